@@ -375,7 +375,9 @@ extern MDBM* mdbm_dup_handle(MDBM* db, int flags);
 
 /**
  * msync's all pages to disk asynchronously.  The mdbm_sync call will return, and
- * mapped pages are scheduled to be flushed to disk.
+ * mapped pages are scheduled to be flushed to disk.  If dirty page tracking is
+ * enabled (see \ref mdbm_set_dirty_tracking), only the pages modified since the
+ * last sync are scheduled, as with \ref mdbm_sync_dirty.
  *
  * \param[in,out] db Database handle
  * \return Sync status
@@ -387,7 +389,9 @@ extern int mdbm_sync(MDBM *db);
 /**
  * fsync's an MDBM.  Syncs all pages to disk synchronously.  The mdbm_fsync call
  * will return after all pages have been flushed to disk.  The database is locked
- * while pages are flushed.
+ * while pages are flushed.  If dirty page tracking is enabled, the pages modified
+ * since the last sync are written back before the database is locked, so that
+ * the fsync done under the lock has little left to write.
  *
  * \param[in,out] db Database handle
  * \return fsync status
@@ -396,6 +400,301 @@ extern int mdbm_sync(MDBM *db);
  */
 extern int mdbm_fsync(MDBM *db);
 
+/**
+ * Enables or disables dirty page tracking.  While enabled, writers record the
+ * pages they modify in a bitmap shared through the file "<db>.dirty", and
+ * \ref mdbm_sync_dirty (also used by \ref mdbm_sync and \ref mdbm_fsync)
+ * writes back only the pages modified since they were last synced, without
+ * locking the db.  This makes frequent syncs of large, mostly idle MDBMs cheap.
+ *
+ * The setting is stored in the MDBM file: handles opened for writing attach to
+ * the bitmap automatically, and older library versions will refuse to open the
+ * MDBM while it is set.  Other handles that were already open when tracking was
+ * enabled don't record their changes until they are reopened.  Enabling
+ * tracking marks the whole db dirty.
+ *
+ * Changes made directly through pointers into the db (values written after an
+ * MDBM_RESERVE store, or in-place updates of fetched values), and the cache
+ * access counters updated by fetches, are not tracked.  The operating system
+ * still writes them back eventually, and \ref mdbm_fsync always syncs the
+ * whole file.
+ *
+ * Dirty page tracking is not supported for memory-only caches or MDBMs on
+ * hugetlbfs.
+ *
+ * \param[in,out] db Database handle
+ * \param[in] enable 1 to enable dirty page tracking, 0 to disable it
+ * \return Set dirty page tracking status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Success
+ */
+extern int mdbm_set_dirty_tracking(MDBM *db, int enable);
+
+#define MDBM_SYNC_DIRTY_WAIT    0x01    /**< Wait for the write-back to complete */
+
+/**
+ * Writes back the pages modified since they were last synced, as recorded by
+ * dirty page tracking (see \ref mdbm_set_dirty_tracking).  Dirty pages are
+ * taken in file order, and runs of adjacent dirty pages are written back as a
+ * single range.  The header and directory pages are always included.  The db is
+ * not locked: pages modified while the sync runs are left for the next one.
+ *
+ * On Linux, write-back is started with sync_file_range(2); with
+ * MDBM_SYNC_DIRTY_WAIT, mdbm_sync_dirty also waits for it to complete.  Neither
+ * flushes file metadata or the drive's write cache (use \ref mdbm_fsync for
+ * that).  On other platforms the file is fsync'ed.
+ *
+ * \param[in,out] db Database handle
+ * \param[in] max_bytes Stop after about this many bytes of dirty pages, 0 for no limit
+ * \param[in] flags 0 or MDBM_SYNC_DIRTY_WAIT
+ * \param[out] synced Number of bytes of dirty pages written back (may be NULL)
+ * \return Sync status
+ * \retval -1 Error, and errno is set (EINVAL if dirty page tracking is not enabled
+ *             for this handle)
+ * \retval  0 Success, all dirty pages were written back
+ * \retval  1 Success, but \a max_bytes was reached before all dirty pages were
+ *             written back
+ */
+extern int mdbm_sync_dirty(MDBM *db, uint64_t max_bytes, int flags, uint64_t *synced);
+
+/**
+ * Starts a background thread that writes back dirty pages (as with
+ * \ref mdbm_sync_dirty) every \a interval_msec milliseconds, writing about
+ * \a max_bytes_per_sec bytes per second at most.  Pages over the limit stay
+ * dirty until a later interval.  The thread uses its own file descriptor and
+ * mapping of the dirty page bitmap, and never locks the db, so the handle
+ * remains usable as before.  A handle can have one flusher, which is stopped by
+ * \ref mdbm_stop_flusher or \ref mdbm_close.
+ *
+ * \param[in,out] db Database handle, with dirty page tracking enabled
+ * \param[in] interval_msec Milliseconds between write-backs (must be non-zero)
+ * \param[in] max_bytes_per_sec Write-back rate limit, 0 for no limit
+ * \return Start flusher status
+ * \retval -1 Error, and errno is set (EBUSY if a flusher is already running)
+ * \retval  0 Success
+ */
+extern int mdbm_start_flusher(MDBM *db, uint32_t interval_msec, uint64_t max_bytes_per_sec);
+
+/**
+ * Stops the background flusher started by \ref mdbm_start_flusher, waiting for
+ * a write-back in progress to finish.  Dirty pages not written back yet are left
+ * for the next sync.
+ *
+ * \param[in,out] db Database handle
+ * \return Stop flusher status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Success (also if no flusher was running)
+ */
+extern int mdbm_stop_flusher(MDBM *db);
+
+/**
+ * Enables or disables the write-ahead journal.  While enabled, every store and
+ * delete also appends a redo record (the operation, key and value) to the file
+ * "<db>.journal", and the call returns once the record is on disk.  Concurrent
+ * writers, in this and other processes, share a single fdatasync(2) of the
+ * journal (group commit), so each update is durable without syncing the db
+ * pages it touched.  Changes made while the caller holds a lock (see
+ * \ref mdbm_lock) are committed when the last lock is released.
+ *
+ * A checkpoint fsync's the db and empties the journal.  Checkpoints are done
+ * automatically when the journal grows past a size limit (64MB by default, see
+ * \ref mdbm_set_journal_options), when the last handle attached to the journal
+ * is closed, and by \ref mdbm_journal_checkpoint.  The db is locked during a
+ * checkpoint.
+ *
+ * The setting is stored in the MDBM file: handles opened for writing attach to
+ * the journal automatically, and older library versions will refuse to open the
+ * MDBM while it is set.  The first handle to attach after a crash replays the
+ * complete records left in the journal (stopping at a torn or corrupt record),
+ * then checkpoints; its mdbm_open fails if the replay does.  Other handles that
+ * were already open when the journal was enabled don't journal their changes
+ * until they are reopened, and read-only handles never replay.
+ *
+ * Records are replayed as MDBM_REPLACE stores (MDBM_INSERT_DUP for duplicate
+ * inserts), deletes and purges, so:
+ *  - a duplicate insert may be applied twice, and a delete through an iterator
+ *    (\ref mdbm_delete_r) deletes the first record with that key.
+ *  - an MDBM_RESERVE store logs the value as it is when the store returns.
+ *  - changes made directly through pointers into the db, and cache evictions,
+ *    are not journaled.
+ * Records only redo changes made in place on existing pages.  A store or delete
+ * that changes the structure of the db (a page split or merge, a large object
+ * chunk allocated or freed, directory or file growth) is committed by a
+ * checkpoint instead, so the db itself is on disk before the call returns (or,
+ * under a lock, by the next commit of any handle).  With MDBM_JOURNAL_NOSYNC, that
+ * checkpoint is done by \ref mdbm_journal_sync.  If the MDBM's pages are larger
+ * than the system page, which the kernel may write back in part, every commit
+ * checkpoints.  Replay rebuilds the lookup filters (see
+ * \ref mdbm_set_lookup_filter) before it applies the records.
+ * \ref mdbm_restore and \ref mdbm_bulk_finish journal each record they load,
+ * and are checkpointed if they grow or split the db.
+ *
+ * So a crash after a call returns loses none of its changes, but an OS crash
+ * in the middle of a structural change can still leave the db file damaged in
+ * a way that replay can't fix (use \ref mdbm_check to find out).  The journal
+ * does not repair a db file that was corrupted by other means.
+ *
+ * If a journal record can't be written, the commit checkpoints instead.  If
+ * that, or the journal sync, fails, the change is still applied, but the store
+ * or delete fails with errno set.  The journal is not supported for memory-only
+ * caches, MDBMs on hugetlbfs, or MDBMs with a backing store.
+ *
+ * \param[in,out] db Database handle
+ * \param[in] enable 1 to enable the journal, 0 to disable it (after a checkpoint)
+ * \return Set journal status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Success
+ */
+extern int mdbm_set_journal(MDBM *db, int enable);
+
+#define MDBM_JOURNAL_NOSYNC     0x01    /**< Don't wait for journal records to reach disk */
+
+/**
+ * Sets journal options for this handle (and handles dup'ed from it later).
+ * With MDBM_JOURNAL_NOSYNC, stores and deletes return as soon as their record
+ * is written to the journal, and it is synced by \ref mdbm_journal_sync, by a
+ * checkpoint, or by the commits of other handles.  This survives a crash of
+ * the process, but not of the system.
+ *
+ * \param[in,out] db Database handle, with the journal enabled
+ * \param[in] flags 0 or MDBM_JOURNAL_NOSYNC
+ * \param[in] checkpoint_bytes Checkpoint when the journal reaches about this
+ *            size, 0 to only checkpoint explicitly
+ * \return Set journal options status
+ * \retval -1 Error, and errno is set (EINVAL if the journal is not enabled)
+ * \retval  0 Success
+ */
+extern int mdbm_set_journal_options(MDBM *db, int flags, uint64_t checkpoint_bytes);
+
+/**
+ * Waits until every record written to the journal so far is on disk.
+ *
+ * \param[in,out] db Database handle, with the journal enabled
+ * \return Journal sync status
+ * \retval -1 Error, and errno is set (EINVAL if the journal is not enabled)
+ * \retval  0 Success
+ */
+extern int mdbm_journal_sync(MDBM *db);
+
+/**
+ * Checkpoints the journal: fsync's the db, then empties the journal.
+ *
+ * \param[in,out] db Database handle, with the journal enabled
+ * \return Checkpoint status
+ * \retval -1 Error, and errno is set (EINVAL if the journal is not enabled)
+ * \retval  0 Success
+ */
+extern int mdbm_journal_checkpoint(MDBM *db);
+
+#define MDBM_CHANGE_STORE       1       /**< Record stored (inserted or replaced) */
+#define MDBM_CHANGE_INSERT_DUP  2       /**< Duplicate record inserted */
+#define MDBM_CHANGE_DELETE      3       /**< Record deleted (the first one with the key) */
+#define MDBM_CHANGE_PURGE       4       /**< All records deleted */
+
+#define MDBM_CHANGE_NOVAL       0x01    /**< Value too large for the ring, fetch it from the db */
+
+/**
+ * A change read from the change ring by \ref mdbm_change_ring_next.  Key and
+ * value point into a buffer owned by the ring, which is reused by the next call.
+ */
+typedef struct mdbm_change {
+    uint64_t    seq;            /**< Sequence number */
+    int         op;             /**< MDBM_CHANGE_* operation */
+    int         flags;          /**< MDBM_CHANGE_NOVAL */
+    datum       key;            /**< Key (empty for MDBM_CHANGE_PURGE) */
+    datum       val;            /**< Value (MDBM_CHANGE_STORE and MDBM_CHANGE_INSERT_DUP) */
+} mdbm_change_t;
+
+typedef struct mdbm_change_ring mdbm_change_ring_t;
+
+/**
+ * Enables or disables the change ring, a log of recent changes that other
+ * processes can tail to replicate the MDBM incrementally (see
+ * \ref mdbm_change_ring_open and the mdbm_changes utility).  While enabled,
+ * every store and delete also appends a record (the operation, key and value,
+ * and a sequence number) to the file "<db>.changes".  The ring has a fixed
+ * size: the oldest records are overwritten, and a consumer that falls too far
+ * behind must resync from a copy of the db.  Values larger than a quarter of
+ * the ring are not copied; their records are flagged MDBM_CHANGE_NOVAL, and the
+ * consumer fetches the current value from the db instead.
+ *
+ * The setting is stored in the MDBM file, and every handle opened for writing
+ * appends to the ring while it is set.  Records of a key are in the order its
+ * changes were applied.  Like the journal (see \ref mdbm_set_journal), changes
+ * made directly through pointers into the db, and cache evictions, are not
+ * recorded.  \ref mdbm_restore and \ref mdbm_bulk_finish record a purge, then
+ * each record they load as a duplicate insert.  The ring starts a new epoch whenever consumers can
+ * no longer rely on it: when it is re-enabled, and when the db is truncated
+ * or replaced.  The change ring is not supported for memory-only caches,
+ * MDBMs on hugetlbfs, or MDBMs with a backing store.
+ *
+ * \param[in,out] db Database handle
+ * \param[in] size Size of the ring in bytes (at least 1MB, at most 1GB), or 0
+ *            to disable it.  The size of an existing ring can only be changed
+ *            while no other handle is using it.
+ * \return Set change ring status
+ * \retval -1 Error, and errno is set (EBUSY if the ring is in use with another size)
+ * \retval  0 Success
+ */
+extern int mdbm_set_change_ring(MDBM *db, uint64_t size);
+
+/**
+ * Opens the change ring of an MDBM for reading, positioned after the newest
+ * change.  The MDBM doesn't need to be open.
+ *
+ * \param[in] dbfilename Name of the MDBM file
+ * \return Change ring handle
+ * \retval NULL Error, and errno is set (ENOENT if the ring doesn't exist)
+ */
+extern mdbm_change_ring_t* mdbm_change_ring_open(const char *dbfilename);
+
+/**
+ * Closes a change ring handle.
+ *
+ * \param[in,out] ring Change ring handle
+ */
+extern void mdbm_change_ring_close(mdbm_change_ring_t *ring);
+
+/**
+ * Returns the position of a change ring handle: the epoch of the ring, and the
+ * sequence number of the next change to be read.  Consumers save it with the
+ * state of their replica, to resume with \ref mdbm_change_ring_seek.
+ *
+ * \param[in] ring Change ring handle
+ * \param[out] epoch Epoch of the ring
+ * \param[out] seq Sequence number of the next change
+ */
+extern void mdbm_change_ring_position(const mdbm_change_ring_t *ring,
+                                      uint64_t *epoch, uint64_t *seq);
+
+/**
+ * Positions a change ring handle at the change with sequence number \a seq.
+ *
+ * \param[in,out] ring Change ring handle
+ * \param[in] epoch Epoch of the ring, as returned by \ref mdbm_change_ring_position
+ * \param[in] seq Sequence number of the next change to read
+ * \return Seek status
+ * \retval -1 Error, and errno is set: ESTALE if the ring started a new epoch or
+ *            no longer holds the change (the consumer must resync), EINVAL if
+ *            the change hasn't happened yet
+ * \retval  0 Success
+ */
+extern int mdbm_change_ring_seek(mdbm_change_ring_t *ring, uint64_t epoch, uint64_t seq);
+
+/**
+ * Reads the next change from a change ring.  The change stays valid until the
+ * next call on \a ring.
+ *
+ * \param[in,out] ring Change ring handle
+ * \param[out] change The change
+ * \return Read status
+ * \retval -1 Error, and errno is set: ESTALE if the change was overwritten or
+ *            the ring started a new epoch (the consumer must resync)
+ * \retval  0 No new change
+ * \retval  1 Success
+ */
+extern int mdbm_change_ring_next(mdbm_change_ring_t *ring, mdbm_change_t *change);
+
 /**
  * Atomically replaces the database currently in oldfile \a db with the new
  * database in \a newfile.  The old database is locked while the new database
@@ -497,10 +796,14 @@ extern int mdbm_fcopy(MDBM* db, int fd, int flags);
 #define MDBM_SAVE_COMPRESS_TREE 0x01000000      /* compress mdbm before saving */
 
 /**
- * DEPRECATED!!  mdbm_save is only supported for V2 MDBMs.
  * Saves the current contents of the database in a transportable format (i.e.,
- * without all of the holes normally found in an MDBM database).  Include
- * MDBM_O_CREAT in flags to create a new save file, MDBM_O_TRUNC to truncate
+ * without all of the holes normally found in an MDBM database).  Only live
+ * records are written, in blocks that are optionally compressed with a
+ * built-in LZ77 codec and checksummed (CRC-32C).  The db is locked for the
+ * duration of the save, so the snapshot is consistent; on larger dbs several
+ * threads, each iterating a disjoint range of pages, write the blocks.
+ * The format uses native byte order.  Include MDBM_O_CREAT in flags to create
+ * a new save file (the save fails if the file exists), MDBM_O_TRUNC to truncate
  * an existing file.  Include both to either create a new file or truncate an
  * existing one, as required.
  *
@@ -511,7 +814,8 @@ extern int mdbm_fcopy(MDBM* db, int fd, int flags);
  *                a database internally before saving to file)
  * \param[in]     mode Set as file mode permissions (ex: 0644); If 0 then ignored
  * \param[in]     compressionLevel If <= 0, then file is saved without compressing.
- *                If > zero, zlib compression at the specified level is applied
+ *                If > zero, blocks are compressed; levels 1 (fastest) to 9 trade
+ *                speed for size on hard-to-compress data.
  * \return Save status
  * \retval  0 Success
  * \retval -1 Error, and errno is set
@@ -519,10 +823,17 @@ extern int mdbm_fcopy(MDBM* db, int fd, int flags);
 extern int mdbm_save(MDBM *db, const char *file, int flags, int mode, int compressionLevel);
 
 /**
- * DEPRECATED!!  mdbm_restore is only supported for V2 MDBMs.
  * Restores a database from the specified file (which was created using the
- * \ref mdbm_save function).  Any existing contents in the database are truncated
- * before restoring.
+ * \ref mdbm_save function).  Any existing contents in the database are purged
+ * before restoring (see \ref mdbm_purge), and the database keeps its own
+ * configuration (page size, hash function, large object settings), so a
+ * save file can be restored into a differently configured database.
+ * An empty, unsplit database is pre-split to about the size the records need,
+ * and records are then appended directly to their pages, which is much
+ * faster than storing them one at a time.  The database is locked for the
+ * duration of the restore.  Files from an unfinished or failed save, and
+ * blocks that fail their checksum, are rejected with EINVAL (records loaded
+ * before a bad block is found are kept).
  *
  * \param[in,out] db Database handle
  * \param[in]     file File to restore from
@@ -532,6 +843,71 @@ extern int mdbm_save(MDBM *db, const char *file, int flags, int mode, int compre
  */
 extern int mdbm_restore(MDBM *db, const char *file);
 
+/**
+ * Handle for building a database in bulk (see \ref mdbm_bulk_open).
+ */
+typedef struct mdbm_bulk mdbm_bulk_t;
+
+/**
+ * Starts building an empty database in bulk, which is much faster than
+ * storing the records one at a time.  Records are added with
+ * \ref mdbm_bulk_add, which only hashes and buffers them, and the database is
+ * written by \ref mdbm_bulk_finish: it is pre-split for the total size of the
+ * records, which are then sorted by page, and each page is split as needed
+ * before it is filled, so pages are written once, fully packed.  Once the
+ * buffer reaches \a mem_limit, records spill to temporary files in
+ * \a tmpdir, partitioned by hash, and are loaded one partition at a time.
+ *
+ * The database configuration (page size, hash function, large object
+ * settings, size limit) must be set before the build starts.
+ *
+ * \param[in,out] db Database handle, of an empty database
+ * \param[in]     store_flag What to do with records that have the same key:
+ *                MDBM_INSERT keeps the first one, MDBM_REPLACE keeps the last
+ *                one, and MDBM_INSERT_DUP keeps all of them
+ * \param[in]     mem_limit Bytes of records to buffer in memory (0 for 256MB)
+ * \param[in]     tmpdir Directory for temporary files (NULL for $TMPDIR, or
+ *                /tmp)
+ * \return Bulk build handle, or NULL on error (errno is set: EINVAL if
+ *         the database is not empty)
+ */
+extern mdbm_bulk_t* mdbm_bulk_open(MDBM *db, int store_flag, uint64_t mem_limit,
+                                   const char *tmpdir);
+
+/**
+ * Adds a record to a bulk build.  The record is copied, and is not in the
+ * database until \ref mdbm_bulk_finish is called.
+ *
+ * \param[in,out] bulk Bulk build handle
+ * \param[in]     key Stored key
+ * \param[in]     val Key's value
+ * \return Add status
+ * \retval -1 Error, and errno is set (EINVAL if the record is too large for
+ *            the database)
+ * \retval  0 Success
+ */
+extern int mdbm_bulk_add(mdbm_bulk_t *bulk, datum key, datum val);
+
+/**
+ * Writes the records of a bulk build to the database, and frees the bulk
+ * build handle.  The database is locked for the duration.  With the journal
+ * or the change ring enabled, every record is logged as well (see
+ * \ref mdbm_set_journal and \ref mdbm_set_change_ring).
+ *
+ * \param[in,out] bulk Bulk build handle
+ * \return Finish status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Success
+ */
+extern int mdbm_bulk_finish(mdbm_bulk_t *bulk);
+
+/**
+ * Frees a bulk build handle without writing its records to the database.
+ *
+ * \param[in,out] bulk Bulk build handle
+ */
+extern void mdbm_bulk_abort(mdbm_bulk_t *bulk);
+
 /** \} FileManagementGroup */
 
 
@@ -570,6 +946,8 @@ extern void mdbm_stat_header(MDBM *db);
  * \retval MDBM_HASH_SHA_1   - SHA_1
  * \retval MDBM_HASH_JENKINS - Jenkins string
  * \retval MDBM_HASH_HSIEH   - Hsieh SuperFast
+ * \retval MDBM_HASH_XXH64   - xxHash64
+ * \retval MDBM_HASH_CRC32C  - CRC-32C (Castagnoli)
  */
 extern int mdbm_get_hash(MDBM *db);
 
@@ -601,6 +979,8 @@ extern int mdbm_get_hash(MDBM *db);
  *  - MDBM_HASH_SHA_1   - SHA_1
  *  - MDBM_HASH_JENKINS - Jenkins string
  *  - MDBM_HASH_HSIEH   - Hsieh SuperFast
+ *  - MDBM_HASH_XXH64   - xxHash64
+ *  - MDBM_HASH_CRC32C  - CRC-32C (Castagnoli)
  */
 extern int mdbm_set_hash(MDBM *db, int hashid);
 
@@ -676,6 +1056,107 @@ extern int mdbm_get_alignment(MDBM *db);
  */
 extern int mdbm_set_alignment(MDBM *db, int align);
 
+/**
+ * Sets the number of slots in the in-page hash index.  When set, each data
+ * page reserves a table of 16-bit slots at its end, indexing the page's
+ * entries by key hash.  Fetches, deletes and MDBM_INSERT duplicate checks
+ * then probe a few slots instead of scanning every entry on the page, which
+ * matters for large pages (64KB and up) holding thousands of entries.
+ *
+ * The index costs 2 bytes per slot per page.  A page can index up to 3/4 of
+ * its slots in entries; a page with more entries (e.g. an oversized page)
+ * falls back to scanning its entries.  About 1 slot per 16 bytes of page
+ * size suits small records.
+ *
+ * NOTE: like \ref mdbm_set_alignment, this must be done at MDBM-creation
+ * time, or when there is no data in an MDBM.  The in-page index is not
+ * supported in windowed mode.
+ *
+ * \param[in,out] db Database handle
+ * \param[in] slots Number of index slots per page, rounded up to a power of 2
+ *            between 16 and 32768, with the index taking at most 1/4 of a page.
+ *            0 removes the index.
+ * \return Set page index status
+ * \retval -1 Error, and errno is set
+ * \retval 0 Success
+ */
+extern int mdbm_set_page_index(MDBM *db, int slots);
+
+/**
+ * Sets whether the full 32-bit hash of each key is stored with the entry.
+ * By default only the upper 16 bits are kept, so page splits have to rehash
+ * every key they move, which can be slow with cryptographic hashes and long
+ * keys.  Storing the full hash costs 2 bytes (plus alignment) per entry, and
+ * lets page splits, merges and \ref mdbm_check level 4 work without calling
+ * the hash function.
+ *
+ * NOTE: like \ref mdbm_set_alignment, this must be done at MDBM-creation
+ * time, or when there is no data in an MDBM.
+ *
+ * \param[in,out] db Database handle
+ * \param[in] enable 1 to store full hashes, 0 for the default
+ * \return Set full hash status
+ * \retval -1 Error, and errno is set
+ * \retval 0 Success
+ */
+extern int mdbm_set_full_hash(MDBM *db, int enable);
+
+/**
+ * Enables or disables optimistic (lock-free) reads for \ref mdbm_fetch_buf.
+ * When enabled, every writer keeps a sequence counter in the MDBM header
+ * up to date around its locked sections (one counter for db-wide locks, and
+ * a few shared by the partitions in partitioned locking mode).
+ * \ref mdbm_fetch_buf then looks the key up without locking, copies the
+ * value into its buffer, and checks the counters afterwards; if a writer was
+ * active meanwhile it retries, and after a few tries takes the lock as usual.
+ * Page splits and other directory changes are detected through the
+ * directory generation.  This mostly helps read-heavy workloads with many
+ * concurrent readers, where readers otherwise contend on the same locks.
+ *
+ * The setting is stored in the MDBM file, so it applies to all processes,
+ * and older library versions will refuse to open the MDBM while it is set.
+ * While enabled, the MDBM file is never shrunk (e.g. by
+ * \ref mdbm_compress_tree); freed space at the end is released by punching
+ * a hole in the file instead.
+ *
+ * Lookups that can't be done lock-free (large objects, cache mode, windowed
+ * mode, backing stores, handles from \ref mdbm_dup_handle, and handles with
+ * stats callbacks) always take the lock.  Writers must not use MDBM_OPEN_NOLOCK
+ * or MDBM_PROTECT handles while optimistic reads are enabled.
+ *
+ * \param[in,out] db Database handle
+ * \param[in] enable 1 to enable optimistic reads, 0 to disable them
+ * \return Set optimistic reads status
+ * \retval -1 Error, and errno is set
+ * \retval 0 Success
+ */
+extern int mdbm_set_optimistic_reads(MDBM *db, int enable);
+
+/**
+ * Enables or disables the per-page lookup filter.  When enabled, each page
+ * gets a small (one cache line) bloom filter of the keys stored on it, kept
+ * in the directory area of the MDBM.  Lookups of keys that are not in the
+ * MDBM are usually rejected by the filter without scanning the page's entry
+ * table.  The filter is maintained by store, delete, page split and merge,
+ * and persists in the MDBM file until disabled or \ref mdbm_truncate is
+ * called.
+ *
+ * Enabling the filter on an MDBM with existing data builds the filters for
+ * all pages, which requires a full-db lock, and may grow the directory.
+ * The filter rejection and false positive rates are reported by
+ * \ref mdbm_get_stats.
+ *
+ * NOTE: In windowed mode, the filter should be enabled before other
+ * windowed handles are opened on the same MDBM.
+ *
+ * \param[in,out] db Database handle
+ * \param[in] enable 1 to enable the filter, 0 to disable it
+ * \return Set lookup filter status
+ * \retval -1 Error, and errno is set
+ * \retval 0 Success
+ */
+extern int mdbm_set_lookup_filter(MDBM *db, int enable);
+
 /**
  * Gets the MDBM's size limit.  Returns the limit set for the size of the db
  * using the \ref mdbm_limit_size_v3 routine.
@@ -940,6 +1421,9 @@ extern int mdbm_fetch_r(MDBM *db, datum *key, datum *val, MDBM_ITER *iter);
  * buf.dptr must point to memory that has been previously malloc'd on the
  * heap.  buff.dptr will be realloc'd if is too small.
  *
+ * If \ref mdbm_set_optimistic_reads is enabled, the copy is normally made
+ * without locking.
+ *
  * \param[in,out] db Database handle
  * \param[in]     key Lookup key
  * \param[out]    val Lookup value (pointer)
@@ -984,6 +1468,36 @@ extern int mdbm_fetch_dup_r(MDBM *db, datum *key, datum *val, MDBM_ITER *iter);
  */
 extern char* mdbm_fetch_str(MDBM *db, const char *key);
 
+/**
+ * Fetches a batch of records.  All keys are hashed up front, grouped by page
+ * (and by lock partition for partitioned-lock databases, so that each
+ * partition lock is taken once per batch), and the pages and entry tables
+ * are prefetched before probing, which hides much of the memory latency of
+ * the individual lookups.
+ *
+ * For each key, the value location and size are stored in vals[i] and the
+ * per-key result is stored in status[i]: 0 if the key was found, or an errno
+ * value (ENOENT if the key does not exist).  Missing keys get a null datum.
+ *
+ * If \a bufs is non-NULL, each value is also copied into bufs[i], with the same
+ * rules as \ref mdbm_fetch_buf: bufs[i].dptr must point to memory that has
+ * been previously malloc'd on the heap, and will be realloc'd if too small.
+ * Without \a bufs, the returned values are only valid while the caller holds
+ * a lock that covers them.
+ *
+ * \param[in,out] db Database handle
+ * \param[in]     keys Array of \a count lookup keys
+ * \param[out]    vals Array of \a count lookup values (pointers)
+ * \param[in,out] bufs Array of \a count copy-out buffers, or NULL
+ * \param[out]    status Array of \a count per-key results
+ * \param[in]     count Number of keys
+ * \param[in]     flags Reserved for future use (must be 0)
+ * \return Number of keys found, or -1 on error
+ * \retval -1 Error, and errno is set
+ */
+extern int mdbm_fetch_multi(MDBM *db, datum *keys, datum *vals, datum *bufs, int *status,
+                            int count, int flags);
+
  /*
  * MDBM fetch interface
  */
@@ -1194,6 +1708,32 @@ extern int mdbm_store_r(MDBM *db, datum* key, datum* val, int flags, MDBM_ITER*
  */
 extern int mdbm_store_str(MDBM *db, const char *key, const char *val, int flags);
 
+/**
+ * Stores a batch of records.  All keys are hashed up front and the batch is
+ * sorted by page (and by lock partition for partitioned-lock databases), so
+ * the write lock (or each partition lock) is taken once per batch, and
+ * consecutive stores land on the same page.  Records with the same key are
+ * stored in the order they appear in the batch, including records that are
+ * retried after a page split.
+ *
+ * The per-record result is stored in status[i]: 0 if the record was stored,
+ * EEXIST if \a MDBM_INSERT found an existing key, or an errno value.
+ * The keys and vals arrays are not modified.
+ *
+ * \param[in,out] db Database handle
+ * \param[in]     keys Array of \a count keys
+ * \param[in]     vals Array of \a count values
+ * \param[in]     store_flags Array of \a count per-record store flags
+ *                (see \ref mdbm_store), or NULL to use \a flags for every record
+ * \param[out]    status Array of \a count per-record results
+ * \param[in]     count Number of records
+ * \param[in]     flags Store flags used when \a store_flags is NULL
+ * \return Number of records stored, or -1 on error
+ * \retval -1 Error, and errno is set
+ */
+extern int mdbm_store_multi(MDBM *db, datum *keys, datum *vals, const int *store_flags,
+                            int *status, int count, int flags);
+
 /** \} RecordAccessGroup */
 
 /**
@@ -1363,6 +1903,161 @@ typedef int (*mdbm_iterate_func_t)(void* user, const mdbm_iterate_info_t* info,
  */
 extern int mdbm_iterate(MDBM* db, int pagenum, mdbm_iterate_func_t func, int flags, void* user);
 
+/**
+ * Iterates through all keys in the database, like \ref mdbm_iterate with a
+ * negative \a pagenum, using \a nthreads worker threads.  Logical pages are
+ * handed out to the workers in small batches, so the order in which pages
+ * are visited is unspecified.  Each worker uses its own handle (see
+ * \ref mdbm_dup_handle), and holds only the lock for the page it is
+ * iterating: the page's partition lock with MDBM_PARTITIONED_LOCKS, a shared
+ * lock with MDBM_RW_LOCKS, or the db lock (so workers take turns) otherwise.
+ *
+ * The iteration is therefore consistent per page, not for the whole db: other
+ * handles may modify the db between the pages, and a record moved by a
+ * concurrent page split may be visited twice or missed.  For a consistent
+ * view of the whole db, use \ref mdbm_iterate, which holds the db lock for
+ * the whole iteration, or stop writers while iterating.
+ *
+ * \a func is called concurrently from several threads, and must be
+ * thread-safe.  As with \ref mdbm_iterate, the page and record data passed
+ * to \a func are only valid during the call.  If \a func returns non-zero,
+ * all workers stop after their current page or record.
+ *
+ * \a db must not be locked by the caller.
+ *
+ * \param[in,out] db Database handle
+ * \param[in]     nthreads Number of worker threads (0 for one per CPU)
+ * \param[in]     func Function to invoke for each page or key
+ * \param[in]     flags iteration control (same as \ref mdbm_iterate)
+ * \param[in]     user User-supplied opaque pointer to pass to \a func
+ * \return Iteration status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Success
+ * \retval  1 \a func returned non-zero and iteration stopped early
+ */
+extern int mdbm_iterate_parallel(MDBM* db, int nthreads, mdbm_iterate_func_t func,
+                                 int flags, void* user);
+
+#define MDBM_MERKLE_MAX_LEVELS  24      /**< Most levels (below the root) of a Merkle tree */
+
+typedef struct mdbm_merkle mdbm_merkle_t;
+
+/**
+ * Computes a Merkle tree of the contents of an MDBM, to compare replicas
+ * without comparing every record.  Records are assigned to 2^\a levels leaves
+ * by the low bits of the hash of their key, which are also the low bits of
+ * their logical page number: a leaf covers one logical page, or a subset of
+ * one.  The digest of a leaf does not depend on the order of its records, or
+ * on how they are laid out in pages, and each node above the leaves is the
+ * digest of its two children.  Digests are 64-bit (xxHash64), so they detect
+ * accidental differences, not deliberate collisions.
+ *
+ * Two MDBMs (or an MDBM and a tree saved by \ref mdbm_merkle_save) can be
+ * compared by exchanging tree levels from the root down (see
+ * \ref mdbm_merkle_level), and descending only into the nodes that differ.
+ * \ref mdbm_merkle_diff does that for two trees in memory, and
+ * \ref mdbm_merkle_iterate_leaf visits the records of a leaf that differs.
+ * Trees are only comparable if both MDBMs use the same hash function.
+ *
+ * Records are hashed by \a nthreads threads, as with \ref mdbm_iterate_parallel,
+ * so the tree is consistent only if the MDBM is not being modified.
+ *
+ * \param[in,out] db Database handle (must not be locked by the caller)
+ * \param[in] levels Depth of the tree, from 0 to MDBM_MERKLE_MAX_LEVELS
+ * \param[in] nthreads Number of threads (0 for one per CPU)
+ * \return Merkle tree, to be freed with \ref mdbm_merkle_free
+ * \retval NULL Error, and errno is set
+ */
+extern mdbm_merkle_t* mdbm_merkle_build(MDBM* db, int levels, int nthreads);
+
+/**
+ * Frees a Merkle tree.
+ *
+ * \param[in,out] tree Merkle tree
+ */
+extern void mdbm_merkle_free(mdbm_merkle_t* tree);
+
+/**
+ * Returns the number of levels below the root of a Merkle tree.
+ *
+ * \param[in] tree Merkle tree
+ * \return Number of levels (leaves are at that level)
+ */
+extern int mdbm_merkle_levels(const mdbm_merkle_t* tree);
+
+/**
+ * Returns the root digest of a Merkle tree, a digest of the whole MDBM.
+ *
+ * \param[in] tree Merkle tree
+ * \return Root digest
+ */
+extern uint64_t mdbm_merkle_root(const mdbm_merkle_t* tree);
+
+/**
+ * Returns the digests of the nodes at a level of a Merkle tree.  The children
+ * of node i are nodes 2*i and 2*i+1 of the next level.
+ *
+ * \param[in] tree Merkle tree
+ * \param[in] level Level, from 0 (the root) to \ref mdbm_merkle_levels (the leaves)
+ * \return Array of 2^\a level digests, owned by the tree
+ * \retval NULL \a level is out of range
+ */
+extern const uint64_t* mdbm_merkle_level(const mdbm_merkle_t* tree, int level);
+
+/**
+ * Saves a Merkle tree to a file.
+ *
+ * \param[in] tree Merkle tree
+ * \param[in] filename File to create or overwrite
+ * \return Save status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Success
+ */
+extern int mdbm_merkle_save(const mdbm_merkle_t* tree, const char* filename);
+
+/**
+ * Loads a Merkle tree saved by \ref mdbm_merkle_save.
+ *
+ * \param[in] filename File to read
+ * \return Merkle tree, to be freed with \ref mdbm_merkle_free
+ * \retval NULL Error, and errno is set (EINVAL if the file is not a Merkle tree)
+ */
+extern mdbm_merkle_t* mdbm_merkle_load(const char* filename);
+
+/**
+ * Compares two Merkle trees, descending only into the nodes that differ, and
+ * returns the leaves that differ.
+ *
+ * \param[in] a First Merkle tree
+ * \param[in] b Second Merkle tree
+ * \param[out] leaves Indexes of the leaves that differ (may be NULL if \a maxleaves is 0)
+ * \param[in] maxleaves Size of \a leaves
+ * \return Number of leaves that differ (which may be more than \a maxleaves)
+ * \retval -1 Error, and errno is set (EINVAL if the trees aren't comparable:
+ *            different depths or hash functions)
+ */
+extern int mdbm_merkle_diff(const mdbm_merkle_t* a, const mdbm_merkle_t* b,
+                            uint32_t* leaves, int maxleaves);
+
+/**
+ * Invokes \a func for each record that belongs to a leaf of a Merkle tree
+ * with \a levels levels, visiting only the logical pages that can hold them.
+ * Locking is as for \ref mdbm_iterate, one page at a time.
+ *
+ * \param[in,out] db Database handle
+ * \param[in] levels Depth of the tree
+ * \param[in] leaf Index of the leaf
+ * \param[in] func Function to invoke for each record
+ * \param[in] flags 0 or MDBM_ITERATE_NOLOCK
+ * \param[in] user User-supplied opaque pointer to pass to \a func
+ * \return Iteration status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Success
+ * \retval  1 \a func returned non-zero and iteration stopped early
+ */
+extern int mdbm_merkle_iterate_leaf(MDBM* db, int levels, uint32_t leaf,
+                                    mdbm_iterate_func_t func, int flags, void* user);
+
 /** \} RecordIterationGroup */
 
 
@@ -1593,6 +2288,41 @@ extern int mdbm_unlock_smart(MDBM *db, const datum *key, int flags);
  */
 extern int mdbm_lock_reset(const char* dbfilename, int flags);
 
+/**
+ * Lock contention counters of an MDBM, see \ref mdbm_get_lock_stats.
+ */
+typedef struct mdbm_lock_stats {
+    uint64_t ls_acquires;      /**< Locks taken (not counting nested locks) */
+    uint64_t ls_contended;     /**< Blocking lock requests that found the lock held */
+    uint64_t ls_spin_acquires; /**< Contended requests that got the lock while spinning */
+    uint64_t ls_sleeps;        /**< Contended requests that had to wait in the kernel */
+    uint64_t ls_try_failures;  /**< Non-blocking lock requests that failed */
+    uint64_t ls_owner_died;    /**< Locks recovered from an owner that died holding them */
+    uint64_t ls_hold_nsec;     /**< Average time a lock is held, in nanoseconds (sampled) */
+} mdbm_lock_stats_t;
+
+/**
+ * Gets the lock contention counters of a database, summed over all of its
+ * locks (all partitions, for partitioned or shared locking).
+ * The counters are kept in the lock file, so they cover all processes
+ * using the database.  They are cleared by \ref mdbm_lock_reset.
+ *
+ * A contended blocking lock request first spins, for about twice the
+ * average hold time of that lock (bounded, and only on multi-cpu hosts),
+ * and then waits in the kernel.  Many sleeps for few spin acquires indicate
+ * locks that are held for a long time: consider more partitions
+ * (see \ref mdbm_open, MDBM_PARTITIONED_LOCKS).
+ *
+ * \param[in,out] db Database handle
+ * \param[out]    stats Lock counters
+ * \param[in]     stats_size Size of \a stats.  Only as many counters are
+ *                returned as fit in this size.
+ * \return Get lock stats status
+ * \retval -1 Error, and errno is set (EINVAL for MDBM_OPEN_NOLOCK)
+ * \retval  0 Success
+ */
+extern int mdbm_get_lock_stats(MDBM* db, mdbm_lock_stats_t* stats, size_t stats_size);
+
 /**
  * Removes all lockfiles associated with an MDBM file.
  * USE THIS FUNCTION WITH EXTREME CAUTION!
@@ -1634,6 +2364,84 @@ extern int mdbm_delete_lockfiles(const char* dbname);
  */
 extern void mdbm_compress_tree(MDBM *db);
 
+#define MDBM_COMPACT_MERGE      0   /**< Merging sibling data pages */
+#define MDBM_COMPACT_DEFRAG     1   /**< Moving chunks down to free the end of the file */
+#define MDBM_COMPACT_DONE       2   /**< Compaction is complete */
+
+/**
+ * Position and progress of an incremental compaction (see \ref mdbm_compact_step).
+ * Zero-fill it before the first step.
+ */
+typedef struct mdbm_compact_cursor {
+    int      phase;         /**< Phase of the next step (MDBM_COMPACT_*) */
+    int      level;         /**< Directory level being merged */
+    uint32_t next;          /**< Next page on \a level to try to merge */
+    uint32_t pages_merged;  /**< Data pages merged into their siblings so far */
+    uint32_t chunks_moved;  /**< Chunks moved down so far */
+    uint32_t pages_moved;   /**< Pages moved down so far */
+    uint64_t usec;          /**< Time spent holding the db lock so far */
+} mdbm_compact_cursor_t;
+
+/**
+ * Performs a bounded slice of the work done by \ref mdbm_compress_tree, so a
+ * live database can be compacted a little at a time (e.g., from a background
+ * thread, or a periodic job).
+ *
+ * Compaction first merges sibling data pages whose entries fit on a single
+ * page, starting at the deepest directory level, and drops directory levels
+ * that become unused.  It then de-fragments the file by moving chunks down, and
+ * releases the free space gathered at the end of the file.  Unlike
+ * \ref mdbm_compress_tree, pages are merged individually, so pages that can't
+ * be merged don't prevent the rest from being merged.
+ *
+ * Each step locks the db (see \ref mdbm_lock) for as long as its budget allows,
+ * doing at least one unit of work, and releases the lock before returning.
+ * Other threads and processes can access the db between steps, and the cursor
+ * stays valid across their changes.
+ *
+ * NOTE: This function does not work with Windowed-Mode.
+ *
+ * \param[in,out] db Database handle
+ * \param[in]     budget_usec Maximum time to hold the lock for (0 for no limit)
+ * \param[in]     budget_pages Maximum number of page pairs examined or pages
+ *                moved (0 for no limit)
+ * \param[in,out] cursor Compaction position and progress
+ * \return Compaction status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Compaction is complete
+ * \retval  1 More compaction remains: call again with the same cursor
+ */
+extern int mdbm_compact_step(MDBM* db, uint64_t budget_usec, uint32_t budget_pages,
+                             mdbm_compact_cursor_t* cursor);
+
+/**
+ * Splits data pages that are nearly full ahead of time, so that stores rarely
+ * have to split a page (and possibly grow the directory and remap the db)
+ * themselves.  Call it periodically, e.g., from a helper thread using its own
+ * handle (see \ref mdbm_dup_handle).
+ *
+ * Examines up to \a budget_pages logical pages, starting at \a *next, and
+ * splits each page whose free space, counting space held by deleted entries,
+ * is below \a min_free_pct percent of the page size.  Oversize pages are not
+ * split.  Splitting stops once the directory or the db reaches its size limit
+ * (see \ref mdbm_limit_dir_size and \ref mdbm_limit_size_v3).
+ *
+ * The db is locked (see \ref mdbm_lock) for the duration of the call, so use
+ * \a budget_pages to bound how long stores wait.
+ *
+ * NOTE: This function does not work with Windowed-Mode.
+ *
+ * \param[in,out] db Database handle
+ * \param[in]     min_free_pct Split pages with less free space than this
+ *                percentage of the page size (1-99)
+ * \param[in]     budget_pages Maximum number of pages to examine (0 for all)
+ * \param[in,out] next Logical page to start at (0 the first time).  Set to the
+ *                page the next call should start at, wrapping back to 0 after
+ *                the last page.
+ * \return Number of pages split, or -1 (and errno is set) on error
+ */
+extern int mdbm_maintain(MDBM* db, int min_free_pct, uint32_t budget_pages, uint32_t* next);
+
 /**
  * Truncates the MDBM to single empty page
  *
@@ -1772,6 +2580,26 @@ extern int mdbm_clean(MDBM* db, int pagenum, int flags);
  */
 extern int mdbm_check(MDBM* db, int level, int verbose);
 
+/**
+ * Checks an MDBM's integrity, like \ref mdbm_check, using \a nthreads threads
+ * for the data page and large object checks (level 3 and above).  These checks
+ * run concurrently without output, and the pages and large objects that failed
+ * are then re-checked in order.  Error messages and counts are the same as for
+ * \ref mdbm_check.  Windowed handles are always checked with a single thread.
+ *
+ * As with \ref mdbm_check, \a db should be locked by the caller, if other
+ * processes may be modifying it.
+ *
+ * \param[in,out] db Database handle
+ * \param[in]     level Depth of checks
+ * \param[in]     verbose Whether to display verbose information while checking
+ * \param[in]     nthreads Number of threads (0 for one per CPU)
+ * \return Check status
+ * \retval -1 Error
+ * \retval  0 Success
+ */
+extern int mdbm_check_parallel(MDBM* db, int level, int verbose, int nthreads);
+
 /**
  * Checks integrity of an entry on a page.
  *
@@ -1909,6 +2737,8 @@ typedef struct mdbm_stats {
     mdbm_ubig_t s_large_min_size;
     mdbm_ubig_t s_large_max_size;
     uint32_t    s_cache_mode;
+    uint64_t    s_filter_rejects;   /**< Lookups rejected by the page lookup filter */
+    uint64_t    s_filter_false_pos; /**< Lookups passed by the filter that found no entry */
 } mdbm_stats_t;
 
 
@@ -1972,7 +2802,8 @@ extern int mdbm_get_stat_counter(MDBM *db, mdbm_stat_type type, mdbm_counter_t *
 extern int mdbm_get_stat_time(MDBM *db, mdbm_stat_type type, time_t *value);
 
 /**
- * Resets the stat counter and last-time performed for fetch, store, and remove operations.
+ * Resets the stat counter and last-time performed for fetch, store, and remove operations,
+ * and the lookup filter counters.
  *
  * \param[in,out] db Database handle
  *
@@ -2172,7 +3003,11 @@ extern void mdbm_stat_all_page(MDBM *db);
  * \param[out]    s Stats block
  * \param[in]     stats_size Stats block \a s size.  Only as many stats will
  *                be returned as according to this size.  The stats block is
- *                filled from top-to-bottom.
+ *                filled from top-to-bottom.  The lookup filter counters
+ *                (\a s_filter_rejects and \a s_filter_false_pos) are only
+ *                filled in when \a stats_size covers them, and are only
+ *                counted when MDBM_STATS_BASIC operations stats are enabled
+ *                (see \ref mdbm_enable_stat_operations).
  * \return Get stats status
  * \retval -1 Error, and errno is set
  * \retval  0 Success
@@ -2515,10 +3350,12 @@ extern int mdbm_set_backingstore(MDBM* cachedb, const mdbm_bsops_t* bsops, void*
  * cdb_dump or db_dump format.
  *
  * Utility functions for converting from MDBM files into a textual representation.
- * These functions generate data in one of 2 formats:
+ * These functions generate data in one of 3 formats:
  *   - The "printable" BerkeleyDB db_{dump,load} format
  *   - The cdb_dump format, which is a little more compact because it uses binary
  *      representation instead of escaped hex sequences: http://cr.yp.to/cdb/cdbmake.html
+ *   - The binary "bindump" format (below), which is not textual at all, but can be
+ *      written and read by several threads at once
  * \{
  */
 
@@ -2643,6 +3480,33 @@ mdbm_dbdump_import_header(FILE *fp, int *pgsize, int *pgcount, int *large, uint3
 extern int
 mdbm_dbdump_import(MDBM *db, FILE *fp, const char *input_file, int store_flag, uint32_t *lineno);
 
+/**
+ * Callback for records read from a DBdump file by \ref mdbm_dbdump_read.
+ *
+ * \param[in] user User-supplied opaque pointer
+ * \param[in] kv   Record, only valid during the call
+ * \return 0 to continue, or non-zero to stop reading
+ */
+typedef int (*mdbm_dbdump_func_t)(void *user, const kvpair *kv);
+
+/**
+ * Import API: Read the records of a DBdump file, after its header, invoking
+ * \a func for each.  \ref mdbm_dbdump_import uses this to store the records.
+ *
+ * \param[in]      fp          file handle/pointer to read from
+ * \param[in]      input_file  name of the file pointed to by "fp".
+ * \param[in,out]  lineno      current line number, as for \ref mdbm_dbdump_import
+ * \param[in]      func        Function to invoke for each record
+ * \param[in]      user        User-supplied opaque pointer to pass to \a func
+ * \return Read status
+ * \retval -2 Bad format (described on stderr)
+ * \retval  0 Success
+ * \retval  other Non-zero value returned by \a func, which stopped reading
+ */
+extern int
+mdbm_dbdump_read(FILE *fp, const char *input_file, uint32_t *lineno,
+                 mdbm_dbdump_func_t func, void *user);
+
 /**
  * Import API: Read data from FILE into MDBM, using Cdb format.
  *   MDBM locking and unlocking is done one record at a time based on locking set up when
@@ -2655,6 +3519,143 @@ mdbm_dbdump_import(MDBM *db, FILE *fp, const char *input_file, int store_flag, u
  */
 extern int mdbm_cdbdump_import(MDBM *db, FILE *fp, const char *input_file, int store_flag);
 
+/*
+ * The bindump format is a header, then blocks of records, then an index of the
+ * blocks.  A record is its key length and value length (32 bits each, in network
+ * byte order) followed by the key and the value.  Each block holds up to
+ * MDBM_BINDUMP_BLOCK_SIZE bytes of records (more for a single larger record), is
+ * checked with a CRC-32C and may be compressed.  Blocks don't depend on each other,
+ * so they are compressed, written, read and decoded in parallel, and can be
+ * split without decoding the records.  The index lets readers of a regular file
+ * hand out blocks to threads; readers of a pipe take them in order.
+ */
+
+#define MDBM_BINDUMP_BLOCK_SIZE (256*1024)  /**< Bytes of records per bindump block */
+
+typedef struct mdbm_bindump_writer mdbm_bindump_writer_t;
+
+/**
+ * Callback for records read from a bindump file by \ref mdbm_bindump_read.
+ *
+ * \param[in] user User-supplied opaque pointer
+ * \param[in] kv   Record, only valid during the call
+ * \return 0 to continue, or non-zero to stop reading
+ */
+typedef int (*mdbm_bindump_func_t)(void *user, const kvpair *kv);
+
+/**
+ * Export API: Write all records of \a db to \a fp in bindump format, including
+ * the header and the block index.  Pages are read by \a nthreads threads, as with
+ * \ref mdbm_iterate_parallel, which also compress and write their own blocks, so
+ * records are written in no particular order.  \a db must not be locked by the
+ * caller.  As with \ref mdbm_iterate_parallel, the export is only a consistent
+ * snapshot if the db is not being modified.  \a fp is not closed.
+ *
+ * \param[in,out] db               Database handle
+ * \param[in,out] fp               FILE pointer (return value of fopen)
+ * \param[in]     compressionLevel 0 for uncompressed blocks, or 1 (fastest) to 9
+ * \param[in]     nthreads         Number of threads (0 for one per CPU)
+ * \return Export status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Success
+ */
+extern int mdbm_bindump_export(MDBM *db, FILE *fp, int compressionLevel, int nthreads);
+
+/**
+ * Export API: Start writing a bindump file from records supplied one at a time by
+ * \ref mdbm_bindump_writer_add.  The header is written right away.
+ *
+ * \param[in,out] fp               FILE pointer (return value of fopen)
+ * \param[in]     pgsize           Page size to record in the header (0 if unknown)
+ * \param[in]     pgcount          Page count to record in the header (0 if unknown)
+ * \param[in]     large            Large-object support to record in the header
+ * \param[in]     hash             Hash function to record in the header (-1 if unknown)
+ * \param[in]     compressionLevel 0 for uncompressed blocks, or 1 (fastest) to 9
+ * \return Writer handle, or NULL on error with errno set
+ */
+extern mdbm_bindump_writer_t *
+mdbm_bindump_writer_open(FILE *fp, int pgsize, int pgcount, int large, int hash,
+                         int compressionLevel);
+
+/**
+ * Export API: Add a record to a bindump file.  A writer is not thread-safe.
+ *
+ * \param[in,out] w  Writer handle
+ * \param[in]     kv Key+Value pair
+ * \return Add record status
+ * \retval -1 Error, and errno is set
+ * \retval  0 Success
+ */
+extern int mdbm_bindump_writer_add(mdbm_bindump_writer_t *w, kvpair kv);
+
+/**
+ * Export API: Finish a bindump file, writing the last block and the block index,
+ * and free the writer.  The FILE is flushed but not closed.
+ *
+ * \param[in,out] w Writer handle
+ * \return Close status
+ * \retval -1 Error, and errno is set (the writer is freed regardless)
+ * \retval  0 Success
+ */
+extern int mdbm_bindump_writer_close(mdbm_bindump_writer_t *w);
+
+/**
+ * Import API: Read the bindump header from FILE.
+ *
+ * \param[in]    fp       file handle/pointer to read from
+ * \param[out]   pgsize   page-size recorded in the header (0 if unknown)
+ * \param[out]   pgcount  page-count recorded in the header (0 if unknown)
+ * \param[out]   large    large-object-support
+ * \param[out]   hash     hash function recorded in the header (-1 if unknown)
+ * \return Read header status
+ * \retval -1 Error, and errno is set (EINVAL if \a fp isn't in bindump format)
+ * \retval  0 Success
+ */
+extern int
+mdbm_bindump_import_header(FILE *fp, int *pgsize, int *pgcount, int *large, int *hash);
+
+/**
+ * Import API: Read the records of a bindump file, after its header, invoking
+ * \a func for each.  Blocks are read and decoded by \a nthreads threads, so
+ * \a func is called concurrently, and must be thread-safe.  If \a fp is a regular
+ * file, threads take blocks from the index, and \a fp is left at the end of the
+ * file.  Otherwise, they take turns reading the next block.
+ *
+ * \param[in]     fp          file handle/pointer to read from
+ * \param[in]     input_file  name of the file pointed to by "fp"
+ * \param[in]     nthreads    Number of threads (0 for one per CPU)
+ * \param[in]     func        Function to invoke for each record
+ * \param[in]     user        User-supplied opaque pointer to pass to \a func
+ * \return Read status
+ * \retval -1 Error, and errno is set (EINVAL if the data is corrupt)
+ * \retval  0 Success
+ * \retval  other Non-zero value returned by \a func, which stopped reading
+ */
+extern int mdbm_bindump_read(FILE *fp, const char *input_file, int nthreads,
+                             mdbm_bindump_func_t func, void *user);
+
+/**
+ * Import API: Read data from FILE into MDBM, using bindump format, after the
+ * header has been read by \ref mdbm_bindump_import_header.  Blocks are decoded and
+ * stored by \a nthreads threads, each with its own handle (see
+ * \ref mdbm_dup_handle), locking one record at a time as
+ * \ref mdbm_dbdump_import does.  Records are therefore stored in no particular
+ * order: use a single thread if the order of records with the same key matters.
+ * A database opened with MDBM_OPEN_NOLOCK is always loaded by one thread.
+ *
+ * \param[in,out]  db          handle of MDBM into which data is being imported
+ * \param[in]      fp          file handle/pointer to read from
+ * \param[in]      input_file  name of the file pointed to by "fp"
+ * \param[in]      store_flag  MDBM_INSERT | MDBM_REPLACE | MDBM_INSERT_DUP | MDBM_MODIFY
+ * \param[in]      nthreads    Number of threads (0 for one per CPU)
+ * \return Import status
+ * \retval -1 Error reading the data, and errno is set
+ * \retval -3 Error storing a record
+ * \retval  0 Success
+ */
+extern int mdbm_bindump_import(MDBM *db, FILE *fp, const char *input_file, int store_flag,
+                               int nthreads);
+
 /** \} ImportExportGroup */
 
 /**
@@ -2697,6 +3698,8 @@ extern int mdbm_get_errno(MDBM *db);
  *   - MDBM_HASH_SHA_1   - SHA_1
  *   - MDBM_HASH_JENKINS - Jenkins string
  *   - MDBM_HASH_HSIEH   - Hsieh SuperFast
+ *   - MDBM_HASH_XXH64   - xxHash64
+ *   - MDBM_HASH_CRC32C  - CRC-32C (Castagnoli)
  */
 extern int mdbm_get_hash_value(datum key, int hashFunctionCode, uint32_t *hashValue);
 
@@ -2832,7 +3835,9 @@ extern mdbm_hash_t mdbm_hash_funcs[];
 #define MDBM_HASH_SHA_1         8       /**< SHA_1 */
 #define MDBM_HASH_JENKINS       9       /**< JENKINS */
 #define MDBM_HASH_HSIEH         10      /**< HSIEH SuperFastHash */
-#define MDBM_MAX_HASH           10      /* bump up if adding more */
+#define MDBM_HASH_XXH64         11      /**< xxHash64 (folded to 32 bits) */
+#define MDBM_HASH_CRC32C        12      /**< CRC-32C (SSE4.2 accelerated) */
+#define MDBM_MAX_HASH           12      /* bump up if adding more */
 
 /** Define the hash function to use on a newly created file */
 #ifndef MDBM_DEFAULT_HASH
@@ -2867,6 +3872,8 @@ extern  mdbm_ubig_t  mdbm_hash3(unsigned char *, int);
 extern  mdbm_ubig_t  mdbm_hash4(unsigned char *, int);
 extern  mdbm_ubig_t  mdbm_hash5(unsigned char *, int);
 extern  mdbm_ubig_t  mdbm_hash6(unsigned char *, int);
+extern  mdbm_ubig_t  mdbm_hash_xxh64(const unsigned char *, int);
+extern  mdbm_ubig_t  mdbm_hash_crc32c(const unsigned char *, int);
 
 
 #ifdef  __cplusplus
@@ -122,6 +122,31 @@ MDBM *mdbm_pool_acquire_excl_handle(mdbm_pool_t *pool);
  */
 int mdbm_pool_release_excl_handle(mdbm_pool_t *pool, MDBM *db);
 
+/**
+ * Counters of a pool, for tuning its size.
+ */
+typedef struct mdbm_pool_stats_s {
+  uint64_t hits;      /**< Acquires served by the handle the thread released last */
+  uint64_t misses;    /**< Acquires that took a handle from the shared pool */
+  uint64_t waits;     /**< Acquires that blocked until a handle was released */
+  uint64_t wait_usec; /**< Total time spent blocked, in microseconds */
+  uint32_t size;      /**< Number of handles in the pool */
+} mdbm_pool_stats_t;
+
+/**
+ * Get the counters of a pool. Each thread keeps the handle it released last,
+ * and gets it back on its next acquire unless another thread took it meanwhile
+ * (a hit). A high miss or wait count means the pool has fewer handles than
+ * there are threads using it.
+ *
+ * \param pool pointer to a pool object that was returned from
+ *  calling mdbm_pool_create_pool function
+ * \param stats pointer to the counters to fill in
+ *
+ * \return 1 if successful or 0 for failure.
+ */
+int mdbm_pool_get_stats(mdbm_pool_t *pool, mdbm_pool_stats_t *stats);
+
 /**
  * \page example_usage "Using Core-Tech MDBM Handle Pool in your application"
  *
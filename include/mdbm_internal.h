@@ -63,6 +63,9 @@ Free-pages (type FREE) contain a "next" pointer (p_next_free), and the first pag
 referenced by h_first_free, forming a singly-linked-list. Newly freed pages should 
 be inserted into the free list sorted by address, and adjacent free pages should be 
 coalesced into a single chunk.
+Handles don't search the list itself: each keeps a private index of it
+(mdbm_free_index_t), which is rebuilt whenever h_free_gen shows that another
+handle has changed the list.
 
 The directory is a linear array of bits, used to convert hash values of keys
 into "logical pages". Logical pages determine an index into the page table,
@@ -139,7 +142,9 @@ typedef struct mdbm_hdr_stats {
     mdbm_counter_t      s_locks_wait_time;
     mdbm_counter_t      s_pages_gc;
 #else
-    mdbm_counter_t      s_reserved[14];
+    mdbm_counter_t      s_filter_rejects;   /* lookups rejected by the page filter */
+    mdbm_counter_t      s_filter_false_pos; /* lookups passed by the filter that missed */
+    mdbm_counter_t      s_reserved[12];
 #endif
 } mdbm_hdr_stats_t;
 
@@ -148,7 +153,7 @@ typedef struct mdbm_hdr {
     uint32_t            h_magic;         /* magic number, determines filetype */
     uint16_t            h_dbflags;       /* options: large-objects, etc. */
     uint8_t             h_cache_mode;    /* cache type */
-    uint8_t             h_pad1;          /* unused padding */
+    uint8_t             h_index_shift;   /* log2(in-page index slots), see MDBM_HFLAG_PAGEINDEX */
     uint8_t             h_dir_shift;     /* log2(logical_pages) */
     uint8_t             h_hash_func;     /* hash function used, determines key->page mapping */
     uint8_t             h_max_dir_shift; /* user-set maximum number of log2(logical_pages) */
@@ -159,7 +164,10 @@ typedef struct mdbm_hdr {
     uint32_t            h_spill_size;    /* threshold for deciding an object is "large" */
     uint32_t            h_last_chunk;    /* last group of pages in the DB */
     uint32_t            h_first_free;    /* First free page number */
-    uint32_t            h_pad4[8];       /* unused padding (future expansion) */
+    uint32_t            h_read_seq[4];   /* optimistic read counters, see MDBM_HFLAG_OPTREAD */
+    uint32_t            h_free_gen;      /* free-list change counter, see mdbm_free_index_t */
+    uint32_t            h_read_seq_stale; /* a dead writer may have left h_read_seq busy */
+    uint32_t            h_pad4[2];       /* unused padding (future expansion) */
     mdbm_hdr_stats_t    h_stats;         /* store/fetch/delete statistics */
 } mdbm_hdr_t;
 #define MDBM_HDR_T_SIZE sizeof(mdbm_hdr_t)
@@ -177,6 +185,32 @@ CCASSERT(sizeof(mdbm_hdr_t)==232, MDBM3_HEADER_SIZE_CHANGE__THIS_BREAKS_FILE_COM
 #define MDBM_HFLAG_PERFECT      0x0008
 #define MDBM_HFLAG_REPLACED     0x0010
 #define MDBM_HFLAG_LARGEOBJ     0x0020
+#define MDBM_HFLAG_FILTER       0x0040  /* per-page lookup filters follow the page table */
+#define MDBM_HFLAG_PAGEINDEX    0x0080  /* data pages end with a hash slot index */
+#define MDBM_HFLAG_FULLHASH     0x0100  /* low 16 hash bits follow each key */
+#define MDBM_HFLAG_OPTREAD      0x0200  /* writers maintain h_read_seq for lock-free fetches */
+#define MDBM_HFLAG_DIRTYMAP     0x0400  /* writers record modified pages in "<db>.dirty" */
+#define MDBM_HFLAG_JOURNAL      0x0800  /* writers log changes to "<db>.journal" */
+#define MDBM_HFLAG_CHANGES      0x1000  /* writers log changes to "<db>.changes" */
+
+/* Optimistic read counters (h_read_seq).  Word 0 covers exclusive (and
+ * single or shared-mode) locks, the others partition locks, by partition
+ * number.  The low bits count writers inside a locked section; the rest is a
+ * version, bumped each time a writer leaves.  Locks taken for library lookups
+ * (MDBM_LOCK_LOOKUP) are not counted.  When a lock is recovered from a dead
+ * owner, the counts are reset under the exclusive lock (h_read_seq_stale
+ * defers that until some handle takes it). */
+#define MDBM_READ_SEQ_WORDS     4
+#define MDBM_READ_SEQ_BUSY      0x000000ff
+#define MDBM_READ_SEQ_VERSION   0x00000100
+#define MDBM_READ_SEQ_PART_WORD(part) (1 + (part) % (MDBM_READ_SEQ_WORDS-1))
+
+/* Size of the lookup filter for each logical page (one cache line). */
+#define MDBM_FILTER_BYTES       64
+
+/* Limits on the number of in-page index slots (slots are 16 bits). */
+#define MDBM_PAGEINDEX_MIN_SHIFT 4
+#define MDBM_PAGEINDEX_MAX_SHIFT 15
 
 #define MDBM_DIRSHIFT_MAX       24
 #define MDBM_NUMPAGES_MAX       (1<<MDBM_DIRSHIFT_MAX)
@@ -205,7 +239,7 @@ extern int mdbm_init_rstats(MDBM* db, int flags);
 extern int mdbm_sanity_check;
 
 #define CHECK_DB_PARTIAL(db,l)  \
-    if (mdbm_sanity_check && (check_db(db,mdbm_sanity_check,l,1) > 0)) { \
+    if (mdbm_sanity_check && (check_db(db,mdbm_sanity_check,l,1,1) > 0)) { \
       mdbm_log(LOG_ERR, "fail CHECK_DB_PARTIAL, aborting...\n"); \
       abort(); \
     } 
@@ -249,6 +283,9 @@ typedef struct mdbm_page {
 
 #define MDBM_PAGE_T_SIZE        16
 
+/* mdbm_page.p_flags for data pages */
+#define MDBM_PFLAG_NOINDEX      0x1     /* in-page index overflowed, scan the entries */
+
 typedef struct mdbm_ptentry {
     unsigned int pt_pagenum:24;  /* index for the page data, or 0 */
     unsigned int pt_r0:8;        /* padding */
@@ -324,6 +361,149 @@ typedef struct mdbm_window_data {
 } mdbm_window_data_t;
 
 
+/* Number of hash bits resolved by a single directory cache lookup. */
+#define MDBM_DIR_CACHE_MAX_SHIFT    16
+
+/* Flattened copy of the directory trie: the low hash bits index the table,
+ * giving the trie node and depth (hash bits consumed) where the walk stops.
+ * A cache is immutable once built, and is reference counted so that it can
+ * be shared by dup(licate) handles looking at the same directory.
+ */
+typedef struct mdbm_dir_cache {
+    uint32_t    nrefs;      /* number of handles (and dup_info) using the cache */
+    uint32_t    dir_gen;    /* db_dir_gen it was built from */
+    int         dir_shift;  /* db_dir_shift it was built from */
+    int         max_dirbit; /* db_max_dirbit it was built from */
+    int         shift;      /* number of hash bits resolved by the table */
+    mdbm_dir_t* dir;        /* copy of the directory bits it was built from */
+    uint32_t*   table;      /* (dirbit << 5) | hashbit, indexed by hash prefix */
+} mdbm_dir_cache_t;
+
+/* Size classes of the free-list index: one per size for chunks smaller
+ * than MDBM_FREE_EXACT_PAGES, then one per power of 2. */
+#define MDBM_FREE_EXACT_PAGES   16
+#define MDBM_FREE_CLASSES       48
+
+/* Per-class list of free chunks that may be of that class. */
+typedef struct mdbm_free_class {
+    uint32_t*   pages;      /* chunk page numbers (unordered, possibly stale) */
+    uint32_t    len;        /* number of entries in use */
+    uint32_t    cap;        /* number of entries allocated */
+} mdbm_free_class_t;
+
+/* Handle-private index of the on-disk free list (h_first_free), so that
+ * allocating and freeing chunks doesn't have to walk the list.
+ * heads has a bit for each page that starts a free chunk, and summary a bit
+ * for each non-zero word of heads.  Class lists are pruned lazily: entries
+ * whose chunk has since been allocated, merged or resized are dropped when
+ * they are next looked at.  The index is valid while free_gen == h_free_gen.
+ */
+typedef struct mdbm_free_index {
+    uint32_t    free_gen;   /* h_free_gen it matches */
+    uint32_t    num_pages;  /* number of pages covered by heads */
+    uint32_t    num_free;   /* number of free chunks (bits set in heads) */
+    uint32_t    free_pages; /* total pages in free chunks */
+    uint32_t    num_entries;/* total entries in the class lists */
+    uint64_t    class_mask; /* bit for each non-empty class list */
+    uint64_t*   heads;      /* bit per page: page starts a free chunk */
+    uint64_t*   summary;    /* bit per heads word: word is non-zero */
+    mdbm_free_class_t classes[MDBM_FREE_CLASSES];
+} mdbm_free_index_t;
+
+/* Dirty page map shared by all handles through "<db>.dirty", see
+ * mdbm_set_dirty_tracking().  d_bits has a bit for each db page, and
+ * d_summary a bit for each non-zero word of d_bits.  Writers set the d_bits
+ * bit before the d_summary bit; mdbm_sync_dirty() clears the d_summary bit
+ * before taking (zeroing) the d_bits word, so no mark is ever lost.
+ */
+#define MDBM_DIRTY_MAGIC        0x54524944  /* "DIRT" */
+#define MDBM_DIRTY_VERSION      1
+#define MDBM_DIRTY_WORDS        (MDBM_NUMPAGES_MAX/64)
+#define MDBM_DIRTY_SUMMARY      (MDBM_DIRTY_WORDS/64)
+
+typedef struct mdbm_dirty_map {
+    uint32_t    d_magic;
+    uint32_t    d_version;
+    uint32_t    d_hi;           /* one past the highest page ever marked */
+    uint32_t    d_hdr_pages;    /* pages in the header chunk (always synced) */
+    uint64_t    d_pad[6];
+    uint64_t    d_summary[MDBM_DIRTY_SUMMARY];
+    uint64_t    d_bits[MDBM_DIRTY_WORDS];
+} mdbm_dirty_map_t;
+
+/* Write-ahead journal ("<db>.journal"), see mdbm_set_journal().  The file
+ * starts with a header page, mapped by every handle, followed by redo
+ * records.  Each record is a mdbm_journal_rec_t, the key, and the value.
+ * Writers append under the db lock of the record's key, and advance j_tail.
+ * A group commit syncs the file up to j_tail and advances j_synced; a
+ * checkpoint syncs the db, truncates the file back to the header page, and
+ * bumps j_gen.  Both are serialized by the journal lock.
+ */
+#define MDBM_JOURNAL_MAGIC      0x4c4e524a  /* "JRNL" */
+#define MDBM_JOURNAL_VERSION    1
+#define MDBM_JOURNAL_HDR_SIZE   4096
+#define MDBM_JOURNAL_REC_MAGIC  0x4345524a  /* "JREC" */
+
+#define MDBM_JOURNAL_OP_STORE   MDBM_CHANGE_STORE
+#define MDBM_JOURNAL_OP_DUP     MDBM_CHANGE_INSERT_DUP
+#define MDBM_JOURNAL_OP_DELETE  MDBM_CHANGE_DELETE
+#define MDBM_JOURNAL_OP_PURGE   MDBM_CHANGE_PURGE
+
+typedef struct mdbm_journal_hdr {
+    uint32_t    j_magic;
+    uint32_t    j_version;
+    uint64_t    j_gen;          /* checkpoint generation */
+    uint64_t    j_tail;         /* end of the last complete record */
+    uint64_t    j_synced;       /* file offset known to be on disk */
+    uint32_t    j_structural;   /* the db structure changed since the last checkpoint */
+    uint32_t    j_pad;
+} mdbm_journal_hdr_t;
+
+typedef struct mdbm_journal_rec {
+    uint32_t    r_magic;
+    uint32_t    r_crc;          /* crc32c of the op, sizes, key and value */
+    uint32_t    r_op;
+    uint32_t    r_ksize;
+    uint32_t    r_vsize;
+} mdbm_journal_rec_t;
+
+/* Change ring ("<db>.changes", see mdbm_set_change_ring()).  A header page
+ * is followed by r_size bytes of records, each a mdbm_change_rec_t, the key
+ * and the value, padded to 8 bytes.  Offsets grow forever, and are taken
+ * modulo r_size.  A record never wraps: the space left at the end is skipped,
+ * with a pad record (c_op 0) if it is big enough for one.  Writers append
+ * under r_lock (the pid of the owner), advance r_tail past the records they
+ * are about to overwrite, write, then advance r_head.  Readers detect being
+ * overrun by r_tail passing their offset.
+ */
+#define MDBM_CHANGE_RING_MAGIC      0x474e4952  /* "RING" */
+#define MDBM_CHANGE_RING_VERSION    1
+#define MDBM_CHANGE_RING_HDR_SIZE   4096
+#define MDBM_CHANGE_RING_MIN_SIZE   (1024*1024)
+#define MDBM_CHANGE_RING_MAX_SIZE   (1024*1024*1024)
+
+typedef struct mdbm_change_ring_hdr {
+    uint32_t    r_magic;
+    uint32_t    r_version;
+    uint64_t    r_epoch;        /* changes whenever readers must resync */
+    uint64_t    r_size;         /* size of the record area */
+    uint32_t    r_lock;         /* pid of the appending writer, or 0 */
+    uint32_t    r_pad;
+    uint64_t    r_head;         /* end of the newest record */
+    uint64_t    r_tail;         /* start of the oldest record */
+    uint64_t    r_tail_seq;     /* its sequence number */
+    uint64_t    r_next_seq;     /* sequence number of the next record */
+} mdbm_change_ring_hdr_t;
+
+typedef struct mdbm_change_rec {
+    uint32_t    c_len;          /* whole record, padding included */
+    uint16_t    c_op;           /* MDBM_CHANGE_*, or 0 for padding */
+    uint16_t    c_flags;        /* MDBM_CHANGE_NOVAL */
+    uint64_t    c_seq;
+    uint32_t    c_ksize;
+    uint32_t    c_vsize;
+} mdbm_change_rec_t;
+
 /* This structure is used for communicating mapping changes
  * between threads sharing a dup(licate) MDBM handle.
  * Given that, perhaps the fields should be volatile/sig_atomic_t/etc
@@ -340,6 +520,9 @@ typedef struct mdbm_dup_info {
     /* int         dup_page_map_size; */
 
     uint64_t    dup_map_gen_marker; /* count of the last completed update */
+
+    mdbm_dir_cache_t* dup_dir_cache;    /* most recently built directory cache */
+    uint32_t    dup_dir_lock;           /* spin-lock protecting dup_dir_cache */
 } mdbm_dup_info_t;
 
 typedef uint64_t (*mdbm_time_func_t)();
@@ -364,9 +547,13 @@ struct mdbm {
     int                 db_pagesize;  /* size of a single (non-oversize) page */
     unsigned            db_num_pages; /* number of physical pages in the db (h_num_pages) */
     int                 db_align_mask;/* alignment requirement for keys and values */
+    int                 db_hashlo_len;/* bytes of low hash bits stored after each key */
     mdbm_dir_t*         db_dir;       /* (mdbm_dir_t*)malloc(MDBM_DIR_SIZE(hdr->h_dir_shift)); */
     int                 db_dir_flags; /* directory flags: perfect hash, etc */
     uint32_t            db_dir_gen;   /* "generation" (as in age) change counter */
+    mdbm_dir_cache_t*   db_dir_cache; /* flattened db_dir lookup table (lazily built) */
+    uint32_t            db_dir_cache_miss; /* uncached lookups since db_dir changed */
+    mdbm_free_index_t*  db_free_index; /* index of the free list (lazily built) */
     int                 db_dir_shift; /* log2(logical_pages) */
     int                 db_max_dir_shift; /* user-set maximum number of log2(logical_pages) */
     int                 db_max_dirbit;/* it's actually the number of logical pages */
@@ -387,9 +574,18 @@ struct mdbm {
 #endif
     mdbm_rstats_t*      db_rstats;    /* realtime statistics structure (shared memory) */
     struct mdbm_rstats_mem* db_rstats_mem;
+    mdbm_dirty_map_t*   db_dirty;     /* dirty page map (shared memory), or NULL */
+    struct mdbm_shmem_s* db_dirty_mem;
+    struct mdbm_flusher* db_flusher;  /* background dirty page flusher, or NULL */
+    struct mdbm_journal* db_journal;  /* write-ahead journal, or NULL */
+    mdbm_change_ring_hdr_t* db_changes;  /* change ring (shared memory), or NULL */
+    struct mdbm_shmem_s* db_changes_mem;
     uint32_t            guard_padding_3;  /* Guard padding against handle corruption */
     mdbm_window_data_t  db_window;    /* "window" data for partially mmap-ing the db */
     uint64_t            db_lock_wait; /* locking latency time */
+    uint32_t            db_read_seq_held; /* bitmask of h_read_seq words entered */
+    int                 db_read_seq_part; /* partition of the last partition lock */
+    int                 db_read_seq_reading; /* lock being taken is only for reading */
     uint32_t            db_sys_pagesize; /* system (OS) page size */
     mdbm_dup_info_t*    db_dup_info;    /* info for shared mmaps (dup'ed handle) */  
     uint64_t            db_dup_map_gen; /* last update from dup_info  */
@@ -449,6 +645,7 @@ MDBM_DB_CACHEMODE(const MDBM* db)
 
 #define MDBM_LOCK_READ          0
 #define MDBM_LOCK_WRITE         1
+#define MDBM_LOCK_LOOKUP        2       /* read lock for a library lookup that never writes */
 
 #define MDBM_LOCK_NOCHECK       0
 #define MDBM_LOCK_CHECK         1
@@ -474,13 +671,18 @@ extern int do_lock_x(MDBM* db, int pageno, int nonblock, int check);
 extern int do_unlock_x(MDBM* db);
 extern uint32_t db_get_lockmode(MDBM *db);
 extern int db_get_part_count(MDBM* db);
+extern int db_get_lock_stats(MDBM* db, mdbm_lock_stats_t* stats);
 extern int lock_db_isowned(MDBM* db);
 extern int db_is_locked(MDBM* db);
 extern int db_is_owned(MDBM* db);
+extern int db_part_owned(MDBM* db);
 extern int db_is_multi_lock(MDBM* db);
 extern int db_multi_part_locked(MDBM* db);
 extern int db_internal_is_owned(MDBM* db);
 extern int do_lock_reset(const char* dbfilename, int flags);
+extern void mdbm_internal_read_seq_sync(MDBM* db);
+extern void mdbm_internal_read_seq_leave(MDBM* db);
+extern void mdbm_internal_read_seq_reset(MDBM* db);
 
 
 
@@ -624,6 +826,13 @@ MDBM_ALIGN_LEN(const MDBM* db, int len)
     return (len & db->db_align_mask) ? (len + db->db_align_mask) & ~db->db_align_mask : len;
 }
 
+/* Space taken by a key of len bytes, including any stored low hash bits. */
+static inline int
+MDBM_KEY_ALIGN_LEN(const MDBM* db, int len)
+{
+    return len ? MDBM_ALIGN_LEN(db,len + db->db_hashlo_len) : 0;
+}
+
 static inline int
 MDBM_ALIGN_PAD_BYTES(const MDBM* db, int len)
 {
@@ -646,20 +855,20 @@ static inline int
 MDBM_VAL_LEN(const MDBM* db, const mdbm_entry_data_t* e)
 {
     return e->e_entry[0].e_offset - e->e_entry[1].e_offset
-        - MDBM_ALIGN_LEN(db,e->e_entry[1].e_key.key.len) - MDBM_PAD_BYTES(e->e_entry);
+        - MDBM_KEY_ALIGN_LEN(db,e->e_entry[1].e_key.key.len) - MDBM_PAD_BYTES(e->e_entry);
 }
 
 static inline int
 MDBM_VAL_LEN1 (const MDBM* db, const mdbm_entry_t* ep)
 {
     return ep[0].e_offset - ep[1].e_offset
-        - MDBM_ALIGN_LEN(db,ep[1].e_key.key.len) - MDBM_PAD_BYTES(ep);
+        - MDBM_KEY_ALIGN_LEN(db,ep[1].e_key.key.len) - MDBM_PAD_BYTES(ep);
 }
 
 static inline int
 MDBM_VAL_OFFSET(const MDBM* db, const mdbm_entry_t* ep)
 {
-    return ep[1].e_offset + MDBM_ALIGN_LEN(db,ep[1].e_key.key.len);
+    return ep[1].e_offset + MDBM_KEY_ALIGN_LEN(db,ep[1].e_key.key.len);
 }
 
 static inline char*
@@ -683,8 +892,8 @@ MDBM_VAL_PTR2 (const mdbm_page_t* page, int offset, int vlen)
 static inline int
 MDBM_ENTRY_KVSIZE(const MDBM* db, const mdbm_entry_t* ep)
 {
-    return ep[0].e_offset - ep[1].e_offset - MDBM_ALIGN_LEN(db,ep[1].e_key.key.len)
-        + MDBM_ALIGN_LEN(db,ep[0].e_key.key.len);
+    return ep[0].e_offset - ep[1].e_offset - MDBM_KEY_ALIGN_LEN(db,ep[1].e_key.key.len)
+        + MDBM_KEY_ALIGN_LEN(db,ep[0].e_key.key.len);
 }
 
 static inline int
@@ -702,7 +911,7 @@ MDBM_ENTRY_OFFSET(const MDBM* db, const mdbm_entry_t* ep)
 static inline int
 MDBM_ENTRY_LEN(const MDBM* db, const mdbm_entry_t* ep)
 {
-    return MDBM_KEY_OFFSET(ep) + ep->e_key.key.len - MDBM_VAL_OFFSET(db,ep);
+    return MDBM_KEY_OFFSET(ep) + ep->e_key.key.len + db->db_hashlo_len - MDBM_VAL_OFFSET(db,ep);
 }
 
 static inline int
@@ -745,6 +954,56 @@ MDBM_DATA_PAGE_BASE(const mdbm_page_t* p)
     return (char*)p + MDBM_PAGE_T_SIZE;
 }
 
+static inline int
+MDBM_HAS_PAGE_INDEX(const MDBM* db)
+{
+    return db->db_hdr->h_dbflags & MDBM_HFLAG_PAGEINDEX;
+}
+
+static inline int
+MDBM_HAS_OPTREAD(const MDBM* db)
+{
+    return db->db_hdr->h_dbflags & MDBM_HFLAG_OPTREAD;
+}
+
+static inline int
+MDBM_HAS_DIRTYMAP(const MDBM* db)
+{
+    return db->db_hdr->h_dbflags & MDBM_HFLAG_DIRTYMAP;
+}
+
+static inline int
+MDBM_HAS_JOURNAL(const MDBM* db)
+{
+    return db->db_hdr->h_dbflags & MDBM_HFLAG_JOURNAL;
+}
+
+static inline int
+MDBM_HAS_CHANGES(const MDBM* db)
+{
+    return db->db_hdr->h_dbflags & MDBM_HFLAG_CHANGES;
+}
+
+/* Size of the hash slot index at the end of each data page (0 if disabled). */
+static inline int
+MDBM_PAGE_INDEX_BYTES(const MDBM* db)
+{
+    return MDBM_HAS_PAGE_INDEX(db) ? (int)sizeof(uint16_t) << db->db_hdr->h_index_shift : 0;
+}
+
+/* Offset just past the data area of a data page, where the first entry ends. */
+static inline int
+MDBM_DATA_PAGE_END(const MDBM* db, const mdbm_page_t* p)
+{
+    return p->p_num_pages*db->db_pagesize - MDBM_PAGE_INDEX_BYTES(db);
+}
+
+static inline uint16_t*
+MDBM_PAGE_INDEX_PTR(const MDBM* db, const mdbm_page_t* p)
+{
+    return (uint16_t*)((char*)p + MDBM_DATA_PAGE_END(db,p));
+}
+
 static inline int
 MDBM_PAGE_FREE_BYTES(const mdbm_page_t* p)
 {
@@ -836,9 +1095,30 @@ MDBM_PTABLE_SIZE(int dir_shift)
     return MDBM_DIR_WIDTH(dir_shift)*MDBM_PTENTRY_T_SIZE;
 }
 
+/* Offset (from the start of the db) of the per-page lookup filters, which
+ * follow the page table, cache-line aligned. */
+static inline int
+MDBM_FILTER_OFFSET(int dir_shift)
+{
+    return (MDBM_PAGE_T_SIZE
+            + MDBM_HDR_T_SIZE
+            + MDBM_DIR_SIZE(dir_shift)
+            + MDBM_PTABLE_SIZE(dir_shift)
+            + MDBM_FILTER_BYTES - 1) & ~(MDBM_FILTER_BYTES - 1);
+}
+
+static inline int
+MDBM_FILTER_SIZE(int dir_shift)
+{
+    return MDBM_DIR_WIDTH(dir_shift)*MDBM_FILTER_BYTES;
+}
+
 static inline int
-MDBM_NUM_DIR_BYTES(int dir_shift)
+MDBM_NUM_DIR_BYTES(int dir_shift, int dbflags)
 {
+    if (dbflags & MDBM_HFLAG_FILTER) {
+        return MDBM_FILTER_OFFSET(dir_shift) + MDBM_FILTER_SIZE(dir_shift);
+    }
     return MDBM_PAGE_T_SIZE
         + MDBM_HDR_T_SIZE
         + MDBM_DIR_SIZE(dir_shift)
@@ -848,19 +1128,32 @@ MDBM_NUM_DIR_BYTES(int dir_shift)
 static inline int
 MDBM_DB_NUM_DIR_BYTES(MDBM* db)
 {
-    return MDBM_NUM_DIR_BYTES(db->db_dir_shift);
+    return MDBM_NUM_DIR_BYTES(db->db_dir_shift,db->db_hdr->h_dbflags);
 }
 
 static inline int
-MDBM_NUM_DIR_PAGES(int pagesize, int dir_shift)
+MDBM_NUM_DIR_PAGES(int pagesize, int dir_shift, int dbflags)
 {
-    return MDBM_NUM_PAGES_ROUNDED(pagesize,MDBM_NUM_DIR_BYTES(dir_shift));
+    return MDBM_NUM_PAGES_ROUNDED(pagesize,MDBM_NUM_DIR_BYTES(dir_shift,dbflags));
 }
 
 static inline int
 MDBM_DB_NUM_DIR_PAGES(MDBM* db)
 {
-    return MDBM_NUM_DIR_PAGES(db->db_pagesize,db->db_dir_shift);
+    return MDBM_NUM_DIR_PAGES(db->db_pagesize,db->db_dir_shift,db->db_hdr->h_dbflags);
+}
+
+static inline int
+MDBM_HAS_FILTER(const MDBM* db)
+{
+    return db->db_hdr->h_dbflags & MDBM_HFLAG_FILTER;
+}
+
+static inline uint64_t*
+MDBM_FILTER_PTR(const MDBM* db, mdbm_pagenum_t pagenum)
+{
+    return (uint64_t*)(db->db_base + MDBM_FILTER_OFFSET(db->db_dir_shift)
+                       + (size_t)pagenum*MDBM_FILTER_BYTES);
 }
 
 static inline int
@@ -1232,6 +1525,37 @@ extern int fcopy_body(MDBM* db, int fd, int flags);
 
 extern char mdbm_internal_hex_to_byte(int c1, int c2);
 
+/* Page entry-table scanners (selected at library load by cpu features). */
+#define MDBM_SCAN_SCALAR        0
+#define MDBM_SCAN_SSE2          1
+#define MDBM_SCAN_AVX2          2
+
+/* Selects a scanner, returns -1 (errno=ENOTSUP) if the cpu doesn't support it. */
+extern int mdbm_internal_set_entry_scan(int kind);
+extern int mdbm_internal_get_entry_scan(void);
+/* Returns the first index in [start,end) whose match word equals 'match', or 'end'. */
+extern int mdbm_internal_scan_entries(const mdbm_entry_t* ep, int start, int end,
+                                      uint32_t match);
+
+/* Selects the db_dump escape codec, of the same kinds as the entry scanners. */
+extern int mdbm_internal_set_dbdump_codec(int kind);
+extern int mdbm_internal_get_dbdump_codec(void);
+
+/* Selects the SSE4.2 (1) or table (0) CRC-32C hash; -1 (errno=ENOTSUP) if unavailable. */
+extern int mdbm_internal_set_crc32c_hw(int enable);
+
+/* Seeded 64-bit xxHash (mdbm_hash_xxh64 folds the unseeded one to 32 bits). */
+extern uint64_t mdbm_internal_hash64(const uint8_t* p, int len, uint64_t seed);
+
+/* LZ77 block codec for mdbm_save() snapshots and bindump exports (lz.c). */
+/* Returns the output capacity compress needs for 'len' input bytes. */
+extern int mdbm_internal_lz_bound(int len);
+/* Returns the compressed length, or -1 if 'cap' is less than the bound. */
+extern int mdbm_internal_lz_compress(const uint8_t* src, int len, uint8_t* dst, int cap,
+                                     int level);
+/* Returns the decompressed length, or -1 if the input is malformed or too long. */
+extern int mdbm_internal_lz_decompress(const uint8_t* src, int len, uint8_t* dst, int dstlen);
+
 #define ERROR() fprintf(stderr, "ERROR (%d %s) in %s() %s:%d\n", errno, strerror(errno), __func__, __FILE__, __LINE__);
 #define NOTE(desc) fprintf(stderr, "NOTICE %s in %s() %s:%d\n", desc, __func__, __FILE__, __LINE__);
 
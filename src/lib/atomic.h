@@ -47,6 +47,17 @@ static inline uint32_t atomic_add32u(uint32_t* var, uint32_t delta) {
 static inline int32_t atomic_add32s(int32_t* var, int32_t delta) {
   return __sync_fetch_and_add(var, delta);
 }
+static inline uint64_t atomic_add64u(uint64_t* var, uint64_t delta) {
+  return __sync_fetch_and_add(var, delta);
+}
+
+/* Atomically set/clear 'bits' in 'var'. Returns old value. */
+static inline uint64_t atomic_or64u(uint64_t* var, uint64_t bits) {
+  return __sync_fetch_and_or(var, bits);
+}
+static inline uint64_t atomic_and64u(uint64_t* var, uint64_t bits) {
+  return __sync_fetch_and_and(var, bits);
+}
 
 /* Atomically replace 'var' by 'to' if it is 'from'. Returns old value. */
 static inline uint32_t atomic_cas32u(uint32_t* var, uint32_t from, uint32_t to) {
@@ -55,6 +66,9 @@ static inline uint32_t atomic_cas32u(uint32_t* var, uint32_t from, uint32_t to)
 static inline int32_t atomic_cas32s(int32_t* var, int32_t from, int32_t to) {
   return __sync_val_compare_and_swap(var, from, to);
 }
+static inline uint64_t atomic_cas64u(uint64_t* var, uint64_t from, uint64_t to) {
+  return __sync_val_compare_and_swap(var, from, to);
+}
 
 /* returns true if the swap completed. */
 static inline int atomic_cmp_and_set_32_bool (volatile void *ptr, uint32_t oldval, uint32_t newval)
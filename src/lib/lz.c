@@ -0,0 +1,211 @@
+/* Copyright 2013 Yahoo! Inc.                                         */
+/* See LICENSE in the root of the distribution for licensing details. */
+
+/*
+ * Small LZ77 block codec used for mdbm_save() snapshots.
+ *
+ * The encoding is a sequence of (literals, match) pairs, each led by a token
+ * byte: the high nibble is the literal count and the low nibble the match
+ * length minus LZ_MIN_MATCH.  A nibble of 15 is followed by extra length
+ * bytes (255 means "more follows").  The literals come next, then a 2-byte
+ * little-endian match offset.  The last sequence has literals only.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mdbm.h"
+#include "mdbm_internal.h"
+
+#define LZ_MIN_MATCH        4
+#define LZ_HASH_BITS        13
+#define LZ_MAX_OFFSET       65535
+#define LZ_LAST_LITERALS    5   /* trailing bytes always emitted as literals */
+#define LZ_MATCH_LIMIT      12  /* no match may start this close to the end */
+
+static inline uint32_t
+lz_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t*
+lz_put_len(uint8_t* op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+int
+mdbm_internal_lz_bound(int len)
+{
+    return len + len/255 + 16;
+}
+
+int
+mdbm_internal_lz_compress(const uint8_t* src, int len, uint8_t* dst, int cap, int level)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + len;
+    const uint8_t* match_limit = end - LZ_MATCH_LIMIT;
+    const uint8_t* copy_limit = end - LZ_LAST_LITERALS;
+    uint8_t* op = dst;
+    uint8_t* token;
+    int skip_shift;
+    int lit;
+
+    if (len < 0 || cap < mdbm_internal_lz_bound(len)) {
+        return -1;
+    }
+    /* Lower levels give up on incompressible runs sooner. */
+    if (level < 1) {
+        level = 1;
+    } else if (level > 9) {
+        level = 9;
+    }
+    skip_shift = 2 + level;
+
+    if (len > LZ_MATCH_LIMIT) {
+        uint32_t misses = 0;
+
+        memset(table,0,sizeof(table));
+        while (ip < match_limit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t* ref = src + table[h];
+            const uint8_t* mp;
+            const uint8_t* rp;
+            int mlen, off;
+
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+                ip += 1 + (misses++ >> skip_shift);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            mp = ip + LZ_MIN_MATCH;
+            rp = ref + LZ_MIN_MATCH;
+            while (mp < copy_limit && *mp == *rp) {
+                ++mp;
+                ++rp;
+            }
+
+            lit = (int)(ip - anchor);
+            mlen = (int)(mp - ip) - LZ_MIN_MATCH;
+            off = (int)(ip - ref);
+            token = op++;
+            *token = (uint8_t)(((lit >= 15) ? 15 : lit) << 4);
+            if (lit >= 15) {
+                op = lz_put_len(op,lit - 15);
+            }
+            memcpy(op,anchor,lit);
+            op += lit;
+            *op++ = (uint8_t)off;
+            *op++ = (uint8_t)(off >> 8);
+            *token |= (uint8_t)((mlen >= 15) ? 15 : mlen);
+            if (mlen >= 15) {
+                op = lz_put_len(op,mlen - 15);
+            }
+            ip = anchor = mp;
+            if (ip - 2 > src && ip < match_limit) {
+                table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+            }
+        }
+    }
+
+    lit = (int)(end - anchor);
+    token = op++;
+    *token = (uint8_t)(((lit >= 15) ? 15 : lit) << 4);
+    if (lit >= 15) {
+        op = lz_put_len(op,lit - 15);
+    }
+    memcpy(op,anchor,lit);
+    op += lit;
+    return (int)(op - dst);
+}
+
+int
+mdbm_internal_lz_decompress(const uint8_t* src, int len, uint8_t* dst, int dstlen)
+{
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dstlen;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int lit = token >> 4;
+        int mlen = token & 15;
+        int off, b;
+        const uint8_t* ref;
+
+        if (lit == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > iend - ip || lit > oend - op) {
+            return -1;
+        }
+        memcpy(op,ip,lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!off || off > op - dst) {
+            return -1;
+        }
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > oend - op) {
+            return -1;
+        }
+        ref = op - off;
+        if (off >= mlen) {
+            memcpy(op,ref,mlen);
+            op += mlen;
+        } else {
+            while (mlen--) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return (int)(op - dst);
+}
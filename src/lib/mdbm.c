@@ -32,7 +32,12 @@
 #include <sys/resource.h> /* used for rlimit */
 #include <execinfo.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sched.h>
 #include <inttypes.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
 
 /* FreeBSD4 doesn't have stdint.h, but FreeBSD6 masks it. */
 #ifdef FREEBSD
@@ -456,6 +461,201 @@ check_guard_padding(MDBM *db, int printMsg)
     return 0;
 }
 
+static void
+dir_cache_release(mdbm_dir_cache_t* cache)
+{
+    if (cache && atomic_dec32u(&cache->nrefs) == 1) {
+        free(cache);
+    }
+}
+
+static void
+dir_cache_fill(const MDBM* db, uint32_t* table, int shift, int dirbit, int hashbit,
+               uint32_t prefix)
+{
+    if (hashbit < shift && dirbit < db->db_max_dirbit && MDBM_DIR_BIT(db,dirbit)) {
+        dir_cache_fill(db,table,shift,(dirbit << 1) + 1,hashbit+1,prefix);
+        dir_cache_fill(db,table,shift,(dirbit << 1) + 2,hashbit+1,prefix | (1 << hashbit));
+    } else {
+        /* every hash prefix ending in 'prefix' stops at this node */
+        uint32_t ent = ((uint32_t)dirbit << 5) | hashbit;
+        uint32_t i;
+        for (i = prefix; i < (1U << shift); i += (1U << hashbit)) {
+            table[i] = ent;
+        }
+    }
+}
+
+static mdbm_dir_cache_t*
+dir_cache_build(const MDBM* db)
+{
+    int shift = (db->db_dir_shift < MDBM_DIR_CACHE_MAX_SHIFT)
+        ? db->db_dir_shift : MDBM_DIR_CACHE_MAX_SHIFT;
+    int dirsize = MDBM_DIR_SIZE(db->db_dir_shift);
+    mdbm_dir_cache_t* cache;
+
+    cache = (mdbm_dir_cache_t*)malloc(sizeof(*cache) + (sizeof(uint32_t) << shift) + dirsize);
+    if (!cache) {
+        return NULL;
+    }
+    cache->nrefs = 1;
+    cache->dir_gen = db->db_dir_gen;
+    cache->dir_shift = db->db_dir_shift;
+    cache->max_dirbit = db->db_max_dirbit;
+    cache->shift = shift;
+    cache->table = (uint32_t*)(cache + 1);
+    cache->dir = (mdbm_dir_t*)(cache->table + (1 << shift));
+    memcpy(cache->dir,db->db_dir,dirsize);
+    dir_cache_fill(db,cache->table,shift,0,0,0);
+    return cache;
+}
+
+static int
+dir_cache_matches(const MDBM* db, const mdbm_dir_cache_t* cache)
+{
+    return cache->dir_gen == db->db_dir_gen
+        && cache->dir_shift == db->db_dir_shift
+        && cache->max_dirbit == db->db_max_dirbit
+        && !memcmp(cache->dir,db->db_dir,MDBM_DIR_SIZE(db->db_dir_shift));
+}
+
+static void
+dir_cache_spin_lock(mdbm_dup_info_t* info)
+{
+    while (!atomic_cmp_and_set_32_bool(&info->dup_dir_lock,0,1)) {
+        atomic_pause();
+    }
+}
+
+static void
+dir_cache_spin_unlock(mdbm_dup_info_t* info)
+{
+    atomic_barrier();
+    info->dup_dir_lock = 0;
+}
+
+/*
+ * Attaches a directory cache for the handle's current db_dir, preferring one
+ * already built by a dup'ed handle over building a new one.
+ */
+static mdbm_dir_cache_t*
+dir_cache_attach(MDBM* db)
+{
+    mdbm_dup_info_t* info = db->db_dup_info;
+    mdbm_dir_cache_t* cache = NULL;
+
+    if (!db->db_dir) {
+        return NULL;
+    }
+    if (info) {
+        dir_cache_spin_lock(info);
+        if (info->dup_dir_cache && dir_cache_matches(db,info->dup_dir_cache)) {
+            cache = info->dup_dir_cache;
+            atomic_inc32u(&cache->nrefs);
+        }
+        dir_cache_spin_unlock(info);
+    }
+    if (!cache) {
+        if ((cache = dir_cache_build(db)) == NULL) {
+            return NULL;
+        }
+        if (info) {
+            atomic_inc32u(&cache->nrefs);
+            dir_cache_spin_lock(info);
+            dir_cache_release(info->dup_dir_cache);
+            info->dup_dir_cache = cache;
+            dir_cache_spin_unlock(info);
+        }
+    }
+    db->db_dir_cache = cache;
+    return cache;
+}
+
+/*
+ * Drops the handle's directory cache (called whenever db_dir changes).
+ */
+static void
+dir_cache_detach(MDBM* db)
+{
+    dir_cache_release(db->db_dir_cache);
+    db->db_dir_cache = NULL;
+    db->db_dir_cache_miss = 0;
+}
+
+/*
+ * Walks the directory to the leaf for hashval.  Returns the number of hash
+ * bits consumed (the page number is hashval masked to that many bits), and
+ * the trie node the walk stopped at in *dirbitp.
+ *
+ * The first MDBM_DIR_CACHE_MAX_SHIFT levels are resolved with one load from
+ * the flattened directory cache.  The cache is (re)built lazily, once enough
+ * lookups have been made against the current directory to pay for it, so
+ * runs of page splits don't rebuild it on every split.
+ */
+static inline int
+dir_walk_cached(const MDBM* db, const mdbm_dir_cache_t* cache, mdbm_hashval_t hashval,
+                int* dirbitp)
+{
+    mdbm_hashval_t hv = hashval;
+    int dirbit = 0;
+    int hashbit = 0;
+
+    if (cache) {
+        uint32_t ent = cache->table[hashval & MDBM_HASH_MASK(cache->shift)];
+        dirbit = ent >> 5;
+        hashbit = ent & 0x1f;
+        hv >>= hashbit;
+    }
+    while (dirbit < db->db_max_dirbit && MDBM_DIR_BIT(db,dirbit)) {
+        dirbit = (dirbit << 1) + (hv & 1) + 1;
+        hashbit++;
+        hv >>= 1;
+    }
+    if (dirbitp) {
+        *dirbitp = dirbit;
+    }
+    return hashbit;
+}
+
+static inline int
+dir_walk(const MDBM* db, mdbm_hashval_t hashval, int* dirbitp)
+{
+    const mdbm_dir_cache_t* cache = db->db_dir_cache;
+
+    if (cache && cache->max_dirbit != db->db_max_dirbit) {
+        /* directory resized in place */
+        dir_cache_detach((MDBM*)db);
+        cache = NULL;
+    }
+    if (!cache && db->db_dir_shift
+        && ++((MDBM*)db)->db_dir_cache_miss > (1U << db->db_dir_shift) / 8) {
+        cache = dir_cache_attach((MDBM*)db);
+    }
+    return dir_walk_cached(db,cache,hashval,dirbitp);
+}
+
+/*
+ * Like hashval_to_pagenum(), but never changes the handle (the directory cache
+ * is used if it is current, but isn't attached or detached), so several
+ * threads can look up pages through the same handle.
+ */
+static mdbm_pagenum_t
+hashval_to_pagenum_shared(const MDBM* db, mdbm_hashval_t hashval)
+{
+    const mdbm_dir_cache_t* cache = db->db_dir_cache;
+    int hashbit;
+
+    if (db->db_dir_flags & MDBM_HFLAG_PERFECT) {
+        hashbit = db->db_dir_shift;
+    } else {
+        if (cache && cache->max_dirbit != db->db_max_dirbit) {
+            cache = NULL;
+        }
+        hashbit = dir_walk_cached(db,cache,hashval,NULL);
+    }
+    return MDBM_HASH_MASK(hashbit) & hashval;
+}
+
 mdbm_pagenum_t
 hashval_to_pagenum(const MDBM *db, mdbm_hashval_t hashval)
 {
@@ -465,15 +665,7 @@ hashval_to_pagenum(const MDBM *db, mdbm_hashval_t hashval)
     if (db->db_dir_flags & MDBM_HFLAG_PERFECT) {
         hashbit = db->db_dir_shift;
     } else {
-        mdbm_hashval_t hv = hashval;
-        int dirbit = 0;
-
-        hashbit = 0;
-        while (dirbit < db->db_max_dirbit && MDBM_DIR_BIT(db,dirbit)) {
-            dirbit = (dirbit << 1) + (hv & 1) + 1;
-            hashbit++;
-            hv >>= 1;
-        }
+        hashbit = dir_walk(db,hashval,NULL);
     }
     return MDBM_HASH_MASK(hashbit) & hashval;
 #else
@@ -493,4351 +685,4677 @@ hashval_to_pagenum(const MDBM *db, mdbm_hashval_t hashval)
 #endif
 }
 
+/*
+ * Free-list index (see mdbm_free_index_t).
+ *
+ * alloc_free_chunk() and free_chunk() keep the handle's index in step with
+ * the free list.  Anything else that rewrites the free list just bumps
+ * h_free_gen (free_list_changed(db,NULL)), and every handle rebuilds its index,
+ * with one walk of the list, the next time it allocates or frees a chunk.
+ */
+
+static inline int
+free_class(uint32_t npages)
+{
+    int c;
+
+    if (npages < MDBM_FREE_EXACT_PAGES) {
+        return npages ? npages - 1 : 0;
+    }
+    /* one class per power of 2, starting with [MDBM_FREE_EXACT_PAGES,2*MDBM_FREE_EXACT_PAGES) */
+    c = MDBM_FREE_EXACT_PAGES - 1 + __builtin_clz(MDBM_FREE_EXACT_PAGES) - __builtin_clz(npages);
+    return (c < MDBM_FREE_CLASSES) ? c : MDBM_FREE_CLASSES - 1;
+}
+
+static inline int
+free_index_is_head(const mdbm_free_index_t* fi, uint32_t pagenum)
+{
+    return pagenum < fi->num_pages && (fi->heads[pagenum / 64] & (1ULL << (pagenum % 64)));
+}
+
 static void
-alloc_free_chunk(MDBM* db, int npages, int n, int prev)
+free_index_clear(mdbm_free_index_t* fi)
 {
-    mdbm_page_t* page;
+    int c;
 
-    assert(n <= db->db_hdr->h_last_chunk);
-    if (prev < 0) {
-        int p;
-        prev = 0;
-        for (p = db->db_hdr->h_first_free; p && p != n;) {
-            mdbm_page_t* page = MDBM_PAGE_PTR(db,p);
-            prev = p;
-            p = page->p.p_next_free;
-        }
+    if (fi->heads) {
+        free(fi->heads);
     }
+    fi->heads = fi->summary = NULL;
+    fi->num_pages = 0;
+    fi->num_free = 0;
+    fi->free_pages = 0;
+    fi->num_entries = 0;
+    fi->class_mask = 0;
+    for (c = 0; c < MDBM_FREE_CLASSES; c++) {
+        fi->classes[c].len = 0;
+    }
+}
 
-    page = MDBM_PAGE_PTR(db,n);
-    assert(page->p_type == MDBM_PTYPE_FREE);
-    if (page->p_num_pages > npages) {
-        int n1 = n + npages;
-        int n1pages = page->p_num_pages - npages;
-        mdbm_page_t* next_page = MDBM_PAGE_PTR(db,n1);
+static void
+free_index_release(MDBM* db)
+{
+    mdbm_free_index_t* fi = db->db_free_index;
+    int c;
 
-        next_page->p_type = MDBM_PTYPE_FREE;
-        next_page->p_num_pages = n1pages;
-        next_page->p_prev_num_pages = npages;
-        next_page->p.p_next_free = page->p.p_next_free;
-        page->p.p_next_free = n1;
-        if (n == db->db_hdr->h_last_chunk) {
-            db->db_hdr->h_last_chunk = n+npages;
-        } else {
-            next_page = MDBM_PAGE_PTR(db,n1 + n1pages);
-            next_page->p_prev_num_pages = n1pages;
+    if (fi) {
+        free_index_clear(fi);
+        for (c = 0; c < MDBM_FREE_CLASSES; c++) {
+            free(fi->classes[c].pages);
         }
-    }
-    if (prev) {
-        mdbm_page_t* pprev = MDBM_PAGE_PTR(db,prev);
-        pprev->p.p_next_free = page->p.p_next_free;
-    } else {
-        assert(!page->p.p_next_free
-               || MDBM_PAGE_PTR(db,page->p.p_next_free)->p_type == MDBM_PTYPE_FREE);
-        db->db_hdr->h_first_free = page->p.p_next_free;
+        free(fi);
+        db->db_free_index = NULL;
     }
 }
 
-/**
- * \brief Checks the integrity of the database header.
- * \param[in,out] mdbm handle
- * \param[in] h header
- * \param[in] whether to display information messages
- * \return number of check failures
+/*
+ * Grows the page bitmaps to cover num_pages.  Returns 0 on success, -1 if out
+ * of memory.
  */
 static int
-check_db_header(MDBM* db, mdbm_hdr_t* h, int verbose)
+free_index_size(mdbm_free_index_t* fi, uint32_t num_pages)
 {
-    int nerr = 0;
+    uint32_t words = (num_pages + 63) / 64;
+    uint32_t swords = (words + 63) / 64;
+    uint32_t old_words = (fi->num_pages + 63) / 64;
+    uint32_t old_swords = (old_words + 63) / 64;
+    uint64_t* heads;
 
-    if (h->h_magic != _MDBM_MAGIC_NEW2) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_magic (0x%x) invalid",
-                     db->db_filename,h->h_magic);
-        }
-        nerr++;
-    }
-    if (h->h_dbflags
-        & ~(MDBM_ALIGN_MASK|MDBM_HFLAG_PERFECT|MDBM_HFLAG_REPLACED|MDBM_HFLAG_LARGEOBJ))
-    {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_dbflags (0x%x) invalid",
-                     db->db_filename,h->h_dbflags);
+    if (words > old_words) {
+        if ((heads = (uint64_t*)calloc(words + swords,sizeof(uint64_t))) == NULL) {
+            return -1;
         }
-        nerr++;
-    }
-    if ((h->h_cache_mode & ~MDBM_CACHEMODE_BITS)
-        || (MDBM_CACHEMODE(h->h_cache_mode) > MDBM_CACHEMODE_MAX))
-    {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_cachemode (0x%x) invalid",
-                     db->db_filename,h->h_cache_mode);
+        if (fi->heads) {
+            memcpy(heads,fi->heads,old_words * sizeof(uint64_t));
+            memcpy(heads + words,fi->summary,old_swords * sizeof(uint64_t));
+            free(fi->heads);
         }
-        nerr++;
+        fi->heads = heads;
+        fi->summary = heads + words;
     }
-    if (h->h_dir_shift > MDBM_DIRSHIFT_MAX) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_dir_shift (%u) invalid",
-                     db->db_filename,h->h_dir_shift);
+    fi->num_pages = num_pages;
+    return 0;
+}
+
+static int
+free_index_push(mdbm_free_index_t* fi, uint32_t pagenum, uint32_t npages)
+{
+    int c = free_class(npages);
+    mdbm_free_class_t* fc = &fi->classes[c];
+
+    if (fc->len == fc->cap) {
+        uint32_t cap = fc->cap ? fc->cap * 2 : 16;
+        uint32_t* pages = (uint32_t*)realloc(fc->pages,cap * sizeof(uint32_t));
+        if (!pages) {
+            return -1;
         }
-        nerr++;
+        fc->pages = pages;
+        fc->cap = cap;
     }
-    if (h->h_hash_func > MDBM_HASH_MAX) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_hash_func (%u) invalid",
-                     db->db_filename,h->h_hash_func);
-        }
-        nerr++;
+    fc->pages[fc->len++] = pagenum;
+    fi->num_entries++;
+    fi->class_mask |= 1ULL << c;
+    return 0;
+}
+
+/*
+ * Refills the class lists from the page bitmap, dropping stale entries.
+ */
+static int
+free_index_prune(MDBM* db, mdbm_free_index_t* fi)
+{
+    uint32_t w, words = (fi->num_pages + 63) / 64;
+    int c;
+
+    fi->num_entries = 0;
+    fi->class_mask = 0;
+    for (c = 0; c < MDBM_FREE_CLASSES; c++) {
+        fi->classes[c].len = 0;
     }
-    if (h->h_max_dir_shift > MDBM_DIRSHIFT_MAX) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_max_dir_shift (%u) invalid",
-                     db->db_filename,h->h_max_dir_shift);
+    for (w = 0; w < words; w++) {
+        uint64_t bits = fi->heads[w];
+        while (bits) {
+            uint32_t n = w * 64 + __builtin_ctzll(bits);
+            if (free_index_push(fi,n,MDBM_PAGE_PTR(db,n)->p_num_pages) < 0) {
+                return -1;
+            }
+            bits &= bits - 1;
         }
-        nerr++;
     }
-    if (h->h_max_dir_shift && h->h_dir_shift > h->h_max_dir_shift) {
-        if (verbose) {
-            mdbm_log(LOG_WARNING,
-                     "%s: h_dir_shift (%u) > h_max_dir_shift (%u)",
-                     db->db_filename,h->h_dir_shift,h->h_max_dir_shift);
-        }
+    return 0;
+}
+
+/*
+ * Adds free chunk pagenum (npages long) to the index.
+ * Returns 0 on success, -1 on failure (the index must then be dropped).
+ */
+static int
+free_index_add(MDBM* db, mdbm_free_index_t* fi, uint32_t pagenum, uint32_t npages)
+{
+    uint32_t w = pagenum / 64;
+
+    if (pagenum >= fi->num_pages || free_index_is_head(fi,pagenum)) {
+        return -1;
     }
-    if (h->h_pagesize < MDBM_MINPAGE || h->h_pagesize > MDBM_MAXPAGE
-        || (h->h_pagesize & (MDBM_PAGE_ALIGN-1)))
-    {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_pagesize (%u) invalid",
-                     db->db_filename,h->h_pagesize);
-        }
-        nerr++;
+    fi->heads[w] |= 1ULL << (pagenum % 64);
+    fi->summary[w / 64] |= 1ULL << (w % 64);
+    fi->num_free++;
+    fi->free_pages += npages;
+    /* class lists only grow until they're looked at; keep them proportional */
+    if (fi->num_entries > 2 * fi->num_free + 64) {
+        return free_index_prune(db,fi);
     }
-    if (h->h_num_pages > MDBM_NUMPAGES_MAX) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_num_pages (%u) invalid",
-                     db->db_filename,h->h_num_pages);
-        }
-        nerr++;
+    return free_index_push(fi,pagenum,npages);
+}
+
+/*
+ * Removes free chunk pagenum (npages long) from the index.  Its class list
+ * entry is dropped lazily.
+ */
+static void
+free_index_del(mdbm_free_index_t* fi, uint32_t pagenum, uint32_t npages)
+{
+    uint32_t w = pagenum / 64;
+
+    fi->heads[w] &= ~(1ULL << (pagenum % 64));
+    if (!fi->heads[w]) {
+        fi->summary[w / 64] &= ~(1ULL << (w % 64));
     }
-    if (h->h_max_pages > MDBM_NUMPAGES_MAX) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_max_pages (%u) invalid",
-                     db->db_filename,h->h_max_pages);
-        }
-        nerr++;
+    fi->num_free--;
+    fi->free_pages -= npages;
+}
+
+/*
+ * Returns the free chunk preceding pagenum on the free list, or 0 if none.
+ */
+static uint32_t
+free_index_prev(const mdbm_free_index_t* fi, uint32_t pagenum)
+{
+    uint32_t w, sw;
+    uint64_t bits;
+
+    if (pagenum >= fi->num_pages) {
+        pagenum = fi->num_pages;
     }
-    if (h->h_max_pages && h->h_num_pages > h->h_max_pages) {
-        if (verbose) {
-            mdbm_log(LOG_WARNING,
-                     "%s: h_num_pages (%u) > h_max_pages (%u)",
-                     db->db_filename,h->h_num_pages,h->h_max_pages);
+    w = pagenum / 64;
+    bits = (pagenum % 64) ? fi->heads[w] & ((1ULL << (pagenum % 64)) - 1) : 0;
+    if (bits) {
+        return w * 64 + 63 - __builtin_clzll(bits);
+    }
+    /* find the previous non-zero word of heads */
+    sw = w / 64;
+    bits = (w % 64) ? fi->summary[sw] & ((1ULL << (w % 64)) - 1) : 0;
+    while (!bits) {
+        if (!sw) {
+            return 0;
         }
+        bits = fi->summary[--sw];
     }
-    if (h->h_spill_size > h->h_pagesize) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_spill_size (%u) > h_pagesize (%u)",
-                     db->db_filename,h->h_spill_size,h->h_pagesize);
+    w = sw * 64 + 63 - __builtin_clzll(bits);
+    return w * 64 + 63 - __builtin_clzll(fi->heads[w]);
+}
+
+/*
+ * Returns a free chunk of at least npages: the best fit in the smallest size
+ * class that has one (classes below MDBM_FREE_EXACT_PAGES hold one size, so
+ * that's usually the first chunk looked at).  Returns 0 if there isn't one.
+ */
+static uint32_t
+free_index_find(MDBM* db, mdbm_free_index_t* fi, uint32_t npages)
+{
+    uint64_t mask = fi->class_mask & ~((1ULL << free_class(npages)) - 1);
+
+    while (mask) {
+        int c = __builtin_ctzll(mask);
+        mdbm_free_class_t* fc = &fi->classes[c];
+        uint32_t i = fc->len;
+        uint32_t best = 0, best_size = 0;
+
+        while (i > 0) {
+            uint32_t n = fc->pages[--i];
+            uint32_t size = 0;
+            if (!free_index_is_head(fi,n)
+                || free_class(size = MDBM_PAGE_PTR(db,n)->p_num_pages) != c)
+            {
+                /* stale: the chunk has been allocated, merged or resized */
+                fc->pages[i] = fc->pages[--fc->len];
+                fi->num_entries--;
+                continue;
+            }
+            if (size == npages) {
+                return n;
+            }
+            if (size > npages && (!best || size < best_size)) {
+                best = n;
+                best_size = size;
+            }
         }
-        nerr++;
+        if (best) {
+            return best;
+        }
+        if (!fc->len) {
+            fi->class_mask &= ~(1ULL << c);
+        }
+        mask &= ~(1ULL << c);
     }
-    if (h->h_last_chunk >= h->h_num_pages) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_last_chunk (%u) >= h_num_pages (%u)",
-                     db->db_filename,h->h_last_chunk,h->h_num_pages);
+    return 0;
+}
+
+/*
+ * Returns the handle's free-list index, rebuilding it if the free list has
+ * changed since it was built.  Returns NULL if the index can't be built;
+ * callers then walk the free list.
+ */
+static mdbm_free_index_t*
+free_index_get(MDBM* db)
+{
+    mdbm_hdr_t* hdr = db->db_hdr;
+    mdbm_free_index_t* fi = db->db_free_index;
+    uint32_t n, prev;
+
+    if (!fi) {
+        if ((fi = (mdbm_free_index_t*)calloc(1,sizeof(*fi))) == NULL) {
+            return NULL;
         }
-        nerr++;
+        fi->free_gen = hdr->h_free_gen - 1;
+        db->db_free_index = fi;
     }
-    if (h->h_first_free >= h->h_num_pages) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_first_free (%u) >= h_num_pages (%u)",
-                     db->db_filename,h->h_first_free,h->h_num_pages);
+    if (fi->free_gen == hdr->h_free_gen) {
+        if (fi->num_pages < hdr->h_num_pages && free_index_size(fi,hdr->h_num_pages) < 0) {
+            fi->free_gen = hdr->h_free_gen - 1;
+            return NULL;
         }
-        nerr++;
+        return fi;
     }
-    if (h->h_first_free > 0 && h->h_first_free == h->h_last_chunk) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: h_first_free (%u) == h_last_chunk (%u)",
-                     db->db_filename,h->h_first_free,h->h_last_chunk);
+
+    free_index_clear(fi);
+    if (free_index_size(fi,hdr->h_num_pages) < 0) {
+        return NULL;
+    }
+    for (prev = 0, n = hdr->h_first_free; n; prev = n, n = MDBM_PAGE_PTR(db,n)->p.p_next_free) {
+        /* the list must be sorted; leave a damaged one to the walkers */
+        if (n <= prev || free_index_add(db,fi,n,MDBM_PAGE_PTR(db,n)->p_num_pages) < 0) {
+            return NULL;
         }
-        nerr++;
     }
-    if (verbose > 1) {
-        mdbm_log(LOG_INFO,
-                 "%s: header checked (%d error(s))",db->db_filename,nerr);
+    fi->free_gen = hdr->h_free_gen;
+    return fi;
+}
+
+/*
+ * Records a change to the free list.  fi is the index that was updated to
+ * match (if any); other handles' indexes are rebuilt when next used.
+ */
+static inline void journal_structural(MDBM* db);
+
+static inline void
+free_list_changed(MDBM* db, mdbm_free_index_t* fi)
+{
+    journal_structural(db);
+    if (fi && fi->free_gen == db->db_hdr->h_free_gen) {
+        fi->free_gen++;
     }
-    return nerr;
+    db->db_hdr->h_free_gen++;
 }
 
-/**
- * \brief Checks the integrity of the free-list.
- * \param[in,out] db mdbm handle
- * \param[in] verbose whether to display information messages
- * \return number of check failures
+static inline void
+free_index_invalidate(MDBM* db, mdbm_free_index_t* fi)
+{
+    fi->free_gen = db->db_hdr->h_free_gen - 1;
+}
+
+/*
+ * Dirty page tracking (mdbm_set_dirty_tracking).  Pages are marked after
+ * they are modified, so that a concurrent mdbm_sync_dirty() either writes
+ * back the change or leaves the mark for the next sync.
  */
-static int
-check_db_chunks(MDBM* db, int verbose)
+static void
+dirty_mark_range(mdbm_dirty_map_t* m, uint32_t p, uint32_t npages)
 {
-    int pg;
-    int cur_free;
-    int nerr = 0;
-    mdbm_hdr_t* h = db->db_hdr;
-    int nchunks = 0;
+    uint32_t end = p + npages;
+    uint32_t hi;
 
-    pg = 0;
-    cur_free = h->h_first_free;
-    while (pg < h->h_num_pages) {
-        mdbm_page_t* page = MDBM_PAGE_PTR(db,pg);
-        nchunks++;
-        if (page->p_type == MDBM_PTYPE_FREE) {
-            if (cur_free < 0) {
-                if (verbose) {
-                    mdbm_log(LOG_NOTICE,
-                             "%s: resuming free-list checking with chunk %u",
-                             db->db_filename,pg);
-                }
-                cur_free = pg;
-            }
-            if (cur_free > 0 && pg == cur_free) {
-                cur_free = page->p.p_next_free;
-            } else {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s: chunk %u is free but not on free-list (next=%u)",
-                             db->db_filename,pg,cur_free);
-                }
-                nerr++;
-            }
-        } else if (cur_free > 0 && pg == cur_free) {
-            if (verbose) {
-                mdbm_log(LOG_CRIT,
-                         "%s: chunk %u on free-list but not marked free (type=%u)",
-                         db->db_filename,pg,page->p_type);
-            }
-            nerr++;
-            if (verbose) {
-                mdbm_log(LOG_NOTICE,
-                         "%s: free-list checking suspended",
-                         db->db_filename);
-            }
-            cur_free = -1;
-        }
-        if (cur_free > 0 && pg+page->p_num_pages > cur_free) {
-            if (verbose) {
-                mdbm_log(LOG_CRIT,
-                         "%s: chunk %u (npages=%u) overlaps next free-list chunk (%u)",
-                         db->db_filename,pg,page->p_num_pages,cur_free);
-            }
-            nerr++;
-            if (verbose) {
-                mdbm_log(LOG_NOTICE,
-                         "%s: free-list checking suspended",
-                         db->db_filename);
-            }
-            cur_free = -1;
-        }
-        if (pg == h->h_last_chunk) {
-            if (cur_free > 0) {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s: free-list (next=%u) runs past last chunk (%u)",
-                             db->db_filename,cur_free,pg);
-                }
-                nerr++;
-            }
-            break;
-        }
-        if (MDBM_PAGE_PTR(db,pg+page->p_num_pages)->p_prev_num_pages != page->p_num_pages) {
-            if (verbose) {
-                mdbm_log(LOG_CRIT,
-                         "%s: chunk %d size (npages=%u) != chunk %d prev size (npages=%u)",
-                         db->db_filename,pg,page->p_num_pages,pg+page->p_num_pages,
-                         MDBM_PAGE_PTR(db,pg+page->p_num_pages)->p_prev_num_pages);
-            }
-            nerr++;
+    if (end > MDBM_NUMPAGES_MAX) {
+        end = MDBM_NUMPAGES_MAX;
+    }
+    while (p < end) {
+        uint32_t w = p / 64;
+        uint32_t n = 64 - p % 64;
+        uint64_t bits;
+
+        if (n > end - p) {
+            n = end - p;
         }
-        if (pg+page->p_num_pages > h->h_num_pages) {
-            if (verbose) {
-                mdbm_log(LOG_CRIT,
-                         "%s: chunk %d (npages=%u) overlaps end of db (npages=%u)",
-                         db->db_filename,pg,page->p_num_pages,h->h_num_pages);
-            }
-            nerr++;
+        bits = (n == 64) ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << (p % 64);
+        if ((m->d_bits[w] & bits) != bits) {
+            atomic_or64u(&m->d_bits[w],bits);
         }
-        if (page->p_num_pages < 1) {
-            if (verbose) {
-                mdbm_log(LOG_CRIT,
-                         "%s: chunk %d invalid size (npages=%u); chunk scan aborted",
-                         db->db_filename,pg,page->p_num_pages);
-            }
-            nerr++;
-            break;
+        if (!(m->d_summary[w/64] & ((uint64_t)1 << (w%64)))) {
+            atomic_or64u(&m->d_summary[w/64],(uint64_t)1 << (w%64));
         }
-        pg += page->p_num_pages;
+        p += n;
     }
-    if (verbose > 1) {
-        mdbm_log(LOG_INFO,
-                 "%s: %d chunks checked (%d error(s))",db->db_filename,nchunks,nerr);
+    while ((hi = m->d_hi) < end && atomic_cas32u(&m->d_hi,hi,end) != hi) {
     }
-    return nerr;
 }
 
-static int
-check_db_dir_entry(MDBM* db, int i, int verbose)
+static inline void
+dirty_mark(MDBM* db, uint32_t pagenum, uint32_t npages)
 {
-    mdbm_hdr_t* h = db->db_hdr;
-    int p;
-    int nerr = 0;
-
-    if ((p = MDBM_GET_PAGE_INDEX(db,i)) != 0) {
-        if (p > h->h_last_chunk) {
-            if (verbose) {
-                mdbm_log(LOG_CRIT,
-                         "%s: directory page %u maps to chunk %u past last chunk (%u)",
-                         db->db_filename,i,p,h->h_last_chunk);
-            }
-            nerr++;
-        } else {
-            mdbm_page_t* page = MDBM_PAGE_PTR(db,p);
-            if (page->p_type != MDBM_PTYPE_DATA) {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s: directory page %u maps to non-data chunk %u"
-                             " (type=%u npages=%u)",
-                             db->db_filename,i,p,page->p_type,page->p_num_pages);
-                }
-                nerr++;
-            } else if (page->p_num != i) {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s: directory page %u != chunk %u directory page (%u)",
-                             db->db_filename,i,p,page->p_num);
-                }
-                nerr++;
-            }
-        }
+    if (db->db_dirty) {
+        dirty_mark_range(db->db_dirty,pagenum,npages);
     }
-    return nerr;
 }
 
-#define MDBM_PAGE_NOALLOC       0
-#define MDBM_PAGE_ALLOC         1
-#define MDBM_PAGE_EXISTS        2
-
-#define MDBM_PAGE_NOMAP         0
-#define MDBM_PAGE_MAP           1
-
-#define MDBM_ALLOC_NO_UNLOCK    0
-#define MDBM_ALLOC_CAN_UNLOCK   1
+/* Marks the chunk of a data page (p_num is the logical page number). */
+static inline void
+dirty_mark_page(MDBM* db, const mdbm_page_t* page)
+{
+    if (db->db_dirty) {
+        dirty_mark_range(db->db_dirty,MDBM_GET_PAGE_INDEX(db,page->p_num),
+                         page->p_num_pages);
+    }
+}
 
-static void* alloc_chunk(MDBM* db, int type, int npages, int n0, int n1, int map, int lock);
-static int free_chunk(MDBM* db, int pagenum, int* prevp);
+/* Marks the chunk starting at physical page pagenum. */
+static inline void
+dirty_mark_chunk(MDBM* db, uint32_t pagenum)
+{
+    if (db->db_dirty) {
+        dirty_mark_range(db->db_dirty,pagenum,MDBM_PAGE_PTR(db,pagenum)->p_num_pages);
+    }
+}
 
-static mdbm_page_t* pagenum_to_page(MDBM* db, int pagenum, int alloc, int map);
+static void
+dirty_mark_all(MDBM* db)
+{
+    if (db->db_dirty) {
+        db->db_dirty->d_hdr_pages = MDBM_PAGE_PTR(db,0)->p_num_pages;
+        dirty_mark_range(db->db_dirty,0,db->db_num_pages);
+    }
+}
 
+/* Maps "<db>.dirty".  *init is set if the caller is the first to map it. */
+static mdbm_shmem_t*
+dirty_map_open(const char* dbfilename, int* init)
+{
+    char path[MAXPATHLEN+1];
+    mdbm_shmem_t* mem;
+    mdbm_dirty_map_t* m;
+
+    if (snprintf(path,sizeof(path),"%s.dirty",dbfilename) >= (int)sizeof(path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((mem = mdbm_shmem_open(path,MDBM_SHMEM_RDWR|MDBM_SHMEM_CREATE|MDBM_SHMEM_TRUNC,
+                               sizeof(*m),init)) == NULL)
+    {
+        return NULL;
+    }
+    m = (mdbm_dirty_map_t*)mem->base;
+    if (!*init
+        && (mem->size != sizeof(*m)
+            || m->d_magic != MDBM_DIRTY_MAGIC || m->d_version != MDBM_DIRTY_VERSION))
+    {
+        mdbm_log(LOG_ERR,"%s: invalid dirty page map",path);
+        mdbm_shmem_close(mem,0);
+        errno = EINVAL;
+        return NULL;
+    }
+    return mem;
+}
 
-/**
- * \brief Checks the integrity of a data page.
- * - Once a specific check fails, no further checks are done.
- * - Check number of page entries in within bounds.
- * - Check number of free bytes is non-negative.
- * - Check top-of-page-marker is correct.
- * - Check each entry (key) offset is within page.
- * - Check each key length is within page.
- * - Check each entry match field is within page.
- * - Check each value length is within page.
- * - If non-windowed: check valid hash field.
- * - If non-windowed, LOB: LOB chunk is within bounds (header last_chunk).
- * - If non-windowed, LOB: LOB chunk has corresponding LOB page-type.
- * - If non-windowed, LOB: LOB internal page number matches \a pnum.
- * \param[in,out] db handle
- * \param[in] pnum page number
- * \param[in] verbose whether to display information messages
- * \param[in] level integrity check level
- * \return number of check failures
- */
 static int
-check_db_page(MDBM *db, int pnum, int verbose, int level)
+dirty_attach(MDBM* db)
 {
-    mdbm_page_t* page;
-    mdbm_entry_t* ep;
-    int index = -1;
-    int max_page_entries;
-    int mapped_pnum;
-    int nerr = 0;
+    mdbm_shmem_t* mem;
+    int init;
 
-    if ((nerr = check_db_dir_entry(db,pnum,0)) > 0) {
-        return nerr;
+    if (db->db_dirty) {
+        return 0;
+    }
+    if ((mem = dirty_map_open(db->db_filename,&init)) == NULL) {
+        return -1;
+    }
+    db->db_dirty = (mdbm_dirty_map_t*)mem->base;
+    db->db_dirty_mem = mem;
+    if (init) {
+        /* Nothing is known about pages changed before now: sync them all. */
+        db->db_dirty->d_magic = MDBM_DIRTY_MAGIC;
+        db->db_dirty->d_version = MDBM_DIRTY_VERSION;
+        db->db_dirty->d_hi = 0;
+        dirty_mark_all(db);
+        mdbm_shmem_init_complete(mem);
     }
+    return 0;
+}
 
-    if ((page = pagenum_to_page(db,pnum,MDBM_PAGE_NOALLOC,MDBM_PAGE_MAP)) == NULL) {
-        return 0;
+static void
+dirty_detach(MDBM* db)
+{
+    if (db->db_dirty_mem) {
+        mdbm_shmem_close(db->db_dirty_mem,0);
+        db->db_dirty_mem = NULL;
+        db->db_dirty = NULL;
     }
-    mapped_pnum = MDBM_GET_PAGE_INDEX(db,pnum);
+}
 
-    max_page_entries = ((page->p_num_pages*db->db_pagesize - MDBM_PAGE_T_SIZE)
-                        / MDBM_ENTRY_T_SIZE) - 1;
-    if (page->p.p_num_entries > max_page_entries) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,"%s (page %d/%d): invalid num entries: %u",
-                     db->db_filename,pnum,mapped_pnum,page->p.p_num_entries);
-        }
-        nerr++;
-    } else if (MDBM_PAGE_FREE_BYTES(page) < 0) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,"%s (page %d/%d):"
-                     " invalid page free bytes: %d (bottom-of-data=%d numentries=%d)",
-                     db->db_filename,pnum,mapped_pnum,
-                     MDBM_PAGE_FREE_BYTES(page),
-                     MDBM_DATA_PAGE_BOTTOM_OF_DATA(page),
-                     page->p.p_num_entries);
-        }
-        nerr++;
-    } else if (MDBM_ENTRY(page,page->p.p_num_entries)->e_key.match != MDBM_TOP_OF_PAGE_MARKER) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,"%s (page %d/%d):"
-                     " bad top-of-page marker: %08x (numentries=%d)",
-                     db->db_filename,pnum,mapped_pnum,
-                     MDBM_ENTRY(page,page->p.p_num_entries)->e_key.match,
-                     page->p.p_num_entries);
-        }
-        nerr++;
-    } else {
-        int offset_limit;
+#define JOURNAL_CHECKPOINT_BYTES    (64*1024*1024)
 
-        offset_limit = page->p_num_pages*db->db_pagesize;
-        for (index = 0; index < page->p.p_num_entries; index++) {
-            ep = MDBM_ENTRY(page,index);
-            if (ep->e_offset > offset_limit) {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s (page %d/%d): invalid entry offset (index %d): %u",
-                             db->db_filename,pnum,mapped_pnum,index,ep->e_offset);
-                }
-                nerr++;
-            } else if (index > 0 && ep->e_key.key.len > ep[-1].e_offset - ep[0].e_offset) {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s (page %d/%d): invalid keylen or offset problem (index %d):"
-                             " keylen=%u offsets=%d-%d=%d",
-                             db->db_filename,pnum,mapped_pnum,index,ep->e_key.key.len,
-                             ep[-1].e_offset,ep[0].e_offset,
-                             ep[-1].e_offset - ep[0].e_offset);
-                }
-                nerr++;
-            } else if (ep->e_key.match == MDBM_TOP_OF_PAGE_MARKER) {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s (page %d/%d): premature top-of-page marker (index %d)",
-                             db->db_filename,pnum,mapped_pnum,index);
-                    }
-                    nerr++;
-            } else if (ep->e_key.match) {
-                if (MDBM_VAL_LEN1(db,ep) < 0) {
-                    if (verbose) {
-                        mdbm_log(LOG_CRIT,
-                                 "%s (page %d/%d): invalid vallen (index %d): vallen=%d",
-                                 db->db_filename,pnum,mapped_pnum,index,
-                                 MDBM_VAL_LEN1(db,ep));
-                    }
-                    nerr++;
-                } else if (!MDBM_IS_WINDOWED(db)) {
-                    if (level > 3) {
-                        mdbm_hashval_t h = MDBM_HASH_VALUE(db,MDBM_KEY_PTR1(page,ep),
-                                                           MDBM_KEY_LEN1(ep));
-                        if (ep->e_key.key.hash != (h>>16)) {
-                            if (verbose) {
-                                mdbm_log(LOG_CRIT,
-                                         "%s (page %d/%d): invalid key hash (index %d)",
-                                         db->db_filename,pnum,mapped_pnum,index);
-                            }
-                            nerr++;
-                        }
-                    }
-                    if (MDBM_ENTRY_LARGEOBJ(ep)) {
-                        mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
-                        if (lp->l_pagenum > db->db_hdr->h_last_chunk) {
-                            if (verbose) {
-                                mdbm_log(LOG_CRIT,
-                                         "%s (page %d/%d):"
-                                         " invalid lob chunk (index %d): l_pagenum=%u",
-                                         db->db_filename,pnum,mapped_pnum,index,
-                                         lp->l_pagenum);
-                            }
-                            nerr++;
-                        } else {
-                            mdbm_page_t* lob = MDBM_PAGE_PTR(db,lp->l_pagenum);
-                            if (lob->p_type != MDBM_PTYPE_LOB) {
-                                if (verbose) {
-                                    mdbm_log(LOG_CRIT,
-                                             "%s (page %d/%d): chunk is not lob (index %d):"
-                                             " l_pagenum=%u type=%u",
-                                             db->db_filename,pnum,mapped_pnum,index,
-                                             lp->l_pagenum,lob->p_type);
-                                }
-                                nerr++;
-                            } else if (lob->p_num != pnum) {
-                                if (verbose) {
-                                    mdbm_log(LOG_CRIT,
-                                             "%s (page %d/%d): lob page ref mismatch (index %d):"
-                                             " l_pagenum=%u lob.p_num=%u pnum=%u",
-                                             db->db_filename,pnum,mapped_pnum,index,
-                                             lp->l_pagenum,lob->p_num,pnum);
-                                }
-                                nerr++;
-                            }
-                        }
-                    }
-                }
-                offset_limit = ep->e_offset;
-            }
-        }
-    }
+/* Per-handle state of the write-ahead journal (see MDBM_HFLAG_JOURNAL). */
+struct mdbm_journal {
+    int                 fd;         /* O_APPEND; flock()ed shared while attached */
+    mdbm_journal_hdr_t* hdr;        /* shared header page */
+    uint64_t            gen;        /* generation of our last append */
+    uint64_t            end;        /* end of our last append */
+    int                 pending;    /* appended, but not committed yet */
+    int                 failed;     /* an append failed since the last commit */
+    int                 flags;      /* MDBM_JOURNAL_* options */
+    int                 torn_pages; /* db pages span several system pages */
+    uint64_t            checkpoint_bytes;
+};
 
-    if (MDBM_IS_WINDOWED(db)) {
-        release_window_page(db,page);
+/* Notes a change to the structure of the db (page splits and merges, chunk
+ * allocation, directory and file growth).  Replaying records can't redo it,
+ * and the kernel may write back any subset of the pages it touched, so the
+ * next commit, by any handle, checkpoints instead of syncing the journal.
+ */
+static inline void
+journal_structural(MDBM* db)
+{
+    if (db->db_journal && !db->db_journal->hdr->j_structural) {
+        db->db_journal->hdr->j_structural = 1;
     }
+}
 
-    return nerr;
+/* Whether a commit has to sync the db: records can't redo what changed. */
+static inline int
+journal_needs_checkpoint(const struct mdbm_journal* j)
+{
+    return j->failed || j->torn_pages || j->hdr->j_structural;
 }
 
-/**
- * \brief Checks the integrity of the page directory.
- * \param[in,out] db handle
- * \param[in] verbose whether to display information messages
- * \return number of check failures
- */
+#ifndef F_OFD_SETLKW
+/* Plain fcntl locks don't exclude other handles in the same process. */
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Serializes group commits and checkpoints, across handles and processes. */
 static int
-check_db_dir(MDBM* db, int verbose)
+journal_lock(struct mdbm_journal* j, int lock)
 {
-    int nerr = 0;
-    int i;
-    int p;
-    mdbm_page_t* page;
-    mdbm_hdr_t* h = db->db_hdr;
-    int ndir = 0;
+    struct flock fl;
+    int ret;
 
-    page = MDBM_PAGE_PTR(db,0);
-    if (page->p_type != MDBM_PTYPE_DIR) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: chunk 0 is not directory (type=%u, npages=%u)",
-                     db->db_filename,page->p_type,page->p_num_pages);
-        }
-        nerr++;
+    memset(&fl,0,sizeof(fl));
+    fl.l_type = lock ? F_WRLCK : F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_len = 1;
+#ifdef F_OFD_SETLKW
+    while ((ret = fcntl(j->fd,F_OFD_SETLKW,&fl)) < 0 && errno == EINTR) {
     }
-    if (db->db_dir_gen == db->db_hdr->h_dir_gen
-        && memcmp(db->db_dir,MDBM_DIR_PTR(db),MDBM_DB_DIR_SIZE(db)))
+#else
+    if (lock) {
+        pthread_mutex_lock(&journal_mutex);
+    }
+    while ((ret = fcntl(j->fd,F_SETLKW,&fl)) < 0 && errno == EINTR) {
+    }
+    if (!lock || ret < 0) {
+        pthread_mutex_unlock(&journal_mutex);
+    }
+#endif
+    return ret;
+}
+
+static uint32_t
+journal_crc(const mdbm_journal_rec_t* rec, const char* key, const char* val)
+{
+    uint32_t crc = mdbm_hash_crc32c((const unsigned char*)&rec->r_op,3*sizeof(uint32_t));
+
+    crc = ((crc << 1) | (crc >> 31)) ^ mdbm_hash_crc32c((const unsigned char*)key,rec->r_ksize);
+    crc = ((crc << 1) | (crc >> 31)) ^ mdbm_hash_crc32c((const unsigned char*)val,rec->r_vsize);
+    return crc;
+}
+
+/* Appends a redo record.  Called with the key (or the whole db) locked, so
+ * records of a key are in the order the changes were applied.
+ */
+static void
+journal_append(MDBM* db, int op, const datum* key, const datum* val)
+{
+    struct mdbm_journal* j = db->db_journal;
+    mdbm_journal_rec_t rec;
+    struct iovec iov[3];
+    uint64_t tail;
+    off_t end;
+
+    rec.r_magic = MDBM_JOURNAL_REC_MAGIC;
+    rec.r_op = op;
+    rec.r_ksize = key ? key->dsize : 0;
+    rec.r_vsize = val ? val->dsize : 0;
+    rec.r_crc = journal_crc(&rec,key ? key->dptr : NULL,val ? val->dptr : NULL);
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = key ? key->dptr : NULL;
+    iov[1].iov_len = rec.r_ksize;
+    iov[2].iov_base = val ? val->dptr : NULL;
+    iov[2].iov_len = rec.r_vsize;
+
+    j->pending = 1;
+    if (writev(j->fd,iov,3) != (ssize_t)(sizeof(rec) + rec.r_ksize + rec.r_vsize)
+        || (end = lseek(j->fd,0,SEEK_CUR)) < 0)
     {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: db_dir (0x%p) out-of-sync with directory on page 0",
-                     db->db_filename,(void*)db->db_dir);
-        }
-        nerr++;
+        mdbm_logerror(LOG_ERR,0,"%s: journal write failure",db->db_filename);
+        j->failed = 1;
+        return;
     }
-    if (MDBM_DB_NUM_DIR_PAGES(db) > page->p_num_pages) {
-        if (verbose) {
-            mdbm_log(LOG_CRIT,
-                     "%s: directory chunk too small (npages=%u) for directory size (npages=%u)",
-                     db->db_filename,page->p_num_pages,MDBM_DB_NUM_DIR_PAGES(db));
+    j->gen = j->hdr->j_gen;
+    j->end = end;
+    /* Appends are serialized by the file system, so every record before
+     * ours is complete as well. */
+    while ((tail = j->hdr->j_tail) < (uint64_t)end) {
+        if (atomic_cas64u(&j->hdr->j_tail,tail,end) == tail) {
+            break;
         }
-        nerr++;
     }
+}
 
-    for (i = 0; i <= db->db_max_dirbit; i++) {
-        nerr += check_db_dir_entry(db,i,verbose);
-        ndir++;
+/* Waits until the journal is on disk up to end.  Whoever gets the journal
+ * lock first syncs every complete record, so concurrent writers share one
+ * fdatasync().
+ */
+static int
+journal_sync_to(struct mdbm_journal* j, uint64_t gen, uint64_t end)
+{
+    volatile mdbm_journal_hdr_t* hdr = j->hdr;
+    int ret = 0;
+    int err = 0;
+
+    if (hdr->j_gen != gen || hdr->j_synced >= end) {
+        return 0;
+    }
+    if (journal_lock(j,1) < 0) {
+        return -1;
     }
+    if (hdr->j_gen == gen && hdr->j_synced < end) {
+        uint64_t tail = hdr->j_tail;
 
-    p = 0;
-    while (p <= h->h_last_chunk) {
-        page = MDBM_PAGE_PTR(db,p);
-        if (page->p_type == MDBM_PTYPE_DATA) {
-            if (page->p_num > db->db_max_dirbit) {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s: invalid directory page (%u) referenced by chunk %u",
-                             db->db_filename,page->p_num,p);
-                }
-                nerr++;
-            } else if (MDBM_GET_PAGE_INDEX(db,page->p_num) != p) {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s: chunk/directory page mismatch (chunk=%u dir[%u]=%u)",
-                             db->db_filename,p,page->p_num,MDBM_GET_PAGE_INDEX(db,page->p_num));
-                }
-                nerr++;
-            }
-        }
-        if (page->p_num_pages < 1) {
-            if (verbose) {
-                mdbm_log(LOG_CRIT,
-                         "%s: chunk %d invalid size (npages=%u); dir/page check aborted",
-                         db->db_filename,p,page->p_num_pages);
-            }
-            nerr++;
-            break;
+        if (fdatasync(j->fd) < 0) {
+            err = errno;
+            ret = -1;
+        } else {
+            hdr->j_synced = tail;
         }
-        p += page->p_num_pages;
     }
-    if (verbose > 1) {
-        mdbm_log(LOG_INFO,
-                 "%s: %d directory entries checked (%d error(s))",db->db_filename,ndir,nerr);
+    journal_lock(j,0);
+    if (ret < 0) {
+        errno = err;
     }
-    return nerr;
+    return ret;
 }
 
-/**
- * \brief Checks the integrity of all data pages.
- * \param[in,out] db handle
- * \param[in] verbose whether to display information messages
- * \param[in] level integrity check level
- * \return number of check failures
+/* Syncs the db, then empties the journal.  If gen is non-zero, the
+ * checkpoint is skipped if one has been done since that generation.
  */
 static int
-check_db_pages(MDBM* db, int verbose, int level)
+journal_checkpoint(MDBM* db, struct mdbm_journal* j, uint64_t gen)
 {
-    int nerr = 0;
-    int i;
-    int npages = 0;
+    int ret = 0;
+    int err = 0;
 
-    for (i = 0; i <= db->db_max_dirbit; i++) {
-        if (MDBM_GET_PAGE_INDEX(db,i)) {
-            nerr += check_db_page(db,i,verbose,level);
-            npages++;
+    if (lock_db(db) < 0) {
+        return -1;
+    }
+    if (journal_lock(j,1) < 0) {
+        err = errno;
+        unlock_db(db);
+        errno = err;
+        return -1;
+    }
+    if (!gen || j->hdr->j_gen == gen) {
+        if (fsync(db->db_fd) < 0 || ftruncate(j->fd,MDBM_JOURNAL_HDR_SIZE) < 0) {
+            err = errno;
+            mdbm_logerror(LOG_ERR,0,"%s: journal checkpoint failure",db->db_filename);
+            ret = -1;
+        } else {
+            ++j->hdr->j_gen;
+            j->hdr->j_tail = j->hdr->j_synced = MDBM_JOURNAL_HDR_SIZE;
+            j->hdr->j_structural = 0;
         }
     }
-    if (verbose > 1) {
-        mdbm_log(LOG_INFO,
-                 "%s: %d db pages checked (%d error(s))",db->db_filename,npages,nerr);
+    journal_lock(j,0);
+    unlock_db(db);
+    if (ret < 0) {
+        errno = err;
     }
-    return nerr;
+    return ret;
 }
 
-/**
- * \brief Checks the integrity of all large objects.
- * \param[in,out] db handle
- * \param[in] verbose whether to display information messages
- * \return number of check failures
+/* Makes this handle's journaled changes durable (unless the handle asked
+ * for MDBM_JOURNAL_NOSYNC).  Changes made while the caller holds a lock are
+ * committed when the last lock is released.  Structural changes, made by
+ * any handle, are committed by a checkpoint.
  */
 static int
-check_db_lobs(MDBM* db, int verbose)
+journal_commit(MDBM* db)
 {
-    int nerr = 0;
-    mdbm_hdr_t* h = db->db_hdr;
-    int p;
-    int nlobs = 0;
-
-    p = 0;
-    while (p <= h->h_last_chunk) {
-        mdbm_page_t* lob = MDBM_PAGE_PTR(db,p);
-        if (lob->p_type == MDBM_PTYPE_LOB) {
-            if (lob->p_num > db->db_max_dirbit) {
-                if (verbose) {
-                    mdbm_log(LOG_CRIT,
-                             "%s: invalid lob page ref: chunk=%u p_num=%u",
-                             db->db_filename,p,lob->p_num);
-                    nerr++;
-                }
-            } else {
-                mdbm_page_t* page;
-                if ((page = pagenum_to_page(db,lob->p_num,MDBM_PAGE_NOALLOC,MDBM_PAGE_NOMAP))) {
-                    mdbm_entry_t* ep;
+    struct mdbm_journal* j = db->db_journal;
 
-                    for (ep = MDBM_ENTRY(page,0); ep->e_key.match != MDBM_TOP_OF_PAGE_MARKER; ep++)
-                    {
-                        if (ep->e_key.match && MDBM_ENTRY_LARGEOBJ(ep)) {
-                            mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
-                            if (lp->l_pagenum == p) {
-                                break;
-                            }
-                        }
-                    }
-                } else {
-                    if (verbose) {
-                        mdbm_log(LOG_CRIT,
-                                 "%s: lob page ref not allocated: chunk=%u p_num=%u",
-                                 db->db_filename,p,lob->p_num);
-                        nerr++;
-                    }
-                }
-            }
-            nlobs++;
-        }
-        if (lob->p_num_pages < 1) {
-            if (verbose) {
-                mdbm_log(LOG_CRIT,
-                         "%s: chunk %d invalid size (npages=%u); lob check aborted",
-                         db->db_filename,p,lob->p_num_pages);
-            }
-            nerr++;
-            break;
-        }
-        p += lob->p_num_pages;
+    if (!j || (!j->pending && !j->hdr->j_structural)
+        || db_is_owned(db) > 0 || db_part_owned(db) > 0)
+    {
+        return 0;
     }
-    if (verbose > 1) {
-        mdbm_log(LOG_INFO,
-                 "%s: %d large objects checked (%d error(s))",db->db_filename,nlobs,nerr);
+    j->pending = 0;
+    if (j->failed || (!(j->flags & MDBM_JOURNAL_NOSYNC) && journal_needs_checkpoint(j))) {
+        /* The journal may have a torn record, or the db a torn structure:
+         * sync the db instead. */
+        j->failed = 0;
+        return journal_checkpoint(db,j,0);
     }
-    return nerr;
+    if (!(j->flags & MDBM_JOURNAL_NOSYNC) && journal_sync_to(j,j->gen,j->end) < 0) {
+        mdbm_logerror(LOG_ERR,0,"%s: journal sync failure",db->db_filename);
+        return -1;
+    }
+    if (j->checkpoint_bytes && j->end >= MDBM_JOURNAL_HDR_SIZE + j->checkpoint_bytes) {
+        (void)journal_checkpoint(db,j,j->gen);
+    }
+    return 0;
 }
 
-/**
- * \brief Check integrity of file header, free-list, data pages, and large objects.
- * \param[in,out] db mdbm handle
- * \param[in] level minimum level of checking
- * \param[in] maxlevel maximum level of checking
- * \param[in] verbose whether to display check information
- */
+static int protect_dir(MDBM* db, int protect);
+static void filter_rebuild_all(MDBM* db);
+
+/* Re-applies the complete records of a journal left by a crash. */
 static int
-check_db(MDBM* db, int level, int maxlevel, int verbose)
+journal_replay(MDBM* db, struct mdbm_journal* j)
 {
-    int nerr = 0;
+    mdbm_journal_rec_t rec;
+    struct stat st;
+    off_t off = MDBM_JOURNAL_HDR_SIZE;
+    char* buf = NULL;
+    size_t bufsize = 0;
+    int n = 0;
+    int ret = 0;
 
-    if (check_guard_padding(db, 0) != 0) {
-        ++nerr;
+    if (fstat(j->fd,&st) < 0) {
+        return -1;
     }
-
-    nerr += check_db_header(db,db->db_hdr,verbose);
-    if (level <= maxlevel && level > 0) {
-        nerr += check_db_chunks(db,verbose);
-        if (level <= maxlevel && level > 1) {
-            nerr += check_db_dir(db,verbose);
-            if (level <= maxlevel && level > 2) {
-                nerr += check_db_pages(db,verbose,level);
-                nerr += check_db_lobs(db,verbose);
-            }
+    if (MDBM_HAS_FILTER(db)) {
+        /* A filter may have reached the disk without the pages it covers,
+         * which would hide their keys from the replayed stores. */
+        if (lock_db(db) < 0) {
+            return -1;
         }
+        protect_dir(db,0);
+        filter_rebuild_all(db);
+        protect_dir(db,1);
+        unlock_db(db);
     }
-    return nerr;
-}
-
-static int
-check_empty(MDBM* db)
-{
-    int i;
-    int empty = 1;
+    while (off + (off_t)sizeof(rec) <= st.st_size) {
+        datum k, v;
+        size_t len;
 
-    for (i = 0; i <= db->db_max_dirbit; i++) {
-        mdbm_page_t* page;
-        if ((page = pagenum_to_page(db,i,MDBM_PAGE_NOALLOC,MDBM_PAGE_NOMAP))) {
-            if (page->p.p_num_entries > 0) {
-                empty = 0;
-            }
-            if (MDBM_IS_WINDOWED(db)) {
-                release_window_page(db,page);
-            }
-            if (!empty) {
+        if (pread(j->fd,&rec,sizeof(rec),off) != sizeof(rec)
+            || rec.r_magic != MDBM_JOURNAL_REC_MAGIC
+            || rec.r_ksize > MDBM_KEYLEN_MAX || rec.r_vsize > MDBM_VALLEN_MAX)
+        {
+            break;
+        }
+        len = (size_t)rec.r_ksize + rec.r_vsize;
+        if (off + (off_t)(sizeof(rec) + len) > st.st_size) {
+            break;
+        }
+        if (len > bufsize) {
+            char* p = (char*)realloc(buf,len);
+            if (!p) {
+                ret = -1;
                 break;
             }
+            buf = p;
+            bufsize = len;
+        }
+        if (pread(j->fd,buf,len,off + sizeof(rec)) != (ssize_t)len
+            || journal_crc(&rec,buf,buf + rec.r_ksize) != rec.r_crc)
+        {
+            break;
+        }
+        k.dptr = buf;
+        k.dsize = rec.r_ksize;
+        v.dptr = buf + rec.r_ksize;
+        v.dsize = rec.r_vsize;
+        switch (rec.r_op) {
+        case MDBM_JOURNAL_OP_STORE:
+            ret = mdbm_store(db,k,v,MDBM_REPLACE);
+            break;
+        case MDBM_JOURNAL_OP_DUP:
+            ret = mdbm_store(db,k,v,MDBM_INSERT_DUP);
+            break;
+        case MDBM_JOURNAL_OP_DELETE:
+            if ((ret = mdbm_delete(db,k)) < 0 && errno == ENOENT) {
+                ret = 0;
+            }
+            break;
+        case MDBM_JOURNAL_OP_PURGE:
+            mdbm_purge(db);
+            break;
+        default:
+            mdbm_log(LOG_ERR,"%s: unknown journal record op %u",db->db_filename,rec.r_op);
+            ret = -1;
+            errno = EINVAL;
         }
+        if (ret < 0) {
+            mdbm_logerror(LOG_ERR,0,"%s: journal replay failure at offset %llu",
+                          db->db_filename,(unsigned long long)off);
+            break;
+        }
+        off += sizeof(rec) + len;
+        ++n;
     }
-    return empty;
+    free(buf);
+    if (ret < 0) {
+        return -1;
+    }
+    if (off < st.st_size) {
+        mdbm_log(LOG_WARNING,"%s: ignoring %llu bytes of incomplete journal records",
+                 db->db_filename,(unsigned long long)(st.st_size - off));
+    }
+    mdbm_log(LOG_NOTICE,"%s: replayed %d journal records",db->db_filename,n);
+    return 0;
 }
 
-#if 0
 static void
-print_dir(MDBM* db, mdbm_page_t* page)
+journal_free(struct mdbm_journal* j)
 {
-    int i;
-    int base = MDBM_ENTRY(page,0)->e_offset;
-
-    for (i = 0; i <= page->p.p_num_entries; i++) {
-        mdbm_entry_t* ep = MDBM_ENTRY(page,i);
-        printf(" [%d]%s%d(%d)",i,ep->e_key.key.len ? "" : "*",ep->e_offset,base - ep->e_offset);
+    if (j->hdr) {
+        munmap(j->hdr,MDBM_JOURNAL_HDR_SIZE);
     }
-    printf(" (num=%d free=%d)\n",page->p.p_num_entries,MDBM_PAGE_FREE_BYTES(page));
+    if (j->fd >= 0) {
+        close(j->fd);
+    }
+    free(j);
 }
-#endif
 
+/* Opens "<db>.journal".  The first handle to open it replays (if replay is
+ * set) whatever a crash left in it, and checkpoints.  Attached handles hold
+ * a shared flock() on the file.
+ */
 static int
-find_free_chunk(MDBM* db, int npages, int n0, int n1, int* tot_free_pages)
+journal_attach(MDBM* db, int replay)
 {
-    int n;
-    int best_alloc = 0;
-    int best_alloc_prev = 0;
-    int best_alloc_pages = db->db_num_pages;
-    int num_free = 0;
-    int prev = 0;
-
-    n = db->db_hdr->h_first_free;
-    while (n > 0) {
-        mdbm_page_t* page = MDBM_PAGE_PTR(db,n);
-        if (!n0 || n+page->p_num_pages <= n0 || n > n1) {
-            if (page->p_num_pages == npages) {
-                alloc_free_chunk(db,npages,n,prev);
-                return n;
-            }
-            num_free += page->p_num_pages;
+    char path[MAXPATHLEN+1];
+    struct mdbm_journal* j;
+    mdbm_journal_hdr_t* hdr;
+    struct stat st;
+    int first;
+    int err;
 
-            if (page->p_num_pages > npages) {
-                if (page->p_num_pages < best_alloc_pages) {
-                    best_alloc_prev = prev;
-                    best_alloc = n;
-                    best_alloc_pages = page->p_num_pages;
-                }
-            }
-            if (page->p.p_next_free == n) {
-                mdbm_log(LOG_CRIT, "%s: invalid next_free (%d vs %d) in find_free_chunk",
-                         db->db_filename, page->p.p_next_free, n);
-                abort();
-            }
+    if (db->db_journal) {
+        return 0;
+    }
+    if (snprintf(path,sizeof(path),"%s.journal",db->db_filename) >= (int)sizeof(path)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fstat(db->db_fd,&st) < 0
+        || (j = (struct mdbm_journal*)calloc(1,sizeof(*j))) == NULL)
+    {
+        return -1;
+    }
+    j->checkpoint_bytes = JOURNAL_CHECKPOINT_BYTES;
+    j->torn_pages = db->db_pagesize > getpagesize();
+    if ((j->fd = open(path,O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC,st.st_mode & 0666)) < 0) {
+        goto attach_error;
+    }
+    first = !flock(j->fd,LOCK_EX|LOCK_NB);
+    if ((!first && flock(j->fd,LOCK_SH) < 0) || fstat(j->fd,&st) < 0) {
+        goto attach_error;
+    }
+    if (st.st_size < MDBM_JOURNAL_HDR_SIZE) {
+        if (!first) {
+            errno = EINVAL;
+            goto attach_error;
+        }
+        if (ftruncate(j->fd,MDBM_JOURNAL_HDR_SIZE) < 0) {
+            goto attach_error;
         }
-        prev = n;
-        n = page->p.p_next_free;
     }
-    if (best_alloc) {
-        alloc_free_chunk(db,npages,best_alloc,best_alloc_prev);
-        return best_alloc;
+    if ((hdr = (mdbm_journal_hdr_t*)mmap(NULL,MDBM_JOURNAL_HDR_SIZE,PROT_READ|PROT_WRITE,
+                                         MAP_SHARED,j->fd,0)) == MAP_FAILED)
+    {
+        goto attach_error;
     }
-    *tot_free_pages = num_free;
+    j->hdr = hdr;
+    if (hdr->j_magic != MDBM_JOURNAL_MAGIC || hdr->j_version != MDBM_JOURNAL_VERSION) {
+        if (!first) {
+            errno = EINVAL;
+            goto attach_error;
+        }
+        /* A new journal, or one this version can't read. */
+        if (ftruncate(j->fd,MDBM_JOURNAL_HDR_SIZE) < 0) {
+            goto attach_error;
+        }
+        hdr->j_version = MDBM_JOURNAL_VERSION;
+        hdr->j_gen = 1;
+        hdr->j_tail = hdr->j_synced = MDBM_JOURNAL_HDR_SIZE;
+        hdr->j_magic = MDBM_JOURNAL_MAGIC;
+    } else if (first && st.st_size > MDBM_JOURNAL_HDR_SIZE) {
+        if ((replay && journal_replay(db,j) < 0) || journal_checkpoint(db,j,0) < 0) {
+            goto attach_error;
+        }
+    }
+    if (first && flock(j->fd,LOCK_SH) < 0) {
+        goto attach_error;
+    }
+    db->db_journal = j;
     return 0;
+
+  attach_error:
+    err = errno;
+    mdbm_logerror(LOG_ERR,0,"%s: unable to attach journal",path);
+    journal_free(j);
+    errno = err;
+    return -1;
 }
 
-static int
-fixup_lob_pointer(MDBM* db, int data_page, int lob_page, int new_lob_page)
+/* With checkpoint set, the last handle to detach empties the journal. */
+static void
+journal_detach(MDBM* db, int checkpoint)
 {
-    mdbm_page_t* page = pagenum_to_page(db,data_page,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
-    mdbm_entry_t* ep;
+    struct mdbm_journal* j = db->db_journal;
 
-    for (ep = MDBM_ENTRY(page,0); ep->e_key.match != MDBM_TOP_OF_PAGE_MARKER; ep++) {
-        if (ep->e_key.match && MDBM_ENTRY_LARGEOBJ(ep)) {
-            mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
-            if (lp->l_pagenum == lob_page) {
-                lp->l_pagenum = new_lob_page;
-                return 0;
-            }
-        }
+    if (!j) {
+        return;
     }
-    return -1;
+    (void)journal_commit(db);
+    if (checkpoint && !flock(j->fd,LOCK_EX|LOCK_NB)
+        && lseek(j->fd,0,SEEK_END) > MDBM_JOURNAL_HDR_SIZE)
+    {
+        (void)journal_checkpoint(db,j,0);
+    }
+    db->db_journal = NULL;
+    journal_free(j);
 }
 
-static int
-clear_pages(MDBM* db, int p0, int npages)
-{
-    int n;
-    mdbm_page_t* page;
-    int p1 = p0 + npages - 1;
-    int prev = 0;
+#define CHANGE_RING_DEFAULT_SIZE    (64*1024*1024)
+#define CHANGE_REC_LEN(n)           (((n) + 7) & ~(uint64_t)7)
 
-    /* fprintf(stderr, "=============> clear_pages(%p, %d, %d)\n", (void*)db, p0, npages); */
-    if (p1 >= db->db_num_pages) {
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "clear_pages failed, p1=%u, db_num_pages=%u",
-                 p1, db->db_num_pages);
-#endif
-        errno = ENOMEM;
-        return -1;
-    }
+static uint64_t
+changes_epoch(uint64_t old)
+{
+    struct timeval tv;
+    uint64_t e;
 
-    for (n = p0; n <= p1 && n <= db->db_hdr->h_last_chunk;) {
-        page = MDBM_PAGE_PTR(db,n);
-        if (page->p_type != MDBM_PTYPE_FREE) {
-            mdbm_page_t* new_page;
-            int new_pagenum;
-            int prev_num_pages;
+    gettimeofday(&tv,NULL);
+    e = (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+    return (e > old) ? e : old+1;
+}
 
-            page = MDBM_MAPPED_PAGE_PTR(db,n);
-            if ((new_page = alloc_chunk(db,page->p_type,page->p_num_pages,p0,p1,MDBM_PAGE_MAP,0))
-                == NULL)
-            {
-                return -1;
-            }
+static void
+changes_lock(mdbm_change_ring_hdr_t* r)
+{
+    uint32_t pid = getpid();
+    uint32_t owner;
+    int spins = 0;
 
-            new_pagenum = new_page->p_num;
-            prev_num_pages = new_page->p_prev_num_pages;
-            memcpy(new_page,page,page->p_num_pages * db->db_pagesize);
-            new_page->p_prev_num_pages = prev_num_pages;
-            if (new_page->p_type == MDBM_PTYPE_DATA) {
-/* fprintf(stderr, "=============> clear_pages(%p, %d, %d) n=%d->%d DATA\n", (void*)db, p0, npages, n, new_pagenum); */
-/*              printf("move data page %d: %d -> %d\n", */
-/*                     page->p_num, */
-/*                     n, */
-/*                     new_pagenum); */
-                MDBM_SET_PAGE_INDEX(db,page->p_num, new_pagenum);
-            } else if (new_page->p_type == MDBM_PTYPE_LOB) {
-/* fprintf(stderr, "=============> clear_pages(%p, %d, %d) n=%d->%d LOB\n", (void*)db, p0, npages, n, new_pagenum); */
-/*              printf("move lob page %d: %d -> %d\n", */
-/*                     page->p_num, */
-/*                     n, */
-/*                     new_pagenum); */
-                fixup_lob_pointer(db,page->p_num,n,new_pagenum);
-            }
-            n = free_chunk(db,n,&prev);
-            if (n < p0) {
-                p0 = n;
-            }
-            page = MDBM_PAGE_PTR(db,n);
+    while ((owner = atomic_cas32u(&r->r_lock,0,pid)) != 0) {
+        if (++spins < 1000) {
+            atomic_pause();
+            continue;
+        }
+        spins = 0;
+        if (owner != pid && kill(owner,0) < 0 && errno == ESRCH) {
+            /* The writer died holding the lock; what it appended is complete
+             * up to r_head. */
+            atomic_cas32u(&r->r_lock,owner,0);
+        } else {
+            sched_yield();
         }
-        n += page->p_num_pages;
-    }
-
-    if (p0 > db->db_hdr->h_last_chunk) {
-        mdbm_page_t* last_page = MDBM_PAGE_PTR(db,db->db_hdr->h_last_chunk);
-        assert(p0 == db->db_hdr->h_last_chunk + last_page->p_num_pages);
-        page = MDBM_PAGE_PTR(db,p0);
-        /* this is a placeholder type designation to keep the sanity checks happy */
-        page->p_type = MDBM_PTYPE_DATA;
-        page->p_num_pages = npages;
-        page->p_prev_num_pages = last_page->p_num_pages;
-        db->db_hdr->h_last_chunk = p0;
-    } else {
-        alloc_free_chunk(db,npages,p0,-1);
-        page = MDBM_PAGE_PTR(db,p0);
-        /* this is a placeholder type designation to keep the sanity checks happy */
-        page->p_type = MDBM_PTYPE_DATA;
-        page->p_num_pages = npages;
     }
-
-    CHECK_DB(db);
-
-    return p0;
 }
 
-static int
-find_defrag_free_chunk(MDBM* db, int npages)
+static void
+changes_unlock(mdbm_change_ring_hdr_t* r)
 {
-    int n;
-    int best_moved = db->db_num_pages;
-    int best_maxmove = db->db_num_pages;
-    int best_n0 = 0;
-
-/*     printf("defrag npages=%d dbpages=%d\n",npages,db->db_num_pages); */
+    atomic_barrier();
+    r->r_lock = 0;
+}
 
-    {
-        int got;
+/* Drops the oldest records until none of them overlaps the space up to end. */
+static void
+changes_evict(mdbm_change_ring_hdr_t* r, uint64_t end)
+{
+    const char* base = (const char*)r + MDBM_CHANGE_RING_HDR_SIZE;
 
-        got = 0;
-        n = MDBM_PAGE_PTR(db,0)->p_num_pages;
-        while (got < npages && n <= db->db_hdr->h_last_chunk) {
-            mdbm_page_t* p = MDBM_PAGE_PTR(db,n);
-            int num = p->p_num_pages;
-            if (p->p_type != MDBM_PTYPE_FREE && num > 1) {
-                got = 0;
-            } else {
-                if (!got) {
-                    best_n0 = n;
-                }
-                got += num;
-            }
-            n += num;
-        }
+    while (r->r_tail < r->r_head && r->r_tail + r->r_size < end) {
+        uint64_t off = r->r_tail % r->r_size;
+        const mdbm_change_rec_t* c = (const mdbm_change_rec_t*)(base + off);
 
-        if (got >= npages) {
-            if ((n = clear_pages(db,best_n0,npages)) > 0) {
-                return n;
+        if (r->r_size - off < sizeof(*c)) {
+            r->r_tail += r->r_size - off;
+        } else if (c->c_len < sizeof(*c) || c->c_len > r->r_size - off) {
+            mdbm_log(LOG_ERR,"invalid change ring record at %llu, dropping all records",
+                     (unsigned long long)r->r_tail);
+            r->r_tail = r->r_head;
+            r->r_tail_seq = r->r_next_seq;
+        } else {
+            r->r_tail += c->c_len;
+            if (c->c_op) {
+                r->r_tail_seq = c->c_seq+1;
             }
         }
     }
+    /* Readers must see the new tail before the records are overwritten. */
+    atomic_barrier();
+}
 
-    n = db->db_hdr->h_first_free;
-    while (n > 0) {
-        mdbm_page_t* n0p;
-        int n0, n1, got, moved, maxmove, next;
-
-        got = 0;
-        n0 = n1 = n;
-        n0p = MDBM_PAGE_PTR(db,n);
+/* Appends a change record.  Called with the key (or the whole db) locked, so
+ * records of a key are in the order the changes were applied.
+ */
+static void
+changes_append(MDBM* db, int op, const datum* key, const datum* val)
+{
+    mdbm_change_ring_hdr_t* r = db->db_changes;
+    char* base = (char*)r + MDBM_CHANGE_RING_HDR_SIZE;
+    mdbm_change_rec_t* c;
+    uint32_t ksize = key ? key->dsize : 0;
+    uint32_t vsize = val ? val->dsize : 0;
+    uint64_t len, start, off;
+    int flags = 0;
+    int err = errno;
+
+    len = CHANGE_REC_LEN(sizeof(*c) + ksize + vsize);
+    if (len > r->r_size/4) {
+        vsize = 0;
+        flags = MDBM_CHANGE_NOVAL;
+        len = CHANGE_REC_LEN(sizeof(*c) + ksize);
+    }
+    changes_lock(r);
+    start = r->r_head;
+    off = start % r->r_size;
+    if (r->r_size - off < len) {
+        /* Records don't wrap: skip the end of the ring. */
+        start += r->r_size - off;
+        changes_evict(r,start + len);
+        if (r->r_size - off >= sizeof(*c)) {
+            c = (mdbm_change_rec_t*)(base + off);
+            c->c_len = r->r_size - off;
+            c->c_op = 0;
+            c->c_flags = 0;
+            c->c_seq = 0;
+            c->c_ksize = c->c_vsize = 0;
+        }
+        off = 0;
+    } else {
+        changes_evict(r,start + len);
+    }
+    c = (mdbm_change_rec_t*)(base + off);
+    c->c_len = len;
+    c->c_op = op;
+    c->c_flags = flags;
+    c->c_seq = r->r_next_seq;
+    c->c_ksize = ksize;
+    c->c_vsize = vsize;
+    if (ksize) {
+        memcpy(c+1,key->dptr,ksize);
+    }
+    if (vsize) {
+        memcpy((char*)(c+1) + ksize,val->dptr,vsize);
+    }
+    atomic_barrier();
+    r->r_head = start + len;
+    r->r_next_seq++;
+    changes_unlock(r);
+    errno = err;
+}
 
-/*      printf("  n=%d\n",n); */
+/* Maps "<db>.changes", creating it with a record area of size bytes (or, if
+ * size is 0, keeping the size of an existing ring).
+ */
+static mdbm_shmem_t*
+changes_open(const char* dbfilename, uint64_t size)
+{
+    char path[MAXPATHLEN+1];
+    mdbm_shmem_t* mem;
+    mdbm_change_ring_hdr_t* r;
+    struct stat st;
+    int init;
 
-        maxmove = moved = 0;
-        while (got < npages) {
-            mdbm_page_t* n0pnew;
-            mdbm_page_t* n1pnew;
-            if (n0p && n0p->p_type != MDBM_PTYPE_DIR) {
-                n0pnew = MDBM_PAGE_PTR(db,n0 - n0p->p_prev_num_pages);
-            } else {
-                n0pnew = NULL;
-            }
-            if (n1 <= db->db_hdr->h_last_chunk) {
-                n1pnew = MDBM_PAGE_PTR(db,n1);
-            } else {
-                if (n1 < db->db_num_pages) {
-                    got += db->db_num_pages - n1;
-                    n1 = db->db_num_pages;
-                    if (got >= npages) {
-                        break;
-                    }
-                }
-                n1pnew = NULL;
-            }
-/*          printf("   n0:%d-%d=%d n1:%d+%d=%d got=%d\n", */
-/*                 n0,n0pnew ? n0p->p_prev_num_pages : 0, */
-/*                 n0pnew ? n0 - n0p->p_prev_num_pages : 0, */
-/*                 n1,n1pnew ? n1pnew->p_num_pages : 0, */
-/*                 n1pnew ? n1 + n1pnew->p_num_pages : 0, */
-/*                 got); */
-            if (n0pnew && (!n1pnew
-                           || n0pnew->p_type == MDBM_PTYPE_FREE
-                           || (got + n1pnew->p_num_pages > npages
-                               && n0pnew->p_num_pages < n1pnew->p_num_pages)
-                           || (n0pnew->p_num_pages >= n1pnew->p_num_pages)))
-            {
-                n0p = n0pnew;
-                n0 -= n0p->p_num_pages;
-                got += n0p->p_num_pages;
-                if (n0p->p_type != MDBM_PTYPE_FREE) {
-                    if (n0p->p_num_pages > maxmove) {
-                        maxmove = n0p->p_num_pages;
-                    }
-                    moved += n0p->p_num_pages;
-                }
-            } else if (n1pnew) {
-                got += n1pnew->p_num_pages;
-                n1 += n1pnew->p_num_pages;
-                if (n1pnew->p_type != MDBM_PTYPE_FREE) {
-                    if (n1pnew->p_num_pages > maxmove) {
-                        maxmove = n1pnew->p_num_pages;
-                    }
-                    moved += n1pnew->p_num_pages;
-                }
-            }
-            if (!n0pnew && !n1pnew) {
-                break;
-            }
-        }
-        if (got >= npages
-            && (maxmove < best_maxmove
-                || (maxmove == best_maxmove
-                    && moved < best_moved)))
+    if (snprintf(path,sizeof(path),"%s.changes",dbfilename) >= (int)sizeof(path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!size) {
+        size = (!stat(path,&st) && st.st_size > MDBM_CHANGE_RING_HDR_SIZE)
+            ? (uint64_t)st.st_size - MDBM_CHANGE_RING_HDR_SIZE
+            : CHANGE_RING_DEFAULT_SIZE;
+    }
+    if ((mem = mdbm_shmem_open(path,MDBM_SHMEM_RDWR|MDBM_SHMEM_CREATE|MDBM_SHMEM_TRUNC,
+                               MDBM_CHANGE_RING_HDR_SIZE + size,&init)) == NULL)
+    {
+        return NULL;
+    }
+    r = (mdbm_change_ring_hdr_t*)mem->base;
+    if (init) {
+        if (r->r_magic != MDBM_CHANGE_RING_MAGIC || r->r_version != MDBM_CHANGE_RING_VERSION
+            || r->r_size != size)
         {
-            best_moved = moved;
-            best_maxmove = maxmove;
-            best_n0 = n0;
-            if (moved == 1 || got == npages) {
-                break;
-            }
-        }
-        next = MDBM_PAGE_PTR(db,n)->p.p_next_free;
-        assert(next > n || !next);
-        n = next;
+            r->r_version = MDBM_CHANGE_RING_VERSION;
+            r->r_epoch = changes_epoch(0);
+            r->r_size = size;
+            r->r_head = r->r_tail = 0;
+            r->r_tail_seq = r->r_next_seq = 1;
+            r->r_magic = MDBM_CHANGE_RING_MAGIC;
+        }
+        /* Nobody else has it mapped: a lock left by a crash is stale. */
+        r->r_lock = 0;
+        mdbm_shmem_init_complete(mem);
+    } else if (mem->size != MDBM_CHANGE_RING_HDR_SIZE + r->r_size
+               || r->r_magic != MDBM_CHANGE_RING_MAGIC
+               || r->r_version != MDBM_CHANGE_RING_VERSION)
+    {
+        mdbm_log(LOG_ERR,"%s: invalid change ring",path);
+        mdbm_shmem_close(mem,0);
+        errno = EINVAL;
+        return NULL;
+    } else if (r->r_size != size) {
+        mdbm_log(LOG_ERR,"%s: change ring is in use with a size of %llu",
+                 path,(unsigned long long)r->r_size);
+        mdbm_shmem_close(mem,0);
+        errno = EBUSY;
+        return NULL;
     }
+    return mem;
+}
 
-    if (!best_n0) {
-        return -1;
+/* Returns the change ring of a writable handle, attaching to it if needed. */
+static mdbm_change_ring_hdr_t*
+changes_ring(MDBM* db)
+{
+    mdbm_shmem_t* mem;
+
+    if (!db->db_changes && !MDBM_IS_RDONLY(db)) {
+        if ((mem = changes_open(db->db_filename,0)) == NULL) {
+            mdbm_logerror(LOG_ERR,0,"%s: unable to attach change ring",db->db_filename);
+            return NULL;
+        }
+        db->db_changes = (mdbm_change_ring_hdr_t*)mem->base;
+        db->db_changes_mem = mem;
     }
+    return db->db_changes;
+}
 
-    if ((n = clear_pages(db,best_n0,npages)) < 0) {
-        return -1;
+static void
+changes_detach(MDBM* db)
+{
+    if (db->db_changes_mem) {
+        mdbm_shmem_close(db->db_changes_mem,0);
+        db->db_changes_mem = NULL;
+        db->db_changes = NULL;
     }
+}
 
-/*     printf("defrag n0=%d npages=%d: n=%d\n",best_n0,npages,n); */
-    CHECK_DB(db);
+/* Tells consumers of the change ring to resync. */
+static void
+changes_new_epoch(MDBM* db)
+{
+    mdbm_change_ring_hdr_t* r;
 
-    return n;
+    if ((r = changes_ring(db)) != NULL) {
+        changes_lock(r);
+        r->r_epoch = changes_epoch(r->r_epoch);
+        changes_unlock(r);
+    }
 }
 
-static int
-map(MDBM* db, void* start_addr, off_t start_offset, size_t len, char** base, size_t* base_len)
+static inline int
+logs_changes(MDBM* db)
 {
-    void* m;
-    int prot = MDBM_IS_RDONLY(db) ? PROT_READ : (PROT_READ|PROT_WRITE);
-    int mapflags = MAP_SHARED;
-    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
-        mapflags |= MAP_ANON;
-    }
-#ifdef FREEBSD
-    mapflags |= MAP_NOCORE;
-    if ((db->db_flags & (MDBM_DBFLAG_ASYNC|MDBM_DBFLAG_FSYNC)) == 0) {
-        mapflags |= MAP_NOSYNC;
-    }
-#endif
-    len = (len+db->db_sys_pagesize-1) & ~((size_t)db->db_sys_pagesize-1);
-    if (MAP_FAILED == (m = mmap(start_addr,len, prot, mapflags,db->db_fd,start_offset))) {
-        mdbm_logerror(LOG_ERR,0,"%s: mmap failure mmap(%p, %llu, %d, %d, %d, %lld)",
-            db->db_filename,
-            (void*)start_addr, (unsigned long long)len, prot, mapflags, db->db_fd,
-            (long long)start_offset);
-        return -1;
-    }
-    /*fprintf(stderr, "map::mmap(%p, %d, %d, %d, %d, %d) = %p\n", start_addr, len, prot, */
-    /*              mapflags,db->db_fd,(int)start_offset, m); */
-
-    *base = m;
-    *base_len = len;
-    return 0;
+    return db->db_journal || MDBM_HAS_CHANGES(db);
 }
 
-static int
-protect_dir(MDBM* db, int protect)
+/* Records a change in the journal and the change ring, if they are enabled. */
+static void
+log_change(MDBM* db, int op, const datum* key, const datum* val)
 {
-    int dir_size;
-    int used;
-    int total;
-
-    if (db->db_flags & MDBM_DBFLAG_HDRONLY) {
-        /* No extra space when mapped hdronly */
-        return 0;
+    if (db->db_journal) {
+        journal_append(db,op,key,val);
     }
-    dir_size = MDBM_DB_NUM_DIR_BYTES(db);
-
-    /* Round `used' up to a system page size. */
-    used = (dir_size + (db->db_sys_pagesize - 1)) & ~(db->db_sys_pagesize - 1);
+    if (MDBM_HAS_CHANGES(db) && changes_ring(db)) {
+        changes_append(db,op,key,val);
+    }
+}
 
-    /* Round `total' up to an mdbm page size. */
-    total = dir_size + (db->db_pagesize - 1);
+static void
+alloc_free_chunk(MDBM* db, int npages, int n, int prev)
+{
+    mdbm_page_t* page;
+    mdbm_free_index_t* fi = free_index_get(db);
+    int old_npages;
 
-    /* Reduce the total size if the mdbm page size is greater then the system's page size. */
-    if (db->db_pagesize > db->db_sys_pagesize) {
-        total -= total % db->db_pagesize;
+    assert(n <= db->db_hdr->h_last_chunk);
+    if (prev < 0 && fi) {
+        prev = free_index_prev(fi,n);
+        if ((prev ? MDBM_PAGE_PTR(db,prev)->p.p_next_free : db->db_hdr->h_first_free)
+            != (uint32_t)n)
+        {
+            free_index_invalidate(db,fi);
+            fi = NULL;
+            prev = -1;
+        }
     }
-    total -= total % db->db_sys_pagesize;
-    if (total > used) {
-        mdbm_log(LOG_DEBUG,
-                 "protect_dir,"
-                 " db_pagesize=%d, db_syspage_size=%d, dir_size=%d,"
-                 " used=%d, total=%d, db_base=%p, db_base+used=%p, total - used=%d"
-                 " mprotect start=%p, mprotect end=%p",
-                 db->db_pagesize, db->db_sys_pagesize, dir_size,
-                 used, total, (void*)db->db_base, (void*)(db->db_base + used), total - used,
-                 (void*)(db->db_base + used), (void*)(db->db_base + used + total - used - 1));
-        if (mprotect(db->db_base + used,
-                     total - used,
-                     (protect
-                      ? PROT_NONE
-                      : (MDBM_IS_RDONLY(db) ? PROT_READ : (PROT_READ|PROT_WRITE)))) < 0) {
-            mdbm_logerror(LOG_ERR,0,"%s: mprotect failure",db->db_filename);
-            return -1;
+    if (prev < 0) {
+        int p;
+        prev = 0;
+        for (p = db->db_hdr->h_first_free; p && p != n;) {
+            mdbm_page_t* page = MDBM_PAGE_PTR(db,p);
+            prev = p;
+            p = page->p.p_next_free;
         }
     }
-    return 0;
-}
 
-void
-sync_dir(MDBM* db, mdbm_hdr_t* hdr)
-{
-    if (!hdr) {
-        hdr = db->db_hdr;
-    }
-    if (db->db_dir) {
-        free(db->db_dir);
+    page = MDBM_PAGE_PTR(db,n);
+    assert(page->p_type == MDBM_PTYPE_FREE);
+    old_npages = page->p_num_pages;
+    if (page->p_num_pages > npages) {
+        int n1 = n + npages;
+        int n1pages = page->p_num_pages - npages;
+        mdbm_page_t* next_page = MDBM_PAGE_PTR(db,n1);
+
+        next_page->p_type = MDBM_PTYPE_FREE;
+        next_page->p_num_pages = n1pages;
+        next_page->p_prev_num_pages = npages;
+        next_page->p.p_next_free = page->p.p_next_free;
+        page->p.p_next_free = n1;
+        if (n == db->db_hdr->h_last_chunk) {
+            db->db_hdr->h_last_chunk = n+npages;
+        } else {
+            next_page = MDBM_PAGE_PTR(db,n1 + n1pages);
+            next_page->p_prev_num_pages = n1pages;
+            dirty_mark(db,n1 + n1pages,1);
+        }
+        dirty_mark(db,n1,1);
     }
-    /* HDRONLY means map only 1st page, so the entire directory may not be there (e.g. big MDBMs).
-     * That's why we don't copy the directory, and data should not be accessed with HDRONLY */
-    if (db->db_flags & MDBM_DBFLAG_HDRONLY) {
-        db->db_dir = NULL;
+    if (prev) {
+        mdbm_page_t* pprev = MDBM_PAGE_PTR(db,prev);
+        pprev->p.p_next_free = page->p.p_next_free;
+        dirty_mark(db,prev,1);
     } else {
-        db->db_dir = (mdbm_dir_t*)malloc(MDBM_DIR_SIZE(hdr->h_dir_shift));
-        memcpy(db->db_dir,MDBM_DIR_PTR(db),MDBM_DIR_SIZE(hdr->h_dir_shift));
-        db->db_dir_gen = hdr->h_dir_gen;
-        db->db_dir_flags = hdr->h_dbflags & MDBM_HFLAG_PERFECT;
+        assert(!page->p.p_next_free
+               || MDBM_PAGE_PTR(db,page->p.p_next_free)->p_type == MDBM_PTYPE_FREE);
+        db->db_hdr->h_first_free = page->p.p_next_free;
     }
-}
 
-static void
-init(MDBM* db, mdbm_hdr_t* hdr)
-{
-    db->db_pagesize = hdr->h_pagesize;
-    db->db_cache_mode = hdr->h_cache_mode;
-    db->db_num_pages = hdr->h_num_pages;
-    db->db_align_mask = hdr->h_dbflags & MDBM_ALIGN_MASK;
-    db->db_dir_shift = hdr->h_dir_shift;
-    db->db_max_dir_shift = hdr->h_max_dir_shift;
-    db->db_max_dirbit = MDBM_HASH_MASK(db->db_dir_shift);
-    sync_dir(db,hdr);
-    db->db_ptable = MDBM_PTABLE_PTR(MDBM_DIR_PTR(db),db->db_dir_shift);
-    db->db_hashfunc = mdbm_hash_funcs[hdr->h_hash_func];
-    db->db_spillsize = (hdr->h_dbflags & MDBM_HFLAG_LARGEOBJ) ? hdr->h_spill_size : 0;
+    if (fi) {
+        free_index_del(fi,n,old_npages);
+        if (old_npages > npages && free_index_add(db,fi,n+npages,old_npages-npages) < 0) {
+            free_index_invalidate(db,fi);
+        }
+    }
+    free_list_changed(db,fi);
 }
 
-int
-mdbm_internal_remap(MDBM *db, size_t dbsize, int flags)
+/**
+ * \brief Checks the integrity of the database header.
+ * \param[in,out] mdbm handle
+ * \param[in] h header
+ * \param[in] whether to display information messages
+ * \return number of check failures
+ */
+static int
+check_db_header(MDBM* db, mdbm_hdr_t* h, int verbose)
 {
-    mdbm_hdr_t hdr;
-    mdbm_page_t page;
-    int got_hdr = 0;
+    int nerr = 0;
 
-    /* Save a copy of the header, then unmap current db. */
-    if (db->db_base) {
-        assert(sizeof(hdr) <= db->db_base_len);
-        memcpy(&page, db->db_base, MDBM_PAGE_T_SIZE);
-        memcpy(&hdr, db->db_base+MDBM_PAGE_T_SIZE, sizeof(hdr));
-        got_hdr = 1;
-        if (munmap(db->db_base,db->db_base_len) < 0) {
-            mdbm_logerror(LOG_ERR,0,"munmap(%p,%llu)",
-                          (void*)db->db_base,(unsigned long long)db->db_base_len);
+    if (h->h_magic != _MDBM_MAGIC_NEW2) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_magic (0x%x) invalid",
+                     db->db_filename,h->h_magic);
         }
-        /*fprintf(stderr, "remap::munmap(%p,%u)\n", db->db_base,(unsigned)db->db_base_len); */
-        db->db_base = NULL;
-    } else {
-      memset(&page, 0, sizeof(page));
+        nerr++;
     }
-
-    if (!dbsize || !got_hdr) {
-        /* There's no header, and requested size is 0, so create a minmal map
-         * based on the system page size. */
-        uint64_t s;
-        char* p;
-
-        mdbm_log(LOG_DEBUG,"%s: remap, using default system page size for header",
-                 db->db_filename);
-        assert(sizeof(hdr) <= db->db_sys_pagesize);
-
-        if ((p = (char*)mmap(0,db->db_sys_pagesize,PROT_READ,MAP_SHARED,db->db_fd,0))
-            == MAP_FAILED)
-        {
-            mdbm_logerror(LOG_ERR,0,"%s: mdbm header mmap failure",db->db_filename);
-            return -1;
+    if (h->h_dbflags
+        & ~(MDBM_ALIGN_MASK|MDBM_HFLAG_PERFECT|MDBM_HFLAG_REPLACED|MDBM_HFLAG_LARGEOBJ
+            |MDBM_HFLAG_FILTER|MDBM_HFLAG_PAGEINDEX|MDBM_HFLAG_FULLHASH|MDBM_HFLAG_OPTREAD
+            |MDBM_HFLAG_DIRTYMAP|MDBM_HFLAG_JOURNAL|MDBM_HFLAG_CHANGES))
+    {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_dbflags (0x%x) invalid",
+                     db->db_filename,h->h_dbflags);
         }
-        /*fprintf(stderr, "remap::mmap(%p, %u, %d, %d, %d, %d) = %p\n", (void*)0,(unsigned)db->db_sys_pagesize,PROT_READ,MAP_SHARED,db->db_fd,0, p); */
-
-        memcpy(&hdr,p+MDBM_PAGE_T_SIZE,sizeof(hdr));
-        munmap(p,db->db_sys_pagesize);
-        /*fprintf(stderr, "remap::munmap(%p,%u)\n", p,(unsigned)db->db_sys_pagesize); */
-
-        if (check_db_header(db,&hdr,1) > 0) {
-            errno = EBADF;
-            return -1;
+        nerr++;
+    }
+    if ((h->h_dbflags & MDBM_HFLAG_PAGEINDEX)
+        && (h->h_index_shift < MDBM_PAGEINDEX_MIN_SHIFT
+            || h->h_index_shift > MDBM_PAGEINDEX_MAX_SHIFT
+            || (2 << h->h_index_shift) > (int)h->h_pagesize / 4))
+    {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_index_shift (%u) invalid",
+                     db->db_filename,h->h_index_shift);
         }
-
-        s = MDBM_HDR_DB_SIZE_64(&hdr);
-#ifndef __x86_64__
-        if (s > UINT_MAX && !MDBM_IS_WINDOWED(db)) {
-            mdbm_log(LOG_ERR,
-                     "%s: mdbm too large to open in 32-bit mode",
-                     db->db_filename);
-            errno = EFBIG;
-            return -1;
+        nerr++;
+    }
+    if ((h->h_cache_mode & ~MDBM_CACHEMODE_BITS)
+        || (MDBM_CACHEMODE(h->h_cache_mode) > MDBM_CACHEMODE_MAX))
+    {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_cachemode (0x%x) invalid",
+                     db->db_filename,h->h_cache_mode);
         }
-#endif
-        if (!dbsize) {
-            dbsize = s;
+        nerr++;
+    }
+    if (h->h_dir_shift > MDBM_DIRSHIFT_MAX) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_dir_shift (%u) invalid",
+                     db->db_filename,h->h_dir_shift);
         }
+        nerr++;
     }
-
-    if (MDBM_IS_WINDOWED(db)) {
-#ifdef HAVE_WINDOWED_MODE
-        int syspagesz = db->db_sys_pagesize;
-        int dbpagesz = hdr.h_pagesize;
-        /*int ndbpages = hdr.h_num_pages; // db-sized pages */
-        /* this provides enough space for the header, dir-bits, and ptable... */
-        int ndirpages = MDBM_NUM_DIR_PAGES(dbpagesz,hdr.h_dir_shift);
-        size_t mapsz = (size_t)ndirpages*dbpagesz;
-
-        /* ensure mapsz is a multiple of db_page_size rounded up to sys_page_size */
-        mapsz = (size_t)(MDBM_NUM_PAGES_ROUNDED(dbpagesz,  mapsz))*dbpagesz;
-        mapsz = (size_t)(MDBM_NUM_PAGES_ROUNDED(syspagesz, mapsz))*syspagesz;
-
-        /* map the header/dir/ptable and extra space */
-        if (map(db,0,0,mapsz,&db->db_base,&db->db_base_len) < 0) {
-            mdbm_logerror(LOG_ERR,0,"%s: map failure",db->db_filename);
-            return -1;
+    if (h->h_hash_func > MDBM_HASH_MAX) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_hash_func (%u) invalid",
+                     db->db_filename,h->h_hash_func);
         }
-
-        db->db_hdr = (mdbm_hdr_t*)(db->db_base + MDBM_PAGE_T_SIZE);
-        if (check_db_header(db,db->db_hdr,1) > 0) {
-            errno = EBADF;
-            return -1;
+        nerr++;
+    }
+    if (h->h_max_dir_shift > MDBM_DIRSHIFT_MAX) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_max_dir_shift (%u) invalid",
+                     db->db_filename,h->h_max_dir_shift);
         }
-        init(db,db->db_hdr);
-
-        if (!db->db_window.base) {
-            static const int MDBM_DEFAULT_WINDOW_PAGES = 8;
-            if (mdbm_set_window_size_internal(db,MDBM_DEFAULT_WINDOW_PAGES * dbpagesz) < 0) {
-                return -1;
-            }
+        nerr++;
+    }
+    if (h->h_max_dir_shift && h->h_dir_shift > h->h_max_dir_shift) {
+        if (verbose) {
+            mdbm_log(LOG_WARNING,
+                     "%s: h_dir_shift (%u) > h_max_dir_shift (%u)",
+                     db->db_filename,h->h_dir_shift,h->h_max_dir_shift);
         }
-#endif
-    } else {
-        size_t mapsz = (flags & MDBM_HEADER_ONLY) ? (size_t)sizeof(hdr) : dbsize;
-        if (map(db,NULL,0,mapsz,&db->db_base,&db->db_base_len) < 0) {
-            return -1;
+    }
+    if (h->h_pagesize < MDBM_MINPAGE || h->h_pagesize > MDBM_MAXPAGE
+        || (h->h_pagesize & (MDBM_PAGE_ALIGN-1)))
+    {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_pagesize (%u) invalid",
+                     db->db_filename,h->h_pagesize);
         }
-
-        if (flags & MDBM_HEADER_ONLY) {
-            db->db_flags |= MDBM_DBFLAG_HDRONLY;
+        nerr++;
+    }
+    if (h->h_num_pages > MDBM_NUMPAGES_MAX) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_num_pages (%u) invalid",
+                     db->db_filename,h->h_num_pages);
         }
-        if (db->db_flags & MDBM_DBFLAG_LOCK_PAGES) {
-            pin_pages(db);   /* Pin pages into memory, if necessary */
+        nerr++;
+    }
+    if (h->h_max_pages > MDBM_NUMPAGES_MAX) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_max_pages (%u) invalid",
+                     db->db_filename,h->h_max_pages);
         }
-
-        db->db_hdr = (mdbm_hdr_t*)(db->db_base + MDBM_PAGE_T_SIZE);
-        if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
-            memcpy(db->db_hdr, &hdr,sizeof(hdr));
-            memcpy(db->db_base, &page, MDBM_PAGE_T_SIZE);
+        nerr++;
+    }
+    if (h->h_max_pages && h->h_num_pages > h->h_max_pages) {
+        if (verbose) {
+            mdbm_log(LOG_WARNING,
+                     "%s: h_num_pages (%u) > h_max_pages (%u)",
+                     db->db_filename,h->h_num_pages,h->h_max_pages);
         }
-
-        if (check_db_header(db,db->db_hdr,1) > 0) {
-            errno = EBADF;
-            return -1;
+    }
+    if (h->h_spill_size > h->h_pagesize) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_spill_size (%u) > h_pagesize (%u)",
+                     db->db_filename,h->h_spill_size,h->h_pagesize);
         }
-        init(db,db->db_hdr);
+        nerr++;
     }
-    protect_dir(db,1);
-    if (db->db_dup_info) {
-        update_dup_map_gen(db);
+    if (h->h_last_chunk >= h->h_num_pages) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_last_chunk (%u) >= h_num_pages (%u)",
+                     db->db_filename,h->h_last_chunk,h->h_num_pages);
+        }
+        nerr++;
     }
-
-    return 0;
+    if (h->h_first_free >= h->h_num_pages) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_first_free (%u) >= h_num_pages (%u)",
+                     db->db_filename,h->h_first_free,h->h_num_pages);
+        }
+        nerr++;
+    }
+    if (h->h_first_free > 0 && h->h_first_free == h->h_last_chunk) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: h_first_free (%u) == h_last_chunk (%u)",
+                     db->db_filename,h->h_first_free,h->h_last_chunk);
+        }
+        nerr++;
+    }
+    if (verbose > 1) {
+        mdbm_log(LOG_INFO,
+                 "%s: header checked (%d error(s))",db->db_filename,nerr);
+    }
+    return nerr;
 }
 
 /**
- * Resizes a db.  Adjusts the header, page directory, and page table appropriately.
- *
+ * \brief Checks the integrity of the free-list.
  * \param[in,out] db mdbm handle
- * \param[in] npages total number of pages for the db
- * \return return code
- * \retval 0 success
- * \retval -1 failure, errno set
+ * \param[in] verbose whether to display information messages
+ * \return number of check failures
  */
 static int
-resize_db(MDBM* db, int npages)
+check_db_chunks(MDBM* db, int verbose)
 {
-    size_t dbsize;
-    int prev_npages;
+    int pg;
+    int cur_free;
+    int nerr = 0;
+    mdbm_hdr_t* h = db->db_hdr;
+    int nchunks = 0;
 
-#ifndef __x86_64__
-    if (npages > UINT_MAX/db->db_pagesize) {
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "Cannot remap over 4GB, npages=%d", npages);
-#endif
-        errno = ENOMEM;
-        return -1;
+    pg = 0;
+    cur_free = h->h_first_free;
+    while (pg < h->h_num_pages) {
+        mdbm_page_t* page = MDBM_PAGE_PTR(db,pg);
+        nchunks++;
+        if (page->p_type == MDBM_PTYPE_FREE) {
+            if (cur_free < 0) {
+                if (verbose) {
+                    mdbm_log(LOG_NOTICE,
+                             "%s: resuming free-list checking with chunk %u",
+                             db->db_filename,pg);
+                }
+                cur_free = pg;
+            }
+            if (cur_free > 0 && pg == cur_free) {
+                cur_free = page->p.p_next_free;
+            } else {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s: chunk %u is free but not on free-list (next=%u)",
+                             db->db_filename,pg,cur_free);
+                }
+                nerr++;
+            }
+        } else if (cur_free > 0 && pg == cur_free) {
+            if (verbose) {
+                mdbm_log(LOG_CRIT,
+                         "%s: chunk %u on free-list but not marked free (type=%u)",
+                         db->db_filename,pg,page->p_type);
+            }
+            nerr++;
+            if (verbose) {
+                mdbm_log(LOG_NOTICE,
+                         "%s: free-list checking suspended",
+                         db->db_filename);
+            }
+            cur_free = -1;
+        }
+        if (cur_free > 0 && pg+page->p_num_pages > cur_free) {
+            if (verbose) {
+                mdbm_log(LOG_CRIT,
+                         "%s: chunk %u (npages=%u) overlaps next free-list chunk (%u)",
+                         db->db_filename,pg,page->p_num_pages,cur_free);
+            }
+            nerr++;
+            if (verbose) {
+                mdbm_log(LOG_NOTICE,
+                         "%s: free-list checking suspended",
+                         db->db_filename);
+            }
+            cur_free = -1;
+        }
+        if (pg == h->h_last_chunk) {
+            if (cur_free > 0) {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s: free-list (next=%u) runs past last chunk (%u)",
+                             db->db_filename,cur_free,pg);
+                }
+                nerr++;
+            }
+            break;
+        }
+        if (MDBM_PAGE_PTR(db,pg+page->p_num_pages)->p_prev_num_pages != page->p_num_pages) {
+            if (verbose) {
+                mdbm_log(LOG_CRIT,
+                         "%s: chunk %d size (npages=%u) != chunk %d prev size (npages=%u)",
+                         db->db_filename,pg,page->p_num_pages,pg+page->p_num_pages,
+                         MDBM_PAGE_PTR(db,pg+page->p_num_pages)->p_prev_num_pages);
+            }
+            nerr++;
+        }
+        if (pg+page->p_num_pages > h->h_num_pages) {
+            if (verbose) {
+                mdbm_log(LOG_CRIT,
+                         "%s: chunk %d (npages=%u) overlaps end of db (npages=%u)",
+                         db->db_filename,pg,page->p_num_pages,h->h_num_pages);
+            }
+            nerr++;
+        }
+        if (page->p_num_pages < 1) {
+            if (verbose) {
+                mdbm_log(LOG_CRIT,
+                         "%s: chunk %d invalid size (npages=%u); chunk scan aborted",
+                         db->db_filename,pg,page->p_num_pages);
+            }
+            nerr++;
+            break;
+        }
+        pg += page->p_num_pages;
     }
-#endif
-
-    if (npages > MDBM_NUMPAGES_MAX) {
-        mdbm_log(LOG_ERR, "MDBM cannot grow to %d pages, max=%d", npages, MDBM_NUMPAGES_MAX);
-        errno = ENOSPC;
-        return -1;
+    if (verbose > 1) {
+        mdbm_log(LOG_INFO,
+                 "%s: %d chunks checked (%d error(s))",db->db_filename,nchunks,nerr);
     }
+    return nerr;
+}
 
-    dbsize = (size_t)npages * db->db_pagesize;
-    prev_npages = db->db_num_pages;
-    db->db_num_pages = db->db_hdr->h_num_pages = npages;
-
-    if (!(db->db_flags & (MDBM_DBFLAG_MEMONLYCACHE|MDBM_DBFLAG_HUGEPAGES))) {
-        if (ftruncate(db->db_fd,dbsize) < 0) {
-            db->db_num_pages = db->db_hdr->h_num_pages = prev_npages;
-            mdbm_logerror(LOG_ERR,0,"%s: ftruncate failure",db->db_filename);
-            return -1;
-        }
-    }
+static int
+check_db_dir_entry(MDBM* db, int i, int verbose)
+{
+    mdbm_hdr_t* h = db->db_hdr;
+    int p;
+    int nerr = 0;
 
-    if (mdbm_internal_remap(db,dbsize,0) < 0) {
-        /* remap failed, db is currently unmapped.          */
-        /* restore the original number of pages for the db. */
-        dbsize = (size_t)prev_npages * db->db_pagesize;
-        db->db_num_pages = prev_npages;
-        /* This remap restores original size, so should mostly succeed, and failure means
-         * no MDBM data is mapped in. */
-        if (mdbm_internal_remap(db,dbsize,0) < 0) {
-            mdbm_log(LOG_ERR, "remap cannot restore size to %d pages, MDBM handle invalid",
-                     prev_npages);
-            errno = ENOSPC;
-            return -1;
+    if ((p = MDBM_GET_PAGE_INDEX(db,i)) != 0) {
+        if (p > h->h_last_chunk) {
+            if (verbose) {
+                mdbm_log(LOG_CRIT,
+                         "%s: directory page %u maps to chunk %u past last chunk (%u)",
+                         db->db_filename,i,p,h->h_last_chunk);
+            }
+            nerr++;
+        } else {
+            mdbm_page_t* page = MDBM_PAGE_PTR(db,p);
+            if (page->p_type != MDBM_PTYPE_DATA) {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s: directory page %u maps to non-data chunk %u"
+                             " (type=%u npages=%u)",
+                             db->db_filename,i,p,page->p_type,page->p_num_pages);
+                }
+                nerr++;
+            } else if (page->p_num != i) {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s: directory page %u != chunk %u directory page (%u)",
+                             db->db_filename,i,p,page->p_num);
+                }
+                nerr++;
+            }
         }
-        db->db_hdr->h_num_pages = prev_npages;
-        init(db,db->db_hdr);
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "remap cannot resize, npages=%d", npages);
-#endif
-        errno = ENOMEM;
-        return -1;
     }
-
-    return 0;
+    return nerr;
 }
 
-static int resize(MDBM* db, int new_dirshift, int new_numpages);
-
-static void*
-alloc_chunk(MDBM* db, int type, int npages, int n0, int n1, int map, int lock)
-{
-    int n;
-    mdbm_page_t* page;
-    int lock_upgraded = 0;
-
-    CHECK_LOCK_INTERNAL_ISOWNED;
-
-/*     printf("**alloc_chunk npages=%d\n",npages); */
-
-    /* find a free chunk */
-    for (;;) {
-        int last_chunk, last_chunk_pages;
-        int tot_free_pages;
+#define MDBM_PAGE_NOALLOC       0
+#define MDBM_PAGE_ALLOC         1
+#define MDBM_PAGE_EXISTS        2
 
-        if ((n = find_free_chunk(db,npages,n0,n1,&tot_free_pages)) != 0) {
-            break;
-        }
+#define MDBM_PAGE_NOMAP         0
+#define MDBM_PAGE_MAP           1
 
-        /* nothing big enough; how about unused space? */
-        last_chunk = db->db_hdr->h_last_chunk;
-        page = MDBM_PAGE_PTR(db,last_chunk);
-        last_chunk_pages = page->p_num_pages;
+#define MDBM_ALLOC_NO_UNLOCK    0
+#define MDBM_ALLOC_CAN_UNLOCK   1
 
-        if (last_chunk+last_chunk_pages+npages <= db->db_hdr->h_num_pages) {
-            n = last_chunk + last_chunk_pages;
-            page = MDBM_PAGE_PTR(db,n);
-            page->p_prev_num_pages = last_chunk_pages;
-            db->db_hdr->h_last_chunk = n;
-            break;
-        }
+static void* alloc_chunk(MDBM* db, int type, int npages, int n0, int n1, int map, int lock);
+static int free_chunk(MDBM* db, int pagenum, int* prevp);
 
-        if (n0) {
-            page = NULL;
-            goto alloc_ret;
-        }
+static mdbm_page_t* pagenum_to_page(MDBM* db, int pagenum, int alloc, int map);
+static int check_page_index(MDBM* db, mdbm_page_t* page, int pnum, int mapped_pnum, int verbose);
 
-        if (resize(db,0,last_chunk + last_chunk_pages + npages) < 0) {
-            if (tot_free_pages >= npages) {
-                /* Need db lock in order to defrag */
-                if (!mdbm_isowned(db)) {
-                    if (lock != MDBM_ALLOC_CAN_UNLOCK) {
-                        page = NULL;
-                        goto alloc_ret;
-                    }
-                    mdbm_internal_unlock(db);
-                    if (mdbm_lock(db) != 1) {
-                        return NULL;
-                    }
-                    if (mdbm_internal_lock(db) < 0) {
-                        mdbm_unlock(db);
-                        return NULL;
-                    }
-                    lock_upgraded = 1;
-                }
-                if ((n = find_defrag_free_chunk(db,npages)) >= 0) {
-                    break;
-                }
-            }
-            page = NULL;
-            goto alloc_ret;
-        }
-    }
 
-    page = MDBM_CHUNK_PTR(db,n,npages);
-    page->p_num = n;
-    page->p_type = type;
-    page->p_flags = 0;
-    page->p_num_pages = npages;
-    page->p_r0 = 0;
-    page->p_r1 = 0;
-    page->p.p_data = 0;
+/*
+ * With MDBM_HFLAG_FULLHASH, the low 16 bits of each entry's hash are stored
+ * (unaligned) right after its key, so the full hash can be recovered without
+ * rehashing the key.
+ */
+static inline void
+set_entry_hashlo(mdbm_page_t* page, mdbm_entry_t* ep, uint16_t lo)
+{
+    memcpy(MDBM_KEY_PTR1(page,ep) + ep->e_key.key.len,&lo,sizeof(lo));
+}
 
-/*     printf("alloc_chunk npages=%d => page %d\n",npages,n); */
-    CHECK_DB_PARTIAL(db,1);
+static inline mdbm_hashval_t
+entry_hashval(MDBM* db, const mdbm_page_t* page, const mdbm_entry_t* ep)
+{
+    uint16_t lo;
 
- alloc_ret:
-    if (!page && lock == MDBM_ALLOC_CAN_UNLOCK) {
-        mdbm_internal_unlock(db);
-    }
-    if (lock_upgraded) {
-        mdbm_unlock(db);
+    if (!db->db_hashlo_len) {
+        return MDBM_HASH_VALUE(db,MDBM_KEY_PTR1(page,ep),ep->e_key.key.len);
     }
-
-    return page;
+    memcpy(&lo,MDBM_KEY_PTR1(page,ep) + ep->e_key.key.len,sizeof(lo));
+    return ((mdbm_hashval_t)ep->e_key.key.hash << 16) | lo;
 }
 
+/**
+ * \brief Checks the integrity of a data page.
+ * - Once a specific check fails, no further checks are done.
+ * - Check number of page entries in within bounds.
+ * - Check number of free bytes is non-negative.
+ * - Check top-of-page-marker is correct.
+ * - Check each entry (key) offset is within page.
+ * - Check each key length is within page.
+ * - Check each entry match field is within page.
+ * - Check each value length is within page.
+ * - If non-windowed, level 4+: check valid hash field, and that the key is on the right page
+ *   (with stored full hashes, keys are only rehashed at level 5).
+ * - If non-windowed, LOB: LOB chunk is within bounds (header last_chunk).
+ * - If non-windowed, LOB: LOB chunk has corresponding LOB page-type.
+ * - If non-windowed, LOB: LOB internal page number matches \a pnum.
+ * \param[in,out] db handle
+ * \param[in] pnum page number
+ * \param[in] verbose whether to display information messages
+ * \param[in] level integrity check level
+ * \return number of check failures
+ */
 static int
-free_chunk(MDBM* db, int pagenum, int* prevp)
+check_db_page(MDBM *db, int pnum, int verbose, int level)
 {
-    int npages;
     mdbm_page_t* page;
-    int prevprev, prev, next, p1;
-
-    CHECK_LOCK_INTERNAL_ISOWNED;
-
-    page = MDBM_PAGE_PTR(db,pagenum);
-    npages = page->p_num_pages;
-
-#ifdef DEBUG
-     printf("**free_chunk p=%d npages=%d (prev npages=%d)\n",
-        pagenum,npages,page->p_prev_num_pages);
-#endif
-
-    if (pagenum == 0) {
-        mdbm_log(LOG_CRIT, "%s: invalid attempt to free chunk 0",db->db_filename);
-        abort();
-    }
-
-    page->p_type = MDBM_PTYPE_FREE;
-    page->p_num = pagenum;
+    mdbm_entry_t* ep;
+    int index = -1;
+    int max_page_entries;
+    int mapped_pnum;
+    int nerr = 0;
 
-    /* Find 2 previous free chunks and next free chunk */
-    prevprev = 0;
-    prev = 0;
-    next = db->db_hdr->h_first_free;
-    if (prevp && *prevp) {
-        prevprev = *prevp;
-        prev = MDBM_PAGE_PTR(db,prevprev)->p.p_next_free;
-        next = MDBM_PAGE_PTR(db,prev)->p.p_next_free;
-    }
-    while (next && next < pagenum) {
-        prevprev = prev;
-        prev = next;
-        next = MDBM_PAGE_PTR(db,next)->p.p_next_free;
+    if ((nerr = check_db_dir_entry(db,pnum,0)) > 0) {
+        return nerr;
     }
 
-    if (next == pagenum) {
-        mdbm_log(LOG_CRIT, "%s: attempt to free chunk (%d) on free-list (npages=%d prev=%d)",
-                 db->db_filename,pagenum,npages,prev);
-        abort();
+    if ((page = pagenum_to_page(db,pnum,MDBM_PAGE_NOALLOC,MDBM_PAGE_MAP)) == NULL) {
+        return 0;
     }
+    mapped_pnum = MDBM_GET_PAGE_INDEX(db,pnum);
 
-    /* p1 is page number of (possibly-merged) free chunk */
-    p1 = pagenum;
-
-    if (prev) {
-        mdbm_page_t* pprev = MDBM_PAGE_PTR(db,prev);
-        if (prev + pprev->p_num_pages == pagenum) {
-            /* previous free chunk adjoins: merge chunks */
-            assert(pprev->p_type == MDBM_PTYPE_FREE);
-            assert(pagenum - page->p_prev_num_pages == prev);
-            pprev->p_num_pages += npages;
-            npages = 0; /* signal that we've merged */
-            if (pagenum < db->db_hdr->h_last_chunk) {
-                /* merged chunk is not the last chunk, so update back-pointer */
-                MDBM_PAGE_PTR(db,prev + pprev->p_num_pages)->p_prev_num_pages = pprev->p_num_pages;
-            } else {
-                /* chunk being freed was last chunk */
-                assert(pagenum == db->db_hdr->h_last_chunk);
-                db->db_hdr->h_last_chunk = prev;
-            }
-            p1 = prev; /* update page number to new merged chunk */
-            prev = prevprev;
+    max_page_entries = ((page->p_num_pages*db->db_pagesize - MDBM_PAGE_T_SIZE)
+                        / MDBM_ENTRY_T_SIZE) - 1;
+    if (page->p.p_num_entries > max_page_entries) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,"%s (page %d/%d): invalid num entries: %u",
+                     db->db_filename,pnum,mapped_pnum,page->p.p_num_entries);
         }
-    }
-    if (next) {
-        mdbm_page_t* pp1 = MDBM_PAGE_PTR(db,p1);
-        assert(pp1->p_type == MDBM_PTYPE_FREE);
-        if (p1 + pp1->p_num_pages == next) {
-            /* following free chunk adjoins: merge chunks */
-            mdbm_page_t* pnext = MDBM_PAGE_PTR(db,next);
-            assert(next - pnext->p_prev_num_pages == p1);
-            pp1->p_num_pages += pnext->p_num_pages;
-            pp1->p.p_next_free = pnext->p.p_next_free;
-            npages = 0;
-            if (db->db_hdr->h_first_free == next) {
-                /* following free chunk was head of free list; merged chunk is new head */
-                assert(prev == 0);
-                db->db_hdr->h_first_free = p1;
-            } else if (prev != 0) {
-                /* update next pointer in previous free list chunk */
-                MDBM_PAGE_PTR(db,prev)->p.p_next_free = p1;
-            }
-
-            /* last chunk should never be free, so following free chunk shouldn't be last */
-            assert(db->db_hdr->h_last_chunk != next);
+        nerr++;
+    } else if (MDBM_PAGE_FREE_BYTES(page) < 0) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,"%s (page %d/%d):"
+                     " invalid page free bytes: %d (bottom-of-data=%d numentries=%d)",
+                     db->db_filename,pnum,mapped_pnum,
+                     MDBM_PAGE_FREE_BYTES(page),
+                     MDBM_DATA_PAGE_BOTTOM_OF_DATA(page),
+                     page->p.p_num_entries);
+        }
+        nerr++;
+    } else if (MDBM_ENTRY(page,page->p.p_num_entries)->e_key.match != MDBM_TOP_OF_PAGE_MARKER) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,"%s (page %d/%d):"
+                     " bad top-of-page marker: %08x (numentries=%d)",
+                     db->db_filename,pnum,mapped_pnum,
+                     MDBM_ENTRY(page,page->p.p_num_entries)->e_key.match,
+                     page->p.p_num_entries);
+        }
+        nerr++;
+    } else {
+        int offset_limit;
 
-            /* update back-pointer on following chunk */
-            MDBM_PAGE_PTR(db,p1 + pp1->p_num_pages)->p_prev_num_pages = pp1->p_num_pages;
+        offset_limit = MDBM_DATA_PAGE_END(db,page);
+        for (index = 0; index < page->p.p_num_entries; index++) {
+            ep = MDBM_ENTRY(page,index);
+            if (ep->e_offset > offset_limit) {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s (page %d/%d): invalid entry offset (index %d): %u",
+                             db->db_filename,pnum,mapped_pnum,index,ep->e_offset);
+                }
+                nerr++;
+            } else if (index > 0 && ep->e_key.key.len > ep[-1].e_offset - ep[0].e_offset) {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s (page %d/%d): invalid keylen or offset problem (index %d):"
+                             " keylen=%u offsets=%d-%d=%d",
+                             db->db_filename,pnum,mapped_pnum,index,ep->e_key.key.len,
+                             ep[-1].e_offset,ep[0].e_offset,
+                             ep[-1].e_offset - ep[0].e_offset);
+                }
+                nerr++;
+            } else if (ep->e_key.match == MDBM_TOP_OF_PAGE_MARKER) {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s (page %d/%d): premature top-of-page marker (index %d)",
+                             db->db_filename,pnum,mapped_pnum,index);
+                    }
+                    nerr++;
+            } else if (ep->e_key.match) {
+                if (MDBM_VAL_LEN1(db,ep) < 0) {
+                    if (verbose) {
+                        mdbm_log(LOG_CRIT,
+                                 "%s (page %d/%d): invalid vallen (index %d): vallen=%d",
+                                 db->db_filename,pnum,mapped_pnum,index,
+                                 MDBM_VAL_LEN1(db,ep));
+                    }
+                    nerr++;
+                } else if (!MDBM_IS_WINDOWED(db)) {
+                    if (level > 3) {
+                        mdbm_hashval_t h = entry_hashval(db,page,ep);
+                        int bad_hash = (ep->e_key.key.hash != (h>>16));
+                        if (db->db_hashlo_len && level > 4) {
+                            /* Stored full hashes are only re-verified against keys at level 5. */
+                            bad_hash = (h != MDBM_HASH_VALUE(db,MDBM_KEY_PTR1(page,ep),
+                                                             MDBM_KEY_LEN1(ep)));
+                        }
+                        if (bad_hash) {
+                            if (verbose) {
+                                mdbm_log(LOG_CRIT,
+                                         "%s (page %d/%d): invalid key hash (index %d)",
+                                         db->db_filename,pnum,mapped_pnum,index);
+                            }
+                            nerr++;
+                        } else if (hashval_to_pagenum_shared(db,h) != (mdbm_pagenum_t)pnum) {
+                            if (verbose) {
+                                mdbm_log(LOG_CRIT,
+                                         "%s (page %d/%d): key on wrong page (index %d)",
+                                         db->db_filename,pnum,mapped_pnum,index);
+                            }
+                            nerr++;
+                        }
+                    }
+                    if (MDBM_ENTRY_LARGEOBJ(ep)) {
+                        mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
+                        if (lp->l_pagenum > db->db_hdr->h_last_chunk) {
+                            if (verbose) {
+                                mdbm_log(LOG_CRIT,
+                                         "%s (page %d/%d):"
+                                         " invalid lob chunk (index %d): l_pagenum=%u",
+                                         db->db_filename,pnum,mapped_pnum,index,
+                                         lp->l_pagenum);
+                            }
+                            nerr++;
+                        } else {
+                            mdbm_page_t* lob = MDBM_PAGE_PTR(db,lp->l_pagenum);
+                            if (lob->p_type != MDBM_PTYPE_LOB) {
+                                if (verbose) {
+                                    mdbm_log(LOG_CRIT,
+                                             "%s (page %d/%d): chunk is not lob (index %d):"
+                                             " l_pagenum=%u type=%u",
+                                             db->db_filename,pnum,mapped_pnum,index,
+                                             lp->l_pagenum,lob->p_type);
+                                }
+                                nerr++;
+                            } else if (lob->p_num != pnum) {
+                                if (verbose) {
+                                    mdbm_log(LOG_CRIT,
+                                             "%s (page %d/%d): lob page ref mismatch (index %d):"
+                                             " l_pagenum=%u lob.p_num=%u pnum=%u",
+                                             db->db_filename,pnum,mapped_pnum,index,
+                                             lp->l_pagenum,lob->p_num,pnum);
+                                }
+                                nerr++;
+                            }
+                        }
+                    }
+                }
+                offset_limit = ep->e_offset;
+            }
+        }
+        if (!nerr && MDBM_HAS_PAGE_INDEX(db) && !(page->p_flags & MDBM_PFLAG_NOINDEX)) {
+            nerr += check_page_index(db,page,pnum,mapped_pnum,verbose);
         }
     }
-    if (npages) {
-        /* wasn't merged, so add to free list */
-        if (prev) {
-            mdbm_page_t* pprev = MDBM_PAGE_PTR(db,prev);
-            page->p.p_next_free = pprev->p.p_next_free;
-            pprev->p.p_next_free = pagenum;
-        } else {
-            page->p.p_next_free = db->db_hdr->h_first_free;
-            db->db_hdr->h_first_free = pagenum;
+
+    if (MDBM_IS_WINDOWED(db)) {
+        release_window_page(db,page);
+    }
+
+    return nerr;
+}
+
+/**
+ * \brief Checks the integrity of the page directory.
+ * \param[in,out] db handle
+ * \param[in] verbose whether to display information messages
+ * \return number of check failures
+ */
+static int
+check_db_dir(MDBM* db, int verbose)
+{
+    int nerr = 0;
+    int i;
+    int p;
+    mdbm_page_t* page;
+    mdbm_hdr_t* h = db->db_hdr;
+    int ndir = 0;
+
+    page = MDBM_PAGE_PTR(db,0);
+    if (page->p_type != MDBM_PTYPE_DIR) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: chunk 0 is not directory (type=%u, npages=%u)",
+                     db->db_filename,page->p_type,page->p_num_pages);
         }
+        nerr++;
     }
-    if (p1 == db->db_hdr->h_last_chunk) {
-        /* we're the last chunk, but last chunk can't be free; adjust */
-        if (db->db_hdr->h_first_free == p1) {
-            assert(prev == 0);
-            db->db_hdr->h_first_free = 0;
-        } else {
-            assert(prev != 0);
-            MDBM_PAGE_PTR(db,prev)->p.p_next_free = 0;
+    if (db->db_dir_gen == db->db_hdr->h_dir_gen
+        && memcmp(db->db_dir,MDBM_DIR_PTR(db),MDBM_DB_DIR_SIZE(db)))
+    {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: db_dir (0x%p) out-of-sync with directory on page 0",
+                     db->db_filename,(void*)db->db_dir);
         }
-        /* update last chunk to previous chunk */
-        db->db_hdr->h_last_chunk = p1 - MDBM_PAGE_PTR(db,p1)->p_prev_num_pages;
+        nerr++;
+    }
+    if (MDBM_DB_NUM_DIR_PAGES(db) > page->p_num_pages) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: directory chunk too small (npages=%u) for directory size (npages=%u)",
+                     db->db_filename,page->p_num_pages,MDBM_DB_NUM_DIR_PAGES(db));
+        }
+        nerr++;
     }
 
-    CHECK_DB(db);
+    for (i = 0; i <= db->db_max_dirbit; i++) {
+        nerr += check_db_dir_entry(db,i,verbose);
+        ndir++;
+    }
 
-    if (prevp) {
-        if (prevprev) {
-            *prevp = prevprev;
-        } else {
-            *prevp = 0;
+    p = 0;
+    while (p <= h->h_last_chunk) {
+        page = MDBM_PAGE_PTR(db,p);
+        if (page->p_type == MDBM_PTYPE_DATA) {
+            if (page->p_num > db->db_max_dirbit) {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s: invalid directory page (%u) referenced by chunk %u",
+                             db->db_filename,page->p_num,p);
+                }
+                nerr++;
+            } else if (MDBM_GET_PAGE_INDEX(db,page->p_num) != p) {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s: chunk/directory page mismatch (chunk=%u dir[%u]=%u)",
+                             db->db_filename,p,page->p_num,MDBM_GET_PAGE_INDEX(db,page->p_num));
+                }
+                nerr++;
+            }
         }
+        if (page->p_num_pages < 1) {
+            if (verbose) {
+                mdbm_log(LOG_CRIT,
+                         "%s: chunk %d invalid size (npages=%u); dir/page check aborted",
+                         db->db_filename,p,page->p_num_pages);
+            }
+            nerr++;
+            break;
+        }
+        p += page->p_num_pages;
     }
-
-    return p1;
+    if (verbose > 1) {
+        mdbm_log(LOG_INFO,
+                 "%s: %d directory entries checked (%d error(s))",db->db_filename,ndir,nerr);
+    }
+    return nerr;
 }
 
-static void
-free_large_object_chunks(MDBM* db)
+#define MDBM_CHECK_PARALLEL_CHUNK 64
+
+/*
+ * Shared state for a multi-threaded page or lob check.  Items are handed out in
+ * batches, and each item's error count is recorded separately so the results
+ * can be reported in order once all workers are done.
+ */
+struct check_parallel {
+    MDBM*       db;
+    int         level;
+    const int*  lobs;       /* lob chunk numbers to check, or NULL for data pages */
+    uint32_t    count;      /* number of items to check */
+    uint32_t    next;       /* next item to hand out */
+    int*        nerr;       /* per-item error count (-1 for an unallocated page) */
+};
+
+static int check_db_lob(MDBM* db, int p, int verbose);
+
+static void*
+check_parallel_worker(void* arg)
 {
-    int pno = 0;
-    int prev = 0;
-    while (pno <= db->db_hdr->h_last_chunk) {
-        mdbm_page_t* page = MDBM_PAGE_PTR(db,pno);
-        if (page->p_type == MDBM_PTYPE_LOB) {
-            free_chunk(db,pno,&prev);
+    struct check_parallel* cp = (struct check_parallel*)arg;
+    MDBM* db = cp->db;
+
+    for (;;) {
+        uint32_t first = atomic_add32u(&cp->next,MDBM_CHECK_PARALLEL_CHUNK);
+        uint32_t i;
+
+        if (first >= cp->count) {
+            break;
+        }
+        for (i = first; i < first + MDBM_CHECK_PARALLEL_CHUNK && i < cp->count; ++i) {
+            if (cp->lobs) {
+                cp->nerr[i] = check_db_lob(db,cp->lobs[i],0);
+            } else if (MDBM_GET_PAGE_INDEX(db,i)) {
+                cp->nerr[i] = check_db_page(db,i,0,cp->level);
+            } else {
+                cp->nerr[i] = -1;
+            }
         }
-        pno += page->p_num_pages;
     }
+    return NULL;
 }
 
-/* Expand an existing chunk to at least 'npages' size.
- * 'pagenum' is the physical page number in units of db-page-size.
- * 'npages' is the desired number of (contiguous) pages in units of db-page-size.
+/*
+ * Runs check_parallel_worker() on nthreads threads, including the caller.
+ * If threads can't be created, the remaining threads pick up the slack.
  */
-static int
-grow_chunk(MDBM* db, int pagenum, int npages)
+static void
+check_parallel_run(struct check_parallel* cp, int nthreads)
 {
-    mdbm_page_t* page = MDBM_PAGE_PTR(db,pagenum);
+    pthread_t* threads;
+    int started = 0;
 
-    if (pagenum + npages > db->db_num_pages) {
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "grow_chunk failed, pagenum=%d, npages=%d, db_num_pages=%u",
-                 pagenum, npages, db->db_num_pages);
-#endif
-        errno = ENOMEM;
-        return -1;
+    if ((threads = (pthread_t*)calloc(nthreads,sizeof(*threads))) != NULL) {
+        while (started < nthreads - 1
+               && pthread_create(&threads[started],NULL,check_parallel_worker,cp) == 0)
+        {
+            started++;
+        }
     }
-    if (page->p_num_pages >= npages) {
-        mdbm_log(LOG_WARNING,
-            "grow_chunk() redundant, pagenum=%d, npages=%d (already %d), db_num_pages=%u",
-            pagenum, npages, page->p_num_pages, db->db_num_pages);
-        return 0;
+    check_parallel_worker(cp);
+    while (started > 0) {
+        pthread_join(threads[--started],NULL);
     }
-    if (pagenum == db->db_hdr->h_last_chunk) {
-        page->p_num_pages = npages;
+    free(threads);
+}
+
+/**
+ * \brief Checks the integrity of all data pages.
+ * With \a nthreads > 1, pages are checked concurrently (silently), and pages
+ * that failed are then re-checked in order to report errors deterministically.
+ * Windowed handles are always checked serially.
+ * \param[in,out] db handle
+ * \param[in] verbose whether to display information messages
+ * \param[in] level integrity check level
+ * \param[in] nthreads number of threads to use
+ * \return number of check failures
+ */
+static int
+check_db_pages(MDBM* db, int verbose, int level, int nthreads)
+{
+    int nerr = 0;
+    int i;
+    int npages = 0;
+    struct check_parallel cp;
+
+    memset(&cp,0,sizeof(cp));
+    if (nthreads > 1 && !MDBM_IS_WINDOWED(db)) {
+        cp.count = db->db_max_dirbit + 1;
+        cp.nerr = (int*)malloc(cp.count * sizeof(int));
+    }
+    if (cp.nerr) {
+        /* Workers share the handle: build the directory cache now, since
+         * their page lookups don't update the handle. */
+        if (!db->db_dir_cache && db->db_dir_shift) {
+            dir_cache_attach(db);
+        }
+        cp.db = db;
+        cp.level = level;
+        check_parallel_run(&cp,nthreads);
+        for (i = 0; i <= db->db_max_dirbit; i++) {
+            if (cp.nerr[i] >= 0) {
+                npages++;
+            }
+            if (cp.nerr[i] > 0) {
+                nerr += cp.nerr[i];
+                if (verbose) {
+                    check_db_page(db,i,verbose,level);
+                }
+            }
+        }
+        free(cp.nerr);
     } else {
-        if (clear_pages(db,pagenum+page->p_num_pages,npages-page->p_num_pages) < 0) {
-            return -1;
+        for (i = 0; i <= db->db_max_dirbit; i++) {
+            if (MDBM_GET_PAGE_INDEX(db,i)) {
+                nerr += check_db_page(db,i,verbose,level);
+                npages++;
+            }
         }
-        page->p_num_pages = npages;
-        MDBM_PAGE_PTR(db,pagenum + npages)->p_prev_num_pages = page->p_num_pages;
     }
-
-    CHECK_DB(db);
-
-    return 0;
+    if (verbose > 1) {
+        mdbm_log(LOG_INFO,
+                 "%s: %d db pages checked (%d error(s))",db->db_filename,npages,nerr);
+    }
+    return nerr;
 }
 
-static void
-shrink_page(MDBM* db, mdbm_page_t* page)
+/**
+ * \brief Checks the integrity of a large object.
+ * \param[in,out] db handle
+ * \param[in] p chunk number of the large object
+ * \param[in] verbose whether to display information messages
+ * \return number of check failures
+ */
+static int
+check_db_lob(MDBM* db, int p, int verbose)
 {
-    int pagenum = page->p_num;
-    int p = MDBM_GET_PAGE_INDEX(db,pagenum);
-    MDBM_SET_PAGE_INDEX(db,pagenum, 0);
-    free_chunk(db,p,NULL);
+    mdbm_page_t* lob = MDBM_PAGE_PTR(db,p);
+    mdbm_page_t* page;
+    int nerr = 0;
 
-    pagenum_to_page(db,pagenum,MDBM_PAGE_ALLOC,MDBM_PAGE_NOMAP);
-    CHECK_DB(db);
-}
+    if (lob->p_num > db->db_max_dirbit) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: invalid lob page ref: chunk=%u p_num=%u",
+                     db->db_filename,p,lob->p_num);
+        }
+        nerr++;
+    } else if ((page = pagenum_to_page(db,lob->p_num,MDBM_PAGE_NOALLOC,MDBM_PAGE_NOMAP))) {
+        mdbm_entry_t* ep;
 
-static inline int
-MDBM_MAX_PGMAP_ENTRIES(const MDBM* db)
-{
-    return ((db->db_pagesize-MDBM_PAGE_T_SIZE)/MDBM_ENTRY_T_SIZE) - 1;
+        for (ep = MDBM_ENTRY(page,0); ep->e_key.match != MDBM_TOP_OF_PAGE_MARKER; ep++) {
+            if (ep->e_key.match && MDBM_ENTRY_LARGEOBJ(ep)) {
+                mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
+                if (lp->l_pagenum == p) {
+                    break;
+                }
+            }
+        }
+    } else {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s: lob page ref not allocated: chunk=%u p_num=%u",
+                     db->db_filename,p,lob->p_num);
+        }
+        nerr++;
+    }
+    return nerr;
 }
 
-static mdbm_page_t*
-pagenum_to_page(MDBM* db, int pagenum, int alloc, int map)
+/**
+ * \brief Checks the integrity of all large objects.
+ * With \a nthreads > 1, the large objects are collected first and checked
+ * concurrently, and the results are then reported in chunk order.
+ * \param[in,out] db handle
+ * \param[in] verbose whether to display information messages
+ * \param[in] nthreads number of threads to use
+ * \return number of check failures
+ */
+static int
+check_db_lobs(MDBM* db, int verbose, int nthreads)
 {
-    mdbm_page_t* page = NULL;
+    int nerr = 0;
+    mdbm_hdr_t* h = db->db_hdr;
     int p;
-#ifdef MDBM_SANITY_CHECKS
-    if (pagenum < 0 || pagenum > db->db_max_dirbit) {
-        mdbm_log(LOG_CRIT, "%s: invalid pagenum (%d/%d) in pagenum_to_page",
-                 db->db_filename,pagenum,db->db_max_dirbit);
-        abort();
-    }
-#endif
-    if ((p = MDBM_GET_PAGE_INDEX(db,pagenum)) != 0) {
-        page = MDBM_PAGE_PTR(db,p);
-        if (MDBM_IS_WINDOWED(db)
-            && (map || (page->p.p_num_entries+1 >= MDBM_MAX_PGMAP_ENTRIES(db))))
+    int nlobs = 0;
+    int* lobs = NULL;
+    struct check_parallel cp;
+
+    memset(&cp,0,sizeof(cp));
+    if (nthreads > 1 && !MDBM_IS_WINDOWED(db)) {
+        mdbm_page_t* lob;
+
+        for (p = 0; p <= h->h_last_chunk && (lob = MDBM_PAGE_PTR(db,p))->p_num_pages > 0;
+             p += lob->p_num_pages)
         {
-            /* force a remap if it's larger than a single page */
-            page = get_window_page(db,page,0,0,0,0);
-            if (!page) {
-              return NULL;
+            if (lob->p_type == MDBM_PTYPE_LOB) {
+                cp.count++;
             }
         }
-#ifdef MDBM_SANITY_CHECKS
-        if (p > db->db_num_pages || !page || page->p_type != MDBM_PTYPE_DATA) {
-            mdbm_log(LOG_CRIT, "%s: invalid page (%d/%d type:%d vs %d) in pagenum_to_page",
-                     db->db_filename,p,db->db_num_pages, page?page->p_type:-1, MDBM_PTYPE_DATA);
-            abort();
+        if (cp.count
+            && (lobs = (int*)malloc(cp.count * sizeof(int))) != NULL
+            && (cp.nerr = (int*)malloc(cp.count * sizeof(int))) != NULL)
+        {
+            for (p = 0; p <= h->h_last_chunk && (lob = MDBM_PAGE_PTR(db,p))->p_num_pages > 0;
+                 p += lob->p_num_pages)
+            {
+                if (lob->p_type == MDBM_PTYPE_LOB) {
+                    lobs[nlobs++] = p;
+                }
+            }
+            cp.db = db;
+            cp.lobs = lobs;
+            check_parallel_run(&cp,nthreads);
+            nlobs = 0;
         }
-#endif
-        return page;
     }
 
-#ifdef MDBM_SANITY_CHECKS
-    if (alloc == MDBM_PAGE_EXISTS) {
-        mdbm_log(LOG_CRIT, "%s: alloc==MDBM_PAGE_EXISTS in pagenum_to_page",
-                 db->db_filename);
-        abort();
+    p = 0;
+    while (p <= h->h_last_chunk) {
+        mdbm_page_t* lob = MDBM_PAGE_PTR(db,p);
+        if (lob->p_type == MDBM_PTYPE_LOB) {
+            if (!cp.nerr) {
+                nerr += check_db_lob(db,p,verbose);
+            } else if (cp.nerr[nlobs] > 0) {
+                nerr += cp.nerr[nlobs];
+                if (verbose) {
+                    check_db_lob(db,p,verbose);
+                }
+            }
+            nlobs++;
+        }
+        if (lob->p_num_pages < 1) {
+            if (verbose) {
+                mdbm_log(LOG_CRIT,
+                         "%s: chunk %d invalid size (npages=%u); lob check aborted",
+                         db->db_filename,p,lob->p_num_pages);
+            }
+            nerr++;
+            break;
+        }
+        p += lob->p_num_pages;
     }
-#endif
-    if (alloc == MDBM_PAGE_NOALLOC) {
-        return NULL;
+    free(cp.nerr);
+    free(lobs);
+    if (verbose > 1) {
+        mdbm_log(LOG_INFO,
+                 "%s: %d large objects checked (%d error(s))",db->db_filename,nlobs,nerr);
     }
+    return nerr;
+}
 
-    if (mdbm_internal_lock(db) < 0) {
-        return NULL;
-    }
+/**
+ * \brief Check integrity of file header, free-list, data pages, and large objects.
+ * \param[in,out] db mdbm handle
+ * \param[in] level minimum level of checking
+ * \param[in] maxlevel maximum level of checking
+ * \param[in] verbose whether to display check information
+ * \param[in] nthreads number of threads for the data page and large object checks
+ */
+static int
+check_db(MDBM* db, int level, int maxlevel, int verbose, int nthreads)
+{
+    int nerr = 0;
 
-    if ((page = alloc_chunk(db,MDBM_PTYPE_DATA,1,0,0,MDBM_PAGE_NOMAP,MDBM_ALLOC_CAN_UNLOCK))
-        == NULL)
-    {
-        /* alloc_chunk releases internal lock if allocation fails */
-        return NULL;
+    if (check_guard_padding(db, 0) != 0) {
+        ++nerr;
     }
 
-    MDBM_INIT_TOP_ENTRY(MDBM_ENTRY(page,0),db->db_pagesize);
-    MDBM_SET_PAGE_INDEX(db, pagenum, page->p_num);
-    page->p_num = pagenum;
-    mdbm_internal_unlock(db);
-
-    if (map && MDBM_IS_WINDOWED(db)) {
-        page = get_window_page(db,page,0,0,0,0);
+    nerr += check_db_header(db,db->db_hdr,verbose);
+    if (level <= maxlevel && level > 0) {
+        nerr += check_db_chunks(db,verbose);
+        if (level <= maxlevel && level > 1) {
+            nerr += check_db_dir(db,verbose);
+            if (level <= maxlevel && level > 2) {
+                nerr += check_db_pages(db,verbose,level,nthreads);
+                nerr += check_db_lobs(db,verbose,nthreads);
+            }
+        }
     }
-
-    return page;
+    return nerr;
 }
 
-static mdbm_entry_t*
-first_entry(mdbm_page_t* page, mdbm_entry_data_t* e)
+static int
+check_empty(MDBM* db)
 {
-    e->e_page = page;
-    e->e_index = 0;
-    if (page->p.p_num_entries > 0) {
-        e->e_entry = MDBM_ENTRY(e->e_page,e->e_index);
-    } else {
-        e->e_entry = NULL;
-    }
-    return e->e_entry;
-}
+    int i;
+    int empty = 1;
 
-static inline mdbm_entry_t*
-set_entry(MDBM* db, mdbm_pagenum_t pagenum, int index, mdbm_entry_data_t* e)
-{
-    if ((e->e_page = pagenum_to_page(db,pagenum,MDBM_PAGE_NOALLOC,MDBM_PAGE_MAP)) == NULL
-        || index >= e->e_page->p.p_num_entries)
-    {
-        e->e_entry = NULL;
-        e->e_index = -1;
-    } else {
-        e->e_index = index;
-        e->e_entry = MDBM_ENTRY(e->e_page,index);
+    for (i = 0; i <= db->db_max_dirbit; i++) {
+        mdbm_page_t* page;
+        if ((page = pagenum_to_page(db,i,MDBM_PAGE_NOALLOC,MDBM_PAGE_NOMAP))) {
+            if (page->p.p_num_entries > 0) {
+                empty = 0;
+            }
+            if (MDBM_IS_WINDOWED(db)) {
+                release_window_page(db,page);
+            }
+            if (!empty) {
+                break;
+            }
+        }
     }
-    return e->e_entry;
+    return empty;
 }
 
-static inline mdbm_entry_t*
-next_entry(mdbm_entry_data_t* e)
+#if 0
+static void
+print_dir(MDBM* db, mdbm_page_t* page)
 {
-    if (++e->e_index < e->e_page->p.p_num_entries) {
-        e->e_entry++;
-    } else {
-        e->e_entry = NULL;
+    int i;
+    int base = MDBM_ENTRY(page,0)->e_offset;
+
+    for (i = 0; i <= page->p.p_num_entries; i++) {
+        mdbm_entry_t* ep = MDBM_ENTRY(page,i);
+        printf(" [%d]%s%d(%d)",i,ep->e_key.key.len ? "" : "*",ep->e_offset,base - ep->e_offset);
     }
-    return e->e_entry;
+    printf(" (num=%d free=%d)\n",page->p.p_num_entries,MDBM_PAGE_FREE_BYTES(page));
 }
+#endif
 
-static void
-get_kv0 (MDBM* db, mdbm_page_t* p, mdbm_entry_t* ep, datum* key, datum* val,
-         struct mdbm_fetch_info* info, int upd_cache, uint32_t lob_alloclen)
+static int
+find_free_chunk(MDBM* db, int npages, int n0, int n1, int* tot_free_pages)
 {
-    key->dptr = MDBM_KEY_PTR1(p,ep);
-    key->dsize = MDBM_KEY_LEN1(ep);
-    if (val != NULL) {
-        char* v = MDBM_VAL_PTR1(db,p,ep);
-        int vlen = MDBM_VAL_LEN1(db,ep);
-        if (MDBM_DB_CACHEMODE(db)) {
-            mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)v;
-            v += MDBM_CACHE_ENTRY_T_SIZE;
-            vlen -= MDBM_CACHE_ENTRY_T_SIZE;
-            if (upd_cache && !MDBM_IS_RDONLY(db)) {
-                switch (MDBM_DB_CACHEMODE(db)) {
-                case MDBM_CACHEMODE_LFU:
-                case MDBM_CACHEMODE_LRU:
-                    c->c_num_accesses++;
-                    c->c_dat.access_time = get_time_sec();
-                    break;
+    int n;
+    int best_alloc = 0;
+    int best_alloc_prev = 0;
+    int best_alloc_pages = db->db_num_pages;
+    int num_free = 0;
+    int prev = 0;
+    mdbm_free_index_t* fi;
 
-                case MDBM_CACHEMODE_GDSF:
-                    c->c_num_accesses++;
-                    c->c_dat.priority = (float)c->c_num_accesses / (key->dsize + vlen);
-                    break;
-                }
+    /* clear_pages() restricts the search to outside [n0,n1]; that's rare
+     * enough (and slow enough anyway) to leave to the list walk */
+    if (!n0 && (fi = free_index_get(db)) != NULL) {
+        if ((n = free_index_find(db,fi,npages)) != 0) {
+            alloc_free_chunk(db,npages,n,-1);
+            return n;
+        }
+        *tot_free_pages = fi->free_pages;
+        return 0;
+    }
+
+    n = db->db_hdr->h_first_free;
+    while (n > 0) {
+        mdbm_page_t* page = MDBM_PAGE_PTR(db,n);
+        if (!n0 || n+page->p_num_pages <= n0 || n > n1) {
+            if (page->p_num_pages == npages) {
+                alloc_free_chunk(db,npages,n,prev);
+                return n;
             }
-            if (info != NULL) {
-                info->flags = ((!(db->db_flags & MDBM_DBFLAG_NO_DIRTY) && MDBM_ENTRY_DIRTY(ep))
-                               ? MDBM_FETCH_FLAG_DIRTY
-                               : 0);
-                info->cache_num_accesses = c->c_num_accesses;
-                switch (MDBM_DB_CACHEMODE(db)) {
-                case MDBM_CACHEMODE_LFU:
-                case MDBM_CACHEMODE_LRU:
-                    info->cache_access_time = c->c_dat.access_time;
-                    break;
+            num_free += page->p_num_pages;
 
-                case MDBM_CACHEMODE_GDSF:
-                    info->cache_access_time = 0;
-                    break;
+            if (page->p_num_pages > npages) {
+                if (page->p_num_pages < best_alloc_pages) {
+                    best_alloc_prev = prev;
+                    best_alloc = n;
+                    best_alloc_pages = page->p_num_pages;
                 }
             }
-        }
-        if (MDBM_ENTRY_LARGEOBJ(ep)) {
-            uint32_t lob_pages, vallen;
-            mdbm_page_t* lob;
-            mdbm_entry_lob_t l = *((mdbm_entry_lob_t*)v);
-
-            if (!lob_alloclen) {
-                MDBM_ENTRY_LOB_ALLOC_LEN1(db,p,ep,&vallen,&lob_alloclen);
+            if (page->p.p_next_free == n) {
+                mdbm_log(LOG_CRIT, "%s: invalid next_free (%d vs %d) in find_free_chunk",
+                         db->db_filename, page->p.p_next_free, n);
+                abort();
             }
-            lob_pages = lob_alloclen / db->db_pagesize;
-            lob = MDBM_CHUNK_PTR(db,l.l_pagenum,lob_pages);
-            val->dptr = MDBM_LOB_VAL_PTR(lob);
-            val->dsize = MDBM_LOB_VAL_LEN(lob);
-        } else {
-            val->dptr = v;
-            val->dsize = vlen;
         }
+        prev = n;
+        n = page->p.p_next_free;
     }
+    if (best_alloc) {
+        alloc_free_chunk(db,npages,best_alloc,best_alloc_prev);
+        return best_alloc;
+    }
+    *tot_free_pages = num_free;
+    return 0;
 }
 
-static inline void
-get_kv(MDBM* db, mdbm_entry_data_t* e, datum* key, datum* val)
-{
-    get_kv0(db,e->e_page,e->e_entry,key,val,NULL,0,0);
-}
-
-static inline void
-get_kv1 (MDBM* db, mdbm_page_t* p, mdbm_entry_t* ep, datum* key, datum* val,
-         struct mdbm_fetch_info* info)
+static int
+fixup_lob_pointer(MDBM* db, int data_page, int lob_page, int new_lob_page)
 {
-    get_kv0(db,p,ep,key,val,info,1,0);
-}
+    mdbm_page_t* page = pagenum_to_page(db,data_page,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
+    mdbm_entry_t* ep;
 
-static void
-get_kv2 (MDBM* db, mdbm_page_t* p, mdbm_entry_t* ep, datum* key, datum* val)
-{
-    get_kv0(db,p,ep,key,val,NULL,0,0);
+    for (ep = MDBM_ENTRY(page,0); ep->e_key.match != MDBM_TOP_OF_PAGE_MARKER; ep++) {
+        if (ep->e_key.match && MDBM_ENTRY_LARGEOBJ(ep)) {
+            mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
+            if (lp->l_pagenum == lob_page) {
+                lp->l_pagenum = new_lob_page;
+                dirty_mark_page(db,page);
+                return 0;
+            }
+        }
+    }
+    return -1;
 }
 
-static mdbm_entry_t*
-find_entry(MDBM* db, mdbm_page_t* page, const datum* key, mdbm_hashval_t hash,
-           datum* k, datum* v, struct mdbm_fetch_info* info)
+static int
+clear_pages(MDBM* db, int p0, int npages)
 {
-    /* requires page lock */
-
-    mdbm_entry_t test;
-    mdbm_entry_t* ep;
-    unsigned int i;
-    mdbm_page_t* rpage = page;
-    int lob_alloclen = 0;
+    int n;
+    mdbm_page_t* page;
+    int p1 = p0 + npages - 1;
+    int prev = 0;
 
-    test.e_key.key.len = key->dsize;
-    test.e_key.key.hash = hash >> 16;
+    /* fprintf(stderr, "=============> clear_pages(%p, %d, %d)\n", (void*)db, p0, npages); */
+    if (p1 >= db->db_num_pages) {
+#ifdef DEBUG
+        mdbm_log(LOG_DEBUG, "clear_pages failed, p1=%u, db_num_pages=%u",
+                 p1, db->db_num_pages);
+#endif
+        errno = ENOMEM;
+        return -1;
+    }
 
-    ep = MDBM_ENTRY(page,0);
-    i = 0;
-    for (;;) {
-        char* kp;
+    for (n = p0; n <= p1 && n <= db->db_hdr->h_last_chunk;) {
+        page = MDBM_PAGE_PTR(db,n);
+        if (page->p_type != MDBM_PTYPE_FREE) {
+            mdbm_page_t* new_page;
+            int new_pagenum;
+            int prev_num_pages;
 
-        while (ep[i].e_key.match != test.e_key.match && i < page->p.p_num_entries) {
-        /* fprintf(stderr, "find_entry() page:%p, entry:%d key:[%s]\n", (void*)page, i, ((char*)page)+MDBM_ENTRY_OFFSET(db,ep+i)); */
-        /* fprintf(stderr, "find_entry() match: %d vs %d\n", ep[i].e_key.match, test.e_key.match );*/
-            i++;
-        }
-        if (i == page->p.p_num_entries) {
-            return NULL;
-        }
+            page = MDBM_MAPPED_PAGE_PTR(db,n);
+            if ((new_page = alloc_chunk(db,page->p_type,page->p_num_pages,p0,p1,MDBM_PAGE_MAP,0))
+                == NULL)
+            {
+                return -1;
+            }
 
-        if (MDBM_IS_WINDOWED(db)) {
-            int ent_off = MDBM_ENTRY_OFFSET(db,ep+i);
-            int ent_len = MDBM_ENTRY_LEN(db,ep+i);
-            rpage = get_window_page(db,page,0,0, ent_off, ent_len);
-            if (!rpage) {
-              return NULL;
+            new_pagenum = new_page->p_num;
+            prev_num_pages = new_page->p_prev_num_pages;
+            memcpy(new_page,page,page->p_num_pages * db->db_pagesize);
+            new_page->p_prev_num_pages = prev_num_pages;
+            dirty_mark(db,new_pagenum,new_page->p_num_pages);
+            if (new_page->p_type == MDBM_PTYPE_DATA) {
+/* fprintf(stderr, "=============> clear_pages(%p, %d, %d) n=%d->%d DATA\n", (void*)db, p0, npages, n, new_pagenum); */
+/*              printf("move data page %d: %d -> %d\n", */
+/*                     page->p_num, */
+/*                     n, */
+/*                     new_pagenum); */
+                MDBM_SET_PAGE_INDEX(db,page->p_num, new_pagenum);
+            } else if (new_page->p_type == MDBM_PTYPE_LOB) {
+/* fprintf(stderr, "=============> clear_pages(%p, %d, %d) n=%d->%d LOB\n", (void*)db, p0, npages, n, new_pagenum); */
+/*              printf("move lob page %d: %d -> %d\n", */
+/*                     page->p_num, */
+/*                     n, */
+/*                     new_pagenum); */
+                fixup_lob_pointer(db,page->p_num,n,new_pagenum);
             }
+            n = free_chunk(db,n,&prev);
+            if (n < p0) {
+                p0 = n;
+            }
+            page = MDBM_PAGE_PTR(db,n);
         }
-        kp = MDBM_KEY_PTR1(rpage,ep+i);
-        if (memcmp(kp,key->dptr,key->dsize)) {
-            i++;
-            continue;
-        }
-        break;
+        n += page->p_num_pages;
     }
 
-    if (MDBM_IS_WINDOWED(db) && MDBM_ENTRY_LARGEOBJ(ep+i)) {
-        uint32_t vallen, lob_alloclen;
-        int n;
-
-        MDBM_ENTRY_LOB_ALLOC_LEN1(db,rpage,ep+i,&vallen,&lob_alloclen);
-        n = 2 + lob_alloclen/db->db_pagesize;
-        if (db->db_window.num_pages < n) {
-            mdbm_log(LOG_ERR,
-                     "%s: window size too small for large object (need at least %d bytes)",
-                     db->db_filename,n * db->db_pagesize);
-            return NULL;
-        }
+    if (p0 > db->db_hdr->h_last_chunk) {
+        mdbm_page_t* last_page = MDBM_PAGE_PTR(db,db->db_hdr->h_last_chunk);
+        assert(p0 == db->db_hdr->h_last_chunk + last_page->p_num_pages);
+        page = MDBM_PAGE_PTR(db,p0);
+        /* this is a placeholder type designation to keep the sanity checks happy */
+        page->p_type = MDBM_PTYPE_DATA;
+        page->p_num_pages = npages;
+        page->p_prev_num_pages = last_page->p_num_pages;
+        db->db_hdr->h_last_chunk = p0;
+    } else {
+        alloc_free_chunk(db,npages,p0,-1);
+        page = MDBM_PAGE_PTR(db,p0);
+        /* this is a placeholder type designation to keep the sanity checks happy */
+        page->p_type = MDBM_PTYPE_DATA;
+        page->p_num_pages = npages;
     }
+    dirty_mark(db,p0,1);
+    journal_structural(db);
 
-    get_kv0(db,rpage,ep+i,k,v,info,1,lob_alloclen);
-    return ep+i;
+    CHECK_DB(db);
+
+    return p0;
 }
 
 static int
-del_entry(MDBM* db, mdbm_page_t* page, mdbm_entry_t* ep)
+find_defrag_free_chunk(MDBM* db, int npages)
 {
-    /* requires page lock */
+    int n;
+    int best_moved = db->db_num_pages;
+    int best_maxmove = db->db_num_pages;
+    int best_n0 = 0;
 
-    int index = MDBM_ENTRY_INDEX(page,ep);
-    int offset;
+/*     printf("defrag npages=%d dbpages=%d\n",npages,db->db_num_pages); */
 
-    if (MDBM_ENTRY_LARGEOBJ(ep)) {
-        mdbm_page_t* rpage = page;
-        mdbm_entry_lob_t*  lp;
+    {
+        int got;
 
-        if (MDBM_IS_WINDOWED(db)) {
-            int ent_off = MDBM_ENTRY_OFFSET(db,ep);
-            int ent_len = MDBM_ENTRY_LEN(db,ep);
-            rpage = get_window_page(db,page,0,0, ent_off, ent_len);
-            if (!rpage) {
-              return -1;
-            }
-        }
-        lp = MDBM_LOB_PTR1(db,rpage,ep);
-        if (mdbm_internal_lock(db) < 0) {
-            return -1;
-        }
-        free_chunk(db,lp->l_pagenum,NULL);
-        mdbm_internal_unlock(db);
-    }
-
-    offset = ep[0].e_offset + MDBM_ALIGN_LEN(db,ep[0].e_key.key.len);
-    ep->e_key.match = 0;
-    ep->e_offset = offset;
-
-    if (index == page->p.p_num_entries-1) {
-        while (index > 0 && !ep[-1].e_key.match) {
-            index--;
-            ep--;
-        }
-        page->p.p_num_entries = index;
-        MDBM_INIT_TOP_ENTRY(ep,ep->e_offset);
-        if (!index && page->p_num_pages > 1) {
-            /* Free oversized page. */
-            if (mdbm_internal_lock(db) == 1) {
-                shrink_page(db,page);
-                mdbm_internal_unlock(db);
+        got = 0;
+        n = MDBM_PAGE_PTR(db,0)->p_num_pages;
+        while (got < npages && n <= db->db_hdr->h_last_chunk) {
+            mdbm_page_t* p = MDBM_PAGE_PTR(db,n);
+            int num = p->p_num_pages;
+            if (p->p_type != MDBM_PTYPE_FREE && num > 1) {
+                got = 0;
+            } else {
+                if (!got) {
+                    best_n0 = n;
+                }
+                got += num;
             }
+            n += num;
         }
-    } else {
-        if (index > 0 && !ep[-1].e_key.match) {
-            offset = ep[-1].e_offset;
-        }
-        while (!ep->e_key.match) {
-            ep->e_offset = offset;
-            ep++;
+
+        if (got >= npages) {
+            if ((n = clear_pages(db,best_n0,npages)) > 0) {
+                return n;
+            }
         }
     }
-    return 0;
-}
-
-static void
-wring_page(MDBM* db, mdbm_page_t* page)
-{
-    /* requires page lock */
 
-    mdbm_entry_data_t e;
-    mdbm_entry_t* ep;
-    int index = -1;
-    int offset = 0;
+    n = db->db_hdr->h_first_free;
+    while (n > 0) {
+        mdbm_page_t* n0p;
+        int n0, n1, got, moved, maxmove, next;
 
-    int num = 0;
-    for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
-        if (ep->e_key.match) {
-            num++;
-            if (offset) {
-                mdbm_entry_t* move_ep = MDBM_ENTRY(page,index);
-                int ksize = MDBM_ALIGN_LEN(db,ep->e_key.key.len);
-                int vsize = ep[0].e_offset -
-                            ep[1].e_offset -
-                            MDBM_ALIGN_LEN(db,ep[1].e_key.key.len);
-                int kvsize = ksize + vsize;
+        got = 0;
+        n0 = n1 = n;
+        n0p = MDBM_PAGE_PTR(db,n);
 
-                offset -= kvsize;
-                move_ep->e_key.match = ep->e_key.match;
-                move_ep->e_flags = ep->e_flags;
-                move_ep->e_offset = offset + vsize;
-                memmove((char*)page + offset,MDBM_VAL_PTR2(page,ep->e_offset,vsize),kvsize);
+/*      printf("  n=%d\n",n); */
 
-                index++;
+        maxmove = moved = 0;
+        while (got < npages) {
+            mdbm_page_t* n0pnew;
+            mdbm_page_t* n1pnew;
+            if (n0p && n0p->p_type != MDBM_PTYPE_DIR) {
+                n0pnew = MDBM_PAGE_PTR(db,n0 - n0p->p_prev_num_pages);
+            } else {
+                n0pnew = NULL;
             }
-        } else {
-            if (!offset) {
-                index = e.e_index;
-                offset = e.e_entry->e_offset;
+            if (n1 <= db->db_hdr->h_last_chunk) {
+                n1pnew = MDBM_PAGE_PTR(db,n1);
+            } else {
+                if (n1 < db->db_num_pages) {
+                    got += db->db_num_pages - n1;
+                    n1 = db->db_num_pages;
+                    if (got >= npages) {
+                        break;
+                    }
+                }
+                n1pnew = NULL;
+            }
+/*          printf("   n0:%d-%d=%d n1:%d+%d=%d got=%d\n", */
+/*                 n0,n0pnew ? n0p->p_prev_num_pages : 0, */
+/*                 n0pnew ? n0 - n0p->p_prev_num_pages : 0, */
+/*                 n1,n1pnew ? n1pnew->p_num_pages : 0, */
+/*                 n1pnew ? n1 + n1pnew->p_num_pages : 0, */
+/*                 got); */
+            if (n0pnew && (!n1pnew
+                           || n0pnew->p_type == MDBM_PTYPE_FREE
+                           || (got + n1pnew->p_num_pages > npages
+                               && n0pnew->p_num_pages < n1pnew->p_num_pages)
+                           || (n0pnew->p_num_pages >= n1pnew->p_num_pages)))
+            {
+                n0p = n0pnew;
+                n0 -= n0p->p_num_pages;
+                got += n0p->p_num_pages;
+                if (n0p->p_type != MDBM_PTYPE_FREE) {
+                    if (n0p->p_num_pages > maxmove) {
+                        maxmove = n0p->p_num_pages;
+                    }
+                    moved += n0p->p_num_pages;
+                }
+            } else if (n1pnew) {
+                got += n1pnew->p_num_pages;
+                n1 += n1pnew->p_num_pages;
+                if (n1pnew->p_type != MDBM_PTYPE_FREE) {
+                    if (n1pnew->p_num_pages > maxmove) {
+                        maxmove = n1pnew->p_num_pages;
+                    }
+                    moved += n1pnew->p_num_pages;
+                }
+            }
+            if (!n0pnew && !n1pnew) {
+                break;
+            }
+        }
+        if (got >= npages
+            && (maxmove < best_maxmove
+                || (maxmove == best_maxmove
+                    && moved < best_moved)))
+        {
+            best_moved = moved;
+            best_maxmove = maxmove;
+            best_n0 = n0;
+            if (moved == 1 || got == npages) {
+                break;
             }
         }
+        next = MDBM_PAGE_PTR(db,n)->p.p_next_free;
+        assert(next > n || !next);
+        n = next;
     }
-    if (offset) {
-        MDBM_INIT_TOP_ENTRY(MDBM_ENTRY(page,num),offset);
-        page->p.p_num_entries = num;
+
+    if (!best_n0) {
+        return -1;
     }
-    /* printf("wring page=%d: before=%d after=%d\n",page->p_num,n,MDBM_PAGE_FREE_BYTES(page)); */
+
+    if ((n = clear_pages(db,best_n0,npages)) < 0) {
+        return -1;
+    }
+
+/*     printf("defrag n0=%d npages=%d: n=%d\n",best_n0,npages,n); */
+    CHECK_DB(db);
+
+    return n;
 }
 
 static int
-resize(MDBM* db, int new_dirshift, int new_num_pages)
+map(MDBM* db, void* start_addr, off_t start_offset, size_t len, char** base, size_t* base_len)
 {
-    /* requires db lock */
-
-    int old_num_pages = db->db_num_pages;
-    int old_dirpages;
-    int old_dirshift = db->db_dir_shift;
-    int old_dirsize;
-    int old_ptsize;
-    int new_dirpages;
-    int new_dirwidth;
-    int new_dirsize;
-    int new_ptsize;
-    mdbm_ptentry_t* new_ptable;
-
-    if (!new_dirshift) {
-        new_dirshift = old_dirshift;
-    }
-    if (!new_num_pages) {
-        new_num_pages = old_num_pages + MDBM_NUM_DIR_PAGES(db->db_pagesize,new_dirshift);
-    }
-    new_dirwidth = MDBM_DIR_WIDTH(new_dirshift);
-    if (new_dirwidth > new_num_pages) {
-        new_num_pages = new_dirwidth;
+    void* m;
+    int prot = MDBM_IS_RDONLY(db) ? PROT_READ : (PROT_READ|PROT_WRITE);
+    int mapflags = MAP_SHARED;
+    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
+        mapflags |= MAP_ANON;
     }
-    if (new_dirshift <= old_dirshift && new_num_pages <= old_num_pages) {
-        return 0;
+#ifdef FREEBSD
+    mapflags |= MAP_NOCORE;
+    if ((db->db_flags & (MDBM_DBFLAG_ASYNC|MDBM_DBFLAG_FSYNC)) == 0) {
+        mapflags |= MAP_NOSYNC;
     }
-    if (new_num_pages > old_num_pages) {
-        if ((db->db_hdr->h_max_pages && new_num_pages > db->db_hdr->h_max_pages)
-                || resize_db(db,new_num_pages) < 0) {
-            mdbm_log(LOG_DEBUG,
-                 "resize db failure,"
-                 " old_num_pages=%d, new_num_pages=%d,"
-                 " dirwidth=%d, new_dirwidth=%d)\n",
-                 old_num_pages, new_num_pages,
-                 MDBM_DB_DIR_WIDTH(db), new_dirwidth);
-            errno = ENOSPC;
-            return -1;
-        }
-        new_num_pages = db->db_num_pages;
+#endif
+    len = (len+db->db_sys_pagesize-1) & ~((size_t)db->db_sys_pagesize-1);
+    if (MAP_FAILED == (m = mmap(start_addr,len, prot, mapflags,db->db_fd,start_offset))) {
+        mdbm_logerror(LOG_ERR,0,"%s: mmap failure mmap(%p, %llu, %d, %d, %d, %lld)",
+            db->db_filename,
+            (void*)start_addr, (unsigned long long)len, prot, mapflags, db->db_fd,
+            (long long)start_offset);
+        return -1;
     }
-    if (new_dirshift == old_dirshift) {
+    /*fprintf(stderr, "map::mmap(%p, %d, %d, %d, %d, %d) = %p\n", start_addr, len, prot, */
+    /*              mapflags,db->db_fd,(int)start_offset, m); */
+
+    *base = m;
+    *base_len = len;
+    return 0;
+}
+
+static int
+protect_dir(MDBM* db, int protect)
+{
+    int dir_size;
+    int used;
+    int total;
+
+    if (db->db_flags & MDBM_DBFLAG_HDRONLY) {
+        /* No extra space when mapped hdronly */
         return 0;
     }
+    dir_size = MDBM_DB_NUM_DIR_BYTES(db);
 
-    old_dirpages = MDBM_DB_NUM_DIR_PAGES(db);
-    old_dirsize = MDBM_DB_DIR_SIZE(db);
-    old_ptsize = MDBM_DB_PTABLE_SIZE(db);
-
-    new_dirpages = MDBM_NUM_DIR_PAGES(db->db_pagesize,new_dirshift);
-    new_dirsize = MDBM_DIR_SIZE(new_dirshift);
-    new_ptsize = MDBM_PTABLE_SIZE(new_dirshift);
+    /* Round `used' up to a system page size. */
+    used = (dir_size + (db->db_sys_pagesize - 1)) & ~(db->db_sys_pagesize - 1);
 
-    protect_dir(db,0);
+    /* Round `total' up to an mdbm page size. */
+    total = dir_size + (db->db_pagesize - 1);
 
-    if (new_dirpages > old_dirpages) {
-        if (grow_chunk(db,0,new_dirpages) < 0) {
-            protect_dir(db,1);
-            return -1;
-        }
+    /* Reduce the total size if the mdbm page size is greater then the system's page size. */
+    if (db->db_pagesize > db->db_sys_pagesize) {
+        total -= total % db->db_pagesize;
     }
-
-    if (new_dirsize > old_dirsize) {
-        /* Initialize new directory and page table */
-        new_ptable = MDBM_PTABLE_PTR(MDBM_DIR_PTR(db),new_dirshift);
+    total -= total % db->db_sys_pagesize;
+    if (total > used) {
         mdbm_log(LOG_DEBUG,
-                 "move page table,"
-                 " db_dir=%p, old_dirsize=%d, new_dirsize=%d,"
-                 " old_ptable=%p, old_ptsize=%d,"
-                 " new_ptable=%p, new_ptsize=%d,"
-                 " directory size increase=%d\n",
-                 (void*)db->db_dir,
-                 old_dirsize,
-                 new_dirsize,
-                 (void*)db->db_ptable,
-                 old_ptsize,
-                 (void*)new_ptable,
-                 new_ptsize,
-                 new_dirsize - old_dirsize);
+                 "protect_dir,"
+                 " db_pagesize=%d, db_syspage_size=%d, dir_size=%d,"
+                 " used=%d, total=%d, db_base=%p, db_base+used=%p, total - used=%d"
+                 " mprotect start=%p, mprotect end=%p",
+                 db->db_pagesize, db->db_sys_pagesize, dir_size,
+                 used, total, (void*)db->db_base, (void*)(db->db_base + used), total - used,
+                 (void*)(db->db_base + used), (void*)(db->db_base + used + total - used - 1));
+        if (mprotect(db->db_base + used,
+                     total - used,
+                     (protect
+                      ? PROT_NONE
+                      : (MDBM_IS_RDONLY(db) ? PROT_READ : (PROT_READ|PROT_WRITE)))) < 0) {
+            mdbm_logerror(LOG_ERR,0,"%s: mprotect failure",db->db_filename);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-        memmove(new_ptable,db->db_ptable,old_ptsize);
-        db->db_ptable = new_ptable;
-        /* Clear the added portion at the end of the new page directory. */
-        memset(MDBM_DIR_PTR(db)+old_dirsize,0,new_dirsize - old_dirsize);
-        /* NOTE: this gets set again below, but sync_dir allocates memory based on it. */
-        db->db_hdr->h_dir_shift = (uint8_t)new_dirshift;
-        sync_dir(db,NULL);
+void
+sync_dir(MDBM* db, mdbm_hdr_t* hdr)
+{
+    if (!hdr) {
+        hdr = db->db_hdr;
     }
-    /* Clear the added portion at the end of the new page table. */
-    mdbm_log(LOG_DEBUG,
-             "Clear new page table, db_ptable=%p, db_ptable+old_ptsize=%p, size=%d",
-             (void*)db->db_ptable, (void*)(db->db_ptable+old_ptsize), new_ptsize - old_ptsize);
-    memset((char*)db->db_ptable+old_ptsize,0,new_ptsize - old_ptsize);
+    if (db->db_dir) {
+        free(db->db_dir);
+    }
+    dir_cache_detach(db);
+    /* HDRONLY means map only 1st page, so the entire directory may not be there (e.g. big MDBMs).
+     * That's why we don't copy the directory, and data should not be accessed with HDRONLY */
+    if (db->db_flags & MDBM_DBFLAG_HDRONLY) {
+        db->db_dir = NULL;
+    } else {
+        db->db_dir = (mdbm_dir_t*)malloc(MDBM_DIR_SIZE(hdr->h_dir_shift));
+        memcpy(db->db_dir,MDBM_DIR_PTR(db),MDBM_DIR_SIZE(hdr->h_dir_shift));
+        db->db_dir_gen = hdr->h_dir_gen;
+        db->db_dir_flags = hdr->h_dbflags & MDBM_HFLAG_PERFECT;
+    }
+}
 
-    db->db_dir_shift = db->db_hdr->h_dir_shift = (uint8_t)new_dirshift;
+static void
+init(MDBM* db, mdbm_hdr_t* hdr)
+{
+    db->db_pagesize = hdr->h_pagesize;
+    db->db_cache_mode = hdr->h_cache_mode;
+    db->db_num_pages = hdr->h_num_pages;
+    db->db_align_mask = hdr->h_dbflags & MDBM_ALIGN_MASK;
+    db->db_hashlo_len = (hdr->h_dbflags & MDBM_HFLAG_FULLHASH) ? sizeof(uint16_t) : 0;
+    db->db_dir_shift = hdr->h_dir_shift;
+    db->db_max_dir_shift = hdr->h_max_dir_shift;
     db->db_max_dirbit = MDBM_HASH_MASK(db->db_dir_shift);
-
-    protect_dir(db,1);
-
-    return 0;
+    sync_dir(db,hdr);
+    db->db_ptable = MDBM_PTABLE_PTR(MDBM_DIR_PTR(db),db->db_dir_shift);
+    db->db_hashfunc = mdbm_hash_funcs[hdr->h_hash_func];
+    db->db_spillsize = (hdr->h_dbflags & MDBM_HFLAG_LARGEOBJ) ? hdr->h_spill_size : 0;
 }
 
-static mdbm_page_t*
-split_page(MDBM* db, mdbm_hashval_t hashval)
+int
+mdbm_internal_remap(MDBM *db, size_t dbsize, int flags)
 {
-    int dirbit;
-    int hashbit;
-    mdbm_pagenum_t pagenum, newpagenum;
-    mdbm_page_t* page;
-    mdbm_page_t* newpage;
-    mdbm_entry_data_t e;
-    mdbm_entry_t* ep;
-    mdbm_hashval_t hvbit;
-    mdbm_hashval_t hv;
-    int new_index;
-    int new_offset;
-    int num;
+    mdbm_hdr_t hdr;
+    mdbm_page_t page;
+    int got_hdr = 0;
 
-    hv = hashval;
-    dirbit = 0;
-    hashbit = 0;
-    while (dirbit < db->db_max_dirbit && MDBM_DIR_BIT(db,dirbit)) {
-        dirbit = (dirbit << 1) + (hv & 1) + 1;
-        hashbit++;
-        hv >>= 1;
+    /* Save a copy of the header, then unmap current db. */
+    if (db->db_base) {
+        assert(sizeof(hdr) <= db->db_base_len);
+        memcpy(&page, db->db_base, MDBM_PAGE_T_SIZE);
+        memcpy(&hdr, db->db_base+MDBM_PAGE_T_SIZE, sizeof(hdr));
+        got_hdr = 1;
+        if (munmap(db->db_base,db->db_base_len) < 0) {
+            mdbm_logerror(LOG_ERR,0,"munmap(%p,%llu)",
+                          (void*)db->db_base,(unsigned long long)db->db_base_len);
+        }
+        /*fprintf(stderr, "remap::munmap(%p,%u)\n", db->db_base,(unsigned)db->db_base_len); */
+        db->db_base = NULL;
+    } else {
+      memset(&page, 0, sizeof(page));
     }
 
-    pagenum = (hashval & MDBM_HASH_MASK(hashbit));
-    newpagenum = pagenum | (1<<hashbit);
+    if (!dbsize || !got_hdr) {
+        /* There's no header, and requested size is 0, so create a minmal map
+         * based on the system page size. */
+        uint64_t s;
+        char* p;
 
-    if (newpagenum > db->db_max_dirbit
-        && db->db_max_dir_shift
-        && db->db_dir_shift >= db->db_max_dir_shift) {
-        /* can't split beyond capped size */
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "Cannot split page, pagenum=%u, newnum=%u, dir_shift=%u",
-                 pagenum, newpagenum, db->db_dir_shift);
-#endif
-        errno = ENOMEM;
-        return NULL;
-    }
+        mdbm_log(LOG_DEBUG,"%s: remap, using default system page size for header",
+                 db->db_filename);
+        assert(sizeof(hdr) <= db->db_sys_pagesize);
 
-    if (!db_is_owned(db)) {
-        errno = EPERM;
-        return NULL;
-    }
+        if ((p = (char*)mmap(0,db->db_sys_pagesize,PROT_READ,MAP_SHARED,db->db_fd,0))
+            == MAP_FAILED)
+        {
+            mdbm_logerror(LOG_ERR,0,"%s: mdbm header mmap failure",db->db_filename);
+            return -1;
+        }
+        /*fprintf(stderr, "remap::mmap(%p, %u, %d, %d, %d, %d) = %p\n", (void*)0,(unsigned)db->db_sys_pagesize,PROT_READ,MAP_SHARED,db->db_fd,0, p); */
 
-    mdbm_log(LOG_DEBUG, "split page, pagenum=%d, newpagenum=%d\n", pagenum, newpagenum);
+        memcpy(&hdr,p+MDBM_PAGE_T_SIZE,sizeof(hdr));
+        munmap(p,db->db_sys_pagesize);
+        /*fprintf(stderr, "remap::munmap(%p,%u)\n", p,(unsigned)db->db_sys_pagesize); */
 
-    if (newpagenum > db->db_max_dirbit) {
-        mdbm_log(LOG_DEBUG,
-                 "resizing page directory for page split,"
-                 " db_dir_shift=%d, db_dir_shift+1=%d, db_max_dir_shift=%d,"
-                 " pagenum=%d, newpagenum=%d\n",
-                 db->db_dir_shift, db->db_dir_shift + 1, db->db_max_dir_shift,
-                 pagenum, newpagenum);
-        if ((db->db_max_dir_shift && db->db_dir_shift >= db->db_max_dir_shift)
-            || resize(db,db->db_dir_shift+1,0) < 0) {
-            db->db_max_dir_shift = db->db_dir_shift;
-            return NULL;
+        if (check_db_header(db,&hdr,1) > 0) {
+            errno = EBADF;
+            return -1;
         }
-    }
-
-    newpage = pagenum_to_page(db,newpagenum,MDBM_PAGE_ALLOC,MDBM_PAGE_MAP);
-    if (!newpage) {
-        return NULL;
-    }
 
-    page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
-    if (page->p_num_pages > 1) {
-        return NULL;
+        s = MDBM_HDR_DB_SIZE_64(&hdr);
+#ifndef __x86_64__
+        if (s > UINT_MAX && !MDBM_IS_WINDOWED(db)) {
+            mdbm_log(LOG_ERR,
+                     "%s: mdbm too large to open in 32-bit mode",
+                     db->db_filename);
+            errno = EFBIG;
+            return -1;
+        }
+#endif
+        if (!dbsize) {
+            dbsize = s;
+        }
     }
 
-    hvbit = (1<<hashbit);
-    new_index = newpage->p.p_num_entries;
-    new_offset = MDBM_DATA_PAGE_BOTTOM_OF_DATA(newpage);
-    num = 0;
-    for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
-        if (ep->e_key.match) {
-            mdbm_hashval_t h = MDBM_HASH_VALUE(db,MDBM_KEY_PTR(&e),ep->e_key.key.len);
-            if (h & hvbit) {
-                mdbm_entry_t* new_ep = MDBM_ENTRY(newpage,new_index);
-                int ksize = MDBM_ALIGN_LEN(db,ep[0].e_key.key.len);
-                int vsize = (ep[0].e_offset -
-                             ep[1].e_offset -
-                             MDBM_ALIGN_LEN(db,ep[1].e_key.key.len));
-                int kvsize = ksize + vsize;
+    if (MDBM_IS_WINDOWED(db)) {
+#ifdef HAVE_WINDOWED_MODE
+        int syspagesz = db->db_sys_pagesize;
+        int dbpagesz = hdr.h_pagesize;
+        /*int ndbpages = hdr.h_num_pages; // db-sized pages */
+        /* this provides enough space for the header, dir-bits, and ptable... */
+        int ndirpages = MDBM_NUM_DIR_PAGES(dbpagesz,hdr.h_dir_shift,hdr.h_dbflags);
+        size_t mapsz = (size_t)ndirpages*dbpagesz;
 
-                new_ep->e_offset = new_offset - ksize;
-                new_ep->e_key.match = ep->e_key.match;
-                new_ep->e_flags = ep->e_flags;
-                memcpy(MDBM_VAL_PTR2(newpage,new_offset,kvsize),
-                       MDBM_VAL_PTR2(page,ep->e_offset,vsize),
-                       kvsize);
-                new_offset -= kvsize;
-                if (MDBM_ENTRY_LARGEOBJ(ep)) {
-                    mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
-                    mdbm_page_t* lob = MDBM_PAGE_PTR(db,lp->l_pagenum);
-                    lob->p_num = newpagenum;
-                }
-                ep->e_flags &= ~MDBM_EFLAG_LARGEOBJ;
-                del_entry(db,page,ep);
-                ++new_index;
-            }
+        if (hdr.h_dbflags & MDBM_HFLAG_PAGEINDEX) {
+            mdbm_log(LOG_ERR, "%s: windowed mode does not support in-page indexes",
+                     db->db_filename);
+            errno = EINVAL;
+            return -1;
         }
-        num++;
-    }
-    newpage->p.p_num_entries = new_index;
-    mdbm_log(LOG_DEBUG,
-             "split page=%d, newpage=%d, moved(new_index)=%d of num=%d\n",
-             pagenum, newpagenum, new_index, num);
-    MDBM_INIT_TOP_ENTRY(MDBM_ENTRY(newpage,new_index),new_offset);
 
-    MDBM_SET_DIR_BIT(db,dirbit);
-    db->db_hdr->h_dbflags &= ~MDBM_HFLAG_PERFECT;
-    db->db_hdr->h_dir_gen++;
-    sync_dir(db,NULL);
+        /* ensure mapsz is a multiple of db_page_size rounded up to sys_page_size */
+        mapsz = (size_t)(MDBM_NUM_PAGES_ROUNDED(dbpagesz,  mapsz))*dbpagesz;
+        mapsz = (size_t)(MDBM_NUM_PAGES_ROUNDED(syspagesz, mapsz))*syspagesz;
 
-    return (hashval & hvbit) ? newpage : page;
-}
+        /* map the header/dir/ptable and extra space */
+        if (map(db,0,0,mapsz,&db->db_base,&db->db_base_len) < 0) {
+            mdbm_logerror(LOG_ERR,0,"%s: map failure",db->db_filename);
+            return -1;
+        }
 
-static int
-shake_page(MDBM* db, mdbm_page_t* page,
-            const datum* key, const datum* val,
-            int free_bytes, int needed_bytes)
-{
-    /* requires page lock */
-
-    int recycle_bytes = 0;
-    int ver = MDBM_DBFLAG_SHAKE_VER(db);
-
-    if (ver == MDBM_DBFLAG_SHAKE_V3) {
-        struct mdbm_shake_data_v3 od;
-        int i, num;
-        mdbm_entry_data_t e;
-        mdbm_entry_t* ep;
-        kvpair null_kv;
-
-        od.page_num = page->p_num;
-        od.page_begin = MDBM_DATA_PAGE_BASE(page);
-        od.page_end = od.page_begin + db->db_pagesize;
-        od.page_free_space = free_bytes;
-        od.space_needed = needed_bytes;
-        num = page->p.p_num_entries;
-        od.page_num_items = num;
-        od.page_items = (kvpair*)malloc(num * sizeof(od.page_items[0]));
-        od.page_item_sizes = (uint32_t*)malloc(num * sizeof(od.page_item_sizes[0]));
-        od.user_data = db->db_shake_data;
+        db->db_hdr = (mdbm_hdr_t*)(db->db_base + MDBM_PAGE_T_SIZE);
+        if (check_db_header(db,db->db_hdr,1) > 0) {
+            errno = EBADF;
+            return -1;
+        }
+        init(db,db->db_hdr);
 
-        memset(&null_kv,0,sizeof(null_kv));
-        for (ep = first_entry(page,&e), i = 0; ep; ep = next_entry(&e), i++) {
-            if (ep->e_key.match) {
-                get_kv(db,&e,&od.page_items[i].key,&od.page_items[i].val);
-                od.page_item_sizes[i] = MDBM_ENTRY_SIZE(db,ep);
-            } else {
-                od.page_items[i] = null_kv;
-                od.page_item_sizes[i] = 0;
+        if (!db->db_window.base) {
+            static const int MDBM_DEFAULT_WINDOW_PAGES = 8;
+            if (mdbm_set_window_size_internal(db,MDBM_DEFAULT_WINDOW_PAGES * dbpagesz) < 0) {
+                return -1;
             }
         }
+#endif
+    } else {
+        size_t mapsz = (flags & MDBM_HEADER_ONLY) ? (size_t)sizeof(hdr) : dbsize;
+        if (map(db,NULL,0,mapsz,&db->db_base,&db->db_base_len) < 0) {
+            return -1;
+        }
 
-        if (((mdbm_shake_func_v3)db->db_shake_func)(db,key,val,&od)) {
-            for (i = 0; i < num; i++) {
-                if (od.page_item_sizes[i] && od.page_items[i].key.dsize == 0) {
-                    del_entry(db,page,MDBM_ENTRY(page,i));
-                    recycle_bytes += od.page_item_sizes[i];
-                }
-            }
+        if (flags & MDBM_HEADER_ONLY) {
+            db->db_flags |= MDBM_DBFLAG_HDRONLY;
+        }
+        if (db->db_flags & MDBM_DBFLAG_LOCK_PAGES) {
+            pin_pages(db);   /* Pin pages into memory, if necessary */
         }
 
-        free(od.page_items);
-        free(od.page_item_sizes);
+        db->db_hdr = (mdbm_hdr_t*)(db->db_base + MDBM_PAGE_T_SIZE);
+        if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
+            memcpy(db->db_hdr, &hdr,sizeof(hdr));
+            memcpy(db->db_base, &page, MDBM_PAGE_T_SIZE);
+        }
+
+        if (check_db_header(db,db->db_hdr,1) > 0) {
+            errno = EBADF;
+            return -1;
+        }
+        init(db,db->db_hdr);
     }
-    if (needed_bytes <= free_bytes + recycle_bytes) {
-        return 0;
+    protect_dir(db,1);
+    if (db->db_dup_info) {
+        update_dup_map_gen(db);
     }
 
-    errno = ENOMEM;
-    return -1;
+    return 0;
 }
 
+/*
+ * Sets the size of the db file.  With optimistic reads enabled, readers in
+ * other processes may still be copying out of pages past the new end of the
+ * db, and would fault if the file shrank under them; so the file keeps its
+ * size, and the dropped pages are punched out instead.
+ */
 static int
-cache_evict(MDBM* db, mdbm_page_t* page,
-            const datum* key, const datum* val,
-            int free_bytes, int needed_bytes, int want_large)
+set_file_size(MDBM* db, size_t size)
 {
-    int clean = (db->db_cache_mode & MDBM_CACHEMODE_EVICT_CLEAN_FIRST) != 0;
-    int quit = 0;
-    uint64_t t0 = 0;
-    uint64_t nerror = 0;
+    struct stat st;
 
-    if (db->db_flags & MDBM_DBFLAG_NO_DIRTY) {
-        clean = 0;
+    if (db->db_hdr && MDBM_HAS_OPTREAD(db)
+        && fstat(db->db_fd,&st) == 0 && (size_t)st.st_size > size)
+    {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        if (fallocate(db->db_fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                      size,st.st_size - size) < 0)
+        {
+            mdbm_logerror(LOG_DEBUG,0,"%s: fallocate(PUNCH_HOLE) failure",db->db_filename);
+        }
+#endif
+        return 0;
     }
+    return ftruncate(db->db_fd,size);
+}
 
-    if (MDBM_DO_STAT_TIME(db)) {
-        t0 = db->db_get_usec();
-    }
+/**
+ * Resizes a db.  Adjusts the header, page directory, and page table appropriately.
+ *
+ * \param[in,out] db mdbm handle
+ * \param[in] npages total number of pages for the db
+ * \return return code
+ * \retval 0 success
+ * \retval -1 failure, errno set
+ */
+static int
+resize_db(MDBM* db, int npages)
+{
+    size_t dbsize;
+    int prev_npages;
 
-    {   /* Reset markers for entries that failed db_clean_func. */
-        mdbm_entry_t* ep;
-        mdbm_entry_data_t e;
-        for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
-            ep->e_flags &= ~MDBM_EFLAG_SYNC_ERROR;
-        }
+#ifndef __x86_64__
+    if (npages > UINT_MAX/db->db_pagesize) {
+#ifdef DEBUG
+        mdbm_log(LOG_DEBUG, "Cannot remap over 4GB, npages=%d", npages);
+#endif
+        errno = ENOMEM;
+        return -1;
     }
-    while (free_bytes < needed_bytes) {
-        mdbm_entry_t* ep;
-        mdbm_entry_data_t e;
-        mdbm_entry_t* evict = NULL;
-        uint32_t evict_num_accesses = 0;
-        uint32_t evict_access_time = 0;
-        uint32_t evict_bytes = 0;
-        float evict_priority = 0;
+#endif
 
-        switch (MDBM_DB_CACHEMODE(db)) {
-        case MDBM_CACHEMODE_LFU:
-            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
-                if (clean && (ep->e_flags & MDBM_EFLAG_SYNC_ERROR)) {
-                    continue; /* skip entries that failed db_clean_func */
-                }
-                if (ep->e_key.match
-                    && (!clean || !MDBM_ENTRY_DIRTY(ep))
-                    && (!want_large || MDBM_ENTRY_LARGEOBJ(ep)))
-                {
-                    mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)MDBM_VAL_PTR(db,&e);
-                    if (!evict
-                        || (c->c_num_accesses < evict_num_accesses)
-                        || (c->c_num_accesses == evict_num_accesses
-                            && c->c_dat.access_time < evict_access_time))
-                    {
-                        evict = ep;
-                        evict_num_accesses = c->c_num_accesses;
-                        evict_access_time = c->c_dat.access_time;
-                        if (want_large) {
-                            uint32_t vallen;
-                            MDBM_ENTRY_LOB_ALLOC_LEN(db,&e,&vallen,&evict_bytes);
-                        } else {
-                            evict_bytes = MDBM_VAL_LEN(db,&e);
-                        }
-                    }
-                }
-            }
-            break;
+    if (npages > MDBM_NUMPAGES_MAX) {
+        mdbm_log(LOG_ERR, "MDBM cannot grow to %d pages, max=%d", npages, MDBM_NUMPAGES_MAX);
+        errno = ENOSPC;
+        return -1;
+    }
 
-        case MDBM_CACHEMODE_LRU:
-            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
-                if (clean && (ep->e_flags & MDBM_EFLAG_SYNC_ERROR)) {
-                    continue; /* skip entries that failed db_clean_func */
-                }
-                if (ep->e_key.match
-                    && (!clean || !MDBM_ENTRY_DIRTY(ep))
-                    && (!want_large || MDBM_ENTRY_LARGEOBJ(ep)))
-                {
-                    mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)MDBM_VAL_PTR(db,&e);
-                    if (!evict
-                        || (c->c_dat.access_time < evict_access_time)
-                        || (c->c_dat.access_time == evict_access_time
-                            && c->c_num_accesses < evict_num_accesses))
-                    {
-                        evict = ep;
-                        evict_num_accesses = c->c_num_accesses;
-                        evict_access_time = c->c_dat.access_time;
-                        if (want_large) {
-                            uint32_t vallen;
-                            MDBM_ENTRY_LOB_ALLOC_LEN(db,&e,&vallen,&evict_bytes);
-                        } else {
-                            evict_bytes = MDBM_VAL_LEN(db,&e);
-                        }
-                    }
-                }
-            }
-            break;
+    dbsize = (size_t)npages * db->db_pagesize;
+    prev_npages = db->db_num_pages;
+    db->db_num_pages = db->db_hdr->h_num_pages = npages;
+    journal_structural(db);
 
-        case MDBM_CACHEMODE_GDSF:
-            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
-                if (clean && (ep->e_flags & MDBM_EFLAG_SYNC_ERROR)) {
-                    continue; /* skip entries that failed db_clean_func */
-                }
-                if (ep->e_key.match
-                    && (!clean || !MDBM_ENTRY_DIRTY(ep))
-                    && (!want_large || MDBM_ENTRY_LARGEOBJ(ep)))
-                {
-                    mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)MDBM_VAL_PTR(db,&e);
-                    float priority = c->c_dat.priority;
-                    uint32_t vallen, lob_alloclen;
-                    if (want_large) {
-                        MDBM_ENTRY_LOB_ALLOC_LEN(db,&e,&vallen,&lob_alloclen);
-                        priority = c->c_num_accesses*(lob_alloclen - vallen) - priority;
-                    }
-                    if (!evict || priority < evict_priority) {
-                        evict = ep;
-                        evict_num_accesses = c->c_num_accesses;
-                        evict_priority = priority;
-                        if (want_large) {
-                            evict_bytes = lob_alloclen;
-                        } else {
-                            evict_bytes = MDBM_VAL_LEN(db,&e);
-                        }
-                    }
-                }
-            }
-            break;
+    if (!(db->db_flags & (MDBM_DBFLAG_MEMONLYCACHE|MDBM_DBFLAG_HUGEPAGES))) {
+        if (set_file_size(db,dbsize) < 0) {
+            db->db_num_pages = db->db_hdr->h_num_pages = prev_npages;
+            mdbm_logerror(LOG_ERR,0,"%s: ftruncate failure",db->db_filename);
+            return -1;
         }
+    }
 
-        if (!evict) {
-            /* clean_func didn't free enough, retry with normal cache preferences */
-            if (clean) {
-                clean = 0;
-                continue;
-            }
-            return free_bytes;
+    if (mdbm_internal_remap(db,dbsize,0) < 0) {
+        /* remap failed, db is currently unmapped.          */
+        /* restore the original number of pages for the db. */
+        dbsize = (size_t)prev_npages * db->db_pagesize;
+        db->db_num_pages = prev_npages;
+        /* This remap restores original size, so should mostly succeed, and failure means
+         * no MDBM data is mapped in. */
+        if (mdbm_internal_remap(db,dbsize,0) < 0) {
+            mdbm_log(LOG_ERR, "remap cannot restore size to %d pages, MDBM handle invalid",
+                     prev_npages);
+            errno = ENOSPC;
+            return -1;
         }
-
-        if (clean && db->db_clean_func && MDBM_ENTRY_DIRTY(evict)) {
-            datum k, v;
-            get_kv2(db,page,evict,&k,&v);
-            if (!db->db_clean_func(db,&k,&v,db->db_clean_data,&quit)) {
-                evict->e_flags |= MDBM_EFLAG_SYNC_ERROR;
-                nerror++;
-                if (quit) {
-                    return free_bytes;
-                }
-                continue;
-            }
-        }
-        if (MDBM_DB_CACHEMODE(db) == MDBM_CACHEMODE_GDSF) {
-            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
-                if (ep->e_key.match) {
-                    mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)MDBM_VAL_PTR(db,&e);
-                    c->c_dat.priority -= evict_priority;
-                }
-            }
-        }
-        free_bytes += evict_bytes;
-        del_entry(db,page,evict);
-    }
-
-    if (MDBM_DO_STAT_TIME(db)) {
-      mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->cache_evict : NULL;
-      MDBM_ADD_STAT(db,rstats_val,(db->db_get_usec() - t0), MDBM_STAT_TAG_CACHE_EVICT);
-      MDBM_ADD_STAT_ERROR_COUNTER(db, rstats_val, nerror, MDBM_STAT_TAG_CACHE_EVICT);
-    } else if (MDBM_DO_STATS(db)) {
-      MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_CACHE_EVICT);
-      MDBM_ADD_STAT_ERROR_COUNTER(db, NULL, nerror, MDBM_STAT_TAG_STORE);
-    }
-    return free_bytes;
-}
-
-static int
-expand_page(MDBM* db, mdbm_page_t* page, int pagenum)
-{
-    /* requires page lock; acquires internal lock */
-
-    mdbm_page_t* newpage;
-    int newpagenum;
-    int oldpagenum;
-    int tod;
-    mdbm_entry_t* ep;
-    int i;
-    int prev_numpages;
-
-    if (mdbm_internal_lock(db) < 0) {
-        return -1;
-    }
-
-    if ((newpage = alloc_chunk(db,MDBM_PTYPE_DATA,page->p_num_pages+1,0,0,MDBM_PAGE_MAP,
-                               MDBM_ALLOC_CAN_UNLOCK)) == NULL)
-    {
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "expand_page failed in alloc_chunk, pagenum=%d", pagenum);
-#endif
-        /* alloc_chunk releases internal lock if allocation fails */
+        db->db_hdr->h_num_pages = prev_npages;
+        init(db,db->db_hdr);
 #ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "expand_page failed in alloc_chunk, pagenum=%d", pagenum);
+        mdbm_log(LOG_DEBUG, "remap cannot resize, npages=%d", npages);
 #endif
         errno = ENOMEM;
         return -1;
     }
 
-    newpagenum = newpage->p_num;
-    prev_numpages = newpage->p_prev_num_pages;
-
-    page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
-    tod = MDBM_DATA_PAGE_BOTTOM_OF_DATA(page);
-
-    memcpy(newpage,page,MDBM_PAGE_T_SIZE + (page->p.p_num_entries+1)*MDBM_ENTRY_T_SIZE);
-    memcpy((char*)newpage + tod + db->db_pagesize,
-           (char*)page + tod,
-           page->p_num_pages*db->db_pagesize - tod);
-    ep = MDBM_ENTRY(newpage,0);
-    for (i = 0; i <= newpage->p.p_num_entries; i++, ep++) {
-        ep->e_offset += db->db_pagesize;
-    }
-
-    newpage->p_num = pagenum;
-    newpage->p_num_pages++;
-    newpage->p_prev_num_pages = prev_numpages;
-
-    oldpagenum = MDBM_GET_PAGE_INDEX(db,pagenum);
-    MDBM_SET_PAGE_INDEX(db, pagenum, newpagenum);
-    free_chunk(db,oldpagenum,NULL);
-
-    mdbm_internal_unlock(db);
     return 0;
 }
 
-int
-mdbm_internal_replace(MDBM* db)
+static int resize(MDBM* db, int new_dirshift, int new_numpages);
+static void init_data_page(MDBM* db, mdbm_page_t* page);
+
+static void*
+alloc_chunk(MDBM* db, int type, int npages, int n0, int n1, int map, int lock)
 {
-    if (MDBM_IS_REPLACED(db)) {
-        struct stat st1;
-        struct stat st2;
-        int newfd, oldfd;
-        int wsize;
+    int n;
+    mdbm_page_t* page;
+    int lock_upgraded = 0;
 
-        if (fstat(db->db_fd,&st1) < 0) {
-            mdbm_logerror(LOG_ERR,0,"mdbm replace: fstat(fd=%d)",db->db_fd);
-            return 0;
-        }
-        if (stat(db->db_filename,&st2) < 0) {
-            mdbm_logerror(LOG_ERR,0,"mdbm replace: stat(%s)",db->db_filename);
-            return 0;
-        }
-        if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
-            db->db_hdr->h_dbflags &= ~MDBM_HFLAG_REPLACED;
-            mdbm_log(LOG_NOTICE,
-                     "mdbm replace: Reset stale replace flag: %s",
-                     db->db_filename);
-            return 1;
-        }
+    CHECK_LOCK_INTERNAL_ISOWNED;
 
-        newfd = open(db->db_filename,MDBM_IS_RDONLY(db) ? MDBM_O_RDONLY : MDBM_O_RDWR,0);
-        if (newfd < 0) {
-            mdbm_logerror(LOG_ERR,0,"mdbm replace: %s",db->db_filename);
-            return -1;
+/*     printf("**alloc_chunk npages=%d\n",npages); */
+
+    /* find a free chunk */
+    for (;;) {
+        int last_chunk, last_chunk_pages;
+        int tot_free_pages;
+
+        if ((n = find_free_chunk(db,npages,n0,n1,&tot_free_pages)) != 0) {
+            break;
         }
 
-        oldfd = db->db_fd;
-        db->db_fd = newfd;
+        /* nothing big enough; how about unused space? */
+        last_chunk = db->db_hdr->h_last_chunk;
+        page = MDBM_PAGE_PTR(db,last_chunk);
+        last_chunk_pages = page->p_num_pages;
 
-        if (mdbm_internal_remap(db,0,0) < 0) {
-            mdbm_logerror(LOG_ERR,0,"mdbm replace unable to map %s",db->db_filename);
-            return -1;
+        if (last_chunk+last_chunk_pages+npages <= db->db_hdr->h_num_pages) {
+            n = last_chunk + last_chunk_pages;
+            page = MDBM_PAGE_PTR(db,n);
+            page->p_prev_num_pages = last_chunk_pages;
+            db->db_hdr->h_last_chunk = n;
+            journal_structural(db);
+            break;
         }
 
-        wsize = db->db_window.num_pages * db->db_pagesize;
-        mdbm_set_window_size_internal(db,wsize);
+        if (n0) {
+            page = NULL;
+            goto alloc_ret;
+        }
 
-        close(oldfd);
+        if (resize(db,0,last_chunk + last_chunk_pages + npages) < 0) {
+            if (tot_free_pages >= npages) {
+                /* Need db lock in order to defrag */
+                if (!mdbm_isowned(db)) {
+                    if (lock != MDBM_ALLOC_CAN_UNLOCK) {
+                        page = NULL;
+                        goto alloc_ret;
+                    }
+                    mdbm_internal_unlock(db);
+                    if (mdbm_lock(db) != 1) {
+                        return NULL;
+                    }
+                    if (mdbm_internal_lock(db) < 0) {
+                        mdbm_unlock(db);
+                        return NULL;
+                    }
+                    lock_upgraded = 1;
+                }
+                if ((n = find_defrag_free_chunk(db,npages)) >= 0) {
+                    break;
+                }
+            }
+            page = NULL;
+            goto alloc_ret;
+        }
     }
-    return 0;
-}
 
+    page = MDBM_CHUNK_PTR(db,n,npages);
+    page->p_num = n;
+    page->p_type = type;
+    page->p_flags = 0;
+    page->p_num_pages = npages;
+    page->p_r0 = 0;
+    page->p_r1 = 0;
+    page->p.p_data = 0;
+    dirty_mark(db,n,1);
 
-struct mdbm_walk {
-    MDBM* db;
-    int dirbit;
-    int level;
-    int min_level;
-    int max_level;
-    int num_nodes;
-};
-
+/*     printf("alloc_chunk npages=%d => page %d\n",npages,n); */
+    CHECK_DB_PARTIAL(db,1);
 
-void
-walk_dir(struct mdbm_walk* w)
-{
-    w->dirbit <<= 1;
-    w->level++;
-    if (w->level >= w->db->db_dir_shift
-        || (!MDBM_DIR_BIT(w->db,w->dirbit+1) && !MDBM_DIR_BIT(w->db,w->dirbit+2)))
-    {
-        if (w->min_level == -1) {
-            w->min_level = w->level;
-        }
-        if (w->level > w->max_level) {
-            w->max_level = w->level;
-        }
-    } else {
-        w->dirbit++;
-        walk_dir(w);
-        w->dirbit++;
-        walk_dir(w);
-        w->dirbit -= 2;
+ alloc_ret:
+    if (!page && lock == MDBM_ALLOC_CAN_UNLOCK) {
+        mdbm_internal_unlock(db);
     }
-    w->dirbit >>= 1;
-    w->level--;
-    w->num_nodes++;
+    if (lock_upgraded) {
+        mdbm_unlock(db);
+    }
+
+    return page;
 }
 
 static int
-truncate_db(MDBM* db, int npages, int pagesize, int flags)
+free_chunk(MDBM* db, int pagenum, int* prevp)
 {
-    int dir_shift, n;
-    int dir_pages, tot_pages;
-    size_t dbsize;
+    int npages;
     mdbm_page_t* page;
-    mdbm_hdr_t* hdr;
-    size_t mapsz;
-    int ret;
+    int prevprev, prev, next, p1;
+    mdbm_free_index_t* fi;
+    int merged_prev = 0, merged_prev_pages = 0;
+    int merged_next = 0, merged_next_pages = 0;
+    int p1_free = 1;
 
-    /* Compute dir bit shift. */
-    for (dir_shift = 0, n = 1; (n<<1) <= npages; dir_shift++, n <<= 1);
-    dir_pages = MDBM_NUM_DIR_PAGES(pagesize,dir_shift);
+    CHECK_LOCK_INTERNAL_ISOWNED;
 
-    tot_pages = npages;
-    if (n == npages) {
-        tot_pages += dir_pages;
-    }
+    page = MDBM_PAGE_PTR(db,pagenum);
+    npages = page->p_num_pages;
 
-    dbsize = (size_t)tot_pages * pagesize;
-    mapsz = (size_t)dir_pages * pagesize;
+#ifdef DEBUG
+     printf("**free_chunk p=%d npages=%d (prev npages=%d)\n",
+        pagenum,npages,page->p_prev_num_pages);
+#endif
 
-    /* memory-only: don't want to ftruncate to make the file big */
-    if (!(db->db_flags & (MDBM_DBFLAG_HUGEPAGES|MDBM_DBFLAG_MEMONLYCACHE))) {
-        if (ftruncate(db->db_fd,dbsize) < 0) {
-            mdbm_logerror(LOG_ERR,0,"%s: ftruncate failure",db->db_filename);
-            ERROR();
-            return -1;
-        }
+    if (pagenum == 0) {
+        mdbm_log(LOG_CRIT, "%s: invalid attempt to free chunk 0",db->db_filename);
+        abort();
     }
 
-    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
-        mapsz = dbsize;
-    }
+    page->p_type = MDBM_PTYPE_FREE;
+    page->p_num = pagenum;
 
+    /* Find 2 previous free chunks and next free chunk */
+    prevprev = 0;
+    prev = 0;
+    next = db->db_hdr->h_first_free;
+    if ((fi = free_index_get(db)) != NULL) {
+        prev = free_index_prev(fi,pagenum);
+        prevprev = prev ? free_index_prev(fi,prev) : 0;
+        next = prev ? MDBM_PAGE_PTR(db,prev)->p.p_next_free : db->db_hdr->h_first_free;
+        if (next && next < pagenum) {
+            /* index doesn't match the free list; walk it */
+            free_index_invalidate(db,fi);
+            fi = NULL;
+            prevprev = 0;
+            prev = 0;
+            next = db->db_hdr->h_first_free;
+        }
+    } else if (prevp && *prevp) {
+        prevprev = *prevp;
+        prev = MDBM_PAGE_PTR(db,prevprev)->p.p_next_free;
+        next = MDBM_PAGE_PTR(db,prev)->p.p_next_free;
+    }
+    while (next && next < pagenum) {
+        prevprev = prev;
+        prev = next;
+        next = MDBM_PAGE_PTR(db,next)->p.p_next_free;
+    }
 
-    if (map(db,NULL,0,mapsz,&db->db_base,&db->db_base_len) < 0) {
-        ERROR();
-        return -1;
+    if (next == pagenum) {
+        mdbm_log(LOG_CRIT, "%s: attempt to free chunk (%d) on free-list (npages=%d prev=%d)",
+                 db->db_filename,pagenum,npages,prev);
+        abort();
     }
 
-    memset(db->db_base,0,dir_pages * pagesize);
+    /* p1 is page number of (possibly-merged) free chunk */
+    p1 = pagenum;
 
-    page = (mdbm_page_t*)db->db_base;
-    page->p_num = 0;
-    page->p_type = MDBM_PTYPE_DIR;
-    page->p_flags = 0;
-    page->p_num_pages = dir_pages;
-    page->p_r0 = 0;
-    page->p_prev_num_pages = 0;
-    page->p_r1 = 0;
-    page->p.p_data = _MDBM_MAGIC_NEW2;
+    if (prev) {
+        mdbm_page_t* pprev = MDBM_PAGE_PTR(db,prev);
+        if (prev + pprev->p_num_pages == pagenum) {
+            /* previous free chunk adjoins: merge chunks */
+            assert(pprev->p_type == MDBM_PTYPE_FREE);
+            assert(pagenum - page->p_prev_num_pages == prev);
+            merged_prev = prev;
+            merged_prev_pages = pprev->p_num_pages;
+            pprev->p_num_pages += npages;
+            npages = 0; /* signal that we've merged */
+            if (pagenum < db->db_hdr->h_last_chunk) {
+                /* merged chunk is not the last chunk, so update back-pointer */
+                MDBM_PAGE_PTR(db,prev + pprev->p_num_pages)->p_prev_num_pages = pprev->p_num_pages;
+            } else {
+                /* chunk being freed was last chunk */
+                assert(pagenum == db->db_hdr->h_last_chunk);
+                db->db_hdr->h_last_chunk = prev;
+            }
+            p1 = prev; /* update page number to new merged chunk */
+            prev = prevprev;
+        }
+    }
+    if (next) {
+        mdbm_page_t* pp1 = MDBM_PAGE_PTR(db,p1);
+        assert(pp1->p_type == MDBM_PTYPE_FREE);
+        if (p1 + pp1->p_num_pages == next) {
+            /* following free chunk adjoins: merge chunks */
+            mdbm_page_t* pnext = MDBM_PAGE_PTR(db,next);
+            assert(next - pnext->p_prev_num_pages == p1);
+            merged_next = next;
+            merged_next_pages = pnext->p_num_pages;
+            pp1->p_num_pages += pnext->p_num_pages;
+            pp1->p.p_next_free = pnext->p.p_next_free;
+            npages = 0;
+            if (db->db_hdr->h_first_free == next) {
+                /* following free chunk was head of free list; merged chunk is new head */
+                assert(prev == 0);
+                db->db_hdr->h_first_free = p1;
+            } else if (prev != 0) {
+                /* update next pointer in previous free list chunk */
+                MDBM_PAGE_PTR(db,prev)->p.p_next_free = p1;
+            }
 
-    hdr = (mdbm_hdr_t*)(db->db_base + MDBM_PAGE_T_SIZE);
-    hdr->h_magic = _MDBM_MAGIC_NEW2;
-    hdr->h_dbflags = 0;
-    hdr->h_pagesize = pagesize;
-    hdr->h_num_pages = tot_pages;
-    hdr->h_max_pages = 0;
-    hdr->h_dir_shift = dir_shift;
-    hdr->h_last_chunk = 0;
-    hdr->h_hash_func = MDBM_DEFAULT_HASH;
-    hdr->h_first_free = 0;
+            /* last chunk should never be free, so following free chunk shouldn't be last */
+            assert(db->db_hdr->h_last_chunk != next);
 
-    if (mdbm_internal_remap(db,dbsize,flags) < 0) {
-        ERROR();
-        return -1;
+            /* update back-pointer on following chunk */
+            MDBM_PAGE_PTR(db,p1 + pp1->p_num_pages)->p_prev_num_pages = pp1->p_num_pages;
+        }
+    }
+    if (npages) {
+        /* wasn't merged, so add to free list */
+        if (prev) {
+            mdbm_page_t* pprev = MDBM_PAGE_PTR(db,prev);
+            page->p.p_next_free = pprev->p.p_next_free;
+            pprev->p.p_next_free = pagenum;
+        } else {
+            page->p.p_next_free = db->db_hdr->h_first_free;
+            db->db_hdr->h_first_free = pagenum;
+        }
+    }
+    if (p1 == db->db_hdr->h_last_chunk) {
+        /* we're the last chunk, but last chunk can't be free; adjust */
+        if (db->db_hdr->h_first_free == p1) {
+            assert(prev == 0);
+            db->db_hdr->h_first_free = 0;
+        } else {
+            assert(prev != 0);
+            MDBM_PAGE_PTR(db,prev)->p.p_next_free = 0;
+        }
+        /* update last chunk to previous chunk */
+        db->db_hdr->h_last_chunk = p1 - MDBM_PAGE_PTR(db,p1)->p_prev_num_pages;
+        p1_free = 0;
+    }
+    dirty_mark(db,pagenum,1);
+    if (p1 != pagenum) {
+        dirty_mark(db,p1,1);
+    }
+    if (prev) {
+        dirty_mark(db,prev,1);
+    }
+    if (p1_free) {
+        dirty_mark(db,p1 + MDBM_PAGE_PTR(db,p1)->p_num_pages,1);
     }
 
-
-    ret = mdbm_pre_split(db,npages);
-    hdr = (mdbm_hdr_t*)(db->db_base + MDBM_PAGE_T_SIZE); /* db was remaped */
-    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
-        /* set max_pages since we would lose all our data if it remapped memory */
-        hdr->h_max_pages = db->db_num_pages;
+    if (fi) {
+        if (merged_prev) {
+            free_index_del(fi,merged_prev,merged_prev_pages);
+        }
+        if (merged_next) {
+            free_index_del(fi,merged_next,merged_next_pages);
+        }
+        if (p1_free && free_index_add(db,fi,p1,MDBM_PAGE_PTR(db,p1)->p_num_pages) < 0) {
+            free_index_invalidate(db,fi);
+        }
     }
-    return ret;
-}
+    free_list_changed(db,fi);
 
-static void
-get_key(datum* key, char* buf, int buflen)
-{
-    int nonprint = 0;
-    int bp = 0;
-    int i;
+    CHECK_DB(db);
 
-    for (i = 0; i < key->dsize; ++i) {
-        if (isprint(key->dptr[i])) {
-            if (bp >= buflen-1) {
-                break;
-            }
-            buf[bp++] = key->dptr[i];
+    if (prevp) {
+        if (prevprev) {
+            *prevp = prevprev;
         } else {
-            if (bp >= buflen-4) {
-                break;
-            }
-            bp += snprintf(buf+bp, buflen-bp, "\\x%02x",key->dptr[i]);
-            ++nonprint;
+            *prevp = 0;
         }
     }
-    if (nonprint > key->dsize/4) {
-        bp = 0;
-        for (i = 0; i < key->dsize; ++i) {
-            if (bp >= buflen-2) {
-                break;
-            }
-            bp += snprintf(buf+bp, buflen-bp, "%02x",key->dptr[i]);
+
+    return p1;
+}
+
+static void
+free_large_object_chunks(MDBM* db)
+{
+    int pno = 0;
+    int prev = 0;
+    while (pno <= db->db_hdr->h_last_chunk) {
+        mdbm_page_t* page = MDBM_PAGE_PTR(db,pno);
+        if (page->p_type == MDBM_PTYPE_LOB) {
+            free_chunk(db,pno,&prev);
         }
+        pno += page->p_num_pages;
     }
-    buf[bp] = 0;
 }
 
-/**
- * \brief Accesses a key in this MDBM.
- * \param[in,out] db database handle
- * \param[in] key key to access
- * \param[out] value value pointing to accessed value (if any)
- * \param[out] buf buffer containing copy of accessed value (if any)
- * \param[out] info information about the fetch
- * \param[out] iter initialized iterator for next entry
- * \return status code for success of lock
- * \retval -1 error
- * \retval  0 success
+/* Expand an existing chunk to at least 'npages' size.
+ * 'pagenum' is the physical page number in units of db-page-size.
+ * 'npages' is the desired number of (contiguous) pages in units of db-page-size.
  */
 static int
-access_entry(MDBM* db, datum* key, datum* val, datum* buf, struct mdbm_fetch_info* info,
-             MDBM_ITER* iter)
+grow_chunk(MDBM* db, int pagenum, int npages)
 {
-    mdbm_hashval_t hashval;
-    mdbm_pagenum_t pagenum;
-    mdbm_page_t* page;
-    mdbm_entry_t* ep;
-    int do_del = !val;
-    int locked = 0;
-#ifdef MDBM_BSOPS
-    int bserr = 0;
-#endif
-    uint64_t t0 = 0;
-
-    if (MDBM_DO_STAT_TIME(db)) {
-        t0 = db->db_get_usec();
-    }
+    mdbm_page_t* page = MDBM_PAGE_PTR(db,pagenum);
 
-    /*fprintf(stderr, "access_entry key %p\n", key); */
-    if (!key || !key->dsize) {
-        errno = EINVAL;
+    if (pagenum + npages > db->db_num_pages) {
+#ifdef DEBUG
+        mdbm_log(LOG_DEBUG, "grow_chunk failed, pagenum=%d, npages=%d, db_num_pages=%u",
+                 pagenum, npages, db->db_num_pages);
+#endif
+        errno = ENOMEM;
         return -1;
     }
-
-    if (check_guard_padding(db, 1) != 0) {
-        return -1;
+    if (page->p_num_pages >= npages) {
+        mdbm_log(LOG_WARNING,
+            "grow_chunk() redundant, pagenum=%d, npages=%d (already %d), db_num_pages=%u",
+            pagenum, npages, page->p_num_pages, db->db_num_pages);
+        return 0;
     }
-
-    /* All accesses must lock when deleting a key, copying out a key value, or
-     * if an mdbm replacement occurred.
-     */
-    if (do_del || (buf != NULL) || MDBM_REPLACED_OR_CHANGED(db)) {
-        if (mdbm_internal_do_lock(db,
-                    do_del ? MDBM_LOCK_WRITE : MDBM_LOCK_READ,
-                    MDBM_LOCK_WAIT,
-                    key,
-                    &hashval,
-                    &pagenum) < 0) {
-            /*print_lock_state(db); */
-            goto access_error;
-        } else {
-            locked = 1;
-        }
+    if (pagenum == db->db_hdr->h_last_chunk) {
+        page->p_num_pages = npages;
     } else {
-        hashval = hash_value(db,key);
-        pagenum = hashval_to_pagenum(db,hashval);
+        if (clear_pages(db,pagenum+page->p_num_pages,npages-page->p_num_pages) < 0) {
+            return -1;
+        }
+        page->p_num_pages = npages;
+        MDBM_PAGE_PTR(db,pagenum + npages)->p_prev_num_pages = page->p_num_pages;
+        dirty_mark(db,pagenum + npages,1);
     }
+    if (pagenum == 0 && db->db_dirty) {
+        db->db_dirty->d_hdr_pages = npages;
+    }
+    dirty_mark(db,pagenum,1);
+    journal_structural(db);
 
-#ifdef MDBM_BSOPS
-    if (do_del && db->db_bsops) {
-        if (db->db_bsops->bs_delete(db->db_bsops_data,key,0) < 0) {
-            bserr = (errno == ENOENT) ? ENOENT : EIO;
-        }
+    CHECK_DB(db);
+
+    return 0;
+}
+
+static void
+shrink_page(MDBM* db, mdbm_page_t* page)
+{
+    int pagenum = page->p_num;
+    int p = MDBM_GET_PAGE_INDEX(db,pagenum);
+    MDBM_SET_PAGE_INDEX(db,pagenum, 0);
+    free_chunk(db,p,NULL);
+
+    pagenum_to_page(db,pagenum,MDBM_PAGE_ALLOC,MDBM_PAGE_NOMAP);
+    CHECK_DB(db);
+}
+
+static inline int
+MDBM_MAX_PGMAP_ENTRIES(const MDBM* db)
+{
+    return ((db->db_pagesize-MDBM_PAGE_T_SIZE)/MDBM_ENTRY_T_SIZE) - 1;
+}
+
+static mdbm_page_t*
+pagenum_to_page(MDBM* db, int pagenum, int alloc, int map)
+{
+    mdbm_page_t* page = NULL;
+    int p;
+#ifdef MDBM_SANITY_CHECKS
+    if (pagenum < 0 || pagenum > db->db_max_dirbit) {
+        mdbm_log(LOG_CRIT, "%s: invalid pagenum (%d/%d) in pagenum_to_page",
+                 db->db_filename,pagenum,db->db_max_dirbit);
+        abort();
     }
 #endif
-
-    page = pagenum_to_page(db,pagenum,MDBM_PAGE_NOALLOC,MDBM_PAGE_NOMAP);
-    /* fprintf(stderr, "access_entry() key %s pagenum:%d page:%p\n", key->dptr, pagenum, (void*)page); */
-    if (!page || (ep = find_entry(db,page,key,hashval,key,val,info)) == NULL) {
-        errno = ENOENT;
-#ifdef MDBM_BSOPS
-        if (db->db_bsops) {
-            if (do_del) {
-                if (!bserr) {
-                    if (locked) {
-                        mdbm_internal_do_unlock(db,key);
-                    }
-                    if (MDBM_DO_STAT_TIME(db)) {
-                        mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->remove : NULL;
-                        MDBM_ADD_STAT_WAIT(db,rstats_val,(db->db_get_usec() - t0), MDBM_STAT_TAG_DELETE);
-                    } else if (MDBM_DO_STATS(db)) {
-                        MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_DELETE);
-                    }
-                    if (MDBM_DO_STAT_PAGE(db)) {
-                          MDBM_PAGE_STAT(db, pagenum, MDBM_STAT_TAG_PAGE_DELETE);
-                    }
-                    return 0;
-                }
-                errno = bserr;
-            } else if (db->db_bsops->bs_fetch(db->db_bsops_data,key,val,buf,0) < 0) {
-                if (errno != ENOENT) {
-                    mdbm_logerror(LOG_ERR,0,"mdbm backing store fetch error");
-                }
-            } else {
-                datum k = *key;
-                datum v = *val;
-                if (mdbm_store_r(db,&k,&v,MDBM_REPLACE|MDBM_CLEAN|MDBM_CACHE_ONLY,NULL) < 0) {
-                    char kbuf[128];
-                    get_key(key,kbuf,sizeof(kbuf));
-                    mdbm_logerror((errno != ENOMEM && errno != EINVAL)
-                                  ? LOG_ERR : LOG_DEBUG,
-                                  0,"mdbm backing store cache refill error (key=%s)",kbuf);
-                }
-                if (locked) {
-                    mdbm_internal_do_unlock(db,key);
-                }
-                if (MDBM_DO_STAT_TIME(db)) {
-                    uint64_t dt = db->db_get_usec() - t0;
-                    mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->fetch : NULL;
-                    MDBM_ADD_STAT_WAIT(db,rstats_val,dt,MDBM_STAT_TAG_FETCH);
-                    rstats_val = (db->db_rstats) ? &db->db_rstats->fetch_uncached : NULL;
-                    MDBM_ADD_STAT_WAIT(db,rstats_val,dt,MDBM_STAT_TAG_FETCH_UNCACHED);
-                } else if (MDBM_DO_STATS(db)) {
-                    MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_FETCH);
-                    MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_FETCH_UNCACHED);
-                }
-                return 0;
+    if ((p = MDBM_GET_PAGE_INDEX(db,pagenum)) != 0) {
+        page = MDBM_PAGE_PTR(db,p);
+        if (MDBM_IS_WINDOWED(db)
+            && (map || (page->p.p_num_entries+1 >= MDBM_MAX_PGMAP_ENTRIES(db))))
+        {
+            /* force a remap if it's larger than a single page */
+            page = get_window_page(db,page,0,0,0,0);
+            if (!page) {
+              return NULL;
             }
         }
+#ifdef MDBM_SANITY_CHECKS
+        if (p > db->db_num_pages || !page || page->p_type != MDBM_PTYPE_DATA) {
+            mdbm_log(LOG_CRIT, "%s: invalid page (%d/%d type:%d vs %d) in pagenum_to_page",
+                     db->db_filename,p,db->db_num_pages, page?page->p_type:-1, MDBM_PTYPE_DATA);
+            abort();
+        }
 #endif
-        goto access_error;
+        return page;
     }
 
-    if (!do_del) {
-        if (buf) {
-            if (val->dsize > buf->dsize) {
-                buf->dptr = (char*)realloc(buf->dptr,val->dsize);
-                buf->dsize = val->dsize;
-            }
-            memcpy(buf->dptr,val->dptr,val->dsize);
-            val->dptr = buf->dptr;
-        }
-        if (MDBM_DO_STAT_TIME(db)) {
-            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->fetch : NULL;
-            MDBM_ADD_STAT_WAIT(db,rstats_val,(db->db_get_usec() - t0), MDBM_STAT_TAG_FETCH);
-        } else if (MDBM_DO_STATS(db)) {
-            MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_FETCH);
-        }
-    } else {
-        if (!bserr || bserr == ENOENT) {
-            del_entry(db,page,ep);
-            if (MDBM_DO_STAT_TIME(db)) {
-                mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->remove : NULL;
-                MDBM_ADD_STAT_WAIT(db,rstats_val,(db->db_get_usec() - t0), MDBM_STAT_TAG_DELETE);
-            } else if (MDBM_DO_STATS(db)) {
-                MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_DELETE);
-            }
-            if (MDBM_DO_STAT_PAGE(db)) {
-                  MDBM_PAGE_STAT(db, pagenum, MDBM_STAT_TAG_PAGE_DELETE);
-            }
-        }
+#ifdef MDBM_SANITY_CHECKS
+    if (alloc == MDBM_PAGE_EXISTS) {
+        mdbm_log(LOG_CRIT, "%s: alloc==MDBM_PAGE_EXISTS in pagenum_to_page",
+                 db->db_filename);
+        abort();
     }
-
-    if (iter) {
-        iter->m_pageno = pagenum;
-        iter->m_next = -3 - 2*MDBM_ENTRY_INDEX(page,ep);
+#endif
+    if (alloc == MDBM_PAGE_NOALLOC) {
+        return NULL;
     }
 
-    if (locked) {
-        mdbm_internal_do_unlock(db,key);
+    if (mdbm_internal_lock(db) < 0) {
+        return NULL;
     }
 
-    return 0;
-
-  access_error:
-    if (MDBM_DO_STATS(db)) {
-        if (do_del) {
-            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->remove : NULL;
-            MDBM_INC_STAT_ERROR_COUNTER(db, rstats_val, MDBM_STAT_TAG_DELETE_FAILED);
-        } else {
-            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->fetch : NULL;
-            if (errno == ENOENT) {
-                MDBM_INC_STAT_ERROR_COUNTER(db, rstats_val, MDBM_STAT_TAG_FETCH_NOT_FOUND);
-            } else {
-                MDBM_INC_STAT_ERROR_COUNTER(db, rstats_val, MDBM_STAT_TAG_FETCH_ERROR);
-            }
-        }
-    }
-    if (locked) {
-        mdbm_internal_do_unlock(db,key);
-    }
-    if (iter) {
-        iter->m_pageno = MDBM_DB_DIR_WIDTH(db);
-        iter->m_next = -1;
-    }
-    key->dptr = NULL;
-    key->dsize = 0;
-    if (val) {
-        *val = *key;
+    if ((page = alloc_chunk(db,MDBM_PTYPE_DATA,1,0,0,MDBM_PAGE_NOMAP,MDBM_ALLOC_CAN_UNLOCK))
+        == NULL)
+    {
+        /* alloc_chunk releases internal lock if allocation fails */
+        return NULL;
     }
-    return -1;
-}
 
+    init_data_page(db,page);
+    MDBM_SET_PAGE_INDEX(db, pagenum, page->p_num);
+    page->p_num = pagenum;
+    dirty_mark_page(db,page);
+    mdbm_internal_unlock(db);
 
-/* EXTERNAL INTERFACES */
+    if (map && MDBM_IS_WINDOWED(db)) {
+        page = get_window_page(db,page,0,0,0,0);
+    }
 
-int 
-mdbm_delete_lockfiles(const char* dbname)
-{
-  return do_delete_lockfiles(dbname);
+    return page;
 }
 
-
-int
-mdbm_plock(MDBM *db, const datum *key, int flags)
+static mdbm_entry_t*
+first_entry(mdbm_page_t* page, mdbm_entry_data_t* e)
 {
-    mdbm_hashval_t hashval;
-    mdbm_pagenum_t pagenum;
-
-    if (key) {
-        return mdbm_internal_do_lock(db,MDBM_LOCK_READ,MDBM_LOCK_WAIT,key,&hashval,&pagenum);
+    e->e_page = page;
+    e->e_index = 0;
+    if (page->p.p_num_entries > 0) {
+        e->e_entry = MDBM_ENTRY(e->e_page,e->e_index);
+    } else {
+        e->e_entry = NULL;
     }
-    return mdbm_lock(db);
+    return e->e_entry;
 }
 
-int
-mdbm_tryplock(MDBM *db, const datum *key, int flags)
+static inline mdbm_entry_t*
+set_entry(MDBM* db, mdbm_pagenum_t pagenum, int index, mdbm_entry_data_t* e)
 {
-    mdbm_hashval_t hashval;
-    mdbm_pagenum_t pagenum;
-
-    if (key) {
-        return mdbm_internal_do_lock(db,MDBM_LOCK_READ,MDBM_LOCK_NOWAIT,key,&hashval,&pagenum);
+    if ((e->e_page = pagenum_to_page(db,pagenum,MDBM_PAGE_NOALLOC,MDBM_PAGE_MAP)) == NULL
+        || index >= e->e_page->p.p_num_entries)
+    {
+        e->e_entry = NULL;
+        e->e_index = -1;
+    } else {
+        e->e_index = index;
+        e->e_entry = MDBM_ENTRY(e->e_page,index);
     }
-    return mdbm_trylock(db);
-}
-
-int
-mdbm_punlock(MDBM *db, const datum *key, int flags)
-{
-    return mdbm_internal_do_unlock(db,key);
+    return e->e_entry;
 }
 
-int
-mdbm_trylock(MDBM *db)
+static inline mdbm_entry_t*
+next_entry(mdbm_entry_data_t* e)
 {
-    return mdbm_internal_do_lock(db,MDBM_LOCK_EXCLUSIVE,MDBM_LOCK_NOWAIT,NULL,NULL,NULL);
+    if (++e->e_index < e->e_page->p.p_num_entries) {
+        e->e_entry++;
+    } else {
+        e->e_entry = NULL;
+    }
+    return e->e_entry;
 }
 
-int
-mdbm_trylock_shared(MDBM *db)
+static void
+get_kv0 (MDBM* db, mdbm_page_t* p, mdbm_entry_t* ep, datum* key, datum* val,
+         struct mdbm_fetch_info* info, int upd_cache, uint32_t lob_alloclen)
 {
-    return mdbm_internal_do_lock(db,MDBM_LOCK_SHARED,MDBM_LOCK_NOWAIT,NULL,NULL,NULL);
+    key->dptr = MDBM_KEY_PTR1(p,ep);
+    key->dsize = MDBM_KEY_LEN1(ep);
+    if (val != NULL) {
+        char* v = MDBM_VAL_PTR1(db,p,ep);
+        int vlen = MDBM_VAL_LEN1(db,ep);
+        if (MDBM_DB_CACHEMODE(db)) {
+            mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)v;
+            v += MDBM_CACHE_ENTRY_T_SIZE;
+            vlen -= MDBM_CACHE_ENTRY_T_SIZE;
+            if (upd_cache && !MDBM_IS_RDONLY(db)) {
+                switch (MDBM_DB_CACHEMODE(db)) {
+                case MDBM_CACHEMODE_LFU:
+                case MDBM_CACHEMODE_LRU:
+                    c->c_num_accesses++;
+                    c->c_dat.access_time = get_time_sec();
+                    break;
+
+                case MDBM_CACHEMODE_GDSF:
+                    c->c_num_accesses++;
+                    c->c_dat.priority = (float)c->c_num_accesses / (key->dsize + vlen);
+                    break;
+                }
+            }
+            if (info != NULL) {
+                info->flags = ((!(db->db_flags & MDBM_DBFLAG_NO_DIRTY) && MDBM_ENTRY_DIRTY(ep))
+                               ? MDBM_FETCH_FLAG_DIRTY
+                               : 0);
+                info->cache_num_accesses = c->c_num_accesses;
+                switch (MDBM_DB_CACHEMODE(db)) {
+                case MDBM_CACHEMODE_LFU:
+                case MDBM_CACHEMODE_LRU:
+                    info->cache_access_time = c->c_dat.access_time;
+                    break;
+
+                case MDBM_CACHEMODE_GDSF:
+                    info->cache_access_time = 0;
+                    break;
+                }
+            }
+        }
+        if (MDBM_ENTRY_LARGEOBJ(ep)) {
+            uint32_t lob_pages, vallen;
+            mdbm_page_t* lob;
+            mdbm_entry_lob_t l = *((mdbm_entry_lob_t*)v);
+
+            if (!lob_alloclen) {
+                MDBM_ENTRY_LOB_ALLOC_LEN1(db,p,ep,&vallen,&lob_alloclen);
+            }
+            lob_pages = lob_alloclen / db->db_pagesize;
+            lob = MDBM_CHUNK_PTR(db,l.l_pagenum,lob_pages);
+            val->dptr = MDBM_LOB_VAL_PTR(lob);
+            val->dsize = MDBM_LOB_VAL_LEN(lob);
+        } else {
+            val->dptr = v;
+            val->dsize = vlen;
+        }
+    }
 }
 
-uint32_t mdbm_get_lockmode(MDBM *db) {
-  return db_get_lockmode(db);
+static inline void
+get_kv(MDBM* db, mdbm_entry_data_t* e, datum* key, datum* val)
+{
+    get_kv0(db,e->e_page,e->e_entry,key,val,NULL,0,0);
 }
 
-int
-mdbm_lock(MDBM *db)
+static inline void
+get_kv1 (MDBM* db, mdbm_page_t* p, mdbm_entry_t* ep, datum* key, datum* val,
+         struct mdbm_fetch_info* info)
 {
-    return mdbm_internal_do_lock(db,MDBM_LOCK_EXCLUSIVE,MDBM_LOCK_WAIT,NULL,NULL,NULL);
+    get_kv0(db,p,ep,key,val,info,1,0);
 }
 
-int
-mdbm_lock_shared(MDBM *db)
+static void
+get_kv2 (MDBM* db, mdbm_page_t* p, mdbm_entry_t* ep, datum* key, datum* val)
 {
-    return mdbm_internal_do_lock(db,MDBM_LOCK_SHARED,MDBM_LOCK_WAIT,NULL,NULL,NULL);
+    get_kv0(db,p,ep,key,val,NULL,0,0);
+}
+
+/*
+ * Entry-table scanning.
+ * Each mdbm_entry_t is 8 bytes, with the 32-bit (len,hash) match word first.
+ * The vector versions compare the match word of 2 (SSE2) or 4 (AVX2) entries
+ * per instruction, and only fall back to the per-entry compare on a hit.
+ * All versions return the index of the first entry in [start,end) whose match
+ * word equals 'match', or 'end' if there is none.
+ */
+static int
+scan_entries_scalar(const mdbm_entry_t* ep, int start, int end, uint32_t match)
+{
+    int i = start;
+    while (i < end && ep[i].e_key.match != match) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MDBM_HAVE_SIMD_SCAN
+#include <immintrin.h>
+
+__attribute__ ((target("sse2"))) static int
+scan_entries_sse2(const mdbm_entry_t* ep, int start, int end, uint32_t match)
+{
+    int i = start;
+    __m128i m = _mm_set1_epi32((int)match);
+
+    /* lanes 0 and 2 hold the match words, lanes 1 and 3 hold offset/flags */
+    for (; i + 2 <= end; i += 2) {
+        __m128i e = _mm_loadu_si128((const __m128i*)(ep + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(e,m))) & 0x5;
+        if (mask) {
+            return i + (__builtin_ctz(mask) >> 1);
+        }
+    }
+    return scan_entries_scalar(ep,i,end,match);
+}
+
+__attribute__ ((target("avx2"))) static int
+scan_entries_avx2(const mdbm_entry_t* ep, int start, int end, uint32_t match)
+{
+    int i = start;
+    __m256i m = _mm256_set1_epi32((int)match);
+
+    /* even lanes hold the match words */
+    for (; i + 4 <= end; i += 4) {
+        __m256i e = _mm256_loadu_si256((const __m256i*)(ep + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(e,m))) & 0x55;
+        if (mask) {
+            return i + (__builtin_ctz(mask) >> 1);
+        }
+    }
+    return scan_entries_scalar(ep,i,end,match);
 }
+#endif
+
+typedef int (*mdbm_scan_entries_func_t)(const mdbm_entry_t*, int, int, uint32_t);
+
+static mdbm_scan_entries_func_t scan_entries = scan_entries_scalar;
+static int scan_entries_kind = MDBM_SCAN_SCALAR;
 
 int
-mdbm_islocked(MDBM *db)
+mdbm_internal_set_entry_scan(int kind)
 {
-  return db_is_locked(db) ? 1 : 0;
+    switch (kind) {
+    case MDBM_SCAN_SCALAR:
+        scan_entries = scan_entries_scalar;
+        break;
+#ifdef MDBM_HAVE_SIMD_SCAN
+    case MDBM_SCAN_SSE2:
+        if (!__builtin_cpu_supports("sse2")) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        scan_entries = scan_entries_sse2;
+        break;
+    case MDBM_SCAN_AVX2:
+        if (!__builtin_cpu_supports("avx2")) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        scan_entries = scan_entries_avx2;
+        break;
+#endif
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    scan_entries_kind = kind;
+    return 0;
 }
 
-/* NOTE: despite the documentation, this only checks ownership */
-/* by the calling process, instead of ownership by *any* process. */
 int
-mdbm_isowned(MDBM *db)
+mdbm_internal_get_entry_scan(void)
 {
-  return db_is_owned(db) ? 1 : 0;
+    return scan_entries_kind;
 }
 
 int
-mdbm_unlock(MDBM *db)
+mdbm_internal_scan_entries(const mdbm_entry_t* ep, int start, int end, uint32_t match)
 {
-    return mdbm_internal_do_unlock(db,NULL);
+    return scan_entries(ep,start,end,match);
 }
 
+/* Library constructor: pick the widest entry scanner this cpu supports. */
+void __attribute__ ((constructor)) mdbm_entry_scan_init(void);
 
-/**
- * Return whether to enable the protect feature based on a regular expression
- * pattern match with an mdbm path.
- * \param[in] filename mdbm path
- * \param[in] envvar environment variable containing regex pattern
- * \return 1 if the filename matches. Otherwise, return 0
- */
-static int
-protect_regex_match(const char *filename, const char *envvar)
+void mdbm_entry_scan_init(void)
 {
-    regex_t regex;
-    char *pattern = getenv(envvar);
-    int rc;
-    int matched;
-
-    mdbm_log(LOG_DEBUG, "%s: protect_regex_match, envvar=%s", filename, envvar);
-    if (pattern == NULL) {
-        return 0;
+#ifdef MDBM_HAVE_SIMD_SCAN
+    __builtin_cpu_init();
+    if (mdbm_internal_set_entry_scan(MDBM_SCAN_AVX2) == 0) {
+        return;
     }
-    if (strlen(pattern) == 0) {
-        mdbm_log(LOG_ERR,
-                 "%s: protect_regex_match environment variable defined but it has an empty value"
-                 ", envvar=%s", filename, envvar);
-        return 0;
+    if (mdbm_internal_set_entry_scan(MDBM_SCAN_SSE2) == 0) {
+        return;
     }
+#endif
+    mdbm_internal_set_entry_scan(MDBM_SCAN_SCALAR);
+}
 
-    mdbm_log(LOG_DEBUG, "%s: protect_regex_match, pattern=%s", filename, pattern);
-    rc = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
-    if (rc) {
-        mdbm_logerror(LOG_ERR, 0,
-                      "%s: protect_regex_match cannot compile regular expresion"
-                      ", envvar=%s"
-                      ", pattern=%s",
-                      filename, envvar, pattern);
-        return 0;
-    }
+/*
+ * Per-page lookup filters.
+ *
+ * Each logical page owns one cache line (512 bits) of blocked bloom filter,
+ * stored in the directory chunk after the page table.  Entries are keyed by
+ * their match word (key length plus the stored 16 hash bits), so the filter
+ * can be rebuilt from the entry table alone without rehashing any keys.
+ * Stale bits from deleted or evicted entries only cost false positives.
+ */
+#define MDBM_FILTER_PROBES      3
 
-    rc = regexec(&regex, filename, 0, NULL, 0);
-    matched = (rc == 0 ? 1 : 0);
-    regfree(&regex);
-    mdbm_log(LOG_DEBUG, "%s: protect_regex_match, matched=%d", filename, matched);
-    return matched;
+static inline uint64_t
+filter_mix(uint32_t match)
+{
+    uint64_t h = match;
+    h ^= h >> 16;
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+    return h;
 }
 
-
-/**
- * Return whether to enable the protect feature if a .protect file is present.
- * \param[in] filename mdbm path
- * \return 1 if the protect file exists. Otherwise, return 0
- */
-static int
-protect_file_exists(const char *filename)
+static inline void
+filter_add(MDBM* db, mdbm_pagenum_t pagenum, uint32_t match)
 {
-    struct stat st;
-    char protect_path[MAXPATHLEN+1];
-    int size = 0;
-    int found = 0;
+    uint64_t* f = MDBM_FILTER_PTR(db,pagenum);
+    uint64_t h = filter_mix(match);
+    int i;
 
-    if (!(filename && filename[0])) { return 0; }
+    for (i = 0; i < MDBM_FILTER_PROBES; ++i, h >>= 9) {
+        f[(h >> 6) & 7] |= 1ULL << (h & 63);
+    }
+}
 
-    size = snprintf(protect_path, sizeof(protect_path), "%s.protect", filename);
+static inline int
+filter_test(const MDBM* db, mdbm_pagenum_t pagenum, uint32_t match)
+{
+    const uint64_t* f = MDBM_FILTER_PTR(db,pagenum);
+    uint64_t h = filter_mix(match);
+    int i;
 
-    if (size < sizeof(protect_path)) {
-        /* appease ynetdblib, it erroneously relies on errno=0 after mdbm_open() */
-        int errno_save=errno;
-        if (lstat(protect_path, &st) < 0) {
-            if (errno != ENOENT) {
-                mdbm_logerror(LOG_ERR, 0, "%s", protect_path);
-            }
-        } else {
-            /* Removing restriction that .protect file must be owned by root to  simplify
-               testing and it is no longer useful for avoiding unintended uses in production. */
-            /*if (st.st_uid) { */
-            /*    mdbm_log(LOG_ERR, "%s: WARNING: must be owned by root", protect_path); */
-            if (!S_ISLNK(st.st_mode)) { /* Make sure it is a symbolic link */
-                mdbm_log(LOG_ERR, "%s: WARNING: must be a symbolic link", protect_path);
-            } else {
-                found = 1;
-            }
+    for (i = 0; i < MDBM_FILTER_PROBES; ++i, h >>= 9) {
+        if (!(f[(h >> 6) & 7] & (1ULL << (h & 63)))) {
+            return 0;
         }
-        errno=errno_save;
-    } else {
-        mdbm_log(LOG_ERR, "%s.protect: pathname too long", filename);
     }
+    return 1;
+}
 
-    mdbm_log(LOG_DEBUG, "%s: protect_file_exists, found=%d", filename, found);
-    return found;
+static void
+filter_rebuild(MDBM* db, mdbm_page_t* page)
+{
+    /* requires page lock */
+
+    mdbm_entry_t* ep = MDBM_ENTRY(page,0);
+    unsigned int i;
+
+    memset(MDBM_FILTER_PTR(db,page->p_num),0,MDBM_FILTER_BYTES);
+    for (i = 0; i < page->p.p_num_entries; ++i) {
+        if (ep[i].e_key.match) {
+            filter_add(db,page->p_num,ep[i].e_key.match);
+        }
+    }
 }
 
-/**
- * Determines whether a file is on a hugetlbfs.
- * This function has been moved out mdbm_open for profiling purposes.
- *
- * \param[in] filename - mdbm path
- * \param[in] fd file descriptor of opened \a filename
- * \param[out] hugep - predicate result for whether fd is on a hugetlbfs
- *             If the return code is 0, hugep is returned.
- * \param[out] page_size - if \a hugep, the optimal transfer block size
- *             If the return code is 0, page_size is returned.
- * \return whether the check were successful
- * \retval 1 platform cannot have a hugetblfs
- * \retval 0 check success
- * \retval -1 check failed (fstatfs)
+/* Rebuilds the filters of all pages.  On entry the db should be locked, and
+ * the directory writable.
  */
-static int
-check_hugetlbfs(const char *filename, int fd, int *hugep, uint32_t *page_size)
+static void
+filter_rebuild_all(MDBM* db)
 {
-    int rc;
-#ifdef __linux__
-    {
-        struct statfs fs;
-        if (fstatfs(fd, &fs) < 0) {
-            mdbm_logerror(LOG_ERR, 0, "%s: mdbm fstatfs failure", filename);
-            rc = -1;
-        } else {
-            rc = 0;
-            *hugep = (fs.f_type == MDBM_HUGETLBFS_MAGIC);
-            if (page_size != NULL) {
-                *page_size = (uint32_t)fs.f_bsize; /* Optimal transfer block size. */
+    int i;
+
+    memset(MDBM_FILTER_PTR(db,0),0,MDBM_FILTER_SIZE(db->db_dir_shift));
+    for (i = 0; i <= db->db_max_dirbit; i++) {
+        mdbm_page_t* page;
+        if ((page = pagenum_to_page(db,i,MDBM_PAGE_NOALLOC,MDBM_PAGE_MAP))) {
+            filter_rebuild(db,page);
+            if (MDBM_IS_WINDOWED(db)) {
+                release_window_page(db,page);
             }
         }
     }
-#else
-    rc = 1;
-    *hugep = 0;
-    if (page_size != NULL) {
-        *page_size = 0;
-    }
-#endif
-    return rc;
 }
 
-static int
-is_hugetlbfs(const char *filename, int fd)
+/*
+ * In-page hash slot index.
+ *
+ * When enabled, every data page ends with an open-addressed (linear probing)
+ * table of 16-bit slots, each holding an entry index + 1, or 0 when empty.
+ * Slots are placed by the entry match word, so the index can be rebuilt from
+ * the entry table without rehashing keys.  Entry indexes are bounded to 3/4 of
+ * the slots so that probing always terminates; a page that outgrows that
+ * (e.g. an oversized page) is flagged MDBM_PFLAG_NOINDEX and falls back to
+ * scanning its entries until it is rebuilt.
+ */
+static inline uint32_t
+page_index_home(uint32_t match, int shift)
 {
-    int hugep = 0;
-    (void)check_hugetlbfs(filename, fd, &hugep, NULL);
-    return hugep;
+    return (match * 0x9e3779b1U) >> (32 - shift);
 }
 
-/**
- * Gets the magic number from an mdbm by mmap instead of pread.
- * This is needed for older Linux kernel versions (2.6.18) that don't support
- * hugetlbfs file-based read-write operations (i.e., pread).  hugtlbfs
- * read-write operations aren't supported until kernel version 2.6.25.
- *
- * Currently (Linux kernel 2.6.18), hugetlbfs files cannot be mmap'd for just
- * the header size, or the typical system page size (4096) because mmap fails
- * with errno=EINVAL.  A hugetlbfs mdbm has to be mmap's according to its
- * system page size (ex., 2MB).
- *
- * \param[in] filename - mdbm path
- * \param[in] fd file descriptor of opened \a filename
- * \param[in] db_sys_pagesize - file-system page page size.
- *            Normally, the same as system page size, unless the
- *            the mdbm is on hugetlbfs, where it must be the
- *            huge page size.
- * \param[out] magic - mdbm magic number (internal version identifier)
- * \param[in] log_error - non-zero value for whether to log an error.
- *            Normally, an error should be emitted.  However, during an
- *            mdbm_open when a file is being created, there is no data
- *            and the caller will not want to emit an expected error.
- * \return whether a magic number is returned
- * \retval  0 magic number returned in \a magic
- * \retval -1 file is truncated (0 bytes)
- * \retval -2 file size is smaller than magic number
- * \retval -3 mmap failed
- * \retval -4 munmap failed
- * \retval -5 file size invalid (truncated)
- */
-static int
-get_magic_number_mmap(const char *filename, int fd, uint32_t db_sys_pagesize,
-                      uint32_t *magic, int log_error)
+static inline int
+page_index_max_entries(int shift)
 {
-    mdbm_hdr_t* hp = NULL;
-    off_t len;
+    return (3 << shift) / 4;
+}
 
-    mdbm_log(LOG_DEBUG, "%s: get_magic_number_mmap", filename);
-    len = lseek(fd, 0, SEEK_END);
-    if (len == 0) {
-        return -1;
-    } else {
-        /* The above lseek might've failed, catch it here. */
-        if (len < sizeof(hp->h_magic)) {
-            mdbm_logerror(LOG_ERR, 0,
-                          "%s: mdbm header is smaller than the size of a magic number, "
-                          "header_len=%ld, magic_size=%ld",
-                          filename, (long)len, (long)sizeof(hp->h_magic));
-            return -2;
-        } else {
-            /* Ideally, we only want to map the header, but hugetlbfs mmap
-             * operations fail if something other than that file-system's page
-             * size is used (ex., sizes 4096 and sizeof(*hp) fail). */
-            if (db_sys_pagesize < sizeof(*hp)) {
-                /* Display an error message, but allow to continue.  In the
-                 * future, it might be OK to not use an integral page size for
-                 * hugetlbfs mmap. */
-                mdbm_log(LOG_ERR,
-                         "%s: get_magic_number_mmap map size is less than header size, "
-                         "header_size=%ld, map_size=%d",
-                         filename, (long)sizeof(*hp), db_sys_pagesize);
-            }
-            hp = (mdbm_hdr_t*)mmap(0, db_sys_pagesize, PROT_READ, MAP_SHARED, fd, 0);
-            if (hp == (mdbm_hdr_t*)-1) {
-                mdbm_logerror(LOG_ERR, 0,
-                              "%s: mdbm header map failure, len=%lld, db_sys_pagesize=%d",
-                              filename, (long long)len, db_sys_pagesize);
-                return -3;
-            }
-            *magic = hp->h_magic;
+static void
+page_index_insert(MDBM* db, mdbm_page_t* page, int index)
+{
+    /* requires page lock */
 
-            if (munmap(hp, db_sys_pagesize)) {
-                mdbm_logerror(LOG_ERR, 0, "%s: mdbm header unmap failure, size=%d",
-                              filename, db_sys_pagesize);
-                return -4;
-            }
+    int shift = db->db_hdr->h_index_shift;
+    uint32_t mask = (1U << shift) - 1;
+    uint16_t* slots;
+    uint32_t s;
 
-            if (*magic == _MDBM_MAGIC_NEW2 && (len < db_sys_pagesize)) {
-                mdbm_logerror(LOG_ERR, 0, "%s: mdbm header is truncated, len=%lld",
-                              filename, (long long)len);
-                return -5;
-            }
-        }
+    if (page->p_flags & MDBM_PFLAG_NOINDEX) {
+        return;
     }
-
-    return 0;
+    if (index >= page_index_max_entries(shift)) {
+        page->p_flags |= MDBM_PFLAG_NOINDEX;
+        return;
+    }
+    slots = MDBM_PAGE_INDEX_PTR(db,page);
+    for (s = page_index_home(MDBM_ENTRY(page,index)->e_key.match,shift); slots[s];
+         s = (s + 1) & mask) {
+    }
+    slots[s] = (uint16_t)(index + 1);
 }
 
-/**
- * Gets the magic number from an mdbm using pread.  Using pread is much faster
- * than using mmap as done in get_magic_number_mmap.  pread is used for
- * non-hugetlbfs file-systems.
- *
- * \param[in] filename - mdbm path
- * \param[in] fd file descriptor of opened \a filename
- * \param[out] magic - mdbm magic number (internal version identifier)
- * \param[in] log_error - non-zero value for whether to log an error.
- *            Normally, an error should be emitted.  However, during an
- *            mdbm_open when a file is being created, there is no data
- *            and the caller will not want to emit an expected error.
- * \return whether a magic number is returned
- * \retval  0 magic number returned in \a magic
- * \retval -1 cannot read file
- * \retval -2 file is truncated (0 bytes)
- * \retval -3 cannot read all of magic number
- */
-static int
-get_magic_number_pread(const char* filename, int fd, uint32_t *magic, int log_error)
+static void
+page_index_remove(MDBM* db, mdbm_page_t* page, int index)
 {
-    uint32_t magic_local;
-    ssize_t bytes_expected = sizeof(magic_local);
-    off_t offset = offsetof(mdbm_hdr_t, h_magic);
-    ssize_t bytes_read = pread(fd, &magic_local, bytes_expected, offset);
+    /* requires page lock; must be called before the entry's match is cleared */
 
-#ifdef DEBUG
-    mdbm_log(LOG_DEBUG, "%s: get_magic_number_pread", filename);
-#endif
-    if (bytes_read < 0) {
-        if (log_error) {
-            mdbm_logerror(LOG_ERR, 0,
-                          "%s: mdbm header read failure, "
-                          "bytes_expected=%ld, bytes_read=%ld, offset=%ld",
-                          filename, (long)bytes_expected, (long)bytes_read, (long)offset);
-        }
-        return -1;
-    } else if (bytes_read == 0) {
-        if (log_error) {
-            mdbm_logerror(LOG_ERR, 0,
-                          "%s: mdbm header read failure, file is truncated, "
-                          "bytes_expected=%ld, bytes_read=%ld, offset=%ld",
-                          filename, (long)bytes_expected, (long)bytes_read, (long)offset);
+    int shift = db->db_hdr->h_index_shift;
+    uint32_t mask = (1U << shift) - 1;
+    uint16_t* slots;
+    uint32_t i, j;
+
+    if (page->p_flags & MDBM_PFLAG_NOINDEX) {
+        return;
+    }
+    slots = MDBM_PAGE_INDEX_PTR(db,page);
+    for (i = page_index_home(MDBM_ENTRY(page,index)->e_key.match,shift);
+         slots[i] != index + 1; i = (i + 1) & mask) {
+        if (!slots[i]) {
+            return;
         }
-        return -2;
-    } else if (bytes_read != bytes_expected) {
-        if (log_error) {
-            mdbm_logerror(LOG_ERR, 0,
-                          "%s: mdbm header read failure, "
-                          "bytes_expected=%ld, bytes_read=%ld, offset=%ld",
-                          filename, (long)bytes_read, (long)bytes_expected, (long)offset);
+    }
+
+    /* Shift later members of the probe run back, so lookups never stop short. */
+    slots[i] = 0;
+    for (j = (i + 1) & mask; slots[j]; j = (j + 1) & mask) {
+        uint32_t k = page_index_home(MDBM_ENTRY(page,slots[j]-1)->e_key.match,shift);
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
         }
-        return -3;
-    } else {
-        *magic = magic_local;
-        return 0;
+        slots[i] = slots[j];
+        slots[j] = 0;
+        i = j;
     }
 }
 
-/**
- * Gets the magic number from an mdbm.
- *
- * \param[in] filename - mdbm path
- * \param[in] fd - file descriptor of opened \a filename
- * \param[in] db_sys_pagesize - file-system page page size.
- *            Normally, the same as system page size, unless the
- *            the mdbm is on hugetlbfs, where it must be the
- *            huge page size.
- * \param[out] magic - mdbm magic number (internal version identifier)
- * \param[in]  log_error - non-zero value for whether to log an error.
- *             Normally, an error should be emitted.  However, during an
- *             mdbm_open when a file is being created, there is no data
- *             and the caller will not want to emit an expected error.
- * \return whether a magic number is returned
- * \retval  0 magic number returned in \a magic
- * \retval -1 file (\a fd) is an empty file
- * \retval -2 get magic failed on hugetlbfs
- * \retval -3 get magic failed on non-hugetlbfs
- */
-int
-get_magic_number(const char* filename, int fd, uint32_t db_sys_pagesize,
-                 uint32_t *magic, int log_error)
+static void
+page_index_rebuild(MDBM* db, mdbm_page_t* page)
 {
-    int rc;
-
-    /* If this mdbm is on a hugetlbfs, use the slower get_magic_number_mmap
-     * function because file-based read-write operations are not supported in
-     * older version of the kernel.
-     *
-     * TBD: if the kernel version is 2.6.25 or later, read-write operations
-     * are supported and get_magic_number_pread should be used.
-     */
-    if (is_hugetlbfs(filename, fd)) {
-        rc = get_magic_number_mmap(filename, fd, db_sys_pagesize, magic, log_error);
-        if ((rc != 0) && (rc != -1)) {
-            /* If rc is 0, or -1, return that.  Otherwise, convert the rc code. */
-            if (log_error) {
-                mdbm_logerror(LOG_ERR, 0,
-                              "%s: get_magic_number failed on hugetlbfs, rc=%d",
-                              filename, rc);
-            }
-            rc = -2;
-        }
-    } else {
-        rc = get_magic_number_pread(filename, fd, magic, log_error);
-        /* If rc is 0, return that.  Otherwise, convert the rc code. */
-        switch (rc) {
-        case 0:
-            break;
+    /* requires page lock */
 
-        case -2:
-            rc = -1;
-            break;
+    mdbm_entry_t* ep = MDBM_ENTRY(page,0);
+    unsigned int i;
 
-        default:
-            if (log_error) {
-                mdbm_logerror(LOG_ERR, 0,
-                              "%s: get_magic_number failed on non-hugetlbfs, rc=%d",
-                              filename, rc);
-            }
-            rc = -3;
+    page->p_flags &= ~MDBM_PFLAG_NOINDEX;
+    memset(MDBM_PAGE_INDEX_PTR(db,page),0,MDBM_PAGE_INDEX_BYTES(db));
+    for (i = 0; i < page->p.p_num_entries; ++i) {
+        if (ep[i].e_key.match) {
+            page_index_insert(db,page,i);
         }
     }
-
-    return rc;
 }
 
-/**
- * Gets the magic number from an mdbm.
- *
- * \param[in] db mdbm handle
- * \param[out] magic - mdbm magic number (internal version identifier)
- * \return whether a magic number is returned
- * \retval 0 magic number returned in \a magic
- * \retval -1 get magic number failed on hugetlbfs
- * \retval -2 get magic number failed on non-hugetlbfs
- */
-int
-mdbm_get_magic_number(MDBM *db, uint32_t *magic)
+static void
+init_data_page(MDBM* db, mdbm_page_t* page)
 {
-    if (db == NULL) {
-        return -1;
-    }
-    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
-        return _MDBM_MAGIC_NEW2;
+    MDBM_INIT_TOP_ENTRY(MDBM_ENTRY(page,0),MDBM_DATA_PAGE_END(db,page));
+    if (MDBM_HAS_PAGE_INDEX(db)) {
+        page->p_flags &= ~MDBM_PFLAG_NOINDEX;
+        memset(MDBM_PAGE_INDEX_PTR(db,page),0,MDBM_PAGE_INDEX_BYTES(db));
     }
-    return get_magic_number(db->db_filename, db->db_fd, db->db_sys_pagesize, magic, 1);
 }
 
-
-void*
-mdbm_allocate_handle()
+/**
+ * \brief Checks that a page's slot index holds exactly its live entries.
+ * \param[in,out] db handle
+ * \param[in] page data page
+ * \param[in] pnum logical page number
+ * \param[in] mapped_pnum physical page number
+ * \param[in] verbose whether to display information messages
+ * \return number of check failures
+ */
+static int
+check_page_index(MDBM* db, mdbm_page_t* page, int pnum, int mapped_pnum, int verbose)
 {
-    /* NOTE: this assumes a V3 handle is larger than V2 (currently true).
-     * we need to allocate enough space for either. */
-    void* ret = calloc(1,sizeof(MDBM)); /* auto-zero's the memory */
+    int shift = db->db_hdr->h_index_shift;
+    uint32_t mask = (1U << shift) - 1;
+    const uint16_t* slots = MDBM_PAGE_INDEX_PTR(db,page);
+    unsigned int nslots = 0;
+    unsigned int nlive = 0;
+    unsigned int i;
+    uint32_t s;
+    int nerr = 0;
 
-    struct mdbm* db = (struct mdbm *) ret;
-    if (db) {
-      db->guard_padding_1 = db->guard_padding_2 = MDBM_GUARD_PADDING; 
-      db->guard_padding_3 = db->guard_padding_4 = MDBM_GUARD_PADDING;
+    for (s = 0; s <= mask; s++) {
+        if (slots[s]) {
+            nslots++;
+            if (slots[s] > page->p.p_num_entries
+                || !MDBM_ENTRY(page,slots[s]-1)->e_key.match)
+            {
+                if (verbose) {
+                    mdbm_log(LOG_CRIT,
+                             "%s (page %d/%d): index slot %u refers to invalid entry %u",
+                             db->db_filename,pnum,mapped_pnum,s,slots[s]-1);
+                }
+                nerr++;
+            }
+        }
     }
-
-    return ret;
+    for (i = 0; i < page->p.p_num_entries; i++) {
+        uint32_t match = MDBM_ENTRY(page,i)->e_key.match;
+        if (!match) {
+            continue;
+        }
+        nlive++;
+        for (s = page_index_home(match,shift); slots[s] && slots[s] != i + 1; s = (s + 1) & mask) {
+        }
+        if (!slots[s]) {
+            if (verbose) {
+                mdbm_log(LOG_CRIT,
+                         "%s (page %d/%d): entry %u missing from page index",
+                         db->db_filename,pnum,mapped_pnum,i);
+            }
+            nerr++;
+        }
+    }
+    if (nslots != nlive) {
+        if (verbose) {
+            mdbm_log(LOG_CRIT,
+                     "%s (page %d/%d): page index has %u slots in use for %u entries",
+                     db->db_filename,pnum,mapped_pnum,nslots,nlive);
+        }
+        nerr++;
+    }
+    return nerr;
 }
 
-void
-mdbm_free_handle(MDBM* db)
+/* Returns the index of the entry for key, or p_num_entries if not found. */
+static unsigned int
+page_index_find(MDBM* db, mdbm_page_t* page, const datum* key, uint32_t match)
 {
-    free(db);
-}
-
+    int shift = db->db_hdr->h_index_shift;
+    uint32_t mask = (1U << shift) - 1;
+    const uint16_t* slots = MDBM_PAGE_INDEX_PTR(db,page);
+    uint32_t s;
 
-/* extern int mdbm_convert_legacy_mdbm(const char* filename); */
+    for (s = page_index_home(match,shift); slots[s]; s = (s + 1) & mask) {
+        unsigned int i = slots[s] - 1;
+        mdbm_entry_t* ep = MDBM_ENTRY(page,i);
+        if (i < page->p.p_num_entries
+            && ep->e_key.match == match
+            && !memcmp(MDBM_KEY_PTR1(page,ep),key->dptr,key->dsize)) {
+            return i;
+        }
+    }
+    return page->p.p_num_entries;
+}
 
-MDBM*
-mdbm_open_inner(const char *filename, int flags, int mode, int pagesize, int dbsize, int retry)
+static mdbm_entry_t*
+find_entry(MDBM* db, mdbm_page_t* page, const datum* key, mdbm_hashval_t hash,
+           datum* k, datum* v, struct mdbm_fetch_info* info)
 {
-    MDBM *db = NULL;
-    int do_check = 0;
-    int err;
-    int openflags = 0;
-    int fd = -1;
-    uint32_t magic;
-    /*uint32_t page_size = 0; */
-    int db_flags = 0;
-    uint32_t db_sys_pagesize = getpagesize();
-    char pathname[MAXPATHLEN+1];
-    mode_t umask_save;
-    char memonly_fname[MAXPATHLEN];
-    char *tempfilename;
-
-    if (filename == NULL) {
-        /* user requested a memory only db */
-        if (pagesize == 0) {
-            pagesize = MDBM_PAGESIZ;
-        }
-        if (pagesize < MDBM_MINPAGE) {
-            mdbm_logerror(LOG_ERR, 0,"mem-only: mdbm open memory-only cache failure,"
-                          " invalid page size specified=%d", pagesize);
-            errno = EINVAL;
-            return NULL;
-        }
+    /* requires page lock */
 
-        /* dbsize is a required parameter */
-        if ((dbsize < (2 * pagesize)) || (dbsize < (MDBM_MINPAGE * 3))) {
-            mdbm_logerror(LOG_ERR, 0,"mem-only: mdbm open memory-only failure, "
-                          "invalid dbsize specified=%d", dbsize);
-            errno = EINVAL;
-            return NULL;
-        }
+    mdbm_entry_t test;
+    mdbm_entry_t* ep;
+    unsigned int i;
+    mdbm_page_t* rpage = page;
+    int lob_alloclen = 0;
 
-        db_flags = MDBM_DBFLAG_MEMONLYCACHE;
+    test.e_key.key.len = key->dsize;
+    test.e_key.key.hash = hash >> 16;
 
-        /* sanity check flags that make sense for memory-only cache */
-        if (flags & (MDBM_OPEN_WINDOWED|MDBM_O_FSYNC|MDBM_HEADER_ONLY|MDBM_O_RDONLY)) {
-            mdbm_logerror(LOG_ERR, 0,"mem-only: mdbm open memory-only failure, "
-                          "conflicting flags(%x) specified", flags);
-            errno = EINVAL;
-            return NULL;
+    if (MDBM_HAS_FILTER(db) && !filter_test(db,page->p_num,test.e_key.match)) {
+        if (MDBM_GET_STAT_OPERATIONS_OPS(db)) {
+            MDBM_INC_STAT_64(&mdbm_hdr_stats(db)->s_filter_rejects);
         }
-        flags |= MDBM_O_CREAT | MDBM_O_TRUNC | MDBM_O_RDWR | MDBM_CREATE_V3;
-
-        /* create a unique tmp name for filename */
-        tempfilename = tempnam("/tmp", "memoryonly");
-        snprintf(memonly_fname, sizeof(memonly_fname),"%s",tempfilename);
-        filename = memonly_fname;
-        free(tempfilename);
+        return NULL;
     }
 
+    ep = MDBM_ENTRY(page,0);
+    i = 0;
+    if (MDBM_HAS_PAGE_INDEX(db) && !(page->p_flags & MDBM_PFLAG_NOINDEX)) {
+        i = page_index_find(db,page,key,test.e_key.match);
+    } else {
+        for (;;) {
+            char* kp;
 
-    /* force V3 */
-    flags |= MDBM_CREATE_V3;
-    /* unset V2 */
-    if (flags & MDBM_CREATE_V2) {
-      mdbm_logerror(LOG_ERR,0,"%s: MDBM V4 doesn't support MDBM_CREATE_V2", filename);
-      errno = EINVAL;
-      return NULL;
-    }
+            i = scan_entries(ep,i,page->p.p_num_entries,test.e_key.match);
+            if (i == page->p.p_num_entries) {
+                break;
+            }
 
-    /* open_locks_inner() handles MDBM_ANY_LOCKS for now... */
-    if (flags & MDBM_ANY_LOCKS) {
-      db_flags |= MDBM_ANY_LOCKS;
+            if (MDBM_IS_WINDOWED(db)) {
+                int ent_off = MDBM_ENTRY_OFFSET(db,ep+i);
+                int ent_len = MDBM_ENTRY_LEN(db,ep+i);
+                rpage = get_window_page(db,page,0,0, ent_off, ent_len);
+                if (!rpage) {
+                  return NULL;
+                }
+            }
+            kp = MDBM_KEY_PTR1(rpage,ep+i);
+            if (memcmp(kp,key->dptr,key->dsize)) {
+                i++;
+                continue;
+            }
+            break;
+        }
     }
-    if (flags & MDBM_SINGLE_ARCH) {
-      db_flags |= MDBM_SINGLE_ARCH;
+    if (i == page->p.p_num_entries) {
+        if (MDBM_HAS_FILTER(db) && MDBM_GET_STAT_OPERATIONS_OPS(db)) {
+            MDBM_INC_STAT_64(&mdbm_hdr_stats(db)->s_filter_false_pos);
+        }
+        return NULL;
     }
 
+    if (MDBM_IS_WINDOWED(db) && MDBM_ENTRY_LARGEOBJ(ep+i)) {
+        uint32_t vallen, lob_alloclen;
+        int n;
 
-    /* fprintf(stderr, "MDBM V3 header size is %d bytes\n", sizeof(mdbm_hdr_t)); */
-
-    if ((flags & MDBM_O_ACCMODE) != MDBM_O_RDONLY) {
-        openflags = O_RDWR;
-    } else {
-        openflags = O_RDONLY;
-        /* remap_file_pages() fails when opening RDONLY */
-        if (flags & MDBM_OPEN_WINDOWED) {
-            mdbm_logerror(LOG_ERR,0,"%s: cannot use MDBM_OPEN_WINDOWED in read-only mode",filename);
-            ERROR();
-            goto open_error;
+        MDBM_ENTRY_LOB_ALLOC_LEN1(db,rpage,ep+i,&vallen,&lob_alloclen);
+        n = 2 + lob_alloclen/db->db_pagesize;
+        if (db->db_window.num_pages < n) {
+            mdbm_log(LOG_ERR,
+                     "%s: window size too small for large object (need at least %d bytes)",
+                     db->db_filename,n * db->db_pagesize);
+            return NULL;
         }
     }
-    if (flags & MDBM_O_CREAT) {
-        openflags |= O_CREAT;
-    }
 
-    mdbm_log(LOG_DEBUG, "%s: mdbm_open, openflags=0x%x, mode=0%o",
-             filename, openflags, mode);
+    get_kv0(db,rpage,ep+i,k,v,info,1,lob_alloclen);
+    return ep+i;
+}
 
-    if (db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
-        fd = -1;
-    } else {
-        umask_save = umask(0);      /* Allow all permissions to be set */
-        fd = open(filename,openflags,mode);
-        umask(umask_save);          /* Restore umask */
-        if (fd < 0) {
-            mdbm_logerror(LOG_ERR,0,"%s: mdbm file open failure",filename);
-            ERROR();
-            goto open_error;
-        }
+static int
+del_entry(MDBM* db, mdbm_page_t* page, mdbm_entry_t* ep)
+{
+    /* requires page lock */
 
-      /* Check for a hugetlbfs, and update config if appropriate. */
-      {
-          int hugep = 0; /* Boolean for whether filename is on a hugetlbfs */
-          uint32_t page_size = 0;
+    int index = MDBM_ENTRY_INDEX(page,ep);
+    int offset;
 
-          if (check_hugetlbfs(filename, fd, &hugep, &page_size) < 0) {
-              ERROR();
-              goto open_error;
-          } else {
-              if (hugep) {
-                  db_flags |= MDBM_DBFLAG_HUGEPAGES;
-                  db_sys_pagesize = page_size;
-              }
-          }
-      }
-    }
+    if (MDBM_ENTRY_LARGEOBJ(ep)) {
+        mdbm_page_t* rpage = page;
+        mdbm_entry_lob_t*  lp;
 
-    /* Verify the magic number in the header. */
-    magic = 0;
-    if (!(flags & MDBM_O_TRUNC)) {
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "%s: mdbm_open, check for magic number", filename);
-        int rc = get_magic_number(filename, fd, db_sys_pagesize, &magic, 1);
-        mdbm_log(LOG_DEBUG, "%s: mdbm_open, magic number=0x%x, rc=%d",
-                 filename, magic, rc);
-#else
-        int rc = get_magic_number(filename, fd, db_sys_pagesize, &magic, 0);
-#endif
-        /* Either the mdbm exists and it has a valid magic number, or a new mdbm
-         * is being created (and no data for a magic number could be read). */
-        if (rc) {
-            if (rc == -1) {
-                /* mdbm was empty */
-                if (!(flags & MDBM_O_CREAT)) {
-                    mdbm_logerror(LOG_ERR,0,"%s: mdbm header is truncated",filename);
-                    ERROR();
-                    goto open_error;
-                }
-            } else {
-              mdbm_logerror(LOG_ERR,0,"%s: can't get mdbm magic number (fd:%d, rc:%d)",
-                            filename, fd, rc);
-              goto open_error;
+        if (MDBM_IS_WINDOWED(db)) {
+            int ent_off = MDBM_ENTRY_OFFSET(db,ep);
+            int ent_len = MDBM_ENTRY_LEN(db,ep);
+            rpage = get_window_page(db,page,0,0, ent_off, ent_len);
+            if (!rpage) {
+              return -1;
             }
         }
+        lp = MDBM_LOB_PTR1(db,rpage,ep);
+        if (mdbm_internal_lock(db) < 0) {
+            return -1;
+        }
+        free_chunk(db,lp->l_pagenum,NULL);
+        mdbm_internal_unlock(db);
     }
 
-#ifdef DEBUG
-    mdbm_log(LOG_DEBUG, "%s: mdbm_open, magic number=0x%x", filename, magic);
-#endif
-    /* If there is no magic number (we're creating an mdbm), set it according
-     * to the mdbm version desired. */
-    if (!magic) {
-        magic = _MDBM_MAGIC_NEW2;
+    if (MDBM_HAS_PAGE_INDEX(db)) {
+        page_index_remove(db,page,index);
     }
-    if (magic != _MDBM_MAGIC_NEW2) {
-        if (magic == _MDBM_MAGIC || magic == _MDBM_MAGIC_NEW) {
-          mdbm_log(LOG_ERR,"%s: V2 mdbm is not supported",filename);
-          errno = EBADF;
-          return NULL;
+    offset = ep[0].e_offset + MDBM_KEY_ALIGN_LEN(db,ep[0].e_key.key.len);
+    ep->e_key.match = 0;
+    ep->e_offset = offset;
 
-          /*
-          //if (!retry) {
-          //  mdbm_log(LOG_ERR,"%s: V2 mdbm is not supported, and autoconvert failed",filename);
-          //  errno = EBADF;
-          //  return NULL;
-          //}
-          //close(fd);
-          // // log error
-          //mdbm_log(LOG_ERR,"%s: V2 mdbm is not supported, attempting to autoconvert",filename);
-          //mdbm_log(LOG_ERR,"%s: conversion will go away completely in the future",filename);
-          // // try upgrade...
-          //if (mdbm_convert_legacy_mdbm(filename)) {
-          //  errno = EBADF;
-          //  return NULL;
-          //}
-          //return mdbm_open_inner(filename, flags, mode, pagesize, dbsize, 0);
-          */
-
-        } else {
-          close(fd);
-          mdbm_log(LOG_ERR,"%s: mdbm header magic number is invalid",filename);
-          ERROR();
-          errno = EBADF;
-          return NULL;
+    if (index == page->p.p_num_entries-1) {
+        while (index > 0 && !ep[-1].e_key.match) {
+            index--;
+            ep--;
+        }
+        page->p.p_num_entries = index;
+        MDBM_INIT_TOP_ENTRY(ep,ep->e_offset);
+        dirty_mark_page(db,page);
+        if (!index && page->p_num_pages > 1) {
+            /* Free oversized page. */
+            if (mdbm_internal_lock(db) == 1) {
+                shrink_page(db,page);
+                mdbm_internal_unlock(db);
+            }
+        }
+    } else {
+        if (index > 0 && !ep[-1].e_key.match) {
+            offset = ep[-1].e_offset;
+        }
+        while (!ep->e_key.match) {
+            ep->e_offset = offset;
+            ep++;
         }
+        dirty_mark_page(db,page);
     }
+    return 0;
+}
 
-    if (pagesize && (pagesize < MDBM_MINPAGE)) {
-        mdbm_logerror(LOG_ERR,0,"%s: Page size %d is too small", filename, pagesize);
-        close(fd);
-        errno = EINVAL;
-        return NULL;
-    }
+static void
+wring_page(MDBM* db, mdbm_page_t* page)
+{
+    /* requires page lock */
 
-    if (pagesize && (pagesize > MDBM_MAXPAGE)) {
-        mdbm_logerror(LOG_ERR,0,"%s: Page size %d is too large", filename, pagesize);
-        close(fd);
-        errno = EINVAL;
-        return NULL;
-    }
+    mdbm_entry_data_t e;
+    mdbm_entry_t* ep;
+    int index = -1;
+    int offset = 0;
 
-    if ((flags & MDBM_HEADER_ONLY) && (flags & MDBM_O_CREAT)) {
-        mdbm_logerror(LOG_ERR,0,
-                      "%s: cannot use MDBM_HEADER_ONLY with MDBM_O_CREAT",filename);
-        close(fd);
-        errno = EINVAL;
-        return NULL;
-    }
+    int num = 0;
+    for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
+        if (ep->e_key.match) {
+            num++;
+            if (offset) {
+                mdbm_entry_t* move_ep = MDBM_ENTRY(page,index);
+                int ksize = MDBM_KEY_ALIGN_LEN(db,ep->e_key.key.len);
+                int vsize = ep[0].e_offset -
+                            ep[1].e_offset -
+                            MDBM_KEY_ALIGN_LEN(db,ep[1].e_key.key.len);
+                int kvsize = ksize + vsize;
 
-    if (!filename || !filename[0] || strlen(filename) > MAXPATHLEN
-#ifndef __x86_64__
-        || ((flags & (MDBM_DBSIZE_MB|MDBM_DBSIZE_MB_OLD)) && dbsize > 2048)
-#endif
-        || ((flags & (MDBM_CREATE_V2|MDBM_CREATE_V3)) == (MDBM_CREATE_V2|MDBM_CREATE_V3)))
-        {
-            mdbm_logerror(LOG_ERR,0,"%s: invalid path, size=%ld",
-                          filename, (filename ? (long)strlen(filename) : 0L) );
-            close(fd);
-            errno = EINVAL;
-            return NULL;
-        }
+                offset -= kvsize;
+                move_ep->e_key.match = ep->e_key.match;
+                move_ep->e_flags = ep->e_flags;
+                move_ep->e_offset = offset + vsize;
+                memmove((char*)page + offset,MDBM_VAL_PTR2(page,ep->e_offset,vsize),kvsize);
 
-#ifndef HAVE_WINDOWED_MODE /* WINDOWED mode only supported on linux */
-    if (flags & MDBM_OPEN_WINDOWED) {
-        ERROR();
-        close(fd);
-        errno = EINVAL;
-        return NULL;
+                index++;
+            }
+        } else {
+            if (!offset) {
+                index = e.e_index;
+                offset = e.e_entry->e_offset;
+            }
+        }
     }
-#endif
-    if ((flags & MDBM_OPEN_WINDOWED) && pagesize && (0 != (pagesize % db_sys_pagesize))) {
-        ERROR();
-        mdbm_logerror(LOG_ERR,0,"%s: Page size %d must be a multiple of system page size %d", filename, pagesize, db_sys_pagesize);
-        close(fd);
-        errno = EINVAL;
-        return NULL;
+    if (offset) {
+        MDBM_INIT_TOP_ENTRY(MDBM_ENTRY(page,num),offset);
+        page->p.p_num_entries = num;
+        if (MDBM_HAS_PAGE_INDEX(db)) {
+            page_index_rebuild(db,page);
+        }
+        dirty_mark_page(db,page);
     }
+    /* printf("wring page=%d: before=%d after=%d\n",page->p_num,n,MDBM_PAGE_FREE_BYTES(page)); */
+}
 
-/*
-    //if ((flags & MDBM_OPEN_WINDOWED) && remap_is_limited(db_sys_pagesize)) {
-    //    mdbm_logerror(LOG_ERR,0,"%s: OS does not support windowed mode", filename);
-    //    close(fd);
-    //    errno = EINVAL;
-    //    return NULL;
-    //}
-*/
+static int
+resize(MDBM* db, int new_dirshift, int new_num_pages)
+{
+    /* requires db lock */
 
-    if (!(db_flags & MDBM_DBFLAG_MEMONLYCACHE)) {
-        if (!realpath(filename,pathname)) {
-          mdbm_logerror(LOG_ERR,0,"Unable to resolve real path for mdbm: %s",filename);
-          ERROR();
-          return NULL;
-        }
-    } else {
-      pathname[0] = '\0';
-    }
+    int old_num_pages = db->db_num_pages;
+    int old_dirpages;
+    int old_dirshift = db->db_dir_shift;
+    int old_dirsize;
+    int old_ptsize;
+    int new_dirpages;
+    int new_dirwidth;
+    int new_dirsize;
+    int new_ptsize;
+    mdbm_ptentry_t* new_ptable;
 
-    db = (MDBM*)mdbm_allocate_handle();
-    if (db == NULL) {
-        ERROR();
-        errno = ENOMEM;
-        return NULL;
+    if (!new_dirshift) {
+        new_dirshift = old_dirshift;
     }
-    db->db_ver_flag = MDBM_DBVER_3;
-    db->db_fd = fd;
-    db->db_flags |= db_flags;
-    db->db_sys_pagesize = db_sys_pagesize;
-    /*init_locks(db); */
-
-    db->db_filename[0] = 0;
-    if (filename[0] == '/') {
-        strncat(db->db_filename,filename,sizeof(db->db_filename)-1);
-    } else {
-        strncat(db->db_filename,pathname,sizeof(db->db_filename)-1);
+    if (!new_num_pages) {
+        new_num_pages = old_num_pages + MDBM_NUM_DIR_PAGES(db->db_pagesize,new_dirshift,db->db_hdr->h_dbflags);
     }
-    db->m_stat_cb = 0;
-    db->m_stat_cb_flags = 0;
-    db->m_stat_cb_user = 0;
-    db->db_get_usec = &fast_time_usec;
-
-    if ((flags & MDBM_O_ACCMODE) == MDBM_O_RDONLY) {
-        db->db_flags |= MDBM_DBFLAG_RDONLY;
+    new_dirwidth = MDBM_DIR_WIDTH(new_dirshift);
+    if (new_dirwidth > new_num_pages) {
+        new_num_pages = new_dirwidth;
     }
-    if (flags & MDBM_NO_DIRTY) {
-        db->db_flags |= MDBM_DBFLAG_NO_DIRTY;
+    if (new_dirshift <= old_dirshift && new_num_pages <= old_num_pages) {
+        return 0;
     }
-    if (flags & MDBM_OPEN_NOLOCK) {
-        db->db_flags |= MDBM_DBFLAG_NOLOCK;
-    } else {
-        int lockmode = 0;
-        int lflags = (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE);
-        if (mdbm_internal_open_locks(db,flags|lflags,1,&do_check) < 0) {
-            ERROR();
-            goto open_error;
+    if (new_num_pages > old_num_pages) {
+        if ((db->db_hdr->h_max_pages && new_num_pages > db->db_hdr->h_max_pages)
+                || resize_db(db,new_num_pages) < 0) {
+            mdbm_log(LOG_DEBUG,
+                 "resize db failure,"
+                 " old_num_pages=%d, new_num_pages=%d,"
+                 " dirwidth=%d, new_dirwidth=%d)\n",
+                 old_num_pages, new_num_pages,
+                 MDBM_DB_DIR_WIDTH(db), new_dirwidth);
+            errno = ENOSPC;
+            return -1;
         }
-        lockmode = db_get_lockmode(db);
-        /* fprintf(stderr, "SETTING db_flags FROM db_get_lockmode %x ON %s\n",
-             lockmode, db->db_filename); */
-        /* correct db_flags with actual locking mode */
-        db->db_flags |= lockmode;
+        new_num_pages = db->db_num_pages;
     }
-
-    if (flags & MDBM_STAT_OPERATIONS) {
-        if (mdbm_enable_stat_operations(db, MDBM_STATS_BASIC | MDBM_STATS_TIMED) != 0) {
-#if 0
-/* deprecated */
-        if (flags & MDBM_O_RDWR) {
-            db->db_flags |= MDBM_DBFLAG_STAT_OPERATIONS;
-        } else {  /* Must have write access: keeping stats on fetches still writes to MDBM */
-             mdbm_log(LOG_ERR,
-                 "%s: STAT_OPERATIONS (even of fetches only) require Read/Write access", filename);
-#endif
-            goto open_error;
-        }
+    if (new_dirshift == old_dirshift) {
+        return 0;
     }
 
-    if ((flags & MDBM_PROTECT) ||
-        (protect_file_exists(pathname)) ||
-        (protect_regex_match(pathname, "MDBM_PROTECT_PATH_REGEX"))) {
-        mdbm_log(LOG_WARNING,
-                 "%s: protect feature enabled -- performance might be degraded", filename);
-        db->db_flags |= MDBM_DBFLAG_PROTECT;
-    }
+    old_dirpages = MDBM_DB_NUM_DIR_PAGES(db);
+    old_dirsize = MDBM_DB_DIR_SIZE(db);
+    old_ptsize = MDBM_DB_PTABLE_SIZE(db);
 
-    if (flags & MDBM_OPEN_WINDOWED) {
-        db->db_flags |= MDBM_DBFLAG_WINDOWED;
-    }
-#ifdef DEBUG
-    mdbm_log(LOG_DEBUG, "%s: mdbm_open, magic number=0x%x", filename, magic);
-#endif
+    new_dirpages = MDBM_NUM_DIR_PAGES(db->db_pagesize,new_dirshift,db->db_hdr->h_dbflags);
+    new_dirsize = MDBM_DIR_SIZE(new_dirshift);
+    new_ptsize = MDBM_PTABLE_SIZE(new_dirshift);
 
-    /* If there is a create flag, and the file is empty, treat it like a
-     * truncation.  The truncation will initialize the header (magic number,
-     * etc.) */
-    if (flags & MDBM_O_CREAT) {
-        if (lseek(db->db_fd,0,SEEK_END) == 0) {
-            flags |= MDBM_O_TRUNC;
+    protect_dir(db,0);
+
+    if (new_dirpages > old_dirpages) {
+        if (grow_chunk(db,0,new_dirpages) < 0) {
+            protect_dir(db,1);
+            return -1;
         }
     }
-    if (flags & MDBM_O_ASYNC) {
-        db->db_flags |= MDBM_DBFLAG_ASYNC;
-    }
-    if (flags & MDBM_O_FSYNC) {
-        db->db_flags |= MDBM_DBFLAG_FSYNC;
+
+    if (MDBM_HAS_FILTER(db)) {
+        /* Lookup filters follow the page table, so move them out of its way first. */
+        char* old_filter = db->db_base + MDBM_FILTER_OFFSET(old_dirshift);
+        char* new_filter = db->db_base + MDBM_FILTER_OFFSET(new_dirshift);
+        int old_fsize = MDBM_FILTER_SIZE(old_dirshift);
+        memmove(new_filter,old_filter,old_fsize);
+        memset(new_filter+old_fsize,0,MDBM_FILTER_SIZE(new_dirshift) - old_fsize);
     }
-    if (flags & MDBM_O_TRUNC) {
-        int npages;
 
-        if (!pagesize) {
-            pagesize = MDBM_PAGESIZ; /* go with default size */
-        } else if (pagesize < MDBM_MINPAGE) {
-            pagesize = MDBM_MINPAGE;
-        } else if (pagesize > MDBM_MAXPAGE) {
-            pagesize = MDBM_MAXPAGE;
-        } else {
-            pagesize = (pagesize + (MDBM_PAGE_ALIGN-1)) & ~(MDBM_PAGE_ALIGN-1);
-        }
+    if (new_dirsize > old_dirsize) {
+        /* Initialize new directory and page table */
+        new_ptable = MDBM_PTABLE_PTR(MDBM_DIR_PTR(db),new_dirshift);
+        mdbm_log(LOG_DEBUG,
+                 "move page table,"
+                 " db_dir=%p, old_dirsize=%d, new_dirsize=%d,"
+                 " old_ptable=%p, old_ptsize=%d,"
+                 " new_ptable=%p, new_ptsize=%d,"
+                 " directory size increase=%d\n",
+                 (void*)db->db_dir,
+                 old_dirsize,
+                 new_dirsize,
+                 (void*)db->db_ptable,
+                 old_ptsize,
+                 (void*)new_ptable,
+                 new_ptsize,
+                 new_dirsize - old_dirsize);
 
-        if (dbsize) {
-            size_t ldbsize = (unsigned int)dbsize;
-            if (flags & (MDBM_DBSIZE_MB|MDBM_DBSIZE_MB_OLD)) {
-                ldbsize *= (1024*1024);
-            }
-            npages = (ldbsize + pagesize - 1) / pagesize;
-        } else {
-            npages = 1;
-        }
-        if (truncate_db(db,npages,pagesize,flags) < 0) {
-            ERROR();
-            goto open_error;
-        }
-        if (flags & MDBM_LARGE_OBJECTS) {
-            db->db_hdr->h_dbflags |= MDBM_HFLAG_LARGEOBJ;
-            db->db_spillsize = db->db_hdr->h_spill_size = pagesize/2 + pagesize/4;
-        }
-    } else {
-        if (mdbm_internal_remap(db,0,flags) < 0) {
-            ERROR();
-            goto open_error;
-        }
-        if (do_check) {
-            if ((db->db_flags & MDBM_DBFLAG_HDRONLY) || MDBM_IS_WINDOWED(db)) {
-                mdbm_log(LOG_NOTICE,
-                         "%s: previous lock owner died; use mdbm_check to test db integrity",
-                         db->db_filename);
-            } else if (mdbm_check(db,3,1) > 0) {
-                mdbm_log(LOG_ERR,"%s: mdbm_open db integrity check failure",filename);
-                ERROR();
-                errno = EFAULT;
-                goto open_error;
-            }
-        }
-    }
-    if (!MDBM_NOLOCK(db)) {
-        mdbm_internal_do_unlock(db,NULL);
+        memmove(new_ptable,db->db_ptable,old_ptsize);
+        db->db_ptable = new_ptable;
+        /* Clear the added portion at the end of the new page directory. */
+        memset(MDBM_DIR_PTR(db)+old_dirsize,0,new_dirsize - old_dirsize);
+        /* NOTE: this gets set again below, but sync_dir allocates memory based on it. */
+        db->db_hdr->h_dir_shift = (uint8_t)new_dirshift;
+        journal_structural(db);
+        sync_dir(db,NULL);
     }
+    /* Clear the added portion at the end of the new page table. */
+    mdbm_log(LOG_DEBUG,
+             "Clear new page table, db_ptable=%p, db_ptable+old_ptsize=%p, size=%d",
+             (void*)db->db_ptable, (void*)(db->db_ptable+old_ptsize), new_ptsize - old_ptsize);
+    memset((char*)db->db_ptable+old_ptsize,0,new_ptsize - old_ptsize);
 
-    if ((flags & MDBM_OPEN_WINDOWED)){
-        if (0 != (db->db_pagesize % db_sys_pagesize)) {
-            mdbm_logerror(LOG_ERR,0,"%s: Page size %d must be a multiple of system page size %d", 
-                filename, pagesize, db_sys_pagesize);
-            ERROR();
-            errno = EINVAL;
-            goto open_error;
-        }
-    }
+    db->db_dir_shift = db->db_hdr->h_dir_shift = (uint8_t)new_dirshift;
+    db->db_max_dirbit = MDBM_HASH_MASK(db->db_dir_shift);
 
-#ifdef MDBM_SANITY_CHECKS
-    if (getenv("MDBM_SANITY_CHECK")) {
-        mdbm_sanity_check = 1;
-    }
-#endif
+    protect_dir(db,1);
 
-    if (check_guard_padding(db, 1) != 0) {
-        goto open_error;
-    }
+    return 0;
+}
 
-    return db;
+static mdbm_page_t*
+split_page(MDBM* db, mdbm_hashval_t hashval)
+{
+    int dirbit;
+    int hashbit;
+    mdbm_pagenum_t pagenum, newpagenum;
+    mdbm_page_t* page;
+    mdbm_page_t* newpage;
+    mdbm_entry_data_t e;
+    mdbm_entry_t* ep;
+    mdbm_hashval_t hvbit;
+    int new_index;
+    int new_offset;
+    int num;
 
-  open_error:
-    err = errno;
-    if (db) {
-        mdbm_internal_close_locks(db);
-        if (db->db_base) {
-            if (munmap(db->db_base,db->db_base_len) < 0) {
-                mdbm_logerror(LOG_ERR,0,"munmap(%p,%llu)",
-                              (void*)db->db_base,(unsigned long long)db->db_base_len);
-            }
-            /*fprintf(stderr, "open_error::munmap(%p,%u)\n", db->db_base,(unsigned)db->db_base_len); */
-        }
-        if (db->db_dir) {
-            free(db->db_dir);
-        }
-        if (db->db_window.buckets) {
-            free(db->db_window.buckets);
-        }
-        if (db->db_window.wpages) {
-            free(db->db_window.wpages);
-        }
-        if (db->db_fd != -1) {
-            close(db->db_fd);
-        }
-        mdbm_free_handle(db);
-    } else {
-        if (fd != -1) {
-            close(fd);
-        }
-    }
-    errno = err;
-    return NULL;
-}
+    hashbit = dir_walk(db,hashval,&dirbit);
 
+    pagenum = (hashval & MDBM_HASH_MASK(hashbit));
+    newpagenum = pagenum | (1<<hashbit);
 
-MDBM*
-mdbm_open(const char *filename, int flags, int mode, int pagesize, int dbsize)
-{
+    if (newpagenum > db->db_max_dirbit
+        && db->db_max_dir_shift
+        && db->db_dir_shift >= db->db_max_dir_shift) {
+        /* can't split beyond capped size */
 #ifdef DEBUG
-    {
-        /* DEBUG: manually enable debugging for testing.
-         * Specify a numeric log level:
-         *
-         * 0: emerg   1: alert  2: crit   3: err     4: warn
-         * 5: notice  6: info   7: debug  8: debug2  9: debug3
-         */
-        char *mdbm_level = getenv("MDBM_LOG_LEVEL");
-        if ((mdbm_level != NULL)) {
-            int level = atoi(mdbm_level);
-            if ((level >= LOG_EMERG) && (level <= LOG_DEBUG)) {
-              mdbm_log_minlevel(level);
-            } else {
-                mdbm_log(LOG_ERR, "%s: mdbm log level must in numeric and in range %d,%d, level=%s",
-                         filename, LOG_EMERG, LOG_DEBUG, mdbm_level);
-            }
-        }
-    }
+        mdbm_log(LOG_DEBUG, "Cannot split page, pagenum=%u, newnum=%u, dir_shift=%u",
+                 pagenum, newpagenum, db->db_dir_shift);
 #endif
-
-    /* Add code to handle opening RDONLY|CREAT by allowing us to create an empty V3 */
-    /* MDBM (which requires read+write access) then closing it and reopening it RDONLY */
-    /* Created mdbm_open_internal out of the old mdbm_open() to avoid recursive calls. */
-    if ((flags & MDBM_CREATE_V3) && (flags & MDBM_O_CREAT) && !(flags & MDBM_O_RDWR) && (filename != NULL)) {
-        int errno_save = errno;
-        struct stat stat_info;
-        if ((stat(filename, &stat_info) == 0) && (stat_info.st_size != 0) ) {
-            return mdbm_open_inner(filename, flags, mode, pagesize, dbsize, 1);
-        } else {
-            MDBM *db =  NULL;
-            int cflags = flags | MDBM_O_RDWR | MDBM_O_TRUNC;
-            errno = 0;
-            db =  mdbm_open_inner(filename, cflags, mode, pagesize, dbsize, 1);
-            if (db != NULL) {
-                mdbm_close(db);
-                errno = errno_save;
-            } else {
-                mdbm_logerror(LOG_ERR,0,"%s: cannot truncate and reopen",filename);
-                errno = errno_save;
-                return NULL;
-            }
-        }
+        errno = ENOMEM;
+        return NULL;
     }
 
-    return mdbm_open_inner(filename, flags, mode, pagesize, dbsize, 1);
-}
-
+    if (!db_is_owned(db)) {
+        errno = EPERM;
+        return NULL;
+    }
 
-void
-mdbm_close(MDBM *db)
-{
-    int zrefs;
+    mdbm_log(LOG_DEBUG, "split page, pagenum=%d, newpagenum=%d\n", pagenum, newpagenum);
 
-    if (!db) {
-        return;
+    if (newpagenum > db->db_max_dirbit) {
+        mdbm_log(LOG_DEBUG,
+                 "resizing page directory for page split,"
+                 " db_dir_shift=%d, db_dir_shift+1=%d, db_max_dir_shift=%d,"
+                 " pagenum=%d, newpagenum=%d\n",
+                 db->db_dir_shift, db->db_dir_shift + 1, db->db_max_dir_shift,
+                 pagenum, newpagenum);
+        if ((db->db_max_dir_shift && db->db_dir_shift >= db->db_max_dir_shift)
+            || resize(db,db->db_dir_shift+1,0) < 0) {
+            db->db_max_dir_shift = db->db_dir_shift;
+            return NULL;
+        }
     }
 
-    zrefs = !db->db_dup_info || (dec_dup_ref(db) == 0);
-    if (zrefs && db->db_rstats) {
-        mdbm_close_rstats(db->db_rstats_mem);
-        db->db_rstats = NULL;
-        db->db_rstats_mem = NULL;
+    newpage = pagenum_to_page(db,newpagenum,MDBM_PAGE_ALLOC,MDBM_PAGE_MAP);
+    if (!newpage) {
+        return NULL;
     }
 
-#ifdef MDBM_BSOPS
-    if (db->db_bsops) {
-        db->db_bsops->bs_term(db->db_bsops_data,0);
-        db->db_bsops_data = NULL;
-        db->db_bsops = NULL;
+    page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
+    if (page->p_num_pages > 1) {
+        return NULL;
     }
-#endif
 
-    mdbm_set_window_size_internal(db,0);
+    hvbit = (1<<hashbit);
+    new_index = newpage->p.p_num_entries;
+    new_offset = MDBM_DATA_PAGE_BOTTOM_OF_DATA(newpage);
+    num = 0;
+    for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
+        if (ep->e_key.match) {
+            mdbm_hashval_t h = entry_hashval(db,page,ep);
+            if (h & hvbit) {
+                mdbm_entry_t* new_ep = MDBM_ENTRY(newpage,new_index);
+                int ksize = MDBM_KEY_ALIGN_LEN(db,ep[0].e_key.key.len);
+                int vsize = (ep[0].e_offset -
+                             ep[1].e_offset -
+                             MDBM_KEY_ALIGN_LEN(db,ep[1].e_key.key.len));
+                int kvsize = ksize + vsize;
 
-    if (zrefs && db->db_base) {
-        if (!MDBM_IS_RDONLY(db)) {
-            if (db->db_flags & MDBM_DBFLAG_FSYNC) {
-                msync(db->db_base,MDBM_DB_MAP_SIZE(db),MS_ASYNC);
+                new_ep->e_offset = new_offset - ksize;
+                new_ep->e_key.match = ep->e_key.match;
+                new_ep->e_flags = ep->e_flags;
+                memcpy(MDBM_VAL_PTR2(newpage,new_offset,kvsize),
+                       MDBM_VAL_PTR2(page,ep->e_offset,vsize),
+                       kvsize);
+                new_offset -= kvsize;
+                if (MDBM_ENTRY_LARGEOBJ(ep)) {
+                    mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
+                    mdbm_page_t* lob = MDBM_PAGE_PTR(db,lp->l_pagenum);
+                    lob->p_num = newpagenum;
+                    dirty_mark(db,lp->l_pagenum,1);
+                }
+                ep->e_flags &= ~MDBM_EFLAG_LARGEOBJ;
+                del_entry(db,page,ep);
+                ++new_index;
             }
         }
-        if (munmap(db->db_base,db->db_base_len) < 0) {
-            mdbm_logerror(LOG_ERR,0,"munmap(%p,%llu)",
-                          (void*)db->db_base,(unsigned long long)db->db_base_len);
-        }
-        /*fprintf(stderr, "close::munmap(%p,%u)\n", db->db_base,(unsigned)db->db_base_len); */
-        db->db_base = NULL;
-        db->db_hdr = NULL;
-    }
-    mdbm_internal_close_locks(db);
-    if (zrefs && db->db_fd >= 0) {
-        close(db->db_fd);
-        db->db_fd = -1;
-    }
-    if (zrefs && db->db_dup_info) {
-        free(db->db_dup_info);
-        db->db_dup_info = NULL;
-    }
-    if (db->db_dir) {
-        free(db->db_dir);
-        db->db_dir = NULL;
+        num++;
     }
-    check_guard_padding(db, 1);
-    mdbm_free_handle(db);
-}
-
-int
-mdbm_set_cachemode(MDBM* db, int cachemode)
-{
-    int err = 0;
-
-    if (db->db_ver_flag != MDBM_DBVER_3) {
-        errno = ENOSYS;
-        return -1;
+    newpage->p.p_num_entries = new_index;
+    mdbm_log(LOG_DEBUG,
+             "split page=%d, newpage=%d, moved(new_index)=%d of num=%d\n",
+             pagenum, newpagenum, new_index, num);
+    MDBM_INIT_TOP_ENTRY(MDBM_ENTRY(newpage,new_index),new_offset);
+    if (MDBM_HAS_FILTER(db)) {
+        filter_rebuild(db,page);
+        filter_rebuild(db,newpage);
     }
-    if ((cachemode & ~MDBM_CACHEMODE_BITS)
-        || (MDBM_CACHEMODE(cachemode) > MDBM_CACHEMODE_MAX))
-    {
-        errno = EINVAL;
-        return -1;
+    if (MDBM_HAS_PAGE_INDEX(db)) {
+        page_index_rebuild(db,newpage);
     }
+    dirty_mark_page(db,page);
+    dirty_mark_page(db,newpage);
 
-    if (lock_db(db) < 0) {
-        return -1;
-    }
-    if (!check_empty(db)) {
-        err = EINVAL;
-    } else {
-        db->db_cache_mode = db->db_hdr->h_cache_mode = cachemode;
-    }
-    unlock_db(db);
+    MDBM_SET_DIR_BIT(db,dirbit);
+    db->db_hdr->h_dbflags &= ~MDBM_HFLAG_PERFECT;
+    db->db_hdr->h_dir_gen++;
+    journal_structural(db);
+    sync_dir(db,NULL);
 
-    if (err) {
-        errno = err;
-        return -1;
-    }
-    return 0;
+    return (hashval & hvbit) ? newpage : page;
 }
 
-int
-mdbm_get_cachemode(MDBM* db)
+static int
+shake_page(MDBM* db, mdbm_page_t* page,
+            const datum* key, const datum* val,
+            int free_bytes, int needed_bytes)
 {
-    if (db->db_ver_flag != MDBM_DBVER_3) {
-        errno = ENOSYS;
-        return -1;
-    }
-    return db->db_cache_mode;
-}
+    /* requires page lock */
 
-const char*
-mdbm_get_cachemode_name(int cachemode)
-{
-    static char* s_cache_modes[] =
-        { "none",
-          "LFU",
-          "LRU",
-          "GDSF",
-          "unknown"
-        };
+    int recycle_bytes = 0;
+    int ver = MDBM_DBFLAG_SHAKE_VER(db);
 
-    static char* s_cache_clean_modes[] =
-        { "CLEAN+none",
-          "CLEAN+LFU",
-          "CLEAN+LRU",
-          "CLEAN+GDSF",
-          "unknown"
-        };
+    if (ver == MDBM_DBFLAG_SHAKE_V3) {
+        struct mdbm_shake_data_v3 od;
+        int i, num;
+        mdbm_entry_data_t e;
+        mdbm_entry_t* ep;
+        kvpair null_kv;
 
-    int clean = cachemode & MDBM_CACHEMODE_EVICT_CLEAN_FIRST;
-    cachemode = MDBM_CACHEMODE(cachemode);
-    assert(sizeof(s_cache_modes) / sizeof(s_cache_modes[0]) > MDBM_CACHEMODE_MAX);
-    if (cachemode > MDBM_CACHEMODE_MAX) {
-      return s_cache_modes[MDBM_CACHEMODE_MAX + 1];
-    }
-    return (clean) ? s_cache_clean_modes[cachemode] : s_cache_modes[cachemode];
+        od.page_num = page->p_num;
+        od.page_begin = MDBM_DATA_PAGE_BASE(page);
+        od.page_end = od.page_begin + db->db_pagesize;
+        od.page_free_space = free_bytes;
+        od.space_needed = needed_bytes;
+        num = page->p.p_num_entries;
+        od.page_num_items = num;
+        od.page_items = (kvpair*)malloc(num * sizeof(od.page_items[0]));
+        od.page_item_sizes = (uint32_t*)malloc(num * sizeof(od.page_item_sizes[0]));
+        od.user_data = db->db_shake_data;
 
-}
+        memset(&null_kv,0,sizeof(null_kv));
+        for (ep = first_entry(page,&e), i = 0; ep; ep = next_entry(&e), i++) {
+            if (ep->e_key.match) {
+                get_kv(db,&e,&od.page_items[i].key,&od.page_items[i].val);
+                od.page_item_sizes[i] = MDBM_ENTRY_SIZE(db,ep);
+            } else {
+                od.page_items[i] = null_kv;
+                od.page_item_sizes[i] = 0;
+            }
+        }
 
-int
-mdbm_get_stat_counter(MDBM *db, mdbm_stat_type type, mdbm_counter_t *value)
-{
-    int rc = 0;
+        if (((mdbm_shake_func_v3)db->db_shake_func)(db,key,val,&od)) {
+            for (i = 0; i < num; i++) {
+                if (od.page_item_sizes[i] && od.page_items[i].key.dsize == 0) {
+                    del_entry(db,page,MDBM_ENTRY(page,i));
+                    recycle_bytes += od.page_item_sizes[i];
+                }
+            }
+        }
 
-#ifdef MDBM_V2_COMPAT
-    if ((db == NULL) || (db->db_ver_flag != MDBM_DBVER_3)) {
-        return -1;
+        free(od.page_items);
+        free(od.page_item_sizes);
     }
-#endif
-
-    switch ((int)type) {
-    case MDBM_STAT_TYPE_FETCH:
-        *value =  mdbm_hdr_stats(db)->s_fetches;
-        break;
-
-    case MDBM_STAT_TYPE_STORE:
-        *value =  mdbm_hdr_stats(db)->s_stores;
-        break;
-
-    case MDBM_STAT_TYPE_DELETE:
-        *value =  mdbm_hdr_stats(db)->s_deletes;
-        break;
-
-    default:
-        rc = -1;
+    if (needed_bytes <= free_bytes + recycle_bytes) {
+        return 0;
     }
 
-    return rc;
+    errno = ENOMEM;
+    return -1;
 }
 
-int
-mdbm_get_stat_time(MDBM *db, mdbm_stat_type type, time_t *value)
+static int
+cache_evict(MDBM* db, mdbm_page_t* page,
+            const datum* key, const datum* val,
+            int free_bytes, int needed_bytes, int want_large)
 {
-    int rc = 0;
-
-#ifdef MDBM_V2_COMPAT
-    if ((db == NULL) || (db->db_ver_flag != MDBM_DBVER_3)) {
-        return -1;
-    }
-#endif
-
-    switch ((int)type) {
-    case MDBM_STAT_TYPE_FETCH:
-        *value =  (time_t) mdbm_hdr_stats(db)->s_last_fetch;
-        break;
-
-    case MDBM_STAT_TYPE_STORE:
-        *value =  (time_t) mdbm_hdr_stats(db)->s_last_store;
-        break;
-
-    case MDBM_STAT_TYPE_DELETE:
-        *value =  (time_t) mdbm_hdr_stats(db)->s_last_delete;
-        break;
+    int clean = (db->db_cache_mode & MDBM_CACHEMODE_EVICT_CLEAN_FIRST) != 0;
+    int quit = 0;
+    uint64_t t0 = 0;
+    uint64_t nerror = 0;
 
-    default:
-        rc = -1;
+    if (db->db_flags & MDBM_DBFLAG_NO_DIRTY) {
+        clean = 0;
     }
 
-    return rc;
-}
-
-inline static void
-fetch_increment(MDBM *db)
-{
-    if (MDBM_GET_STAT_OPERATIONS_OPS(db)) {
-        MDBM_INC_STAT_64(&mdbm_hdr_stats(db)->s_fetches);
-    }
-    if (MDBM_GET_STAT_OPERATIONS_TIMES(db)) {
-        mdbm_hdr_stats(db)->s_last_fetch = get_time_sec();
+    if (MDBM_DO_STAT_TIME(db)) {
+        t0 = db->db_get_usec();
     }
-}
 
-inline static void
-store_increment(MDBM *db)
-{
-    if (MDBM_GET_STAT_OPERATIONS_OPS(db)) {
-        MDBM_INC_STAT_64(&mdbm_hdr_stats(db)->s_stores);
-    }
-    if (MDBM_GET_STAT_OPERATIONS_TIMES(db)) {
-        mdbm_hdr_stats(db)->s_last_store = get_time_sec();
+    {   /* Reset markers for entries that failed db_clean_func. */
+        mdbm_entry_t* ep;
+        mdbm_entry_data_t e;
+        for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
+            ep->e_flags &= ~MDBM_EFLAG_SYNC_ERROR;
+        }
     }
-}
+    while (free_bytes < needed_bytes) {
+        mdbm_entry_t* ep;
+        mdbm_entry_data_t e;
+        mdbm_entry_t* evict = NULL;
+        uint32_t evict_num_accesses = 0;
+        uint32_t evict_access_time = 0;
+        uint32_t evict_bytes = 0;
+        float evict_priority = 0;
 
-inline static void
-delete_increment(MDBM *db)
-{
-    if (MDBM_GET_STAT_OPERATIONS_OPS(db)) {
-        MDBM_INC_STAT_64(&mdbm_hdr_stats(db)->s_deletes);
-    }
-    if (MDBM_GET_STAT_OPERATIONS_TIMES(db)) {
-        mdbm_hdr_stats(db)->s_last_delete = get_time_sec();
-    }
-}
-
-void
-mdbm_reset_stat_operations(MDBM *db)
-{
-#ifdef MDBM_V2_COMPAT
-    if ((db == NULL) || (db->db_ver_flag != MDBM_DBVER_3)) {
-        return;
-    }
-#endif
+        switch (MDBM_DB_CACHEMODE(db)) {
+        case MDBM_CACHEMODE_LFU:
+            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
+                if (clean && (ep->e_flags & MDBM_EFLAG_SYNC_ERROR)) {
+                    continue; /* skip entries that failed db_clean_func */
+                }
+                if (ep->e_key.match
+                    && (!clean || !MDBM_ENTRY_DIRTY(ep))
+                    && (!want_large || MDBM_ENTRY_LARGEOBJ(ep)))
+                {
+                    mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)MDBM_VAL_PTR(db,&e);
+                    if (!evict
+                        || (c->c_num_accesses < evict_num_accesses)
+                        || (c->c_num_accesses == evict_num_accesses
+                            && c->c_dat.access_time < evict_access_time))
+                    {
+                        evict = ep;
+                        evict_num_accesses = c->c_num_accesses;
+                        evict_access_time = c->c_dat.access_time;
+                        if (want_large) {
+                            uint32_t vallen;
+                            MDBM_ENTRY_LOB_ALLOC_LEN(db,&e,&vallen,&evict_bytes);
+                        } else {
+                            evict_bytes = MDBM_VAL_LEN(db,&e);
+                        }
+                    }
+                }
+            }
+            break;
 
-    mdbm_hdr_stats(db)->s_fetches = 0ULL;
-    mdbm_hdr_stats(db)->s_stores  = 0ULL;
-    mdbm_hdr_stats(db)->s_deletes = 0ULL;
+        case MDBM_CACHEMODE_LRU:
+            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
+                if (clean && (ep->e_flags & MDBM_EFLAG_SYNC_ERROR)) {
+                    continue; /* skip entries that failed db_clean_func */
+                }
+                if (ep->e_key.match
+                    && (!clean || !MDBM_ENTRY_DIRTY(ep))
+                    && (!want_large || MDBM_ENTRY_LARGEOBJ(ep)))
+                {
+                    mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)MDBM_VAL_PTR(db,&e);
+                    if (!evict
+                        || (c->c_dat.access_time < evict_access_time)
+                        || (c->c_dat.access_time == evict_access_time
+                            && c->c_num_accesses < evict_num_accesses))
+                    {
+                        evict = ep;
+                        evict_num_accesses = c->c_num_accesses;
+                        evict_access_time = c->c_dat.access_time;
+                        if (want_large) {
+                            uint32_t vallen;
+                            MDBM_ENTRY_LOB_ALLOC_LEN(db,&e,&vallen,&evict_bytes);
+                        } else {
+                            evict_bytes = MDBM_VAL_LEN(db,&e);
+                        }
+                    }
+                }
+            }
+            break;
 
-    mdbm_hdr_stats(db)->s_last_fetch  = 0ULL;
-    mdbm_hdr_stats(db)->s_last_store  = 0ULL;
-    mdbm_hdr_stats(db)->s_last_delete = 0ULL;
-}
+        case MDBM_CACHEMODE_GDSF:
+            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
+                if (clean && (ep->e_flags & MDBM_EFLAG_SYNC_ERROR)) {
+                    continue; /* skip entries that failed db_clean_func */
+                }
+                if (ep->e_key.match
+                    && (!clean || !MDBM_ENTRY_DIRTY(ep))
+                    && (!want_large || MDBM_ENTRY_LARGEOBJ(ep)))
+                {
+                    mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)MDBM_VAL_PTR(db,&e);
+                    float priority = c->c_dat.priority;
+                    uint32_t vallen, lob_alloclen;
+                    if (want_large) {
+                        MDBM_ENTRY_LOB_ALLOC_LEN(db,&e,&vallen,&lob_alloclen);
+                        priority = c->c_num_accesses*(lob_alloclen - vallen) - priority;
+                    }
+                    if (!evict || priority < evict_priority) {
+                        evict = ep;
+                        evict_num_accesses = c->c_num_accesses;
+                        evict_priority = priority;
+                        if (want_large) {
+                            evict_bytes = lob_alloclen;
+                        } else {
+                            evict_bytes = MDBM_VAL_LEN(db,&e);
+                        }
+                    }
+                }
+            }
+            break;
+        }
 
-datum
-mdbm_fetch(MDBM *db, datum key)
-{
-    datum val;
+        if (!evict) {
+            /* clean_func didn't free enough, retry with normal cache preferences */
+            if (clean) {
+                clean = 0;
+                continue;
+            }
+            return free_bytes;
+        }
 
-    fetch_increment(db);
-    if (access_entry(db,&key,&val,NULL,NULL,NULL) < 0) {
-        val.dptr = NULL;
-        val.dsize = 0;
+        if (clean && db->db_clean_func && MDBM_ENTRY_DIRTY(evict)) {
+            datum k, v;
+            get_kv2(db,page,evict,&k,&v);
+            if (!db->db_clean_func(db,&k,&v,db->db_clean_data,&quit)) {
+                evict->e_flags |= MDBM_EFLAG_SYNC_ERROR;
+                nerror++;
+                if (quit) {
+                    return free_bytes;
+                }
+                continue;
+            }
+        }
+        if (MDBM_DB_CACHEMODE(db) == MDBM_CACHEMODE_GDSF) {
+            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
+                if (ep->e_key.match) {
+                    mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)MDBM_VAL_PTR(db,&e);
+                    c->c_dat.priority -= evict_priority;
+                }
+            }
+        }
+        free_bytes += evict_bytes;
+        del_entry(db,page,evict);
     }
-    return val;
-}
 
-int
-mdbm_fetch_r(MDBM *db, datum *key, datum *val, MDBM_ITER *iter)
-{
-    fetch_increment(db);
-    return access_entry(db,key,val,NULL,NULL,iter);
+    if (MDBM_DO_STAT_TIME(db)) {
+      mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->cache_evict : NULL;
+      MDBM_ADD_STAT(db,rstats_val,(db->db_get_usec() - t0), MDBM_STAT_TAG_CACHE_EVICT);
+      MDBM_ADD_STAT_ERROR_COUNTER(db, rstats_val, nerror, MDBM_STAT_TAG_CACHE_EVICT);
+    } else if (MDBM_DO_STATS(db)) {
+      MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_CACHE_EVICT);
+      MDBM_ADD_STAT_ERROR_COUNTER(db, NULL, nerror, MDBM_STAT_TAG_STORE);
+    }
+    return free_bytes;
 }
 
-int
-mdbm_fetch_buf(MDBM *db, datum *key, datum *val, datum *buf, int flags)
+static int
+expand_page(MDBM* db, mdbm_page_t* page, int pagenum)
 {
-    fetch_increment(db);
-    return access_entry(db,key,val,buf,NULL,NULL);
-}
-
-static kvpair
-next_r(MDBM *db, MDBM_ITER *iter, int one_page);
+    /* requires page lock; acquires internal lock */
 
-int
-mdbm_fetch_dup_r(MDBM *db, datum *key, datum *val, MDBM_ITER *iter)
-{
-    mdbm_pagenum_t pagenum;
-    kvpair kv;
+    mdbm_page_t* newpage;
+    int newpagenum;
+    int oldpagenum;
+    int tod;
+    mdbm_entry_t* ep;
+    int i;
+    int prev_numpages;
 
-    pagenum = iter->m_pageno;
-    if (iter->m_pageno == 0 && iter->m_next == -1) {
-        /* Called with an uninitialized iterator.
-         * Just lookup first entry.
-         */
-        return mdbm_fetch_r(db,key,val,iter);
+    if (mdbm_internal_lock(db) < 0) {
+        return -1;
     }
 
-    fetch_increment(db);
+    if ((newpage = alloc_chunk(db,MDBM_PTYPE_DATA,page->p_num_pages+1,0,0,MDBM_PAGE_MAP,
+                               MDBM_ALLOC_CAN_UNLOCK)) == NULL)
+    {
+#ifdef DEBUG
+        mdbm_log(LOG_DEBUG, "expand_page failed in alloc_chunk, pagenum=%d", pagenum);
+#endif
+        /* alloc_chunk releases internal lock if allocation fails */
+#ifdef DEBUG
+        mdbm_log(LOG_DEBUG, "expand_page failed in alloc_chunk, pagenum=%d", pagenum);
+#endif
+        errno = ENOMEM;
+        return -1;
+    }
 
-    /* Look for next occurrence of this key in the same page.  Continue
-     * looking for this key until I run out of keys on this page; or
-     * until I find it.
-     */
+    newpagenum = newpage->p_num;
+    prev_numpages = newpage->p_prev_num_pages;
 
-    do {
-        kv = next_r(db,iter,1);
-    } while (kv.val.dptr                        /* Still data in the db */
-             && iter->m_pageno == pagenum       /* Still on same page */
-             && (kv.key.dsize != key->dsize     /* Key not same length -OR- */
-                 || kv.key.dptr[0] != key->dptr[0] /* Key not same value - look again */
-                 || memcmp(kv.key.dptr,key->dptr,key->dsize)));
+    page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
+    tod = MDBM_DATA_PAGE_BOTTOM_OF_DATA(page);
 
-    /* ASSERT: kv.val.dptr is NULL [end of db];
-     *         pageno is different [moved to next page];
-     *         or we found the appropriate key.
-     */
-    if (kv.val.dptr && (iter->m_pageno == pagenum)) {
-        /* found something. */
-        *val = kv.val;
-        return 0;
+    memcpy(newpage,page,MDBM_PAGE_T_SIZE + (page->p.p_num_entries+1)*MDBM_ENTRY_T_SIZE);
+    memcpy((char*)newpage + tod + db->db_pagesize,
+           (char*)page + tod,
+           page->p_num_pages*db->db_pagesize - tod);
+    ep = MDBM_ENTRY(newpage,0);
+    for (i = 0; i <= newpage->p.p_num_entries; i++, ep++) {
+        ep->e_offset += db->db_pagesize;
     }
 
-    val->dptr = NULL;
-    val->dsize = 0;
-    errno = ENOENT;
-    return -1;
+    newpage->p_num = pagenum;
+    newpage->p_num_pages++;
+    newpage->p_prev_num_pages = prev_numpages;
+
+    oldpagenum = MDBM_GET_PAGE_INDEX(db,pagenum);
+    MDBM_SET_PAGE_INDEX(db, pagenum, newpagenum);
+    dirty_mark(db,newpagenum,newpage->p_num_pages);
+    free_chunk(db,oldpagenum,NULL);
+
+    mdbm_internal_unlock(db);
+    return 0;
 }
 
 int
-mdbm_fetch_info(MDBM *db, datum *key, datum *val, datum *buf,
-                struct mdbm_fetch_info* info,
-                MDBM_ITER* iter)
+mdbm_internal_replace(MDBM* db)
 {
-    if (db->db_ver_flag != MDBM_DBVER_3) {
-        errno = ENOSYS;
-        return -1;
-    }
+    if (MDBM_IS_REPLACED(db)) {
+        struct stat st1;
+        struct stat st2;
+        int newfd, oldfd;
+        int wsize;
 
-    fetch_increment(db);
-    return access_entry(db,key,val,buf,info,iter);
-}
+        if (fstat(db->db_fd,&st1) < 0) {
+            mdbm_logerror(LOG_ERR,0,"mdbm replace: fstat(fd=%d)",db->db_fd);
+            return 0;
+        }
+        if (stat(db->db_filename,&st2) < 0) {
+            mdbm_logerror(LOG_ERR,0,"mdbm replace: stat(%s)",db->db_filename);
+            return 0;
+        }
+        if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
+            db->db_hdr->h_dbflags &= ~MDBM_HFLAG_REPLACED;
+            mdbm_log(LOG_NOTICE,
+                     "mdbm replace: Reset stale replace flag: %s",
+                     db->db_filename);
+            return 1;
+        }
 
-char*
-mdbm_fetch_str(MDBM *db, const char *key)
-{
-    datum k;
+        newfd = open(db->db_filename,MDBM_IS_RDONLY(db) ? MDBM_O_RDONLY : MDBM_O_RDWR,0);
+        if (newfd < 0) {
+            mdbm_logerror(LOG_ERR,0,"mdbm replace: %s",db->db_filename);
+            return -1;
+        }
 
-    k.dptr = (char *)key;
-    k.dsize = strlen(key) + 1;
-    return mdbm_fetch(db,k).dptr;
+        /* read counters entered on the old file must be left before it's unmapped */
+        mdbm_internal_read_seq_leave(db);
+        oldfd = db->db_fd;
+        db->db_fd = newfd;
+
+        if (mdbm_internal_remap(db,0,0) < 0) {
+            mdbm_logerror(LOG_ERR,0,"mdbm replace unable to map %s",db->db_filename);
+            return -1;
+        }
+        mdbm_internal_read_seq_sync(db);
+        free_index_release(db);
+        dirty_mark_all(db);
+
+        wsize = db->db_window.num_pages * db->db_pagesize;
+        mdbm_set_window_size_internal(db,wsize);
+
+        close(oldfd);
+    }
+    return 0;
 }
 
-int
-mdbm_delete(MDBM *db, datum key)
+
+struct mdbm_walk {
+    MDBM* db;
+    int dirbit;
+    int level;
+    int min_level;
+    int max_level;
+    int num_nodes;
+};
+
+
+void
+walk_dir(struct mdbm_walk* w)
 {
-    delete_increment(db);
-    return access_entry(db,&key,NULL,NULL,NULL,NULL);
+    w->dirbit <<= 1;
+    w->level++;
+    if (w->level >= w->db->db_dir_shift
+        || (!MDBM_DIR_BIT(w->db,w->dirbit+1) && !MDBM_DIR_BIT(w->db,w->dirbit+2)))
+    {
+        if (w->min_level == -1) {
+            w->min_level = w->level;
+        }
+        if (w->level > w->max_level) {
+            w->max_level = w->level;
+        }
+    } else {
+        w->dirbit++;
+        walk_dir(w);
+        w->dirbit++;
+        walk_dir(w);
+        w->dirbit -= 2;
+    }
+    w->dirbit >>= 1;
+    w->level--;
+    w->num_nodes++;
 }
 
-int
-mdbm_delete_r(MDBM *db, MDBM_ITER *iter)
+static int
+truncate_db(MDBM* db, int npages, int pagesize, int flags)
 {
+    int dir_shift, n;
+    int dir_pages, tot_pages;
+    size_t dbsize;
+    mdbm_page_t* page;
+    mdbm_hdr_t* hdr;
+    size_t mapsz;
     int ret;
-    mdbm_entry_data_t e;
-    mdbm_entry_t* ep;
-    mdbm_pagenum_t pagenum;
-    int index;
 
-    if (!iter) {
-        errno = EINVAL;
-        return -1;
+    /* the new header restarts h_free_gen */
+    free_index_release(db);
+
+    /* Compute dir bit shift. */
+    for (dir_shift = 0, n = 1; (n<<1) <= npages; dir_shift++, n <<= 1);
+    dir_pages = MDBM_NUM_DIR_PAGES(pagesize,dir_shift,0);
+
+    tot_pages = npages;
+    if (n == npages) {
+        tot_pages += dir_pages;
     }
 
-    pagenum = iter->m_pageno;
-    index = (iter->m_next+3)/-2;
+    dbsize = (size_t)tot_pages * pagesize;
+    mapsz = (size_t)dir_pages * pagesize;
 
-    if (pagenum > db->db_max_dirbit || index < 0) {
-        errno = EINVAL;
-        return -1;
+    /* memory-only: don't want to ftruncate to make the file big */
+    if (!(db->db_flags & (MDBM_DBFLAG_HUGEPAGES|MDBM_DBFLAG_MEMONLYCACHE))) {
+        if (set_file_size(db,dbsize) < 0) {
+            mdbm_logerror(LOG_ERR,0,"%s: ftruncate failure",db->db_filename);
+            ERROR();
+            return -1;
+        }
     }
 
-    if (mdbm_internal_do_lock(db,MDBM_LOCK_WRITE,MDBM_LOCK_WAIT,NULL,NULL,&pagenum) < 0) {
+    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
+        mapsz = dbsize;
+    }
+
+
+    if (map(db,NULL,0,mapsz,&db->db_base,&db->db_base_len) < 0) {
+        ERROR();
         return -1;
     }
 
-    if ((ep = set_entry(db,pagenum,index,&e)) == NULL || !ep->e_key.match) {
-        delete_increment(db);
-        errno = ENOENT;
-        ret = -1;
-    } else {
-        del_entry(db,e.e_page,ep);
-        ret = 0;
+    memset(db->db_base,0,dir_pages * pagesize);
+
+    page = (mdbm_page_t*)db->db_base;
+    page->p_num = 0;
+    page->p_type = MDBM_PTYPE_DIR;
+    page->p_flags = 0;
+    page->p_num_pages = dir_pages;
+    page->p_r0 = 0;
+    page->p_prev_num_pages = 0;
+    page->p_r1 = 0;
+    page->p.p_data = _MDBM_MAGIC_NEW2;
+
+    hdr = (mdbm_hdr_t*)(db->db_base + MDBM_PAGE_T_SIZE);
+    hdr->h_magic = _MDBM_MAGIC_NEW2;
+    hdr->h_dbflags = 0;
+    hdr->h_pagesize = pagesize;
+    hdr->h_num_pages = tot_pages;
+    hdr->h_max_pages = 0;
+    hdr->h_dir_shift = dir_shift;
+    hdr->h_last_chunk = 0;
+    hdr->h_hash_func = MDBM_DEFAULT_HASH;
+    hdr->h_first_free = 0;
+
+    if (mdbm_internal_remap(db,dbsize,flags) < 0) {
+        ERROR();
+        return -1;
     }
 
-    mdbm_internal_do_unlock(db,NULL);
 
+    ret = mdbm_pre_split(db,npages);
+    hdr = (mdbm_hdr_t*)(db->db_base + MDBM_PAGE_T_SIZE); /* db was remaped */
+    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
+        /* set max_pages since we would lose all our data if it remapped memory */
+        hdr->h_max_pages = db->db_num_pages;
+    }
     return ret;
 }
 
-int
-mdbm_delete_str(MDBM *db, const char *key)
+static void
+get_key(datum* key, char* buf, int buflen)
 {
-    MDBM_ITER iter;
-    datum k;
-
+    int nonprint = 0;
+    int bp = 0;
+    int i;
 
-    delete_increment(db);
-    k.dptr = (char *)key;
-    k.dsize = strlen(key) + 1;
-    return access_entry(db,&k,NULL,NULL,NULL,&iter);
+    for (i = 0; i < key->dsize; ++i) {
+        if (isprint(key->dptr[i])) {
+            if (bp >= buflen-1) {
+                break;
+            }
+            buf[bp++] = key->dptr[i];
+        } else {
+            if (bp >= buflen-4) {
+                break;
+            }
+            bp += snprintf(buf+bp, buflen-bp, "\\x%02x",key->dptr[i]);
+            ++nonprint;
+        }
+    }
+    if (nonprint > key->dsize/4) {
+        bp = 0;
+        for (i = 0; i < key->dsize; ++i) {
+            if (bp >= buflen-2) {
+                break;
+            }
+            bp += snprintf(buf+bp, buflen-bp, "%02x",key->dptr[i]);
+        }
+    }
+    buf[bp] = 0;
 }
 
-
-
-int
-mdbm_store_r(MDBM *db, datum* key, datum* val, int flags, MDBM_ITER* iter)
+/**
+ * \brief Accesses a key in this MDBM.
+ * \param[in,out] db database handle
+ * \param[in] key key to access
+ * \param[out] value value pointing to accessed value (if any)
+ * \param[out] buf buffer containing copy of accessed value (if any)
+ * \param[out] info information about the fetch
+ * \param[out] iter initialized iterator for next entry
+ * \return status code for success of lock
+ * \retval -1 error
+ * \retval  0 success
+ */
+static int
+access_entry(MDBM* db, datum* key, datum* val, datum* buf, struct mdbm_fetch_info* info,
+             MDBM_ITER* iter)
 {
-    int ret = 0;
     mdbm_hashval_t hashval;
     mdbm_pagenum_t pagenum;
-    int want_large, is_large;
     mdbm_page_t* page;
-    int pass, ksize, vsize, kvsize, esize, maxesize;
-    mdbm_entry_t* ep = NULL;
-    mdbm_entry_t* freep;
-    int free_index = -1;
-    kvpair kv;
-    mdbm_pagenum_t lob_pagenum = 0;
-    char* v;
+    mdbm_entry_t* ep;
+    int do_del = !val;
+    int locked = 0;
+#ifdef MDBM_BSOPS
+    int bserr = 0;
+#endif
     uint64_t t0 = 0;
-    int stored = 0;
-    int cache_stored = 0;
-    int db_locked = 0;
-    int key_locked = 0;
-    int tries = 0;
-    int deleted_old = 0;
-    static const int MAX_LOCK_TRIES = 8;
-
-    store_increment(db);
 
     if (MDBM_DO_STAT_TIME(db)) {
         t0 = db->db_get_usec();
     }
 
-    if (!key || !val || key->dsize < 1 || key->dsize > MDBM_KEYLEN_MAX
-        || val->dsize < 0 || (!db->db_spillsize && val->dsize > MDBM_VALLEN_MAX))
-    {
+    /*fprintf(stderr, "access_entry key %p\n", key); */
+    if (!key || !key->dsize) {
         errno = EINVAL;
         return -1;
     }
@@ -4846,153 +5364,2216 @@ mdbm_store_r(MDBM *db, datum* key, datum* val, int flags, MDBM_ITER* iter)
         return -1;
     }
 
-    if (MDBM_IS_WINDOWED(db) && db->db_spillsize && val->dsize >= db->db_spillsize) {
-        int n = 2+MDBM_DB_NUM_PAGES_ROUNDED(db,val->dsize+MDBM_PAGE_T_SIZE);
-        if (db->db_window.num_pages < n) {
-            mdbm_log(LOG_ERR,
-                     "%s: window size too small for large object (need at least %d bytes)",
-                     db->db_filename,
-                     n*db->db_pagesize);
-            errno = ENOMEM;
-            return -1;
+    /* All accesses must lock when deleting a key, copying out a key value, or
+     * if an mdbm replacement occurred.
+     */
+    if (do_del || (buf != NULL) || MDBM_REPLACED_OR_CHANGED(db)) {
+        if (mdbm_internal_do_lock(db,
+                    do_del ? MDBM_LOCK_WRITE : MDBM_LOCK_LOOKUP,
+                    MDBM_LOCK_WAIT,
+                    key,
+                    &hashval,
+                    &pagenum) < 0) {
+            /*print_lock_state(db); */
+            goto access_error;
+        } else {
+            locked = 1;
         }
+    } else {
+        hashval = hash_value(db,key);
+        pagenum = hashval_to_pagenum(db,hashval);
     }
 
-    want_large = 0;
-    ksize = MDBM_ALIGN_LEN(db,key->dsize);
-    vsize = MDBM_ALIGN_LEN(db,val->dsize);
-    if (MDBM_DB_CACHEMODE(db)) {
-        vsize += MDBM_CACHE_ENTRY_T_SIZE;
+#ifdef MDBM_BSOPS
+    if (do_del && db->db_bsops) {
+        if (db->db_bsops->bs_delete(db->db_bsops_data,key,0) < 0) {
+            bserr = (errno == ENOENT) ? ENOENT : EIO;
+        }
     }
-    kvsize = ksize + vsize;
-    esize = kvsize + MDBM_ENTRY_T_SIZE;
-    maxesize = db->db_pagesize-MDBM_PAGE_T_SIZE-MDBM_ENTRY_T_SIZE;
+#endif
 
-    if (esize > maxesize || (db->db_spillsize && MDBM_LOB_ENABLED(db) && vsize >= db->db_spillsize)) {
-        if (db->db_spillsize) {
-            want_large = 1;
-            vsize = MDBM_ALIGN_LEN(db,MDBM_ENTRY_LOB_T_SIZE);
-            if (MDBM_DB_CACHEMODE(db)) {
-                vsize += MDBM_CACHE_ENTRY_T_SIZE;
+    page = pagenum_to_page(db,pagenum,MDBM_PAGE_NOALLOC,MDBM_PAGE_NOMAP);
+    /* fprintf(stderr, "access_entry() key %s pagenum:%d page:%p\n", key->dptr, pagenum, (void*)page); */
+    if (!page || (ep = find_entry(db,page,key,hashval,key,val,info)) == NULL) {
+        errno = ENOENT;
+#ifdef MDBM_BSOPS
+        if (db->db_bsops) {
+            if (do_del) {
+                if (!bserr) {
+                    if (locked) {
+                        mdbm_internal_do_unlock(db,key);
+                    }
+                    if (MDBM_DO_STAT_TIME(db)) {
+                        mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->remove : NULL;
+                        MDBM_ADD_STAT_WAIT(db,rstats_val,(db->db_get_usec() - t0), MDBM_STAT_TAG_DELETE);
+                    } else if (MDBM_DO_STATS(db)) {
+                        MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_DELETE);
+                    }
+                    if (MDBM_DO_STAT_PAGE(db)) {
+                          MDBM_PAGE_STAT(db, pagenum, MDBM_STAT_TAG_PAGE_DELETE);
+                    }
+                    return 0;
+                }
+                errno = bserr;
+            } else if (db->db_bsops->bs_fetch(db->db_bsops_data,key,val,buf,0) < 0) {
+                if (errno != ENOENT) {
+                    mdbm_logerror(LOG_ERR,0,"mdbm backing store fetch error");
+                }
+            } else {
+                datum k = *key;
+                datum v = *val;
+                if (mdbm_store_r(db,&k,&v,MDBM_REPLACE|MDBM_CLEAN|MDBM_CACHE_ONLY,NULL) < 0) {
+                    char kbuf[128];
+                    get_key(key,kbuf,sizeof(kbuf));
+                    mdbm_logerror((errno != ENOMEM && errno != EINVAL)
+                                  ? LOG_ERR : LOG_DEBUG,
+                                  0,"mdbm backing store cache refill error (key=%s)",kbuf);
+                }
+                if (locked) {
+                    mdbm_internal_do_unlock(db,key);
+                }
+                if (MDBM_DO_STAT_TIME(db)) {
+                    uint64_t dt = db->db_get_usec() - t0;
+                    mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->fetch : NULL;
+                    MDBM_ADD_STAT_WAIT(db,rstats_val,dt,MDBM_STAT_TAG_FETCH);
+                    rstats_val = (db->db_rstats) ? &db->db_rstats->fetch_uncached : NULL;
+                    MDBM_ADD_STAT_WAIT(db,rstats_val,dt,MDBM_STAT_TAG_FETCH_UNCACHED);
+                } else if (MDBM_DO_STATS(db)) {
+                    MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_FETCH);
+                    MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_FETCH_UNCACHED);
+                }
+                return 0;
             }
-            kvsize = ksize + vsize;
-            esize = kvsize + MDBM_ENTRY_T_SIZE;
-        }
-        if (esize > maxesize) {
-            errno = EINVAL;
-            ret = -1;
-            goto store_error_unlocked;
         }
-    }
-
- store_retry_lock:
-    if (mdbm_internal_do_lock(db,MDBM_LOCK_WRITE,MDBM_LOCK_WAIT,key,&hashval,&pagenum) < 0) {
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "Cannot write lock when storing");
 #endif
-        ret = -1;
-        goto store_error_unlocked;
+        goto access_error;
     }
-    key_locked = 1;
 
-#ifdef MDBM_BSOPS
-    if (!(flags & MDBM_CACHE_ONLY) && db->db_bsops) {
-        if (db->db_bsops->bs_store(db->db_bsops_data,key,val,flags) < 0) {
-            int err = errno;
-            mdbm_internal_do_unlock(db,key);
-            if (err == EPERM) {
-              mdbm_log(LOG_NOTICE,
-                       "Retrying store to backing-store after possible"
-                       " page-split locking conflict");
-              if (++tries < MAX_LOCK_TRIES) {
-                goto store_retry_lock;
-              }
+    if (!do_del) {
+        if (buf) {
+            if (val->dsize > buf->dsize) {
+                buf->dptr = (char*)realloc(buf->dptr,val->dsize);
+                buf->dsize = val->dsize;
             }
-            errno = err;
-            return -1;
+            memcpy(buf->dptr,val->dptr,val->dsize);
+            val->dptr = buf->dptr;
         }
-        flags |= MDBM_CLEAN;
-        flags = flags & ~MDBM_STORE_MASK;
-        if (MDBM_CACHE_UPDATE_MODE(flags) == MDBM_CACHE_MODIFY) {
-            flags |= MDBM_MODIFY;
-        } else {
-            flags |= MDBM_REPLACE;
+        if (MDBM_DO_STAT_TIME(db)) {
+            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->fetch : NULL;
+            MDBM_ADD_STAT_WAIT(db,rstats_val,(db->db_get_usec() - t0), MDBM_STAT_TAG_FETCH);
+        } else if (MDBM_DO_STATS(db)) {
+            MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_FETCH);
+        }
+    } else {
+        if (!bserr || bserr == ENOENT) {
+            if (logs_changes(db)) {
+                log_change(db,MDBM_CHANGE_DELETE,key,NULL);
+            }
+            del_entry(db,page,ep);
+            if (MDBM_HAS_FILTER(db)) {
+                filter_rebuild(db,page);
+            }
+            if (MDBM_DO_STAT_TIME(db)) {
+                mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->remove : NULL;
+                MDBM_ADD_STAT_WAIT(db,rstats_val,(db->db_get_usec() - t0), MDBM_STAT_TAG_DELETE);
+            } else if (MDBM_DO_STATS(db)) {
+                MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_DELETE);
+            }
+            if (MDBM_DO_STAT_PAGE(db)) {
+                  MDBM_PAGE_STAT(db, pagenum, MDBM_STAT_TAG_PAGE_DELETE);
+            }
         }
-        stored = 1;
     }
-#endif
 
-    MDBM_SIG_DEFER;
-    if ((page = pagenum_to_page(db,pagenum,MDBM_PAGE_ALLOC,MDBM_PAGE_MAP)) == NULL) {
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "pagenum_to_page inside store failed, pagenum=%d", pagenum);
-#endif
-        errno = ENOMEM;
-        ret = -1;
-        goto store_ret;
+    if (iter) {
+        iter->m_pageno = pagenum;
+        iter->m_next = -3 - 2*MDBM_ENTRY_INDEX(page,ep);
     }
 
-    if (MDBM_STORE_MODE(flags) != MDBM_INSERT_DUP
-        && ((ep = find_entry(db,page,key,hashval,&kv.key,&kv.val,NULL)) != NULL))
-    {
-        if (iter) {
-            iter->m_pageno = pagenum;
-            iter->m_next = -3 - 2*MDBM_ENTRY_INDEX(page,ep);
-        }
-        if (MDBM_STORE_MODE(flags) == MDBM_INSERT) {
-            *key = kv.key;
-            *val = kv.val;
-            ret = MDBM_STORE_ENTRY_EXISTS;
-            goto store_ret;
-        }
-        is_large = MDBM_ENTRY_LARGEOBJ(ep);
-        if (is_large == want_large) {
-            if (is_large) {
-                mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
-                mdbm_page_t* lob = MDBM_PAGE_PTR(db,lp->l_pagenum);
-                if (MDBM_DB_NUM_PAGES_ROUNDED(db,lob->p.p_vallen+MDBM_PAGE_T_SIZE)
-                    == MDBM_DB_NUM_PAGES_ROUNDED(db,val->dsize+MDBM_PAGE_T_SIZE))
-                {
-                    lob = MDBM_PAGE_TO_CHUNK_PTR(db,lob);
-                    if (!(flags & MDBM_RESERVE)) {
-                        memcpy(MDBM_LOB_VAL_PTR(lob),val->dptr,val->dsize);
-                    }
-                    kv.val.dsize = lob->p.p_vallen = val->dsize;
-                    *key = kv.key;
-                    *val = kv.val;
-                    ret = 0;
-                    cache_stored = 1;
-                    goto store_ret;
-                }
+    if (locked) {
+        mdbm_internal_do_unlock(db,key);
+    }
+    if (do_del && journal_commit(db) < 0) {
+        return -1;
+    }
+
+    return 0;
+
+  access_error:
+    if (MDBM_DO_STATS(db)) {
+        if (do_del) {
+            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->remove : NULL;
+            MDBM_INC_STAT_ERROR_COUNTER(db, rstats_val, MDBM_STAT_TAG_DELETE_FAILED);
+        } else {
+            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->fetch : NULL;
+            if (errno == ENOENT) {
+                MDBM_INC_STAT_ERROR_COUNTER(db, rstats_val, MDBM_STAT_TAG_FETCH_NOT_FOUND);
             } else {
-                /* If the new value fits in the same aligned space, return that space. */
-                if (MDBM_ALIGN_LEN(db,kv.val.dsize) == MDBM_ALIGN_LEN(db,val->dsize)) {
-                    MDBM_SET_PAD_BYTES(ep,MDBM_ALIGN_PAD_BYTES(db,val->dsize));
-                    if (!(flags & MDBM_RESERVE)) {
-                        memcpy(kv.val.dptr,val->dptr,val->dsize);
-                    }
-                    *key = kv.key;
-                    *val = kv.val;
-                    ret = 0;
-                    cache_stored = 1;
-                    goto store_ret;
-                }
+                MDBM_INC_STAT_ERROR_COUNTER(db, rstats_val, MDBM_STAT_TAG_FETCH_ERROR);
             }
         }
-        /* Note: old entry can be deleted and the new entry not stored. */
-        /* Make a note and return EOVERFLOW, if it happens. */
-        del_entry(db,page,ep);
-        deleted_old = 1;
-    } else if (MDBM_STORE_MODE(flags) == MDBM_MODIFY) {
-        if (stored) {
-            ret = 0;
-        } else {
-            errno = ENOENT;
-            ret = -1;
-        }
-        goto store_ret;
     }
-
+    if (locked) {
+        mdbm_internal_do_unlock(db,key);
+    }
+    if (iter) {
+        iter->m_pageno = MDBM_DB_DIR_WIDTH(db);
+        iter->m_next = -1;
+    }
+    key->dptr = NULL;
+    key->dsize = 0;
+    if (val) {
+        *val = *key;
+    }
+    return -1;
+}
+
+
+/* EXTERNAL INTERFACES */
+
+int 
+mdbm_delete_lockfiles(const char* dbname)
+{
+  return do_delete_lockfiles(dbname);
+}
+
+
+int
+mdbm_plock(MDBM *db, const datum *key, int flags)
+{
+    mdbm_hashval_t hashval;
+    mdbm_pagenum_t pagenum;
+
+    if (key) {
+        return mdbm_internal_do_lock(db,MDBM_LOCK_READ,MDBM_LOCK_WAIT,key,&hashval,&pagenum);
+    }
+    return mdbm_lock(db);
+}
+
+int
+mdbm_tryplock(MDBM *db, const datum *key, int flags)
+{
+    mdbm_hashval_t hashval;
+    mdbm_pagenum_t pagenum;
+
+    if (key) {
+        return mdbm_internal_do_lock(db,MDBM_LOCK_READ,MDBM_LOCK_NOWAIT,key,&hashval,&pagenum);
+    }
+    return mdbm_trylock(db);
+}
+
+int
+mdbm_punlock(MDBM *db, const datum *key, int flags)
+{
+    int ret = mdbm_internal_do_unlock(db,key);
+
+    if (ret >= 0 && journal_commit(db) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int
+mdbm_trylock(MDBM *db)
+{
+    return mdbm_internal_do_lock(db,MDBM_LOCK_EXCLUSIVE,MDBM_LOCK_NOWAIT,NULL,NULL,NULL);
+}
+
+int
+mdbm_trylock_shared(MDBM *db)
+{
+    return mdbm_internal_do_lock(db,MDBM_LOCK_SHARED,MDBM_LOCK_NOWAIT,NULL,NULL,NULL);
+}
+
+uint32_t mdbm_get_lockmode(MDBM *db) {
+  return db_get_lockmode(db);
+}
+
+int
+mdbm_lock(MDBM *db)
+{
+    return mdbm_internal_do_lock(db,MDBM_LOCK_EXCLUSIVE,MDBM_LOCK_WAIT,NULL,NULL,NULL);
+}
+
+int
+mdbm_lock_shared(MDBM *db)
+{
+    return mdbm_internal_do_lock(db,MDBM_LOCK_SHARED,MDBM_LOCK_WAIT,NULL,NULL,NULL);
+}
+
+int
+mdbm_islocked(MDBM *db)
+{
+  return db_is_locked(db) ? 1 : 0;
+}
+
+/* NOTE: despite the documentation, this only checks ownership */
+/* by the calling process, instead of ownership by *any* process. */
+int
+mdbm_isowned(MDBM *db)
+{
+  return db_is_owned(db) ? 1 : 0;
+}
+
+int
+mdbm_unlock(MDBM *db)
+{
+    int ret = mdbm_internal_do_unlock(db,NULL);
+
+    if (ret >= 0 && journal_commit(db) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+
+/**
+ * Return whether to enable the protect feature based on a regular expression
+ * pattern match with an mdbm path.
+ * \param[in] filename mdbm path
+ * \param[in] envvar environment variable containing regex pattern
+ * \return 1 if the filename matches. Otherwise, return 0
+ */
+static int
+protect_regex_match(const char *filename, const char *envvar)
+{
+    regex_t regex;
+    char *pattern = getenv(envvar);
+    int rc;
+    int matched;
+
+    mdbm_log(LOG_DEBUG, "%s: protect_regex_match, envvar=%s", filename, envvar);
+    if (pattern == NULL) {
+        return 0;
+    }
+    if (strlen(pattern) == 0) {
+        mdbm_log(LOG_ERR,
+                 "%s: protect_regex_match environment variable defined but it has an empty value"
+                 ", envvar=%s", filename, envvar);
+        return 0;
+    }
+
+    mdbm_log(LOG_DEBUG, "%s: protect_regex_match, pattern=%s", filename, pattern);
+    rc = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
+    if (rc) {
+        mdbm_logerror(LOG_ERR, 0,
+                      "%s: protect_regex_match cannot compile regular expresion"
+                      ", envvar=%s"
+                      ", pattern=%s",
+                      filename, envvar, pattern);
+        return 0;
+    }
+
+    rc = regexec(&regex, filename, 0, NULL, 0);
+    matched = (rc == 0 ? 1 : 0);
+    regfree(&regex);
+    mdbm_log(LOG_DEBUG, "%s: protect_regex_match, matched=%d", filename, matched);
+    return matched;
+}
+
+
+/**
+ * Return whether to enable the protect feature if a .protect file is present.
+ * \param[in] filename mdbm path
+ * \return 1 if the protect file exists. Otherwise, return 0
+ */
+static int
+protect_file_exists(const char *filename)
+{
+    struct stat st;
+    char protect_path[MAXPATHLEN+1];
+    int size = 0;
+    int found = 0;
+
+    if (!(filename && filename[0])) { return 0; }
+
+    size = snprintf(protect_path, sizeof(protect_path), "%s.protect", filename);
+
+    if (size < sizeof(protect_path)) {
+        /* appease ynetdblib, it erroneously relies on errno=0 after mdbm_open() */
+        int errno_save=errno;
+        if (lstat(protect_path, &st) < 0) {
+            if (errno != ENOENT) {
+                mdbm_logerror(LOG_ERR, 0, "%s", protect_path);
+            }
+        } else {
+            /* Removing restriction that .protect file must be owned by root to  simplify
+               testing and it is no longer useful for avoiding unintended uses in production. */
+            /*if (st.st_uid) { */
+            /*    mdbm_log(LOG_ERR, "%s: WARNING: must be owned by root", protect_path); */
+            if (!S_ISLNK(st.st_mode)) { /* Make sure it is a symbolic link */
+                mdbm_log(LOG_ERR, "%s: WARNING: must be a symbolic link", protect_path);
+            } else {
+                found = 1;
+            }
+        }
+        errno=errno_save;
+    } else {
+        mdbm_log(LOG_ERR, "%s.protect: pathname too long", filename);
+    }
+
+    mdbm_log(LOG_DEBUG, "%s: protect_file_exists, found=%d", filename, found);
+    return found;
+}
+
+/**
+ * Determines whether a file is on a hugetlbfs.
+ * This function has been moved out mdbm_open for profiling purposes.
+ *
+ * \param[in] filename - mdbm path
+ * \param[in] fd file descriptor of opened \a filename
+ * \param[out] hugep - predicate result for whether fd is on a hugetlbfs
+ *             If the return code is 0, hugep is returned.
+ * \param[out] page_size - if \a hugep, the optimal transfer block size
+ *             If the return code is 0, page_size is returned.
+ * \return whether the check were successful
+ * \retval 1 platform cannot have a hugetblfs
+ * \retval 0 check success
+ * \retval -1 check failed (fstatfs)
+ */
+static int
+check_hugetlbfs(const char *filename, int fd, int *hugep, uint32_t *page_size)
+{
+    int rc;
+#ifdef __linux__
+    {
+        struct statfs fs;
+        if (fstatfs(fd, &fs) < 0) {
+            mdbm_logerror(LOG_ERR, 0, "%s: mdbm fstatfs failure", filename);
+            rc = -1;
+        } else {
+            rc = 0;
+            *hugep = (fs.f_type == MDBM_HUGETLBFS_MAGIC);
+            if (page_size != NULL) {
+                *page_size = (uint32_t)fs.f_bsize; /* Optimal transfer block size. */
+            }
+        }
+    }
+#else
+    rc = 1;
+    *hugep = 0;
+    if (page_size != NULL) {
+        *page_size = 0;
+    }
+#endif
+    return rc;
+}
+
+static int
+is_hugetlbfs(const char *filename, int fd)
+{
+    int hugep = 0;
+    (void)check_hugetlbfs(filename, fd, &hugep, NULL);
+    return hugep;
+}
+
+/**
+ * Gets the magic number from an mdbm by mmap instead of pread.
+ * This is needed for older Linux kernel versions (2.6.18) that don't support
+ * hugetlbfs file-based read-write operations (i.e., pread).  hugtlbfs
+ * read-write operations aren't supported until kernel version 2.6.25.
+ *
+ * Currently (Linux kernel 2.6.18), hugetlbfs files cannot be mmap'd for just
+ * the header size, or the typical system page size (4096) because mmap fails
+ * with errno=EINVAL.  A hugetlbfs mdbm has to be mmap's according to its
+ * system page size (ex., 2MB).
+ *
+ * \param[in] filename - mdbm path
+ * \param[in] fd file descriptor of opened \a filename
+ * \param[in] db_sys_pagesize - file-system page page size.
+ *            Normally, the same as system page size, unless the
+ *            the mdbm is on hugetlbfs, where it must be the
+ *            huge page size.
+ * \param[out] magic - mdbm magic number (internal version identifier)
+ * \param[in] log_error - non-zero value for whether to log an error.
+ *            Normally, an error should be emitted.  However, during an
+ *            mdbm_open when a file is being created, there is no data
+ *            and the caller will not want to emit an expected error.
+ * \return whether a magic number is returned
+ * \retval  0 magic number returned in \a magic
+ * \retval -1 file is truncated (0 bytes)
+ * \retval -2 file size is smaller than magic number
+ * \retval -3 mmap failed
+ * \retval -4 munmap failed
+ * \retval -5 file size invalid (truncated)
+ */
+static int
+get_magic_number_mmap(const char *filename, int fd, uint32_t db_sys_pagesize,
+                      uint32_t *magic, int log_error)
+{
+    mdbm_hdr_t* hp = NULL;
+    off_t len;
+
+    mdbm_log(LOG_DEBUG, "%s: get_magic_number_mmap", filename);
+    len = lseek(fd, 0, SEEK_END);
+    if (len == 0) {
+        return -1;
+    } else {
+        /* The above lseek might've failed, catch it here. */
+        if (len < sizeof(hp->h_magic)) {
+            mdbm_logerror(LOG_ERR, 0,
+                          "%s: mdbm header is smaller than the size of a magic number, "
+                          "header_len=%ld, magic_size=%ld",
+                          filename, (long)len, (long)sizeof(hp->h_magic));
+            return -2;
+        } else {
+            /* Ideally, we only want to map the header, but hugetlbfs mmap
+             * operations fail if something other than that file-system's page
+             * size is used (ex., sizes 4096 and sizeof(*hp) fail). */
+            if (db_sys_pagesize < sizeof(*hp)) {
+                /* Display an error message, but allow to continue.  In the
+                 * future, it might be OK to not use an integral page size for
+                 * hugetlbfs mmap. */
+                mdbm_log(LOG_ERR,
+                         "%s: get_magic_number_mmap map size is less than header size, "
+                         "header_size=%ld, map_size=%d",
+                         filename, (long)sizeof(*hp), db_sys_pagesize);
+            }
+            hp = (mdbm_hdr_t*)mmap(0, db_sys_pagesize, PROT_READ, MAP_SHARED, fd, 0);
+            if (hp == (mdbm_hdr_t*)-1) {
+                mdbm_logerror(LOG_ERR, 0,
+                              "%s: mdbm header map failure, len=%lld, db_sys_pagesize=%d",
+                              filename, (long long)len, db_sys_pagesize);
+                return -3;
+            }
+            *magic = hp->h_magic;
+
+            if (munmap(hp, db_sys_pagesize)) {
+                mdbm_logerror(LOG_ERR, 0, "%s: mdbm header unmap failure, size=%d",
+                              filename, db_sys_pagesize);
+                return -4;
+            }
+
+            if (*magic == _MDBM_MAGIC_NEW2 && (len < db_sys_pagesize)) {
+                mdbm_logerror(LOG_ERR, 0, "%s: mdbm header is truncated, len=%lld",
+                              filename, (long long)len);
+                return -5;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Gets the magic number from an mdbm using pread.  Using pread is much faster
+ * than using mmap as done in get_magic_number_mmap.  pread is used for
+ * non-hugetlbfs file-systems.
+ *
+ * \param[in] filename - mdbm path
+ * \param[in] fd file descriptor of opened \a filename
+ * \param[out] magic - mdbm magic number (internal version identifier)
+ * \param[in] log_error - non-zero value for whether to log an error.
+ *            Normally, an error should be emitted.  However, during an
+ *            mdbm_open when a file is being created, there is no data
+ *            and the caller will not want to emit an expected error.
+ * \return whether a magic number is returned
+ * \retval  0 magic number returned in \a magic
+ * \retval -1 cannot read file
+ * \retval -2 file is truncated (0 bytes)
+ * \retval -3 cannot read all of magic number
+ */
+static int
+get_magic_number_pread(const char* filename, int fd, uint32_t *magic, int log_error)
+{
+    uint32_t magic_local;
+    ssize_t bytes_expected = sizeof(magic_local);
+    off_t offset = offsetof(mdbm_hdr_t, h_magic);
+    ssize_t bytes_read = pread(fd, &magic_local, bytes_expected, offset);
+
+#ifdef DEBUG
+    mdbm_log(LOG_DEBUG, "%s: get_magic_number_pread", filename);
+#endif
+    if (bytes_read < 0) {
+        if (log_error) {
+            mdbm_logerror(LOG_ERR, 0,
+                          "%s: mdbm header read failure, "
+                          "bytes_expected=%ld, bytes_read=%ld, offset=%ld",
+                          filename, (long)bytes_expected, (long)bytes_read, (long)offset);
+        }
+        return -1;
+    } else if (bytes_read == 0) {
+        if (log_error) {
+            mdbm_logerror(LOG_ERR, 0,
+                          "%s: mdbm header read failure, file is truncated, "
+                          "bytes_expected=%ld, bytes_read=%ld, offset=%ld",
+                          filename, (long)bytes_expected, (long)bytes_read, (long)offset);
+        }
+        return -2;
+    } else if (bytes_read != bytes_expected) {
+        if (log_error) {
+            mdbm_logerror(LOG_ERR, 0,
+                          "%s: mdbm header read failure, "
+                          "bytes_expected=%ld, bytes_read=%ld, offset=%ld",
+                          filename, (long)bytes_read, (long)bytes_expected, (long)offset);
+        }
+        return -3;
+    } else {
+        *magic = magic_local;
+        return 0;
+    }
+}
+
+/**
+ * Gets the magic number from an mdbm.
+ *
+ * \param[in] filename - mdbm path
+ * \param[in] fd - file descriptor of opened \a filename
+ * \param[in] db_sys_pagesize - file-system page page size.
+ *            Normally, the same as system page size, unless the
+ *            the mdbm is on hugetlbfs, where it must be the
+ *            huge page size.
+ * \param[out] magic - mdbm magic number (internal version identifier)
+ * \param[in]  log_error - non-zero value for whether to log an error.
+ *             Normally, an error should be emitted.  However, during an
+ *             mdbm_open when a file is being created, there is no data
+ *             and the caller will not want to emit an expected error.
+ * \return whether a magic number is returned
+ * \retval  0 magic number returned in \a magic
+ * \retval -1 file (\a fd) is an empty file
+ * \retval -2 get magic failed on hugetlbfs
+ * \retval -3 get magic failed on non-hugetlbfs
+ */
+int
+get_magic_number(const char* filename, int fd, uint32_t db_sys_pagesize,
+                 uint32_t *magic, int log_error)
+{
+    int rc;
+
+    /* If this mdbm is on a hugetlbfs, use the slower get_magic_number_mmap
+     * function because file-based read-write operations are not supported in
+     * older version of the kernel.
+     *
+     * TBD: if the kernel version is 2.6.25 or later, read-write operations
+     * are supported and get_magic_number_pread should be used.
+     */
+    if (is_hugetlbfs(filename, fd)) {
+        rc = get_magic_number_mmap(filename, fd, db_sys_pagesize, magic, log_error);
+        if ((rc != 0) && (rc != -1)) {
+            /* If rc is 0, or -1, return that.  Otherwise, convert the rc code. */
+            if (log_error) {
+                mdbm_logerror(LOG_ERR, 0,
+                              "%s: get_magic_number failed on hugetlbfs, rc=%d",
+                              filename, rc);
+            }
+            rc = -2;
+        }
+    } else {
+        rc = get_magic_number_pread(filename, fd, magic, log_error);
+        /* If rc is 0, return that.  Otherwise, convert the rc code. */
+        switch (rc) {
+        case 0:
+            break;
+
+        case -2:
+            rc = -1;
+            break;
+
+        default:
+            if (log_error) {
+                mdbm_logerror(LOG_ERR, 0,
+                              "%s: get_magic_number failed on non-hugetlbfs, rc=%d",
+                              filename, rc);
+            }
+            rc = -3;
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Gets the magic number from an mdbm.
+ *
+ * \param[in] db mdbm handle
+ * \param[out] magic - mdbm magic number (internal version identifier)
+ * \return whether a magic number is returned
+ * \retval 0 magic number returned in \a magic
+ * \retval -1 get magic number failed on hugetlbfs
+ * \retval -2 get magic number failed on non-hugetlbfs
+ */
+int
+mdbm_get_magic_number(MDBM *db, uint32_t *magic)
+{
+    if (db == NULL) {
+        return -1;
+    }
+    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
+        return _MDBM_MAGIC_NEW2;
+    }
+    return get_magic_number(db->db_filename, db->db_fd, db->db_sys_pagesize, magic, 1);
+}
+
+
+void*
+mdbm_allocate_handle()
+{
+    /* NOTE: this assumes a V3 handle is larger than V2 (currently true).
+     * we need to allocate enough space for either. */
+    void* ret = calloc(1,sizeof(MDBM)); /* auto-zero's the memory */
+
+    struct mdbm* db = (struct mdbm *) ret;
+    if (db) {
+      db->guard_padding_1 = db->guard_padding_2 = MDBM_GUARD_PADDING; 
+      db->guard_padding_3 = db->guard_padding_4 = MDBM_GUARD_PADDING;
+    }
+
+    return ret;
+}
+
+void
+mdbm_free_handle(MDBM* db)
+{
+    free(db);
+}
+
+
+/* extern int mdbm_convert_legacy_mdbm(const char* filename); */
+
+MDBM*
+mdbm_open_inner(const char *filename, int flags, int mode, int pagesize, int dbsize, int retry)
+{
+    MDBM *db = NULL;
+    int do_check = 0;
+    int err;
+    int openflags = 0;
+    int fd = -1;
+    uint32_t magic;
+    /*uint32_t page_size = 0; */
+    int db_flags = 0;
+    uint32_t db_sys_pagesize = getpagesize();
+    char pathname[MAXPATHLEN+1];
+    mode_t umask_save;
+    char memonly_fname[MAXPATHLEN];
+    char *tempfilename;
+
+    if (filename == NULL) {
+        /* user requested a memory only db */
+        if (pagesize == 0) {
+            pagesize = MDBM_PAGESIZ;
+        }
+        if (pagesize < MDBM_MINPAGE) {
+            mdbm_logerror(LOG_ERR, 0,"mem-only: mdbm open memory-only cache failure,"
+                          " invalid page size specified=%d", pagesize);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        /* dbsize is a required parameter */
+        if ((dbsize < (2 * pagesize)) || (dbsize < (MDBM_MINPAGE * 3))) {
+            mdbm_logerror(LOG_ERR, 0,"mem-only: mdbm open memory-only failure, "
+                          "invalid dbsize specified=%d", dbsize);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        db_flags = MDBM_DBFLAG_MEMONLYCACHE;
+
+        /* sanity check flags that make sense for memory-only cache */
+        if (flags & (MDBM_OPEN_WINDOWED|MDBM_O_FSYNC|MDBM_HEADER_ONLY|MDBM_O_RDONLY)) {
+            mdbm_logerror(LOG_ERR, 0,"mem-only: mdbm open memory-only failure, "
+                          "conflicting flags(%x) specified", flags);
+            errno = EINVAL;
+            return NULL;
+        }
+        flags |= MDBM_O_CREAT | MDBM_O_TRUNC | MDBM_O_RDWR | MDBM_CREATE_V3;
+
+        /* create a unique tmp name for filename */
+        tempfilename = tempnam("/tmp", "memoryonly");
+        snprintf(memonly_fname, sizeof(memonly_fname),"%s",tempfilename);
+        filename = memonly_fname;
+        free(tempfilename);
+    }
+
+
+    /* force V3 */
+    flags |= MDBM_CREATE_V3;
+    /* unset V2 */
+    if (flags & MDBM_CREATE_V2) {
+      mdbm_logerror(LOG_ERR,0,"%s: MDBM V4 doesn't support MDBM_CREATE_V2", filename);
+      errno = EINVAL;
+      return NULL;
+    }
+
+    /* open_locks_inner() handles MDBM_ANY_LOCKS for now... */
+    if (flags & MDBM_ANY_LOCKS) {
+      db_flags |= MDBM_ANY_LOCKS;
+    }
+    if (flags & MDBM_SINGLE_ARCH) {
+      db_flags |= MDBM_SINGLE_ARCH;
+    }
+
+
+    /* fprintf(stderr, "MDBM V3 header size is %d bytes\n", sizeof(mdbm_hdr_t)); */
+
+    if ((flags & MDBM_O_ACCMODE) != MDBM_O_RDONLY) {
+        openflags = O_RDWR;
+    } else {
+        openflags = O_RDONLY;
+        /* remap_file_pages() fails when opening RDONLY */
+        if (flags & MDBM_OPEN_WINDOWED) {
+            mdbm_logerror(LOG_ERR,0,"%s: cannot use MDBM_OPEN_WINDOWED in read-only mode",filename);
+            ERROR();
+            goto open_error;
+        }
+    }
+    if (flags & MDBM_O_CREAT) {
+        openflags |= O_CREAT;
+    }
+
+    mdbm_log(LOG_DEBUG, "%s: mdbm_open, openflags=0x%x, mode=0%o",
+             filename, openflags, mode);
+
+    if (db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
+        fd = -1;
+    } else {
+        umask_save = umask(0);      /* Allow all permissions to be set */
+        fd = open(filename,openflags,mode);
+        umask(umask_save);          /* Restore umask */
+        if (fd < 0) {
+            mdbm_logerror(LOG_ERR,0,"%s: mdbm file open failure",filename);
+            ERROR();
+            goto open_error;
+        }
+
+      /* Check for a hugetlbfs, and update config if appropriate. */
+      {
+          int hugep = 0; /* Boolean for whether filename is on a hugetlbfs */
+          uint32_t page_size = 0;
+
+          if (check_hugetlbfs(filename, fd, &hugep, &page_size) < 0) {
+              ERROR();
+              goto open_error;
+          } else {
+              if (hugep) {
+                  db_flags |= MDBM_DBFLAG_HUGEPAGES;
+                  db_sys_pagesize = page_size;
+              }
+          }
+      }
+    }
+
+    /* Verify the magic number in the header. */
+    magic = 0;
+    if (!(flags & MDBM_O_TRUNC)) {
+#ifdef DEBUG
+        mdbm_log(LOG_DEBUG, "%s: mdbm_open, check for magic number", filename);
+        int rc = get_magic_number(filename, fd, db_sys_pagesize, &magic, 1);
+        mdbm_log(LOG_DEBUG, "%s: mdbm_open, magic number=0x%x, rc=%d",
+                 filename, magic, rc);
+#else
+        int rc = get_magic_number(filename, fd, db_sys_pagesize, &magic, 0);
+#endif
+        /* Either the mdbm exists and it has a valid magic number, or a new mdbm
+         * is being created (and no data for a magic number could be read). */
+        if (rc) {
+            if (rc == -1) {
+                /* mdbm was empty */
+                if (!(flags & MDBM_O_CREAT)) {
+                    mdbm_logerror(LOG_ERR,0,"%s: mdbm header is truncated",filename);
+                    ERROR();
+                    goto open_error;
+                }
+            } else {
+              mdbm_logerror(LOG_ERR,0,"%s: can't get mdbm magic number (fd:%d, rc:%d)",
+                            filename, fd, rc);
+              goto open_error;
+            }
+        }
+    }
+
+#ifdef DEBUG
+    mdbm_log(LOG_DEBUG, "%s: mdbm_open, magic number=0x%x", filename, magic);
+#endif
+    /* If there is no magic number (we're creating an mdbm), set it according
+     * to the mdbm version desired. */
+    if (!magic) {
+        magic = _MDBM_MAGIC_NEW2;
+    }
+    if (magic != _MDBM_MAGIC_NEW2) {
+        if (magic == _MDBM_MAGIC || magic == _MDBM_MAGIC_NEW) {
+          mdbm_log(LOG_ERR,"%s: V2 mdbm is not supported",filename);
+          errno = EBADF;
+          return NULL;
+
+          /*
+          //if (!retry) {
+          //  mdbm_log(LOG_ERR,"%s: V2 mdbm is not supported, and autoconvert failed",filename);
+          //  errno = EBADF;
+          //  return NULL;
+          //}
+          //close(fd);
+          // // log error
+          //mdbm_log(LOG_ERR,"%s: V2 mdbm is not supported, attempting to autoconvert",filename);
+          //mdbm_log(LOG_ERR,"%s: conversion will go away completely in the future",filename);
+          // // try upgrade...
+          //if (mdbm_convert_legacy_mdbm(filename)) {
+          //  errno = EBADF;
+          //  return NULL;
+          //}
+          //return mdbm_open_inner(filename, flags, mode, pagesize, dbsize, 0);
+          */
+
+        } else {
+          close(fd);
+          mdbm_log(LOG_ERR,"%s: mdbm header magic number is invalid",filename);
+          ERROR();
+          errno = EBADF;
+          return NULL;
+        }
+    }
+
+    if (pagesize && (pagesize < MDBM_MINPAGE)) {
+        mdbm_logerror(LOG_ERR,0,"%s: Page size %d is too small", filename, pagesize);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (pagesize && (pagesize > MDBM_MAXPAGE)) {
+        mdbm_logerror(LOG_ERR,0,"%s: Page size %d is too large", filename, pagesize);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((flags & MDBM_HEADER_ONLY) && (flags & MDBM_O_CREAT)) {
+        mdbm_logerror(LOG_ERR,0,
+                      "%s: cannot use MDBM_HEADER_ONLY with MDBM_O_CREAT",filename);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!filename || !filename[0] || strlen(filename) > MAXPATHLEN
+#ifndef __x86_64__
+        || ((flags & (MDBM_DBSIZE_MB|MDBM_DBSIZE_MB_OLD)) && dbsize > 2048)
+#endif
+        || ((flags & (MDBM_CREATE_V2|MDBM_CREATE_V3)) == (MDBM_CREATE_V2|MDBM_CREATE_V3)))
+        {
+            mdbm_logerror(LOG_ERR,0,"%s: invalid path, size=%ld",
+                          filename, (filename ? (long)strlen(filename) : 0L) );
+            close(fd);
+            errno = EINVAL;
+            return NULL;
+        }
+
+#ifndef HAVE_WINDOWED_MODE /* WINDOWED mode only supported on linux */
+    if (flags & MDBM_OPEN_WINDOWED) {
+        ERROR();
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+#endif
+    if ((flags & MDBM_OPEN_WINDOWED) && pagesize && (0 != (pagesize % db_sys_pagesize))) {
+        ERROR();
+        mdbm_logerror(LOG_ERR,0,"%s: Page size %d must be a multiple of system page size %d", filename, pagesize, db_sys_pagesize);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+/*
+    //if ((flags & MDBM_OPEN_WINDOWED) && remap_is_limited(db_sys_pagesize)) {
+    //    mdbm_logerror(LOG_ERR,0,"%s: OS does not support windowed mode", filename);
+    //    close(fd);
+    //    errno = EINVAL;
+    //    return NULL;
+    //}
+*/
+
+    if (!(db_flags & MDBM_DBFLAG_MEMONLYCACHE)) {
+        if (!realpath(filename,pathname)) {
+          mdbm_logerror(LOG_ERR,0,"Unable to resolve real path for mdbm: %s",filename);
+          ERROR();
+          return NULL;
+        }
+    } else {
+      pathname[0] = '\0';
+    }
+
+    db = (MDBM*)mdbm_allocate_handle();
+    if (db == NULL) {
+        ERROR();
+        errno = ENOMEM;
+        return NULL;
+    }
+    db->db_ver_flag = MDBM_DBVER_3;
+    db->db_fd = fd;
+    db->db_flags |= db_flags;
+    db->db_sys_pagesize = db_sys_pagesize;
+    /*init_locks(db); */
+
+    db->db_filename[0] = 0;
+    if (filename[0] == '/') {
+        strncat(db->db_filename,filename,sizeof(db->db_filename)-1);
+    } else {
+        strncat(db->db_filename,pathname,sizeof(db->db_filename)-1);
+    }
+    db->m_stat_cb = 0;
+    db->m_stat_cb_flags = 0;
+    db->m_stat_cb_user = 0;
+    db->db_get_usec = &fast_time_usec;
+
+    if ((flags & MDBM_O_ACCMODE) == MDBM_O_RDONLY) {
+        db->db_flags |= MDBM_DBFLAG_RDONLY;
+    }
+    if (flags & MDBM_NO_DIRTY) {
+        db->db_flags |= MDBM_DBFLAG_NO_DIRTY;
+    }
+    if (flags & MDBM_OPEN_NOLOCK) {
+        db->db_flags |= MDBM_DBFLAG_NOLOCK;
+    } else {
+        int lockmode = 0;
+        int lflags = (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE);
+        if (mdbm_internal_open_locks(db,flags|lflags,1,&do_check) < 0) {
+            ERROR();
+            goto open_error;
+        }
+        lockmode = db_get_lockmode(db);
+        /* fprintf(stderr, "SETTING db_flags FROM db_get_lockmode %x ON %s\n",
+             lockmode, db->db_filename); */
+        /* correct db_flags with actual locking mode */
+        db->db_flags |= lockmode;
+    }
+
+    if (flags & MDBM_STAT_OPERATIONS) {
+        if (mdbm_enable_stat_operations(db, MDBM_STATS_BASIC | MDBM_STATS_TIMED) != 0) {
+#if 0
+/* deprecated */
+        if (flags & MDBM_O_RDWR) {
+            db->db_flags |= MDBM_DBFLAG_STAT_OPERATIONS;
+        } else {  /* Must have write access: keeping stats on fetches still writes to MDBM */
+             mdbm_log(LOG_ERR,
+                 "%s: STAT_OPERATIONS (even of fetches only) require Read/Write access", filename);
+#endif
+            goto open_error;
+        }
+    }
+
+    if ((flags & MDBM_PROTECT) ||
+        (protect_file_exists(pathname)) ||
+        (protect_regex_match(pathname, "MDBM_PROTECT_PATH_REGEX"))) {
+        mdbm_log(LOG_WARNING,
+                 "%s: protect feature enabled -- performance might be degraded", filename);
+        db->db_flags |= MDBM_DBFLAG_PROTECT;
+    }
+
+    if (flags & MDBM_OPEN_WINDOWED) {
+        db->db_flags |= MDBM_DBFLAG_WINDOWED;
+    }
+#ifdef DEBUG
+    mdbm_log(LOG_DEBUG, "%s: mdbm_open, magic number=0x%x", filename, magic);
+#endif
+
+    /* If there is a create flag, and the file is empty, treat it like a
+     * truncation.  The truncation will initialize the header (magic number,
+     * etc.) */
+    if (flags & MDBM_O_CREAT) {
+        if (lseek(db->db_fd,0,SEEK_END) == 0) {
+            flags |= MDBM_O_TRUNC;
+        }
+    }
+    if (flags & MDBM_O_ASYNC) {
+        db->db_flags |= MDBM_DBFLAG_ASYNC;
+    }
+    if (flags & MDBM_O_FSYNC) {
+        db->db_flags |= MDBM_DBFLAG_FSYNC;
+    }
+    if (flags & MDBM_O_TRUNC) {
+        int npages;
+
+        if (!pagesize) {
+            pagesize = MDBM_PAGESIZ; /* go with default size */
+        } else if (pagesize < MDBM_MINPAGE) {
+            pagesize = MDBM_MINPAGE;
+        } else if (pagesize > MDBM_MAXPAGE) {
+            pagesize = MDBM_MAXPAGE;
+        } else {
+            pagesize = (pagesize + (MDBM_PAGE_ALIGN-1)) & ~(MDBM_PAGE_ALIGN-1);
+        }
+
+        if (dbsize) {
+            size_t ldbsize = (unsigned int)dbsize;
+            if (flags & (MDBM_DBSIZE_MB|MDBM_DBSIZE_MB_OLD)) {
+                ldbsize *= (1024*1024);
+            }
+            npages = (ldbsize + pagesize - 1) / pagesize;
+        } else {
+            npages = 1;
+        }
+        if (truncate_db(db,npages,pagesize,flags) < 0) {
+            ERROR();
+            goto open_error;
+        }
+        if (flags & MDBM_LARGE_OBJECTS) {
+            db->db_hdr->h_dbflags |= MDBM_HFLAG_LARGEOBJ;
+            db->db_spillsize = db->db_hdr->h_spill_size = pagesize/2 + pagesize/4;
+        }
+    } else {
+        if (mdbm_internal_remap(db,0,flags) < 0) {
+            ERROR();
+            goto open_error;
+        }
+        if (do_check) {
+            if ((db->db_flags & MDBM_DBFLAG_HDRONLY) || MDBM_IS_WINDOWED(db)) {
+                mdbm_log(LOG_NOTICE,
+                         "%s: previous lock owner died; use mdbm_check to test db integrity",
+                         db->db_filename);
+            } else if (mdbm_check(db,3,1) > 0) {
+                mdbm_log(LOG_ERR,"%s: mdbm_open db integrity check failure",filename);
+                ERROR();
+                errno = EFAULT;
+                goto open_error;
+            }
+        }
+    }
+    if (!MDBM_NOLOCK(db)) {
+        mdbm_internal_do_unlock(db,NULL);
+    }
+
+    if ((flags & MDBM_OPEN_WINDOWED)){
+        if (0 != (db->db_pagesize % db_sys_pagesize)) {
+            mdbm_logerror(LOG_ERR,0,"%s: Page size %d must be a multiple of system page size %d", 
+                filename, pagesize, db_sys_pagesize);
+            ERROR();
+            errno = EINVAL;
+            goto open_error;
+        }
+    }
+
+#ifdef MDBM_SANITY_CHECKS
+    if (getenv("MDBM_SANITY_CHECK")) {
+        mdbm_sanity_check = 1;
+    }
+#endif
+
+    if (MDBM_HAS_DIRTYMAP(db) && !MDBM_IS_RDONLY(db) && dirty_attach(db) < 0) {
+        mdbm_logerror(LOG_ERR,0,"%s: unable to attach dirty page map,"
+                      " changes made through this handle will not be tracked",filename);
+    }
+
+    /* Replays the journal, if a crash left one. */
+    if (MDBM_HAS_JOURNAL(db) && !MDBM_IS_RDONLY(db) && journal_attach(db,1) < 0) {
+        goto open_error;
+    }
+
+    if (check_guard_padding(db, 1) != 0) {
+        goto open_error;
+    }
+
+    return db;
+
+  open_error:
+    err = errno;
+    if (db) {
+        journal_detach(db,0);
+        dirty_detach(db);
+        mdbm_internal_close_locks(db);
+        if (db->db_base) {
+            if (munmap(db->db_base,db->db_base_len) < 0) {
+                mdbm_logerror(LOG_ERR,0,"munmap(%p,%llu)",
+                              (void*)db->db_base,(unsigned long long)db->db_base_len);
+            }
+            /*fprintf(stderr, "open_error::munmap(%p,%u)\n", db->db_base,(unsigned)db->db_base_len); */
+        }
+        if (db->db_dir) {
+            free(db->db_dir);
+        }
+        dir_cache_detach(db);
+        free_index_release(db);
+        if (db->db_window.buckets) {
+            free(db->db_window.buckets);
+        }
+        if (db->db_window.wpages) {
+            free(db->db_window.wpages);
+        }
+        if (db->db_fd != -1) {
+            close(db->db_fd);
+        }
+        mdbm_free_handle(db);
+    } else {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    errno = err;
+    return NULL;
+}
+
+
+MDBM*
+mdbm_open(const char *filename, int flags, int mode, int pagesize, int dbsize)
+{
+#ifdef DEBUG
+    {
+        /* DEBUG: manually enable debugging for testing.
+         * Specify a numeric log level:
+         *
+         * 0: emerg   1: alert  2: crit   3: err     4: warn
+         * 5: notice  6: info   7: debug  8: debug2  9: debug3
+         */
+        char *mdbm_level = getenv("MDBM_LOG_LEVEL");
+        if ((mdbm_level != NULL)) {
+            int level = atoi(mdbm_level);
+            if ((level >= LOG_EMERG) && (level <= LOG_DEBUG)) {
+              mdbm_log_minlevel(level);
+            } else {
+                mdbm_log(LOG_ERR, "%s: mdbm log level must in numeric and in range %d,%d, level=%s",
+                         filename, LOG_EMERG, LOG_DEBUG, mdbm_level);
+            }
+        }
+    }
+#endif
+
+    /* Add code to handle opening RDONLY|CREAT by allowing us to create an empty V3 */
+    /* MDBM (which requires read+write access) then closing it and reopening it RDONLY */
+    /* Created mdbm_open_internal out of the old mdbm_open() to avoid recursive calls. */
+    if ((flags & MDBM_CREATE_V3) && (flags & MDBM_O_CREAT) && !(flags & MDBM_O_RDWR) && (filename != NULL)) {
+        int errno_save = errno;
+        struct stat stat_info;
+        if ((stat(filename, &stat_info) == 0) && (stat_info.st_size != 0) ) {
+            return mdbm_open_inner(filename, flags, mode, pagesize, dbsize, 1);
+        } else {
+            MDBM *db =  NULL;
+            int cflags = flags | MDBM_O_RDWR | MDBM_O_TRUNC;
+            errno = 0;
+            db =  mdbm_open_inner(filename, cflags, mode, pagesize, dbsize, 1);
+            if (db != NULL) {
+                mdbm_close(db);
+                errno = errno_save;
+            } else {
+                mdbm_logerror(LOG_ERR,0,"%s: cannot truncate and reopen",filename);
+                errno = errno_save;
+                return NULL;
+            }
+        }
+    }
+
+    return mdbm_open_inner(filename, flags, mode, pagesize, dbsize, 1);
+}
+
+
+void
+mdbm_close(MDBM *db)
+{
+    int zrefs;
+
+    if (!db) {
+        return;
+    }
+
+    zrefs = !db->db_dup_info || (dec_dup_ref(db) == 0);
+    if (zrefs && db->db_rstats) {
+        mdbm_close_rstats(db->db_rstats_mem);
+        db->db_rstats = NULL;
+        db->db_rstats_mem = NULL;
+    }
+    mdbm_stop_flusher(db);
+    dirty_detach(db);
+    journal_detach(db,1);
+    changes_detach(db);
+
+#ifdef MDBM_BSOPS
+    if (db->db_bsops) {
+        db->db_bsops->bs_term(db->db_bsops_data,0);
+        db->db_bsops_data = NULL;
+        db->db_bsops = NULL;
+    }
+#endif
+
+    mdbm_set_window_size_internal(db,0);
+
+    if (zrefs && db->db_base) {
+        if (!MDBM_IS_RDONLY(db)) {
+            if (db->db_flags & MDBM_DBFLAG_FSYNC) {
+                msync(db->db_base,MDBM_DB_MAP_SIZE(db),MS_ASYNC);
+            }
+        }
+        if (munmap(db->db_base,db->db_base_len) < 0) {
+            mdbm_logerror(LOG_ERR,0,"munmap(%p,%llu)",
+                          (void*)db->db_base,(unsigned long long)db->db_base_len);
+        }
+        /*fprintf(stderr, "close::munmap(%p,%u)\n", db->db_base,(unsigned)db->db_base_len); */
+        db->db_base = NULL;
+        db->db_hdr = NULL;
+    }
+    mdbm_internal_close_locks(db);
+    if (zrefs && db->db_fd >= 0) {
+        close(db->db_fd);
+        db->db_fd = -1;
+    }
+    dir_cache_detach(db);
+    free_index_release(db);
+    if (zrefs && db->db_dup_info) {
+        dir_cache_release(db->db_dup_info->dup_dir_cache);
+        free(db->db_dup_info);
+        db->db_dup_info = NULL;
+    }
+    if (db->db_dir) {
+        free(db->db_dir);
+        db->db_dir = NULL;
+    }
+    check_guard_padding(db, 1);
+    mdbm_free_handle(db);
+}
+
+int
+mdbm_set_cachemode(MDBM* db, int cachemode)
+{
+    int err = 0;
+
+    if (db->db_ver_flag != MDBM_DBVER_3) {
+        errno = ENOSYS;
+        return -1;
+    }
+    if ((cachemode & ~MDBM_CACHEMODE_BITS)
+        || (MDBM_CACHEMODE(cachemode) > MDBM_CACHEMODE_MAX))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (lock_db(db) < 0) {
+        return -1;
+    }
+    if (!check_empty(db)) {
+        err = EINVAL;
+    } else {
+        db->db_cache_mode = db->db_hdr->h_cache_mode = cachemode;
+    }
+    unlock_db(db);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int
+mdbm_get_cachemode(MDBM* db)
+{
+    if (db->db_ver_flag != MDBM_DBVER_3) {
+        errno = ENOSYS;
+        return -1;
+    }
+    return db->db_cache_mode;
+}
+
+const char*
+mdbm_get_cachemode_name(int cachemode)
+{
+    static char* s_cache_modes[] =
+        { "none",
+          "LFU",
+          "LRU",
+          "GDSF",
+          "unknown"
+        };
+
+    static char* s_cache_clean_modes[] =
+        { "CLEAN+none",
+          "CLEAN+LFU",
+          "CLEAN+LRU",
+          "CLEAN+GDSF",
+          "unknown"
+        };
+
+    int clean = cachemode & MDBM_CACHEMODE_EVICT_CLEAN_FIRST;
+    cachemode = MDBM_CACHEMODE(cachemode);
+    assert(sizeof(s_cache_modes) / sizeof(s_cache_modes[0]) > MDBM_CACHEMODE_MAX);
+    if (cachemode > MDBM_CACHEMODE_MAX) {
+      return s_cache_modes[MDBM_CACHEMODE_MAX + 1];
+    }
+    return (clean) ? s_cache_clean_modes[cachemode] : s_cache_modes[cachemode];
+
+}
+
+int
+mdbm_get_stat_counter(MDBM *db, mdbm_stat_type type, mdbm_counter_t *value)
+{
+    int rc = 0;
+
+#ifdef MDBM_V2_COMPAT
+    if ((db == NULL) || (db->db_ver_flag != MDBM_DBVER_3)) {
+        return -1;
+    }
+#endif
+
+    switch ((int)type) {
+    case MDBM_STAT_TYPE_FETCH:
+        *value =  mdbm_hdr_stats(db)->s_fetches;
+        break;
+
+    case MDBM_STAT_TYPE_STORE:
+        *value =  mdbm_hdr_stats(db)->s_stores;
+        break;
+
+    case MDBM_STAT_TYPE_DELETE:
+        *value =  mdbm_hdr_stats(db)->s_deletes;
+        break;
+
+    default:
+        rc = -1;
+    }
+
+    return rc;
+}
+
+int
+mdbm_get_stat_time(MDBM *db, mdbm_stat_type type, time_t *value)
+{
+    int rc = 0;
+
+#ifdef MDBM_V2_COMPAT
+    if ((db == NULL) || (db->db_ver_flag != MDBM_DBVER_3)) {
+        return -1;
+    }
+#endif
+
+    switch ((int)type) {
+    case MDBM_STAT_TYPE_FETCH:
+        *value =  (time_t) mdbm_hdr_stats(db)->s_last_fetch;
+        break;
+
+    case MDBM_STAT_TYPE_STORE:
+        *value =  (time_t) mdbm_hdr_stats(db)->s_last_store;
+        break;
+
+    case MDBM_STAT_TYPE_DELETE:
+        *value =  (time_t) mdbm_hdr_stats(db)->s_last_delete;
+        break;
+
+    default:
+        rc = -1;
+    }
+
+    return rc;
+}
+
+inline static void
+fetch_increment(MDBM *db)
+{
+    if (MDBM_GET_STAT_OPERATIONS_OPS(db)) {
+        MDBM_INC_STAT_64(&mdbm_hdr_stats(db)->s_fetches);
+    }
+    if (MDBM_GET_STAT_OPERATIONS_TIMES(db)) {
+        mdbm_hdr_stats(db)->s_last_fetch = get_time_sec();
+    }
+}
+
+inline static void
+store_increment(MDBM *db)
+{
+    if (MDBM_GET_STAT_OPERATIONS_OPS(db)) {
+        MDBM_INC_STAT_64(&mdbm_hdr_stats(db)->s_stores);
+    }
+    if (MDBM_GET_STAT_OPERATIONS_TIMES(db)) {
+        mdbm_hdr_stats(db)->s_last_store = get_time_sec();
+    }
+}
+
+inline static void
+delete_increment(MDBM *db)
+{
+    if (MDBM_GET_STAT_OPERATIONS_OPS(db)) {
+        MDBM_INC_STAT_64(&mdbm_hdr_stats(db)->s_deletes);
+    }
+    if (MDBM_GET_STAT_OPERATIONS_TIMES(db)) {
+        mdbm_hdr_stats(db)->s_last_delete = get_time_sec();
+    }
+}
+
+void
+mdbm_reset_stat_operations(MDBM *db)
+{
+#ifdef MDBM_V2_COMPAT
+    if ((db == NULL) || (db->db_ver_flag != MDBM_DBVER_3)) {
+        return;
+    }
+#endif
+
+    mdbm_hdr_stats(db)->s_fetches = 0ULL;
+    mdbm_hdr_stats(db)->s_stores  = 0ULL;
+    mdbm_hdr_stats(db)->s_deletes = 0ULL;
+
+    mdbm_hdr_stats(db)->s_last_fetch  = 0ULL;
+    mdbm_hdr_stats(db)->s_last_store  = 0ULL;
+    mdbm_hdr_stats(db)->s_last_delete = 0ULL;
+
+    mdbm_hdr_stats(db)->s_filter_rejects   = 0ULL;
+    mdbm_hdr_stats(db)->s_filter_false_pos = 0ULL;
+}
+
+datum
+mdbm_fetch(MDBM *db, datum key)
+{
+    datum val;
+
+    fetch_increment(db);
+    if (access_entry(db,&key,&val,NULL,NULL,NULL) < 0) {
+        val.dptr = NULL;
+        val.dsize = 0;
+    }
+    return val;
+}
+
+int
+mdbm_fetch_r(MDBM *db, datum *key, datum *val, MDBM_ITER *iter)
+{
+    fetch_increment(db);
+    return access_entry(db,key,val,NULL,NULL,iter);
+}
+
+#define MDBM_OPTREAD_TRIES      4
+
+/*
+ * Lock-free lookup for mdbm_fetch_buf (see mdbm_set_optimistic_reads).
+ * The page is read without a lock, so everything read from it is
+ * bounds-checked against this handle's mapping.  The value is copied out,
+ * then the read counters are checked to make sure no writer was in a locked
+ * section of the db, or of the page's partition, in the meantime.
+ * Returns 0 if the key was found, 1 if it wasn't, or -1 if the caller must
+ * take the locked path.
+ */
+static int
+fetch_optimistic(MDBM* db, const datum* key, datum* val, datum* buf)
+{
+    volatile uint32_t* seq = db->db_hdr->h_read_seq;
+    mdbm_hashval_t hashval;
+    mdbm_entry_t test;
+    int part_lock;
+    int tries;
+
+    if (MDBM_IS_WINDOWED(db) || MDBM_USE_PROTECT(db) || MDBM_NOLOCK(db)
+        || MDBM_DB_CACHEMODE(db) || db->db_dup_info || MDBM_DO_STATS(db)
+#ifdef MDBM_BSOPS
+        || db->db_bsops
+#endif
+        )
+    {
+        return -1;
+    }
+
+    hashval = hash_value(db,key);
+    test.e_key.key.len = key->dsize;
+    test.e_key.key.hash = hashval >> 16;
+    part_lock = db_is_multi_lock(db) && !MDBM_RWLOCKS(db);
+
+    for (tries = 0; tries < MDBM_OPTREAD_TRIES; ++tries) {
+        uint32_t s0, sp = 0;
+        int part_word = 0;
+        mdbm_pagenum_t pagenum;
+        mdbm_page_t* page;
+        unsigned int p;
+        size_t pagelen;
+        int found = 0;
+        int vlen = 0;
+
+        s0 = seq[0];
+        atomic_read_barrier();
+        if (!MDBM_HAS_OPTREAD(db)
+            || MDBM_REPLACED_OR_CHANGED(db)
+            || db->db_dir_gen != db->db_hdr->h_dir_gen)
+        {
+            return -1;
+        }
+        pagenum = hashval_to_pagenum(db,hashval);
+        if (part_lock) {
+            part_word = MDBM_READ_SEQ_PART_WORD(MDBM_PAGENUM_TO_PARTITION(db,pagenum));
+            sp = seq[part_word];
+            atomic_read_barrier();
+        }
+        if ((s0 | sp) & MDBM_READ_SEQ_BUSY) {
+            goto retry;
+        }
+
+        if ((p = MDBM_GET_PAGE_INDEX(db,pagenum)) != 0) {
+            mdbm_entry_t* ep;
+            unsigned int n;
+            unsigned int i;
+
+            if (p >= db->db_num_pages) {
+                goto retry;
+            }
+            page = (mdbm_page_t*)(db->db_base + (size_t)p*db->db_pagesize);
+            if (!page->p_num_pages || p + page->p_num_pages > db->db_num_pages) {
+                goto retry;
+            }
+            pagelen = (size_t)page->p_num_pages*db->db_pagesize;
+            n = page->p.p_num_entries;
+            if (MDBM_PAGE_T_SIZE + (size_t)(n+1)*MDBM_ENTRY_T_SIZE > pagelen) {
+                goto retry;
+            }
+            if (MDBM_HAS_FILTER(db)) {
+                if ((size_t)(MDBM_FILTER_OFFSET(db->db_dir_shift)
+                             + MDBM_FILTER_SIZE(db->db_dir_shift)) > db->db_base_len) {
+                    goto retry;
+                }
+                if (!filter_test(db,pagenum,test.e_key.match)) {
+                    n = 0;
+                }
+            }
+            ep = MDBM_ENTRY(page,0);
+            for (i = scan_entries(ep,0,n,test.e_key.match);
+                 i < n;
+                 i = scan_entries(ep,i+1,n,test.e_key.match))
+            {
+                mdbm_entry_t e[2];
+                size_t koff;
+                long voff;
+
+                e[0] = ep[i];
+                e[1] = ep[i+1];
+                koff = MDBM_KEY_OFFSET(e);
+                if (e[0].e_key.match != test.e_key.match || koff + key->dsize > pagelen) {
+                    goto retry;
+                }
+                if (memcmp((char*)page + koff,key->dptr,key->dsize)) {
+                    continue;
+                }
+                if (MDBM_ENTRY_LARGEOBJ(e)) {
+                    return -1;
+                }
+                voff = MDBM_VAL_OFFSET(db,e);
+                vlen = MDBM_VAL_LEN1(db,e);
+                if (vlen < 0 || voff + vlen > (long)pagelen) {
+                    goto retry;
+                }
+                if (vlen > buf->dsize) {
+                    buf->dptr = (char*)realloc(buf->dptr,vlen);
+                    buf->dsize = vlen;
+                }
+                memcpy(buf->dptr,(char*)page + voff,vlen);
+                found = 1;
+                break;
+            }
+        }
+
+        atomic_read_barrier();
+        if (seq[0] == s0 && (!part_lock || seq[part_word] == sp)
+            && !MDBM_REPLACED_OR_CHANGED(db)
+            && db->db_dir_gen == db->db_hdr->h_dir_gen)
+        {
+            if (!found) {
+                return 1;
+            }
+            val->dptr = buf->dptr;
+            val->dsize = vlen;
+            return 0;
+        }
+  retry:
+        atomic_pause();
+    }
+    return -1;
+}
+
+int
+mdbm_fetch_buf(MDBM *db, datum *key, datum *val, datum *buf, int flags)
+{
+    fetch_increment(db);
+    if (db->db_hdr && MDBM_HAS_OPTREAD(db) && key && key->dsize
+        && check_guard_padding(db,1) == 0)
+    {
+        int ret = fetch_optimistic(db,key,val,buf);
+        if (ret == 0) {
+            return 0;
+        } else if (ret > 0) {
+            key->dptr = NULL;
+            key->dsize = 0;
+            *val = *key;
+            errno = ENOENT;
+            return -1;
+        }
+    }
+    return access_entry(db,key,val,buf,NULL,NULL);
+}
+
+static kvpair
+next_r(MDBM *db, MDBM_ITER *iter, int one_page);
+
+int
+mdbm_fetch_dup_r(MDBM *db, datum *key, datum *val, MDBM_ITER *iter)
+{
+    mdbm_pagenum_t pagenum;
+    kvpair kv;
+
+    pagenum = iter->m_pageno;
+    if (iter->m_pageno == 0 && iter->m_next == -1) {
+        /* Called with an uninitialized iterator.
+         * Just lookup first entry.
+         */
+        return mdbm_fetch_r(db,key,val,iter);
+    }
+
+    fetch_increment(db);
+
+    /* Look for next occurrence of this key in the same page.  Continue
+     * looking for this key until I run out of keys on this page; or
+     * until I find it.
+     */
+
+    do {
+        kv = next_r(db,iter,1);
+    } while (kv.val.dptr                        /* Still data in the db */
+             && iter->m_pageno == pagenum       /* Still on same page */
+             && (kv.key.dsize != key->dsize     /* Key not same length -OR- */
+                 || kv.key.dptr[0] != key->dptr[0] /* Key not same value - look again */
+                 || memcmp(kv.key.dptr,key->dptr,key->dsize)));
+
+    /* ASSERT: kv.val.dptr is NULL [end of db];
+     *         pageno is different [moved to next page];
+     *         or we found the appropriate key.
+     */
+    if (kv.val.dptr && (iter->m_pageno == pagenum)) {
+        /* found something. */
+        *val = kv.val;
+        return 0;
+    }
+
+    val->dptr = NULL;
+    val->dsize = 0;
+    errno = ENOENT;
+    return -1;
+}
+
+int
+mdbm_fetch_info(MDBM *db, datum *key, datum *val, datum *buf,
+                struct mdbm_fetch_info* info,
+                MDBM_ITER* iter)
+{
+    if (db->db_ver_flag != MDBM_DBVER_3) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    fetch_increment(db);
+    return access_entry(db,key,val,buf,info,iter);
+}
+
+char*
+mdbm_fetch_str(MDBM *db, const char *key)
+{
+    datum k;
+
+    k.dptr = (char *)key;
+    k.dsize = strlen(key) + 1;
+    return mdbm_fetch(db,k).dptr;
+}
+
+/* Number of keys the batch fetch looks ahead when prefetching entry tables. */
+#define MDBM_FETCH_MULTI_AHEAD  4
+
+#if defined(__GNUC__)
+#define MDBM_PREFETCH(p)        __builtin_prefetch((p),0,3)
+#else
+#define MDBM_PREFETCH(p)        ((void)(p))
+#endif
+
+struct fetch_multi_ent {
+    mdbm_hashval_t hashval;
+    mdbm_pagenum_t pagenum;
+    int part;
+    int retry;                  /* key must be fetched on its own */
+    int idx;                    /* index into the caller's arrays */
+    mdbm_page_t* page;
+};
+
+static int
+fetch_multi_cmp(const void* a, const void* b)
+{
+    const struct fetch_multi_ent* ea = (const struct fetch_multi_ent*)a;
+    const struct fetch_multi_ent* eb = (const struct fetch_multi_ent*)b;
+
+    if (ea->part != eb->part) {
+        return (ea->part < eb->part) ? -1 : 1;
+    }
+    if (ea->pagenum != eb->pagenum) {
+        return (ea->pagenum < eb->pagenum) ? -1 : 1;
+    }
+    return ea->idx - eb->idx;
+}
+
+/*
+ * Probes a run of (locked) batch entries.  All pages are resolved and their
+ * headers prefetched first; entry tables are then prefetched a few keys
+ * ahead of the probe so that the cache misses of neighbouring keys overlap.
+ * Returns the number of keys found.
+ */
+static int
+fetch_multi_probe(MDBM* db, struct fetch_multi_ent* ents, int n,
+                  datum* keys, datum* vals, datum* bufs, int* status, uint64_t t0)
+{
+    uint64_t dt = 0;
+    int found = 0;
+    int j;
+
+    for (j = 0; j < n; ++j) {
+        if (ents[j].retry) {
+            ents[j].page = NULL;
+            continue;
+        }
+        if (j && !ents[j-1].retry && ents[j].pagenum == ents[j-1].pagenum) {
+            ents[j].page = ents[j-1].page;
+            continue;
+        }
+        ents[j].page = pagenum_to_page(db,ents[j].pagenum,MDBM_PAGE_NOALLOC,MDBM_PAGE_NOMAP);
+        if (ents[j].page) {
+            MDBM_PREFETCH(ents[j].page);
+        }
+    }
+
+    for (j = 0; j < n; ++j) {
+        struct fetch_multi_ent* e = &ents[j];
+        int a = j + MDBM_FETCH_MULTI_AHEAD;
+        datum k, v;
+
+        if (a < n && ents[a].page && ents[a].page != ents[a-1].page) {
+            const char* p = (const char*)MDBM_ENTRY(ents[a].page,0);
+            const char* pend = (const char*)MDBM_ENTRY(ents[a].page,ents[a].page->p.p_num_entries);
+            int lines = 0;
+            for (; p <= pend && lines < 8; p += 64, ++lines) {
+                MDBM_PREFETCH(p);
+            }
+        }
+        if (e->retry) {
+            continue;
+        }
+        k = keys[e->idx];
+        if (!e->page || find_entry(db,e->page,&k,e->hashval,&k,&v,NULL) == NULL) {
+            vals[e->idx].dptr = NULL;
+            vals[e->idx].dsize = 0;
+            status[e->idx] = ENOENT;
+            if (MDBM_DO_STATS(db)) {
+                mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->fetch : NULL;
+                MDBM_INC_STAT_ERROR_COUNTER(db, rstats_val, MDBM_STAT_TAG_FETCH_NOT_FOUND);
+            }
+            continue;
+        }
+        if (bufs) {
+            datum* buf = &bufs[e->idx];
+            if (v.dsize > buf->dsize) {
+                buf->dptr = (char*)realloc(buf->dptr,v.dsize);
+                buf->dsize = v.dsize;
+            }
+            memcpy(buf->dptr,v.dptr,v.dsize);
+            v.dptr = buf->dptr;
+        }
+        vals[e->idx] = v;
+        status[e->idx] = 0;
+        ++found;
+    }
+
+    /* Timed stats are charged evenly across the keys found in this run. */
+    if (found && MDBM_DO_STAT_TIME(db)) {
+        dt = (db->db_get_usec() - t0) / found;
+    }
+    for (j = 0; j < n; ++j) {
+        if (ents[j].retry || status[ents[j].idx] != 0) {
+            continue;
+        }
+        if (MDBM_DO_STAT_TIME(db)) {
+            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->fetch : NULL;
+            MDBM_ADD_STAT_WAIT(db,rstats_val,dt,MDBM_STAT_TAG_FETCH);
+        } else if (MDBM_DO_STATS(db)) {
+            MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_FETCH);
+        }
+    }
+    return found;
+}
+
+int
+mdbm_fetch_multi(MDBM *db, datum *keys, datum *vals, datum *bufs, int *status,
+                 int count, int flags)
+{
+    struct fetch_multi_ent* ents;
+    int found = 0;
+    int n = 0;
+    int i, j;
+
+    if (!db || !keys || !vals || !status || count < 0 || flags) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!count) {
+        return 0;
+    }
+    if (check_guard_padding(db, 1) != 0) {
+        return -1;
+    }
+
+    /* Backing stores and windowed mode need the per-key fault-in logic. */
+    if (
+#ifdef MDBM_BSOPS
+        db->db_bsops ||
+#endif
+        MDBM_IS_WINDOWED(db)) {
+        for (i = 0; i < count; ++i) {
+            if (mdbm_fetch_buf(db,&keys[i],&vals[i],bufs ? &bufs[i] : NULL,0) < 0) {
+                status[i] = errno;
+            } else {
+                status[i] = 0;
+                ++found;
+            }
+        }
+        return found;
+    }
+
+    if ((ents = (struct fetch_multi_ent*)malloc(count*sizeof(*ents))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < count; ++i) {
+        if (!keys[i].dptr || !keys[i].dsize) {
+            status[i] = EINVAL;
+            vals[i].dptr = NULL;
+            vals[i].dsize = 0;
+            continue;
+        }
+        fetch_increment(db);
+        ents[n].hashval = hash_value(db,&keys[i]);
+        ents[n].part = 0;
+        ents[n].retry = 0;
+        ents[n].idx = i;
+        ++n;
+    }
+
+    if (!db_is_multi_lock(db) || MDBM_RWLOCKS(db)) {
+        uint64_t t0 = MDBM_DO_STAT_TIME(db) ? db->db_get_usec() : 0;
+
+        if (mdbm_internal_do_lock(db,MDBM_LOCK_LOOKUP,MDBM_LOCK_WAIT,NULL,NULL,NULL) < 0) {
+            free(ents);
+            return -1;
+        }
+        for (j = 0; j < n; ++j) {
+            ents[j].pagenum = hashval_to_pagenum(db,ents[j].hashval);
+        }
+        qsort(ents,n,sizeof(*ents),fetch_multi_cmp);
+        found = fetch_multi_probe(db,ents,n,keys,vals,bufs,status,t0);
+        mdbm_internal_do_unlock(db,NULL);
+    } else {
+        /* Group by partition, so each partition lock is taken once.  The
+         * pre-lock page numbers are only a grouping hint: they are recomputed
+         * under the lock, and any key whose page has moved to a different
+         * partition (directory changed) is retried on its own afterwards.
+         */
+        int start = 0;
+
+        for (j = 0; j < n; ++j) {
+            ents[j].pagenum = hashval_to_pagenum(db,ents[j].hashval);
+            ents[j].part = MDBM_PAGENUM_TO_PARTITION(db,ents[j].pagenum);
+        }
+        qsort(ents,n,sizeof(*ents),fetch_multi_cmp);
+        while (start < n) {
+            int part = ents[start].part;
+            mdbm_pagenum_t pagenum = ents[start].pagenum;
+            uint64_t t0 = MDBM_DO_STAT_TIME(db) ? db->db_get_usec() : 0;
+            int end;
+
+            for (end = start+1; end < n && ents[end].part == part; ++end) {
+            }
+            if (mdbm_internal_do_lock(db,MDBM_LOCK_LOOKUP,MDBM_LOCK_WAIT,NULL,NULL,&pagenum) < 0) {
+                free(ents);
+                return -1;
+            }
+            for (j = start; j < end; ++j) {
+                ents[j].pagenum = hashval_to_pagenum(db,ents[j].hashval);
+                if (MDBM_PAGENUM_TO_PARTITION(db,ents[j].pagenum) != part) {
+                    ents[j].retry = 1;
+                }
+            }
+            found += fetch_multi_probe(db,&ents[start],end-start,keys,vals,bufs,status,t0);
+            mdbm_internal_do_unlock(db,NULL);
+            start = end;
+        }
+        for (j = 0; j < n; ++j) {
+            if (!ents[j].retry) {
+                continue;
+            }
+            i = ents[j].idx;
+            if (access_entry(db,&keys[i],&vals[i],bufs ? &bufs[i] : NULL,NULL,NULL) < 0) {
+                status[i] = errno;
+            } else {
+                status[i] = 0;
+                ++found;
+            }
+        }
+    }
+
+    free(ents);
+    return found;
+}
+
+int
+mdbm_delete(MDBM *db, datum key)
+{
+    delete_increment(db);
+    return access_entry(db,&key,NULL,NULL,NULL,NULL);
+}
+
+int
+mdbm_delete_r(MDBM *db, MDBM_ITER *iter)
+{
+    int ret;
+    mdbm_entry_data_t e;
+    mdbm_entry_t* ep;
+    mdbm_pagenum_t pagenum;
+    int index;
+
+    if (!iter) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pagenum = iter->m_pageno;
+    index = (iter->m_next+3)/-2;
+
+    if (pagenum > db->db_max_dirbit || index < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mdbm_internal_do_lock(db,MDBM_LOCK_WRITE,MDBM_LOCK_WAIT,NULL,NULL,&pagenum) < 0) {
+        return -1;
+    }
+
+    if ((ep = set_entry(db,pagenum,index,&e)) == NULL || !ep->e_key.match) {
+        delete_increment(db);
+        errno = ENOENT;
+        ret = -1;
+    } else {
+        if (logs_changes(db)) {
+            datum k, v;
+
+            get_kv(db,&e,&k,&v);
+            log_change(db,MDBM_CHANGE_DELETE,&k,NULL);
+        }
+        del_entry(db,e.e_page,ep);
+        ret = 0;
+    }
+
+    mdbm_internal_do_unlock(db,NULL);
+    if (!ret && journal_commit(db) < 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int
+mdbm_delete_str(MDBM *db, const char *key)
+{
+    MDBM_ITER iter;
+    datum k;
+
+
+    delete_increment(db);
+    k.dptr = (char *)key;
+    k.dsize = strlen(key) + 1;
+    return access_entry(db,&k,NULL,NULL,NULL,&iter);
+}
+
+
+/*
+ * Stores a record.  If prehash is non-NULL, it is the (already computed) hash
+ * of key, and the key is not hashed again.
+ */
+static int
+store_entry(MDBM *db, datum* key, datum* val, int flags, MDBM_ITER* iter,
+            const mdbm_hashval_t* prehash)
+{
+    int ret = 0;
+    mdbm_hashval_t hashval;
+    mdbm_pagenum_t pagenum;
+    int want_large, is_large;
+    mdbm_page_t* page;
+    int pass, ksize, vsize, kvsize, esize, maxesize;
+    mdbm_entry_t* ep = NULL;
+    mdbm_entry_t* freep;
+    int free_index = -1;
+    kvpair kv;
+    mdbm_pagenum_t lob_pagenum = 0;
+    char* v;
+    uint64_t t0 = 0;
+    int stored = 0;
+    int cache_stored = 0;
+    int db_locked = 0;
+    int key_locked = 0;
+    int tries = 0;
+    int deleted_old = 0;
+    int reindex = 0;
+    static const int MAX_LOCK_TRIES = 8;
+
+    store_increment(db);
+
+    if (MDBM_DO_STAT_TIME(db)) {
+        t0 = db->db_get_usec();
+    }
+
+    if (!key || !val || key->dsize < 1 || key->dsize > MDBM_KEYLEN_MAX
+        || val->dsize < 0 || (!db->db_spillsize && val->dsize > MDBM_VALLEN_MAX))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (check_guard_padding(db, 1) != 0) {
+        return -1;
+    }
+
+    if (MDBM_IS_WINDOWED(db) && db->db_spillsize && val->dsize >= db->db_spillsize) {
+        int n = 2+MDBM_DB_NUM_PAGES_ROUNDED(db,val->dsize+MDBM_PAGE_T_SIZE);
+        if (db->db_window.num_pages < n) {
+            mdbm_log(LOG_ERR,
+                     "%s: window size too small for large object (need at least %d bytes)",
+                     db->db_filename,
+                     n*db->db_pagesize);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    want_large = 0;
+    ksize = MDBM_KEY_ALIGN_LEN(db,key->dsize);
+    vsize = MDBM_ALIGN_LEN(db,val->dsize);
+    if (MDBM_DB_CACHEMODE(db)) {
+        vsize += MDBM_CACHE_ENTRY_T_SIZE;
+    }
+    kvsize = ksize + vsize;
+    esize = kvsize + MDBM_ENTRY_T_SIZE;
+    maxesize = db->db_pagesize-MDBM_PAGE_T_SIZE-MDBM_ENTRY_T_SIZE;
+
+    if (esize > maxesize || (db->db_spillsize && MDBM_LOB_ENABLED(db) && vsize >= db->db_spillsize)) {
+        if (db->db_spillsize) {
+            want_large = 1;
+            vsize = MDBM_ALIGN_LEN(db,MDBM_ENTRY_LOB_T_SIZE);
+            if (MDBM_DB_CACHEMODE(db)) {
+                vsize += MDBM_CACHE_ENTRY_T_SIZE;
+            }
+            kvsize = ksize + vsize;
+            esize = kvsize + MDBM_ENTRY_T_SIZE;
+        }
+        if (esize > maxesize) {
+            errno = EINVAL;
+            ret = -1;
+            goto store_error_unlocked;
+        }
+    }
+
+ store_retry_lock:
+    if (prehash) {
+        hashval = *prehash;
+    }
+    if (mdbm_internal_do_lock(db,MDBM_LOCK_WRITE,MDBM_LOCK_WAIT,prehash ? NULL : key,
+                              &hashval,&pagenum) < 0) {
+#ifdef DEBUG
+        mdbm_log(LOG_DEBUG, "Cannot write lock when storing");
+#endif
+        ret = -1;
+        goto store_error_unlocked;
+    }
+    key_locked = 1;
+
+#ifdef MDBM_BSOPS
+    if (!(flags & MDBM_CACHE_ONLY) && db->db_bsops) {
+        if (db->db_bsops->bs_store(db->db_bsops_data,key,val,flags) < 0) {
+            int err = errno;
+            mdbm_internal_do_unlock(db,key);
+            if (err == EPERM) {
+              mdbm_log(LOG_NOTICE,
+                       "Retrying store to backing-store after possible"
+                       " page-split locking conflict");
+              if (++tries < MAX_LOCK_TRIES) {
+                goto store_retry_lock;
+              }
+            }
+            errno = err;
+            return -1;
+        }
+        flags |= MDBM_CLEAN;
+        flags = flags & ~MDBM_STORE_MASK;
+        if (MDBM_CACHE_UPDATE_MODE(flags) == MDBM_CACHE_MODIFY) {
+            flags |= MDBM_MODIFY;
+        } else {
+            flags |= MDBM_REPLACE;
+        }
+        stored = 1;
+    }
+#endif
+
+    MDBM_SIG_DEFER;
+    if ((page = pagenum_to_page(db,pagenum,MDBM_PAGE_ALLOC,MDBM_PAGE_MAP)) == NULL) {
+#ifdef DEBUG
+        mdbm_log(LOG_DEBUG, "pagenum_to_page inside store failed, pagenum=%d", pagenum);
+#endif
+        errno = ENOMEM;
+        ret = -1;
+        goto store_ret;
+    }
+
+    if (MDBM_STORE_MODE(flags) != MDBM_INSERT_DUP
+        && ((ep = find_entry(db,page,key,hashval,&kv.key,&kv.val,NULL)) != NULL))
+    {
+        if (iter) {
+            iter->m_pageno = pagenum;
+            iter->m_next = -3 - 2*MDBM_ENTRY_INDEX(page,ep);
+        }
+        if (MDBM_STORE_MODE(flags) == MDBM_INSERT) {
+            *key = kv.key;
+            *val = kv.val;
+            ret = MDBM_STORE_ENTRY_EXISTS;
+            goto store_ret;
+        }
+        is_large = MDBM_ENTRY_LARGEOBJ(ep);
+        if (is_large == want_large) {
+            if (is_large) {
+                mdbm_entry_lob_t* lp = MDBM_LOB_PTR1(db,page,ep);
+                mdbm_page_t* lob = MDBM_PAGE_PTR(db,lp->l_pagenum);
+                if (MDBM_DB_NUM_PAGES_ROUNDED(db,lob->p.p_vallen+MDBM_PAGE_T_SIZE)
+                    == MDBM_DB_NUM_PAGES_ROUNDED(db,val->dsize+MDBM_PAGE_T_SIZE))
+                {
+                    lob = MDBM_PAGE_TO_CHUNK_PTR(db,lob);
+                    if (!(flags & MDBM_RESERVE)) {
+                        memcpy(MDBM_LOB_VAL_PTR(lob),val->dptr,val->dsize);
+                    }
+                    kv.val.dsize = lob->p.p_vallen = val->dsize;
+                    *key = kv.key;
+                    *val = kv.val;
+                    ret = 0;
+                    cache_stored = 1;
+                    goto store_ret;
+                }
+            } else {
+                /* If the new value fits in the same aligned space, return that space. */
+                if (MDBM_ALIGN_LEN(db,kv.val.dsize) == MDBM_ALIGN_LEN(db,val->dsize)) {
+                    MDBM_SET_PAD_BYTES(ep,MDBM_ALIGN_PAD_BYTES(db,val->dsize));
+                    if (!(flags & MDBM_RESERVE)) {
+                        memcpy(kv.val.dptr,val->dptr,val->dsize);
+                    }
+                    *key = kv.key;
+                    *val = kv.val;
+                    ret = 0;
+                    cache_stored = 1;
+                    goto store_ret;
+                }
+            }
+        }
+        /* Note: old entry can be deleted and the new entry not stored. */
+        /* Make a note and return EOVERFLOW, if it happens. */
+        del_entry(db,page,ep);
+        deleted_old = 1;
+    } else if (MDBM_STORE_MODE(flags) == MDBM_MODIFY) {
+        if (stored) {
+            ret = 0;
+        } else {
+            errno = ENOENT;
+            ret = -1;
+        }
+        goto store_ret;
+    }
+
     pass = 1;
     while (esize > MDBM_PAGE_FREE_BYTES(page)) {
         mdbm_page_t* newpage;
@@ -5002,1783 +7583,4472 @@ mdbm_store_r(MDBM *db, datum* key, datum* val, int flags, MDBM_ITER* iter)
         int free_dir_space = MDBM_PAGE_FREE_BYTES(page) >= MDBM_ENTRY_T_SIZE;
         int i;
 
-        /* Look for a deleted entry. */
-        for (i = 0; i < page->p.p_num_entries; i++) {
-            ep = MDBM_ENTRY(page,i);
-            if (!ep->e_key.match) {
-                int size = MDBM_ENTRY_SIZE(db,ep);
-                del_bytes += size;
-                if (size == esize) {
-                    /* Exact size deleted entry found. Finished looking. */
-                    free_index = i;
-                    free_size = size;
+        /* Look for a deleted entry. */
+        for (i = 0; i < page->p.p_num_entries; i++) {
+            ep = MDBM_ENTRY(page,i);
+            if (!ep->e_key.match) {
+                int size = MDBM_ENTRY_SIZE(db,ep);
+                del_bytes += size;
+                if (size == esize) {
+                    /* Exact size deleted entry found. Finished looking. */
+                    free_index = i;
+                    free_size = size;
+                    break;
+                }
+                if (free_dir_space && size > esize && (!free_size || size < free_size)) {
+                    /* Bigger deleted size found.  Continue looking. */
+                    free_index = i;
+                    free_size = size;
+                }
+            }
+        }
+        if (free_size) {
+            if (free_size > esize) {
+                int move_count = page->p.p_num_entries - free_index;
+                if (move_count > 0) {
+                    /* Shuffle the entries above free_index up 1 index entry,
+                     * and use this entry. */
+                    freep = MDBM_ENTRY(page,free_index);
+                    memmove(freep+2,freep+1,move_count*MDBM_ENTRY_T_SIZE);
+                    freep[1].e_key.match = 0;
+                    freep[1].e_flags = 0;
+                    freep[1].e_offset = freep[0].e_offset - kvsize;
+                    /* Entry indexes moved: suspend the page index until it is rebuilt. */
+                    page->p_flags |= MDBM_PFLAG_NOINDEX;
+                    reindex = 1;
+                }
+                page->p.p_num_entries++; /* BUG? if move count <= 0 */
+            }
+            break;
+        }
+        free_bytes = MDBM_PAGE_FREE_BYTES(page) + del_bytes;
+        if (esize <= free_bytes) {
+            wring_page(db,page);
+            free_index = -1;
+            break;
+        }
+        if (pass > 1) {
+            errno = ENOMEM;
+            ret = -1;
+            goto store_ret;
+        }
+
+        if ((newpage = split_page(db,hashval)) == NULL) {
+            if (errno == EPERM) {
+                int lock_tries = 0;
+                static const int MAX_STORE_LOCK_TRIES = 2;
+                /* Must upgrade to db lock because split page will almost always be
+                   in a different partition. */
+                for (;;) {
+                    if ((key_locked && trylock_db(db) == 1)
+                        || (!key_locked && lock_db(db) ==1))
+                    {
+                        if ((newpage = split_page(db,hashval)) == NULL) {
+                            unlock_db(db);
+                        } else {
+                            db_locked = 1;
+                        }
+                        break;
+                    }
+                    if (errno != EDEADLK
+                        || db_multi_part_locked(db)
+                        || ++lock_tries >= MAX_STORE_LOCK_TRIES)
+                    {
+                        break;
+                    }
+                    if (key_locked) {
+                        mdbm_internal_do_unlock(db,key);
+                        key_locked = 0;
+                    }
+                    {
+                        struct timespec tv = { 0, 1000000 };
+                        nanosleep(&tv,NULL);
+                    }
+                    mdbm_log(LOG_NOTICE,
+                             "%s: retrying store after page-split deadlock avoidance (page=%d)",
+                             db->db_filename,pagenum);
+                }
+            }
+        }
+        if (!newpage) {
+            page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
+            if ((!db->db_shake_func || shake_page(db,page,key,val,free_bytes,esize) < 0)
+                && (!MDBM_DB_CACHEMODE(db)
+                    || cache_evict(db,page,key,val,free_bytes,esize,0) < esize)
+                && expand_page(db,page,pagenum) < 0)
+            {
+                errno = ENOMEM;
+                ret = -1;
+                goto store_ret;
+            }
+            page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
+            pass++;
+        } else {   /* newpage!=NULL, so new page has been allocated */
+            page = newpage;
+            pagenum = newpage->p_num;
+        }
+    }
+
+    if (want_large) {
+        mdbm_page_t* alloc_lob = NULL;
+        uint32_t alloc_npages = MDBM_DB_NUM_PAGES_ROUNDED(db,val->dsize+MDBM_PAGE_T_SIZE);
+        int ntries = 0;
+        static const int MAX_TRIES = 100;
+
+        if (mdbm_internal_lock(db) < 0) {
+#ifdef DEBUG
+        mdbm_log(LOG_DEBUG, "Cannot mdbm_internal_lock when storing large object");
+#endif
+            ret = -1;
+            goto store_ret;
+        }
+        while (ntries < MAX_TRIES) {
+            if ((alloc_lob = (mdbm_page_t*)alloc_chunk(db,MDBM_PTYPE_LOB,alloc_npages,
+                                                       0,0,MDBM_PAGE_MAP,MDBM_ALLOC_CAN_UNLOCK))
+                != NULL)
+            {
+                break;
+            }
+            /* alloc_chunk releases internal lock if allocation fails */
+            if (mdbm_internal_lock(db) < 0) {
+#ifdef DEBUG
+                mdbm_log(LOG_DEBUG, "Cannot mdbm_internal_lock after alloc_chunk");
+#endif
+                ret = -1;
+                goto store_ret;
+            }
+
+            if (MDBM_DB_CACHEMODE(db)) {
+                mdbm_page_t* p = page;
+                mdbm_hashval_t h = hashval;
+                mdbm_pagenum_t pnum = pagenum;
+                uint32_t alloc_bytes = alloc_npages*db->db_pagesize;
+                uint32_t free_bytes = 0;
+
+                while (ntries < MAX_TRIES) {
+                    ++ntries;
+                    if ((free_bytes = cache_evict(db,p,key,val,free_bytes,alloc_bytes,1))
+                        >= alloc_bytes)
+                    {
+                        break;
+                    }
+                    h = MDBM_HASH_VALUE(db,&h,sizeof(h));
+                    pnum = hashval_to_pagenum(db,h);
+                    p = pagenum_to_page(db,pnum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
+                }
+                if (free_bytes >= alloc_bytes && ntries < MAX_TRIES) {
+                    continue;
+                }
+            }
+
+            mdbm_internal_unlock(db);
+#ifdef DEBUG
+            mdbm_log(LOG_DEBUG, "Cannot find space for storing large object");
+#endif
+            errno = ENOMEM;
+            ret = -1;
+            goto store_ret;
+        }
+        page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
+                        /* may have remapped db */
+        lob_pagenum = alloc_lob->p_num;
+
+        alloc_lob->p_num = pagenum;
+        alloc_lob->p.p_vallen = val->dsize;
+        if (!(flags & MDBM_RESERVE)) {
+            memcpy(MDBM_LOB_VAL_PTR(alloc_lob),val->dptr,val->dsize);
+        }
+    }
+
+    if (free_index == -1) {
+        free_index = page->p.p_num_entries++;
+        freep = MDBM_ENTRY(page,free_index);
+        MDBM_INIT_TOP_ENTRY(freep+1,freep[0].e_offset - kvsize);
+    } else {
+        freep = MDBM_ENTRY(page,free_index);
+    }
+
+    freep->e_offset -= MDBM_KEY_ALIGN_LEN(db,key->dsize);
+    freep->e_flags = 0;
+    freep->e_key.key.len = key->dsize;
+    freep->e_key.key.hash = hashval >> 16;
+    if (MDBM_HAS_FILTER(db)) {
+        filter_add(db,pagenum,freep->e_key.match);
+    }
+    if (MDBM_HAS_PAGE_INDEX(db)) {
+        if (reindex) {
+            page_index_rebuild(db,page);
+        } else {
+            page_index_insert(db,page,free_index);
+        }
+    }
+
+    memcpy(MDBM_KEY_PTR1(page,freep),key->dptr,key->dsize);
+    if (db->db_hashlo_len) {
+        set_entry_hashlo(page,freep,(uint16_t)hashval);
+    }
+    MDBM_SET_PAD_BYTES(freep,MDBM_ALIGN_PAD_BYTES(db,val->dsize));
+    v = MDBM_VAL_PTR1(db,page,freep);
+    if (MDBM_DB_CACHEMODE(db)) {
+        mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)v;
+        c->c_num_accesses = 0;
+        c->c_dat.access_time = 0;
+        v += MDBM_CACHE_ENTRY_T_SIZE;
+    }
+    if (want_large) {
+        mdbm_entry_lob_t* lp = (mdbm_entry_lob_t*)v;
+        lp->l_pagenum = lob_pagenum;
+        lp->l_flags = 0;
+        lp->l_vallen = val->dsize;
+        freep->e_flags |= MDBM_EFLAG_LARGEOBJ;
+        mdbm_internal_unlock(db);
+    } else {
+        if (!(flags & MDBM_RESERVE)) {
+            memcpy(v,val->dptr,val->dsize);
+        }
+    }
+    get_kv1(db,page,freep,key,val,NULL);
+    if (iter) {
+        iter->m_pageno = pagenum;
+        iter->m_next = -3 - 2*MDBM_ENTRY_INDEX(page,freep);
+    }
+    ep = freep;
+    cache_stored = 1;
+
+ store_ret:
+    if (!ret) {
+        if (ep && !(db->db_flags & MDBM_DBFLAG_NO_DIRTY)) {
+            if ((flags & MDBM_CLEAN)) {
+                ep->e_flags &= ~MDBM_EFLAG_DIRTY;
+            } else {
+                ep->e_flags |= MDBM_EFLAG_DIRTY;
+            }
+        }
+        if (cache_stored && db->db_dirty) {
+            dirty_mark_page(db,page);
+            if (MDBM_ENTRY_LARGEOBJ(ep)) {
+                dirty_mark_chunk(db,MDBM_LOB_PTR1(db,page,ep)->l_pagenum);
+            }
+        }
+        if (cache_stored && logs_changes(db)) {
+            log_change(db,(MDBM_STORE_MODE(flags) == MDBM_INSERT_DUP)
+                       ? MDBM_CHANGE_INSERT_DUP : MDBM_CHANGE_STORE,key,val);
+        }
+    } else if (deleted_old && !cache_stored && logs_changes(db)) {
+        log_change(db,MDBM_CHANGE_DELETE,key,NULL);
+    }
+
+    MDBM_SIG_ACCEPT;
+    if (db_locked) {
+        unlock_db(db);
+    }
+    if (key_locked) {
+        mdbm_internal_do_unlock(db,key);
+    }
+    if ((cache_stored || deleted_old) && journal_commit(db) < 0) {
+        ret = -1;
+    }
+
+store_error_unlocked:
+    if (ret<0) {
+        mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->store : NULL;
+        MDBM_INC_STAT_ERROR_COUNTER(db, rstats_val, MDBM_STAT_TAG_STORE_ERROR);
+    } else {
+      if (MDBM_DO_STAT_TIME(db)) {
+        uint64_t now = db->db_get_usec();
+        if (!(flags & MDBM_CACHE_ONLY)) {
+            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->store : NULL;
+            MDBM_ADD_STAT_WAIT(db,rstats_val,now - t0, MDBM_STAT_TAG_STORE);
+        }
+        if (cache_stored && (!db->db_rstats || db->db_rstats->version == MDBM_RSTATS_VERSION)
+              && db->db_bsops) {
+            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->cache_store : NULL;
+            MDBM_ADD_STAT_WAIT(db,rstats_val,now - t0, MDBM_STAT_TAG_CACHE_STORE);
+        }
+      } else if (MDBM_DO_STATS(db)) {
+          if (!(flags & MDBM_CACHE_ONLY)) {
+            MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_STORE);
+          }
+          if (cache_stored && db->db_bsops) {
+            MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_CACHE_STORE);
+          }
+      }
+      if (MDBM_DO_STAT_PAGE(db)) {
+            MDBM_PAGE_STAT(db, pagenum, MDBM_STAT_TAG_PAGE_STORE);
+      }
+    }
+
+
+    if (ret && deleted_old && !stored) {
+      errno = EOVERFLOW;
+    }
+    if (stored && ret < 0 && (errno == ENOMEM || errno == EINVAL)) {
+        ret = 0;
+    }
+
+    return ret;
+}
+
+int
+mdbm_store_r(MDBM *db, datum* key, datum* val, int flags, MDBM_ITER* iter)
+{
+    return store_entry(db,key,val,flags,iter,NULL);
+}
+
+int
+mdbm_store(MDBM *db, datum key, datum val, int flags)
+{
+    return mdbm_store_r(db,&key,&val,flags,NULL);
+}
+
+int
+mdbm_store_str(MDBM *db, const char *key, const char *val, int flags)
+{
+    datum k, v;
+
+    k.dptr = (char *)key;
+    k.dsize = strlen(key) + 1;
+    v.dptr = (char *)val;
+    v.dsize = strlen(val) + 1;
+    return mdbm_store_r(db,&k,&v,flags,NULL);
+}
+
+/* Stores one batch item, and records its result in status. */
+static int
+store_multi_one(MDBM* db, datum key, datum val, int flags, int* status,
+                const mdbm_hashval_t* prehash)
+{
+    int ret = store_entry(db,&key,&val,flags,NULL,prehash);
+
+    if (ret < 0) {
+        *status = errno;
+        return 0;
+    }
+    if (ret == MDBM_STORE_ENTRY_EXISTS) {
+        *status = EEXIST;
+        return 0;
+    }
+    *status = 0;
+    return 1;
+}
+
+int
+mdbm_store_multi(MDBM *db, datum *keys, datum *vals, const int *store_flags, int *status,
+                 int count, int flags)
+{
+    struct fetch_multi_ent* ents;
+    int stored = 0;
+    int n = 0;
+    int i, j;
+
+    if (!db || !keys || !vals || !status || count < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!count) {
+        return 0;
+    }
+    if (MDBM_IS_RDONLY(db)) {
+        errno = EPERM;
+        return -1;
+    }
+
+    /* Backing stores need the key for their own locking. */
+#ifdef MDBM_BSOPS
+    if (db->db_bsops) {
+        for (i = 0; i < count; ++i) {
+            stored += store_multi_one(db,keys[i],vals[i],store_flags ? store_flags[i] : flags,
+                                      &status[i],NULL);
+        }
+        return stored;
+    }
+#endif
+
+    if ((ents = (struct fetch_multi_ent*)malloc(count*sizeof(*ents))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < count; ++i) {
+        if (!keys[i].dptr || keys[i].dsize < 1) {
+            status[i] = EINVAL;
+            continue;
+        }
+        ents[n].hashval = hash_value(db,&keys[i]);
+        ents[n].part = 0;
+        ents[n].retry = 0;
+        ents[n].idx = i;
+        ++n;
+    }
+
+    /* Each store below re-takes the lock we hold, which is just a recursion
+     * count, and splits or wrings a page at most when the batch fills it.
+     * Sorting by page keeps consecutive stores on the same (hot) page.
+     */
+    if (!db_is_multi_lock(db) || MDBM_RWLOCKS(db)) {
+        if (mdbm_internal_do_lock(db,MDBM_LOCK_WRITE,MDBM_LOCK_WAIT,NULL,NULL,NULL) < 0) {
+            free(ents);
+            return -1;
+        }
+        for (j = 0; j < n; ++j) {
+            ents[j].pagenum = hashval_to_pagenum(db,ents[j].hashval);
+        }
+        qsort(ents,n,sizeof(*ents),fetch_multi_cmp);
+        for (j = 0; j < n; ++j) {
+            i = ents[j].idx;
+            stored += store_multi_one(db,keys[i],vals[i],store_flags ? store_flags[i] : flags,
+                                      &status[i],&ents[j].hashval);
+        }
+        mdbm_internal_do_unlock(db,NULL);
+    } else {
+        /* Group by partition, so each partition lock is taken once.  Splits
+         * can move later keys of the batch to another partition; those are
+         * stored on their own once the partition lock is released.
+         */
+        int start = 0;
+
+        for (j = 0; j < n; ++j) {
+            ents[j].pagenum = hashval_to_pagenum(db,ents[j].hashval);
+            ents[j].part = MDBM_PAGENUM_TO_PARTITION(db,ents[j].pagenum);
+        }
+        qsort(ents,n,sizeof(*ents),fetch_multi_cmp);
+        while (start < n) {
+            int part = ents[start].part;
+            mdbm_pagenum_t pagenum = ents[start].pagenum;
+            int end;
+
+            for (end = start+1; end < n && ents[end].part == part; ++end) {
+            }
+            if (mdbm_internal_do_lock(db,MDBM_LOCK_WRITE,MDBM_LOCK_WAIT,NULL,NULL,&pagenum) < 0) {
+                free(ents);
+                return -1;
+            }
+            for (j = start; j < end; ++j) {
+                i = ents[j].idx;
+                if (MDBM_PAGENUM_TO_PARTITION(db,hashval_to_pagenum(db,ents[j].hashval)) != part) {
+                    ents[j].retry = 1;
+                    continue;
+                }
+                stored += store_multi_one(db,keys[i],vals[i],
+                                          store_flags ? store_flags[i] : flags,
+                                          &status[i],&ents[j].hashval);
+                /* A split that needs the db lock can't wait for it while we
+                 * hold the partition lock, so retry out-of-space failures.
+                 * The rest of the group is deferred too, so that records
+                 * with the same key are still stored in array order. */
+                if (status[i] == ENOMEM || status[i] == EOVERFLOW) {
+                    for (; j < end; ++j) {
+                        ents[j].retry = 1;
+                    }
+                }
+            }
+            mdbm_internal_do_unlock(db,NULL);
+            start = end;
+        }
+        /* ents are still sorted by page and then array index, so retries
+         * keep the batch order of each key. */
+        for (j = 0; j < n; ++j) {
+            if (ents[j].retry) {
+                i = ents[j].idx;
+                stored += store_multi_one(db,keys[i],vals[i],
+                                          store_flags ? store_flags[i] : flags,
+                                          &status[i],&ents[j].hashval);
+            }
+        }
+    }
+
+    free(ents);
+    if (journal_commit(db) < 0) {
+        return -1;
+    }
+    return stored;
+}
+
+static int
+count_entries(void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+{
+    uint64_t *count_ptr = (uint64_t *)user;
+    *count_ptr += info->i_page.page_active_entries;
+    return 0;
+}
+
+uint64_t
+mdbm_count_records(MDBM *db)
+{
+    uint64_t db_entry_count = 0;
+
+    if (mdbm_iterate(db, -1, count_entries, 0, &db_entry_count) < 0) {
+        mdbm_logerror(LOG_ERR, 0, "%s: entry count with mdbm_iterate failed", db->db_filename);
+        return -1;
+    }
+
+    return db_entry_count;
+}
+
+
+kvpair
+mdbm_first(MDBM *db)
+{
+    return mdbm_first_r(db,&db->db_iter);
+}
+
+kvpair
+mdbm_first_r(MDBM *db, MDBM_ITER *iter)
+{
+    iter->m_pageno = 0;
+    iter->m_next = -1;
+    return mdbm_next_r(db,iter);
+}
+
+datum
+mdbm_firstkey(MDBM *db)
+{
+    kvpair kv;
+
+    kv = mdbm_first_r(db,&db->db_iter);
+    return kv.key;
+}
+
+datum
+mdbm_firstkey_r(MDBM *db, MDBM_ITER *iter)
+{
+    kvpair kv;
+
+    kv = mdbm_first_r(db,iter);
+    return kv.key;
+}
+
+kvpair mdbm_next(MDBM *db)
+{
+    return mdbm_next_r(db,&db->db_iter);
+}
+
+static kvpair
+next_r(MDBM *db, MDBM_ITER *iter, int one_page)
+{
+    mdbm_pagenum_t pagenum;
+    int index;
+    kvpair kv;
+
+    pagenum = iter->m_pageno;
+    index = (iter->m_next+1)/-2;
+
+    if (index < 0) {
+        index = 0;
+    }
+    while (pagenum <= db->db_max_dirbit) {
+        mdbm_entry_data_t e;
+        mdbm_entry_t* ep;
+
+        if (index == 0) {
+            if (db_is_multi_lock(db) && !mdbm_isowned(db)) {
+                if (mdbm_internal_do_lock(db,MDBM_LOCK_READ,MDBM_LOCK_WAIT,NULL,NULL,&pagenum) != 1) {
+                    memset(&kv,0,sizeof(kv));
+                    return kv;
+                }
+            }
+        } else {
+            if (MDBM_IS_WINDOWED(db)) {
+                if ((ep = set_entry(db,pagenum,index-1,&e)) != NULL) {
+                    if (MDBM_ENTRY_LARGEOBJ(ep)) {
+                        get_kv(db,&e,&kv.key,&kv.val);
+                        release_window_page(db,kv.val.dptr);
+                    }
+                }
+            }
+        }
+
+        if ((ep = set_entry(db,pagenum,index,&e)) != NULL) {
+            while (ep) {
+                if (ep->e_key.match) {
+                    get_kv(db,&e,&kv.key,&kv.val);
+                    iter->m_pageno = pagenum;
+                    iter->m_next = -3 - 2*e.e_index;
+                    return kv;
+                }
+                ep = next_entry(&e);
+            }
+        }
+
+        if (MDBM_IS_WINDOWED(db)) {
+            release_window_page(db,e.e_page);
+        }
+
+        if (one_page) {
+            memset(&kv,0,sizeof(kv));
+            iter->m_pageno = pagenum+1;
+            iter->m_next = 0;
+            return kv;
+        }
+
+        if (db_is_multi_lock(db) && !mdbm_isowned(db)) {
+            mdbm_internal_do_unlock(db,NULL);
+        }
+
+        pagenum++;
+        index = 0;
+    }
+    memset(&kv,0,sizeof(kv));
+    iter->m_pageno = db->db_max_dirbit+1;
+    iter->m_next = -1;
+    return kv;
+}
+
+kvpair
+mdbm_next_r(MDBM *db, MDBM_ITER *iter)
+{
+    return next_r(db,iter,0);
+}
+
+datum
+mdbm_nextkey(MDBM *db)
+{
+    kvpair kv;
+
+    kv = mdbm_next_r(db,&db->db_iter);
+    return kv.key;
+}
+
+datum
+mdbm_nextkey_r(MDBM *db, MDBM_ITER *iter)
+{
+    kvpair kv;
+
+    kv = mdbm_next_r(db,iter);
+    return kv.key;
+}
+
+int
+mdbm_pre_split(MDBM* db, mdbm_ubig_t pages)
+{
+    int dir_shift, n, p;
+    int init_bytes, init_bits;
+    int npages, extra;
+    mdbm_dir_t* dir;
+
+    if (mdbm_count_records(db) > 0) {   /* pre_split requires DB to be empty */
+        mdbm_log(LOG_ERR, "%s: mdbm_pre_split requires an empty DB", db->db_filename);
+        errno = EFBIG;
+        return -1;
+    }
+    if (pages > MDBM_NUMPAGES_MAX || pages < 1) {
+        mdbm_log(LOG_ERR, "%s: mdbm_pre_split invalid page count (%u vs %u max)", 
+            db->db_filename, (unsigned int) pages, MDBM_NUMPAGES_MAX);
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (lock_db(db) < 0) {
+        ERROR();
+        return -1;
+    }
+
+    for (dir_shift = 0, n = 1; n <= pages; dir_shift++, n <<= 1);
+    if (dir_shift > 0) {
+        dir_shift--;
+    }
+    extra = MDBM_NUM_DIR_PAGES(db->db_pagesize,dir_shift,db->db_hdr->h_dbflags);
+    pages += extra;
+    /* fprintf(stderr, "mdbm_pre_split() pages extra:%d total:%d \n", extra, pages); */
+    if (resize(db,dir_shift,pages) < 0) {
+        unlock_db(db);
+        ERROR();
+        return -1;
+    }
+
+#define MDBM_BITS_PER_BYTE      8
+    init_bytes = db->db_max_dirbit / MDBM_BITS_PER_BYTE;
+    init_bits = db->db_max_dirbit % MDBM_BITS_PER_BYTE;
+
+    dir = MDBM_DIR_PTR(db);
+    if (init_bytes) {
+        memset(dir,0xff,init_bytes);
+    }
+    if (init_bits) {
+        int i;
+
+        dir[init_bytes] = 0;
+        for (i = 0; i < init_bits; i++) {
+            mdbm_dir_t* d = dir + init_bytes;
+            *d = (mdbm_dir_t)(*d | (1 << i));
+        }
+    }
+    db->db_hdr->h_dbflags |= MDBM_HFLAG_PERFECT;
+    ++db->db_hdr->h_dir_gen;
+    journal_structural(db);
+    sync_dir(db,NULL);
+
+    p = db->db_hdr->h_last_chunk;
+    npages = MDBM_PAGE_PTR(db,p)->p_num_pages;
+    p += npages;
+    /* fprintf(stderr, "mdbm_pre_split() max_dirbit:%d \n", db->db_max_dirbit); */
+    for (n = 0; n <= db->db_max_dirbit; n++) {
+        mdbm_page_t* page;
+        if (MDBM_GET_PAGE_INDEX(db,n)) {
+            /* fprintf(stderr, "mdbm_pre_split() init(skip) page %d / %d p:%d \n", n, pages, p); */
+            continue;
+        }
+        /* fprintf(stderr, "mdbm_pre_split() init page %d / %d p:%d \n", n, pages, p); */
+        page = MDBM_PAGE_PTR(db,p);
+        MDBM_SET_PAGE_INDEX(db, n, p);
+        page->p_num = n;
+        page->p_type = MDBM_PTYPE_DATA;
+        page->p_flags = 0;
+        page->p_num_pages = 1;
+        page->p_prev_num_pages = npages;
+        page->p_r0 = 0;
+        page->p_r1 = 0;
+        page->p.p_data = 0;
+        npages = 1;
+        init_data_page(db,page);
+        dirty_mark(db,p,1);
+        if (MDBM_IS_WINDOWED(db)) {
+            release_window_page(db,page);
+        }
+        p++;
+    }
+    db->db_hdr->h_last_chunk = p-1;
+
+    unlock_db(db);
+    return 0;
+}
+
+int
+mdbm_set_alignment(MDBM* db, int align)
+{
+    if (lock_db(db) != 1) {
+        return -1;
+    }
+    if ((align != MDBM_ALIGN_8_BITS
+         && align != MDBM_ALIGN_16_BITS
+         && align != MDBM_ALIGN_32_BITS
+         && align != MDBM_ALIGN_64_BITS)
+        || !check_empty(db))
+    {
+        unlock_db(db);
+        errno = EINVAL;
+        return -1;
+    }
+
+    db->db_hdr->h_dbflags = db->db_hdr->h_dbflags | (uint16_t)align;
+    db->db_align_mask = align;
+    unlock_db(db);
+    return 0;
+}
+
+int
+mdbm_set_full_hash(MDBM* db, int enable)
+{
+    if (lock_db(db) != 1) {
+        return -1;
+    }
+    if (!check_empty(db)) {
+        unlock_db(db);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (enable) {
+        db->db_hdr->h_dbflags |= MDBM_HFLAG_FULLHASH;
+        db->db_hashlo_len = sizeof(uint16_t);
+    } else {
+        db->db_hdr->h_dbflags &= ~MDBM_HFLAG_FULLHASH;
+        db->db_hashlo_len = 0;
+    }
+    unlock_db(db);
+    return 0;
+}
+
+int
+mdbm_set_optimistic_reads(MDBM* db, int enable)
+{
+    if (MDBM_IS_RDONLY(db) || MDBM_NOLOCK(db)) {
+        errno = EPERM;
+        return -1;
+    }
+    if (lock_db(db) != 1) {
+        return -1;
+    }
+
+    mdbm_internal_read_seq_leave(db);
+    if (enable) {
+        /* No writer can be in a locked section now, so drop any count left
+         * behind by a writer that died in one. */
+        mdbm_internal_read_seq_reset(db);
+        db->db_hdr->h_dbflags |= MDBM_HFLAG_OPTREAD;
+    } else {
+        db->db_hdr->h_dbflags &= ~MDBM_HFLAG_OPTREAD;
+    }
+    mdbm_internal_read_seq_sync(db);
+    unlock_db(db);
+    return 0;
+}
+
+int
+mdbm_set_page_index(MDBM* db, int slots)
+{
+    int shift = 0;
+    int i;
+
+    if (slots) {
+        for (shift = MDBM_PAGEINDEX_MIN_SHIFT;
+             shift < MDBM_PAGEINDEX_MAX_SHIFT && (1 << shift) < slots;
+             shift++) {
+        }
+        if (slots < 0 || (1 << shift) < slots) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (lock_db(db) != 1) {
+        return -1;
+    }
+    if (MDBM_IS_WINDOWED(db)
+        || (slots && (2 << shift) > db->db_pagesize / 4)
+        || !check_empty(db))
+    {
+        unlock_db(db);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (slots) {
+        db->db_hdr->h_index_shift = (uint8_t)shift;
+        db->db_hdr->h_dbflags |= MDBM_HFLAG_PAGEINDEX;
+    } else {
+        db->db_hdr->h_index_shift = 0;
+        db->db_hdr->h_dbflags &= ~MDBM_HFLAG_PAGEINDEX;
+    }
+    /* Re-lay out the (empty) pages that already exist. */
+    for (i = 0; i <= db->db_max_dirbit; i++) {
+        mdbm_page_t* page;
+        if ((page = pagenum_to_page(db,i,MDBM_PAGE_NOALLOC,MDBM_PAGE_MAP))) {
+            page->p.p_num_entries = 0;
+            init_data_page(db,page);
+            dirty_mark_page(db,page);
+        }
+    }
+    unlock_db(db);
+    return 0;
+}
+
+int
+mdbm_set_lookup_filter(MDBM* db, int enable)
+{
+    int old_dirpages, new_dirpages;
+
+    if (MDBM_IS_RDONLY(db)) {
+        errno = EPERM;
+        return -1;
+    }
+    if (lock_db(db) != 1) {
+        return -1;
+    }
+    if (!enable) {
+        db->db_hdr->h_dbflags &= ~MDBM_HFLAG_FILTER;
+        unlock_db(db);
+        return 0;
+    }
+    if (MDBM_HAS_FILTER(db)) {
+        unlock_db(db);
+        return 0;
+    }
+
+    old_dirpages = MDBM_DB_NUM_DIR_PAGES(db);
+    new_dirpages = MDBM_NUM_DIR_PAGES(db->db_pagesize,db->db_dir_shift,
+                                      db->db_hdr->h_dbflags | MDBM_HFLAG_FILTER);
+    if (new_dirpages > old_dirpages
+        && resize(db,0,db->db_num_pages + new_dirpages - old_dirpages) < 0)
+    {
+        unlock_db(db);
+        return -1;
+    }
+
+    protect_dir(db,0);
+    if (new_dirpages > old_dirpages) {
+        if (grow_chunk(db,0,new_dirpages) < 0) {
+            protect_dir(db,1);
+            unlock_db(db);
+            return -1;
+        }
+        /* Data pages may have moved out of the directory chunk's way. */
+        db->db_hdr->h_dir_gen++;
+        journal_structural(db);
+        sync_dir(db,NULL);
+    }
+
+    filter_rebuild_all(db);
+    db->db_hdr->h_dbflags |= MDBM_HFLAG_FILTER;
+    protect_dir(db,1);
+
+    unlock_db(db);
+    return 0;
+}
+
+
+static int
+mdbm_limit_size_new_common(MDBM* db,
+                           mdbm_ubig_t pages,
+                           mdbm_shake_func_v3 shake,
+                           void *data)
+{
+    int dir_shift;
+    int npages;
+    int want_pages;
+
+    for (dir_shift = 0, npages = 1; npages && (2*npages <= pages); dir_shift++, npages <<= 1);
+    if (!npages) {
+        mdbm_log(LOG_ERR,
+                 "%s: mdbm_limit_size*() maximum pages is too large"
+                 ", existing pages=%d"
+                 ", new limit pages=%u",
+                 db->db_filename, db->db_hdr->h_num_pages, pages);
+        errno = EINVAL;
+        return -1;
+    }
+    want_pages = pages;
+    pages += MDBM_NUM_DIR_PAGES(db->db_pagesize,dir_shift,db->db_hdr->h_dbflags);
+
+    if (lock_db(db) < 0) {
+        return -1;
+    }
+    if (db->db_hdr->h_num_pages > pages) {
+        unlock_db(db);
+        mdbm_log(LOG_ERR,
+                 "%s: existing number of pages is greater than new limit"
+                 ", existing pages=%d"
+                 ", new limit pages=%d",
+                 db->db_filename, db->db_hdr->h_num_pages, pages);
+        errno = EINVAL;
+        return -1;
+    }
+
+    db->db_hdr->h_max_pages = pages;
+    unlock_db(db);
+    db->db_flags = (db->db_flags & ~MDBM_DBFLAG_SHAKE_MASK) | MDBM_DBFLAG_SHAKE_V2;
+    db->db_shake_func = shake;
+    db->db_shake_data = data;
+
+    if (db->db_spillsize
+        && (!db->db_max_dir_shift || db->db_max_dir_shift >= dir_shift)
+        && (want_pages == npages || want_pages - npages < want_pages/20))
+    {
+        mdbm_log(LOG_WARNING,
+                 "WARNING: %s: size limit leaves %s%dK available for large-object storage",
+                 db->db_filename,
+                 (want_pages > npages) ? "just " : "",
+                 (want_pages - npages) * db->db_pagesize / 1024);
+    }
+
+    return 0;
+}
+
+
+/* FIX: There shouldn't be version-specific mdbm_limit_size functions.  */
+int
+mdbm_limit_size_v3 (MDBM* db, mdbm_ubig_t pages,
+                    mdbm_shake_func_v3 shake,
+                    void *data)
+{
+    if (db->db_ver_flag != MDBM_DBVER_3) {
+        mdbm_log(LOG_ERR, "%s: mdbm_limit_size_v3 may only be used with v3 mdbms.",
+                 db->db_filename);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*if (mdbm_limit_size_new_common(db,pages,(mdbm_shake_func)shake,data) < 0) { */
+    if (mdbm_limit_size_new_common(db,pages,shake,data) < 0) {
+        return -1;
+    }
+    db->db_flags = (db->db_flags & ~MDBM_DBFLAG_SHAKE_MASK) | MDBM_DBFLAG_SHAKE_V3;
+    return 0;
+}
+
+int
+mdbm_limit_dir_size(MDBM *db, int pages)
+{
+    int dir_shift;
+    int npages;
+
+    if (db->db_ver_flag != MDBM_DBVER_3) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pages<=0 || pages>MDBM_NUMPAGES_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (dir_shift = 0, npages = 1; 2*npages <= pages; dir_shift++, npages <<= 1);
+
+    if (lock_db_ex(db) < 0) {
+        return -1;
+    }
+
+    if (db->db_hdr->h_dir_shift > dir_shift) {
+        unlock_db(db);
+        errno = EINVAL;
+        return -1;
+    }
+
+    db->db_max_dir_shift = db->db_hdr->h_max_dir_shift = dir_shift;
+    /* XXX should this be calling sync_dir() ? */
+
+    unlock_db(db);
+    return 0;
+}
+
+void dump_mdbm_header(MDBM* db) {
+    fprintf(stderr ,"db_filename     %s\n",           db->db_filename             );
+    fprintf(stderr ,"h_magic       0x%x\n", (unsigned)db->db_hdr->h_magic         );
+    fprintf(stderr ,"h_dbflags       %u\n", (unsigned)db->db_hdr->h_dbflags       );
+    fprintf(stderr ,"h_cache_mode    %u\n", (unsigned)db->db_hdr->h_cache_mode    );
+    fprintf(stderr ,"h_index_shift   %u\n", (unsigned)db->db_hdr->h_index_shift   );
+    fprintf(stderr ,"h_dir_shift     %u\n", (unsigned)db->db_hdr->h_dir_shift     );
+    fprintf(stderr ,"h_hash_func     %u\n", (unsigned)db->db_hdr->h_hash_func     );
+    fprintf(stderr ,"h_max_dir_shift %u\n", (unsigned)db->db_hdr->h_max_dir_shift );
+    fprintf(stderr ,"h_dir_gen       %u\n", (unsigned)db->db_hdr->h_dir_gen       );
+    fprintf(stderr ,"h_pagesize      %u\n", (unsigned)db->db_hdr->h_pagesize      );
+    fprintf(stderr ,"h_num_pages     %u  ", (unsigned)db->db_hdr->h_num_pages     );
+    fprintf(stderr ,"db_num_pages    %u\n", (unsigned)db->db_num_pages            );
+    fprintf(stderr ,"h_max_pages     %u\n", (unsigned)db->db_hdr->h_max_pages     );
+    fprintf(stderr ,"h_spill_size    %u\n", (unsigned)db->db_hdr->h_spill_size    );
+    fprintf(stderr ,"h_last_chunk    %u\n", (unsigned)db->db_hdr->h_last_chunk    );
+    fprintf(stderr ,"h_first_free    %u\n", (unsigned)db->db_hdr->h_first_free    );
+    fprintf(stderr ,"h_read_seq      0x%x 0x%x 0x%x 0x%x\n",
+            (unsigned)db->db_hdr->h_read_seq[0], (unsigned)db->db_hdr->h_read_seq[1],
+            (unsigned)db->db_hdr->h_read_seq[2], (unsigned)db->db_hdr->h_read_seq[3]);
+    fprintf(stderr ,"h_free_gen      %u\n", (unsigned)db->db_hdr->h_free_gen      );
+    /*uint32_t            h_pad4[3];       // unused padding (future expansion) */
+    /*mdbm_hdr_stats_t    h_stats;         // store/fetch/delete statistics */
+}
+
+/* prints out the page direcory 
+void dump_mdbm_directory(MDBM* db) {
+  // TODO 
+}
+*/
+/* Debugging function. Walks from chunk to chunk, dumping info about each one. */
+void dump_chunk_headers(MDBM* db) {
+  int pg = 0;
+  fprintf(stderr, "DUMPING CHUNK HEADERS, pages:%d|%d first_free:%d last_chunk:%d...\n",
+      db->db_num_pages, db->db_hdr->h_num_pages, db->db_hdr->h_first_free,
+      db->db_hdr->h_last_chunk);
+  /* while (pg < db->db_num_pages) { */
+  while (pg < db->db_hdr->h_num_pages) {
+    mdbm_page_t* p = MDBM_PAGE_PTR(db, pg);
+    const char* typ = "????";
+    switch (p->p_type) {
+      case MDBM_PTYPE_FREE: typ = "FREE"; break;
+      case MDBM_PTYPE_DIR : typ = "DIR "; break;
+      case MDBM_PTYPE_DATA: typ = "DATA"; break;
+      case MDBM_PTYPE_LOB : typ = "LOB "; break;
+      default: break;
+    }
+
+    fprintf(stderr, "  Page:%4.4d (%p) type:%s sz:%d, prev_sz:%d p.*:%u \n", pg, (void*)p,
+        typ, p->p_num_pages, p->p_prev_num_pages,  (unsigned)p->p.p_data);
+
+    pg += p->p_num_pages;
+    if (p->p_num_pages < 1) {
+      fprintf(stderr, " INVALID PAGE COUNT, BREAKING...\n");
+      break;
+    }
+  }
+}
+
+/*
+ * One step of compact_db(): moves the DATA/LOB chunk just above the first free
+ * chunk down into it, then coalesces the free chunk left behind with the free
+ * chunk above it (if any), so the free list is consistent between steps.
+ * *moved is incremented by the number of pages moved.
+ * On entry the db should be locked, and signals deferred.
+ * Returns 1 if a chunk was moved, 0 if there was nothing left to move, or -1
+ * on error.  *compacted is set once all the free space is at the end of the db.
+ */
+static int
+compact_db_step(MDBM* db, int* compacted, uint32_t* moved)
+{
+    int merge = 0; /* Could there be adjacent free-pages to merge from the move. */
+
+    *compacted = 0;
+    while (1) {
+      /* free list should be sorted, lowest page first, based on free_chunk() */
+      uint32_t cur = db->db_hdr->h_first_free, next = 0, nextnext = 0;
+      mdbm_page_t *curp = NULL, *nextp = NULL, *nextnextp = NULL;
+      uint32_t cur_pages = 0;
+
+      if (!cur) { /* no free pages */
+        return merge;
+      }
+
+      curp = MDBM_PAGE_PTR(db, cur);
+      cur_pages = curp->p_num_pages;
+      if (cur+cur_pages >= db->db_num_pages) { /* free_list completely compacted */
+        *compacted = 1;
+        return merge;
+      }
+      /* NOTE: this is simple and fairly safe, but potentially slow.
+       * It bubbles down one DATA/LOB page at a time. i.e.
+       *   |--page A --|-- free --|--page B   --|-- free --|
+       * becomes
+       *   |--page A --|--page B   --|-- free  ...  ...  --|
+       * At each step:
+       *   an occupied page is copied downward, 
+       *   page headers are patched (to maintain the implicit linked list)
+       *   the page-table entry is updated
+       *   adjacent free-pages are coalesced
+       *
+       * Moving the highest DATA/LOB page down might be faster,
+       * but breaks when things don't fit in the available gap.
+       * Also, updating page-headers, etc for all affected entries is a mess. 
+       */
+      next = cur + cur_pages;
+      nextp = MDBM_PAGE_PTR(db, next);
+
+      if (nextp->p_type == MDBM_PTYPE_FREE) {
+        /* fprintf(stderr, "MERGING %d and %d\n", cur, next); */
+        /* if we've done some compaction, try to merge any adjacent free pages */
+        if (next > db->db_hdr->h_last_chunk && 0 == nextp->p_num_pages) {
+          /* FIXME MDBM seems to often leave a "phantom" page at the end of the db.
+           * It's a zero-length, free page, which is not on the free list.
+           * Ignore it for now, but we should try to understand why it's present later. */
+          *compacted = 1;
+          return merge;
+        }
+        if (!merge) {
+          /* adjacent free pages should always be coalesced */
+          mdbm_logerror(LOG_ERR, 0, "compact_db(%s) unexpected unmerged page on the freelist"
+              "pagenum=%u page=%p\n", db->db_filename, next, (void*)nextp);
+          errno = EINVAL;
+          return -1;
+        }
+        /* merge-able */
+        /* fprintf(stderr, " old-size:%d (+=%d) \n", curp->p_num_pages, nextp->p_num_pages); */
+        curp->p_num_pages += nextp->p_num_pages;
+        /* fprintf(stderr, " new-size:%d \n", curp->p_num_pages); */
+        curp->p.p_next_free = nextp->p.p_next_free;
+        free_list_changed(db,NULL);
+        dirty_mark(db,cur,1);
+        /* curp->p_prev_num_pages shouldn't change, but the *new* next chunk one should */
+        nextnext = next + nextp->p_num_pages;
+        if (nextnext >= db->db_num_pages) {
+          *compacted = 1;
+          return 1; /* last free chunk... we're done */
+        }
+        nextnextp = MDBM_PAGE_PTR(db, nextnext);
+        nextnextp->p_prev_num_pages = curp->p_num_pages;
+        dirty_mark(db,nextnext,1);
+        return 1;
+      } else if (merge) {
+        /* moved chunk is followed by another occupied one: nothing to coalesce */
+        return 1;
+      } else if ((nextp->p_type == MDBM_PTYPE_DATA) || (nextp->p_type == MDBM_PTYPE_LOB)) {
+        int is_lob = (nextp->p_type == MDBM_PTYPE_LOB) ? 1 : 0;
+        uint32_t next_count = nextp->p_num_pages;
+        uint32_t next_sz = db->db_pagesize * next_count;
+        nextnext = next + next_count;
+        nextnextp = NULL;
+        if (nextnext < db->db_num_pages) {
+          nextnextp = MDBM_PAGE_PTR(db, nextnext);
+        }
+        /* fprintf(stderr, " SWAP(%d): nextnext:%d size:%d  pages(db:%d h:%d)\n", __LINE__,
+            nextnext, nextnextp?nextnextp->p_num_pages:-1, db->db_num_pages,
+            db->db_hdr->h_num_pages);
+        mdbm_check(db, 3, 3); */
+        {
+          /* stash old-page header to patch freelist */
+          mdbm_page_t old_free_h = *curp;
+          mdbm_page_t old_data_h = *nextp;
+          /* DB page index of the resulting free page (cur and next may be different sizes) */
+          uint32_t nu = cur +  next_count; /* the "new" page location */
+          mdbm_page_t* nup  = MDBM_PAGE_PTR(db, nu);
+          /* fprintf(stderr, "SWAPPING %d (sz:%d) and %d (sx:%d), nu=%d next_free:%d\n",
+               cur, cur_pages, next, next_count, nu, curp->p.p_next_free);
+             fprintf(stderr, " SWAP: nextnext:%d size:%d \n",
+               nextnext, (nextnextp ? nextnextp->p_num_pages : -1)); */
+          /* copy it down to lowest free page */
+          memmove((void*)curp, (void*)nextp, next_sz);
+          free_list_changed(db,NULL);
+          /* recreate free header at new location */
+          *nup = old_free_h;
+          nup->p_num = nu; /* gratuitous */
+          /* patch freelist (we're working at the front) */
+          if (db->db_hdr->h_first_free == cur) {
+            db->db_hdr->h_first_free = nu;
+          }
+          /* update the backwards chain */;
+          curp->p_prev_num_pages = old_free_h.p_prev_num_pages;
+          nup->p_prev_num_pages = old_data_h.p_num_pages;
+
+          /* fprintf(stderr, "SWAPPED cur=%d (sz:%d) and nu=%d (sz:%d)\n", */
+          /*    cur, curp->p_num_pages, nu, nup->p_num_pages);*/
+          /* update backwards chain for the chunk after cur and next */
+          if (nextnextp && nextnextp->p_num_pages != 0) {
+            /* fprintf(stderr," SWAP: nextnext:%d size:%d (nu->next_free:%d nxnx->next_free:%d)\n",
+                nextnext, nextnextp->p_num_pages, nup->p.p_next_free, nextnextp->p.p_next_free); */
+            nextnextp->p_prev_num_pages = old_free_h.p_num_pages;
+          }
+
+          if (is_lob) {
+            /* LOB_page->p_num should be the DATA page index that contains the key */
+            fixup_lob_pointer(db, old_data_h.p_num, next, cur);
+          } else {
+            /* patch page-table */
+            MDBM_SET_PAGE_INDEX(db, old_data_h.p_num, cur);
+          }
+          *moved += next_count;
+          /* the moved chunk and the free header after it */
+          dirty_mark(db,cur,next_count + 1);
+          if (nextnextp) {
+            dirty_mark(db,nextnext,1);
+          }
+          if (db->db_hdr->h_last_chunk == next) {
+            /* last chunk can't be free: the space left behind is now past the end */
+            db->db_hdr->h_first_free = nup->p.p_next_free;
+            db->db_hdr->h_last_chunk = cur;
+            *compacted = 1;
+            return 1;
+          }
+          merge = 1;
+        }
+      } else if (nextp->p_type == MDBM_PTYPE_DIR) {
+        /* broken */
+        mdbm_logerror(LOG_ERR,0, "compact_db(%s) encountered a dir-page on the freelist"
+            "pagenum=%u page=%p\n", db->db_filename, next, (void*)nextp);
+        errno = EINVAL;
+        return -1;
+      } else {
+        /* horribly broken */
+        mdbm_logerror(LOG_ERR,0, "compact_db(%s) encountered an unknown-page on the freelist"
+            "pagenum=%u page=%p type=%d\n", db->db_filename, next, (void*)nextp, nextp->p_type);
+        errno = EINVAL;
+        return -1;
+      }
+    }
+}
+
+/*
+ * Releases the space at the end of a compacted db, past its last chunk (or past
+ * its last free chunk, if that is at the end).  Requires the db lock.
+ */
+static int
+compact_db_truncate(MDBM* db)
+{
+    int ret = 0;
+    uint32_t last_page;     /* first page being released */
+    uint32_t last_unfree;   /* last chunk in use */
+    int syspagesz = db->db_sys_pagesize;
+    size_t sys_pages;
+    size_t compact_size;
+
+    if (db->db_hdr->h_first_free) {
+      /* NOTE: we could verify that there is only one free-list chunk */
+      last_page = db->db_hdr->h_first_free;
+      last_unfree = last_page - MDBM_PAGE_PTR(db, last_page)->p_prev_num_pages;
+    } else {
+      last_unfree = db->db_hdr->h_last_chunk;
+      last_page = last_unfree + MDBM_PAGE_PTR(db, last_unfree)->p_num_pages;
+    }
+    if (last_page >= db->db_num_pages) {
+      return 0;
+    }
+    sys_pages = MDBM_NUM_PAGES_ROUNDED(syspagesz, last_page*db->db_pagesize);
+    compact_size = sys_pages * syspagesz;
+
+    /* truncate and munmap trailing pages, */
+    if (set_file_size(db,compact_size) < 0) {
+        mdbm_logerror(LOG_ERR,0,"%s: ftruncate failure in compact_db()",db->db_filename);
+        ret = -1;
+    } else {
+      /* fprintf(stderr, "compact munmapping(%p, %d) compact_size:%d last_page:%d "
+          "sys_pages:%d old_len:%d\n",
+          db->db_base+compact_size, db->db_base_len-compact_size, compact_size, last_page,
+          sys_pages, db->db_base_len); */
+      if (munmap(db->db_base+compact_size,db->db_base_len-compact_size) < 0) {
+        mdbm_logerror(LOG_ERR,0,"%s: munmap() base:%p, len:%llu new:%llu "
+            "failure in compact_db()",
+            db->db_filename, (void*)db->db_base,(unsigned long long)db->db_base_len,
+            (unsigned long long)compact_size);
+        ret = -1;
+        /* fall thru to do damage control.. we've already truncated the file */
+      }
+      /* truncated and unmapped. update db, db->db_hdr,  */
+      db->db_num_pages = db->db_hdr->h_num_pages = last_page;
+      db->db_base_len = compact_size;
+      db->db_hdr->h_first_free = 0;
+      db->db_hdr->h_last_chunk = last_unfree;
+      free_list_changed(db,NULL);
+      /* sync_dir(), is there a better way to notify other users to adjust their map? */
+      db->db_hdr->h_dir_gen++;
+      journal_structural(db);
+      sync_dir(db,NULL);
+    }
+    return ret;
+}
+
+/* De-fragments a db, by moving DATA/LOB chunks down, and merging FREE chunks upward. */
+static int
+compact_db(MDBM* db) {
+    int ret = 0;
+    int compacted = 0; /* Has free space been created (to truncate) at the end of the DB? */
+    uint32_t moved = 0;
+    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
+      mdbm_log(LOG_WARNING,"%s: compact_db() doesn't support MEMORY-ONLY",
+          db->db_filename);
+      return -1;
+    }
+    if (MDBM_IS_WINDOWED(db)) {
+      mdbm_log(LOG_WARNING,"%s: compact_db() doesn't support WINDOWED MODE",
+          db->db_filename);
+      return -1;
+    }
+
+    mdbm_lock(db);
+
+    /* compact mdbm by moving occupied pages down (low VMA), so the free ones 
+     *   are highest (high VMA) (patching the page_table as we go).
+     *   Note: LOB/OVERSIZE chunks must move as a contiguous block. */
+    MDBM_SIG_DEFER;
+    while ((ret = compact_db_step(db,&compacted,&moved)) > 0) {
+    }
+    MDBM_SIG_ACCEPT;
+
+    if ((compacted || moved) && !ret) {
+      ret = compact_db_truncate(db);
+    }
+
+    mdbm_unlock(db);
+    return ret;
+}
+
+/* Copies an existing entry to a new page.
+ * 'page' is the destination page. 
+ * 'key' and 'val' are the key and value of the entry to be copied.
+ * 'hashval' is it's pre-calculated hash-value.
+ * 'entry' is a pointer to the pre-existing entry on the old page.
+ * 'oldpage' is the page where the entry already exists.
+ * On entry, the DB should be locked, and signals deferred. 
+ */
+int
+copy_page_entry(MDBM *db, mdbm_page_t* page, mdbm_hashval_t hashval, const datum* key, const datum* val, mdbm_entry_t* entry, mdbm_page_t* oldpage)
+{
+    int ksize, vsize, kvsize, esize;
+    mdbm_entry_t* freep = NULL;
+    int free_index = -1;
+    char* v;
+    if (page->p_type != MDBM_PTYPE_DATA) {
+      mdbm_log(LOG_ERR, "%s copy_page_entry() FAIL bad page-type %d (hash:%d)\n",
+          db->db_filename, page->p_type, hashval);
+      /* ensure data pagetype */
+      errno=EINVAL;
+      return -1;
+    }
+    if (page->p_num_pages != 1) {
+      mdbm_log(LOG_ERR, "%s copy_page_entry() FAIL oversize page %d sub-pages (hash:%d)\n",
+          db->db_filename, page->p_num_pages, hashval);
+      /* punt for oversize pages */
+      errno=EINVAL;
+      return -1;
+    }
+
+    /* check fit, include alignment bytes */
+    ksize = MDBM_KEY_ALIGN_LEN(db,key->dsize);
+    vsize = MDBM_ALIGN_LEN(db,val->dsize);
+    if (MDBM_DB_CACHEMODE(db)) {
+        vsize += MDBM_CACHE_ENTRY_T_SIZE;
+    }
+    kvsize = ksize + vsize;
+    esize = kvsize + MDBM_ENTRY_T_SIZE;
+    if (MDBM_ENTRY_LARGEOBJ(entry)) {
+      int delta = sizeof(mdbm_entry_lob_t) - vsize;
+      /* mdbm_entry_lob_t *lob_ent = MDBM_LOB_PTR1(db, oldpage, entry);
+         fprintf(stderr, "copy_page_entry() (page %d->%d) copying LOB key.size:%d, lob_page:%d\n",
+            oldpage->p_num, page->p_num, val->dsize, lob_ent->l_pagenum); */
+      /* adjust size, actual LOB data goes into another chunk of pages */
+      esize += delta;
+      kvsize += delta;
+    }
+    if (esize > MDBM_PAGE_FREE_BYTES(page)) {
+      mdbm_log(LOG_ERR, "%s copy_page_entry() FAIL insufficient space (%d vs %d) (hash:%d)\n",
+          db->db_filename, esize, MDBM_PAGE_FREE_BYTES(page), hashval);
+      errno=ENOMEM;
+      return -1;
+    }
+
+    free_index = page->p.p_num_entries++;
+    freep = MDBM_ENTRY(page,free_index);
+    MDBM_INIT_TOP_ENTRY(freep+1,freep[0].e_offset - kvsize);
+
+    freep->e_offset -= MDBM_KEY_ALIGN_LEN(db,key->dsize);
+    freep->e_flags = 0;
+    freep->e_key.key.len = key->dsize;
+    freep->e_key.key.hash = hashval;
+    if (MDBM_HAS_FILTER(db)) {
+        filter_add(db,page->p_num,freep->e_key.match);
+    }
+    if (MDBM_HAS_PAGE_INDEX(db)) {
+        page_index_insert(db,page,free_index);
+    }
+
+    /* fprintf(stderr, "copy_page_entry() adding at index:%d (hash:%d (%d:%d), size:%d)\n", free_index, freep->e_key.key.hash, hashval, hashval>>16, freep->e_key.key.len); */
+
+    memcpy(MDBM_KEY_PTR1(page,freep),key->dptr,key->dsize);
+    if (db->db_hashlo_len) {
+        set_entry_hashlo(page,freep,(uint16_t)entry_hashval(db,oldpage,entry));
+    }
+    MDBM_SET_PAD_BYTES(freep,MDBM_ALIGN_PAD_BYTES(db,val->dsize));
+    v = MDBM_VAL_PTR1(db,page,freep);
+    if (MDBM_ENTRY_LARGEOBJ(entry)) {
+      mdbm_entry_lob_t *newlob, *oldlob;
+      mdbm_page_t *lob_chunk;
+      /* set flags and handle value specially */
+      freep->e_flags = entry->e_flags;
+      newlob = MDBM_LOB_PTR1(db, page, freep);
+      oldlob = MDBM_LOB_PTR1(db, oldpage, entry);
+      *newlob = *oldlob;
+      lob_chunk = MDBM_PAGE_PTR(db, oldlob->l_pagenum);
+      /* patch data page index on lob chunk starting page */
+      lob_chunk->p_num = page->p_num;
+      dirty_mark(db,oldlob->l_pagenum,1);
+    } else if (MDBM_DB_CACHEMODE(db)) {
+      memcpy(v,val->dptr-MDBM_CACHE_ENTRY_T_SIZE,vsize);
+    } else {
+      memcpy(v,val->dptr,val->dsize);
+    }
+    dirty_mark_page(db,page);
+    return 0;
+}
+
+
+/* compress_tree data structure for merging pages (source entries copied to destination) */
+typedef struct mdbm_merge_data {
+  MDBM* db;               /* The database being iterated over */
+  mdbm_page_t* src_page;  /* Pointer to the beginning of the source page */
+  mdbm_page_t* dst_page;  /* Pointer to the beginning of the destination page */
+  int src_index;          /* Index of the source page */
+  int dst_index;          /* Index of the source page */
+  int retcode;            /* return value, 0 for success */
+} mdbm_merge_data_t;
+
+static int
+merge_page_iter (void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+{
+  int ret;
+  mdbm_merge_data_t* data = (mdbm_merge_data_t*) user;
+  mdbm_entry_t* entry = MDBM_ENTRY(data->src_page, info->i_entry.entry_index);
+
+  /* MDBM* db = data->db;
+     mdbm_hashval_t h = MDBM_HASH_VALUE(db,kv->key.dptr,kv->key.dsize);
+     int pagenum = hashval_to_pagenum(db, h);
+     int realpage = MDBM_GET_PAGE_INDEX(db, pagenum);
+     fprintf(stderr, "merge_page_iter() moving key [%s] hash:%d(%d) from %di to %di "
+     "(expected %di->%dp) \n", kv->key.dptr, entry->e_key.key.hash, (int)h,
+     data->src_index, data->dst_index, pagenum, realpage); */
+  /* assert(realpage == data->dst_index) */
+
+  ret = copy_page_entry(data->db, data->dst_page, entry->e_key.key.hash, &kv->key, &kv->val,
+      entry, data->src_page);
+  if (ret) {
+    data->retcode = ret;
+  }
+  return ret;
+}
+
+/* Internal function for compress_tree. 
+ * Joins two DATA pages into a single page, if possible, by coping entry-by-entry
+ * from the page at src_index to the page at dst_index.
+ * If the merge fails, we unroll by restoring the old entry-count on the destination page.
+ * NOTE: On entry signals should be deferred, the DB locked, and the destination
+ * page should be un-fragmented. 
+ */
+int
+merge_page(MDBM *db, int dest_index, int src_index)
+{
+    mdbm_page_t* srcpg;
+    mdbm_page_t* dstpg;
+    mdbm_merge_data_t data  = {NULL, NULL, NULL, -1, -1, 0};
+    int ret = 0;
+    int need, avail;
+
+    srcpg = MDBM_PAGE_PTR(db, MDBM_GET_PAGE_INDEX(db,src_index));
+    dstpg = MDBM_PAGE_PTR(db, MDBM_GET_PAGE_INDEX(db,dest_index));
+    if (!srcpg) {
+        mdbm_log(LOG_ERR, "%s: compress_tree() merge_page srcpg is NULL, src:%d dst:%d\n",
+            db->db_filename, src_index, dest_index);
+        /* fprintf(stderr, "compress_tree() merge_page FAILED, bad src (%d,%d)\n",
+           src_index, dest_index); */
+        errno = ENOMEM;
+        return -1;
+    }
+    if (!dstpg) {
+        mdbm_log(LOG_ERR, "%s: compress_tree() merge_page dstpg is NULL, src:%d dst:%d\n",
+            db->db_filename, src_index, dest_index);
+        /* fprintf(stderr, "compress_tree() merge_page FAILED, bad dst (%d,%d)\n",
+           src_index, dest_index); */
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (srcpg != dstpg) { /* ensure the pages are actually different */
+      /* check for fit first */
+      avail = MDBM_PAGE_FREE_BYTES(dstpg);
+      need = MDBM_DATA_PAGE_END(db,srcpg) - MDBM_PAGE_FREE_BYTES(srcpg);
+      if (need <= avail) {
+        uint32_t old_entry_count = srcpg->p.p_num_entries;
+        data.db=db;
+        data.src_page=srcpg;
+        data.dst_page=dstpg;
+        data.src_index=src_index;
+        data.dst_index=dest_index;
+        mdbm_iterate(db,src_index,merge_page_iter,MDBM_ITERATE_ENTRIES,&data);
+        ret = data.retcode;
+        if (ret) {
+          /* "delete" the newly added entries. */
+          srcpg->p.p_num_entries = old_entry_count;
+          mdbm_log(LOG_ERR, "%s: compress_tree() merge_page action FAILED (%d,%d)\n",
+              db->db_filename, src_index, dest_index);
+        }
+
+      } else {
+        mdbm_log(LOG_ERR, "%s: compress_tree() merge_page FAILED, "
+            "insufficient space:%d,%d  pages:%d,%d\n",
+            db->db_filename, need, avail, src_index, dest_index);
+        ret = -1;
+      }
+    } else {
+      /* left and right is the same page, log error */
+      mdbm_log(LOG_ERR, "%s: compress_tree() merge_page src_pg == dst_pg (%d,%d)\n",
+          db->db_filename, src_index, dest_index);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Drops the deepest directory level, once no page on it is in use, by moving
+ * the page table (and lookup filters) down to match the smaller directory.
+ * On entry the db should be locked, and signals deferred.
+ */
+static void
+drop_dir_level(MDBM* db)
+{
+    int old_dirshift = db->db_dir_shift;
+    int new_dirshift = old_dirshift - 1;
+    mdbm_ptentry_t* old_ptable = MDBM_PTABLE_PTR(MDBM_DIR_PTR(db),old_dirshift);
+
+    protect_dir(db,0);
+
+    /* adjust handle */
+    db->db_dir_shift = new_dirshift;
+    /*db->db_max_dir_shift */
+    db->db_max_dirbit = MDBM_HASH_MASK(new_dirshift);
+
+    /* adjust header */
+    db->db_hdr->h_dir_shift = (uint8_t)new_dirshift;
+    /*db->db_hdr->h_max_dir_shift */
+
+    /* copy down page-table */
+    db->db_ptable = MDBM_PTABLE_PTR(MDBM_DIR_PTR(db),new_dirshift);
+    memmove(db->db_ptable, old_ptable, MDBM_PTABLE_SIZE(new_dirshift));
+
+    if (MDBM_HAS_FILTER(db)) {
+        /* Lookup filters follow the page table, so they move down with it. */
+        memmove(db->db_base + MDBM_FILTER_OFFSET(new_dirshift),
+                db->db_base + MDBM_FILTER_OFFSET(old_dirshift),
+                MDBM_FILTER_SIZE(new_dirshift));
+    }
+
+    ++db->db_hdr->h_dir_gen;
+    journal_structural(db);
+    sync_dir(db, db->db_hdr);
+
+    /* NOTE: could free trailing dir_page(s) if we're using less */
+    protect_dir(db,1);
+}
+
+/* 
+ * This routine attempts to recursively fold DATA pages from the current size to the
+ * next lower power-of-two size.
+ * At each step, it pre-calculates whether the folds will succeed in an attempt
+ * to avoid needing to unroll changes.
+ * If we succeed in folding, then we attempt to de-fragment the resulting 
+ * free-pages via compact_db().
+ * */
+int
+merge_all_pages(MDBM *db)
+{
+    int bits = db->db_max_dirbit;
+    int lvl, left, right, lp, rp;
+    /*int rh, lh;*/
+    int pages, halfpages;
+    int cur, ret = 0;
+    int do_sync = 0;
+    int do_compact = 0;
+    int can_fold = 0;
+
+    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
+      mdbm_log(LOG_WARNING,"%s: merge_all_pages() doesn't support MEMORY-ONLY",
+          db->db_filename);
+      return -1;
+    }
+    if (MDBM_IS_WINDOWED(db)) {
+      mdbm_log(LOG_WARNING,"%s: merge_all_pages() doesn't support WINDOWED MODE",
+          db->db_filename);
+      return -1;
+    }
+
+    mdbm_lock(db);
+    for (lvl=1; lvl<=((bits)>>1); lvl<<=1) {}
+    /* for (lvl = bits; (lvl>1) && (ret==0); lvl>>=1) { */
+    for (; (lvl>1) && (ret==0); lvl>>=1) {
+        /* Try to iteratively fold down number of pages by powers of 2. */
+        pages = lvl<<1;
+        halfpages = pages/2;
+        /* fprintf(stderr, "compress_tree() level:%d (bits:%d) "
+            "pages:%d half:%d num_pages:%d max_dirbit:%d\n",
+            lvl, bits, pages, halfpages, db->db_num_pages, db->db_max_dirbit); */
+        /* verify fit for all pages on this level */
+        can_fold = 1;
+        for (left=0; left<halfpages; ++left) {
+            mdbm_page_t *srcpg, *dstpg;
+            right = left + halfpages;
+            lp = MDBM_GET_PAGE_INDEX(db,left);
+            rp = MDBM_GET_PAGE_INDEX(db,right);
+            srcpg = MDBM_PAGE_PTR(db,rp);
+            dstpg = MDBM_PAGE_PTR(db,lp);
+            if (srcpg && dstpg) {
+              if (srcpg->p_num_pages != 1 || dstpg->p_num_pages != 1 ) {
+                /* punt for any oversize pages */
+                can_fold = 0;
+                break;
+              } else {
+                /* pack all entries on the pages first */
+                wring_page(db, srcpg);
+                wring_page(db, dstpg);
+                {
+                  int avail = MDBM_PAGE_FREE_BYTES(dstpg);
+                  int need = MDBM_DATA_PAGE_END(db,srcpg) - MDBM_PAGE_FREE_BYTES(srcpg);
+                  if (need >= avail || need<0 || avail<0) {
+                    /* fprintf(stderr, "compress_tree() CAN'T FOLD (space %d vs %d) "
+                        "level:%d (bits:%d) pages:%d half:%d num_pages:%d max_dirbit:%d\n",
+                        need, avail,
+                        lvl, bits, pages, halfpages, db->db_num_pages, db->db_max_dirbit); */
+                    can_fold = 0;
                     break;
+                  }
                 }
-                if (free_dir_space && size > esize && (!free_size || size < free_size)) {
-                    /* Bigger deleted size found.  Continue looking. */
-                    free_index = i;
-                    free_size = size;
-                }
+              }
+            } else {
+              can_fold = 0;
+              break;
+            }
+        }
+        if (!can_fold) {
+          break;
+        }
+        for (left=0; left<halfpages; ++left) {
+            right = left + halfpages;
+            /* skip if not split */
+            /* lh = hashval_to_pagenum(db, left); rh = hashval_to_pagenum(db, right); */
+            lp = MDBM_GET_PAGE_INDEX(db,left);
+            rp = MDBM_GET_PAGE_INDEX(db,right);
+            /* fprintf(stderr, "compress_tree() attempting to merge %d+%d (lp:%d, rp:%d)\n",
+               left, right, lp, rp); */
+            if (lp == rp) {  /* they map to the same physical page already */
+              /* fprintf(stderr, "compress_tree() MERGE SKIPPED %d+%d (lp:%d, rp:%d)\n",
+                 left, right, lp, rp); */
+              continue;
+            }
+            if (rp >= db->db_num_pages || right>db->db_max_dirbit) { /* not really in use */
+              /* fprintf(stderr, "compress_tree() MERGE SKIPPED2 %d+%d (lp:%d, rp:%d) "
+                "num_pages:%d max_dirbit:%d\n", left, right, lp, rp,
+                db->db_num_pages, db->db_max_dirbit); */
+
+              continue;
+            }
+            /* Don't allow signals to interrupt mid merge. */
+            MDBM_SIG_DEFER;
+            cur = merge_page(db, left, right);
+            if (cur) {
+              mdbm_log(LOG_ERR, "compress_tree() MERGE FAILED pages:%d+%d (lp:%d, rp:%d)\n",
+                  left, right, lp, rp);
+              ret = -1;
+            } else {
+               /* fprintf(stderr, "compress_tree() MERGE SUCCEEDED %d+%d (lp:%d, rp:%d)\n",
+                  left, right, lp, rp); */
+              do_sync = 1;
+              MDBM_SET_PAGE_INDEX(db, right, lp);
+              /* clear dirbits, so we don't have to re-split if resize() fails */
+              MDBM_CLEAR_DIR_BIT(db, right);
+              db->db_dir_flags &= ~MDBM_HFLAG_PERFECT;
+              /* page is merged out, release it. */
+              free_chunk(db, rp, NULL);
+              assert(MDBM_DIR_BIT(db, left));
+            }
+            MDBM_SIG_ACCEPT;
+        }
+        if (ret) {
+          mdbm_log(LOG_ERR, "%s compress_tree() LEVEL %d FAILED \n", db->db_filename, lvl);
+          break;
+        } else {
+          MDBM_SIG_DEFER;
+          /* fprintf(stderr, "compress_tree() LEVEL %d SUCCEEDED \n", lvl); */
+          /* DROP one directory level */
+          do_compact = 1;
+          db->db_dir_flags |= MDBM_HFLAG_PERFECT;
+          drop_dir_level(db);
+          MDBM_SIG_ACCEPT;
+        }
+    }
+
+    if (do_sync) {
+      ++db->db_hdr->h_dir_gen;
+      journal_structural(db);
+      sync_dir(db,NULL);
+    }
+
+    if (do_compact) {
+      int rret=0;
+      /* fprintf(stderr, "DOING COMPACTION\n");*/
+      /* NOTE: we don't compact the directory or pagetable.
+       * Ideally, " resize(db, lvl-1, halfpages); "
+       * would do this, but it doesn't work for shrinking.
+       */
+      rret = compact_db(db);
+      if (rret) {
+        mdbm_logerror(LOG_ERR,0, "%s: compact_db() failed", db->db_filename);
+        errno = ENOMEM;
+        ret = -1;
+      }
+    } else {
+      /* fprintf(stderr, "SKIPPING COMPACTION\n");*/
+    }
+
+
+    CHECK_DB(db);
+    mdbm_unlock(db);
+    return ret;
+}
+
+
+
+void
+mdbm_compress_tree(MDBM *db)
+{
+    /* XXX
+    mdbm_log(LOG_CRIT, "%s: unimplemented mdbm_compress_tree",
+             db->db_filename);
+    abort();
+    */
+    int ret = merge_all_pages(db);
+    if (ret) {
+      mdbm_logerror(LOG_ERR,0, "%s: mdbm_compress_tree failed: merge_all_pages() returned %d\n", db->db_filename, ret);
+    }
+
+}
+
+/*
+ * Merges the data page for 'left' with its sibling at the given directory
+ * level, if both are leaves and the merged entries fit on one page.
+ * On entry the db should be locked.
+ * Returns 1 if the pages were merged, 0 if they were skipped, or -1 on error.
+ */
+static int
+merge_sibling_pages(MDBM* db, int level, uint32_t left)
+{
+    uint32_t right = left + (1U << (level - 1));
+    int parent = 0;
+    int child;
+    int lp, rp;
+    int i;
+    mdbm_page_t* srcpg;
+    mdbm_page_t* dstpg = NULL;
+    mdbm_entry_t* ep;
+
+    /* trie node whose split created left and right */
+    for (i = 0; i < level - 1; i++) {
+        parent = (parent << 1) + ((left >> i) & 1) + 1;
+    }
+    if (!MDBM_DIR_BIT(db,parent)) {
+        return 0;
+    }
+    child = (parent << 1) + 1;
+    if (child < db->db_max_dirbit
+        && (MDBM_DIR_BIT(db,child) || MDBM_DIR_BIT(db,child + 1))) {
+        return 0;   /* split further; merge deeper pages first */
+    }
+
+    if ((rp = MDBM_GET_PAGE_INDEX(db,right)) != 0) {
+        srcpg = MDBM_PAGE_PTR(db,rp);
+        if (srcpg->p_num_pages != 1) {
+            return 0;
+        }
+        if ((lp = MDBM_GET_PAGE_INDEX(db,left)) != 0) {
+            int need, avail;
+            dstpg = MDBM_PAGE_PTR(db,lp);
+            if (dstpg->p_num_pages != 1) {
+                return 0;
+            }
+            /* pack all entries on the pages first */
+            wring_page(db,srcpg);
+            wring_page(db,dstpg);
+            avail = MDBM_PAGE_FREE_BYTES(dstpg);
+            need = MDBM_DATA_PAGE_END(db,srcpg) - MDBM_PAGE_FREE_BYTES(srcpg);
+            if (need >= avail || need < 0 || avail < 0) {
+                return 0;
             }
         }
-        if (free_size) {
-            if (free_size > esize) {
-                int move_count = page->p.p_num_entries - free_index;
-                if (move_count > 0) {
-                    /* Shuffle the entries above free_index up 1 index entry,
-                     * and use this entry. */
-                    freep = MDBM_ENTRY(page,free_index);
-                    memmove(freep+2,freep+1,move_count*MDBM_ENTRY_T_SIZE);
-                    freep[1].e_key.match = 0;
-                    freep[1].e_flags = 0;
-                    freep[1].e_offset = freep[0].e_offset - kvsize;
-                }
-                page->p.p_num_entries++; /* BUG? if move count <= 0 */
+    }
+
+    /* Don't allow signals to interrupt mid merge. */
+    MDBM_SIG_DEFER;
+    if (rp && dstpg) {
+        if (merge_page(db,left,right)) {
+            MDBM_SIG_ACCEPT;
+            mdbm_log(LOG_ERR,"%s: mdbm_compact_step() merge failed, pages:%u+%u",
+                     db->db_filename,left,right);
+            return -1;
+        }
+        MDBM_SET_PAGE_INDEX(db,right,0);
+        free_chunk(db,rp,NULL);
+    } else if (rp) {
+        /* left was never allocated: the right page simply becomes the left page */
+        MDBM_SET_PAGE_INDEX(db,left,rp);
+        MDBM_SET_PAGE_INDEX(db,right,0);
+        srcpg->p_num = left;
+        for (ep = MDBM_ENTRY(srcpg,0); ep->e_key.match != MDBM_TOP_OF_PAGE_MARKER; ep++) {
+            if (ep->e_key.match && MDBM_ENTRY_LARGEOBJ(ep)) {
+                MDBM_PAGE_PTR(db,MDBM_LOB_PTR1(db,srcpg,ep)->l_pagenum)->p_num = left;
+                dirty_mark(db,MDBM_LOB_PTR1(db,srcpg,ep)->l_pagenum,1);
             }
-            break;
         }
-        free_bytes = MDBM_PAGE_FREE_BYTES(page) + del_bytes;
-        if (esize <= free_bytes) {
-            wring_page(db,page);
-            free_index = -1;
-            break;
+        if (MDBM_HAS_FILTER(db)) {
+            filter_rebuild(db,srcpg);
         }
-        if (pass > 1) {
-            errno = ENOMEM;
-            ret = -1;
-            goto store_ret;
+        dirty_mark(db,rp,1);
+    }
+    MDBM_CLEAR_DIR_BIT(db,parent);
+    db->db_hdr->h_dbflags &= ~MDBM_HFLAG_PERFECT;
+    db->db_hdr->h_dir_gen++;
+    journal_structural(db);
+    sync_dir(db,NULL);
+    MDBM_SIG_ACCEPT;
+    return 1;
+}
+
+/* Returns whether no node above the deepest directory level is split. */
+static int
+dir_level_unused(MDBM* db)
+{
+    int first = (1 << (db->db_dir_shift - 1)) - 1;
+    int last = (1 << db->db_dir_shift) - 2;
+    int i;
+
+    for (i = first; i <= last; i++) {
+        if (MDBM_DIR_BIT(db,i)) {
+            return 0;
         }
+    }
+    for (i = first + 1; i <= db->db_max_dirbit; i++) {
+        if (MDBM_GET_PAGE_INDEX(db,i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-        if ((newpage = split_page(db,hashval)) == NULL) {
-            if (errno == EPERM) {
-                int lock_tries = 0;
-                static const int MAX_STORE_LOCK_TRIES = 2;
-                /* Must upgrade to db lock because split page will almost always be
-                   in a different partition. */
-                for (;;) {
-                    if ((key_locked && trylock_db(db) == 1)
-                        || (!key_locked && lock_db(db) ==1))
-                    {
-                        if ((newpage = split_page(db,hashval)) == NULL) {
-                            unlock_db(db);
-                        } else {
-                            db_locked = 1;
-                        }
-                        break;
-                    }
-                    if (errno != EDEADLK
-                        || db_multi_part_locked(db)
-                        || ++lock_tries >= MAX_STORE_LOCK_TRIES)
-                    {
-                        break;
-                    }
-                    if (key_locked) {
-                        mdbm_internal_do_unlock(db,key);
-                        key_locked = 0;
-                    }
-                    {
-                        struct timespec tv = { 0, 1000000 };
-                        nanosleep(&tv,NULL);
-                    }
-                    mdbm_log(LOG_NOTICE,
-                             "%s: retrying store after page-split deadlock avoidance (page=%d)",
-                             db->db_filename,pagenum);
+int
+mdbm_compact_step(MDBM* db, uint64_t budget_usec, uint32_t budget_pages,
+                  mdbm_compact_cursor_t* cursor)
+{
+    uint64_t start;
+    uint32_t pages = 0;
+    int ret = 0;
+
+    if (!db || !cursor) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) || MDBM_IS_WINDOWED(db)) {
+        mdbm_log(LOG_WARNING,"%s: mdbm_compact_step() doesn't support %s",
+                 db->db_filename,MDBM_IS_WINDOWED(db) ? "WINDOWED MODE" : "MEMORY-ONLY");
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (cursor->phase == MDBM_COMPACT_DONE) {
+        return 0;
+    }
+    if (mdbm_lock(db) != 1) {
+        return -1;
+    }
+
+    start = get_gtod_usec();
+    while (ret == 0 && cursor->phase != MDBM_COMPACT_DONE
+           && (!budget_pages || pages < budget_pages)
+           && (!budget_usec || !pages || get_gtod_usec() - start < budget_usec))
+    {
+        if (cursor->phase == MDBM_COMPACT_MERGE) {
+            /* (re)start at the deepest level if the directory has grown or shrunk */
+            if (!cursor->level || cursor->level > db->db_dir_shift) {
+                cursor->level = db->db_dir_shift;
+                cursor->next = 0;
+            }
+            if (cursor->level < 1) {
+                cursor->phase = MDBM_COMPACT_DEFRAG;
+            } else if (cursor->next < (1U << (cursor->level - 1))) {
+                int r = merge_sibling_pages(db,cursor->level,cursor->next++);
+                if (r < 0) {
+                    ret = -1;
+                } else {
+                    cursor->pages_merged += r;
+                }
+                ++pages;
+            } else {
+                /* end of this level */
+                if (cursor->level == db->db_dir_shift && dir_level_unused(db)) {
+                    MDBM_SIG_DEFER;
+                    drop_dir_level(db);
+                    MDBM_SIG_ACCEPT;
                 }
+                if (--cursor->level < 1) {
+                    cursor->phase = MDBM_COMPACT_DEFRAG;
+                }
+                cursor->next = 0;
             }
-        }
-        if (!newpage) {
-            page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
-            if ((!db->db_shake_func || shake_page(db,page,key,val,free_bytes,esize) < 0)
-                && (!MDBM_DB_CACHEMODE(db)
-                    || cache_evict(db,page,key,val,free_bytes,esize,0) < esize)
-                && expand_page(db,page,pagenum) < 0)
-            {
-                errno = ENOMEM;
+        } else {
+            int compacted;
+            uint32_t moved = 0;
+            int r;
+
+            MDBM_SIG_DEFER;
+            r = compact_db_step(db,&compacted,&moved);
+            MDBM_SIG_ACCEPT;
+            cursor->chunks_moved += (r > 0);
+            cursor->pages_moved += moved;
+            pages += moved ? moved : 1;
+            if (r < 0) {
                 ret = -1;
-                goto store_ret;
+            } else if (!r) {
+                if ((compacted || cursor->chunks_moved) && compact_db_truncate(db) < 0) {
+                    ret = -1;
+                }
+                cursor->phase = MDBM_COMPACT_DONE;
             }
-            page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
-            pass++;
-        } else {   /* newpage!=NULL, so new page has been allocated */
-            page = newpage;
-            pagenum = newpage->p_num;
         }
     }
+    cursor->usec += get_gtod_usec() - start;
 
-    if (want_large) {
-        mdbm_page_t* alloc_lob = NULL;
-        uint32_t alloc_npages = MDBM_DB_NUM_PAGES_ROUNDED(db,val->dsize+MDBM_PAGE_T_SIZE);
-        int ntries = 0;
-        static const int MAX_TRIES = 100;
+    mdbm_unlock(db);
+    if (ret < 0) {
+        return -1;
+    }
+    return (cursor->phase == MDBM_COMPACT_DONE) ? 0 : 1;
+}
 
-        if (mdbm_internal_lock(db) < 0) {
-#ifdef DEBUG
-        mdbm_log(LOG_DEBUG, "Cannot mdbm_internal_lock when storing large object");
-#endif
-            ret = -1;
-            goto store_ret;
+/*
+ * Returns the free space on a data page, including space held by deleted entries.
+ */
+static int
+page_reclaimable_bytes(MDBM* db, mdbm_page_t* page)
+{
+    int free_bytes = MDBM_PAGE_FREE_BYTES(page);
+    int i;
+
+    for (i = 0; i < page->p.p_num_entries; i++) {
+        mdbm_entry_t* ep = MDBM_ENTRY(page,i);
+        if (!ep->e_key.match) {
+            free_bytes += MDBM_ENTRY_SIZE(db,ep);
         }
-        while (ntries < MAX_TRIES) {
-            if ((alloc_lob = (mdbm_page_t*)alloc_chunk(db,MDBM_PTYPE_LOB,alloc_npages,
-                                                       0,0,MDBM_PAGE_MAP,MDBM_ALLOC_CAN_UNLOCK))
-                != NULL)
-            {
-                break;
-            }
-            /* alloc_chunk releases internal lock if allocation fails */
-            if (mdbm_internal_lock(db) < 0) {
-#ifdef DEBUG
-                mdbm_log(LOG_DEBUG, "Cannot mdbm_internal_lock after alloc_chunk");
-#endif
-                ret = -1;
-                goto store_ret;
-            }
+    }
+    return free_bytes;
+}
 
-            if (MDBM_DB_CACHEMODE(db)) {
-                mdbm_page_t* p = page;
-                mdbm_hashval_t h = hashval;
-                mdbm_pagenum_t pnum = pagenum;
-                uint32_t alloc_bytes = alloc_npages*db->db_pagesize;
-                uint32_t free_bytes = 0;
+int
+mdbm_maintain(MDBM* db, int min_free_pct, uint32_t budget_pages, uint32_t* next)
+{
+    uint32_t pagenum, npages, examined;
+    int min_free;
+    int nsplit = 0;
 
-                while (ntries < MAX_TRIES) {
-                    ++ntries;
-                    if ((free_bytes = cache_evict(db,p,key,val,free_bytes,alloc_bytes,1))
-                        >= alloc_bytes)
-                    {
-                        break;
-                    }
-                    h = MDBM_HASH_VALUE(db,&h,sizeof(h));
-                    pnum = hashval_to_pagenum(db,h);
-                    p = pagenum_to_page(db,pnum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
-                }
-                if (free_bytes >= alloc_bytes && ntries < MAX_TRIES) {
-                    continue;
-                }
-            }
+    if (!db || !next || min_free_pct < 1 || min_free_pct > 99) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (MDBM_IS_RDONLY(db)) {
+        errno = EPERM;
+        return -1;
+    }
+    if (MDBM_IS_WINDOWED(db)) {
+        mdbm_log(LOG_WARNING,"%s: mdbm_maintain() doesn't support WINDOWED MODE",
+                 db->db_filename);
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (mdbm_lock(db) != 1) {
+        return -1;
+    }
 
-            mdbm_internal_unlock(db);
-#ifdef DEBUG
-            mdbm_log(LOG_DEBUG, "Cannot find space for storing large object");
-#endif
-            errno = ENOMEM;
-            ret = -1;
-            goto store_ret;
+    min_free = (int)((int64_t)db->db_pagesize * min_free_pct / 100);
+    npages = db->db_max_dirbit + 1;
+    if (budget_pages && budget_pages < npages) {
+        npages = budget_pages;
+    }
+    pagenum = *next;
+    for (examined = 0; examined < npages; examined++, pagenum++) {
+        mdbm_page_t* page;
+        int dirbit;
+
+        if (pagenum > (uint32_t)db->db_max_dirbit) {
+            pagenum = 0;
+        }
+        /* only look at a page through the leaf it's under (skips stale entries) */
+        if (!MDBM_GET_PAGE_INDEX(db,pagenum)
+            || (pagenum & MDBM_HASH_MASK(dir_walk(db,pagenum,&dirbit))) != pagenum)
+        {
+            continue;
         }
         page = pagenum_to_page(db,pagenum,MDBM_PAGE_EXISTS,MDBM_PAGE_MAP);
-                        /* may have remapped db */
-        lob_pagenum = alloc_lob->p_num;
-
-        alloc_lob->p_num = pagenum;
-        alloc_lob->p.p_vallen = val->dsize;
-        if (!(flags & MDBM_RESERVE)) {
-            memcpy(MDBM_LOB_VAL_PTR(alloc_lob),val->dptr,val->dsize);
+        if (!page || page->p_num_pages > 1
+            || MDBM_PAGE_FREE_BYTES(page) >= min_free
+            || page_reclaimable_bytes(db,page) >= min_free)
+        {
+            continue;
+        }
+        MDBM_SIG_DEFER;
+        page = split_page(db,(mdbm_hashval_t)pagenum);
+        MDBM_SIG_ACCEPT;
+        if (!page) {
+            /* the directory or db can't grow any more */
+            break;
         }
+        ++nsplit;
+    }
+    if (pagenum > (uint32_t)db->db_max_dirbit) {
+        pagenum = 0;
+    }
+    *next = pagenum;
+
+    mdbm_unlock(db);
+    return nsplit;
+}
+
+void
+mdbm_stat_header(MDBM *db)
+{
+    /* XXX */
+    mdbm_log(LOG_CRIT, "%s: unimplemented mdbm_stat_header",
+             db->db_filename);
+    abort();
+}
+
+void
+mdbm_stat_all_page(MDBM *db)
+{
+    /* XXX */
+    mdbm_log(LOG_CRIT, "%s: unimplemented mdbm_stat_all_page",
+             db->db_filename);
+    abort();
+}
+
+void
+mdbm_chk_error(MDBM* db, int pagenum, int mapped_pagenum, int index)
+{
+    /* XXX */
+}
+
+int
+mdbm_chk_page(MDBM *db, int pno)
+{
+    if (!db || pno > db->db_max_dirbit) {
+      errno = EINVAL;
+      return -1;
     }
 
-    if (free_index == -1) {
-        free_index = page->p.p_num_entries++;
-        freep = MDBM_ENTRY(page,free_index);
-        MDBM_INIT_TOP_ENTRY(freep+1,freep[0].e_offset - kvsize);
-    } else {
-        freep = MDBM_ENTRY(page,free_index);
+    if (lock_db_ex(db) != 1) {
+        return -1;
+    }
+    if (check_db_page(db,pno,1,3) > 0) {
+        unlock_db(db);
+        errno = EFAULT;
+        return -1;
     }
+    unlock_db(db);
+    return 0;
+}
 
-    freep->e_offset -= MDBM_ALIGN_LEN(db,key->dsize);
-    freep->e_flags = 0;
-    freep->e_key.key.len = key->dsize;
-    freep->e_key.key.hash = hashval >> 16;
+int
+mdbm_chk_all_page(MDBM *db)
+{
+    int i;
+    int nerr = 0;
 
-    memcpy(MDBM_KEY_PTR1(page,freep),key->dptr,key->dsize);
-    MDBM_SET_PAD_BYTES(freep,MDBM_ALIGN_PAD_BYTES(db,val->dsize));
-    v = MDBM_VAL_PTR1(db,page,freep);
-    if (MDBM_DB_CACHEMODE(db)) {
-        mdbm_cache_entry_t* c = (mdbm_cache_entry_t*)v;
-        c->c_num_accesses = 0;
-        c->c_dat.access_time = 0;
-        v += MDBM_CACHE_ENTRY_T_SIZE;
+    if (lock_db_ex(db) < 0) {
+        return -1;
     }
-    if (want_large) {
-        mdbm_entry_lob_t* lp = (mdbm_entry_lob_t*)v;
-        lp->l_pagenum = lob_pagenum;
-        lp->l_flags = 0;
-        lp->l_vallen = val->dsize;
-        freep->e_flags |= MDBM_EFLAG_LARGEOBJ;
-        mdbm_internal_unlock(db);
-    } else {
-        if (!(flags & MDBM_RESERVE)) {
-            memcpy(v,val->dptr,val->dsize);
+    for (i = 0; i <= db->db_max_dirbit; i++) {
+        if (check_db_page(db,i,1,3) > 0) {
+            nerr++;
         }
     }
-    get_kv1(db,page,freep,key,val,NULL);
-    if (iter) {
-        iter->m_pageno = pagenum;
-        iter->m_next = -3 - 2*MDBM_ENTRY_INDEX(page,freep);
+    unlock_db(db);
+    if (nerr) {
+        errno = EFAULT;
+        return -1;
     }
-    ep = freep;
-    cache_stored = 1;
+    return 0;
+}
 
- store_ret:
-    if (!ret) {
-        if (ep && !(db->db_flags & MDBM_DBFLAG_NO_DIRTY)) {
-            if ((flags & MDBM_CLEAN)) {
-                ep->e_flags &= ~MDBM_EFLAG_DIRTY;
-            } else {
-                ep->e_flags |= MDBM_EFLAG_DIRTY;
-            }
-        }
+mdbm_ubig_t
+mdbm_get_page(MDBM* db, const datum* key)
+{
+    mdbm_hashval_t hashval;
+    mdbm_pagenum_t pagenum;
+
+    if (!db || !key || (key->dsize == 0) || (key->dptr == NULL)) {
+      return -1;
     }
 
-    MDBM_SIG_ACCEPT;
-    if (db_locked) {
-        unlock_db(db);
+    hashval = hash_value(db,key);
+    if (mdbm_internal_do_lock(db,MDBM_LOCK_READ,MDBM_LOCK_WAIT,key,&hashval,&pagenum) < 0) {
+        return -1;
     }
-    if (key_locked) {
-        mdbm_internal_do_unlock(db,key);
+    mdbm_internal_do_unlock(db,key);
+    return pagenum;
+}
+
+int
+mdbm_sync(MDBM *db)
+{
+    if (!db) {
+        errno = EINVAL;
+        return -1;
     }
 
-store_error_unlocked:
-    if (ret<0) {
-        mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->store : NULL;
-        MDBM_INC_STAT_ERROR_COUNTER(db, rstats_val, MDBM_STAT_TAG_STORE_ERROR);
+    if (MDBM_IS_RDONLY(db)) {
+        return 0;
+    } else if (db->db_dirty) {
+      return (mdbm_sync_dirty(db,0,0,NULL) < 0) ? -1 : 0;
     } else {
-      if (MDBM_DO_STAT_TIME(db)) {
-        uint64_t now = db->db_get_usec();
-        if (!(flags & MDBM_CACHE_ONLY)) {
-            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->store : NULL;
-            MDBM_ADD_STAT_WAIT(db,rstats_val,now - t0, MDBM_STAT_TAG_STORE);
-        }
-        if (cache_stored && (!db->db_rstats || db->db_rstats->version == MDBM_RSTATS_VERSION)
-              && db->db_bsops) {
-            mdbm_rstats_val_t* rstats_val = (db->db_rstats) ? &db->db_rstats->cache_store : NULL;
-            MDBM_ADD_STAT_WAIT(db,rstats_val,now - t0, MDBM_STAT_TAG_CACHE_STORE);
-        }
-      } else if (MDBM_DO_STATS(db)) {
-          if (!(flags & MDBM_CACHE_ONLY)) {
-            MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_STORE);
-          }
-          if (cache_stored && db->db_bsops) {
-            MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_CACHE_STORE);
-          }
-      }
+      int ret = msync(db->db_base,MDBM_DB_MAP_SIZE(db),MS_ASYNC);
       if (MDBM_DO_STAT_PAGE(db)) {
-            MDBM_PAGE_STAT(db, pagenum, MDBM_STAT_TAG_PAGE_STORE);
+            MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_SYNC);
       }
+
+      return ret;
     }
+}
 
+int
+mdbm_fsync(MDBM *db)
+{
+    int ret, e;
 
-    if (ret && deleted_old && !stored) {
-      errno = EOVERFLOW;
+    if (!db) {
+        errno = EINVAL;
+        return -1;
     }
-    if (stored && ret < 0 && (errno == ENOMEM || errno == EINVAL)) {
-        ret = 0;
+
+    if (MDBM_IS_RDONLY(db) || (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE)) {
+        return 0;
     }
 
+    /* Write back the tracked pages first, so the fsync under the lock is short. */
+    if (db->db_dirty && mdbm_sync_dirty(db,0,MDBM_SYNC_DIRTY_WAIT,NULL) < 0) {
+        return -1;
+    }
+    if (lock_db(db) < 0) {
+        return -1;
+    }
+    ret = fsync(db->db_fd);
+    if (MDBM_DO_STAT_PAGE(db)) {
+          MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_SYNC);
+    }
+    e = errno;
+    unlock_db(db);
+    if (ret < 0) {
+        errno = e;
+    }
     return ret;
 }
 
 int
-mdbm_store(MDBM *db, datum key, datum val, int flags)
+mdbm_set_dirty_tracking(MDBM* db, int enable)
 {
-    return mdbm_store_r(db,&key,&val,flags,NULL);
+    if (!db) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (MDBM_IS_RDONLY(db)) {
+        errno = EPERM;
+        return -1;
+    }
+    if (db->db_flags & (MDBM_DBFLAG_MEMONLYCACHE|MDBM_DBFLAG_HUGEPAGES)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (lock_db(db) != 1) {
+        return -1;
+    }
+    if (enable) {
+        if (dirty_attach(db) < 0) {
+            int err = errno;
+            unlock_db(db);
+            errno = err;
+            return -1;
+        }
+        /* Other handles may have written pages that were never marked. */
+        if (!MDBM_HAS_DIRTYMAP(db)) {
+            dirty_mark_all(db);
+            db->db_hdr->h_dbflags |= MDBM_HFLAG_DIRTYMAP;
+        }
+    } else {
+        db->db_hdr->h_dbflags &= ~MDBM_HFLAG_DIRTYMAP;
+        dirty_detach(db);
+    }
+    unlock_db(db);
+    return 0;
 }
 
-int
-mdbm_store_str(MDBM *db, const char *key, const char *val, int flags)
-{
-    datum k, v;
-
-    k.dptr = (char *)key;
-    k.dsize = strlen(key) + 1;
-    v.dptr = (char *)val;
-    v.dsize = strlen(val) + 1;
-    return mdbm_store_r(db,&k,&v,flags,NULL);
-}
+#ifdef __linux__
+#define DIRTY_SYNC_WRITE    SYNC_FILE_RANGE_WRITE
+#define DIRTY_SYNC_WAIT     (SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE \
+                             |SYNC_FILE_RANGE_WAIT_AFTER)
+#endif
 
+/* Starts (or with MDBM_SYNC_DIRTY_WAIT, completes) write-back of a range of pages. */
 static int
-count_entries(void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+dirty_sync_range(int fd, uint32_t pagesize, uint32_t p, uint32_t npages, int flags)
 {
-    uint64_t *count_ptr = (uint64_t *)user;
-    *count_ptr += info->i_page.page_active_entries;
+#ifdef __linux__
+    return sync_file_range(fd,(off_t)p * pagesize,(off_t)npages * pagesize,
+                           (flags & MDBM_SYNC_DIRTY_WAIT) ? DIRTY_SYNC_WAIT : DIRTY_SYNC_WRITE);
+#else
     return 0;
+#endif
 }
 
-uint64_t
-mdbm_count_records(MDBM *db)
+/*
+ * Writes back the pages marked in m, coalescing runs of dirty pages into
+ * single ranges.  Stops before the next dirty bitmap word once max_bytes
+ * (if non-zero) have been written, and returns 1 if anything was left.
+ */
+static int
+dirty_sync(mdbm_dirty_map_t* m, int fd, uint32_t pagesize, uint64_t max_bytes, int flags,
+           uint64_t* synced)
 {
-    uint64_t db_entry_count = 0;
+    uint32_t nsummary = (m->d_hi + 64*64 - 1) / (64*64);
+    uint32_t run = 0, run_len = 0;
+    uint64_t done = 0;
+    int more = 0;
+    int ret = 0;
+    uint32_t s;
 
-    if (mdbm_iterate(db, -1, count_entries, 0, &db_entry_count) < 0) {
-        mdbm_logerror(LOG_ERR, 0, "%s: entry count with mdbm_iterate failed", db->db_filename);
+    if (dirty_sync_range(fd,pagesize,0,m->d_hdr_pages,flags) < 0) {
+        *synced = 0;
         return -1;
     }
+    for (s = 0; s < nsummary && !more && !ret; s++) {
+        uint64_t summary = m->d_summary[s];
 
-    return db_entry_count;
-}
-
+        while (summary) {
+            uint32_t w = s*64 + __builtin_ctzll(summary);
+            uint64_t bits;
 
-kvpair
-mdbm_first(MDBM *db)
-{
-    return mdbm_first_r(db,&db->db_iter);
+            if (max_bytes && done >= max_bytes) {
+                more = 1;
+                break;
+            }
+            summary &= summary - 1;
+            atomic_and64u(&m->d_summary[s],~((uint64_t)1 << (w%64)));
+            bits = atomic_and64u(&m->d_bits[w],0);
+            while (bits) {
+                int lo = __builtin_ctzll(bits);
+                uint64_t rest = ~(bits >> lo);
+                int len = rest ? __builtin_ctzll(rest) : 64 - lo;
+                uint32_t p = w*64 + lo;
+
+                bits = (lo + len >= 64) ? 0 : bits & (~(uint64_t)0 << (lo + len));
+                done += (uint64_t)len * pagesize;
+                if (run_len && p == run + run_len) {
+                    run_len += len;
+                    continue;
+                }
+                if (run_len && dirty_sync_range(fd,pagesize,run,run_len,flags) < 0) {
+                    /* keep the unwritten pages dirty for the next sync */
+                    dirty_mark_range(m,run,run_len);
+                    dirty_mark_range(m,p,len);
+                    if (bits) {
+                        dirty_mark_range(m,w*64 + __builtin_ctzll(bits),
+                                         64 - __builtin_ctzll(bits));
+                    }
+                    run_len = 0;
+                    ret = -1;
+                    break;
+                }
+                run = p;
+                run_len = len;
+            }
+            if (ret) {
+                break;
+            }
+        }
+    }
+    if (run_len && dirty_sync_range(fd,pagesize,run,run_len,flags) < 0) {
+        dirty_mark_range(m,run,run_len);
+        ret = -1;
+    }
+#ifndef __linux__
+    if (!ret && (done || (flags & MDBM_SYNC_DIRTY_WAIT))) {
+        ret = fsync(fd);
+    }
+#endif
+    *synced = done;
+    if (ret < 0) {
+        return -1;
+    }
+    return more;
 }
 
-kvpair
-mdbm_first_r(MDBM *db, MDBM_ITER *iter)
+int
+mdbm_sync_dirty(MDBM* db, uint64_t max_bytes, int flags, uint64_t* synced)
 {
-    iter->m_pageno = 0;
-    iter->m_next = -1;
-    return mdbm_next_r(db,iter);
-}
+    uint64_t done = 0;
+    int ret;
 
-datum
-mdbm_firstkey(MDBM *db)
-{
-    kvpair kv;
+    if (!db || !db->db_dirty || (flags & ~MDBM_SYNC_DIRTY_WAIT)) {
+        errno = EINVAL;
+        return -1;
+    }
+    ret = dirty_sync(db->db_dirty,db->db_fd,db->db_pagesize,max_bytes,flags,&done);
+    if (synced) {
+        *synced = done;
+    }
+    if (MDBM_DO_STAT_PAGE(db)) {
+        MDBM_ADD_STAT(db,NULL,0,MDBM_STAT_TAG_SYNC);
+    }
+    return ret;
+}
 
-    kv = mdbm_first_r(db,&db->db_iter);
-    return kv.key;
+struct mdbm_flusher {
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;           /* signalled to stop */
+    int             stop;
+    int             fd;             /* the flusher's own descriptor for the db */
+    mdbm_shmem_t*   mem;            /* the flusher's own mapping of the dirty map */
+    uint32_t        pagesize;
+    uint32_t        interval_msec;
+    uint64_t        max_bytes;      /* per interval, 0 for no limit */
+    char            filename[MAXPATHLEN+1];
+};
+
+static void*
+flusher_run(void* arg)
+{
+    struct mdbm_flusher* f = (struct mdbm_flusher*)arg;
+    mdbm_dirty_map_t* m = (mdbm_dirty_map_t*)f->mem->base;
+    int logged = 0;
+
+    pthread_mutex_lock(&f->mutex);
+    while (!f->stop) {
+        struct timespec ts;
+        uint64_t done;
+
+        clock_gettime(CLOCK_REALTIME,&ts);
+        ts.tv_sec += f->interval_msec / 1000;
+        ts.tv_nsec += (long)(f->interval_msec % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&f->cond,&f->mutex,&ts);
+        if (f->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&f->mutex);
+        if (dirty_sync(m,f->fd,f->pagesize,f->max_bytes,0,&done) < 0) {
+            if (!logged) {
+                mdbm_logerror(LOG_ERR,0,"%s: dirty page flush failure",f->filename);
+                logged = 1;
+            }
+        } else {
+            logged = 0;
+        }
+        pthread_mutex_lock(&f->mutex);
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return NULL;
 }
 
-datum
-mdbm_firstkey_r(MDBM *db, MDBM_ITER *iter)
+int
+mdbm_start_flusher(MDBM* db, uint32_t interval_msec, uint64_t max_bytes_per_sec)
 {
-    kvpair kv;
+    struct mdbm_flusher* f;
+    int init, err;
 
-    kv = mdbm_first_r(db,iter);
-    return kv.key;
+    if (!db || !db->db_dirty || !interval_msec) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->db_flusher) {
+        errno = EBUSY;
+        return -1;
+    }
+    if ((f = (struct mdbm_flusher*)calloc(1,sizeof(*f))) == NULL) {
+        return -1;
+    }
+    f->pagesize = db->db_pagesize;
+    f->interval_msec = interval_msec;
+    if (max_bytes_per_sec) {
+        f->max_bytes = max_bytes_per_sec * interval_msec / 1000;
+        if (!f->max_bytes) {
+            f->max_bytes = 1;   /* at least one bitmap word per interval */
+        }
+    }
+    strcpy(f->filename,db->db_filename);
+    if ((f->fd = dup(db->db_fd)) < 0) {
+        err = errno;
+        free(f);
+        errno = err;
+        return -1;
+    }
+    if ((f->mem = dirty_map_open(db->db_filename,&init)) == NULL) {
+        err = errno;
+        close(f->fd);
+        free(f);
+        errno = err;
+        return -1;
+    }
+    if (init) {
+        /* can't happen while db is attached, but don't leave others waiting */
+        mdbm_shmem_init_complete(f->mem);
+    }
+    pthread_mutex_init(&f->mutex,NULL);
+    pthread_cond_init(&f->cond,NULL);
+    if ((err = pthread_create(&f->thread,NULL,flusher_run,f)) != 0) {
+        pthread_cond_destroy(&f->cond);
+        pthread_mutex_destroy(&f->mutex);
+        mdbm_shmem_close(f->mem,0);
+        close(f->fd);
+        free(f);
+        errno = err;
+        return -1;
+    }
+    db->db_flusher = f;
+    return 0;
 }
 
-kvpair mdbm_next(MDBM *db)
+int
+mdbm_stop_flusher(MDBM* db)
 {
-    return mdbm_next_r(db,&db->db_iter);
+    struct mdbm_flusher* f;
+
+    if (!db) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((f = db->db_flusher) == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&f->mutex);
+    f->stop = 1;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+    pthread_join(f->thread,NULL);
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->mutex);
+    mdbm_shmem_close(f->mem,0);
+    close(f->fd);
+    free(f);
+    db->db_flusher = NULL;
+    return 0;
 }
 
-static kvpair
-next_r(MDBM *db, MDBM_ITER *iter, int one_page)
+int
+mdbm_set_journal(MDBM* db, int enable)
 {
-    mdbm_pagenum_t pagenum;
-    int index;
-    kvpair kv;
-
-    pagenum = iter->m_pageno;
-    index = (iter->m_next+1)/-2;
+    int err;
 
-    if (index < 0) {
-        index = 0;
+    if (!db) {
+        errno = EINVAL;
+        return -1;
     }
-    while (pagenum <= db->db_max_dirbit) {
-        mdbm_entry_data_t e;
-        mdbm_entry_t* ep;
-
-        if (index == 0) {
-            if (db_is_multi_lock(db) && !mdbm_isowned(db)) {
-                if (mdbm_internal_do_lock(db,MDBM_LOCK_READ,MDBM_LOCK_WAIT,NULL,NULL,&pagenum) != 1) {
-                    memset(&kv,0,sizeof(kv));
-                    return kv;
-                }
-            }
-        } else {
-            if (MDBM_IS_WINDOWED(db)) {
-                if ((ep = set_entry(db,pagenum,index-1,&e)) != NULL) {
-                    if (MDBM_ENTRY_LARGEOBJ(ep)) {
-                        get_kv(db,&e,&kv.key,&kv.val);
-                        release_window_page(db,kv.val.dptr);
-                    }
-                }
-            }
+    if (MDBM_IS_RDONLY(db)) {
+        errno = EPERM;
+        return -1;
+    }
+    if (db->db_flags & (MDBM_DBFLAG_MEMONLYCACHE|MDBM_DBFLAG_HUGEPAGES)) {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef MDBM_BSOPS
+    if (db->db_bsops) {
+        errno = EINVAL;
+        return -1;
+    }
+#endif
+    if (enable) {
+        /* Attach before locking: the first handle to attach needs the lock to checkpoint. */
+        if (journal_attach(db,MDBM_HAS_JOURNAL(db)) < 0) {
+            return -1;
         }
-
-        if ((ep = set_entry(db,pagenum,index,&e)) != NULL) {
-            while (ep) {
-                if (ep->e_key.match) {
-                    get_kv(db,&e,&kv.key,&kv.val);
-                    iter->m_pageno = pagenum;
-                    iter->m_next = -3 - 2*e.e_index;
-                    return kv;
-                }
-                ep = next_entry(&e);
-            }
+        if (lock_db(db) != 1) {
+            return -1;
         }
-
-        if (MDBM_IS_WINDOWED(db)) {
-            release_window_page(db,e.e_page);
+        if (!MDBM_HAS_JOURNAL(db)) {
+            /* Anything left in the journal predates the current contents. */
+            if (journal_checkpoint(db,db->db_journal,0) < 0) {
+                err = errno;
+                unlock_db(db);
+                journal_detach(db,0);
+                errno = err;
+                return -1;
+            }
+            db->db_hdr->h_dbflags |= MDBM_HFLAG_JOURNAL;
         }
-
-        if (one_page) {
-            memset(&kv,0,sizeof(kv));
-            iter->m_pageno = pagenum+1;
-            iter->m_next = 0;
-            return kv;
+        unlock_db(db);
+    } else {
+        if (lock_db(db) != 1) {
+            return -1;
         }
-
-        if (db_is_multi_lock(db) && !mdbm_isowned(db)) {
-            mdbm_internal_do_unlock(db,NULL);
+        if (db->db_journal && journal_checkpoint(db,db->db_journal,0) < 0) {
+            err = errno;
+            unlock_db(db);
+            errno = err;
+            return -1;
         }
-
-        pagenum++;
-        index = 0;
+        db->db_hdr->h_dbflags &= ~MDBM_HFLAG_JOURNAL;
+        unlock_db(db);
+        journal_detach(db,0);
     }
-    memset(&kv,0,sizeof(kv));
-    iter->m_pageno = db->db_max_dirbit+1;
-    iter->m_next = -1;
-    return kv;
+    return 0;
 }
 
-kvpair
-mdbm_next_r(MDBM *db, MDBM_ITER *iter)
+int
+mdbm_set_journal_options(MDBM* db, int flags, uint64_t checkpoint_bytes)
 {
-    return next_r(db,iter,0);
+    if (!db || !db->db_journal || (flags & ~MDBM_JOURNAL_NOSYNC)) {
+        errno = EINVAL;
+        return -1;
+    }
+    db->db_journal->flags = flags;
+    db->db_journal->checkpoint_bytes = checkpoint_bytes;
+    return 0;
 }
 
-datum
-mdbm_nextkey(MDBM *db)
+int
+mdbm_journal_sync(MDBM* db)
 {
-    kvpair kv;
+    struct mdbm_journal* j;
 
-    kv = mdbm_next_r(db,&db->db_iter);
-    return kv.key;
+    if (!db || (j = db->db_journal) == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    j->pending = 0;
+    if (journal_needs_checkpoint(j)) {
+        j->failed = 0;
+        return journal_checkpoint(db,j,0);
+    }
+    return journal_sync_to(j,j->hdr->j_gen,j->hdr->j_tail);
 }
 
-datum
-mdbm_nextkey_r(MDBM *db, MDBM_ITER *iter)
+int
+mdbm_journal_checkpoint(MDBM* db)
 {
-    kvpair kv;
+    struct mdbm_journal* j;
 
-    kv = mdbm_next_r(db,iter);
-    return kv.key;
+    if (!db || (j = db->db_journal) == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    j->pending = 0;
+    j->failed = 0;
+    return journal_checkpoint(db,j,0);
 }
 
 int
-mdbm_pre_split(MDBM* db, mdbm_ubig_t pages)
+mdbm_set_change_ring(MDBM* db, uint64_t size)
 {
-    int dir_shift, n, p;
-    int init_bytes, init_bits;
-    int npages, extra;
-    mdbm_dir_t* dir;
+    mdbm_shmem_t* mem;
 
-    if (mdbm_count_records(db) > 0) {   /* pre_split requires DB to be empty */
-        mdbm_log(LOG_ERR, "%s: mdbm_pre_split requires an empty DB", db->db_filename);
-        errno = EFBIG;
+    if (!db || (size && (size < MDBM_CHANGE_RING_MIN_SIZE || size > MDBM_CHANGE_RING_MAX_SIZE))) {
+        errno = EINVAL;
         return -1;
     }
-    if (pages > MDBM_NUMPAGES_MAX || pages < 1) {
-        mdbm_log(LOG_ERR, "%s: mdbm_pre_split invalid page count (%u vs %u max)", 
-            db->db_filename, (unsigned int) pages, MDBM_NUMPAGES_MAX);
-        errno = EFBIG;
+    if (MDBM_IS_RDONLY(db)) {
+        errno = EPERM;
         return -1;
     }
-
-    if (lock_db(db) < 0) {
-        ERROR();
+    if (db->db_flags & (MDBM_DBFLAG_MEMONLYCACHE|MDBM_DBFLAG_HUGEPAGES)) {
+        errno = EINVAL;
         return -1;
     }
-
-    for (dir_shift = 0, n = 1; n <= pages; dir_shift++, n <<= 1);
-    if (dir_shift > 0) {
-        dir_shift--;
+#ifdef MDBM_BSOPS
+    if (db->db_bsops) {
+        errno = EINVAL;
+        return -1;
     }
-    extra = MDBM_NUM_DIR_PAGES(db->db_pagesize,dir_shift);
-    pages += extra;
-    /* fprintf(stderr, "mdbm_pre_split() pages extra:%d total:%d \n", extra, pages); */
-    if (resize(db,dir_shift,pages) < 0) {
+#endif
+    if (size) {
+        size = CHANGE_REC_LEN(size);
+        if (db->db_changes && db->db_changes->r_size != size) {
+            changes_detach(db);
+        }
+        if (!db->db_changes) {
+            if ((mem = changes_open(db->db_filename,size)) == NULL) {
+                return -1;
+            }
+            db->db_changes = (mdbm_change_ring_hdr_t*)mem->base;
+            db->db_changes_mem = mem;
+        }
+        if (lock_db(db) != 1) {
+            return -1;
+        }
+        if (!MDBM_HAS_CHANGES(db)) {
+            /* The ring is missing whatever changed while it was disabled. */
+            changes_new_epoch(db);
+            db->db_hdr->h_dbflags |= MDBM_HFLAG_CHANGES;
+        }
         unlock_db(db);
-        ERROR();
-        return -1;
+    } else {
+        if (lock_db(db) != 1) {
+            return -1;
+        }
+        if (MDBM_HAS_CHANGES(db)) {
+            changes_new_epoch(db);
+            db->db_hdr->h_dbflags &= ~MDBM_HFLAG_CHANGES;
+        }
+        unlock_db(db);
+        changes_detach(db);
     }
+    return 0;
+}
 
-#define MDBM_BITS_PER_BYTE      8
-    init_bytes = db->db_max_dirbit / MDBM_BITS_PER_BYTE;
-    init_bits = db->db_max_dirbit % MDBM_BITS_PER_BYTE;
+struct mdbm_change_ring {
+    mdbm_shmem_t*   mem;
+    const volatile mdbm_change_ring_hdr_t* hdr;
+    uint64_t        epoch;
+    uint64_t        pos;        /* offset of the next record */
+    uint64_t        seq;        /* its sequence number */
+    char*           buf;        /* key and value of the last change read */
+    uint32_t        bufsize;
+};
 
-    dir = MDBM_DIR_PTR(db);
-    if (init_bytes) {
-        memset(dir,0xff,init_bytes);
-    }
-    if (init_bits) {
-        int i;
+struct change_ring_bounds {
+    uint64_t        epoch;
+    uint64_t        tail;
+    uint64_t        tail_seq;
+    uint64_t        head;
+    uint64_t        next_seq;
+};
 
-        dir[init_bytes] = 0;
-        for (i = 0; i < init_bits; i++) {
-            mdbm_dir_t* d = dir + init_bytes;
-            *d = (mdbm_dir_t)(*d | (1 << i));
+/* Reads a consistent copy of the bounds, which writers update under r_lock. */
+static void
+change_ring_bounds(const volatile mdbm_change_ring_hdr_t* r, struct change_ring_bounds* b)
+{
+    int spins = 0;
+
+    for (;;) {
+        uint32_t owner = r->r_lock;
+
+        atomic_read_barrier();
+        b->next_seq = r->r_next_seq;
+        b->epoch = r->r_epoch;
+        b->tail = r->r_tail;
+        b->tail_seq = r->r_tail_seq;
+        b->head = r->r_head;
+        atomic_read_barrier();
+        if (!owner && !r->r_lock && r->r_next_seq == b->next_seq) {
+            return;
+        }
+        if (owner && ++spins >= 1000) {
+            spins = 0;
+            if (kill(owner,0) < 0 && errno == ESRCH) {
+                return;
+            }
+            sched_yield();
+        } else {
+            atomic_pause();
         }
     }
-    db->db_hdr->h_dbflags |= MDBM_HFLAG_PERFECT;
-    ++db->db_hdr->h_dir_gen;
-    sync_dir(db,NULL);
+}
 
-    p = db->db_hdr->h_last_chunk;
-    npages = MDBM_PAGE_PTR(db,p)->p_num_pages;
-    p += npages;
-    /* fprintf(stderr, "mdbm_pre_split() max_dirbit:%d \n", db->db_max_dirbit); */
-    for (n = 0; n <= db->db_max_dirbit; n++) {
-        mdbm_page_t* page;
-        if (MDBM_GET_PAGE_INDEX(db,n)) {
-            /* fprintf(stderr, "mdbm_pre_split() init(skip) page %d / %d p:%d \n", n, pages, p); */
+/* Reads the record at the position of the ring, copying its key and value if
+ * copy is set.  Returns 1, 0 at the head of the ring, or -1 if it was
+ * overwritten.
+ */
+static int
+change_ring_read(mdbm_change_ring_t* ring, mdbm_change_t* change, int copy)
+{
+    const volatile mdbm_change_ring_hdr_t* r = ring->hdr;
+    const char* base = (const char*)ring->hdr + MDBM_CHANGE_RING_HDR_SIZE;
+    uint64_t size = r->r_size;
+    uint64_t pos = ring->pos;
+    mdbm_change_rec_t c;
+
+    for (;;) {
+        uint64_t off = pos % size;
+        int valid;
+
+        if (r->r_epoch != ring->epoch) {
+            errno = ESTALE;
+            return -1;
+        }
+        if (pos >= r->r_head) {
+            ring->pos = pos;
+            return 0;
+        }
+        atomic_read_barrier();
+        if (size - off < sizeof(c)) {
+            pos += size - off;
             continue;
         }
-        /* fprintf(stderr, "mdbm_pre_split() init page %d / %d p:%d \n", n, pages, p); */
-        page = MDBM_PAGE_PTR(db,p);
-        MDBM_SET_PAGE_INDEX(db, n, p);
-        page->p_num = n;
-        page->p_type = MDBM_PTYPE_DATA;
-        page->p_flags = 0;
-        page->p_num_pages = 1;
-        page->p_prev_num_pages = npages;
-        page->p_r0 = 0;
-        page->p_r1 = 0;
-        page->p.p_data = 0;
-        npages = 1;
-        MDBM_INIT_TOP_ENTRY(MDBM_ENTRY(page,0),db->db_pagesize);
-        if (MDBM_IS_WINDOWED(db)) {
-            release_window_page(db,page);
+        memcpy(&c,base + off,sizeof(c));
+        valid = c.c_len >= sizeof(c) && c.c_len <= size - off
+            && (!c.c_op || (uint64_t)c.c_ksize + c.c_vsize <= c.c_len - sizeof(c));
+        if (valid && c.c_op && copy) {
+            if (c.c_ksize + c.c_vsize > ring->bufsize) {
+                char* buf = (char*)realloc(ring->buf,c.c_ksize + c.c_vsize);
+
+                if (!buf) {
+                    return -1;
+                }
+                ring->buf = buf;
+                ring->bufsize = c.c_ksize + c.c_vsize;
+            }
+            memcpy(ring->buf,base + off + sizeof(c),c.c_ksize + c.c_vsize);
+        }
+        /* If a writer started overwriting the record, it moved the tail first. */
+        atomic_read_barrier();
+        if (r->r_tail > pos || r->r_epoch != ring->epoch || !valid
+            || (c.c_op && c.c_seq != ring->seq))
+        {
+            errno = ESTALE;
+            return -1;
+        }
+        pos += c.c_len;
+        if (c.c_op) {
+            break;
         }
-        p++;
     }
-    db->db_hdr->h_last_chunk = p-1;
-
-    unlock_db(db);
-    return 0;
+    ring->pos = pos;
+    ring->seq++;
+    change->seq = c.c_seq;
+    change->op = c.c_op;
+    change->flags = c.c_flags;
+    change->key.dptr = copy ? ring->buf : NULL;
+    change->key.dsize = c.c_ksize;
+    change->val.dptr = copy ? ring->buf + c.c_ksize : NULL;
+    change->val.dsize = c.c_vsize;
+    return 1;
 }
 
-int
-mdbm_set_alignment(MDBM* db, int align)
+mdbm_change_ring_t*
+mdbm_change_ring_open(const char* dbfilename)
 {
-    if (lock_db(db) != 1) {
-        return -1;
+    char path[MAXPATHLEN+1];
+    mdbm_change_ring_t* ring;
+    const mdbm_change_ring_hdr_t* r;
+    struct change_ring_bounds b;
+
+    if (!dbfilename
+        || snprintf(path,sizeof(path),"%s.changes",dbfilename) >= (int)sizeof(path))
+    {
+        errno = EINVAL;
+        return NULL;
     }
-    if ((align != MDBM_ALIGN_8_BITS
-         && align != MDBM_ALIGN_16_BITS
-         && align != MDBM_ALIGN_32_BITS
-         && align != MDBM_ALIGN_64_BITS)
-        || !check_empty(db))
+    if ((ring = (mdbm_change_ring_t*)calloc(1,sizeof(*ring))) == NULL) {
+        return NULL;
+    }
+    if ((ring->mem = mdbm_shmem_open(path,MDBM_SHMEM_RDONLY,0,NULL)) == NULL) {
+        free(ring);
+        return NULL;
+    }
+    r = (const mdbm_change_ring_hdr_t*)ring->mem->base;
+    if (ring->mem->size < MDBM_CHANGE_RING_HDR_SIZE
+        || r->r_magic != MDBM_CHANGE_RING_MAGIC || r->r_version != MDBM_CHANGE_RING_VERSION
+        || ring->mem->size != MDBM_CHANGE_RING_HDR_SIZE + r->r_size)
     {
-        unlock_db(db);
+        mdbm_log(LOG_ERR,"%s: invalid change ring",path);
+        mdbm_shmem_close(ring->mem,0);
+        free(ring);
         errno = EINVAL;
-        return -1;
+        return NULL;
     }
-
-    db->db_hdr->h_dbflags = db->db_hdr->h_dbflags | (uint16_t)align;
-    db->db_align_mask = align;
-    unlock_db(db);
-    return 0;
+    ring->hdr = r;
+    change_ring_bounds(ring->hdr,&b);
+    ring->epoch = b.epoch;
+    ring->pos = b.head;
+    ring->seq = b.next_seq;
+    return ring;
 }
 
+void
+mdbm_change_ring_close(mdbm_change_ring_t* ring)
+{
+    if (ring) {
+        mdbm_shmem_close(ring->mem,0);
+        free(ring->buf);
+        free(ring);
+    }
+}
 
-static int
-mdbm_limit_size_new_common(MDBM* db,
-                           mdbm_ubig_t pages,
-                           mdbm_shake_func_v3 shake,
-                           void *data)
+void
+mdbm_change_ring_position(const mdbm_change_ring_t* ring, uint64_t* epoch, uint64_t* seq)
 {
-    int dir_shift;
-    int npages;
-    int want_pages;
+    *epoch = ring->epoch;
+    *seq = ring->seq;
+}
 
-    for (dir_shift = 0, npages = 1; npages && (2*npages <= pages); dir_shift++, npages <<= 1);
-    if (!npages) {
-        mdbm_log(LOG_ERR,
-                 "%s: mdbm_limit_size*() maximum pages is too large"
-                 ", existing pages=%d"
-                 ", new limit pages=%u",
-                 db->db_filename, db->db_hdr->h_num_pages, pages);
-        errno = EINVAL;
-        return -1;
-    }
-    want_pages = pages;
-    pages += MDBM_NUM_DIR_PAGES(db->db_pagesize,dir_shift);
+int
+mdbm_change_ring_seek(mdbm_change_ring_t* ring, uint64_t epoch, uint64_t seq)
+{
+    struct change_ring_bounds b;
+    uint64_t pos = ring->pos;
+    uint64_t cur = ring->seq;
+    mdbm_change_t change;
+    int ret;
 
-    if (lock_db(db) < 0) {
+    change_ring_bounds(ring->hdr,&b);
+    if (b.epoch != epoch || seq < b.tail_seq) {
+        errno = ESTALE;
         return -1;
     }
-    if (db->db_hdr->h_num_pages > pages) {
-        unlock_db(db);
-        mdbm_log(LOG_ERR,
-                 "%s: existing number of pages is greater than new limit"
-                 ", existing pages=%d"
-                 ", new limit pages=%d",
-                 db->db_filename, db->db_hdr->h_num_pages, pages);
+    if (seq > b.next_seq) {
         errno = EINVAL;
         return -1;
     }
-
-    db->db_hdr->h_max_pages = pages;
-    unlock_db(db);
-    db->db_flags = (db->db_flags & ~MDBM_DBFLAG_SHAKE_MASK) | MDBM_DBFLAG_SHAKE_V2;
-    db->db_shake_func = shake;
-    db->db_shake_data = data;
-
-    if (db->db_spillsize
-        && (!db->db_max_dir_shift || db->db_max_dir_shift >= dir_shift)
-        && (want_pages == npages || want_pages - npages < want_pages/20))
-    {
-        mdbm_log(LOG_WARNING,
-                 "WARNING: %s: size limit leaves %s%dK available for large-object storage",
-                 db->db_filename,
-                 (want_pages > npages) ? "just " : "",
-                 (want_pages - npages) * db->db_pagesize / 1024);
+    ring->epoch = epoch;
+    if (seq == b.next_seq) {
+        ring->pos = b.head;
+        ring->seq = seq;
+        return 0;
+    }
+    ring->pos = b.tail;
+    ring->seq = b.tail_seq;
+    while (ring->seq < seq) {
+        if ((ret = change_ring_read(ring,&change,0)) <= 0) {
+            ring->pos = pos;
+            ring->seq = cur;
+            if (!ret) {
+                errno = ESTALE;
+            }
+            return -1;
+        }
     }
-
     return 0;
 }
 
-
-/* FIX: There shouldn't be version-specific mdbm_limit_size functions.  */
 int
-mdbm_limit_size_v3 (MDBM* db, mdbm_ubig_t pages,
-                    mdbm_shake_func_v3 shake,
-                    void *data)
+mdbm_change_ring_next(mdbm_change_ring_t* ring, mdbm_change_t* change)
 {
-    if (db->db_ver_flag != MDBM_DBVER_3) {
-        mdbm_log(LOG_ERR, "%s: mdbm_limit_size_v3 may only be used with v3 mdbms.",
-                 db->db_filename);
+    if (!ring || !change) {
         errno = EINVAL;
         return -1;
     }
+    return change_ring_read(ring,change,1);
+}
 
-    /*if (mdbm_limit_size_new_common(db,pages,(mdbm_shake_func)shake,data) < 0) { */
-    if (mdbm_limit_size_new_common(db,pages,shake,data) < 0) {
-        return -1;
+void
+mdbm_close_fd(MDBM *db)
+{
+    if (db->db_fd >= 0) {
+        close(db->db_fd);
+        db->db_fd = -1;
     }
-    db->db_flags = (db->db_flags & ~MDBM_DBFLAG_SHAKE_MASK) | MDBM_DBFLAG_SHAKE_V3;
-    return 0;
 }
 
-int
-mdbm_limit_dir_size(MDBM *db, int pages)
+void
+mdbm_truncate(MDBM *db)
 {
-    int dir_shift;
-    int npages;
+    const char *TRUNC_WARN_MSG = 
+        "mdbm_truncate will result in the loss of the setting.\n"
+        "If you'd like to retain this setting, use mdbm_purge() !";
 
-    if (db->db_ver_flag != MDBM_DBVER_3) {
-        errno = EINVAL;
-        return -1;
+    if (lock_db(db) < 0) {
+        return;
     }
 
-    if (pages<=0 || pages>MDBM_NUMPAGES_MAX) {
-        errno = EINVAL;
-        return -1;
-    }
+    errno = 0;   /* Reset errno so it won't show while printing the following warnings */
 
-    for (dir_shift = 0, npages = 1; 2*npages <= pages; dir_shift++, npages <<= 1);
+    /* Look at header to generate warn msgs, since you can mdbm_open() w/o LARGE_OBJ flag */
+    if (db->db_hdr->h_dbflags & MDBM_HFLAG_LARGEOBJ) {
+        mdbm_logerror(LOG_ERR,0, "%s: Large Object Support will no longer be set: %s",
+                      db->db_filename, TRUNC_WARN_MSG);
+    }
 
-    if (lock_db_ex(db) < 0) {
-        return -1;
+    if (db->db_hdr->h_spill_size) {  /* Set spillsize indicates likely large object support */
+        mdbm_logerror(LOG_ERR,0, "%s: Spill Size will no longer be set to %d: %s",
+                      db->db_filename, db->db_hdr->h_spill_size, TRUNC_WARN_MSG);
     }
 
-    if (db->db_hdr->h_dir_shift > dir_shift) {
-        unlock_db(db);
-        errno = EINVAL;
-        return -1;
+    if (db->db_hdr->h_hash_func != MDBM_DEFAULT_HASH) {
+        uint8_t hash = db->db_hdr->h_hash_func;
+        mdbm_logerror(LOG_ERR,0, "%s: Hashing method will no longer be %s: %s",
+                      db->db_filename,
+                      (hash < MDBM_HASH_MAX) ? MDBM_HASH_FUNCNAMES[hash] : "?",
+                      TRUNC_WARN_MSG);
     }
 
-    db->db_max_dir_shift = db->db_hdr->h_max_dir_shift = dir_shift;
-    /* XXX should this be calling sync_dir() ? */
+    if (db->db_hdr->h_max_pages) {
+        mdbm_logerror(LOG_ERR,0, "%s: MDBM Size Limit will no longer be set to %u: %s",
+                      db->db_filename, db->db_hdr->h_max_pages, TRUNC_WARN_MSG);
+    }
 
-    unlock_db(db);
-    return 0;
-}
+    if (MDBM_HAS_FILTER(db)) {
+        mdbm_logerror(LOG_ERR,0, "%s: Lookup filter will no longer be set: %s",
+                      db->db_filename, TRUNC_WARN_MSG);
+    }
 
-void dump_mdbm_header(MDBM* db) {
-    fprintf(stderr ,"db_filename     %s\n",           db->db_filename             );
-    fprintf(stderr ,"h_magic       0x%x\n", (unsigned)db->db_hdr->h_magic         );
-    fprintf(stderr ,"h_dbflags       %u\n", (unsigned)db->db_hdr->h_dbflags       );
-    fprintf(stderr ,"h_cache_mode    %u\n", (unsigned)db->db_hdr->h_cache_mode    );
-    fprintf(stderr ,"h_pad1          %u\n", (unsigned)db->db_hdr->h_pad1          );
-    fprintf(stderr ,"h_dir_shift     %u\n", (unsigned)db->db_hdr->h_dir_shift     );
-    fprintf(stderr ,"h_hash_func     %u\n", (unsigned)db->db_hdr->h_hash_func     );
-    fprintf(stderr ,"h_max_dir_shift %u\n", (unsigned)db->db_hdr->h_max_dir_shift );
-    fprintf(stderr ,"h_dir_gen       %u\n", (unsigned)db->db_hdr->h_dir_gen       );
-    fprintf(stderr ,"h_pagesize      %u\n", (unsigned)db->db_hdr->h_pagesize      );
-    fprintf(stderr ,"h_num_pages     %u  ", (unsigned)db->db_hdr->h_num_pages     );
-    fprintf(stderr ,"db_num_pages    %u\n", (unsigned)db->db_num_pages            );
-    fprintf(stderr ,"h_max_pages     %u\n", (unsigned)db->db_hdr->h_max_pages     );
-    fprintf(stderr ,"h_spill_size    %u\n", (unsigned)db->db_hdr->h_spill_size    );
-    fprintf(stderr ,"h_last_chunk    %u\n", (unsigned)db->db_hdr->h_last_chunk    );
-    fprintf(stderr ,"h_first_free    %u\n", (unsigned)db->db_hdr->h_first_free    );
-    /*uint32_t            h_pad4[8];       // unused padding (future expansion) */
-    /*mdbm_hdr_stats_t    h_stats;         // store/fetch/delete statistics */
-}
+    if (MDBM_HAS_PAGE_INDEX(db)) {
+        mdbm_logerror(LOG_ERR,0, "%s: In-page index will no longer be set: %s",
+                      db->db_filename, TRUNC_WARN_MSG);
+    }
 
-/* prints out the page direcory 
-void dump_mdbm_directory(MDBM* db) {
-  // TODO 
-}
-*/
-/* Debugging function. Walks from chunk to chunk, dumping info about each one. */
-void dump_chunk_headers(MDBM* db) {
-  int pg = 0;
-  fprintf(stderr, "DUMPING CHUNK HEADERS, pages:%d|%d first_free:%d last_chunk:%d...\n",
-      db->db_num_pages, db->db_hdr->h_num_pages, db->db_hdr->h_first_free,
-      db->db_hdr->h_last_chunk);
-  /* while (pg < db->db_num_pages) { */
-  while (pg < db->db_hdr->h_num_pages) {
-    mdbm_page_t* p = MDBM_PAGE_PTR(db, pg);
-    const char* typ = "????";
-    switch (p->p_type) {
-      case MDBM_PTYPE_FREE: typ = "FREE"; break;
-      case MDBM_PTYPE_DIR : typ = "DIR "; break;
-      case MDBM_PTYPE_DATA: typ = "DATA"; break;
-      case MDBM_PTYPE_LOB : typ = "LOB "; break;
-      default: break;
+    if (db->db_hdr->h_dbflags & MDBM_HFLAG_FULLHASH) {
+        mdbm_logerror(LOG_ERR,0, "%s: Full hash storage will no longer be set: %s",
+                      db->db_filename, TRUNC_WARN_MSG);
     }
 
-    fprintf(stderr, "  Page:%4.4d (%p) type:%s sz:%d, prev_sz:%d p.*:%u \n", pg, (void*)p,
-        typ, p->p_num_pages, p->p_prev_num_pages,  (unsigned)p->p.p_data);
+    if (MDBM_HAS_OPTREAD(db)) {
+        mdbm_logerror(LOG_ERR,0, "%s: Optimistic reads will no longer be set: %s",
+                      db->db_filename, TRUNC_WARN_MSG);
+    }
 
-    pg += p->p_num_pages;
-    if (p->p_num_pages < 1) {
-      fprintf(stderr, " INVALID PAGE COUNT, BREAKING...\n");
-      break;
+    if (MDBM_HAS_DIRTYMAP(db)) {
+        mdbm_logerror(LOG_ERR,0, "%s: Dirty page tracking will no longer be set: %s",
+                      db->db_filename, TRUNC_WARN_MSG);
     }
-  }
-}
 
-/* De-fragments a db, by moving DATA/LOB chunks down, and merging FREE chunks upward. */
-static int
-compact_db(MDBM* db) {
-    int ret = 0;
-    int merge = 0; /* Could there be adjacent free-pages to merge from previous iteration. */
-    int compacted = 0; /* Has free space been created (to truncate) at the end of the DB? */
-    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
-      mdbm_log(LOG_WARNING,"%s: compact_db() doesn't support MEMORY-ONLY",
-          db->db_filename);
-      return -1;
+    if (MDBM_HAS_JOURNAL(db)) {
+        mdbm_logerror(LOG_ERR,0, "%s: Write-ahead journal will no longer be set: %s",
+                      db->db_filename, TRUNC_WARN_MSG);
     }
-    if (MDBM_IS_WINDOWED(db)) {
-      mdbm_log(LOG_WARNING,"%s: compact_db() doesn't support WINDOWED MODE",
-          db->db_filename);
-      return -1;
+
+    if (MDBM_HAS_CHANGES(db)) {
+        mdbm_logerror(LOG_ERR,0, "%s: Change ring will no longer be set: %s",
+                      db->db_filename, TRUNC_WARN_MSG);
+        changes_new_epoch(db);
     }
 
-    mdbm_lock(db);
+    if (truncate_db(db,1,db->db_pagesize,0) < 0) {
+    }
+    dirty_detach(db);
+    journal_detach(db,0);
+    changes_detach(db);
 
-    /* compact mdbm by moving occupied pages down (low VMA), so the free ones 
-     *   are highest (high VMA) (patching the page_table as we go).
-     *   Note: LOB/OVERSIZE chunks must move as a contiguous block. */
-    MDBM_SIG_DEFER;
-    while (1) {
-      /* free list should be sorted, lowest page first, based on free_chunk() */
-      uint32_t cur = db->db_hdr->h_first_free, next = 0, nextnext = 0;
-      mdbm_page_t *curp = NULL, *nextp = NULL, *nextnextp = NULL;
-      uint32_t cur_pages = 0;
+    unlock_db(db);
+}
 
-      if (!cur) { /* no free pages */
-        break;
-      }
+int
+mdbm_set_hash(MDBM* db, int hash)
+{
+    if (!db) {
+        errno = EINVAL;
+        return -1;
+    }
 
-      curp = MDBM_PAGE_PTR(db, cur);
-      cur_pages = curp->p_num_pages;
-      if (cur+cur_pages >= db->db_num_pages) { /* free_list completely compacted */
-        compacted = 1;
-        break;
-      }
-      /* NOTE: this is simple and fairly safe, but potentially slow.
-       * It bubbles down one DATA/LOB page at a time. i.e.
-       *   |--page A --|-- free --|--page B   --|-- free --|
-       * becomes
-       *   |--page A --|--page B   --|-- free  ...  ...  --|
-       * At each step:
-       *   an occupied page is copied downward, 
-       *   page headers are patched (to maintain the implicit linked list)
-       *   the page-table entry is updated
-       *   adjacent free-pages are coalesced
-       *
-       * Moving the highest DATA/LOB page down might be faster,
-       * but breaks when things don't fit in the available gap.
-       * Also, updating page-headers, etc for all affected entries is a mess. 
-       */
-      next = cur + cur_pages;
-      nextp = MDBM_PAGE_PTR(db, next);
+    if (hash < 0 || hash > MDBM_MAX_HASH || !mdbm_hash_funcs[hash]) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (lock_db(db) != 1) {
+        return -1;
+    }
+    if (!check_empty(db)) {
+        unlock_db(db);
+        errno = EINVAL;
+        return -1;
+    }
+    db->db_hdr->h_hash_func = (uint8_t)hash;
+    db->db_hashfunc = mdbm_hash_funcs[hash];
+    unlock_db(db);
+    return 0;
+}
 
-      if (nextp->p_type == MDBM_PTYPE_FREE) {
-        /* fprintf(stderr, "MERGING %d and %d\n", cur, next); */
-        /* if we've done some compaction, try to merge any adjacent free pages */
-        if (next > db->db_hdr->h_last_chunk && 0 == nextp->p_num_pages) {
-          /* FIXME MDBM seems to often leave a "phantom" page at the end of the db.
-           * It's a zero-length, free page, which is not on the free list.
-           * Ignore it for now, but we should try to understand why it's present later. */
-          compacted = 1;
-          break;
-        }
-        if (!merge) {
-          /* adjacent free pages should always be coalesced */
-          mdbm_logerror(LOG_ERR, 0, "compact_db(%s) unexpected unmerged page on the freelist"
-              "pagenum=%u page=%p\n", db->db_filename, next, (void*)nextp);
-          errno = EINVAL;
-          ret = -1;
-          break;
-        }
-        /* merge-able */
-        /* fprintf(stderr, " old-size:%d (+=%d) \n", curp->p_num_pages, nextp->p_num_pages); */
-        curp->p_num_pages += nextp->p_num_pages;
-        /* fprintf(stderr, " new-size:%d \n", curp->p_num_pages); */
-        curp->p.p_next_free = nextp->p.p_next_free;
-        /* curp->p_prev_num_pages shouldn't change, but the *new* next chunk one should */
-        nextnext = next + nextp->p_num_pages;
-        if (nextnext >= db->db_num_pages) {
-          compacted = 1;
-          break; /* last free chunk... we're done */
-        }
-        nextnextp = MDBM_PAGE_PTR(db, nextnext);
-        nextnextp->p_prev_num_pages = curp->p_num_pages;
-        merge = 0;
-      } else if ((nextp->p_type == MDBM_PTYPE_DATA) || (nextp->p_type == MDBM_PTYPE_LOB)) {
-        int is_lob = (nextp->p_type == MDBM_PTYPE_LOB) ? 1 : 0;
-        uint32_t next_count = nextp->p_num_pages;
-        uint32_t next_sz = db->db_pagesize * next_count;
-        nextnext = next + next_count;
-        nextnextp = NULL;
-        if (nextnext < db->db_num_pages) {
-          nextnextp = MDBM_PAGE_PTR(db, nextnext);
-        }
-        /* fprintf(stderr, " SWAP(%d): nextnext:%d size:%d  pages(db:%d h:%d)\n", __LINE__,
-            nextnext, nextnextp?nextnextp->p_num_pages:-1, db->db_num_pages,
-            db->db_hdr->h_num_pages);
-        mdbm_check(db, 3, 3); */
-        {
-          /* stash old-page header to patch freelist */
-          mdbm_page_t old_free_h = *curp;
-          mdbm_page_t old_data_h = *nextp;
-          /* DB page index of the resulting free page (cur and next may be different sizes) */
-          uint32_t nu = cur +  next_count; /* the "new" page location */
-          mdbm_page_t* nup  = MDBM_PAGE_PTR(db, nu);
-          /* fprintf(stderr, "SWAPPING %d (sz:%d) and %d (sx:%d), nu=%d next_free:%d\n",
-               cur, cur_pages, next, next_count, nu, curp->p.p_next_free);
-             fprintf(stderr, " SWAP: nextnext:%d size:%d \n",
-               nextnext, (nextnextp ? nextnextp->p_num_pages : -1)); */
-          /* copy it down to lowest free page */
-          memmove((void*)curp, (void*)nextp, next_sz);
-          /* recreate free header at new location */
-          *nup = old_free_h;
-          nup->p_num = nu; /* gratuitous */
-          /* patch freelist (we're working at the front) */
-          if (db->db_hdr->h_first_free == cur) {
-            db->db_hdr->h_first_free = nu;
-          }
-          /* update the backwards chain */;
-          curp->p_prev_num_pages = old_free_h.p_prev_num_pages;
-          nup->p_prev_num_pages = old_data_h.p_num_pages;
+int
+mdbm_sethash(MDBM* db, int hash)
+{
+  int ret = mdbm_set_hash(db, hash);
+  return (ret < 0) ? ret : 1;
+}
 
-          /* fprintf(stderr, "SWAPPED cur=%d (sz:%d) and nu=%d (sz:%d)\n", */
-          /*    cur, curp->p_num_pages, nu, nup->p_num_pages);*/
-          /* update backwards chain for the chunk after cur and next */
-          if (nextnextp && nextnextp->p_num_pages != 0) {
-            /* fprintf(stderr," SWAP: nextnext:%d size:%d (nu->next_free:%d nxnx->next_free:%d)\n",
-                nextnext, nextnextp->p_num_pages, nup->p.p_next_free, nextnextp->p.p_next_free); */
-            nextnextp->p_prev_num_pages = old_free_h.p_num_pages;
-          }
+int
+mdbm_replace_db(MDBM* db, const char* newfile)
+{
+    MDBM* new_db = NULL;
+    struct stat st;
+    struct stat new_st;
 
-          if (is_lob) {
-            /* LOB_page->p_num should be the DATA page index that contains the key */
-            fixup_lob_pointer(db, old_data_h.p_num, next, cur);
-          } else {
-            /* patch page-table */
-            MDBM_SET_PAGE_INDEX(db, old_data_h.p_num, cur);
-          }
-          if (db->db_hdr->h_last_chunk == next) {
-            /* db->db_hdr->h_last_chunk = cur; */
-            db->db_hdr->h_last_chunk = nu;
-          }
-          merge = 1;
-        }
-      } else if (nextp->p_type == MDBM_PTYPE_DIR) {
-        /* broken */
-        mdbm_logerror(LOG_ERR,0, "compact_db(%s) encountered a dir-page on the freelist"
-            "pagenum=%u page=%p\n", db->db_filename, next, (void*)nextp);
+    if (!db) {
         errno = EINVAL;
-        ret = -1;
-        break;
-      } else {
-        /* horribly broken */
-        mdbm_logerror(LOG_ERR,0, "compact_db(%s) encountered an unknown-page on the freelist"
-            "pagenum=%u page=%p type=%d\n", db->db_filename, next, (void*)nextp, nextp->p_type);
+        return -1;
+    }
+
+    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
         errno = EINVAL;
-        ret = -1;
-        break;
-      }
+        return -1;
     }
-    MDBM_SIG_ACCEPT;
 
-    if (compacted && db->db_hdr->h_first_free && !ret) {
-      /* NOTE: we could verify that there is only one free-list chunk */
-      uint32_t last_page = db->db_hdr->h_first_free;
-      uint32_t last_unfree = 0;
-      int syspagesz = db->db_sys_pagesize;
-      size_t sys_pages = MDBM_NUM_PAGES_ROUNDED(syspagesz, last_page*db->db_pagesize);
-      size_t compact_size = sys_pages * syspagesz;
-      mdbm_page_t *freep = MDBM_PAGE_PTR(db, last_page);
-
-      last_unfree = last_page - freep->p_prev_num_pages;
-      /* truncate and munmap trailing pages, */
-      if (ftruncate(db->db_fd,compact_size) < 0) {
-          mdbm_logerror(LOG_ERR,0,"%s: ftruncate failure in compact_db()",db->db_filename);
-          ret = -1;
-      } else {
-        /* fprintf(stderr, "compact munmapping(%p, %d) compact_size:%d last_page:%d "
-            "sys_pages:%d old_len:%d\n",
-            db->db_base+compact_size, db->db_base_len-compact_size, compact_size, last_page,
-            sys_pages, db->db_base_len); */
-        if (munmap(db->db_base+compact_size,db->db_base_len-compact_size) < 0) {
-          mdbm_logerror(LOG_ERR,0,"%s: munmap() base:%p, len:%llu new:%llu "
-              "failure in compact_db()",
-              db->db_filename, (void*)db->db_base,(unsigned long long)db->db_base_len,
-              (unsigned long long)compact_size);
-          ret = -1;
-          /* fall thru to do damage control.. we've already truncated the file */
-        }
-        /* truncated and unmapped. update db, db->db_hdr,  */
-        db->db_num_pages = db->db_hdr->h_num_pages = last_page;
-        db->db_base_len = compact_size;
-        db->db_hdr->h_first_free = 0;
-        db->db_hdr->h_last_chunk = last_unfree;
-        /* sync_dir(), is there a better way to notify other users to adjust their map? */
-        db->db_hdr->h_dir_gen++;
-        sync_dir(db,NULL);
-      }
+    new_db = mdbm_open(newfile,MDBM_O_RDWR|MDBM_HEADER_ONLY|MDBM_ANY_LOCKS,0,0,0);
+    if (!new_db) {
+        goto replace_error;
     }
 
-    mdbm_unlock(db);
-    return ret;
-}
+    if ((db->db_ver_flag == MDBM_DBVER_3) != (new_db->db_ver_flag == MDBM_DBVER_3)) {
+        mdbm_logerror(LOG_ERR,0,
+                      "%s: mdbm_replace_db(%s) are different db formats",
+                      db->db_filename,newfile);
+        goto replace_error;
+    }
 
-/* Copies an existing entry to a new page.
- * 'page' is the destination page. 
- * 'key' and 'val' are the key and value of the entry to be copied.
- * 'hashval' is it's pre-calculated hash-value.
- * 'entry' is a pointer to the pre-existing entry on the old page.
- * 'oldpage' is the page where the entry already exists.
- * On entry, the DB should be locked, and signals deferred. 
- */
-int
-copy_page_entry(MDBM *db, mdbm_page_t* page, mdbm_hashval_t hashval, const datum* key, const datum* val, mdbm_entry_t* entry, mdbm_page_t* oldpage)
-{
-    int ksize, vsize, kvsize, esize;
-    mdbm_entry_t* freep = NULL;
-    int free_index = -1;
-    char* v;
-    if (page->p_type != MDBM_PTYPE_DATA) {
-      mdbm_log(LOG_ERR, "%s copy_page_entry() FAIL bad page-type %d (hash:%d)\n",
-          db->db_filename, page->p_type, hashval);
-      /* ensure data pagetype */
-      errno=EINVAL;
-      return -1;
+    if (fstat(db->db_fd,&st) == -1) {
+        mdbm_logerror(LOG_ERR,0,
+                      "%s: mdbm_replace_db unable to stat existing db file",
+                      db->db_filename);
+        goto replace_error;
     }
-    if (page->p_num_pages != 1) {
-      mdbm_log(LOG_ERR, "%s copy_page_entry() FAIL oversize page %d sub-pages (hash:%d)\n",
-          db->db_filename, page->p_num_pages, hashval);
-      /* punt for oversize pages */
-      errno=EINVAL;
-      return -1;
+
+    if (fstat(new_db->db_fd,&new_st) == -1) {
+        mdbm_logerror(LOG_ERR,0,
+                      "%s: mdbm_replace_db unable to stat new db file",
+                      newfile);
+        goto replace_error;
+    }
+
+    if (st.st_dev != new_st.st_dev) {
+      /* Must both be on the same device for rename() to work. */
+        errno = EXDEV;
+        mdbm_logerror(LOG_ERR,0,
+                      "%s: mdbm_replace_db cannot use %s",
+                      db->db_filename,newfile);
+        goto replace_error;
+    }
+
+    if (mdbm_lock(db) != 1) {
+        if (errno != EFAULT) {
+            mdbm_logerror(LOG_ERR,0,
+                          "%s: mdbm_replace_db unable to lock existing db",
+                          db->db_filename);
+            goto replace_error;
+        }
+    }
+
+    if (mdbm_lock(new_db) != 1) {
+        if (errno != EFAULT) {
+            mdbm_logerror(LOG_ERR,0,
+                          "%s: mdbm_replace_db unable to lock new db",
+                          newfile);
+            mdbm_unlock(db);
+            goto replace_error;
+        }
     }
 
-    /* check fit, include alignment bytes */
-    ksize = MDBM_ALIGN_LEN(db,key->dsize);
-    vsize = MDBM_ALIGN_LEN(db,val->dsize);
-    if (MDBM_DB_CACHEMODE(db)) {
-        vsize += MDBM_CACHE_ENTRY_T_SIZE;
-    }
-    kvsize = ksize + vsize;
-    esize = kvsize + MDBM_ENTRY_T_SIZE;
-    if (MDBM_ENTRY_LARGEOBJ(entry)) {
-      int delta = sizeof(mdbm_entry_lob_t) - vsize;
-      /* mdbm_entry_lob_t *lob_ent = MDBM_LOB_PTR1(db, oldpage, entry);
-         fprintf(stderr, "copy_page_entry() (page %d->%d) copying LOB key.size:%d, lob_page:%d\n",
-            oldpage->p_num, page->p_num, val->dsize, lob_ent->l_pagenum); */
-      /* adjust size, actual LOB data goes into another chunk of pages */
-      esize += delta;
-      kvsize += delta;
+    /* Journal records are for the db being replaced, never replay them on the new one. */
+    if (db->db_journal && journal_checkpoint(db,db->db_journal,0) < 0) {
+        mdbm_unlock(new_db);
+        mdbm_unlock(db);
+        goto replace_error;
     }
-    if (esize > MDBM_PAGE_FREE_BYTES(page)) {
-      mdbm_log(LOG_ERR, "%s copy_page_entry() FAIL insufficient space (%d vs %d) (hash:%d)\n",
-          db->db_filename, esize, MDBM_PAGE_FREE_BYTES(page), hashval);
-      errno=ENOMEM;
-      return -1;
+
+    if (rename(newfile,db->db_filename) == -1) {
+        mdbm_logerror(LOG_ERR,0,
+                      "%s: mdbm_replace_db rename (from %s) failure",
+                      newfile,db->db_filename);
+        mdbm_unlock(new_db);
+        mdbm_unlock(db);
+        goto replace_error;
     }
 
-    free_index = page->p.p_num_entries++;
-    freep = MDBM_ENTRY(page,free_index);
-    MDBM_INIT_TOP_ENTRY(freep+1,freep[0].e_offset - kvsize);
+    mdbm_unlock(new_db);
+    mdbm_close(new_db);
 
-    freep->e_offset -= MDBM_ALIGN_LEN(db,key->dsize);
-    freep->e_flags = 0;
-    freep->e_key.key.len = key->dsize;
-    freep->e_key.key.hash = hashval;
+    if (MDBM_HAS_CHANGES(db)) {
+        /* Consumers must resync from the new db. */
+        changes_new_epoch(db);
+    }
+    db->db_hdr->h_dbflags |= MDBM_HFLAG_REPLACED;
+    mdbm_unlock(db);
 
-    /* fprintf(stderr, "copy_page_entry() adding at index:%d (hash:%d (%d:%d), size:%d)\n", free_index, freep->e_key.key.hash, hashval, hashval>>16, freep->e_key.key.len); */
+    return 0;
 
-    memcpy(MDBM_KEY_PTR1(page,freep),key->dptr,key->dsize);
-    MDBM_SET_PAD_BYTES(freep,MDBM_ALIGN_PAD_BYTES(db,val->dsize));
-    v = MDBM_VAL_PTR1(db,page,freep);
-    if (MDBM_ENTRY_LARGEOBJ(entry)) {
-      mdbm_entry_lob_t *newlob, *oldlob;
-      mdbm_page_t *lob_chunk;
-      /* set flags and handle value specially */
-      freep->e_flags = entry->e_flags;
-      newlob = MDBM_LOB_PTR1(db, page, freep);
-      oldlob = MDBM_LOB_PTR1(db, oldpage, entry);
-      *newlob = *oldlob;
-      lob_chunk = MDBM_PAGE_PTR(db, oldlob->l_pagenum);
-      /* patch data page index on lob chunk starting page */
-      lob_chunk->p_num = page->p_num;
-    } else if (MDBM_DB_CACHEMODE(db)) {
-      memcpy(v,val->dptr-MDBM_CACHE_ENTRY_T_SIZE,vsize);
-    } else {
-      memcpy(v,val->dptr,val->dsize);
+ replace_error:
+    if (new_db) {
+        mdbm_close(new_db);
     }
-    return 0;
+    return -1;
 }
 
-
-/* compress_tree data structure for merging pages (source entries copied to destination) */
-typedef struct mdbm_merge_data {
-  MDBM* db;               /* The database being iterated over */
-  mdbm_page_t* src_page;  /* Pointer to the beginning of the source page */
-  mdbm_page_t* dst_page;  /* Pointer to the beginning of the destination page */
-  int src_index;          /* Index of the source page */
-  int dst_index;          /* Index of the source page */
-  int retcode;            /* return value, 0 for success */
-} mdbm_merge_data_t;
-
-static int
-merge_page_iter (void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+int
+get_version(const char *file, uint32_t *version)
 {
-  int ret;
-  mdbm_merge_data_t* data = (mdbm_merge_data_t*) user;
-  mdbm_entry_t* entry = MDBM_ENTRY(data->src_page, info->i_entry.entry_index);
+    MDBM *db;
+    if ((db = mdbm_open(file, MDBM_O_RDWR|MDBM_HEADER_ONLY, 0, 0, 0)) == NULL) {
+        return -1;
+    }
 
-  /* MDBM* db = data->db;
-     mdbm_hashval_t h = MDBM_HASH_VALUE(db,kv->key.dptr,kv->key.dsize);
-     int pagenum = hashval_to_pagenum(db, h);
-     int realpage = MDBM_GET_PAGE_INDEX(db, pagenum);
-     fprintf(stderr, "merge_page_iter() moving key [%s] hash:%d(%d) from %di to %di "
-     "(expected %di->%dp) \n", kv->key.dptr, entry->e_key.key.hash, (int)h,
-     data->src_index, data->dst_index, pagenum, realpage); */
-  /* assert(realpage == data->dst_index) */
+    *version = mdbm_get_version(db);
+    mdbm_close(db);
 
-  ret = copy_page_entry(data->db, data->dst_page, entry->e_key.key.hash, &kv->key, &kv->val,
-      entry, data->src_page);
-  if (ret) {
-    data->retcode = ret;
-  }
-  return ret;
+    return 0;
 }
 
-/* Internal function for compress_tree. 
- * Joins two DATA pages into a single page, if possible, by coping entry-by-entry
- * from the page at src_index to the page at dst_index.
- * If the merge fails, we unroll by restoring the old entry-count on the destination page.
- * NOTE: On entry signals should be deferred, the DB locked, and the destination
- * page should be un-fragmented. 
- */
+
 int
-merge_page(MDBM *db, int dest_index, int src_index)
+mdbm_replace_file(const char* oldfile, const char* newfile)
 {
-    mdbm_page_t* srcpg;
-    mdbm_page_t* dstpg;
-    mdbm_merge_data_t data  = {NULL, NULL, NULL, -1, -1, 0};
-    int ret = 0;
-    int need, avail;
+    int ret;
+    MDBM* db;
 
-    srcpg = MDBM_PAGE_PTR(db, MDBM_GET_PAGE_INDEX(db,src_index));
-    dstpg = MDBM_PAGE_PTR(db, MDBM_GET_PAGE_INDEX(db,dest_index));
-    if (!srcpg) {
-        mdbm_log(LOG_ERR, "%s: compress_tree() merge_page srcpg is NULL, src:%d dst:%d\n",
-            db->db_filename, src_index, dest_index);
-        /* fprintf(stderr, "compress_tree() merge_page FAILED, bad src (%d,%d)\n",
-           src_index, dest_index); */
-        errno = ENOMEM;
-        return -1;
-    }
-    if (!dstpg) {
-        mdbm_log(LOG_ERR, "%s: compress_tree() merge_page dstpg is NULL, src:%d dst:%d\n",
-            db->db_filename, src_index, dest_index);
-        /* fprintf(stderr, "compress_tree() merge_page FAILED, bad dst (%d,%d)\n",
-           src_index, dest_index); */
-        errno = ENOMEM;
+    if ((db = mdbm_open(oldfile,MDBM_O_RDWR|MDBM_HEADER_ONLY|MDBM_ANY_LOCKS,0,0,0)) == NULL) {
         return -1;
     }
-
-    if (srcpg != dstpg) { /* ensure the pages are actually different */
-      /* check for fit first */
-      avail = MDBM_PAGE_FREE_BYTES(dstpg);
-      need = db->db_pagesize - MDBM_PAGE_FREE_BYTES(srcpg);
-      if (need <= avail) {
-        uint32_t old_entry_count = srcpg->p.p_num_entries;
-        data.db=db;
-        data.src_page=srcpg;
-        data.dst_page=dstpg;
-        data.src_index=src_index;
-        data.dst_index=dest_index;
-        mdbm_iterate(db,src_index,merge_page_iter,MDBM_ITERATE_ENTRIES,&data);
-        ret = data.retcode;
-        if (ret) {
-          /* "delete" the newly added entries. */
-          srcpg->p.p_num_entries = old_entry_count;
-          mdbm_log(LOG_ERR, "%s: compress_tree() merge_page action FAILED (%d,%d)\n",
-              db->db_filename, src_index, dest_index);
-        }
-
-      } else {
-        mdbm_log(LOG_ERR, "%s: compress_tree() merge_page FAILED, "
-            "insufficient space:%d,%d  pages:%d,%d\n",
-            db->db_filename, need, avail, src_index, dest_index);
-        ret = -1;
-      }
-    } else {
-      /* left and right is the same page, log error */
-      mdbm_log(LOG_ERR, "%s: compress_tree() merge_page src_pg == dst_pg (%d,%d)\n",
-          db->db_filename, src_index, dest_index);
-    }
-
+    ret = mdbm_replace_db(db,newfile);
+    mdbm_close(db);
     return ret;
 }
 
 
-/* 
- * This routine attempts to recursively fold DATA pages from the current size to the
- * next lower power-of-two size.
- * At each step, it pre-calculates whether the folds will succeed in an attempt
- * to avoid needing to unroll changes.
- * If we succeed in folding, then we attempt to de-fragment the resulting 
- * free-pages via compact_db().
- * */
 int
-merge_all_pages(MDBM *db)
+mdbm_setspillsize(MDBM* db, int size)
 {
-    int bits = db->db_max_dirbit;
-    int lvl, left, right, lp, rp;
-    /*int rh, lh;*/
-    int pages, halfpages;
-    int cur, ret = 0;
-    int do_sync = 0;
-    int do_compact = 0;
-    int can_fold = 0;
-
-    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
-      mdbm_log(LOG_WARNING,"%s: merge_all_pages() doesn't support MEMORY-ONLY",
-          db->db_filename);
-      return -1;
+    if (!db) {
+        errno = EINVAL;
+        return -1;
     }
-    if (MDBM_IS_WINDOWED(db)) {
-      mdbm_log(LOG_WARNING,"%s: merge_all_pages() doesn't support WINDOWED MODE",
-          db->db_filename);
-      return -1;
+    if (size <= 1) {
+        mdbm_log(LOG_ERR, "%s: mdbm_setspillsize invalid size %u ", db->db_filename, size);
+        errno = EINVAL;
+        return -1;
     }
-
-    mdbm_lock(db);
-    for (lvl=1; lvl<=((bits)>>1); lvl<<=1) {}
-    /* for (lvl = bits; (lvl>1) && (ret==0); lvl>>=1) { */
-    for (; (lvl>1) && (ret==0); lvl>>=1) {
-        /* Try to iteratively fold down number of pages by powers of 2. */
-        pages = lvl<<1;
-        halfpages = pages/2;
-        /* fprintf(stderr, "compress_tree() level:%d (bits:%d) "
-            "pages:%d half:%d num_pages:%d max_dirbit:%d\n",
-            lvl, bits, pages, halfpages, db->db_num_pages, db->db_max_dirbit); */
-        /* verify fit for all pages on this level */
-        can_fold = 1;
-        for (left=0; left<halfpages; ++left) {
-            mdbm_page_t *srcpg, *dstpg;
-            right = left + halfpages;
-            lp = MDBM_GET_PAGE_INDEX(db,left);
-            rp = MDBM_GET_PAGE_INDEX(db,right);
-            srcpg = MDBM_PAGE_PTR(db,rp);
-            dstpg = MDBM_PAGE_PTR(db,lp);
-            if (srcpg && dstpg) {
-              if (srcpg->p_num_pages != 1 || dstpg->p_num_pages != 1 ) {
-                /* punt for any oversize pages */
-                can_fold = 0;
-                break;
-              } else {
-                /* pack all entries on the pages first */
-                wring_page(db, srcpg);
-                wring_page(db, dstpg);
-                {
-                  int avail = MDBM_PAGE_FREE_BYTES(dstpg);
-                  int need = db->db_pagesize - MDBM_PAGE_FREE_BYTES(srcpg);
-                  if (need >= avail || need<0 || avail<0) {
-                    /* fprintf(stderr, "compress_tree() CAN'T FOLD (space %d vs %d) "
-                        "level:%d (bits:%d) pages:%d half:%d num_pages:%d max_dirbit:%d\n",
-                        need, avail,
-                        lvl, bits, pages, halfpages, db->db_num_pages, db->db_max_dirbit); */
-                    can_fold = 0;
-                    break;
-                  }
+    if (!MDBM_LOB_ENABLED(db)) {
+        mdbm_log(LOG_ERR, "%s: mdbm_setspillsize on db without large object support ", db->db_filename);
+        errno = EINVAL;
+        return -1;
+    }
+    if (lock_db(db) != 1) {
+        return -1;
+    }
+    if (size > db->db_pagesize) {
+        unlock_db(db);
+        errno = EINVAL;
+        return -1;
+    }
+    db->db_spillsize = db->db_hdr->h_spill_size = size;
+    unlock_db(db);
+    return 0;
+}
+
+void
+mdbm_prune(MDBM* db, int(*prune) (MDBM* db, datum, datum, void *), void *param)
+{
+    int i;
+
+    if (lock_db(db) < 0) {
+        return;
+    }
+    for (i = 0; i <= db->db_max_dirbit; i++) {
+        if (MDBM_GET_PAGE_INDEX(db,i)) {
+            mdbm_page_t* page = MDBM_MAPPED_PAGE_PTR(db,MDBM_GET_PAGE_INDEX(db,i));
+            mdbm_entry_t* ep;
+            mdbm_entry_data_t e;
+
+            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
+                if (ep->e_key.match) {
+                    datum k, v;
+
+                    get_kv(db,&e,&k,&v);
+                    if (prune(db,k,v,param)) {
+                        if (logs_changes(db)) {
+                            log_change(db,MDBM_CHANGE_DELETE,&k,NULL);
+                        }
+                        del_entry(db,page,ep);
+                    }
                 }
-              }
-            } else {
-              can_fold = 0;
-              break;
             }
-        }
-        if (!can_fold) {
-          break;
-        }
-        for (left=0; left<halfpages; ++left) {
-            right = left + halfpages;
-            /* skip if not split */
-            /* lh = hashval_to_pagenum(db, left); rh = hashval_to_pagenum(db, right); */
-            lp = MDBM_GET_PAGE_INDEX(db,left);
-            rp = MDBM_GET_PAGE_INDEX(db,right);
-            /* fprintf(stderr, "compress_tree() attempting to merge %d+%d (lp:%d, rp:%d)\n",
-               left, right, lp, rp); */
-            if (lp == rp) {  /* they map to the same physical page already */
-              /* fprintf(stderr, "compress_tree() MERGE SKIPPED %d+%d (lp:%d, rp:%d)\n",
-                 left, right, lp, rp); */
-              continue;
+            if (MDBM_IS_WINDOWED(db)) {
+                release_window_page(db,page);
             }
-            if (rp >= db->db_num_pages || right>db->db_max_dirbit) { /* not really in use */
-              /* fprintf(stderr, "compress_tree() MERGE SKIPPED2 %d+%d (lp:%d, rp:%d) "
-                "num_pages:%d max_dirbit:%d\n", left, right, lp, rp,
-                db->db_num_pages, db->db_max_dirbit); */
+        }
+    }
+    unlock_db(db);
+    (void)journal_commit(db);
+}
 
-              continue;
-            }
-            /* Don't allow signals to interrupt mid merge. */
-            MDBM_SIG_DEFER;
-            cur = merge_page(db, left, right);
-            if (cur) {
-              mdbm_log(LOG_ERR, "compress_tree() MERGE FAILED pages:%d+%d (lp:%d, rp:%d)\n",
-                  left, right, lp, rp);
-              ret = -1;
-            } else {
-               /* fprintf(stderr, "compress_tree() MERGE SUCCEEDED %d+%d (lp:%d, rp:%d)\n",
-                  left, right, lp, rp); */
-              do_sync = 1;
-              MDBM_SET_PAGE_INDEX(db, right, lp);
-              /* clear dirbits, so we don't have to re-split if resize() fails */
-              MDBM_CLEAR_DIR_BIT(db, right);
-              db->db_dir_flags &= ~MDBM_HFLAG_PERFECT;
-              /* page is merged out, release it. */
-              free_chunk(db, rp, NULL);
-              assert(MDBM_DIR_BIT(db, left));
+void
+mdbm_purge(MDBM* db)
+{
+    int i;
+
+    if (lock_db(db) < 0) {
+        return;
+    }
+    if (logs_changes(db)) {
+        log_change(db,MDBM_CHANGE_PURGE,NULL,NULL);
+    }
+    for (i = 0; i <= db->db_max_dirbit; i++) {
+        if (MDBM_GET_PAGE_INDEX(db,i)) {
+            mdbm_page_t* page = MDBM_PAGE_PTR(db,MDBM_GET_PAGE_INDEX(db,i));
+            page->p.p_num_entries = 0;
+            init_data_page(db,page);
+            dirty_mark_page(db,page);
+            if (MDBM_IS_WINDOWED(db)) {
+                release_window_page(db,page);
             }
-            MDBM_SIG_ACCEPT;
         }
-        if (ret) {
-          mdbm_log(LOG_ERR, "%s compress_tree() LEVEL %d FAILED \n", db->db_filename, lvl);
-          break;
-        } else {
-          int new_ptsize;
-          mdbm_ptentry_t* old_ptable = MDBM_PTABLE_PTR(MDBM_DIR_PTR(db),db->db_dir_shift);
-          MDBM_SIG_DEFER;
-          /* fprintf(stderr, "compress_tree() LEVEL %d SUCCEEDED \n", lvl); */
-          /* DROP one directory level */
-          do_compact = 1;
-          db->db_dir_flags |= MDBM_HFLAG_PERFECT;
+    }
+    if (db->db_spillsize) {
+        free_large_object_chunks(db);
+    }
+    if (MDBM_HAS_FILTER(db)) {
+        memset(MDBM_FILTER_PTR(db,0),0,MDBM_FILTER_SIZE(db->db_dir_shift));
+    }
+    unlock_db(db);
+    (void)journal_commit(db);
+}
 
-          /* adjust handle */
-          db->db_dir_shift -= 1;
-          /*db->db_max_dir_shift */
-          db->db_max_dirbit >>= 1;
+/*
+ * mdbm_save() snapshot format (native byte order):
+ *   mdbm_save_hdr_t, then any number of blocks.  Each block is a
+ *   mdbm_save_block_t followed by b_comp_len compressed bytes, or by
+ *   b_raw_len raw bytes if b_comp_len is 0.  A block's raw bytes are
+ *   back-to-back records: uint32_t key length, uint32_t value length, key, value.
+ * Blocks are written concurrently, so their order in the file is arbitrary.
+ * The header is rewritten last, with the totals and MDBM_SAVE_HFLAG_COMPLETE.
+ */
+#define MDBM_SAVE_MAGIC             0x4d44534e  /* "MDSN" */
+#define MDBM_SAVE_BLOCK_MAGIC       0x4d44424b  /* "MDBK" */
+#define MDBM_SAVE_VERSION           1
+#define MDBM_SAVE_HFLAG_COMPLETE    0x01
+#define MDBM_SAVE_HFLAG_COMPRESSED  0x02
+#define MDBM_SAVE_BLOCK_SIZE        (256*1024)  /* raw block size, unless a record is bigger */
+#define MDBM_SAVE_PAGES_PER_THREAD  256         /* fewest logical pages worth a save thread */
+#define MDBM_SAVE_MAX_THREADS       8
+#define MDBM_SAVE_CHUNK_PAGES       64          /* logical pages handed to a thread at a time */
+
+typedef struct mdbm_save_hdr {
+    uint32_t s_magic;
+    uint16_t s_version;
+    uint16_t s_hdr_size;
+    uint32_t s_flags;
+    uint32_t s_pagesize;        /* source db page size */
+    uint32_t s_hash;            /* source db hash function */
+    uint32_t s_num_blocks;
+    uint64_t s_num_records;
+    uint64_t s_key_bytes;
+    uint64_t s_val_bytes;
+    uint64_t s_lob_records;     /* records that were large objects in the source db */
+    uint64_t s_lob_bytes;       /* value bytes of those records */
+} mdbm_save_hdr_t;
+
+typedef struct mdbm_save_block {
+    uint32_t b_magic;
+    uint32_t b_raw_len;
+    uint32_t b_comp_len;        /* 0 if stored uncompressed */
+    uint32_t b_num_records;
+    uint32_t b_crc;             /* CRC-32C of the raw bytes */
+    uint32_t b_pad;
+} mdbm_save_block_t;
+
+struct save_state {
+    int                 fd;
+    int                 level;      /* compression level, 0 for none */
+    uint32_t            next_page;  /* next logical page to hand out */
+    pthread_mutex_t     mutex;      /* guards offset and hdr */
+    uint64_t            offset;     /* where the next block goes */
+    mdbm_save_hdr_t     hdr;
+    volatile int        stop;       /* set by the first worker to fail */
+};
 
-          /* adjust header */
-          db->db_hdr->h_dir_shift -= 1;
-          /*db->db_hdr->h_max_dir_shift */
+struct save_worker {
+    struct save_state*  ss;
+    MDBM*               db;
+    pthread_t           thread;
+    char*               buf;        /* raw block being filled */
+    uint32_t            len;
+    uint32_t            cap;
+    uint32_t            num_records;
+    char*               cbuf;       /* block header and compressed block */
+    uint32_t            ccap;
+    mdbm_save_hdr_t     totals;     /* this worker's share of the hdr counts */
+    int                 ret;
+    int                 err;
+};
 
-          /* copy down page-table */
-          new_ptsize = MDBM_PTABLE_SIZE(db->db_dir_shift);
-          db->db_ptable = MDBM_PTABLE_PTR(MDBM_DIR_PTR(db),db->db_dir_shift);
-          memmove(db->db_ptable, old_ptable, new_ptsize);
+static int
+save_pwrite(int fd, const char* buf, size_t len, off_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd,buf,len,off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
 
-          ++db->db_hdr->h_dir_gen;
-          sync_dir(db, db->db_hdr);
+/* Compresses (if enabled) and writes out a worker's current block. */
+static int
+save_flush(struct save_worker* w)
+{
+    struct save_state* ss = w->ss;
+    mdbm_save_block_t* b;
+    uint32_t need;
+    uint64_t off;
+    int clen = 0;
 
-          /* NOTE: could free trailing dir_page(s) if we're using less */
-          MDBM_SIG_ACCEPT;
+    if (!w->len) {
+        return 0;
+    }
+    need = sizeof(*b) + mdbm_internal_lz_bound(w->len);
+    if (w->ccap < need) {
+        char* p = (char*)realloc(w->cbuf,need);
+        if (!p) {
+            errno = ENOMEM;
+            return -1;
+        }
+        w->cbuf = p;
+        w->ccap = need;
+    }
+    b = (mdbm_save_block_t*)w->cbuf;
+    b->b_magic = MDBM_SAVE_BLOCK_MAGIC;
+    b->b_raw_len = w->len;
+    b->b_num_records = w->num_records;
+    b->b_crc = (uint32_t)mdbm_hash_crc32c((const uint8_t*)w->buf,w->len);
+    b->b_pad = 0;
+    if (ss->level > 0) {
+        clen = mdbm_internal_lz_compress((const uint8_t*)w->buf,w->len,
+                                         (uint8_t*)w->cbuf + sizeof(*b),w->ccap - sizeof(*b),
+                                         ss->level);
+        if (clen >= (int)w->len) {
+            clen = 0;   /* incompressible, store it raw */
+        }
+    }
+    b->b_comp_len = (clen > 0) ? clen : 0;
+
+    pthread_mutex_lock(&ss->mutex);
+    off = ss->offset;
+    ss->offset += sizeof(*b) + (clen > 0 ? (uint32_t)clen : w->len);
+    ss->hdr.s_num_blocks++;
+    pthread_mutex_unlock(&ss->mutex);
+
+    if (clen > 0) {
+        if (save_pwrite(ss->fd,w->cbuf,sizeof(*b) + clen,off) < 0) {
+            return -1;
         }
+    } else if (save_pwrite(ss->fd,w->cbuf,sizeof(*b),off) < 0
+               || save_pwrite(ss->fd,w->buf,w->len,off + sizeof(*b)) < 0)
+    {
+        return -1;
     }
+    w->len = 0;
+    w->num_records = 0;
+    return 0;
+}
 
-    if (do_sync) {
-      ++db->db_hdr->h_dir_gen;
-      sync_dir(db,NULL);
-    }
+static int
+save_record(void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+{
+    struct save_worker* w = (struct save_worker*)user;
+    uint32_t klen, vlen, need;
+    char* p;
 
-    if (do_compact) {
-      int rret=0;
-      /* fprintf(stderr, "DOING COMPACTION\n");*/
-      /* NOTE: we don't compact the directory or pagetable.
-       * Ideally, " resize(db, lvl-1, halfpages); "
-       * would do this, but it doesn't work for shrinking.
-       */
-      rret = compact_db(db);
-      if (rret) {
-        mdbm_logerror(LOG_ERR,0, "%s: compact_db() failed", db->db_filename);
-        errno = ENOMEM;
-        ret = -1;
-      }
-    } else {
-      /* fprintf(stderr, "SKIPPING COMPACTION\n");*/
+    if (info->i_entry.entry_flags & MDBM_ENTRY_DELETED) {
+        return 0;
     }
+    if (w->ss->stop) {
+        return 1;
+    }
+    klen = kv->key.dsize;
+    vlen = kv->val.dsize;
+    need = 2*sizeof(uint32_t) + klen + vlen;
+    if (w->len + need > w->cap) {
+        if (save_flush(w) < 0) {
+            goto save_record_error;
+        }
+        if (need > w->cap) {
+            if ((p = (char*)realloc(w->buf,need)) == NULL) {
+                errno = ENOMEM;
+                goto save_record_error;
+            }
+            w->buf = p;
+            w->cap = need;
+        }
+    }
+    p = w->buf + w->len;
+    memcpy(p,&klen,sizeof(klen));
+    memcpy(p + sizeof(klen),&vlen,sizeof(vlen));
+    memcpy(p + 2*sizeof(uint32_t),kv->key.dptr,klen);
+    memcpy(p + 2*sizeof(uint32_t) + klen,kv->val.dptr,vlen);
+    w->len += need;
+    w->num_records++;
 
+    w->totals.s_num_records++;
+    w->totals.s_key_bytes += klen;
+    w->totals.s_val_bytes += vlen;
+    if (info->i_entry.entry_flags & MDBM_ENTRY_LARGE_OBJECT) {
+        w->totals.s_lob_records++;
+        w->totals.s_lob_bytes += vlen;
+    }
+    return 0;
 
-    CHECK_DB(db);
-    mdbm_unlock(db);
-    return ret;
+ save_record_error:
+    w->ret = -1;
+    w->err = errno;
+    w->ss->stop = 1;
+    return 1;
 }
 
+static void*
+save_worker_run(void* arg)
+{
+    struct save_worker* w = (struct save_worker*)arg;
+    struct save_state* ss = w->ss;
+    MDBM* db = w->db;
 
+    while (!ss->stop) {
+        uint32_t first = atomic_add32u(&ss->next_page,MDBM_SAVE_CHUNK_PAGES);
+        uint32_t pg;
 
-void
-mdbm_compress_tree(MDBM *db)
-{
-    /* XXX
-    mdbm_log(LOG_CRIT, "%s: unimplemented mdbm_compress_tree",
-             db->db_filename);
-    abort();
-    */
-    int ret = merge_all_pages(db);
-    if (ret) {
-      mdbm_logerror(LOG_ERR,0, "%s: mdbm_compress_tree failed: merge_all_pages() returned %d\n", db->db_filename, ret);
+        for (pg = first; pg < first + MDBM_SAVE_CHUNK_PAGES && !ss->stop; ++pg) {
+            if (pg > (uint32_t)db->db_max_dirbit) {
+                goto save_worker_done;
+            }
+            /* mdbm_save() holds the db lock, so workers just read the shared handle. */
+            if (mdbm_iterate(db,pg,save_record,MDBM_ITERATE_ENTRIES|MDBM_ITERATE_NOLOCK,w) < 0) {
+                w->ret = -1;
+                w->err = errno;
+                ss->stop = 1;
+            }
+        }
     }
 
+ save_worker_done:
+    if (!ss->stop && save_flush(w) < 0) {
+        w->ret = -1;
+        w->err = errno;
+        ss->stop = 1;
+    }
+    return NULL;
 }
 
-void
-mdbm_stat_header(MDBM *db)
+int
+mdbm_save(MDBM *db, const char *file, int flags, int mode, int compressionLevel)
 {
-    /* XXX */
-    mdbm_log(LOG_CRIT, "%s: unimplemented mdbm_stat_header",
-             db->db_filename);
-    abort();
+    struct save_state ss;
+    struct save_worker* workers;
+    int oflags = O_WRONLY;
+    int nthreads;
+    int started = 0;
+    int ret = 0;
+    int err = 0;
+    int i;
+    long ncpu;
+
+    if (!db || !file) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (flags & MDBM_O_TRUNC) {
+        oflags |= O_TRUNC;
+        if (flags & MDBM_O_CREAT) {
+            oflags |= O_CREAT;
+        }
+    } else if (flags & MDBM_O_CREAT) {
+        oflags |= O_CREAT | O_EXCL;     /* don't overwrite an existing file */
+    }
+    if (flags & MDBM_SAVE_COMPRESS_TREE) {
+        mdbm_compress_tree(db);
+    }
+
+    memset(&ss,0,sizeof(ss));
+    ss.level = (compressionLevel > 0) ? compressionLevel : 0;
+    ss.offset = sizeof(ss.hdr);
+    ss.hdr.s_magic = MDBM_SAVE_MAGIC;
+    ss.hdr.s_version = MDBM_SAVE_VERSION;
+    ss.hdr.s_hdr_size = sizeof(ss.hdr);
+    ss.hdr.s_flags = ss.level ? MDBM_SAVE_HFLAG_COMPRESSED : 0;
+    ss.hdr.s_pagesize = db->db_pagesize;
+    ss.hdr.s_hash = db->db_hdr->h_hash_func;
+    if ((ss.fd = open(file,oflags,mode ? mode : 0666)) < 0) {
+        err = errno;
+        mdbm_logerror(LOG_ERR,0,"%s: mdbm_save cannot open %s",db->db_filename,file);
+        errno = err;
+        return -1;
+    }
+    /* An incomplete header until the save finishes, so a partial file won't restore. */
+    if (save_pwrite(ss.fd,(const char*)&ss.hdr,sizeof(ss.hdr),0) < 0) {
+        err = errno;
+        close(ss.fd);
+        errno = err;
+        return -1;
+    }
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (db->db_max_dirbit + 1) / MDBM_SAVE_PAGES_PER_THREAD;
+    if (nthreads > ncpu) {
+        nthreads = (int)ncpu;
+    }
+    if (nthreads > MDBM_SAVE_MAX_THREADS) {
+        nthreads = MDBM_SAVE_MAX_THREADS;
+    }
+    if (nthreads < 1 || MDBM_IS_WINDOWED(db)) {
+        nthreads = 1;   /* the window belongs to the handle */
+    }
+    if ((workers = (struct save_worker*)calloc(nthreads,sizeof(*workers))) == NULL) {
+        close(ss.fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Hold the db lock throughout, for a consistent snapshot. */
+    if (mdbm_lock(db) != 1) {
+        err = errno;
+        free(workers);
+        close(ss.fd);
+        errno = err;
+        return -1;
+    }
+    pthread_mutex_init(&ss.mutex,NULL);
+    for (i = 0; i < nthreads; i++) {
+        workers[i].ss = &ss;
+        workers[i].cap = MDBM_SAVE_BLOCK_SIZE;
+        if ((workers[i].buf = (char*)malloc(workers[i].cap)) == NULL) {
+            ret = -1;
+            err = ENOMEM;
+            break;
+        }
+        workers[i].db = db;
+        if (pthread_create(&workers[i].thread,NULL,save_worker_run,&workers[i]) != 0) {
+            mdbm_logerror(LOG_ERR,0,"%s: mdbm_save thread create failure",db->db_filename);
+            ret = -1;
+            err = EAGAIN;
+            break;
+        }
+        started++;
+    }
+    if (ret < 0) {
+        ss.stop = 1;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread,NULL);
+        if (workers[i].ret < 0 && !ret) {
+            ret = -1;
+            err = workers[i].err;
+        }
+        ss.hdr.s_num_records += workers[i].totals.s_num_records;
+        ss.hdr.s_key_bytes += workers[i].totals.s_key_bytes;
+        ss.hdr.s_val_bytes += workers[i].totals.s_val_bytes;
+        ss.hdr.s_lob_records += workers[i].totals.s_lob_records;
+        ss.hdr.s_lob_bytes += workers[i].totals.s_lob_bytes;
+    }
+    mdbm_unlock(db);
+    for (i = 0; i < nthreads; i++) {
+        free(workers[i].buf);
+        free(workers[i].cbuf);
+    }
+    free(workers);
+    pthread_mutex_destroy(&ss.mutex);
+
+    if (!ret) {
+        ss.hdr.s_flags |= MDBM_SAVE_HFLAG_COMPLETE;
+        if (save_pwrite(ss.fd,(const char*)&ss.hdr,sizeof(ss.hdr),0) < 0
+            || ftruncate(ss.fd,ss.offset) < 0)
+        {
+            ret = -1;
+            err = errno;
+        }
+    }
+    if (close(ss.fd) < 0 && !ret) {
+        ret = -1;
+        err = errno;
+    }
+    if (ret < 0) {
+        mdbm_log(LOG_ERR,"%s: mdbm_save to %s failed: %s",
+                 db->db_filename,file,strerror(err));
+        errno = err;
+    }
+    return ret;
 }
 
-void
-mdbm_stat_all_page(MDBM *db)
+/* Reads exactly len bytes. Returns 1, or 0 at end of file, or -1 on error. */
+static int
+restore_read(int fd, void* buf, size_t len)
 {
-    /* XXX */
-    mdbm_log(LOG_CRIT, "%s: unimplemented mdbm_stat_all_page",
-             db->db_filename);
-    abort();
-}
+    char* p = (char*)buf;
+    size_t got = 0;
 
-void
-mdbm_chk_error(MDBM* db, int pagenum, int mapped_pagenum, int index)
-{
-    /* XXX */
+    while (got < len) {
+        ssize_t n = read(fd,p + got,len - got);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (!n) {
+            if (got) {
+                errno = EINVAL;     /* truncated */
+                return -1;
+            }
+            return 0;
+        }
+        got += n;
+    }
+    return 1;
 }
 
-int
-mdbm_chk_page(MDBM *db, int pno)
+/*
+ * Pre-splits an empty, single-page db to about the number of pages needed to
+ * hold \a bytes of entries at \a fill percent full, so records mostly go
+ * straight onto their final page.  Dbs that already have a directory keep
+ * its shape.
+ */
+static void
+presize_db(MDBM* db, uint64_t bytes, int fill, const char* what)
 {
-    if (!db || pno > db->db_max_dirbit) {
-      errno = EINVAL;
-      return -1;
-    }
+    uint64_t pages;
+    int usable = db->db_pagesize - MDBM_PAGE_T_SIZE - MDBM_ENTRY_T_SIZE;
+    int shift;
 
-    if (lock_db_ex(db) != 1) {
-        return -1;
+    if (db->db_max_dirbit > 0 || MDBM_IS_WINDOWED(db) || !bytes) {
+        return;
     }
-    if (check_db_page(db,pno,1,3) > 0) {
-        unlock_db(db);
-        errno = EFAULT;
-        return -1;
+    pages = (bytes * 100) / ((uint64_t)usable * fill) + 1;
+    for (shift = 0; ((uint64_t)2 << shift) <= pages && ((uint64_t)2 << shift) <= MDBM_NUMPAGES_MAX;
+         ++shift)
+        ;
+    while (shift > 0 && db->db_hdr->h_max_pages
+           && (1U << shift) + MDBM_NUM_DIR_PAGES(db->db_pagesize,shift,db->db_hdr->h_dbflags)
+               > db->db_hdr->h_max_pages)
+    {
+        --shift;
+    }
+    if (shift > 0 && mdbm_pre_split(db,1U << shift) < 0) {
+        mdbm_log(LOG_DEBUG,"%s: %s pre-split to %u pages failed",
+                 db->db_filename,what,1U << shift);
     }
-    unlock_db(db);
-    return 0;
 }
 
-int
-mdbm_chk_all_page(MDBM *db)
+/* Pre-sizes a db for a snapshot, at 3/4 full. */
+static void
+restore_presize(MDBM* db, const mdbm_save_hdr_t* hdr)
 {
-    int i;
-    int nerr = 0;
+    int per_record = MDBM_ENTRY_T_SIZE + db->db_align_mask + db->db_hashlo_len;
 
-    if (lock_db_ex(db) < 0) {
-        return -1;
-    }
-    for (i = 0; i <= db->db_max_dirbit; i++) {
-        if (check_db_page(db,i,1,3) > 0) {
-            nerr++;
-        }
+    if (!hdr->s_num_records) {
+        return;
     }
-    unlock_db(db);
-    if (nerr) {
-        errno = EFAULT;
-        return -1;
+    if (MDBM_DB_CACHEMODE(db)) {
+        per_record += MDBM_CACHE_ENTRY_T_SIZE;
     }
-    return 0;
+    presize_db(db,
+               hdr->s_key_bytes + (hdr->s_val_bytes - hdr->s_lob_bytes)
+               + hdr->s_lob_records * MDBM_ENTRY_LOB_T_SIZE
+               + hdr->s_num_records * per_record,
+               75,"mdbm_restore");
 }
 
-mdbm_ubig_t
-mdbm_get_page(MDBM* db, const datum* key)
+/*
+ * Adds a restored record.  It is appended directly to its page when it fits
+ * (the db was emptied first, so there's no existing key to look for);
+ * otherwise it goes through the regular store, which splits pages and
+ * handles large objects.  \a prehash is the key's hash, if already known.
+ * On entry the db should be locked.
+ */
+static int
+restore_record(MDBM* db, datum* key, datum* val, const mdbm_hashval_t* prehash)
 {
     mdbm_hashval_t hashval;
     mdbm_pagenum_t pagenum;
+    mdbm_page_t* page;
+    mdbm_entry_t* freep;
+    int free_index;
+    int ksize, vsize, kvsize, esize;
+    char* v;
 
-    if (!db || !key || (key->dsize == 0) || (key->dptr == NULL)) {
-      return -1;
+    if (key->dsize < 1 || key->dsize > MDBM_KEYLEN_MAX || val->dsize < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    ksize = MDBM_KEY_ALIGN_LEN(db,key->dsize);
+    vsize = MDBM_ALIGN_LEN(db,val->dsize);
+    if (MDBM_DB_CACHEMODE(db)) {
+        vsize += MDBM_CACHE_ENTRY_T_SIZE;
+    }
+    kvsize = ksize + vsize;
+    esize = kvsize + MDBM_ENTRY_T_SIZE;
+    hashval = prehash ? *prehash : MDBM_HASH_VALUE(db,key->dptr,key->dsize);
+
+    if (MDBM_IS_WINDOWED(db)
+#ifdef MDBM_BSOPS
+        || db->db_bsops
+#endif
+        || esize > db->db_pagesize - MDBM_PAGE_T_SIZE - MDBM_ENTRY_T_SIZE
+        || (db->db_spillsize && MDBM_LOB_ENABLED(db) && vsize >= db->db_spillsize))
+    {
+        return (store_entry(db,key,val,MDBM_INSERT_DUP,NULL,&hashval) < 0) ? -1 : 0;
     }
 
-    hashval = hash_value(db,key);
-    if (mdbm_internal_do_lock(db,MDBM_LOCK_READ,MDBM_LOCK_WAIT,key,&hashval,&pagenum) < 0) {
-        return -1;
+    pagenum = hashval_to_pagenum(db,hashval);
+    MDBM_SIG_DEFER;
+    if ((page = pagenum_to_page(db,pagenum,MDBM_PAGE_ALLOC,MDBM_PAGE_MAP)) == NULL
+        || esize > MDBM_PAGE_FREE_BYTES(page))
+    {
+        MDBM_SIG_ACCEPT;
+        return (store_entry(db,key,val,MDBM_INSERT_DUP,NULL,&hashval) < 0) ? -1 : 0;
     }
-    mdbm_internal_do_unlock(db,key);
-    return pagenum;
+
+    free_index = page->p.p_num_entries++;
+    freep = MDBM_ENTRY(page,free_index);
+    MDBM_INIT_TOP_ENTRY(freep+1,freep[0].e_offset - kvsize);
+    freep->e_offset -= ksize;
+    freep->e_flags = 0;
+    freep->e_key.key.len = key->dsize;
+    freep->e_key.key.hash = hashval >> 16;
+    if (MDBM_HAS_FILTER(db)) {
+        filter_add(db,pagenum,freep->e_key.match);
+    }
+    if (MDBM_HAS_PAGE_INDEX(db)) {
+        page_index_insert(db,page,free_index);
+    }
+    memcpy(MDBM_KEY_PTR1(page,freep),key->dptr,key->dsize);
+    if (db->db_hashlo_len) {
+        set_entry_hashlo(page,freep,(uint16_t)hashval);
+    }
+    MDBM_SET_PAD_BYTES(freep,MDBM_ALIGN_PAD_BYTES(db,val->dsize));
+    v = MDBM_VAL_PTR1(db,page,freep);
+    if (MDBM_DB_CACHEMODE(db)) {
+        memset(v,0,MDBM_CACHE_ENTRY_T_SIZE);
+        v += MDBM_CACHE_ENTRY_T_SIZE;
+    }
+    memcpy(v,val->dptr,val->dsize);
+    if (!(db->db_flags & MDBM_DBFLAG_NO_DIRTY)) {
+        freep->e_flags |= MDBM_EFLAG_DIRTY;
+    }
+    dirty_mark_page(db,page);
+    if (logs_changes(db)) {
+        /* Replayed after the purge that started the restore or bulk load. */
+        log_change(db,MDBM_CHANGE_INSERT_DUP,key,val);
+    }
+    MDBM_SIG_ACCEPT;
+    return 0;
 }
 
-int
-mdbm_sync(MDBM *db)
+/* Loads the records of one block.  Returns the record count, or -1. */
+static int
+restore_block(MDBM* db, const mdbm_save_block_t* b, const char* raw)
 {
-    if (!db) {
+    const char* p = raw;
+    const char* end = raw + b->b_raw_len;
+    uint32_t i;
+
+    if ((uint32_t)mdbm_hash_crc32c((const uint8_t*)raw,b->b_raw_len) != b->b_crc) {
         errno = EINVAL;
         return -1;
     }
+    for (i = 0; i < b->b_num_records; i++) {
+        uint32_t klen, vlen;
+        datum key, val;
 
-    if (MDBM_IS_RDONLY(db)) {
-        return 0;
-    } else {
-      int ret = msync(db->db_base,MDBM_DB_MAP_SIZE(db),MS_ASYNC);
-      if (MDBM_DO_STAT_PAGE(db)) {
-            MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_SYNC);
-      }
-
-      return ret;
+        if (end - p < (ptrdiff_t)(2*sizeof(uint32_t))) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(&klen,p,sizeof(klen));
+        memcpy(&vlen,p + sizeof(klen),sizeof(vlen));
+        p += 2*sizeof(uint32_t);
+        if (klen > (uint32_t)(end - p) || vlen > (uint32_t)(end - p) - klen
+            || vlen > INT32_MAX)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        key.dptr = (char*)p;
+        key.dsize = klen;
+        val.dptr = (char*)p + klen;
+        val.dsize = vlen;
+        if (restore_record(db,&key,&val,NULL) < 0) {
+            return -1;
+        }
+        p += klen + vlen;
     }
+    if (p != end) {
+        errno = EINVAL;
+        return -1;
+    }
+    return b->b_num_records;
 }
 
 int
-mdbm_fsync(MDBM *db)
+mdbm_restore(MDBM *db, const char *file)
 {
-    int ret, e;
+    mdbm_save_hdr_t hdr;
+    mdbm_save_block_t b;
+    char* buf = NULL;       /* raw block */
+    char* cbuf = NULL;      /* compressed block */
+    uint32_t cap = 0;
+    uint32_t ccap = 0;
+    uint64_t num_records = 0;
+    int fd;
+    int ret = -1;
+    int err = 0;
+    int n;
 
-    if (!db) {
+    if (!db || !file) {
         errno = EINVAL;
         return -1;
     }
-
-    if (MDBM_IS_RDONLY(db) || (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE)) {
-        return 0;
+    if (MDBM_IS_RDONLY(db)) {
+        errno = EPERM;
+        return -1;
+    }
+    if ((fd = open(file,O_RDONLY)) < 0) {
+        err = errno;
+        mdbm_logerror(LOG_ERR,0,"%s: mdbm_restore cannot open %s",db->db_filename,file);
+        errno = err;
+        return -1;
+    }
+    if (restore_read(fd,&hdr,sizeof(hdr)) != 1
+        || hdr.s_magic != MDBM_SAVE_MAGIC
+        || hdr.s_version != MDBM_SAVE_VERSION
+        || hdr.s_hdr_size != sizeof(hdr)
+        || !(hdr.s_flags & MDBM_SAVE_HFLAG_COMPLETE)
+        || hdr.s_lob_bytes > hdr.s_val_bytes)
+    {
+        mdbm_log(LOG_ERR,"%s: mdbm_restore: %s is not a complete mdbm_save file",
+                 db->db_filename,file);
+        close(fd);
+        errno = EINVAL;
+        return -1;
     }
 
-    if (lock_db(db) < 0) {
+    if (mdbm_lock(db) != 1) {
+        err = errno;
+        close(fd);
+        errno = err;
         return -1;
     }
-    ret = fsync(db->db_fd);
-    if (MDBM_DO_STAT_PAGE(db)) {
-          MDBM_ADD_STAT(db,NULL,0, MDBM_STAT_TAG_SYNC);
+    mdbm_purge(db);
+    restore_presize(db,&hdr);
+
+    while ((n = restore_read(fd,&b,sizeof(b))) == 1) {
+        if (b.b_magic != MDBM_SAVE_BLOCK_MAGIC || b.b_comp_len >= b.b_raw_len
+            || b.b_raw_len > INT32_MAX / 2)
+        {
+            errno = EINVAL;
+            goto restore_error;
+        }
+        if (b.b_raw_len > cap) {
+            char* p = (char*)realloc(buf,b.b_raw_len);
+            if (!p) {
+                errno = ENOMEM;
+                goto restore_error;
+            }
+            buf = p;
+            cap = b.b_raw_len;
+        }
+        if (b.b_comp_len) {
+            if (b.b_comp_len > ccap) {
+                char* p = (char*)realloc(cbuf,b.b_comp_len);
+                if (!p) {
+                    errno = ENOMEM;
+                    goto restore_error;
+                }
+                cbuf = p;
+                ccap = b.b_comp_len;
+            }
+            if ((n = restore_read(fd,cbuf,b.b_comp_len)) != 1) {
+                goto restore_read_error;
+            }
+            if (mdbm_internal_lz_decompress((const uint8_t*)cbuf,b.b_comp_len,(uint8_t*)buf,
+                                            b.b_raw_len) != (int)b.b_raw_len)
+            {
+                errno = EINVAL;
+                goto restore_error;
+            }
+        } else if ((n = restore_read(fd,buf,b.b_raw_len)) != 1) {
+            goto restore_read_error;
+        }
+        if (restore_block(db,&b,buf) < 0) {
+            goto restore_error;
+        }
+        num_records += b.b_num_records;
     }
-    e = errno;
-    unlock_db(db);
+    if (n < 0) {
+        goto restore_error;
+    }
+    if (num_records != hdr.s_num_records) {
+        errno = EINVAL;
+        goto restore_error;
+    }
+    ret = 0;
+    goto restore_done;
+
+ restore_read_error:
+    if (!n) {
+        errno = EINVAL;     /* file ends inside a block */
+    }
+ restore_error:
+    err = errno;
+    mdbm_log(LOG_ERR,"%s: mdbm_restore from %s failed after %llu records: %s",
+             db->db_filename,file,(unsigned long long)num_records,strerror(err));
+ restore_done:
+    mdbm_unlock(db);
+    if (journal_commit(db) < 0 && !ret) {
+        err = errno;
+        ret = -1;
+    }
+    close(fd);
+    free(buf);
+    free(cbuf);
     if (ret < 0) {
-        errno = e;
+        errno = err;
     }
     return ret;
 }
 
-void
-mdbm_close_fd(MDBM *db)
-{
-    if (db->db_fd >= 0) {
-        close(db->db_fd);
-        db->db_fd = -1;
-    }
-}
+/*
+ * Bulk build.  Records are buffered in memory (a mdbm_bulk_rec_t, then the
+ * key and value), and once the buffer reaches its memory limit they spill to
+ * temporary files partitioned by the low bits of the key hash.  The page a
+ * record goes to is given by the low bits of its hash, so each partition holds
+ * whole pages, and mdbm_bulk_finish() loads the partitions one at a time.
+ */
 
-void
-mdbm_truncate(MDBM *db)
+#define MDBM_BULK_PART_BITS     8
+#define MDBM_BULK_NUM_PARTS     (1<<MDBM_BULK_PART_BITS)
+#define MDBM_BULK_MEMORY        (256*1024*1024)
+#define MDBM_BULK_FILL          90      /* percent full to pre-split for */
+
+typedef struct mdbm_bulk_rec {
+    uint32_t    r_hash;
+    uint32_t    r_klen;
+    uint32_t    r_vlen;
+} mdbm_bulk_rec_t;
+
+typedef struct mdbm_bulk_ref {
+    uint64_t    f_sort;         /* page << 32 | hash */
+    uint64_t    f_off;          /* record offset in the buffer, or ~0 if dropped */
+} mdbm_bulk_ref_t;
+
+struct mdbm_bulk {
+    MDBM*       b_db;
+    int         b_store_flag;
+    int         b_spilled;
+    uint64_t    b_mem_limit;
+    char*       b_tmpdir;
+    char*       b_buf;
+    uint64_t    b_len;
+    uint64_t    b_cap;
+    uint64_t    b_num_records;
+    uint64_t    b_entry_bytes;  /* data page bytes the records need */
+    size_t*     b_first;        /* bulk_load() page counts, reused by each group */
+    size_t      b_first_cap;
+    FILE*       b_parts[MDBM_BULK_NUM_PARTS];
+};
+
+#define MDBM_BULK_DROPPED       (~(uint64_t)0)
+
+/*
+ * Returns the data page bytes a record takes (only the reference, for a large
+ * object), or -1 if it can't be stored in this db.
+ */
+static int
+bulk_entry_size(MDBM* db, int klen, int vlen)
 {
-    const char *TRUNC_WARN_MSG = 
-        "mdbm_truncate will result in the loss of the setting.\n"
-        "If you'd like to retain this setting, use mdbm_purge() !";
+    int maxesize = db->db_pagesize - MDBM_PAGE_T_SIZE - MDBM_ENTRY_T_SIZE;
+    int cache = MDBM_DB_CACHEMODE(db) ? MDBM_CACHE_ENTRY_T_SIZE : 0;
+    int ksize = MDBM_KEY_ALIGN_LEN(db,klen);
+    int64_t vsize = (((int64_t)vlen + db->db_align_mask) & ~(int64_t)db->db_align_mask) + cache;
 
-    if (lock_db(db) < 0) {
-        return;
+    if (ksize + vsize + MDBM_ENTRY_T_SIZE > maxesize
+        || (db->db_spillsize && MDBM_LOB_ENABLED(db) && vsize >= db->db_spillsize))
+    {
+        if (!db->db_spillsize) {
+            return -1;
+        }
+        vsize = MDBM_ALIGN_LEN(db,MDBM_ENTRY_LOB_T_SIZE) + cache;
+    }
+    if (ksize + vsize + MDBM_ENTRY_T_SIZE > maxesize) {
+        return -1;
     }
+    return ksize + vsize + MDBM_ENTRY_T_SIZE;
+}
 
-    errno = 0;   /* Reset errno so it won't show while printing the following warnings */
+static FILE*
+bulk_tmpfile(const char* dir)
+{
+    char path[MAXPATHLEN+1];
+    FILE* fp;
+    int fd;
 
-    /* Look at header to generate warn msgs, since you can mdbm_open() w/o LARGE_OBJ flag */
-    if (db->db_hdr->h_dbflags & MDBM_HFLAG_LARGEOBJ) {
-        mdbm_logerror(LOG_ERR,0, "%s: Large Object Support will no longer be set: %s",
-                      db->db_filename, TRUNC_WARN_MSG);
+    snprintf(path,sizeof(path),"%s/mdbm_bulk.XXXXXX",dir);
+    if ((fd = mkstemp(path)) < 0) {
+        return NULL;
     }
-
-    if (db->db_hdr->h_spill_size) {  /* Set spillsize indicates likely large object support */
-        mdbm_logerror(LOG_ERR,0, "%s: Spill Size will no longer be set to %d: %s",
-                      db->db_filename, db->db_hdr->h_spill_size, TRUNC_WARN_MSG);
+    unlink(path);
+    if ((fp = fdopen(fd,"w+")) == NULL) {
+        close(fd);
     }
+    return fp;
+}
 
-    if (db->db_hdr->h_hash_func != MDBM_DEFAULT_HASH) {
-        uint8_t hash = db->db_hdr->h_hash_func;
-        mdbm_logerror(LOG_ERR,0, "%s: Hashing method will no longer be %s: %s",
-                      db->db_filename,
-                      (hash < MDBM_HASH_MAX) ? MDBM_HASH_FUNCNAMES[hash] : "?",
-                      TRUNC_WARN_MSG);
-    }
+/* Moves the buffered records to the partition files. */
+static int
+bulk_spill(mdbm_bulk_t* b)
+{
+    uint64_t off = 0;
 
-    if (db->db_hdr->h_max_pages) {
-        mdbm_logerror(LOG_ERR,0, "%s: MDBM Size Limit will no longer be set to %u: %s",
-                      db->db_filename, db->db_hdr->h_max_pages, TRUNC_WARN_MSG);
-    }
+    while (off < b->b_len) {
+        mdbm_bulk_rec_t r;
+        size_t len;
+        FILE** fpp;
 
-    if (truncate_db(db,1,db->db_pagesize,0) < 0) {
+        memcpy(&r,b->b_buf + off,sizeof(r));
+        len = sizeof(r) + r.r_klen + r.r_vlen;
+        fpp = &b->b_parts[r.r_hash & (MDBM_BULK_NUM_PARTS-1)];
+        if (!*fpp && (*fpp = bulk_tmpfile(b->b_tmpdir)) == NULL) {
+            mdbm_logerror(LOG_ERR,0,"%s: mdbm_bulk cannot create a temporary file in %s",
+                          b->b_db->db_filename,b->b_tmpdir);
+            return -1;
+        }
+        if (fwrite(b->b_buf + off,1,len,*fpp) != len) {
+            mdbm_logerror(LOG_ERR,0,"%s: mdbm_bulk cannot write a temporary file in %s",
+                          b->b_db->db_filename,b->b_tmpdir);
+            return -1;
+        }
+        off += len;
     }
-
-    unlock_db(db);
+    b->b_len = 0;
+    b->b_spilled = 1;
+    return 0;
 }
 
-int
-mdbm_set_hash(MDBM* db, int hash)
+static int
+bulk_reserve(mdbm_bulk_t* b, uint64_t need)
 {
-    if (!db) {
-        errno = EINVAL;
-        return -1;
-    }
+    uint64_t cap = b->b_cap ? b->b_cap : 1024*1024;
+    char* p;
 
-    if (hash < 0 || hash > MDBM_MAX_HASH || !mdbm_hash_funcs[hash]) {
-        errno = EINVAL;
-        return -1;
+    if (b->b_len + need <= b->b_cap) {
+        return 0;
     }
-    if (lock_db(db) != 1) {
-        return -1;
+    while (cap < b->b_len + need) {
+        cap *= 2;
     }
-    if (!check_empty(db)) {
-        unlock_db(db);
-        errno = EINVAL;
+    if (cap > b->b_mem_limit && b->b_len + need <= b->b_mem_limit) {
+        cap = b->b_mem_limit;
+    }
+    if ((p = (char*)realloc(b->b_buf,cap)) == NULL) {
+        errno = ENOMEM;
         return -1;
     }
-    db->db_hdr->h_hash_func = (uint8_t)hash;
-    db->db_hashfunc = mdbm_hash_funcs[hash];
-    unlock_db(db);
+    b->b_buf = p;
+    b->b_cap = cap;
     return 0;
 }
 
-int
-mdbm_sethash(MDBM* db, int hash)
+mdbm_bulk_t*
+mdbm_bulk_open(MDBM *db, int store_flag, uint64_t mem_limit, const char *tmpdir)
 {
-  int ret = mdbm_set_hash(db, hash);
-  return (ret < 0) ? ret : 1;
+    mdbm_bulk_t* b;
+    int mode = MDBM_STORE_MODE(store_flag);
+
+    if (!db || (mode != MDBM_INSERT && mode != MDBM_REPLACE && mode != MDBM_INSERT_DUP)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (MDBM_IS_RDONLY(db)) {
+        errno = EPERM;
+        return NULL;
+    }
+    if (mdbm_count_records(db) > 0) {
+        mdbm_log(LOG_ERR,"%s: mdbm_bulk_open requires an empty DB",db->db_filename);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!tmpdir && (tmpdir = getenv("TMPDIR")) == NULL) {
+        tmpdir = "/tmp";
+    }
+    if ((b = (mdbm_bulk_t*)calloc(1,sizeof(*b))) == NULL
+        || (b->b_tmpdir = strdup(tmpdir)) == NULL)
+    {
+        free(b);
+        errno = ENOMEM;
+        return NULL;
+    }
+    b->b_db = db;
+    b->b_store_flag = mode;
+    b->b_mem_limit = mem_limit ? mem_limit : MDBM_BULK_MEMORY;
+    return b;
 }
 
 int
-mdbm_replace_db(MDBM* db, const char* newfile)
+mdbm_bulk_add(mdbm_bulk_t *b, datum key, datum val)
 {
-    MDBM* new_db = NULL;
-    struct stat st;
-    struct stat new_st;
+    mdbm_bulk_rec_t r;
+    uint64_t need;
+    int esize;
 
-    if (!db) {
+    if (!b || !key.dptr || key.dsize < 1 || key.dsize > MDBM_KEYLEN_MAX
+        || val.dsize < 0 || (val.dsize && !val.dptr)
+        || (esize = bulk_entry_size(b->b_db,key.dsize,val.dsize)) < 0)
+    {
         errno = EINVAL;
         return -1;
     }
-
-    if (db->db_flags & MDBM_DBFLAG_MEMONLYCACHE) {
-        errno = EINVAL;
+    need = sizeof(r) + key.dsize + val.dsize;
+    if (b->b_len && b->b_len + need > b->b_mem_limit && bulk_spill(b) < 0) {
         return -1;
     }
-
-    new_db = mdbm_open(newfile,MDBM_O_RDWR|MDBM_HEADER_ONLY|MDBM_ANY_LOCKS,0,0,0);
-    if (!new_db) {
-        goto replace_error;
+    if (bulk_reserve(b,need) < 0) {
+        return -1;
     }
+    r.r_hash = MDBM_HASH_VALUE(b->b_db,key.dptr,key.dsize);
+    r.r_klen = key.dsize;
+    r.r_vlen = val.dsize;
+    memcpy(b->b_buf + b->b_len,&r,sizeof(r));
+    memcpy(b->b_buf + b->b_len + sizeof(r),key.dptr,key.dsize);
+    if (val.dsize) {
+        memcpy(b->b_buf + b->b_len + sizeof(r) + key.dsize,val.dptr,val.dsize);
+    }
+    b->b_len += need;
+    b->b_num_records++;
+    b->b_entry_bytes += esize;
+    return 0;
+}
 
-    if ((db->db_ver_flag == MDBM_DBVER_3) != (new_db->db_ver_flag == MDBM_DBVER_3)) {
-        mdbm_logerror(LOG_ERR,0,
-                      "%s: mdbm_replace_db(%s) are different db formats",
-                      db->db_filename,newfile);
-        goto replace_error;
-    }
+static int
+bulk_ref_cmp(const void* a, const void* b)
+{
+    const mdbm_bulk_ref_t* fa = (const mdbm_bulk_ref_t*)a;
+    const mdbm_bulk_ref_t* fb = (const mdbm_bulk_ref_t*)b;
 
-    if (fstat(db->db_fd,&st) == -1) {
-        mdbm_logerror(LOG_ERR,0,
-                      "%s: mdbm_replace_db unable to stat existing db file",
-                      db->db_filename);
-        goto replace_error;
+    if (fa->f_sort != fb->f_sort) {
+        return (fa->f_sort < fb->f_sort) ? -1 : 1;
     }
+    return (fa->f_off < fb->f_off) ? -1 : (fa->f_off > fb->f_off);
+}
 
-    if (fstat(new_db->db_fd,&new_st) == -1) {
-        mdbm_logerror(LOG_ERR,0,
-                      "%s: mdbm_replace_db unable to stat new db file",
-                      newfile);
-        goto replace_error;
-    }
+static void
+bulk_get(const mdbm_bulk_t* b, uint64_t off, mdbm_bulk_rec_t* r, datum* key, datum* val)
+{
+    memcpy(r,b->b_buf + off,sizeof(*r));
+    key->dptr = b->b_buf + off + sizeof(*r);
+    key->dsize = r->r_klen;
+    val->dptr = key->dptr + r->r_klen;
+    val->dsize = r->r_vlen;
+}
 
-    if (st.st_dev != new_st.st_dev) {
-      /* Must both be on the same device for rename() to work. */
-        errno = EXDEV;
-        mdbm_logerror(LOG_ERR,0,
-                      "%s: mdbm_replace_db cannot use %s",
-                      db->db_filename,newfile);
-        goto replace_error;
-    }
+/*
+ * Keeps one record of each key in a run of records with the same hash (which
+ * are in the order they were added): the first for MDBM_INSERT, the last for
+ * MDBM_REPLACE.
+ */
+static void
+bulk_dedup(mdbm_bulk_t* b, mdbm_bulk_ref_t* refs, size_t n)
+{
+    size_t i, j;
 
-    if (mdbm_lock(db) != 1) {
-        if (errno != EFAULT) {
-            mdbm_logerror(LOG_ERR,0,
-                          "%s: mdbm_replace_db unable to lock existing db",
-                          db->db_filename);
-            goto replace_error;
-        }
-    }
+    for (i = 0; i < n; i++) {
+        mdbm_bulk_rec_t ri;
+        datum ki, vi;
 
-    if (mdbm_lock(new_db) != 1) {
-        if (errno != EFAULT) {
-            mdbm_logerror(LOG_ERR,0,
-                          "%s: mdbm_replace_db unable to lock new db",
-                          newfile);
-            mdbm_unlock(db);
-            goto replace_error;
+        if (refs[i].f_off == MDBM_BULK_DROPPED) {
+            continue;
         }
-    }
-
-    if (rename(newfile,db->db_filename) == -1) {
-        mdbm_logerror(LOG_ERR,0,
-                      "%s: mdbm_replace_db rename (from %s) failure",
-                      newfile,db->db_filename);
-        mdbm_unlock(new_db);
-        mdbm_unlock(db);
-        goto replace_error;
-    }
-
-    mdbm_unlock(new_db);
-    mdbm_close(new_db);
-
-    db->db_hdr->h_dbflags |= MDBM_HFLAG_REPLACED;
-    mdbm_unlock(db);
-
-    return 0;
+        bulk_get(b,refs[i].f_off,&ri,&ki,&vi);
+        for (j = i + 1; j < n; j++) {
+            mdbm_bulk_rec_t rj;
+            datum kj, vj;
 
- replace_error:
-    if (new_db) {
-        mdbm_close(new_db);
+            if (refs[j].f_off == MDBM_BULK_DROPPED) {
+                continue;
+            }
+            bulk_get(b,refs[j].f_off,&rj,&kj,&vj);
+            if (ki.dsize == kj.dsize && !memcmp(ki.dptr,kj.dptr,ki.dsize)) {
+                if (b->b_store_flag == MDBM_REPLACE) {
+                    refs[i].f_off = MDBM_BULK_DROPPED;
+                    break;
+                }
+                refs[j].f_off = MDBM_BULK_DROPPED;
+            }
+        }
     }
-    return -1;
 }
 
-int
-get_version(const char *file, uint32_t *version)
+/*
+ * Appends the records of one page.  If they don't fit, the (empty) page is
+ * split first, and each half is filled in turn, so pages are never split
+ * after they've been filled.  On entry the db should be locked.
+ */
+static int
+bulk_place(mdbm_bulk_t* b, mdbm_bulk_ref_t* refs, size_t n)
 {
-    MDBM *db;
-    if ((db = mdbm_open(file, MDBM_O_RDWR|MDBM_HEADER_ONLY, 0, 0, 0)) == NULL) {
-        return -1;
-    }
-
-    *version = mdbm_get_version(db);
-    mdbm_close(db);
+    MDBM* db = b->b_db;
+    mdbm_bulk_rec_t r;
+    datum key, val;
+    mdbm_hashval_t hashval = (mdbm_hashval_t)refs[0].f_sort;
+    mdbm_page_t* page;
+    uint64_t need = 0;
+    size_t i, lo;
+    int hashbit;
 
+    for (i = 0; i < n; i++) {
+        if (refs[i].f_off != MDBM_BULK_DROPPED) {
+            bulk_get(b,refs[i].f_off,&r,&key,&val);
+            need += bulk_entry_size(db,r.r_klen,r.r_vlen);
+        }
+    }
+    if (n > 1 && !MDBM_IS_WINDOWED(db)
+        && (page = pagenum_to_page(db,hashval_to_pagenum(db,hashval),
+                                   MDBM_PAGE_ALLOC,MDBM_PAGE_MAP)) != NULL
+        && need > (uint64_t)MDBM_PAGE_FREE_BYTES(page)
+        && (hashbit = dir_walk(db,hashval,NULL)) < 31)
+    {
+        /* Partition by the next hash bit, and split only if both halves get records. */
+        for (i = 0, lo = 0; i < n; i++) {
+            if (!(refs[i].f_sort & (1U << hashbit))) {
+                mdbm_bulk_ref_t t = refs[lo];
+                refs[lo++] = refs[i];
+                refs[i] = t;
+            }
+        }
+        if (lo > 0 && lo < n && split_page(db,hashval)) {
+            /* Put duplicates back in the order they were added. */
+            qsort(refs,lo,sizeof(*refs),bulk_ref_cmp);
+            qsort(refs + lo,n - lo,sizeof(*refs),bulk_ref_cmp);
+            return (bulk_place(b,refs,lo) < 0 || bulk_place(b,refs + lo,n - lo) < 0) ? -1 : 0;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (refs[i].f_off != MDBM_BULK_DROPPED) {
+            hashval = (mdbm_hashval_t)refs[i].f_sort;
+            bulk_get(b,refs[i].f_off,&r,&key,&val);
+            if (restore_record(db,&key,&val,&hashval) < 0) {
+                return -1;
+            }
+        }
+    }
     return 0;
 }
 
+/*
+ * Stores the buffered records in page order.  They are counting-sorted by
+ * page, which keeps records of the same page in the order they were added.
+ * On entry the db should be locked.
+ */
+static int
+bulk_load(mdbm_bulk_t* b)
+{
+    MDBM* db = b->b_db;
+    mdbm_bulk_ref_t* refs;
+    size_t* first;              /* index of each page's first record */
+    size_t npages = (size_t)db->db_max_dirbit + 1;
+    uint64_t off;
+    size_t n, i, j;
+    int ret = 0;
 
-int
-mdbm_replace_file(const char* oldfile, const char* newfile)
-{
-    int ret;
-    MDBM* db;
+    if (!b->b_len) {
+        return 0;
+    }
+    if (npages + 1 > b->b_first_cap) {
+        /* Loading a group can split pages, so the next one may need more. */
+        if ((first = (size_t*)realloc(b->b_first,(npages + 1)*sizeof(*first))) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        b->b_first = first;
+        b->b_first_cap = npages + 1;
+    }
+    first = b->b_first;
+    memset(first,0,(npages + 1)*sizeof(*first));
+    for (off = 0, n = 0; off < b->b_len; n++) {
+        mdbm_bulk_rec_t r;
 
-    if ((db = mdbm_open(oldfile,MDBM_O_RDWR|MDBM_HEADER_ONLY|MDBM_ANY_LOCKS,0,0,0)) == NULL) {
+        memcpy(&r,b->b_buf + off,sizeof(r));
+        first[hashval_to_pagenum(db,r.r_hash) + 1]++;
+        off += sizeof(r) + r.r_klen + r.r_vlen;
+    }
+    if ((refs = (mdbm_bulk_ref_t*)malloc(n*sizeof(*refs))) == NULL) {
+        errno = ENOMEM;
         return -1;
     }
-    ret = mdbm_replace_db(db,newfile);
-    mdbm_close(db);
+    for (i = 1; i <= npages; i++) {
+        first[i] += first[i-1];
+    }
+    for (off = 0; off < b->b_len; ) {
+        mdbm_bulk_rec_t r;
+        mdbm_pagenum_t pagenum;
+
+        memcpy(&r,b->b_buf + off,sizeof(r));
+        pagenum = hashval_to_pagenum(db,r.r_hash);
+        i = first[pagenum]++;
+        refs[i].f_sort = ((uint64_t)pagenum << 32) | r.r_hash;
+        refs[i].f_off = off;
+        off += sizeof(r) + r.r_klen + r.r_vlen;
+    }
+
+    for (i = 0; i < n && !ret; i = j) {
+        for (j = i + 1; j < n && (refs[j].f_sort >> 32) == (refs[i].f_sort >> 32); j++)
+            ;
+        if (b->b_store_flag != MDBM_INSERT_DUP && j - i > 1) {
+            size_t k, m;
+
+            qsort(refs + i,j - i,sizeof(*refs),bulk_ref_cmp);
+            for (k = i; k < j; k = m) {
+                for (m = k + 1; m < j && refs[m].f_sort == refs[k].f_sort; m++)
+                    ;
+                if (m - k > 1) {
+                    bulk_dedup(b,refs + k,m - k);
+                }
+            }
+        }
+        ret = bulk_place(b,refs + i,j - i);
+    }
+    free(refs);
     return ret;
 }
 
-
-int
-mdbm_setspillsize(MDBM* db, int size)
+/* Appends a partition file to the buffer, and closes it. */
+static int
+bulk_read_part(mdbm_bulk_t* b, FILE* fp)
 {
-    if (!db) {
-        errno = EINVAL;
-        return -1;
-    }
-    if (size <= 1) {
-        mdbm_log(LOG_ERR, "%s: mdbm_setspillsize invalid size %u ", db->db_filename, size);
-        errno = EINVAL;
-        return -1;
-    }
-    if (!MDBM_LOB_ENABLED(db)) {
-        mdbm_log(LOG_ERR, "%s: mdbm_setspillsize on db without large object support ", db->db_filename);
-        errno = EINVAL;
+    off_t len;
+
+    if (fseeko(fp,0,SEEK_END) < 0 || (len = ftello(fp)) < 0) {
         return -1;
     }
-    if (lock_db(db) != 1) {
+    rewind(fp);
+    if (bulk_reserve(b,len) < 0) {
         return -1;
     }
-    if (size > db->db_pagesize) {
-        unlock_db(db);
-        errno = EINVAL;
+    if (fread(b->b_buf + b->b_len,1,len,fp) != (size_t)len) {
+        if (!ferror(fp)) {
+            errno = EIO;
+        }
         return -1;
     }
-    db->db_spillsize = db->db_hdr->h_spill_size = size;
-    unlock_db(db);
+    b->b_len += len;
     return 0;
 }
 
 void
-mdbm_prune(MDBM* db, int(*prune) (MDBM* db, datum, datum, void *), void *param)
+mdbm_bulk_abort(mdbm_bulk_t *b)
 {
     int i;
 
-    if (lock_db(db) < 0) {
+    if (!b) {
         return;
     }
-    for (i = 0; i <= db->db_max_dirbit; i++) {
-        if (MDBM_GET_PAGE_INDEX(db,i)) {
-            mdbm_page_t* page = MDBM_MAPPED_PAGE_PTR(db,MDBM_GET_PAGE_INDEX(db,i));
-            mdbm_entry_t* ep;
-            mdbm_entry_data_t e;
-
-            for (ep = first_entry(page,&e); ep; ep = next_entry(&e)) {
-                if (ep->e_key.match) {
-                    datum k, v;
-
-                    get_kv(db,&e,&k,&v);
-                    if (prune(db,k,v,param)) {
-                        del_entry(db,page,ep);
-                    }
-                }
-            }
-            if (MDBM_IS_WINDOWED(db)) {
-                release_window_page(db,page);
-            }
+    for (i = 0; i < MDBM_BULK_NUM_PARTS; i++) {
+        if (b->b_parts[i]) {
+            fclose(b->b_parts[i]);
         }
     }
-    unlock_db(db);
+    free(b->b_buf);
+    free(b->b_first);
+    free(b->b_tmpdir);
+    free(b);
 }
 
-void
-mdbm_purge(MDBM* db)
+int
+mdbm_bulk_finish(mdbm_bulk_t *b)
 {
-    int i;
+    MDBM* db;
+    int ret = -1;
+    int err = 0;
 
-    if (lock_db(db) < 0) {
-        return;
+    if (!b) {
+        errno = EINVAL;
+        return -1;
     }
-    for (i = 0; i <= db->db_max_dirbit; i++) {
-        if (MDBM_GET_PAGE_INDEX(db,i)) {
-            mdbm_page_t* page = MDBM_PAGE_PTR(db,MDBM_GET_PAGE_INDEX(db,i));
-            page->p.p_num_entries = 0;
-            MDBM_INIT_TOP_ENTRY(MDBM_ENTRY(page,0),db->db_pagesize);
-            if (MDBM_IS_WINDOWED(db)) {
-                release_window_page(db,page);
-            }
-        }
+    db = b->b_db;
+    if (mdbm_lock(db) != 1) {
+        err = errno;
+        mdbm_bulk_abort(b);
+        errno = err;
+        return -1;
+    }
+    if (mdbm_count_records(db) > 0) {
+        mdbm_log(LOG_ERR,"%s: mdbm_bulk_finish requires an empty DB",db->db_filename);
+        errno = EINVAL;
+        goto bulk_error;
     }
-    if (db->db_spillsize) {
-        free_large_object_chunks(db);
+    presize_db(db,b->b_entry_bytes,MDBM_BULK_FILL,"mdbm_bulk_finish");
+    if (logs_changes(db)) {
+        /* The records are logged as duplicate inserts (see restore_record()),
+         * which replay must apply to an empty db. */
+        log_change(db,MDBM_CHANGE_PURGE,NULL,NULL);
     }
-    unlock_db(db);
-}
 
-int
-mdbm_save(MDBM *db, const char *file, int flags, int mode, int compressionLevel)
-{
-    /* XXX */
-    errno = ENOSYS;
-    return -1;
-}
+    if (!b->b_spilled) {
+        if (bulk_load(b) < 0) {
+            goto bulk_error;
+        }
+    } else {
+        mdbm_hashval_t h;
+        int group_bits = MDBM_BULK_PART_BITS;
+        int g, q;
+
+        if (bulk_spill(b) < 0) {
+            goto bulk_error;
+        }
+        /* Pages shallower than the partition bits take records from several
+         * partitions, which are then loaded together. */
+        for (h = 0; h < MDBM_BULK_NUM_PARTS; h++) {
+            int hashbit = dir_walk(db,h,NULL);
+            if (hashbit < group_bits) {
+                group_bits = hashbit;
+            }
+        }
+        for (g = 0; g < (1 << group_bits); g++) {
+            b->b_len = 0;
+            for (q = g; q < MDBM_BULK_NUM_PARTS; q += (1 << group_bits)) {
+                if (b->b_parts[q]) {
+                    if (bulk_read_part(b,b->b_parts[q]) < 0) {
+                        mdbm_logerror(LOG_ERR,0,"%s: mdbm_bulk cannot read a temporary file",
+                                      db->db_filename);
+                        goto bulk_error;
+                    }
+                    fclose(b->b_parts[q]);
+                    b->b_parts[q] = NULL;
+                }
+            }
+            if (bulk_load(b) < 0) {
+                goto bulk_error;
+            }
+        }
+    }
+    ret = 0;
 
-int
-mdbm_restore(MDBM *db, const char *file)
-{
-    /* XXX */
-    errno = ENOSYS;
-    return -1;
+ bulk_error:
+    if (ret < 0) {
+        err = errno;
+        mdbm_log(LOG_ERR,"%s: mdbm_bulk_finish of %llu records failed: %s",
+                 db->db_filename,(unsigned long long)b->b_num_records,strerror(err));
+    }
+    mdbm_unlock(db);
+    if (journal_commit(db) < 0 && !ret) {
+        err = errno;
+        ret = -1;
+    }
+    mdbm_bulk_abort(b);
+    if (ret < 0) {
+        errno = err;
+    }
+    return ret;
 }
 
 uint64_t
@@ -6826,7 +12096,7 @@ mdbm_get_stats(MDBM* db, mdbm_stats_t* s, size_t stats_size)
     mdbm_db_info_t info;
     mdbm_stat_info_t stats;
 
-    if (stats_size < sizeof(*s)) {
+    if (stats_size < offsetof(mdbm_stats_t,s_filter_rejects)) {
         errno = ENOMEM;
         return -1;
     }
@@ -6861,6 +12131,10 @@ mdbm_get_stats(MDBM* db, mdbm_stats_t* s, size_t stats_size)
     s->s_large_min_size = stats.min_lob_bytes;
     s->s_large_max_size = stats.max_lob_bytes;
     s->s_cache_mode = info.db_cache_mode;
+    if (stats_size >= sizeof(*s)) {
+        s->s_filter_rejects = mdbm_hdr_stats(db)->s_filter_rejects;
+        s->s_filter_false_pos = mdbm_hdr_stats(db)->s_filter_false_pos;
+    }
 
     return 0;
 }
@@ -7113,6 +12387,434 @@ mdbm_iterate(MDBM* db, int pagenum, mdbm_iterate_func_t func, int flags, void* u
     return 0;
 }
 
+/* Logical pages handed to a parallel-iteration worker at a time. */
+#define MDBM_ITERATE_PARALLEL_CHUNK 64
+
+struct iterate_parallel {
+    mdbm_iterate_func_t func;
+    void*               user;
+    int                 flags;
+    uint32_t            next_page;  /* next logical page to hand out */
+    volatile int        stop;       /* set by the first worker to finish early */
+};
+
+struct iterate_worker {
+    struct iterate_parallel* it;
+    MDBM*               db;         /* worker's own (dup'ed) handle */
+    pthread_t           thread;
+    int                 ret;
+    int                 err;
+};
+
+static void*
+iterate_parallel_worker(void* arg)
+{
+    struct iterate_worker* w = (struct iterate_worker*)arg;
+    struct iterate_parallel* it = w->it;
+    MDBM* db = w->db;
+    int lock = !(it->flags & MDBM_ITERATE_NOLOCK);
+
+    while (!it->stop) {
+        uint32_t first = atomic_add32u(&it->next_page,MDBM_ITERATE_PARALLEL_CHUNK);
+        uint32_t pg;
+
+        for (pg = first; pg < first + MDBM_ITERATE_PARALLEL_CHUNK && !it->stop; ++pg) {
+            mdbm_pagenum_t pagenum = pg;
+            int ret;
+
+            /* only the page's own lock (its partition, in partitioned mode) is held */
+            if (lock && mdbm_internal_do_lock(db,MDBM_LOCK_READ,MDBM_LOCK_WAIT,
+                                              NULL,NULL,&pagenum) < 0)
+            {
+                w->ret = -1;
+                w->err = errno;
+                it->stop = 1;
+                return NULL;
+            }
+            if (pg > (uint32_t)db->db_max_dirbit) {
+                if (lock) {
+                    mdbm_internal_do_unlock(db,NULL);
+                }
+                return NULL;
+            }
+            ret = mdbm_iterate(db,pg,it->func,it->flags|MDBM_ITERATE_NOLOCK,it->user);
+            if (lock) {
+                mdbm_internal_do_unlock(db,NULL);
+            }
+            if (ret) {
+                w->ret = ret;
+                w->err = errno;
+                it->stop = 1;
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+int
+mdbm_iterate_parallel(MDBM* db, int nthreads, mdbm_iterate_func_t func, int flags, void* user)
+{
+    struct iterate_parallel it;
+    struct iterate_worker* workers;
+    int started = 0;
+    int ret = 0;
+    int err = 0;
+    int i;
+
+    if (!db || !func) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nthreads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncpu > 0) ? (int)ncpu : 1;
+    }
+    if ((workers = (struct iterate_worker*)calloc(nthreads,sizeof(*workers))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    it.func = func;
+    it.user = user;
+    it.flags = flags;
+    it.next_page = 0;
+    it.stop = 0;
+
+    /* Handles aren't thread-safe: each worker gets its own locks (and window). */
+    for (i = 0; i < nthreads; i++) {
+        workers[i].it = &it;
+        if ((workers[i].db = mdbm_dup_handle(db,0)) == NULL) {
+            ret = -1;
+            err = errno;
+            break;
+        }
+        if (pthread_create(&workers[i].thread,NULL,iterate_parallel_worker,&workers[i]) != 0) {
+            mdbm_logerror(LOG_ERR,0,"%s: mdbm_iterate_parallel thread create failure",
+                          db->db_filename);
+            mdbm_close(workers[i].db);
+            ret = -1;
+            err = EAGAIN;
+            break;
+        }
+        started++;
+    }
+    if (ret < 0) {
+        it.stop = 1;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread,NULL);
+        mdbm_close(workers[i].db);
+        if (workers[i].ret < 0) {
+            ret = -1;
+            err = workers[i].err;
+        } else if (workers[i].ret && !ret) {
+            ret = 1;
+        }
+    }
+    free(workers);
+    if (ret < 0) {
+        errno = err;
+    }
+    return ret;
+}
+
+#define MDBM_MERKLE_MAGIC       0x4c4b524d  /* "MRKL" */
+#define MDBM_MERKLE_VERSION     1
+
+/* A Merkle tree is saved as is: the header, then the nodes level by level,
+ * starting with the root. */
+struct mdbm_merkle {
+    uint32_t    m_magic;
+    uint32_t    m_version;
+    uint32_t    m_levels;
+    uint32_t    m_hash_func;        /* hash function of the db */
+    uint64_t    m_nodes[];          /* level l starts at index 2^l-1 */
+};
+
+struct merkle_build {
+    MDBM*       db;
+    uint32_t    mask;
+    uint64_t*   sums;               /* sum of the digests of each leaf's records */
+    uint64_t*   counts;             /* number of records of each leaf */
+};
+
+struct merkle_leaf_iter {
+    MDBM*       db;
+    uint32_t    mask;
+    uint32_t    leaf;
+    mdbm_iterate_func_t func;
+    void*       user;
+};
+
+static inline size_t
+merkle_size(int levels)
+{
+    return offsetof(struct mdbm_merkle,m_nodes) + ((2ULL << levels) - 1)*sizeof(uint64_t);
+}
+
+static inline uint64_t
+merkle_pair(uint64_t a, uint64_t b)
+{
+    uint64_t v[2];
+
+    v[0] = a;
+    v[1] = b;
+    return mdbm_internal_hash64((const uint8_t*)v,sizeof(v),0);
+}
+
+static int
+merkle_add_record(void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+{
+    struct merkle_build* b = (struct merkle_build*)user;
+    uint32_t leaf;
+    uint64_t h;
+
+    if (info->i_entry.entry_flags & MDBM_ENTRY_DELETED) {
+        return 0;
+    }
+    leaf = hash_value(b->db,&kv->key) & b->mask;
+    h = mdbm_internal_hash64((const uint8_t*)kv->key.dptr,kv->key.dsize,0);
+    h = mdbm_internal_hash64((const uint8_t*)kv->val.dptr,kv->val.dsize,h);
+    /* Summing makes the leaf digest independent of the order of its records. */
+    atomic_add64u(&b->sums[leaf],h);
+    atomic_add64u(&b->counts[leaf],1);
+    return 0;
+}
+
+mdbm_merkle_t*
+mdbm_merkle_build(MDBM* db, int levels, int nthreads)
+{
+    struct merkle_build b;
+    mdbm_merkle_t* tree;
+    uint32_t nleaves;
+    uint32_t i;
+    int l;
+
+    if (!db || levels < 0 || levels > MDBM_MERKLE_MAX_LEVELS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    nleaves = 1U << levels;
+    if ((tree = (mdbm_merkle_t*)malloc(merkle_size(levels))) == NULL) {
+        return NULL;
+    }
+    if ((b.sums = (uint64_t*)calloc(2*(size_t)nleaves,sizeof(uint64_t))) == NULL) {
+        free(tree);
+        return NULL;
+    }
+    b.db = db;
+    b.mask = nleaves - 1;
+    b.counts = b.sums + nleaves;
+    if (mdbm_iterate_parallel(db,nthreads,merkle_add_record,MDBM_ITERATE_ENTRIES,&b) < 0) {
+        int err = errno;
+
+        free(b.sums);
+        free(tree);
+        errno = err;
+        return NULL;
+    }
+    tree->m_magic = MDBM_MERKLE_MAGIC;
+    tree->m_version = MDBM_MERKLE_VERSION;
+    tree->m_levels = levels;
+    tree->m_hash_func = db->db_hdr->h_hash_func;
+    for (i = 0; i < nleaves; i++) {
+        tree->m_nodes[nleaves - 1 + i] = merkle_pair(b.sums[i],b.counts[i]);
+    }
+    for (l = levels - 1; l >= 0; l--) {
+        uint64_t* node = tree->m_nodes + (1U << l) - 1;
+        const uint64_t* child = tree->m_nodes + (2U << l) - 1;
+
+        for (i = 0; i < (1U << l); i++) {
+            node[i] = merkle_pair(child[2*i],child[2*i+1]);
+        }
+    }
+    free(b.sums);
+    return tree;
+}
+
+void
+mdbm_merkle_free(mdbm_merkle_t* tree)
+{
+    free(tree);
+}
+
+int
+mdbm_merkle_levels(const mdbm_merkle_t* tree)
+{
+    return tree->m_levels;
+}
+
+uint64_t
+mdbm_merkle_root(const mdbm_merkle_t* tree)
+{
+    return tree->m_nodes[0];
+}
+
+const uint64_t*
+mdbm_merkle_level(const mdbm_merkle_t* tree, int level)
+{
+    if (level < 0 || level > (int)tree->m_levels) {
+        return NULL;
+    }
+    return tree->m_nodes + (1U << level) - 1;
+}
+
+int
+mdbm_merkle_save(const mdbm_merkle_t* tree, const char* filename)
+{
+    size_t size = merkle_size(tree->m_levels);
+    int fd;
+    int err;
+
+    if ((fd = open(filename,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0666)) < 0) {
+        return -1;
+    }
+    if (write(fd,tree,size) != (ssize_t)size) {
+        err = (errno && errno != EINTR) ? errno : EIO;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return close(fd);
+}
+
+mdbm_merkle_t*
+mdbm_merkle_load(const char* filename)
+{
+    struct mdbm_merkle hdr;
+    mdbm_merkle_t* tree;
+    struct stat st;
+    size_t size;
+    int fd;
+    int err;
+
+    if ((fd = open(filename,O_RDONLY|O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd,&st) < 0) {
+        goto load_error;
+    }
+    if (read(fd,&hdr,sizeof(hdr)) != (ssize_t)sizeof(hdr)
+        || hdr.m_magic != MDBM_MERKLE_MAGIC || hdr.m_version != MDBM_MERKLE_VERSION
+        || hdr.m_levels > MDBM_MERKLE_MAX_LEVELS
+        || (size_t)st.st_size != merkle_size(hdr.m_levels))
+    {
+        errno = EINVAL;
+        goto load_error;
+    }
+    size = merkle_size(hdr.m_levels);
+    if ((tree = (mdbm_merkle_t*)malloc(size)) == NULL) {
+        goto load_error;
+    }
+    memcpy(tree,&hdr,sizeof(hdr));
+    if (read(fd,(char*)tree + sizeof(hdr),size - sizeof(hdr)) != (ssize_t)(size - sizeof(hdr))) {
+        free(tree);
+        errno = EINVAL;
+        goto load_error;
+    }
+    close(fd);
+    return tree;
+
+  load_error:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+static void
+merkle_diff_node(const mdbm_merkle_t* a, const mdbm_merkle_t* b, int level, uint32_t i,
+                 uint32_t* leaves, int maxleaves, int* n)
+{
+    uint32_t k = (1U << level) - 1 + i;
+
+    if (a->m_nodes[k] == b->m_nodes[k]) {
+        return;
+    }
+    if (level == (int)a->m_levels) {
+        if (*n < maxleaves) {
+            leaves[*n] = i;
+        }
+        ++*n;
+        return;
+    }
+    merkle_diff_node(a,b,level+1,2*i,leaves,maxleaves,n);
+    merkle_diff_node(a,b,level+1,2*i+1,leaves,maxleaves,n);
+}
+
+int
+mdbm_merkle_diff(const mdbm_merkle_t* a, const mdbm_merkle_t* b,
+                 uint32_t* leaves, int maxleaves)
+{
+    int n = 0;
+
+    if (!a || !b || a->m_levels != b->m_levels || a->m_hash_func != b->m_hash_func
+        || maxleaves < 0 || (maxleaves && !leaves))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    merkle_diff_node(a,b,0,0,leaves,maxleaves,&n);
+    return n;
+}
+
+static int
+merkle_leaf_record(void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+{
+    struct merkle_leaf_iter* it = (struct merkle_leaf_iter*)user;
+
+    if ((info->i_entry.entry_flags & MDBM_ENTRY_DELETED)
+        || (hash_value(it->db,&kv->key) & it->mask) != it->leaf)
+    {
+        return 0;
+    }
+    return it->func(it->user,info,kv);
+}
+
+int
+mdbm_merkle_iterate_leaf(MDBM* db, int levels, uint32_t leaf,
+                         mdbm_iterate_func_t func, int flags, void* user)
+{
+    struct merkle_leaf_iter it;
+    int lock = !(flags & MDBM_ITERATE_NOLOCK);
+    int depth;
+    int ret = 0;
+
+    if (!db || !func || levels < 0 || levels > MDBM_MERKLE_MAX_LEVELS
+        || leaf >= (1U << levels) || (flags & ~MDBM_ITERATE_NOLOCK))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    it.db = db;
+    it.mask = MDBM_HASH_MASK(levels);
+    it.leaf = leaf;
+    it.func = func;
+    it.user = user;
+    if (lock && do_read_lock(db) < 0) {
+        return -1;
+    }
+    /* A key's page is its hash masked to the depth of the directory there.
+     * Where the directory is no deeper than the tree, the whole leaf is on one
+     * page; otherwise its pages are the ones numbered leaf modulo 2^levels. */
+    depth = (db->db_dir_flags & MDBM_HFLAG_PERFECT) ? db->db_dir_shift : dir_walk(db,leaf,NULL);
+    if (depth <= levels) {
+        ret = mdbm_iterate(db,MDBM_HASH_MASK(depth) & leaf,merkle_leaf_record,
+                           MDBM_ITERATE_ENTRIES|MDBM_ITERATE_NOLOCK,&it);
+    } else {
+        uint64_t pg;
+
+        for (pg = leaf; !ret && pg <= (uint64_t)db->db_max_dirbit; pg += 1U << levels) {
+            ret = mdbm_iterate(db,pg,merkle_leaf_record,
+                               MDBM_ITERATE_ENTRIES|MDBM_ITERATE_NOLOCK,&it);
+        }
+    }
+    if (lock) {
+        mdbm_internal_do_unlock(db,NULL);
+    }
+    return ret;
+}
+
 const char*
 MDBM_HASH_FUNCNAMES[] = {
     "CRC-32",
@@ -7125,7 +12827,9 @@ MDBM_HASH_FUNCNAMES[] = {
     "MD5",
     "SHA-1",
     "Jenkins",
-    "Hsieh"
+    "Hsieh",
+    "xxHash64",
+    "CRC-32C"
 };
 
 
@@ -7354,7 +13058,17 @@ int mdbm_get_fd(MDBM *db)
 int
 mdbm_check(MDBM* db, int level, int verbose)
 {
-    return check_db(db,level,10,verbose);
+    return check_db(db,level,10,verbose,1);
+}
+
+int
+mdbm_check_parallel(MDBM* db, int level, int verbose, int nthreads)
+{
+    if (nthreads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncpu > 0) ? (int)ncpu : 1;
+    }
+    return check_db(db,level,10,verbose,nthreads);
 }
 
 int
@@ -7398,6 +13112,7 @@ mdbm_clean(MDBM* db, int pnum, int flags)
                     get_kv2(db,page,ep,&key,&val);
                     if (db->db_clean_func(db,&key,&val,db->db_clean_data,&quit)) {
                         ep->e_flags &= ~MDBM_EFLAG_DIRTY;
+                        dirty_mark_page(db,page);
                         ncleaned++;
                     }
                     if (quit) {
@@ -9091,7 +14806,22 @@ mdbm_dup_handle(MDBM* db, int flags)
     }
 
     newdb->db_dir = NULL;
+    newdb->db_dir_cache = NULL;
+    newdb->db_free_index = NULL;
     newdb->db_errno = 0;
+    newdb->db_read_seq_held = 0;
+    newdb->db_read_seq_reading = 0;
+    newdb->db_dirty = NULL;
+    newdb->db_dirty_mem = NULL;
+    newdb->db_flusher = NULL;
+    newdb->db_journal = NULL;
+    newdb->db_changes = NULL;
+    newdb->db_changes_mem = NULL;
+    if (db->db_dirty && dirty_attach(newdb) < 0) {
+        mdbm_logerror(LOG_ERR,0,"%s: unable to attach dirty page map,"
+                      " changes made through the dup'ed handle will not be tracked",
+                      db->db_filename);
+    }
 
 #ifdef MDBM_BSOPS
     if (newdb->db_bsops) {
@@ -9103,6 +14833,8 @@ mdbm_dup_handle(MDBM* db, int flags)
         newdb->db_dup_info = db->db_dup_info = (mdbm_dup_info_t*)malloc(sizeof(*db->db_dup_info));
         newdb->db_dup_map_gen = db->db_dup_map_gen = db->db_dup_info->dup_map_gen = 1;
         db->db_dup_info->nrefs = 1;
+        db->db_dup_info->dup_dir_cache = NULL;
+        db->db_dup_info->dup_dir_lock = 0;
     }
 
     sync_dir(newdb,NULL);
@@ -9116,6 +14848,16 @@ mdbm_dup_handle(MDBM* db, int flags)
     if (wsize) {
         mdbm_set_window_size_internal(newdb,wsize);
     }
+    if (db->db_journal) {
+        if (journal_attach(newdb,0) < 0) {
+            int err = errno;
+            mdbm_close(newdb);
+            errno = err;
+            return NULL;
+        }
+        newdb->db_journal->flags = db->db_journal->flags;
+        newdb->db_journal->checkpoint_bytes = db->db_journal->checkpoint_bytes;
+    }
     return newdb;
 
  dup_error:
@@ -9300,6 +15042,23 @@ mdbm_lock_reset(const char* dbfilename, int flags)
   return do_lock_reset(dbfilename, flags);
 }
 
+int
+mdbm_get_lock_stats(MDBM* db, mdbm_lock_stats_t* stats, size_t stats_size)
+{
+  mdbm_lock_stats_t s;
+
+  if (!db || !stats) {
+    errno = EINVAL;
+    return -1;
+  }
+  memset(&s, 0, sizeof(s));
+  if (db_get_lock_stats(db, &s) < 0) {
+    return -1;
+  }
+  memcpy(stats, &s, (stats_size < sizeof(s)) ? stats_size : sizeof(s));
+  return 0;
+}
+
 
 /* Returns the partition number for a key.
  *
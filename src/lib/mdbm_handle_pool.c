@@ -5,10 +5,15 @@
 #include <stdlib.h>
 #include <libgen.h> /* for basename() */
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
-#include <sys/queue.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include <mdbm_log.h>
 #include <mdbm_handle_pool.h>
@@ -28,25 +33,39 @@
  * internals
  ***********************************************************/
 
+#define POOL_CACHE_LINE 64
+
+/* End of the shared free stack. */
+#define POOL_NIL 0xffffffffU
+
+/* States of a pool entry. An entry is on the shared free stack, parked in
+ * the affinity slot of the thread that last released it (where any other
+ * thread may still steal it), or held by a thread. */
+#define POOL_ENTRY_SHARED 0
+#define POOL_ENTRY_CACHED 1
+#define POOL_ENTRY_IN_USE 2
+
+/* Each entry lives on its own cache line, so a thread re-acquiring its
+ * cached handle only touches memory that no other thread is writing. */
+
 struct mdbm_pool_entry {
   MDBM *mdbm_handle;
-  LIST_ENTRY(mdbm_pool_entry) entries;
-};
-
-LIST_HEAD(mdbm_pool_list, mdbm_pool_entry);
+  uint32_t state;
+  uint32_t next;        /* next entry on the free stack */
+  uint64_t hits;        /* acquires served from an affinity slot */
+  uint64_t misses;      /* acquires served from the free stack, or stolen */
+} __attribute__((aligned(POOL_CACHE_LINE)));
 
 typedef struct mdbm_pool_entry mdbm_pool_entry_t;
-typedef struct mdbm_pool_list mdbm_pool_list_t;
 
 struct mdbm_pool_locks_s {
-  /* Duplication is treated as a special case of the many readers,
-   * one writer problem. The need to grow the pool is treated as a
-   * write use, holding a handle is treated as a read use.
-   
-   IMPORTANT: duplication_lock must always be acquired before transfer_handle_lock .   
-  */
-  
-  pthread_rwlock_t duplication_lock;
+  /* Serializes exclusive users. Holding a handle no longer takes a lock:
+   * the exclusive user raises pool->excl and waits until no entry is in use.
+   *
+   * transfer_handle_lock and handle_cond are only used to block on
+   * platforms without futexes. */
+
+  pthread_mutex_t excl_lock;
   pthread_mutex_t transfer_handle_lock;
   pthread_cond_t handle_cond;
 };
@@ -56,20 +75,45 @@ typedef struct mdbm_pool_locks_s mdbm_pool_locks_t;
  * it exists to make the code less difficult to understand. */
 
 struct mdbm_pool_s {
+  /* Free stack head: an ABA tag in the upper 32 bits, the index of the
+   * top entry in the lower 32 bits. Written by every miss, so it gets
+   * a cache line of its own. */
+
+  uint64_t free_head;
+  char pad0[POOL_CACHE_LINE - sizeof(uint64_t)];
+
+  /* Read on every release, written only when a thread blocks. */
+
+  uint32_t excl;          /* an exclusive user wants (or has) the pool */
+  uint32_t waiters;       /* threads blocked in acquire */
+  uint32_t wake_seq;      /* bumped (and futex-woken) to wake blocked threads */
+  char pad1[POOL_CACHE_LINE - 3 * sizeof(uint32_t)];
+
   MDBM *original_handle;
-  
-  /* Each thread which fetches handles from this pool will get a
-   * copy of one of these handles. */
-  
-  mdbm_pool_list_t dup_handle_stack;
-  mdbm_pool_list_t reserve_handle_stack;
-  
+
+  /* Each thread which fetches handles from this pool will get one of
+   * these duplicated handles. */
+
+  mdbm_pool_entry_t *entries;
+
   mdbm_pool_locks_t *locks;
-  
+
+  uint64_t waits;
+  uint64_t wait_usec;
+
   /* This is the total number of handles. */
-  int size;
+  uint32_t size;
 };
 
+/* The affinity slot: the entry this thread last released, and its pool.
+ * The pool is only compared, never dereferenced, so a stale slot left by a
+ * destroyed pool is harmless. */
+
+static __thread struct {
+  mdbm_pool_t *pool;
+  uint32_t index;
+} pool_tls = { NULL, POOL_NIL };
+
 
 /************************************************************
  * main section
@@ -84,20 +128,21 @@ static int init_locks(mdbm_pool_t *new_pool) {
     return 0;
   }
 
-  if (pthread_rwlock_init(&new_pool->locks->duplication_lock, NULL) != 0) {
-    mdbm_logerror(LOG_ERR, 0, "Failed to initialize duplication_lock mutex");
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
+
+  if (pthread_mutex_init(&new_pool->locks->excl_lock, &attr) != 0) {
+    mdbm_logerror(LOG_ERR, 0, "Failed to initialize excl_lock mutex");
+    pthread_mutexattr_destroy(&attr);
     free(new_pool->locks);
     new_pool->locks = NULL;
     return 0;
   }
 
-  pthread_mutexattr_init(&attr);
-  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
-
   if (pthread_mutex_init(&new_pool->locks->transfer_handle_lock, &attr) != 0) {
     mdbm_logerror(LOG_ERR, 0, "Failed to initialize transfer_handle_lock mutex");
     pthread_mutexattr_destroy(&attr);
-    pthread_rwlock_destroy(&new_pool->locks->duplication_lock);
+    pthread_mutex_destroy(&new_pool->locks->excl_lock);
     free(new_pool->locks);
     new_pool->locks = NULL;
     return 0;
@@ -108,7 +153,7 @@ static int init_locks(mdbm_pool_t *new_pool) {
   if (pthread_cond_init (&new_pool->locks->handle_cond, NULL) != 0) {
     mdbm_logerror(LOG_ERR, 0, "Failed to initialize handle_cond condition variable");
     pthread_mutex_destroy(&new_pool->locks->transfer_handle_lock);
-    pthread_rwlock_destroy(&new_pool->locks->duplication_lock);
+    pthread_mutex_destroy(&new_pool->locks->excl_lock);
     free(new_pool->locks);
     new_pool->locks = NULL;
     return 0;
@@ -118,7 +163,7 @@ static int init_locks(mdbm_pool_t *new_pool) {
 }
 
 static void free_locks(mdbm_pool_t *pool) {
-  pthread_rwlock_destroy(&pool->locks->duplication_lock);
+  pthread_mutex_destroy(&pool->locks->excl_lock);
   pthread_mutex_destroy(&pool->locks->transfer_handle_lock);
   pthread_cond_destroy(&pool->locks->handle_cond);
 
@@ -126,101 +171,75 @@ static void free_locks(mdbm_pool_t *pool) {
   pool->locks = NULL;
 }
 
-static void backoff_pool_size(mdbm_pool_t *pool, int backoff) {
-  int i;
-  mdbm_pool_entry_t *to_die;
+static void backoff_pool_size(mdbm_pool_t *pool, uint32_t size, uint32_t backoff) {
+  uint32_t i;
 
-  for (i = 0; pool->dup_handle_stack.lh_first && i < backoff; ++i) {
-    to_die = pool->dup_handle_stack.lh_first;
-    mdbm_close(to_die->mdbm_handle);
-    LIST_REMOVE(to_die, entries);
-    free(to_die);
+  for (i = size - backoff; i < size; ++i) {
+    mdbm_close(pool->entries[i].mdbm_handle);
+    pool->entries[i].mdbm_handle = NULL;
   }
 }
 
 static int setup_pool(mdbm_pool_t *pool, int set_size) {
-  int size;
+  uint32_t size;
+  void *entries = NULL;
 
-  if (pthread_rwlock_wrlock(&pool->locks->duplication_lock) != 0) {
-    LOG_LOCK_ACQUIRE_FAILURE("duplication_lock", "needed to increase pool size");
+  if (posix_memalign(&entries, POOL_CACHE_LINE, set_size * sizeof(mdbm_pool_entry_t)) != 0) {
+    mdbm_logerror(LOG_ERR, 0, "Failed to allocate memory for %d pool entries.", set_size);
     return 0;
   }
+  memset(entries, 0, set_size * sizeof(mdbm_pool_entry_t));
+  pool->entries = (mdbm_pool_entry_t*)entries;
 
-  if (pthread_mutex_lock(&pool->locks->transfer_handle_lock) != 0) {
-    LOG_LOCK_ACQUIRE_FAILURE("transfer_handle_lock", "needed to increase pool size");
-    pthread_rwlock_unlock(&pool->locks->duplication_lock);
-    return 0;
-  }
-  
-  for (size = 0; size < set_size; ++size) {
+  for (size = 0; size < (uint32_t)set_size; ++size) {
     MDBM *dup_handle = mdbm_dup_handle(pool->original_handle, 0);
     if (!dup_handle) {
       mdbm_logerror(LOG_ERR, 0, "mdbm_dup_handle returned null."
-        "%s stopped increasing pool size at %d when %d was requested.",
+        "%s stopped increasing pool size at %u when %d was requested.",
         __func__, size, set_size);
-  
+
       /* we are going to back off half of the opened handles
        * to release resources */
 
       if (size > 1) {
-        int backoff_size = size / 2;
-        backoff_pool_size(pool, backoff_size);
+        uint32_t backoff_size = size / 2;
+        backoff_pool_size(pool, size, backoff_size);
         size -= backoff_size;
       }
 
       break;
-    } else {
-      mdbm_pool_entry_t* new_entry = calloc(1, sizeof(mdbm_pool_entry_t));
-      if ( new_entry ) {
-        new_entry->mdbm_handle = dup_handle;
-        LIST_INSERT_HEAD(&pool->dup_handle_stack, new_entry, entries);
-      } else {
-        mdbm_logerror(LOG_ERR, 0, "Failed to calloc memory for new duplicated handle."
-          " %s stopped increasing pool size at %d when %d was requested.",
-          __func__, size, set_size);
-
-        /* we are going to back off half of the opened handles
-        * to release resources */
-
-        mdbm_close(dup_handle);
-
-        if (size > 1) {
-          int backoff_size = size / 2;
-          backoff_pool_size(pool, backoff_size);
-          size -= backoff_size;
-        }
-
-        break;
-      }
     }
+    pool->entries[size].mdbm_handle = dup_handle;
   }
-    
-  pthread_mutex_unlock(&pool->locks->transfer_handle_lock);
-  pthread_rwlock_unlock(&pool->locks->duplication_lock);
 
   /* make sure we have at least one entry in our pool */
 
   pool->size = size;
-  if (pool->size == 0)
+  if (pool->size == 0) {
+    free(pool->entries);
+    pool->entries = NULL;
     return 0;
-  else
-    return 1;
+  }
+
+  /* Every handle starts out on the free stack. */
+
+  for (size = 0; size < pool->size; ++size) {
+    pool->entries[size].state = POOL_ENTRY_SHARED;
+    pool->entries[size].next = (size + 1 < pool->size) ? size + 1 : POOL_NIL;
+  }
+  pool->free_head = 0;
+
+  return 1;
 }
 
 static void free_handle_stack(mdbm_pool_t *dying) {
-  mdbm_pool_entry_t *to_die;
-  while ( dying->dup_handle_stack.lh_first ) {
-    to_die = dying->dup_handle_stack.lh_first;
-    mdbm_close(to_die->mdbm_handle);
-    LIST_REMOVE( to_die, entries);
-    free(to_die);
-  }
+  uint32_t i;
 
-  while ( dying->reserve_handle_stack.lh_first ) {
-    to_die = dying->reserve_handle_stack.lh_first;
-    LIST_REMOVE( to_die, entries);
-    free(to_die);
+  for (i = 0; i < dying->size; ++i) {
+    mdbm_close(dying->entries[i].mdbm_handle);
   }
+  free(dying->entries);
+  dying->entries = NULL;
 }
 
 mdbm_pool_t *mdbm_pool_create_pool(MDBM *original_handle, int size) {
@@ -235,11 +254,11 @@ mdbm_pool_t *mdbm_pool_create_pool(MDBM *original_handle, int size) {
     return NULL;
   }
 
-  new_pool = calloc(1, sizeof(mdbm_pool_t));
-  if (new_pool == NULL) {
+  if (posix_memalign((void**)&new_pool, POOL_CACHE_LINE, sizeof(mdbm_pool_t)) != 0) {
     mdbm_logerror(LOG_ERR, 0, "Failed to calloc new memory for mdbm handle pool.");
     return NULL;
   }
+  memset(new_pool, 0, sizeof(mdbm_pool_t));
 
   if (!init_locks(new_pool)) {
     free(new_pool);
@@ -248,8 +267,6 @@ mdbm_pool_t *mdbm_pool_create_pool(MDBM *original_handle, int size) {
 
   new_pool->size = 0;
   new_pool->original_handle = original_handle;
-  LIST_INIT(&new_pool->dup_handle_stack);
-  LIST_INIT(&new_pool->reserve_handle_stack);
 
   if (!setup_pool(new_pool, size)) {
     free_locks(new_pool);
@@ -260,39 +277,98 @@ mdbm_pool_t *mdbm_pool_create_pool(MDBM *original_handle, int size) {
   return new_pool;
 }
 
-int mdbm_pool_destroy_pool(mdbm_pool_t *pool) {
-  if (pool == NULL) {
-    return 0;
-  }
+/* Pop an entry off the free stack. The tag changes on every push and pop,
+ * so a head that was popped and pushed back meanwhile fails the CAS. */
 
-  if (pthread_rwlock_wrlock(&pool->locks->duplication_lock) != 0) {
-    LOG_LOCK_ACQUIRE_FAILURE("duplication_lock","destroying pool");
-    return 0;
+static uint32_t pop_free_entry(mdbm_pool_t *pool) {
+  uint64_t head = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+  uint64_t next;
+  uint32_t index;
+
+  do {
+    index = (uint32_t)head;
+    if (index == POOL_NIL) {
+      return POOL_NIL;
+    }
+    next = ((head >> 32) + 1) << 32
+         | __atomic_load_n(&pool->entries[index].next, __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&pool->free_head, &head, next, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  return index;
+}
+
+static void push_free_entry(mdbm_pool_t *pool, uint32_t index) {
+  uint64_t head = __atomic_load_n(&pool->free_head, __ATOMIC_RELAXED);
+  uint64_t next;
+
+  do {
+    __atomic_store_n(&pool->entries[index].next, (uint32_t)head, __ATOMIC_RELAXED);
+    next = ((head >> 32) + 1) << 32 | index;
+  } while (!__atomic_compare_exchange_n(&pool->free_head, &head, next, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+}
+
+static int claim_entry(mdbm_pool_t *pool, uint32_t index) {
+  uint32_t cached = POOL_ENTRY_CACHED;
+
+  return __atomic_compare_exchange_n(&pool->entries[index].state, &cached,
+                                     POOL_ENTRY_IN_USE, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* Find a free entry and mark it in use, without blocking: first this
+ * thread's cached entry, then the free stack, then any entry parked in
+ * another thread's affinity slot. Returns POOL_NIL if all are in use. */
+
+static uint32_t take_entry(mdbm_pool_t *pool, int *hit) {
+  uint32_t index = pool_tls.index;
+  uint32_t i, start;
+
+  *hit = 0;
+  if (pool_tls.pool == pool && index < pool->size && claim_entry(pool, index)) {
+    *hit = 1;
+    return index;
   }
 
-  if (pthread_mutex_lock(&pool->locks->transfer_handle_lock) != 0) {
-    LOG_LOCK_ACQUIRE_FAILURE("transfer_handle_lock", "destroying pool");
-    pthread_rwlock_unlock(&pool->locks->duplication_lock);
-    return 0;
+  index = pop_free_entry(pool);
+  if (index != POOL_NIL) {
+    __atomic_store_n(&pool->entries[index].state, POOL_ENTRY_IN_USE, __ATOMIC_SEQ_CST);
+    return index;
   }
 
-  free_handle_stack(pool);
+  /* Spread the threads that steal over the pool. */
 
-  if (pthread_mutex_unlock(&pool->locks->transfer_handle_lock) != 0) {
-    LOG_LOCK_RELEASE_FAILURE("transfer_handle_lock", "destroying pool");
+  start = (uint32_t)(((uintptr_t)&pool_tls / POOL_CACHE_LINE) % pool->size);
+  for (i = 0; i < pool->size; ++i) {
+    index = (start + i) % pool->size;
+    if (__atomic_load_n(&pool->entries[index].state, __ATOMIC_RELAXED) == POOL_ENTRY_CACHED
+        && claim_entry(pool, index)) {
+      return index;
+    }
   }
 
-  if (pthread_rwlock_unlock(&pool->locks->duplication_lock) != 0) {
-    LOG_LOCK_RELEASE_FAILURE("duplication_lock", "destroying pool");
-  }
+  return POOL_NIL;
+}
 
-  free_locks(pool);
-  free(pool);
-  return 1;
+#ifdef __linux__
+
+static void wait_for_available_handle(mdbm_pool_t *pool, uint32_t seq) {
+  /* default 50 msec for timeout */
+  struct timespec to = { 0, 50 * 1000 * 1000 };
+
+  /* Returns right away if wake_seq moved on since the caller looked. */
+  syscall(SYS_futex, &pool->wake_seq, FUTEX_WAIT_PRIVATE, seq, &to, NULL, 0);
+}
+
+static void wake_waiting_threads(mdbm_pool_t *pool, int count) {
+  __atomic_add_fetch(&pool->wake_seq, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &pool->wake_seq, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
 }
 
-static int wait_for_available_handle(mdbm_pool_t *pool) {
-  int ret;
+#else
+
+static void wait_for_available_handle(mdbm_pool_t *pool, uint32_t seq) {
   uint64_t usec;
   struct timespec to;
 
@@ -305,100 +381,184 @@ static int wait_for_available_handle(mdbm_pool_t *pool) {
   to.tv_sec = usec / 1000000;
   to.tv_nsec = (usec % 1000000) * 1000;
 
-  ret = pthread_cond_timedwait(&pool->locks->handle_cond, 
-    &pool->locks->transfer_handle_lock, &to);
+  pthread_mutex_lock(&pool->locks->transfer_handle_lock);
+  if (__atomic_load_n(&pool->wake_seq, __ATOMIC_SEQ_CST) == seq) {
+    pthread_cond_timedwait(&pool->locks->handle_cond,
+      &pool->locks->transfer_handle_lock, &to);
+  }
+  pthread_mutex_unlock(&pool->locks->transfer_handle_lock);
+}
 
-  return (ret == 0 || ret == ETIMEDOUT) ? 0 : -1;
+static void wake_waiting_threads(mdbm_pool_t *pool, int count) {
+  pthread_mutex_lock(&pool->locks->transfer_handle_lock);
+  __atomic_add_fetch(&pool->wake_seq, 1, __ATOMIC_SEQ_CST);
+  if (count == 1) {
+    pthread_cond_signal(&pool->locks->handle_cond);
+  } else {
+    pthread_cond_broadcast(&pool->locks->handle_cond);
+  }
+  pthread_mutex_unlock(&pool->locks->transfer_handle_lock);
 }
 
-MDBM *mdbm_pool_acquire_handle(mdbm_pool_t *pool) {
-  mdbm_pool_entry_t *reserve_entry = NULL;
-  MDBM *handle = NULL;
+#endif
+
+/* Hand an entry back: park it in this thread's affinity slot unless the
+ * slot already holds a free entry, in which case it goes on the free stack.
+ * Only wakes other threads when someone is actually blocked. */
+
+static void put_entry(mdbm_pool_t *pool, uint32_t index) {
+  uint32_t cached = pool_tls.index;
+
+  if (pool_tls.pool == pool && cached != index && cached < pool->size
+      && __atomic_load_n(&pool->entries[cached].state, __ATOMIC_RELAXED) == POOL_ENTRY_CACHED) {
+    __atomic_store_n(&pool->entries[index].state, POOL_ENTRY_SHARED, __ATOMIC_SEQ_CST);
+    push_free_entry(pool, index);
+  } else {
+    __atomic_store_n(&pool->entries[index].state, POOL_ENTRY_CACHED, __ATOMIC_SEQ_CST);
+    pool_tls.pool = pool;
+    pool_tls.index = index;
+  }
+
+  if (__atomic_load_n(&pool->excl, __ATOMIC_SEQ_CST)) {
+    wake_waiting_threads(pool, INT_MAX);
+  } else if (__atomic_load_n(&pool->waiters, __ATOMIC_SEQ_CST)) {
+    wake_waiting_threads(pool, 1);
+  }
+}
+
+/* Keep new acquires out, then wait until every handle is back.
+ * The caller holds excl_lock. */
+
+static void wait_for_idle_pool(mdbm_pool_t *pool) {
+  uint32_t i, seq;
+
+  __atomic_store_n(&pool->excl, 1, __ATOMIC_SEQ_CST);
+  for (;;) {
+    seq = __atomic_load_n(&pool->wake_seq, __ATOMIC_SEQ_CST);
+    for (i = 0; i < pool->size; ++i) {
+      if (__atomic_load_n(&pool->entries[i].state, __ATOMIC_SEQ_CST) == POOL_ENTRY_IN_USE) {
+        break;
+      }
+    }
+    if (i == pool->size) {
+      return;
+    }
+    wait_for_available_handle(pool, seq);
+  }
+}
+
+int mdbm_pool_destroy_pool(mdbm_pool_t *pool) {
   if (pool == NULL) {
-    return NULL;
+    return 0;
   }
 
-  if (pthread_rwlock_rdlock(&pool->locks->duplication_lock) != 0) {
-    LOG_LOCK_ACQUIRE_FAILURE("duplication_lock", "access to handle");
-    return NULL;
+  if (pthread_mutex_lock(&pool->locks->excl_lock) != 0) {
+    LOG_LOCK_ACQUIRE_FAILURE("excl_lock", "destroying pool");
+    return 0;
+  }
+
+  /* Like an exclusive user, wait for the handles held by other threads. */
+
+  wait_for_idle_pool(pool);
+  free_handle_stack(pool);
+
+  if (pthread_mutex_unlock(&pool->locks->excl_lock) != 0) {
+    LOG_LOCK_RELEASE_FAILURE("excl_lock", "destroying pool");
   }
 
-  if (pthread_mutex_lock(&pool->locks->transfer_handle_lock) != 0) {
-    LOG_LOCK_ACQUIRE_FAILURE("transfer_handle_lock",
-      "access to handle");
-    pthread_rwlock_unlock(&pool->locks->duplication_lock);
+  free_locks(pool);
+  free(pool);
+  return 1;
+}
+
+MDBM *mdbm_pool_acquire_handle(mdbm_pool_t *pool) {
+  mdbm_pool_entry_t *entry;
+  uint32_t index = POOL_NIL, seq;
+  uint64_t start = 0;
+  int hit = 0, waiting = 0;
+
+  if (pool == NULL) {
     return NULL;
   }
 
-  while (! pool->dup_handle_stack.lh_first) {
-    if (wait_for_available_handle(pool) != 0) {
-      LOG_LOCK_RELEASE_FAILURE("handle_cond", "pthread_cond_timedwait returned failure");
-      pthread_mutex_unlock(&pool->locks->transfer_handle_lock);
-      pthread_rwlock_unlock(&pool->locks->duplication_lock);
-      return NULL;
+  for (;;) {
+    seq = __atomic_load_n(&pool->wake_seq, __ATOMIC_SEQ_CST);
+
+    /* Taking an entry and then checking excl pairs with the exclusive
+     * user raising excl and then checking the entries: one of the two
+     * always sees the other. */
+
+    if (!__atomic_load_n(&pool->excl, __ATOMIC_SEQ_CST)) {
+      index = take_entry(pool, &hit);
+      if (index != POOL_NIL) {
+        if (!__atomic_load_n(&pool->excl, __ATOMIC_SEQ_CST)) {
+          break;
+        }
+        put_entry(pool, index);
+      }
+    }
+
+    /* Register as a waiter, then look once more before blocking, so a
+     * release that missed the registration can't be slept through. */
+
+    if (!waiting) {
+      waiting = 1;
+      start = get_time_usec();
+      __atomic_add_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+      continue;
     }
+
+    wait_for_available_handle(pool, seq);
   }
 
-  reserve_entry = pool->dup_handle_stack.lh_first;
-  LIST_REMOVE(reserve_entry, entries);
+  if (waiting) {
+    __atomic_sub_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->wait_usec, get_time_usec() - start, __ATOMIC_RELAXED);
+  }
 
-  handle = reserve_entry->mdbm_handle;
-  reserve_entry->mdbm_handle = NULL;
-  LIST_INSERT_HEAD(&pool->reserve_handle_stack, reserve_entry, entries);
+  /* Only the holder of an entry writes its counters. */
 
-  if (pthread_mutex_unlock(&pool->locks->transfer_handle_lock) != 0) {
-    LOG_LOCK_RELEASE_FAILURE("transfer_handle_lock", "safe exit from acquire_handle.");
+  entry = &pool->entries[index];
+  if (hit) {
+    __atomic_store_n(&entry->hits, entry->hits + 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_store_n(&entry->misses, entry->misses + 1, __ATOMIC_RELAXED);
   }
-  
-  return handle;
+
+  pool_tls.pool = pool;
+  pool_tls.index = index;
+
+  return entry->mdbm_handle;
 }
 
 int mdbm_pool_release_handle(mdbm_pool_t *pool, MDBM *db) {
-  int ret = 1;
-  mdbm_pool_entry_t *reserve_entry = NULL;
+  uint32_t index;
+
   if (pool == NULL || db == NULL) {
     return 0;
   }
 
-  if (pthread_mutex_lock(&pool->locks->transfer_handle_lock) != 0) {
-    LOG_LOCK_ACQUIRE_FAILURE("transfer_handle_lock",
-      "completion of operations on handle.");
-    pthread_rwlock_unlock(&pool->locks->duplication_lock);
-    mdbm_close(db);
-    return 0;
-  }
-  
-  if (pool->reserve_handle_stack.lh_first) {
-    reserve_entry = pool->reserve_handle_stack.lh_first;
-    LIST_REMOVE(reserve_entry, entries);
-  } else {
-    if ((reserve_entry = calloc(1, sizeof(mdbm_pool_entry_t))) == NULL) {
-      mdbm_logerror(LOG_ERR, 0, "Failed to allocate memory needed to return handle to pool.");
-      pthread_mutex_unlock(&pool->locks->transfer_handle_lock);
-      pthread_rwlock_unlock(&pool->locks->duplication_lock);
-      mdbm_close(db);
-      return 0;
+  /* Handles are normally released by the thread that acquired them last. */
+
+  index = pool_tls.index;
+  if (pool_tls.pool != pool || index >= pool->size
+      || pool->entries[index].mdbm_handle != db) {
+    for (index = 0; index < pool->size; ++index) {
+      if (pool->entries[index].mdbm_handle == db) {
+        break;
+      }
     }
   }
 
-  reserve_entry->mdbm_handle = db;
-  LIST_INSERT_HEAD(&pool->dup_handle_stack, reserve_entry, entries);
-
-  /* notify other waiting threads that we released a handle */
-
-  if (pthread_cond_signal(&pool->locks->handle_cond)){
-    ret = 0;
+  if (index >= pool->size
+      || __atomic_load_n(&pool->entries[index].state, __ATOMIC_RELAXED) != POOL_ENTRY_IN_USE) {
+    mdbm_logerror(LOG_ERR, 0, "Released handle %p is not held from this pool.", (void*)db);
+    return 0;
   }
 
-  if (pthread_mutex_unlock(&pool->locks->transfer_handle_lock) != 0) {
-    LOG_LOCK_RELEASE_FAILURE("transfer_handle_lock","safe exit from release_handle");
-  }
-  
-  if (pthread_rwlock_unlock(&pool->locks->duplication_lock) != 0) {
-    LOG_LOCK_RELEASE_FAILURE("duplication_lock", "safe exit from release_handle");
-  }
-    
-  return ret;
+  put_entry(pool, index);
+  return 1;
 }
 
 MDBM *mdbm_pool_acquire_excl_handle(mdbm_pool_t *pool) {
@@ -406,15 +566,12 @@ MDBM *mdbm_pool_acquire_excl_handle(mdbm_pool_t *pool) {
     return NULL;
   }
 
-  if (pthread_rwlock_wrlock(&pool->locks->duplication_lock) != 0) {
-    LOG_LOCK_ACQUIRE_FAILURE("duplication_lock", "exclusive operations.");
+  if (pthread_mutex_lock(&pool->locks->excl_lock) != 0) {
+    LOG_LOCK_ACQUIRE_FAILURE("excl_lock", "exclusive operations.");
     return NULL;
   }
 
-  /* acquire_read_write_handle should never need to muck with the
-   * handle stack, and pthread_rwlock_wrlock() will block until all 
-   * the readers are done, so there's no need to acquire transfer_handle_lock.
-   */
+  wait_for_idle_pool(pool);
 
   return pool->original_handle;
 }
@@ -424,11 +581,33 @@ int mdbm_pool_release_excl_handle(mdbm_pool_t *pool, MDBM *db) {
     return 0;
   }
 
-  if (pthread_rwlock_unlock(&pool->locks->duplication_lock) != 0) {
-    LOG_LOCK_RELEASE_FAILURE("duplication_lock", "completion of exclusive operations.");
+  __atomic_store_n(&pool->excl, 0, __ATOMIC_SEQ_CST);
+  wake_waiting_threads(pool, INT_MAX);
+
+  if (pthread_mutex_unlock(&pool->locks->excl_lock) != 0) {
+    LOG_LOCK_RELEASE_FAILURE("excl_lock", "completion of exclusive operations.");
+    return 0;
+  }
+
+  return 1;
+}
+
+int mdbm_pool_get_stats(mdbm_pool_t *pool, mdbm_pool_stats_t *stats) {
+  uint32_t i;
+
+  if (pool == NULL || stats == NULL) {
     return 0;
   }
 
+  memset(stats, 0, sizeof(*stats));
+  for (i = 0; i < pool->size; ++i) {
+    stats->hits += __atomic_load_n(&pool->entries[i].hits, __ATOMIC_RELAXED);
+    stats->misses += __atomic_load_n(&pool->entries[i].misses, __ATOMIC_RELAXED);
+  }
+  stats->waits = __atomic_load_n(&pool->waits, __ATOMIC_RELAXED);
+  stats->wait_usec = __atomic_load_n(&pool->wait_usec, __ATOMIC_RELAXED);
+  stats->size = pool->size;
+
   return 1;
 }
 
@@ -287,6 +287,15 @@ int db_part_owned(MDBM* db) {
   return 0;
 }
 
+int db_get_lock_stats(MDBM* db, mdbm_lock_stats_t* stats) {
+  MdbmLockBase* locks = CAST_LOCKS(db);
+  if (!locks) { // MDBM_OPEN_NOLOCK
+    errno = EINVAL;
+    return -1;
+  }
+  return locks->getStats(stats);
+}
+
 int db_is_multi_lock(MDBM* db) {
   LOCK_PRECOND_RET(db, -1);
   uint32_t lockmode = db_get_lockmode(db);
@@ -435,6 +444,126 @@ int mdbm_internal_unlock(MDBM* db) {
     }                                                          \
 
 
+/*
+ * Keeps this handle's entries in the optimistic read counters (h_read_seq)
+ * in step with the locks it holds, so lock-free fetches can tell that a
+ * writer may be changing the db.  Counters are entered once a lock is taken
+ * (unless it is taken for a library lookup), and left before it is released.
+ * Read-only handles never modify the db, and protected handles may have the
+ * header mapped read-only.
+ */
+static void
+read_seq_update(MDBM* db, int excl_held, int index_held, int may_enter)
+{
+    mdbm_hdr_t* hdr = db->db_hdr;
+    uint32_t held = db->db_read_seq_held;
+    uint32_t want = 0;
+    int i;
+
+    /* Another dup'ed handle remapped the db: the header can't be touched
+     * until the caller syncs the mapping (and calls us again). */
+    if (MDBM_DUP_IS_REPLACED(db)) {
+        return;
+    }
+    if (!hdr || MDBM_IS_RDONLY(db) || MDBM_USE_PROTECT(db)
+        || (!held && !(hdr->h_dbflags & MDBM_HFLAG_OPTREAD)))
+    {
+        return;
+    }
+    if (excl_held && hdr->h_read_seq_stale) {
+        /* A writer died in a locked section; no other writer can be in one
+         * while we hold the exclusive lock, so its counts can be dropped. */
+        mdbm_internal_read_seq_reset(db);
+        held = 0;
+    }
+    if (hdr->h_dbflags & MDBM_HFLAG_OPTREAD) {
+        if (excl_held) {
+            want |= 1;
+        }
+        if (index_held) {
+            want |= 1U << MDBM_READ_SEQ_PART_WORD(db->db_read_seq_part);
+        }
+    }
+    if (!may_enter) {
+        want &= held;
+    }
+    for (i = 0; i < MDBM_READ_SEQ_WORDS; ++i) {
+        uint32_t bit = 1U << i;
+        if ((want & bit) && !(held & bit)) {
+            atomic_add32u(&hdr->h_read_seq[i],1);
+        } else if (!(want & bit) && (held & bit)) {
+            atomic_add32u(&hdr->h_read_seq[i],MDBM_READ_SEQ_VERSION - 1);
+        }
+    }
+    db->db_read_seq_held = want;
+}
+
+void
+mdbm_internal_read_seq_sync(MDBM* db)
+{
+    LOCK_PRECOND(db);
+    MdbmLockBase* locks = CAST_LOCKS(db);
+    read_seq_update(db,
+                    locks->getHeldCount(MLOCK_EXCLUSIVE, true) > 0,
+                    locks->getHeldCount(MLOCK_INDEX, true) > 0,
+                    !db->db_read_seq_reading);
+}
+
+/*
+ * Leaves every read counter this handle has entered (e.g. before the
+ * mapping they live in goes away).
+ */
+void
+mdbm_internal_read_seq_leave(MDBM* db)
+{
+    int i;
+
+    if (!db->db_read_seq_held) {
+        return;
+    }
+    for (i = 0; i < MDBM_READ_SEQ_WORDS; ++i) {
+        if (db->db_read_seq_held & (1U << i)) {
+            atomic_add32u(&db->db_hdr->h_read_seq[i],MDBM_READ_SEQ_VERSION - 1);
+        }
+    }
+    db->db_read_seq_held = 0;
+}
+
+/*
+ * Drops all writer counts, and bumps every version.  Must be called with the
+ * exclusive lock held, so that no other writer is in a locked section.
+ */
+void
+mdbm_internal_read_seq_reset(MDBM* db)
+{
+    mdbm_hdr_t* hdr = db->db_hdr;
+    int i;
+
+    mdbm_internal_read_seq_leave(db);
+    for (i = 0; i < MDBM_READ_SEQ_WORDS; ++i) {
+        hdr->h_read_seq[i] = (hdr->h_read_seq[i] | MDBM_READ_SEQ_BUSY) + 1;
+    }
+    hdr->h_read_seq_stale = 0;
+}
+
+/*
+ * A lock was recovered from a dead owner, which may have died between
+ * entering and leaving the read counters.  Flag the counts as stale; they
+ * are reset as soon as some handle holds the exclusive lock.
+ */
+static void
+read_seq_recover(MDBM* db)
+{
+    mdbm_hdr_t* hdr = db->db_hdr;
+
+    if (MDBM_DUP_IS_REPLACED(db) || !hdr || MDBM_IS_RDONLY(db) || MDBM_USE_PROTECT(db)
+        || !(hdr->h_dbflags & MDBM_HFLAG_OPTREAD))
+    {
+        return;
+    }
+    hdr->h_read_seq_stale = 1;
+}
+
 /**
  * \brief Locks a page this MDBM in the requested mode.
  * \param[in,out] db database handle
@@ -577,6 +706,13 @@ do_lock_x(MDBM* db, int pageno, int nonblock, int check)
                 mdbm_log(LOG_NOTICE,"%s: mdbm integrity check passed",db->db_filename);
             }
         }
+        if (do_check) {
+            read_seq_recover(db);
+        }
+        if (part_num >= 0) {
+            db->db_read_seq_part = part_num;
+        }
+        mdbm_internal_read_seq_sync(db);
         return 1;
         /*////////////////////////////////////////////////////////*/
 
@@ -584,8 +720,8 @@ do_lock_x(MDBM* db, int pageno, int nonblock, int check)
     /* NOTREACHED */
 }
 
-int
-mdbm_internal_do_lock(MDBM* db, int write, int nonblock, const datum* key,
+static int
+do_lock_key(MDBM* db, int write, int nonblock, const datum* key,
         mdbm_hashval_t* hashval, mdbm_pagenum_t* pagenum)
 {
     /*struct mdbm_locks *db_locks = db->db_locks; */
@@ -628,6 +764,7 @@ retry_replace:
         if (db->db_dup_info) {
             if (db->db_dup_map_gen != db->db_dup_info->dup_map_gen) {
                 sync_dup_map_gen(db);
+                mdbm_internal_read_seq_sync(db);
             }
         }
 
@@ -692,6 +829,7 @@ retry_replace:
             if (db->db_dup_info) {
                 if (db->db_dup_map_gen != db->db_dup_info->dup_map_gen) {
                     sync_dup_map_gen(db);
+                    mdbm_internal_read_seq_sync(db);
                 }
             }
             if (MDBM_REPLACED_OR_CHANGED(db)) {
@@ -716,6 +854,7 @@ retry_replace:
                 if (db->db_dup_info) {
                     if (db->db_dup_map_gen != db->db_dup_info->dup_map_gen) {
                         sync_dup_map_gen(db);
+                        mdbm_internal_read_seq_sync(db);
                     }
                 }
             }
@@ -761,6 +900,24 @@ retry_replace:
     /* NOTREACHED */
 }
 
+int
+mdbm_internal_do_lock(MDBM* db, int write, int nonblock, const datum* key,
+        mdbm_hashval_t* hashval, mdbm_pagenum_t* pagenum)
+{
+    int ret;
+
+    /* Library lookups don't enter the optimistic read counters, so they
+     * don't make concurrent lock-free fetches retry.  Other read locks do,
+     * since the caller may modify values in place while holding them. */
+    db->db_read_seq_reading = (write == MDBM_LOCK_LOOKUP);
+    if (db->db_read_seq_reading) {
+        write = MDBM_LOCK_READ;
+    }
+    ret = do_lock_key(db,write,nonblock,key,hashval,pagenum);
+    db->db_read_seq_reading = 0;
+    return ret;
+}
+
 int
 do_unlock_x(MDBM* db)
 {
@@ -778,6 +935,12 @@ do_unlock_x(MDBM* db)
       int part_nest = locks->getHeldCount(MLOCK_INDEX, true);
       int share_nest = locks->getHeldCount(MLOCK_SHARED, true);
       //fprintf(stderr, "@@@ do_unlock_x pid:%d tid:%d, excl_nest:%d part_nest:%d share_nest:%d\n", getpid(), mdbm_gettid(), exclusive_nest, part_nest, share_nest);
+      /* leave read counters for the lock being released, while it's still held */
+      if (exclusive_nest > 0) {
+        read_seq_update(db, exclusive_nest > 1, part_nest > 0, 0);
+      } else {
+        read_seq_update(db, 0, part_nest > 1, 0);
+      }
       if (exclusive_nest > 0) {
         /* exclusive lock is held... release it */
         if (locks->unlock(MLOCK_EXCLUSIVE) < 0) {
@@ -815,6 +978,22 @@ do_unlock_x(MDBM* db)
             mdbm_protect(db,MDBM_PROT_NOACCESS);
         }
     }
+
+    /* Read counters left busy by a dead partition writer are only reset under
+     * the exclusive lock; try to take it now, rather than have lock-free
+     * fetches fall back until some writer needs it. */
+    if (!MDBM_USE_PROTECT(db) && !MDBM_IS_RDONLY(db) && !MDBM_DUP_IS_REPLACED(db)
+        && db->db_hdr && db->db_hdr->h_read_seq_stale
+        && !locks->getHeldCount(MLOCK_EXCLUSIVE, true)
+        && !locks->getHeldCount(MLOCK_INDEX, true)
+        && !locks->getHeldCount(MLOCK_SHARED, true))
+    {
+        int err = errno;
+        if (do_lock_x(db,MDBM_LOCK_EXCLUSIVE,MDBM_LOCK_NOWAIT,MDBM_LOCK_NOCHECK) >= 0) {
+            do_unlock_x(db);
+        }
+        errno = err;
+    }
     return 1;
 }
 
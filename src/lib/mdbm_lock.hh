@@ -54,6 +54,7 @@ extern "C" {
   int db_part_owned(MDBM* db);
   int db_is_multi_lock(MDBM* db);
   int db_multi_part_locked(MDBM* db);
+  int db_get_lock_stats(MDBM* db, mdbm_lock_stats_t* stats);
   //int get_lockfile_name(const char* dbname, char* lockname, int maxlen);
   struct mdbm_locks* open_locks_inner(const char* dbname, int flags, int do_lock, int* need_check);
   void close_locks_inner(struct mdbm_locks* locks);
@@ -105,6 +106,8 @@ public:
   virtual int getCount(int type) = 0;
   // hacky function... shouldn't exist, optional, may return -1, ENOTSUP
   virtual int reset(const char* dbfilename, int flags) = 0;
+  // fills in contention counters, optional, may return -1, ENOTSUP
+  virtual int getStats(mdbm_lock_stats_t* stats) { errno = ENOTSUP; return -1; }
 
   // TODO int upgrade()/downgrade(int part?) ?
   //   actually, handle it with special 'type' arg to lock()
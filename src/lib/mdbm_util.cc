@@ -4,12 +4,16 @@
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
 
 #include <string>
+#include <vector>
 
 #include "mdbm.h"
 #include "mdbm_internal.h"
@@ -116,37 +120,310 @@ mdbm_util_lockstr_to_flags(const char* lock_string, int *lock_flags)
 }
 
 
-inline static int
-dbdump_str(datum d, FILE *fp)
+/*
+ * db_dump escaping: '\\' is written as "\\\\", and NUL, LF and CR as "\\00",
+ * "\\0a" and "\\0d"; every other byte is copied.  Records are mostly runs of
+ * copied bytes, so the vector codecs look for the escaped bytes (or for '\\'
+ * when decoding) 16 or 32 bytes at a time, and store whole clean runs.
+ */
+
+static inline char*
+dbdump_escape_byte(char c, char *out)
 {
-    int i, ret;
+    switch (c) {
+    case '\\':
+        *out++ = '\\';
+        *out++ = '\\';
+        break;
+    case '\0':
+        memcpy(out, "\\00", 3);
+        out += 3;
+        break;
+    case '\012':
+        memcpy(out, "\\0a", 3);
+        out += 3;
+        break;
+    case '\015':
+        memcpy(out, "\\0d", 3);
+        out += 3;
+        break;
+    default:
+        *out++ = c;
+    }
+    return out;
+}
 
-    for (i = 0; i < d.dsize; i++) {
-        ret = 1;
-        switch(d.dptr[i]) {
-        case '\\':
-            ret = fwrite("\\\\", 2, 1, fp);
-            break;
-        case '\0':
-            ret = fwrite("\\00", 3, 1, fp);
-            break;
-        case '\012':
-            ret = fwrite("\\0a", 3, 1, fp);
-            break;
-        case '\015':
-            ret = fwrite("\\0d", 3, 1, fp);
+// Escape len bytes of src into dst, which must hold 3*len bytes.
+// Returns the escaped length.
+static size_t
+dbdump_escape_scalar(const char *src, size_t len, char *dst)
+{
+    char *out = dst;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        out = dbdump_escape_byte(src[i], out);
+    }
+    return out - dst;
+}
+
+// Decode the escape at src[*ip], advancing *ip and *outp past it.
+// Returns 0, 1 if the '\\' ends the line (a line continuation), or -1 if it's malformed.
+static inline int
+dbdump_unescape_esc(const char *src, size_t len, size_t *ip, char **outp)
+{
+    size_t i = *ip;
+
+    if (i + 1 == len) {
+        *ip = len;
+        return 1;
+    }
+    if (src[i + 1] == '\\') {
+        *(*outp)++ = '\\';
+        *ip = i + 2;
+        return 0;
+    }
+    if (i + 2 < len && isxdigit((unsigned char)src[i + 1]) && isxdigit((unsigned char)src[i + 2])) {
+        *(*outp)++ = mdbm_internal_hex_to_byte(src[i + 1], src[i + 2]);
+        *ip = i + 3;
+        return 0;
+    }
+    return -1;
+}
+
+// Decode one line (without its newline) of len bytes from src into dst, which must
+// hold len bytes.  Sets *dlen to the decoded length, and returns as dbdump_unescape_esc.
+static int
+dbdump_unescape_scalar(const char *src, size_t len, char *dst, size_t *dlen)
+{
+    char *out = dst;
+    size_t i = 0;
+    int ret = 0;
+
+    while (i < len) {
+        if (src[i] != '\\') {
+            *out++ = src[i++];
+        } else if ((ret = dbdump_unescape_esc(src, len, &i, &out)) != 0) {
             break;
-        default:
-            if (fputc(d.dptr[i], fp) == EOF) {
-                ret = 0;
-            }
         }
-        if (ret <= 0) {
-            errno = EBADF;
+    }
+    *dlen = out - dst;
+    return ret;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MDBM_HAVE_SIMD_DBDUMP
+#include <immintrin.h>
+
+/*
+ * The vector codecs store each block before looking at its mask: an escaped
+ * block expands (and a decoded one shrinks) to cover what was stored, so
+ * neither writes past the end of the output.
+ */
+
+__attribute__ ((target("sse2"))) static size_t
+dbdump_escape_sse2(const char *src, size_t len, char *dst)
+{
+    const __m128i bs = _mm_set1_epi8('\\'), nl = _mm_set1_epi8('\012');
+    const __m128i cr = _mm_set1_epi8('\015'), nul = _mm_setzero_si128();
+    char *out = dst;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,bs), _mm_cmpeq_epi8(v,nul)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v,nl), _mm_cmpeq_epi8(v,cr)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+        _mm_storeu_si128((__m128i*)out, v);
+        if (!mask) {
+            out += 16;
+        } else {
+            size_t n = __builtin_ctz(mask);
+            out += n;
+            out += dbdump_escape_scalar(src + i + n, 16 - n, out);
+        }
+    }
+    return (out - dst) + dbdump_escape_scalar(src + i, len - i, out);
+}
+
+__attribute__ ((target("avx2"))) static size_t
+dbdump_escape_avx2(const char *src, size_t len, char *dst)
+{
+    const __m256i bs = _mm256_set1_epi8('\\'), nl = _mm256_set1_epi8('\012');
+    const __m256i cr = _mm256_set1_epi8('\015'), nul = _mm256_setzero_si256();
+    char *out = dst;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v,bs),
+                                                    _mm256_cmpeq_epi8(v,nul)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v,nl),
+                                                    _mm256_cmpeq_epi8(v,cr)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+        _mm256_storeu_si256((__m256i*)out, v);
+        if (!mask) {
+            out += 32;
+        } else {
+            size_t n = __builtin_ctz(mask);
+            out += n;
+            out += dbdump_escape_scalar(src + i + n, 32 - n, out);
+        }
+    }
+    return (out - dst) + dbdump_escape_scalar(src + i, len - i, out);
+}
+
+__attribute__ ((target("sse2"))) static int
+dbdump_unescape_sse2(const char *src, size_t len, char *dst, size_t *dlen)
+{
+    const __m128i bs = _mm_set1_epi8('\\');
+    char *out = dst;
+    size_t i = 0, n;
+    int ret;
+
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v,bs));
+        _mm_storeu_si128((__m128i*)out, v);
+        if (!mask) {
+            i += 16;
+            out += 16;
+            continue;
+        }
+        n = __builtin_ctz(mask);
+        i += n;
+        out += n;
+        if ((ret = dbdump_unescape_esc(src, len, &i, &out)) != 0) {
+            *dlen = out - dst;
+            return ret;
+        }
+    }
+    ret = dbdump_unescape_scalar(src + i, len - i, out, &n);
+    *dlen = (out - dst) + n;
+    return ret;
+}
+
+__attribute__ ((target("avx2"))) static int
+dbdump_unescape_avx2(const char *src, size_t len, char *dst, size_t *dlen)
+{
+    const __m256i bs = _mm256_set1_epi8('\\');
+    char *out = dst;
+    size_t i = 0, n;
+    int ret;
+
+    while (i + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,bs));
+        _mm256_storeu_si256((__m256i*)out, v);
+        if (!mask) {
+            i += 32;
+            out += 32;
+            continue;
+        }
+        n = __builtin_ctz(mask);
+        i += n;
+        out += n;
+        if ((ret = dbdump_unescape_esc(src, len, &i, &out)) != 0) {
+            *dlen = out - dst;
+            return ret;
+        }
+    }
+    ret = dbdump_unescape_scalar(src + i, len - i, out, &n);
+    *dlen = (out - dst) + n;
+    return ret;
+}
+#endif
+
+typedef size_t (*dbdump_escape_func_t)(const char*, size_t, char*);
+typedef int (*dbdump_unescape_func_t)(const char*, size_t, char*, size_t*);
+
+static dbdump_escape_func_t dbdump_escape = dbdump_escape_scalar;
+static dbdump_unescape_func_t dbdump_unescape = dbdump_unescape_scalar;
+static int dbdump_codec_kind = MDBM_SCAN_SCALAR;
+
+int
+mdbm_internal_set_dbdump_codec(int kind)
+{
+    switch (kind) {
+    case MDBM_SCAN_SCALAR:
+        dbdump_escape = dbdump_escape_scalar;
+        dbdump_unescape = dbdump_unescape_scalar;
+        break;
+#ifdef MDBM_HAVE_SIMD_DBDUMP
+    case MDBM_SCAN_SSE2:
+        if (!__builtin_cpu_supports("sse2")) {
+            errno = ENOTSUP;
             return -1;
         }
+        dbdump_escape = dbdump_escape_sse2;
+        dbdump_unescape = dbdump_unescape_sse2;
+        break;
+    case MDBM_SCAN_AVX2:
+        if (!__builtin_cpu_supports("avx2")) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        dbdump_escape = dbdump_escape_avx2;
+        dbdump_unescape = dbdump_unescape_avx2;
+        break;
+#endif
+    default:
+        errno = EINVAL;
+        return -1;
     }
-    return ((fputc('\n', fp) != EOF) ? 0 : -1);
+    dbdump_codec_kind = kind;
+    return 0;
+}
+
+int
+mdbm_internal_get_dbdump_codec(void)
+{
+    return dbdump_codec_kind;
+}
+
+/* Library constructor: pick the widest db_dump codec this cpu supports. */
+static void __attribute__ ((constructor)) mdbm_dbdump_codec_init(void);
+
+static void
+mdbm_dbdump_codec_init(void)
+{
+#ifdef MDBM_HAVE_SIMD_DBDUMP
+    __builtin_cpu_init();
+    if (mdbm_internal_set_dbdump_codec(MDBM_SCAN_AVX2) == 0) {
+        return;
+    }
+    if (mdbm_internal_set_dbdump_codec(MDBM_SCAN_SSE2) == 0) {
+        return;
+    }
+#endif
+    mdbm_internal_set_dbdump_codec(MDBM_SCAN_SCALAR);
+}
+
+#define DBDUMP_CHUNK 4096   /* Bytes escaped at a time by dbdump_str */
+
+// Write d, escaped, and a newline to fp, a chunk at a time.
+static int
+dbdump_str(datum d, FILE *fp)
+{
+    char buf[DBDUMP_CHUNK * 3 + 1];
+    const char *p = d.dptr;
+    size_t left = d.dsize, n, len;
+
+    do {
+        n = (left < DBDUMP_CHUNK) ? left : DBDUMP_CHUNK;
+        len = dbdump_escape(p, n, buf);
+        p += n;
+        left -= n;
+        if (!left) {
+            buf[len++] = '\n';
+        }
+        if (fwrite(buf, 1, len, fp) != len) {
+            errno = EBADF;
+            return -1;
+        }
+    } while (left);
+    return 0;
 }
 
 int
@@ -200,33 +477,7 @@ get_dbdump_size(datum dtum)
 inline static void
 add_dbdump_record(datum d, char *buffer)
 {
-    int i;
-
-    for (i = 0; i < d.dsize; i++) {
-        switch(d.dptr[i]) {
-        case '\\':
-            *buffer++ = '\\';
-            *buffer++ = '\\';
-            break;
-        case '\0':
-            *buffer++ = '\\';
-            *buffer++ = '0';
-            *buffer++ = '0';
-            break;
-        case '\012':
-            *buffer++ = '\\';
-            *buffer++ = '0';
-            *buffer++ = 'a';
-            break;
-        case '\015':
-            *buffer++ = '\\';
-            *buffer++ = '0';
-            *buffer++ = 'd';
-            break;
-        default:
-            *buffer++ = d.dptr[i];
-        }
-    }
+    buffer += dbdump_escape(d.dptr, d.dsize, buffer);
     *buffer = '\n';
 }
 
@@ -431,46 +682,60 @@ mdbm_internal_hex_to_byte(int c1, int c2)
     return (char)digit;
 }
 
-// Read key or value in DBdump format
+// Line and record buffers for reading DBdump data.
+struct dbdump_reader {
+    char   *line;
+    size_t  linesize;
+    char   *buf;
+    size_t  bufsize;
+};
+
+// Read key or value in DBdump format, a line at a time
 //     FILE *fp    - [in]  the file containing the DBdump data
-//     string &str - [out] the string parameter to read into
+//     rd          - [in,out] buffers; the data is decoded into rd->buf at offset off
+//     len         - [out] length of the decoded data
 //     lineno      - [in]  the current line number for printing error messages
-static inline int
-read_str(FILE *fp, std::string &str, uint32_t lineno)
+static int
+read_str(FILE *fp, struct dbdump_reader *rd, size_t off, size_t *len, uint32_t lineno)
 {
-    int ch, ch2, ch3;
-
-    str.erase();
+    ssize_t got;
+    size_t n, dlen;
+    int nl, ret;
 
+    *len = 0;
     for (;;) {
-        ch = getc(fp);
-        switch(ch) {
-        case '\n':
-            return 0;
-        case EOF:
+        if ((got = getline(&rd->line, &rd->linesize, fp)) < 0) {
             return EOF;
-        case '\\':
-            ch2 = getc(fp);
-            if (ch2 == '\\') {
-                str.append((size_t)1, '\\');
-            }
-            else {
-                if (ch2 != '\n') {
-                    // expect two hex characters
-                    ch3 = getc(fp);
-                    if (isxdigit(ch2) && isxdigit(ch3)) {
-                        str.append((size_t)1, mdbm_internal_hex_to_byte(ch2, ch3));
-                    }
-                    else {
-                        fprintf(stderr, "line %u: bad escape format\n", lineno);
-                        return -2;
-                    }
-                }
+        }
+        n = got;
+        nl = (rd->line[n - 1] == '\n');
+        if (nl) {
+            --n;
+        }
+        if (off + *len + n > rd->bufsize) {
+            size_t size = 2 * (off + *len + n);
+            char *tmp = (char *) realloc(rd->buf, size);
+            if (tmp == NULL) {
+                fprintf(stderr, "line %u: cannot allocate %llu bytes\n",
+                        lineno, (unsigned long long)size);
+                return -2;
             }
-            break;
-        default:
-            str.append((size_t)1, ch);
+            rd->buf = tmp;
+            rd->bufsize = size;
+        }
+        ret = dbdump_unescape(rd->line, n, rd->buf + off + *len, &dlen);
+        *len += dlen;
+        if (ret < 0 || (ret > 0 && !nl)) {
+            fprintf(stderr, "line %u: bad escape format\n", lineno);
+            return -2;
+        }
+        if (!nl) {
+            return EOF;     // incomplete last line
         }
+        if (ret == 0) {
+            return 0;
+        }
+        // '\\' before the newline continues the data on the next line
     }
     /*NOTREACHED*/
 }
@@ -513,51 +778,81 @@ lock_and_store(MDBM *db, datum key, datum val, int store_flag)
 }
 
 
-// Read data from FILE *fp into MDBM *db, using DBdump format.
+// Read records from FILE *fp in DBdump format, calling func for each.
 // input_file - name of the file pointed to by "fp".
-// store_flag - MDBM_INSERT | MDBM_REPLACE | MDBM_INSERT_DUP | MDBM_MODIFY
-// lineno is a pointer to the  current line number, used to keep track of the current line number
-// in order to generate meaningful error messages.  May not start from one if a header was
-// previously read.  Also documented in mdbm.h
+// lineno is a pointer to the current line number, as for mdbm_dbdump_import.
+// Also documented in mdbm.h
 int
-mdbm_dbdump_import(MDBM *db, FILE *fp, const char *input_file, int store_flag, uint32_t *lineno)
+mdbm_dbdump_read(FILE *fp, const char *input_file, uint32_t *lineno,
+                 mdbm_dbdump_func_t func, void *user)
 {
-    std::string keybuf(""), valbuf("");
-    datum key, val;
-    int status;
+    struct dbdump_reader rd = { NULL, 0, NULL, 0 };
+    kvpair kv;
+    size_t klen, vlen;
+    int status, ret = 0;
 
     for (;; (*lineno)++) {
-        if ((status = read_str(fp, keybuf, *lineno)) != 0) {
-            if (status == EOF) {
-                break;
-            } else {
-                return -2;
+        if ((status = read_str(fp, &rd, 0, &klen, *lineno)) != 0) {
+            if (status != EOF) {
+                ret = -2;
             }
+            break;
         }
 
-        if (keybuf.size() == 0) {
+        if (klen == 0) {
             fprintf(stderr, "%s: bad key length\n", input_file);
-            return -2;
+            ret = -2;
+            break;
         }
 
-        if (0 != (status = read_str(fp, valbuf, *lineno))) {
+        if (0 != (status = read_str(fp, &rd, klen, &vlen, *lineno))) {
             if (status == EOF)
                 fprintf(stderr, "%s: unexpected EOF\n", input_file);
-            return -2;
+            ret = -2;
+            break;
         }
 
-        key.dptr = (char *) keybuf.data();
-        key.dsize = keybuf.size();
+        kv.key.dptr = rd.buf;
+        kv.key.dsize = klen;
 
-        val.dptr = (char *) valbuf.data();
-        val.dsize = valbuf.size();
+        kv.val.dptr = rd.buf + klen;
+        kv.val.dsize = vlen;
 
-        if (lock_and_store(db, key, val, store_flag) == -1) {
-            return -3;
+        if ((ret = func(user, &kv)) != 0) {
+            break;
         }
     }
 
-    return 0;
+    free(rd.line);
+    free(rd.buf);
+    return ret;
+}
+
+struct dbdump_store {
+    MDBM *db;
+    int store_flag;
+};
+
+static int
+dbdump_store_record(void *user, const kvpair *kv)
+{
+    struct dbdump_store *st = (struct dbdump_store *) user;
+
+    return (lock_and_store(st->db, kv->key, kv->val, st->store_flag) == -1) ? -3 : 0;
+}
+
+// Read data from FILE *fp into MDBM *db, using DBdump format.
+// input_file - name of the file pointed to by "fp".
+// store_flag - MDBM_INSERT | MDBM_REPLACE | MDBM_INSERT_DUP | MDBM_MODIFY
+// lineno is a pointer to the  current line number, used to keep track of the current line number
+// in order to generate meaningful error messages.  May not start from one if a header was
+// previously read.  Also documented in mdbm.h
+int
+mdbm_dbdump_import(MDBM *db, FILE *fp, const char *input_file, int store_flag, uint32_t *lineno)
+{
+    struct dbdump_store st = { db, store_flag };
+
+    return mdbm_dbdump_read(fp, input_file, lineno, dbdump_store_record, &st);
 }
 
 // Read data from FILE *fp into MDBM *db, using Cdb format.
@@ -664,3 +959,905 @@ mdbm_cdbdump_import(MDBM *db, FILE *fp, const char *input_file, int store_flag)
     return 0;
 }
 
+
+/*
+ * bindump format (see mdbm.h), all integers in network byte order:
+ *   bindump_hdr_t
+ *   blocks: a bindump_block_t, then b_stored_len bytes, which are the raw records,
+ *     or the records compressed by mdbm_internal_lz_compress() if b_flags has
+ *     BINDUMP_BLOCK_COMPRESSED
+ *   index: a bindump_block_t with BINDUMP_INDEX_MAGIC, then b_raw_len bytes of
+ *     bindump_index_t, one per block, in file order
+ *   bindump_footer_t
+ * Offsets are from the start of the header.
+ */
+#define BINDUMP_MAGIC               "MDBMBIN1"
+#define BINDUMP_VERSION             1
+#define BINDUMP_HFLAG_LARGE         0x01
+#define BINDUMP_BLOCK_MAGIC         0x424c4b31  /* "BLK1" */
+#define BINDUMP_INDEX_MAGIC         0x42494458  /* "BIDX" */
+#define BINDUMP_FOOTER_MAGIC        0x42454e44  /* "BEND" */
+#define BINDUMP_BLOCK_COMPRESSED    0x01
+#define BINDUMP_MAX_BLOCK           (MDBM_BINDUMP_BLOCK_SIZE + 2*sizeof(uint32_t) \
+                                     + MDBM_KEYLEN_MAX + MDBM_VALLEN_MAX)
+
+typedef struct bindump_hdr {
+    char        h_magic[8];
+    uint32_t    h_version;
+    uint32_t    h_flags;
+    uint32_t    h_pagesize;
+    uint32_t    h_pagecount;
+    int32_t     h_hash;
+    uint32_t    h_pad;
+} bindump_hdr_t;
+
+typedef struct bindump_block {
+    uint32_t    b_magic;
+    uint32_t    b_raw_len;
+    uint32_t    b_stored_len;
+    uint32_t    b_num_records;
+    uint32_t    b_crc;          /* CRC-32C of the raw records */
+    uint32_t    b_flags;
+} bindump_block_t;
+
+typedef struct bindump_index {
+    uint64_t    i_offset;
+    uint32_t    i_num_records;
+    uint32_t    i_pad;
+} bindump_index_t;
+
+typedef struct bindump_footer {
+    uint32_t    f_magic;
+    uint32_t    f_num_blocks;
+    uint64_t    f_index_offset;
+    uint64_t    f_num_records;
+} bindump_footer_t;
+
+static inline uint64_t
+bindump_hton64(uint64_t v)
+{
+    return ((uint64_t)htonl((uint32_t)v) << 32) | htonl((uint32_t)(v >> 32));
+}
+
+#define bindump_ntoh64 bindump_hton64
+
+// Output file shared by the threads writing blocks to it.
+struct bindump_sink {
+    FILE*                   fp;
+    int                     level;
+    pthread_mutex_t         mutex;      // guards everything below
+    uint64_t                offset;
+    uint64_t                num_records;
+    std::vector<bindump_index_t> index;
+    int                     err;        // first write error
+};
+
+// A block being filled, by one thread.
+struct bindump_block_buf {
+    struct bindump_sink*    sink;
+    char*                   buf;
+    uint32_t                len;
+    uint32_t                cap;
+    uint32_t                num_records;
+    char*                   cbuf;       // block header and compressed block
+    uint32_t                ccap;
+};
+
+struct mdbm_bindump_writer {
+    struct bindump_sink     sink;
+    struct bindump_block_buf block;
+};
+
+static int
+bindump_sink_open(struct bindump_sink* sink, FILE* fp, int level, const bindump_hdr_t* hdr)
+{
+    sink->fp = fp;
+    sink->level = (level > 0) ? level : 0;
+    sink->offset = sizeof(*hdr);
+    sink->num_records = 0;
+    sink->err = 0;
+    if (fwrite(hdr, sizeof(*hdr), 1, fp) != 1) {
+        return -1;
+    }
+    pthread_mutex_init(&sink->mutex, NULL);
+    return 0;
+}
+
+// Writes the index and the footer, and releases the sink.
+static int
+bindump_sink_close(struct bindump_sink* sink)
+{
+    bindump_block_t b;
+    bindump_footer_t f;
+    size_t len = sink->index.size() * sizeof(bindump_index_t);
+    const unsigned char* idx = (const unsigned char*)(sink->index.empty() ? NULL : &sink->index[0]);
+    int err = sink->err;
+
+    if (!err) {
+        b.b_magic = htonl(BINDUMP_INDEX_MAGIC);
+        b.b_raw_len = b.b_stored_len = htonl(len);
+        b.b_num_records = htonl(sink->index.size());
+        b.b_crc = htonl(idx ? mdbm_hash_crc32c(idx, len) : 0);
+        b.b_flags = 0;
+        f.f_magic = htonl(BINDUMP_FOOTER_MAGIC);
+        f.f_num_blocks = htonl(sink->index.size());
+        f.f_index_offset = bindump_hton64(sink->offset);
+        f.f_num_records = bindump_hton64(sink->num_records);
+        if (fwrite(&b, sizeof(b), 1, sink->fp) != 1
+            || (len && fwrite(idx, len, 1, sink->fp) != 1)
+            || fwrite(&f, sizeof(f), 1, sink->fp) != 1
+            || fflush(sink->fp) != 0)
+        {
+            err = errno;
+        }
+    }
+    pthread_mutex_destroy(&sink->mutex);
+    std::vector<bindump_index_t>().swap(sink->index);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Compresses (if enabled) and writes out a thread's current block.
+static int
+bindump_flush(struct bindump_block_buf* w)
+{
+    struct bindump_sink* sink = w->sink;
+    bindump_block_t* b;
+    bindump_index_t ie;
+    uint32_t need;
+    int clen = 0;
+    int ret = 0;
+
+    if (!w->len) {
+        return 0;
+    }
+    need = sizeof(*b) + mdbm_internal_lz_bound(w->len);
+    if (w->ccap < need) {
+        char* p = (char*)realloc(w->cbuf, need);
+        if (!p) {
+            errno = ENOMEM;
+            return -1;
+        }
+        w->cbuf = p;
+        w->ccap = need;
+    }
+    b = (bindump_block_t*)w->cbuf;
+    if (sink->level > 0) {
+        clen = mdbm_internal_lz_compress((const uint8_t*)w->buf, w->len,
+                                         (uint8_t*)w->cbuf + sizeof(*b), w->ccap - sizeof(*b),
+                                         sink->level);
+        if (clen >= (int)w->len) {
+            clen = 0;   // incompressible, store it raw
+        }
+    }
+    b->b_magic = htonl(BINDUMP_BLOCK_MAGIC);
+    b->b_raw_len = htonl(w->len);
+    b->b_stored_len = htonl(clen > 0 ? (uint32_t)clen : w->len);
+    b->b_num_records = htonl(w->num_records);
+    b->b_crc = htonl(mdbm_hash_crc32c((const unsigned char*)w->buf, w->len));
+    b->b_flags = htonl(clen > 0 ? BINDUMP_BLOCK_COMPRESSED : 0);
+
+    pthread_mutex_lock(&sink->mutex);
+    if (sink->err) {
+        ret = -1;
+        errno = sink->err;
+    } else if (fwrite(w->cbuf, sizeof(*b) + (clen > 0 ? clen : 0), 1, sink->fp) != 1
+               || (clen <= 0 && fwrite(w->buf, w->len, 1, sink->fp) != 1))
+    {
+        ret = -1;
+        sink->err = errno ? errno : EIO;
+    } else {
+        ie.i_offset = bindump_hton64(sink->offset);
+        ie.i_num_records = htonl(w->num_records);
+        ie.i_pad = 0;
+        sink->index.push_back(ie);
+        sink->offset += sizeof(*b) + (clen > 0 ? (uint32_t)clen : w->len);
+        sink->num_records += w->num_records;
+    }
+    pthread_mutex_unlock(&sink->mutex);
+    w->len = 0;
+    w->num_records = 0;
+    return ret;
+}
+
+static int
+bindump_add(struct bindump_block_buf* w, const datum& key, const datum& val)
+{
+    uint32_t need = 2*sizeof(uint32_t) + key.dsize + val.dsize;
+    uint32_t n;
+    char* p;
+
+    if (w->len + need > w->cap) {
+        if (bindump_flush(w) < 0) {
+            return -1;
+        }
+        if (need > w->cap) {
+            if ((p = (char*)realloc(w->buf, need)) == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            w->buf = p;
+            w->cap = need;
+        }
+    }
+    p = w->buf + w->len;
+    n = htonl(key.dsize);
+    memcpy(p, &n, sizeof(n));
+    n = htonl(val.dsize);
+    memcpy(p + sizeof(n), &n, sizeof(n));
+    memcpy(p + 2*sizeof(n), key.dptr, key.dsize);
+    memcpy(p + 2*sizeof(n) + key.dsize, val.dptr, val.dsize);
+    w->len += need;
+    w->num_records++;
+    return 0;
+}
+
+static int
+bindump_block_init(struct bindump_block_buf* w, struct bindump_sink* sink)
+{
+    memset(w, 0, sizeof(*w));
+    w->sink = sink;
+    w->cap = MDBM_BINDUMP_BLOCK_SIZE;
+    if ((w->buf = (char*)malloc(w->cap)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+bindump_block_free(struct bindump_block_buf* w)
+{
+    free(w->buf);
+    free(w->cbuf);
+}
+
+static void
+bindump_make_hdr(bindump_hdr_t* hdr, int pgsize, int pgcount, int large, int hash)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->h_magic, BINDUMP_MAGIC, sizeof(hdr->h_magic));
+    hdr->h_version = htonl(BINDUMP_VERSION);
+    hdr->h_flags = htonl(large ? BINDUMP_HFLAG_LARGE : 0);
+    hdr->h_pagesize = htonl(pgsize > 0 ? pgsize : 0);
+    hdr->h_pagecount = htonl(pgcount > 0 ? pgcount : 0);
+    hdr->h_hash = htonl(hash);
+}
+
+mdbm_bindump_writer_t *
+mdbm_bindump_writer_open(FILE *fp, int pgsize, int pgcount, int large, int hash,
+                         int compressionLevel)
+{
+    mdbm_bindump_writer_t* w;
+    bindump_hdr_t hdr;
+
+    if (!fp) {
+        errno = EINVAL;
+        return NULL;
+    }
+    w = new mdbm_bindump_writer_t;
+    bindump_make_hdr(&hdr, pgsize, pgcount, large, hash);
+    if (bindump_block_init(&w->block, &w->sink) < 0) {
+        delete w;
+        return NULL;
+    }
+    if (bindump_sink_open(&w->sink, fp, compressionLevel, &hdr) < 0) {
+        int err = errno;
+        bindump_block_free(&w->block);
+        delete w;
+        errno = err;
+        return NULL;
+    }
+    return w;
+}
+
+int
+mdbm_bindump_writer_add(mdbm_bindump_writer_t *w, kvpair kv)
+{
+    if (!w || !kv.key.dptr || kv.key.dsize <= 0 || kv.val.dsize < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return bindump_add(&w->block, kv.key, kv.val);
+}
+
+int
+mdbm_bindump_writer_close(mdbm_bindump_writer_t *w)
+{
+    int ret = 0;
+    int err = 0;
+
+    if (!w) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bindump_flush(&w->block) < 0) {
+        ret = -1;
+        err = errno;
+    }
+    if (bindump_sink_close(&w->sink) < 0 && !ret) {
+        ret = -1;
+        err = errno;
+    }
+    bindump_block_free(&w->block);
+    delete w;
+    if (ret < 0) {
+        errno = err;
+    }
+    return ret;
+}
+
+// Export state: each mdbm_iterate_parallel() worker fills its own block,
+// found through a thread-specific key.
+struct bindump_export {
+    struct bindump_sink     sink;
+    pthread_key_t           key;
+    std::vector<struct bindump_block_buf*> blocks;  // guarded by sink.mutex
+};
+
+static int
+bindump_export_record(void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+{
+    struct bindump_export* ex = (struct bindump_export*)user;
+    struct bindump_block_buf* w;
+
+    if (info->i_entry.entry_flags & MDBM_ENTRY_DELETED) {
+        return 0;
+    }
+    if ((w = (struct bindump_block_buf*)pthread_getspecific(ex->key)) == NULL) {
+        w = (struct bindump_block_buf*)malloc(sizeof(*w));
+        if (!w || bindump_block_init(w, &ex->sink) < 0) {
+            free(w);
+            goto export_record_error;
+        }
+        pthread_mutex_lock(&ex->sink.mutex);
+        ex->blocks.push_back(w);
+        pthread_mutex_unlock(&ex->sink.mutex);
+        pthread_setspecific(ex->key, w);
+    }
+    if (bindump_add(w, kv->key, kv->val) < 0) {
+        goto export_record_error;
+    }
+    return 0;
+
+ export_record_error:
+    pthread_mutex_lock(&ex->sink.mutex);
+    if (!ex->sink.err) {
+        ex->sink.err = errno ? errno : EIO;
+    }
+    pthread_mutex_unlock(&ex->sink.mutex);
+    return 1;
+}
+
+int
+mdbm_bindump_export(MDBM *db, FILE *fp, int compressionLevel, int nthreads)
+{
+    struct bindump_export ex;
+    bindump_hdr_t hdr;
+    size_t i;
+    int ret, err = 0;
+
+    if (!db || !fp) {
+        errno = EINVAL;
+        return -1;
+    }
+    bindump_make_hdr(&hdr, mdbm_get_page_size(db),
+                     (int)(mdbm_get_size(db) / mdbm_get_page_size(db)),
+                     MDBM_LOB_ENABLED(db) ? 1 : 0, mdbm_get_hash(db));
+    if (bindump_sink_open(&ex.sink, fp, compressionLevel, &hdr) < 0) {
+        return -1;
+    }
+    if (pthread_key_create(&ex.key, NULL) != 0) {
+        bindump_sink_close(&ex.sink);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ret = mdbm_iterate_parallel(db, nthreads, bindump_export_record, MDBM_ITERATE_ENTRIES, &ex);
+    if (ret < 0) {
+        err = errno;
+    } else if (ret > 0) {
+        err = ex.sink.err;
+    }
+    // The workers are gone: write out what they left behind.
+    for (i = 0; i < ex.blocks.size(); ++i) {
+        if (!err && bindump_flush(ex.blocks[i]) < 0) {
+            err = errno;
+        }
+        bindump_block_free(ex.blocks[i]);
+        free(ex.blocks[i]);
+    }
+    pthread_key_delete(ex.key);
+    if (err) {
+        ex.sink.err = err;
+    }
+    if (bindump_sink_close(&ex.sink) < 0) {
+        mdbm_log(LOG_ERR, "%s: bindump export failed: %s", mdbm_get_filename(db), strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int
+mdbm_bindump_import_header(FILE *fp, int *pgsize, int *pgcount, int *large, int *hash)
+{
+    bindump_hdr_t hdr;
+
+    if (!fp) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+        if (!ferror(fp)) {
+            errno = EINVAL;
+        }
+        return -1;
+    }
+    if (memcmp(hdr.h_magic, BINDUMP_MAGIC, sizeof(hdr.h_magic))
+        || ntohl(hdr.h_version) != BINDUMP_VERSION)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pgsize) {
+        *pgsize = ntohl(hdr.h_pagesize);
+    }
+    if (pgcount) {
+        *pgcount = ntohl(hdr.h_pagecount);
+    }
+    if (large) {
+        *large = (ntohl(hdr.h_flags) & BINDUMP_HFLAG_LARGE) ? 1 : 0;
+    }
+    if (hash) {
+        *hash = (int32_t)ntohl(hdr.h_hash);
+    }
+    return 0;
+}
+
+// Reader state, shared by the threads decoding blocks.
+struct bindump_reader {
+    FILE*                   fp;
+    const char*             name;
+    mdbm_bindump_func_t     func;
+    void*                   user;
+    pthread_mutex_t         mutex;      // guards everything below
+    int                     indexed;    // blocks are taken from the index, with pread()
+    uint64_t                base;       // file offset of the header
+    std::vector<bindump_index_t> index;
+    size_t                  next;       // next block of the index
+    int                     done;       // no more blocks
+    volatile int            stop;       // set on the first error
+    int                     ret;        // first error, or value returned by func
+    int                     err;
+};
+
+struct bindump_read_worker {
+    struct bindump_reader*  r;
+    pthread_t               thread;
+    char*                   stored;     // block as read
+    uint32_t                stored_cap;
+    char*                   raw;        // decompressed block
+    uint32_t                raw_cap;
+};
+
+static void
+bindump_read_error(struct bindump_reader* r, int ret, int err, const char* what)
+{
+    pthread_mutex_lock(&r->mutex);
+    if (!r->ret) {
+        r->ret = ret;
+        r->err = err;
+        if (what) {
+            fprintf(stderr, "%s: %s\n", r->name, what);
+        }
+    }
+    r->stop = 1;
+    pthread_mutex_unlock(&r->mutex);
+}
+
+static int
+bindump_pread(int fd, void* buf, size_t len, off_t off)
+{
+    char* p = (char*)buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (!n) {
+            errno = EINVAL;     // truncated
+            return -1;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int
+bindump_reserve(char** buf, uint32_t* cap, uint32_t len)
+{
+    if (*cap < len) {
+        char* p = (char*)realloc(*buf, len);
+        if (!p) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *buf = p;
+        *cap = len;
+    }
+    return 0;
+}
+
+// Checks a block header, in host byte order.  Returns 0 if it looks sane.
+static int
+bindump_check_block(const bindump_block_t* b)
+{
+    if (b->b_magic != BINDUMP_BLOCK_MAGIC
+        || b->b_raw_len > BINDUMP_MAX_BLOCK
+        || b->b_stored_len > (uint32_t)mdbm_internal_lz_bound(b->b_raw_len)
+        || (!(b->b_flags & BINDUMP_BLOCK_COMPRESSED) && b->b_stored_len != b->b_raw_len))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void
+bindump_ntoh_block(bindump_block_t* b)
+{
+    b->b_magic = ntohl(b->b_magic);
+    b->b_raw_len = ntohl(b->b_raw_len);
+    b->b_stored_len = ntohl(b->b_stored_len);
+    b->b_num_records = ntohl(b->b_num_records);
+    b->b_crc = ntohl(b->b_crc);
+    b->b_flags = ntohl(b->b_flags);
+}
+
+// Reads the next block into w->stored.  Returns 1, 0 when there are no more
+// blocks, or -1 on error with the reader's error set.
+static int
+bindump_next_block(struct bindump_read_worker* w, bindump_block_t* b)
+{
+    struct bindump_reader* r = w->r;
+    uint64_t off = 0;
+    int ret = 1;
+
+    pthread_mutex_lock(&r->mutex);
+    if (r->done || r->stop) {
+        pthread_mutex_unlock(&r->mutex);
+        return 0;
+    }
+    if (r->indexed) {
+        if (r->next >= r->index.size()) {
+            r->done = 1;
+            pthread_mutex_unlock(&r->mutex);
+            return 0;
+        }
+        off = r->base + bindump_ntoh64(r->index[r->next++].i_offset);
+        pthread_mutex_unlock(&r->mutex);
+        if (bindump_pread(fileno(r->fp), b, sizeof(*b), off) < 0) {
+            goto next_block_error;
+        }
+    } else if (fread(b, sizeof(*b), 1, r->fp) != 1) {
+        if (!ferror(r->fp)) {
+            errno = EINVAL;     // the index is missing
+        }
+        goto next_block_error;
+    }
+
+    bindump_ntoh_block(b);
+    if (!r->indexed && b->b_magic == BINDUMP_INDEX_MAGIC) {
+        r->done = 1;
+        pthread_mutex_unlock(&r->mutex);
+        return 0;
+    }
+    if (bindump_check_block(b) < 0) {
+        errno = EINVAL;
+        goto next_block_error;
+    }
+    if (bindump_reserve(&w->stored, &w->stored_cap, b->b_stored_len) < 0) {
+        goto next_block_error;
+    }
+    if (r->indexed) {
+        if (bindump_pread(fileno(r->fp), w->stored, b->b_stored_len, off + sizeof(*b)) < 0) {
+            goto next_block_error;
+        }
+    } else {
+        if (b->b_stored_len && fread(w->stored, b->b_stored_len, 1, r->fp) != 1) {
+            if (!ferror(r->fp)) {
+                errno = EINVAL;
+            }
+            goto next_block_error;
+        }
+        pthread_mutex_unlock(&r->mutex);
+    }
+    return ret;
+
+ next_block_error:
+    if (!r->indexed) {
+        pthread_mutex_unlock(&r->mutex);
+    }
+    bindump_read_error(r, -1, errno, (errno == EINVAL) ? "truncated or corrupt bindump data"
+                                                       : strerror(errno));
+    return -1;
+}
+
+// Checks and decodes a block, invoking the reader's func for each record.
+static int
+bindump_decode_block(struct bindump_read_worker* w, const bindump_block_t* b)
+{
+    struct bindump_reader* r = w->r;
+    const char* p = w->stored;
+    const char* end;
+    uint32_t n = 0;
+    kvpair kv;
+    int ret;
+
+    if (b->b_flags & BINDUMP_BLOCK_COMPRESSED) {
+        if (bindump_reserve(&w->raw, &w->raw_cap, b->b_raw_len) < 0) {
+            bindump_read_error(r, -1, errno, strerror(errno));
+            return -1;
+        }
+        if (mdbm_internal_lz_decompress((const uint8_t*)w->stored, b->b_stored_len,
+                                        (uint8_t*)w->raw, b->b_raw_len) != (int)b->b_raw_len)
+        {
+            goto decode_error;
+        }
+        p = w->raw;
+    }
+    if ((uint32_t)mdbm_hash_crc32c((const unsigned char*)p, b->b_raw_len) != b->b_crc) {
+        goto decode_error;
+    }
+    end = p + b->b_raw_len;
+    while (p < end) {
+        uint32_t klen, vlen;
+
+        if ((size_t)(end - p) < 2*sizeof(uint32_t)) {
+            goto decode_error;
+        }
+        memcpy(&klen, p, sizeof(klen));
+        memcpy(&vlen, p + sizeof(klen), sizeof(vlen));
+        klen = ntohl(klen);
+        vlen = ntohl(vlen);
+        p += 2*sizeof(uint32_t);
+        if (!klen || klen > (size_t)(end - p) || vlen > (size_t)(end - p) - klen) {
+            goto decode_error;
+        }
+        kv.key.dptr = (char*)p;
+        kv.key.dsize = klen;
+        kv.val.dptr = (char*)p + klen;
+        kv.val.dsize = vlen;
+        p += klen + vlen;
+        if ((ret = r->func(r->user, &kv)) != 0) {
+            bindump_read_error(r, ret, 0, NULL);
+            return -1;
+        }
+        if (r->stop) {
+            return -1;  // another thread failed
+        }
+        n++;
+    }
+    if (n != b->b_num_records) {
+        goto decode_error;
+    }
+    return 0;
+
+ decode_error:
+    bindump_read_error(r, -1, EINVAL, "corrupt bindump block");
+    return -1;
+}
+
+static void*
+bindump_read_worker_run(void* arg)
+{
+    struct bindump_read_worker* w = (struct bindump_read_worker*)arg;
+    bindump_block_t b;
+
+    while (bindump_next_block(w, &b) > 0 && bindump_decode_block(w, &b) == 0) {
+    }
+    return NULL;
+}
+
+// Loads the block index of a regular file.  Returns 0 if blocks can be read
+// through it, or -1 to read them in order instead.
+static int
+bindump_load_index(struct bindump_reader* r)
+{
+    int fd = fileno(r->fp);
+    struct stat st;
+    off_t pos;
+    bindump_footer_t f;
+    bindump_block_t b;
+    uint64_t idx_off;
+    uint32_t nblocks;
+    size_t len;
+
+    if ((pos = ftello(r->fp)) < (off_t)sizeof(bindump_hdr_t)
+        || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+        || st.st_size < (off_t)(pos + sizeof(b) + sizeof(f)))
+    {
+        return -1;
+    }
+    r->base = pos - sizeof(bindump_hdr_t);
+    if (bindump_pread(fd, &f, sizeof(f), st.st_size - sizeof(f)) < 0
+        || ntohl(f.f_magic) != BINDUMP_FOOTER_MAGIC)
+    {
+        return -1;
+    }
+    nblocks = ntohl(f.f_num_blocks);
+    idx_off = r->base + bindump_ntoh64(f.f_index_offset);
+    len = (size_t)nblocks * sizeof(bindump_index_t);
+    if (idx_off + sizeof(b) + len + sizeof(f) != (uint64_t)st.st_size
+        || bindump_pread(fd, &b, sizeof(b), idx_off) < 0)
+    {
+        return -1;
+    }
+    bindump_ntoh_block(&b);
+    if (b.b_magic != BINDUMP_INDEX_MAGIC || b.b_raw_len != len) {
+        return -1;
+    }
+    r->index.resize(nblocks);
+    if (nblocks && (bindump_pread(fd, &r->index[0], len, idx_off + sizeof(b)) < 0
+                    || mdbm_hash_crc32c((const unsigned char*)&r->index[0], len) != b.b_crc))
+    {
+        r->index.clear();
+        return -1;
+    }
+    r->indexed = 1;
+    return 0;
+}
+
+int
+mdbm_bindump_read(FILE *fp, const char *input_file, int nthreads,
+                  mdbm_bindump_func_t func, void *user)
+{
+    struct bindump_reader r;
+    struct bindump_read_worker* workers;
+    int started = 0;
+    int i;
+
+    if (!fp || !func) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nthreads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncpu > 0) ? (int)ncpu : 1;
+    }
+    r.fp = fp;
+    r.name = input_file ? input_file : "input";
+    r.func = func;
+    r.user = user;
+    r.indexed = 0;
+    r.base = 0;
+    r.next = 0;
+    r.done = 0;
+    r.stop = 0;
+    r.ret = 0;
+    r.err = 0;
+    bindump_load_index(&r);
+    pthread_mutex_init(&r.mutex, NULL);
+    if ((workers = (struct bindump_read_worker*)calloc(nthreads, sizeof(*workers))) == NULL) {
+        pthread_mutex_destroy(&r.mutex);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < nthreads; ++i) {
+        workers[i].r = &r;
+    }
+    if (nthreads == 1) {
+        bindump_read_worker_run(&workers[0]);
+    } else {
+        for (i = 0; i < nthreads; ++i) {
+            if (pthread_create(&workers[i].thread, NULL, bindump_read_worker_run, &workers[i])) {
+                bindump_read_error(&r, -1, EAGAIN, "unable to create bindump reader thread");
+                break;
+            }
+            started++;
+        }
+        for (i = 0; i < started; ++i) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    for (i = 0; i < nthreads; ++i) {
+        free(workers[i].stored);
+        free(workers[i].raw);
+    }
+    free(workers);
+    pthread_mutex_destroy(&r.mutex);
+    if (r.indexed && !r.ret) {
+        fseeko(fp, 0, SEEK_END);
+    }
+    if (r.ret < 0) {
+        errno = r.err;
+    }
+    return r.ret;
+}
+
+// Import state: each reader thread stores through its own handle, found
+// through a thread-specific key.
+struct bindump_import {
+    MDBM*                   db;
+    int                     store_flag;
+    int                     single;     // store through db itself
+    pthread_key_t           key;
+    pthread_mutex_t         mutex;      // guards handles
+    std::vector<MDBM*>      handles;
+};
+
+static int
+bindump_import_record(void* user, const kvpair* kv)
+{
+    struct bindump_import* im = (struct bindump_import*)user;
+    MDBM* db = im->db;
+
+    if (!im->single && (db = (MDBM*)pthread_getspecific(im->key)) == NULL) {
+        if ((db = mdbm_dup_handle(im->db, 0)) == NULL) {
+            fprintf(stderr, "%s: unable to dup handle, errno=%s\n",
+                    mdbm_get_filename(im->db), strerror(errno));
+            return -3;
+        }
+        pthread_mutex_lock(&im->mutex);
+        im->handles.push_back(db);
+        pthread_mutex_unlock(&im->mutex);
+        pthread_setspecific(im->key, db);
+    }
+    if (lock_and_store(db, kv->key, kv->val, im->store_flag) == -1) {
+        return -3;
+    }
+    return 0;
+}
+
+int
+mdbm_bindump_import(MDBM *db, FILE *fp, const char *input_file, int store_flag, int nthreads)
+{
+    struct bindump_import im;
+    size_t i;
+    int ret, err;
+
+    if (!db || !fp) {
+        errno = EINVAL;
+        return -1;
+    }
+    im.db = db;
+    im.store_flag = store_flag;
+    im.single = (nthreads == 1 || MDBM_NOLOCK(db));
+    if (im.single) {
+        nthreads = 1;
+    } else if (pthread_key_create(&im.key, NULL) != 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_mutex_init(&im.mutex, NULL);
+    ret = mdbm_bindump_read(fp, input_file, nthreads, bindump_import_record, &im);
+    err = errno;
+    for (i = 0; i < im.handles.size(); ++i) {
+        mdbm_close(im.handles[i]);
+    }
+    pthread_mutex_destroy(&im.mutex);
+    if (!im.single) {
+        pthread_key_delete(im.key);
+        // The other handles grew the file and directory: lock once, which
+        // remaps db, so that the caller can use it without locking first
+        // (e.g. to iterate)
+        if (lock_db(db) < 0) {
+            if (ret == 0) {
+                ret = -1;
+                err = errno;
+            }
+        } else {
+            unlock_db(db);
+        }
+    }
+    errno = err;
+    return ret;
+}
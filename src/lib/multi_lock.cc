@@ -167,6 +167,25 @@ inline void delete_tls_entry(MLock* locks) {
 }
 
 
+// Contended lockers spin for a while before sleeping in the kernel, but only
+// if the owner can run meanwhile (more than one cpu), and only for about twice
+// the average hold time of that lock, so long holders aren't spun on.
+static const uint64_t PMUTEX_SPIN_MIN_NSEC = 1000;   // spin on locks without hold times yet
+static const uint64_t PMUTEX_SPIN_MAX_NSEC = 20000;  // bound on spinning (and held time to spin on)
+static const uint32_t PMUTEX_HOLD_SAMPLE = 8;        // time one in this many acquires
+static const bool pmutex_multi_cpu = (sysconf(_SC_NPROCESSORS_ONLN) > 1);
+
+static inline uint64_t pmutex_time_nsec() {
+#ifdef __MACH__
+  return get_time_usec() * 1000;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+#endif
+}
+
+
 
 
 PMutex::PMutex(PMutexRecord* inst, bool init, uint32_t idx) : rec(inst), index(idx), allocated(false) { 
@@ -215,6 +234,14 @@ bool PMutex::Init() {
   int ret=0;
   rec->owner=0;
   rec->count=0;
+  rec->lockStamp=0;
+  rec->holdAvg=0;
+  rec->acquires=0;
+  rec->contended=0;
+  rec->spinAcquires=0;
+  rec->sleeps=0;
+  rec->tryFailures=0;
+  rec->ownerDied=0;
   pthread_mutexattr_t attr;
   if (pthread_mutexattr_init(&attr)) {
     perror("pthread_mutexattr_init ");
@@ -295,6 +322,51 @@ int PMutex::ResetLock() {
 //  return true;
 //}
 
+int PMutex::SpinLock() {
+  uint64_t hold = rec->holdAvg;
+  if (!pmutex_multi_cpu || hold > PMUTEX_SPIN_MAX_NSEC) {
+    return EBUSY;
+  }
+  uint64_t limit = hold ? 2*hold : PMUTEX_SPIN_MIN_NSEC;
+  if (limit > PMUTEX_SPIN_MAX_NSEC) {
+    limit = PMUTEX_SPIN_MAX_NSEC;
+  }
+
+  uint64_t start = pmutex_time_nsec();
+  uint32_t pauses = 1;
+  do {
+    for (uint32_t i=0; i<pauses; ++i) {
+      atomic_pause();
+    }
+    if (pauses < 64) {
+      pauses <<= 1;
+    }
+    // owner is cleared just before the mutex is released; a dead owner is
+    // never cleared, so it's left to the blocking lock to report EOWNERDEAD
+    if (!rec->owner) {
+      int ret = pthread_mutex_trylock(&rec->mutex);
+      if (ret != EBUSY) {
+        return ret;
+      }
+    }
+  } while (pmutex_time_nsec() - start < limit);
+  return EBUSY;
+}
+
+inline void PMutex::Acquired(bool contended, bool spun) {
+  // only the owner writes these, so they needn't be atomic
+  uint64_t acquires = ++rec->acquires;
+  if (contended) {
+    ++rec->contended;
+    if (spun) {
+      ++rec->spinAcquires;
+    } else {
+      ++rec->sleeps;
+    }
+  }
+  rec->lockStamp = (acquires % PMUTEX_HOLD_SAMPLE == 1) ? pmutex_time_nsec() : 0;
+}
+
 inline int PMutex::Lock(bool blocking, owner_t tid) {
   AUTO_TSC("PMutex::Lock()");
 //#ifdef TRACE_LOCKS
@@ -307,10 +379,20 @@ inline int PMutex::Lock(bool blocking, owner_t tid) {
   if (tid == rec->owner) {
     ret=0;
   } else {
+    bool contended = false, spun = false;
     if (blocking) {
       //AUTO_TSC("pth_lock()");
 //fprintf(stderr, "lock mutex %p\n", &rec->mutex);
-      ret = pthread_mutex_lock(&rec->mutex);
+      ret = pthread_mutex_trylock(&rec->mutex);
+      if (unlikely(ret == EBUSY)) {
+        contended = true;
+        ret = SpinLock();
+        if (ret == EBUSY) {
+          ret = pthread_mutex_lock(&rec->mutex);
+        } else {
+          spun = true;
+        }
+      }
     } else {
       //AUTO_TSC("pth_trylock()");
 //fprintf(stderr, "trylock mutex %p\n", &rec->mutex);
@@ -319,6 +401,7 @@ inline int PMutex::Lock(bool blocking, owner_t tid) {
 //fprintf(stderr, "did (try)lock mutex %p\n", &rec->mutex);
     if (likely(!ret)) {
       rec->owner = tid;
+      Acquired(contended, spun);
 #ifdef HAVE_ROBUST_PTHREADS
     } else if (ret == EOWNERDEAD) {
 //fprintf(stderr, "OWNERDEAD lock mutex %p\n", &rec->mutex);
@@ -329,8 +412,12 @@ inline int PMutex::Lock(bool blocking, owner_t tid) {
       // clean up our book-keeping
       rec->owner = tid;
       rec->count = 0;
+      rec->lockStamp = 0;
+      ++rec->ownerDied;
+      Acquired(contended, spun);
 #endif //HAVE_ROBUST_PTHREADS
     } else if (ret == EBUSY) { // async try failed, already owned
+      atomic_add64u(&rec->tryFailures, 1);
       CHECKPOINTV("  Lock(%s) NOTICE (%d)", blocking?"BLOCK":"ASYNC", ret);
       errno = EWOULDBLOCK; // old mutex system uses this code, despite the documentation
       return ret;
@@ -379,6 +466,13 @@ inline int PMutex::Unlock(owner_t tid) {
   bool released = (1==rec->count);
   atomic_dec32s((int32_t*)&rec->count);
   if (released) { // no-hint, or unlikely
+    if (rec->lockStamp) {
+      // fold a sampled hold time into the average (1/8 weight)
+      int64_t hold = (int64_t)(pmutex_time_nsec() - rec->lockStamp);
+      int64_t avg = (int64_t)rec->holdAvg;
+      rec->holdAvg = avg ? (uint64_t)(avg + (hold - avg) / 8) : (uint64_t)hold;
+      rec->lockStamp = 0;
+    }
     rec->owner = 0;
     //AUTO_TSC("pth_unlock()");
     ret = pthread_mutex_unlock(&rec->mutex);
@@ -410,6 +504,16 @@ int PMutex::GetLocalCount() {
   return (rec->owner==get_thread_id()) ? rec->count : 0; 
 }
 bool PMutex::IsValid() { return (rec!=NULL); }
+void PMutex::AddStats(PMutexStats &stats) {
+  uint64_t acquires = rec->acquires;
+  stats.acquires += acquires;
+  stats.contended += rec->contended;
+  stats.spinAcquires += rec->spinAcquires;
+  stats.sleeps += rec->sleeps;
+  stats.tryFailures += rec->tryFailures;
+  stats.ownerDied += rec->ownerDied;
+  stats.holdSum += rec->holdAvg * acquires;
+}
 
 
 PLockFile::PLockFile() : filename(NULL), fd(-1), lockFileSize(0), base(NULL), hdr(NULL), numRegs(0), registers(NULL), numLocks(0), locks(NULL) {
@@ -456,7 +560,13 @@ void PLockFile::Close() {
   }
 }
 
-const unsigned PLOCK_HDR_VERSION = 1;
+// Version 2 pads mutex records to cache lines, and adds hold times and counters
+const unsigned PLOCK_HDR_VERSION = 2;
+
+size_t PLockFile::GetLocksOffset(int regCount) {
+  size_t offset = sizeof(PLockHdr) + regCount*sizeof(int32_t);
+  return (offset + PMUTEX_CACHE_LINE-1) & ~(size_t)(PMUTEX_CACHE_LINE-1);
+}
 
 /* we need an exact mode (not borked by umask) so that multiple users */
 /* can all peacefully share the lock files */
@@ -500,7 +610,7 @@ int PLockFile::Open(const char* fname, int regCount, int lockCount, bool &create
 
   numLocks = 0;
   // calculate size needed
-  lockFileSize = sHeader + regCount*sReg + lockCount*sMutex;
+  lockFileSize = GetLocksOffset(regCount) + lockCount*sMutex;
 
   if (mode>=0) {
     fd = open_no_umask(fname, O_RDWR, mode);
@@ -585,7 +695,9 @@ int PLockFile::Open(const char* fname, int regCount, int lockCount, bool &create
 
   if (!init) {
     if (hdr->version != PLOCK_HDR_VERSION) {
-      mdbm_log(LOG_ERR, "PLockFile: %s header version mis-match %d vs %d\n", fname, hdr->version, PLOCK_HDR_VERSION);
+      mdbm_log(LOG_ERR, "PLockFile: %s header version mis-match %d vs %d "
+          "(lock files left by older versions must be deleted, once nothing uses them)\n",
+          fname, hdr->version, PLOCK_HDR_VERSION);
       Close();
       errno = EBADF;
       return -1;
@@ -648,7 +760,7 @@ int PLockFile::Open(const char* fname, int regCount, int lockCount, bool &create
   }
 
   locks = new PMutex*[lockCount];
-  offset = sHeader+sReg*numRegs;
+  offset = GetLocksOffset(numRegs);
   for (i=0; i<lockCount; ++i) {
     locks[i] = new PMutex((PMutexRecord*)(base+offset), init, i); 
     //fprintf(stderr, "************************ INITIALIZE (%d/%d) ************************\n", i, lockCount);
@@ -702,8 +814,7 @@ int PLockFile::CheckHeader() {
 int PLockFile::Expand(int newLockCount) {
   int sHeader = sizeof(PLockHdr);
   int sMutex = PMutex::GetRecordSize();
-  int sReg = sizeof(int32_t);
-  size_t newFileSize = lockFileSize + (newLockCount-numLocks)*sMutex;
+  size_t newFileSize = GetLocksOffset(numRegs) + newLockCount*sMutex;
   int ret = 0;
   int err = 0;
   int offset;
@@ -787,7 +898,7 @@ int PLockFile::Expand(int newLockCount) {
   for (i=0; i<newLockCount; ++i) {
     newLocks[i] = NULL;
   }
-  offset = sHeader+sReg*numRegs;
+  offset = GetLocksOffset(numRegs);
   for (i=0; i<newLockCount; ++i) {
     // initialize and increment header initialized count
     bool doInit = init && (unsigned)i>=hdr->mutexInitialized;
@@ -1500,6 +1611,13 @@ int MLock::GetLocalPartCount() {
   return total;
 }
 
+void MLock::GetStats(PMutexStats &stats) {
+  memset(&stats, 0, sizeof(stats));
+  for (int i=0; i<locks.numLocks; ++i) {
+    locks.locks[i]->AddStats(stats);
+  }
+}
+
 void MLock::DumpLockState(FILE* file) {
   int local, lock;
   owner_t owner;
@@ -1706,6 +1824,7 @@ public:
   int getHeldCount(int type, bool self, int index);
   int getCount(int type);
   int reset(const char* dbname, int flags);
+  int getStats(mdbm_lock_stats_t* stats);
 #ifdef DYNAMIC_LOCK_EXPANSION
   int expand(int type, int count);
 #endif
@@ -1897,6 +2016,18 @@ int PthrLock::reset(const char* dbname, int flags) {
   //return -1;
   return locks.ResetAllLocks();
 }
+int PthrLock::getStats(mdbm_lock_stats_t* stats) {
+  PMutexStats ps;
+  locks.GetStats(ps);
+  stats->ls_acquires = ps.acquires;
+  stats->ls_contended = ps.contended;
+  stats->ls_spin_acquires = ps.spinAcquires;
+  stats->ls_sleeps = ps.sleeps;
+  stats->ls_try_failures = ps.tryFailures;
+  stats->ls_owner_died = ps.ownerDied;
+  stats->ls_hold_nsec = ps.acquires ? ps.holdSum / ps.acquires : 0;
+  return 0;
+}
 #ifdef DYNAMIC_LOCK_EXPANSION
 int PthrLock::expand(int type, int count) {
 }
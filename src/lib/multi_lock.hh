@@ -31,18 +31,37 @@ typedef uint32_t owner_t;
 #ifdef __cplusplus
 
 
+// Records are padded out to whole cache lines, so that neighbouring
+// (partition) locks never share one. The first line holds what lockers
+// touch; the counters on the second line are only written by the owner.
+#define PMUTEX_CACHE_LINE 64
+
 struct PMutexRecord {
     pthread_mutex_t mutex;
     // TODO verify that pthread_self() is stable as an int
     //  and unique enough across processes to act as a lock owner-id
     volatile owner_t owner;
     volatile int32_t count;
-    // Attempt to pad structure out to cache-line-size 64 bytes (vs original 48).
-    // This seems not to have much effect (vs ramdom timing variations).
-    //int32_t reserved0;
-    //int32_t reserved1;
-    //int32_t reserved2;
-    //int32_t reserved3;
+    volatile uint64_t lockStamp;    // time (nsec) a sampled acquire took the lock
+    volatile uint64_t holdAvg;      // moving average of sampled hold times (nsec)
+    // contention counters
+    uint64_t acquires;              // times the mutex was taken (not nested locks)
+    uint64_t contended;             // blocking acquires that found the mutex held
+    uint64_t spinAcquires;          // ... and got it while spinning
+    uint64_t sleeps;                // ... and blocked in the kernel
+    uint64_t tryFailures;           // non-blocking acquires that failed (atomic)
+    uint64_t ownerDied;             // acquires that recovered from a dead owner
+} __attribute__((aligned(PMUTEX_CACHE_LINE)));
+
+// Summed contention counters of some locks
+struct PMutexStats {
+    uint64_t acquires;
+    uint64_t contended;
+    uint64_t spinAcquires;
+    uint64_t sleeps;
+    uint64_t tryFailures;
+    uint64_t ownerDied;
+    uint64_t holdSum;               // sum of holdAvg * acquires, for a weighted average
 };
 
 class PMutex {
@@ -76,6 +95,14 @@ class PMutex {
     int GetLocalCount();
     // limited check for lock validity, we can't validate the pthread data
     bool IsValid();
+    // adds this lock's contention counters to 'stats'
+    void AddStats(PMutexStats &stats);
+
+  protected:
+    // spin for a mutex that's expected to be released soon, returns EBUSY if it wasn't
+    int SpinLock();
+    // book-keeping for a newly taken mutex
+    void Acquired(bool contended, bool spun);
 
   //private:
   public:
@@ -92,6 +119,7 @@ public:
   volatile uint32_t registerCount;     // register count
   volatile uint32_t mutexCount;        // PMutexRecord count
   volatile uint32_t mutexInitialized;  // How many of the mutexes have been initialized
+  // (version 2) the mutex records start at the first cache line after the registers
 };
 
 class PLockFile {
@@ -99,7 +127,7 @@ class PLockFile {
   /// It contains: 
   ///   The PLockHdr header structure
   ///   an array of (int32_t) registers (zero-initialized)
-  ///   an array of PMutexRecords
+  ///   an array of PMutexRecords, starting on a cache line
 public:
   PLockFile();
   ~PLockFile();
@@ -114,6 +142,8 @@ public:
   int GetNumLocks();
   // Returns the number of atomic integer registers
   int GetNumRegisters();
+  // Returns the offset of the first mutex record in a file with 'regCount' registers
+  static size_t GetLocksOffset(int regCount);
   // Performs a limited check of header validity,
   // if nonzero, the header has changed or is corrupted
   int CheckHeader();
@@ -207,6 +237,8 @@ public:
   int GetPartCount();
   int GetLockedPartCount();
   int GetLocalPartCount();
+  // sums the contention counters of all of the locks
+  void GetStats(PMutexStats &stats);
   void DumpLockState(FILE* file=NULL);
 
 protected:
@@ -0,0 +1,115 @@
+#!/bin/bash
+
+# Checks that mdbm_export_splitter writes the same buckets however it is run:
+# single-threaded or on a pipeline (-n), byte for byte; straight from the MDBM
+# (-m), with the same records, and the records of each key in the same order
+# (pages are handed out to the -m threads in chunks, so the order of records
+# with different keys depends on the threads).  Also checks that records with
+# empty values survive an export, split and import.
+# Run from the top of the tree, after building the library and the tools.
+
+pass=1
+
+function check() {
+  if [ $? -ne 0 ]; then
+    echo "FAILED: $1"
+    pass=0
+  fi
+}
+
+echo "-------------------------- setup ---------------------"
+
+export LD_LIBRARY_PATH=`pwd`/src/lib/object
+export DYLD_LIBRARY_PATH=`pwd`/src/lib/object
+export PATH=`pwd`/src/tools/object:$PATH
+
+dir=`mktemp -d /tmp/splitter-test.XXXXXX`
+split="mdbm_export_splitter --hash-function 5 -b 7"
+threads=8
+
+# Converts each bucket of $1 (imported with options $2) to a cdbdump in $3.
+# The records of a key are stored as duplicates, in the order they were
+# written, into a presized MDBM: a page split could reorder them.
+function bucket_dumps() {
+  mkdir $3
+  for f in $1/*; do
+    rm -f $dir/bucket.mdbm
+    mdbm_import $2 -S 2 -d 32m -i $f $dir/bucket.mdbm && \
+      mdbm_export -c -o $3/`basename $f` $dir/bucket.mdbm || return 1
+  done
+}
+
+# Compares the buckets in cdbdumps $1 and $2: the same records, and the
+# records of each key in the same order.
+function same_buckets() {
+  [ "`ls $1`" = "`ls $2`" ] || return 1
+  for f in `ls $1`; do
+    cmp -s <(sort $1/$f) <(sort $2/$f) || return 1
+    cmp -s <(sort -s -t- -k1,1 $1/$f) <(sort -s -t- -k1,1 $2/$f) || return 1
+  done
+}
+
+# Every tenth record has an empty value, and each "dup" key has 4 records.
+# The source needs more than 64 pages per thread to split with -m -n.
+awk 'BEGIN {
+  for (i = 0; i < 200000; i++) {
+    k = "key" i; v = (i % 10) ? "value" i : "";
+    printf "+%d,%d:%s->%s\n", length(k), length(v), k, v;
+  }
+  for (i = 0; i < 1000; i++) {
+    for (j = 0; j < 4; j++) {
+      k = "dup" i; v = "dupvalue" (j * 3 % 4);
+      printf "+%d,%d:%s->%s\n", length(k), length(v), k, v;
+    }
+  }
+  print "";
+}' > $dir/in.cdb
+mdbm_import -c -S 2 -i $dir/in.cdb $dir/src.mdbm; check "import source"
+[ `mdbm_stat $dir/src.mdbm | awk '/Num pages/ {print $NF}'` -gt $((64 * threads)) ]; check "source too small"
+mdbm_export -c $dir/src.mdbm | sort > $dir/src.sorted; check "export source"
+
+mdbm_export -o $dir/src.dump $dir/src.mdbm; check "export db_dump"
+mdbm_export -c -o $dir/src.cdb $dir/src.mdbm; check "export cdb"
+mdbm_export -b -o $dir/src.bin $dir/src.mdbm; check "export bindump"
+
+# format: name, export splitter option, import option
+for format in "dump::-T" "cdb:-c:-c" "bin:-B:-b -n 1"; do
+  name=${format%%:*}
+  opts=${format#*:}
+  sopt=${opts%%:*}
+  iopt=${opts#*:}
+
+  echo "------------------------ $name ---------------------"
+
+  mkdir $dir/$name-1 $dir/$name-n $dir/$name-m $dir/$name-mn
+  $split $sopt -o $dir/$name-1 $dir/src.$name >/dev/null 2>&1; check "$name split"
+  $split $sopt -n $threads -o $dir/$name-n $dir/src.$name >/dev/null 2>&1; check "$name split -n $threads"
+  $split $sopt -m -o $dir/$name-m $dir/src.mdbm >/dev/null 2>&1; check "$name split -m"
+  $split $sopt -m -n $threads -o $dir/$name-mn $dir/src.mdbm >/dev/null 2>&1; check "$name split -m -n $threads"
+
+  diff -r $dir/$name-1 $dir/$name-n; check "$name -n $threads buckets differ"
+
+  bucket_dumps $dir/$name-1 "$iopt" $dir/$name-1.cdb; check "$name import buckets"
+  bucket_dumps $dir/$name-m "$iopt" $dir/$name-m.cdb; check "$name import -m buckets"
+  bucket_dumps $dir/$name-mn "$iopt" $dir/$name-mn.cdb; check "$name import -m -n $threads buckets"
+  same_buckets $dir/$name-1.cdb $dir/$name-m.cdb; check "$name -m buckets differ"
+  same_buckets $dir/$name-1.cdb $dir/$name-mn.cdb; check "$name -m -n $threads buckets differ"
+
+  for f in $dir/$name-1/*; do
+    mdbm_import $iopt -S 2 -i $f $dir/$name.mdbm; check "$name import $f"
+  done
+  mdbm_export -c $dir/$name.mdbm | sort | cmp -s - $dir/src.sorted; check "$name round trip"
+  [ `mdbm_export -c $dir/$name.mdbm | grep -c -- '->$'` -eq 20000 ]; check "$name empty values"
+done
+
+rm -rf $dir
+
+echo "--------------------------- done ---------------------"
+
+if [ $pass -ne 1 ]; then
+  echo "SOME TESTS FAILED"
+  exit 1
+else
+  echo "ALL TESTS PASSED"
+  exit 0
+fi
@@ -7,8 +7,10 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include <cppunit/extensions/TestFactoryRegistry.h>
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <set>
 #include <string>
 
 #include <sys/time.h>
@@ -31,6 +33,8 @@ class YccmpTest: public CppUnit::TestFixture {
   CPPUNIT_TEST(test_mdbm_pool_verify);
   CPPUNIT_TEST(test_mdbm_pool_pool_valid);
   CPPUNIT_TEST(test_mdbm_pool_pool_invalid);
+  CPPUNIT_TEST(test_mdbm_pool_stats);
+  CPPUNIT_TEST(test_mdbm_pool_stress);
 #endif
 
   CPPUNIT_TEST_SUITE_END();
@@ -45,6 +49,8 @@ protected:
   void test_mdbm_pool_verify();
   void test_mdbm_pool_pool_valid();
   void test_mdbm_pool_pool_invalid();
+  void test_mdbm_pool_stats();
+  void test_mdbm_pool_stress();
 };
 
 const char *mdbm_name= "/tmp/test_handle_pool.mdbm";
@@ -208,5 +214,151 @@ void YccmpTest::test_mdbm_pool_pool_invalid() {
   mdbm_close(main_handle);
 }
 
+void YccmpTest::test_mdbm_pool_stats() {
+
+  MDBM *main_handle = mdbm_open(mdbm_name, MDBM_O_FSYNC, O_RDONLY, 4096, 0);
+  mdbm_pool_stats_t stats;
+
+  mdbm_pool_t *pool = mdbm_pool_create_pool(main_handle, 8);
+  CPPUNIT_ASSERT(pool != NULL);
+
+  // the first acquire takes a handle from the pool, the next ones get
+  // back the handle this thread released
+  MDBM *first = mdbm_pool_acquire_handle(pool);
+  CPPUNIT_ASSERT(first != NULL);
+  CPPUNIT_ASSERT(mdbm_pool_release_handle(pool, first) == 1);
+
+  MDBM *mdbm_handle = mdbm_pool_acquire_handle(pool);
+  CPPUNIT_ASSERT(mdbm_handle == first);
+
+  // a second handle held at the same time is a different one
+  MDBM *second = mdbm_pool_acquire_handle(pool);
+  CPPUNIT_ASSERT(second != NULL);
+  CPPUNIT_ASSERT(second != first);
+
+  CPPUNIT_ASSERT(mdbm_pool_release_handle(pool, second) == 1);
+  CPPUNIT_ASSERT(mdbm_pool_release_handle(pool, mdbm_handle) == 1);
+
+  // releasing a handle that isn't held fails
+  CPPUNIT_ASSERT(mdbm_pool_release_handle(pool, mdbm_handle) == 0);
+  CPPUNIT_ASSERT(mdbm_pool_release_handle(pool, main_handle) == 0);
+
+  CPPUNIT_ASSERT(mdbm_pool_get_stats(pool, &stats) == 1);
+  CPPUNIT_ASSERT_EQUAL(1, (int)stats.hits);
+  CPPUNIT_ASSERT_EQUAL(2, (int)stats.misses);
+  CPPUNIT_ASSERT_EQUAL(0, (int)stats.waits);
+  CPPUNIT_ASSERT_EQUAL(8, (int)stats.size);
+
+  CPPUNIT_ASSERT(mdbm_pool_get_stats(NULL, &stats) == 0);
+  CPPUNIT_ASSERT(mdbm_pool_get_stats(pool, NULL) == 0);
+
+  CPPUNIT_ASSERT(mdbm_pool_destroy_pool(pool) == 1);
+
+  mdbm_close(main_handle);
+}
+
+// Handles currently held by the stress threads, to catch one handed out twice
+struct stress_state {
+  mdbm_pool_t *pool;
+  int iterations;
+  pthread_mutex_t mutex;
+  std::set<MDBM*> held;
+  int failures;
+};
+
+static void *stress_thread(void *arg) {
+  stress_state *state = (stress_state*)arg;
+
+  for (int i = 0; i < state->iterations; ++i) {
+    MDBM *handle = mdbm_pool_acquire_handle(state->pool);
+    bool dup = false;
+
+    pthread_mutex_lock(&state->mutex);
+    if (handle == NULL || !state->held.insert(handle).second) {
+      ++state->failures;
+      dup = true;
+    }
+    pthread_mutex_unlock(&state->mutex);
+    if (handle == NULL) {
+      continue;
+    }
+    if ((i % 8) == 0) {
+      sched_yield();
+    }
+    if (!dup) {
+      pthread_mutex_lock(&state->mutex);
+      state->held.erase(handle);
+      pthread_mutex_unlock(&state->mutex);
+    }
+    if (mdbm_pool_release_handle(state->pool, handle) != 1) {
+      pthread_mutex_lock(&state->mutex);
+      ++state->failures;
+      pthread_mutex_unlock(&state->mutex);
+    }
+  }
+  return NULL;
+}
+
+void YccmpTest::test_mdbm_pool_stress() {
+
+  const int pool_size = 4;
+  const int threads = 16;
+  MDBM *main_handle = mdbm_open(mdbm_name, MDBM_O_FSYNC, O_RDONLY, 4096, 0);
+  mdbm_pool_stats_t stats;
+  MDBM *taken[pool_size];
+  pthread_t tids[threads];
+  stress_state state;
+  int i;
+
+  mdbm_pool_t *pool = mdbm_pool_create_pool(main_handle, pool_size);
+  CPPUNIT_ASSERT(pool != NULL);
+
+  state.pool = pool;
+  state.iterations = 2000;
+  state.failures = 0;
+  pthread_mutex_init(&state.mutex, NULL);
+
+  // hold every handle while the threads start, so they have to wait
+  for (i = 0; i < pool_size; ++i) {
+    CPPUNIT_ASSERT((taken[i] = mdbm_pool_acquire_handle(pool)) != NULL);
+    CPPUNIT_ASSERT(state.held.insert(taken[i]).second);
+  }
+  for (i = 0; i < threads; ++i) {
+    CPPUNIT_ASSERT_EQUAL(0, pthread_create(&tids[i], NULL, stress_thread, &state));
+  }
+  usleep(100000);
+  pthread_mutex_lock(&state.mutex);
+  for (i = 0; i < pool_size; ++i) {
+    state.held.erase(taken[i]);
+  }
+  pthread_mutex_unlock(&state.mutex);
+  for (i = 0; i < pool_size; ++i) {
+    CPPUNIT_ASSERT(mdbm_pool_release_handle(pool, taken[i]) == 1);
+  }
+  for (i = 0; i < threads; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+  pthread_mutex_destroy(&state.mutex);
+
+  CPPUNIT_ASSERT_EQUAL(0, state.failures);
+  CPPUNIT_ASSERT(state.held.empty());
+
+  // every acquire is counted once, as a hit or a miss
+  CPPUNIT_ASSERT(mdbm_pool_get_stats(pool, &stats) == 1);
+  CPPUNIT_ASSERT_EQUAL((uint64_t)(pool_size + threads * state.iterations),
+                       stats.hits + stats.misses);
+  CPPUNIT_ASSERT(stats.waits > 0);
+  CPPUNIT_ASSERT(stats.waits <= (uint64_t)(threads * state.iterations));
+  CPPUNIT_ASSERT_EQUAL((uint32_t)pool_size, stats.size);
+
+  // all the handles are back: an exclusive acquire doesn't block
+  MDBM *excl = mdbm_pool_acquire_excl_handle(pool);
+  CPPUNIT_ASSERT(excl == main_handle);
+  CPPUNIT_ASSERT(mdbm_pool_release_excl_handle(pool, excl) == 1);
+
+  CPPUNIT_ASSERT(mdbm_pool_destroy_pool(pool) == 1);
+  mdbm_close(main_handle);
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(YccmpTest);
 
@@ -68,6 +68,7 @@ public:
     void SaveEmptyDbRestoreToFullDbC7();
     void SaveDbDiffCompressionLevelsRestoreC8();
     void SaveUsingBinaryKeysAndDataThenRestoreC9();
+    void SaveRestoreLargeObjectsMultiPageC10();
 
     // mdbm_dump_all_page
     void DumpAllEmptyDbD1();
@@ -140,6 +141,32 @@ class DataInterchangeV3 : public DataInterchangeBaseTestSuite
     CPPUNIT_TEST(AlternateValidInvalidKeysA9);
     CPPUNIT_TEST(MultiPageDBalternateValidInvalidKeysA10);
 
+    CPPUNIT_TEST(PartialDbSaveToNewB1);
+    CPPUNIT_TEST(PartialDbSaveToNewFileModeReadOnlyB2);
+    CPPUNIT_TEST(PartialDbSaveToNewNoCreateFlagB3);
+    CPPUNIT_TEST(PartialDbSaveToOldMultiPageB4);
+    CPPUNIT_TEST(PartialDbSaveToOldMultiPageNoTruncFlagB5);
+    CPPUNIT_TEST(PartialDbSaveToNewUseDbVersionFlagB6);
+    CPPUNIT_TEST(PartialDbSaveToInvalidPathB7);
+    CPPUNIT_TEST(EmptyDbSaveToNewB8);
+    CPPUNIT_TEST(EmptyDbSaveToNewFileModeReadOnlyB9);
+    CPPUNIT_TEST(EmptyDbSaveToToOldMultiPageB10);
+    CPPUNIT_TEST(FullDbSaveToNewB11);
+    CPPUNIT_TEST(FullDbSaveToNewFileModeMinPermsB12);
+    CPPUNIT_TEST(DbFullDupDataCompareToDbFullUniqueDataB14);
+
+    CPPUNIT_TEST(SaveUsingV3FlagThenRestoreC1);
+    CPPUNIT_TEST(RestoreFromNonExistentFileC2);
+    CPPUNIT_TEST(RestoreFromDBthatWasNot_mdbm_savedC3);
+    CPPUNIT_TEST(SaveWithChmod0001_ThenRestoreC4);
+    CPPUNIT_TEST(OpenDBwithDataRestoreFromDBwithDiffDataC5);
+    CPPUNIT_TEST(SaveThenRestoreUsingSameDbHandleC6);
+    CPPUNIT_TEST(SaveEmptyDbRestoreToFullDbC7);
+    CPPUNIT_TEST(SaveDbDiffCompressionLevelsRestoreC8);
+    CPPUNIT_TEST(SaveUsingBinaryKeysAndDataThenRestoreC9);
+    CPPUNIT_TEST(SaveRestoreLargeObjectsMultiPageC10);
+    CPPUNIT_TEST(SaveLargeDB);
+
     CPPUNIT_TEST(DumpAllPartialFilledDbD2);
     CPPUNIT_TEST(DumpAllSinglePageFilledDbD3);
     CPPUNIT_TEST(DumpAllMultiPageFilledDbD4);
@@ -55,6 +55,7 @@ public:
     void DupReplaceReadOnly();
     void DupReplaceShared();
     void DupReplacePart();
+    void DupDirCache();
     //void V2ToV3Replace();
     //void V2ToV3ReplaceND();
 
@@ -272,6 +273,46 @@ void DupReplaceTestBase::DupReplacePart() {
   DupReplaceInner(MDBM_PARTITIONED_LOCKS);
 }
 
+void DupReplaceTestBase::DupDirCache() {
+  TRACE_TEST_CASE("DupDirCache");
+  const int NUM_KEYS = 200000;
+  char key[64];
+  char val[64];
+  datum kdat, vdat;
+
+  // Pre-split to a 16-bit directory, then overflow some pages so that the
+  // directory is deeper than a single directory cache lookup resolves.
+  MdbmHolder db = EnsureTmpMdbm("dupdircache", MDBM_O_RDWR|MDBM_O_CREAT|MDBM_O_TRUNC|versionFlag,
+                                0644, MDBM_MINPAGE, 0);
+  CPPUNIT_ASSERT_EQUAL(0, mdbm_pre_split(db, 1<<16));
+  MdbmHolder dup = mdbm_dup_handle(db, 0);
+  CPPUNIT_ASSERT(NULL != (MDBM*)dup);
+
+  kdat.dptr = key;
+  vdat.dptr = val;
+  for (int i = 0; i < NUM_KEYS; ++i) {
+    kdat.dsize = sprintf(key, "dk%07d", i);
+    vdat.dsize = sprintf(val, "dv%07d", i);
+    // alternate handles, so each sees directory changes made by the other
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_store((i & 1) ? dup : db, kdat, vdat, MDBM_INSERT));
+  }
+
+  mdbm_db_info_t info;
+  CPPUNIT_ASSERT_EQUAL(0, mdbm_get_db_info(db, &info));
+  CPPUNIT_ASSERT(info.db_dir_max_level > 16);
+
+  MDBM* handles[] = { db, dup };
+  for (int h = 0; h < 2; ++h) {
+    for (int i = 0; i < NUM_KEYS; ++i) {
+      kdat.dsize = sprintf(key, "dk%07d", i);
+      datum found = mdbm_fetch(handles[h], kdat);
+      CPPUNIT_ASSERT(NULL != found.dptr);
+      CPPUNIT_ASSERT_EQUAL(string(val, sprintf(val, "dv%07d", i)), string(found.dptr, found.dsize));
+    }
+  }
+  CPPUNIT_ASSERT_EQUAL(0, mdbm_check(dup, 3, 0));
+}
+
 
 
 struct Synchro {
@@ -313,6 +354,7 @@ class DupReplaceTestV3PLock : public DupReplaceTestBase
     CPPUNIT_TEST(DupReplaceShared);
     CPPUNIT_TEST(DupReplaceReadOnly);
     CPPUNIT_TEST(DupReplacePart);
+    CPPUNIT_TEST(DupDirCache);
     CPPUNIT_TEST_SUITE_END();
 
 public:
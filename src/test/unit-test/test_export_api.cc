@@ -28,6 +28,7 @@
 #include <cppunit/ui/text/TestRunner.h>
 
 #include "mdbm.h"
+#include "mdbm_internal.h"
 #include "TestBase.hh"
 
 // Include mdbm_import and redefine main() and usage() to perform unit tests w/o using fork+exec
@@ -74,6 +75,11 @@ class MdbmUnitTestDump : public CppUnit::TestFixture, public TestBase
     void test_ImportDbDumpHeaderText();
     void test_ImportCdbText();
 
+    void test_BinDumpExportImport();
+    void test_BinDumpWriterTool();
+
+    void test_DbDumpCodec();
+
     void finalCleanup();
 
     // Helper methods
@@ -260,6 +266,232 @@ MdbmUnitTestDump::test_ImportCdbText()
     testImportAPI(prefix, true, false);
 }
 
+void
+MdbmUnitTestDump::test_BinDumpExportImport()
+{
+    string prefix = string("BinDumpExportImport");
+    TRACE_TEST_CASE(__func__)
+
+    const int pageSize1 = 8192;
+    MdbmHolder db1(GetTmpPopulatedMdbm(prefix, MDBM_O_RDWR | versionFlag, 0666, pageSize1, 0));
+    CPPUNIT_ASSERT(NULL != (MDBM *) db1);
+    InsertData(db1, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, DEFAULT_ENTRY_COUNT,
+               true, DEFAULT_ENTRY_COUNT);
+    string datafile = GetTmpName("bindump");
+
+    // Uncompressed and compressed, written and read by several threads
+    for (int level = 0; level <= 3; level += 3) {
+        FILE *fp = fopen(datafile.c_str(), "w");
+        CPPUNIT_ASSERT(NULL != fp);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_bindump_export(db1, fp, level, 3));
+        CPPUNIT_ASSERT_EQUAL(0, fclose(fp));
+
+        fp = fopen(datafile.c_str(), "r");
+        CPPUNIT_ASSERT(NULL != fp);
+        int pageSize = 0, pageCount = 0, large = 0, hash = -1;
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_bindump_import_header(fp, &pageSize, &pageCount, &large, &hash));
+        CPPUNIT_ASSERT_EQUAL(pageSize1, pageSize);
+        CPPUNIT_ASSERT(0 < pageCount);
+        CPPUNIT_ASSERT_EQUAL(mdbm_get_hash(db1), hash);
+
+        MdbmHolder db2(EnsureTmpMdbm(prefix, MDBM_O_RDWR | MDBM_O_CREAT | MDBM_O_TRUNC | versionFlag,
+                                     0666, pageSize, 0));
+        CPPUNIT_ASSERT(NULL != (MDBM *) db2);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_bindump_import(db2, fp, datafile.c_str(), MDBM_REPLACE, 2));
+        fclose(fp);
+        CPPUNIT_ASSERT_EQUAL(mdbm_count_records(db1), mdbm_count_records(db2));
+        findDiffs(db1, db2);
+    }
+
+    // The caller's handle can be iterated right after a threaded import that
+    // grew the db through the importing threads' handles
+    {
+        const int count = 20000;
+        MdbmHolder db4(EnsureTmpMdbm(prefix, MDBM_O_RDWR | MDBM_O_CREAT | MDBM_O_TRUNC | versionFlag,
+                                     0666, 4096, 0));
+        CPPUNIT_ASSERT(NULL != (MDBM *) db4);
+        CPPUNIT_ASSERT_EQUAL(0, InsertData(db4, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count));
+        FILE *fp = fopen(datafile.c_str(), "w");
+        CPPUNIT_ASSERT(NULL != fp);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_bindump_export(db4, fp, 0, 2));
+        CPPUNIT_ASSERT_EQUAL(0, fclose(fp));
+
+        MdbmHolder db5(EnsureTmpMdbm(prefix, MDBM_O_RDWR | MDBM_O_CREAT | MDBM_O_TRUNC | versionFlag,
+                                     0666, 4096, 0));
+        CPPUNIT_ASSERT(NULL != (MDBM *) db5);
+        fp = fopen(datafile.c_str(), "r");
+        CPPUNIT_ASSERT(NULL != fp);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_bindump_import_header(fp, NULL, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_bindump_import(db5, fp, datafile.c_str(), MDBM_REPLACE, 4));
+        fclose(fp);
+        kvpair kv;
+        MDBM_ITER iter;
+        int n = 0;
+        for (kv = mdbm_first_r(db5, &iter); kv.key.dptr != NULL; kv = mdbm_next_r(db5, &iter)) {
+            ++n;
+        }
+        CPPUNIT_ASSERT_EQUAL(count, n);
+        CPPUNIT_ASSERT_EQUAL(0, VerifyData(db5, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count));
+    }
+
+    // A truncated file is rejected
+    CPPUNIT_ASSERT_EQUAL(0, truncate(datafile.c_str(), 200));
+    FILE *fp = fopen(datafile.c_str(), "r");
+    CPPUNIT_ASSERT(NULL != fp);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_bindump_import_header(fp, NULL, NULL, NULL, NULL));
+    MdbmHolder db3(EnsureTmpMdbm(prefix, MDBM_O_RDWR | MDBM_O_CREAT | MDBM_O_TRUNC | versionFlag,
+                                 0666, pageSize1, 0));
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_bindump_import(db3, fp, datafile.c_str(), MDBM_REPLACE, 2));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+    fclose(fp);
+
+    // Neither is another format
+    datafile = writeToFile(db1, false, true);
+    fp = fopen(datafile.c_str(), "r");
+    CPPUNIT_ASSERT(NULL != fp);
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_bindump_import_header(fp, NULL, NULL, NULL, NULL));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+    fclose(fp);
+    unlink(datafile.c_str());
+}
+
+void
+MdbmUnitTestDump::test_BinDumpWriterTool()
+{
+    string prefix = string("BinDumpWriterTool");
+    TRACE_TEST_CASE(__func__)
+
+    string filename;
+    MDBM *db1 = createTextMdbm(prefix, &filename, 300);
+    string datafile = GetTmpName("binwriter");
+
+    FILE *fp = fopen(datafile.c_str(), "w");
+    CPPUNIT_ASSERT(NULL != fp);
+    mdbm_bindump_writer_t *w = mdbm_bindump_writer_open(fp, 0, 0, 0, -1, 1);
+    CPPUNIT_ASSERT(NULL != w);
+    kvpair kv;
+    MDBM_ITER iter;
+    MDBM_ITER_INIT(&iter);
+    for (kv = mdbm_first_r(db1, &iter); kv.key.dptr != NULL; kv = mdbm_next_r(db1, &iter)) {
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_bindump_writer_add(w, kv));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_bindump_writer_close(w));
+    CPPUNIT_ASSERT_EQUAL(0, fclose(fp));
+
+    string outfile = GetTmpName("imp_bin_out");
+    const char* args[] = { "mdbm_import", "-b", "-n", "2", "-i", datafile.c_str(), outfile.c_str(), NULL };
+    reset_getopt();
+    int ret = import_main_wrapper(sizeof(args)/sizeof(args[0])-1, (char**)args);
+    CPPUNIT_ASSERT_EQUAL(0, ret);
+
+    MdbmHolder db2 = mdbm_open(outfile.c_str(), MDBM_O_RDONLY, 0644, 0 , 0);
+    CPPUNIT_ASSERT(NULL != (MDBM *) db2);
+    CPPUNIT_ASSERT_EQUAL(mdbm_count_records(db1), mdbm_count_records(db2));
+    findDiffs(db1, db2);
+
+    mdbm_close(db1);
+    unlink(datafile.c_str());
+}
+
+static string
+escapeDbDump(const string &s)
+{
+    string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        switch (s[i]) {
+        case '\\':  out += "\\\\"; break;
+        case '\0':  out += "\\00"; break;
+        case '\n':  out += "\\0a"; break;
+        case '\r':  out += "\\0d"; break;
+        default:    out += s[i];
+        }
+    }
+    return out + "\n";
+}
+
+static int
+collectRecord(void *user, const kvpair *kv)
+{
+    vector<pair<string, string> > *recs = (vector<pair<string, string> > *) user;
+    recs->push_back(make_pair(string(kv->key.dptr, kv->key.dsize),
+                              string(kv->val.dptr, kv->val.dsize)));
+    return 0;
+}
+
+// Every db_dump codec must write and read back the same bytes as the scalar one, for
+// all byte values, and any length around the vector widths.
+void
+MdbmUnitTestDump::test_DbDumpCodec()
+{
+    string prefix = string("DbDumpCodec");
+    TRACE_TEST_CASE(__func__)
+
+    vector<pair<string, string> > recs;
+    string expect;
+    for (int len = 1; len < 100; ++len) {
+        string key, val;
+        for (int i = 0; i < len; ++i) {
+            key += (char) ((len * 7 + i) & 0xff);
+            val += (char) ((i % 5 == 0) ? "\\\0\n\r"[(len + i) % 4] : 'a' + (i % 26));
+        }
+        recs.push_back(make_pair(key, (len % 10) ? val : string()));
+        expect += escapeDbDump(recs.back().first) + escapeDbDump(recs.back().second);
+    }
+
+    int saved = mdbm_internal_get_dbdump_codec();
+    for (int kind = MDBM_SCAN_SCALAR; kind <= MDBM_SCAN_AVX2; ++kind) {
+        if (mdbm_internal_set_dbdump_codec(kind) < 0) {
+            CPPUNIT_ASSERT_EQUAL(ENOTSUP, errno);
+            continue;
+        }
+        string datafile = GetTmpName(prefix + ToStr(kind));
+        FILE *fp = fopen(datafile.c_str(), "w+");
+        CPPUNIT_ASSERT(fp != NULL);
+        for (size_t i = 0; i < recs.size(); ++i) {
+            kvpair kv;
+            kv.key.dptr = (char *) recs[i].first.data();
+            kv.key.dsize = recs[i].first.size();
+            kv.val.dptr = (char *) recs[i].second.data();
+            kv.val.dsize = recs[i].second.size();
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_dbdump_to_file(kv, fp));
+        }
+        rewind(fp);
+        string written(expect.size() + 1, '\0');
+        CPPUNIT_ASSERT_EQUAL(expect.size(), fread(&written[0], 1, written.size(), fp));
+        written.resize(expect.size());
+        CPPUNIT_ASSERT(expect == written);
+
+        rewind(fp);
+        vector<pair<string, string> > got;
+        uint32_t lineno = 1;
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_dbdump_read(fp, datafile.c_str(), &lineno, collectRecord, &got));
+        CPPUNIT_ASSERT(recs == got);
+        CPPUNIT_ASSERT_EQUAL((uint32_t) recs.size() + 1, lineno);
+        fclose(fp);
+        unlink(datafile.c_str());
+
+        // A '\\' before the newline continues the line, and malformed escapes are errors
+        char cont[] = "ab\\\ncd\nv\\5c\\\\x\n";
+        fp = fmemopen(cont, strlen(cont), "r");
+        got.clear();
+        lineno = 1;
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_dbdump_read(fp, "cont", &lineno, collectRecord, &got));
+        CPPUNIT_ASSERT_EQUAL((size_t) 1, got.size());
+        CPPUNIT_ASSERT_EQUAL(string("abcd"), got[0].first);
+        CPPUNIT_ASSERT_EQUAL(string("v\\\\x"), got[0].second);
+        fclose(fp);
+
+        char bad[] = "key\\4\nval\n";
+        fp = fmemopen(bad, strlen(bad), "r");
+        lineno = 1;
+        CPPUNIT_ASSERT_EQUAL(-2, mdbm_dbdump_read(fp, "bad", &lineno, collectRecord, &got));
+        fclose(fp);
+    }
+    mdbm_internal_set_dbdump_codec(saved);
+}
+
 void
 MdbmUnitTestDump::finalCleanup()
 {
@@ -512,6 +744,11 @@ class MdbmUnitTestDumpV3 : public MdbmUnitTestDump
     CPPUNIT_TEST(test_ImportDbDumpHeaderText);
     CPPUNIT_TEST(test_ImportCdbText);
 
+    CPPUNIT_TEST(test_BinDumpExportImport);
+    CPPUNIT_TEST(test_BinDumpWriterTool);
+
+    CPPUNIT_TEST(test_DbDumpCodec);
+
     CPPUNIT_TEST(finalCleanup);
 
     CPPUNIT_TEST_SUITE_END();
@@ -28,6 +28,7 @@
 #include <cppunit/ui/text/TestRunner.h>
 
 #include "mdbm.h"
+#include "mdbm_internal.h"
 
 //#include "test_common.h"
 #include "TestBase.hh"
@@ -161,6 +162,11 @@ class MdbmFetchUnitTest : public CppUnit::TestFixture, public TestBase
     void test_FetchM3();
     void test_FetchM4();
     void test_FetchM5();
+    void test_FetchM6();
+    void test_FetchM7();
+    void test_FetchM8();
+    void test_FetchM9();
+    void test_FetchM10();
 
     void finalCleanup();
 
@@ -877,6 +883,351 @@ MdbmFetchUnitTest::test_FetchM5()
 }
 
 
+/// Every available entry-table scanner (scalar, SSE2, AVX2) must agree with the scalar
+/// scan, and fetches on a large page with many entries must succeed with each of them.
+void
+MdbmFetchUnitTest::test_FetchM6()
+{
+    TRACE_TEST_CASE(__func__);
+    const int NUM_ENTRIES = 1003;  // not a multiple of the vector width
+    const int NUM_KEYS = 2000;
+    int saved = mdbm_internal_get_entry_scan();
+    vector<mdbm_entry_t> ents(NUM_ENTRIES+1);
+
+    for (int i = 0; i < NUM_ENTRIES; ++i) {
+        ents[i].e_key.key.len = 1 + (i % 7);
+        ents[i].e_key.key.hash = i * 31;
+        ents[i].e_offset = i;
+        ents[i].e_flags = 0;
+    }
+    ents[NUM_ENTRIES].e_key.match = MDBM_TOP_OF_PAGE_MARKER;
+
+    MdbmHolder mdbm(EnsureTmpMdbm("fetchscan", MDBM_O_RDWR|MDBM_O_CREAT|versionFlag,
+                                  0644, 65536, 0));
+    CPPUNIT_ASSERT(NULL != (MDBM*)mdbm);
+    for (int i = 0; i < NUM_KEYS; ++i) {
+        string key = PREFIX + ToStr(i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key.c_str(), key.c_str(), MDBM_INSERT));
+    }
+
+    for (int kind = MDBM_SCAN_SCALAR; kind <= MDBM_SCAN_AVX2; ++kind) {
+        if (mdbm_internal_set_entry_scan(kind) < 0) {
+            CPPUNIT_ASSERT_EQUAL(ENOTSUP, errno);
+            continue;
+        }
+        for (int start = 0; start < 5; ++start) {
+            for (int i = 0; i <= NUM_ENTRIES; i += 37) {
+                uint32_t match = ents[i].e_key.match;
+                int expect = start;
+                while (expect < NUM_ENTRIES && ents[expect].e_key.match != match) {
+                    ++expect;
+                }
+                CPPUNIT_ASSERT_EQUAL(expect,
+                    mdbm_internal_scan_entries(&ents[0], start, NUM_ENTRIES, match));
+            }
+        }
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            string key = PREFIX + ToStr(i);
+            char* val = mdbm_fetch_str(mdbm, key.c_str());
+            CPPUNIT_ASSERT(val != NULL);
+            CPPUNIT_ASSERT_EQUAL(key, string(val));
+        }
+        string missing = string(SIMPLE_KEY_PREFIX) + "missing";
+        CPPUNIT_ASSERT(NULL == mdbm_fetch_str(mdbm, missing.c_str()));
+    }
+    mdbm_internal_set_entry_scan(saved);
+}
+
+/// mdbm_fetch_multi must return the same results as individual fetches, report
+/// misses per key, and grow undersized copy-out buffers, with and without
+/// partitioned locking.
+void
+MdbmFetchUnitTest::test_FetchM7()
+{
+    TRACE_TEST_CASE(__func__);
+    const int NUM_KEYS = 500;
+    const int lockFlags[] = { 0, MDBM_PARTITIONED_LOCKS, MDBM_RW_LOCKS };
+
+    for (size_t f = 0; f < sizeof(lockFlags)/sizeof(lockFlags[0]); ++f) {
+        string prefix = "fetchmulti" + ToStr(f);
+        MdbmHolder mdbm(EnsureTmpMdbm(prefix, MDBM_O_RDWR|MDBM_O_CREAT|versionFlag|lockFlags[f],
+                                      0644, 512, 0));
+        CPPUNIT_ASSERT(NULL != (MDBM*)mdbm);
+        for (int i = 0; i < NUM_KEYS; i += 2) {
+            string key = PREFIX + ToStr(i);
+            string val = key + string(i % 13, 'v');
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key.c_str(), val.c_str(), MDBM_INSERT));
+        }
+
+        vector<string> keyStrs(NUM_KEYS);
+        vector<datum> keys(NUM_KEYS), vals(NUM_KEYS), bufs(NUM_KEYS);
+        vector<int> status(NUM_KEYS, -1);
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            keyStrs[i] = PREFIX + ToStr(i);
+            keys[i].dptr = (char*)keyStrs[i].c_str();
+            keys[i].dsize = keyStrs[i].size() + 1;
+            bufs[i].dsize = 1;
+            bufs[i].dptr = (char*)malloc(bufs[i].dsize);
+        }
+
+        CPPUNIT_ASSERT_EQUAL(NUM_KEYS/2, mdbm_fetch_multi(mdbm, &keys[0], &vals[0], &bufs[0],
+                                                          &status[0], NUM_KEYS, 0));
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            if (i % 2) {
+                CPPUNIT_ASSERT_EQUAL(ENOENT, status[i]);
+                CPPUNIT_ASSERT(NULL == vals[i].dptr);
+                continue;
+            }
+            string expect = keyStrs[i] + string(i % 13, 'v');
+            CPPUNIT_ASSERT_EQUAL(0, status[i]);
+            CPPUNIT_ASSERT_EQUAL(bufs[i].dptr, vals[i].dptr);
+            CPPUNIT_ASSERT(bufs[i].dsize >= vals[i].dsize);
+            CPPUNIT_ASSERT_EQUAL(expect, string(vals[i].dptr));
+        }
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            free(bufs[i].dptr);
+        }
+
+        // Without copy-out buffers, under the caller's lock
+        CPPUNIT_ASSERT_EQUAL(1, mdbm_lock(mdbm));
+        CPPUNIT_ASSERT_EQUAL(NUM_KEYS/2, mdbm_fetch_multi(mdbm, &keys[0], &vals[0], NULL,
+                                                          &status[0], NUM_KEYS, 0));
+        for (int i = 0; i < NUM_KEYS; i += 2) {
+            CPPUNIT_ASSERT_EQUAL(0, status[i]);
+            CPPUNIT_ASSERT_EQUAL(keyStrs[i] + string(i % 13, 'v'), string(vals[i].dptr));
+        }
+        CPPUNIT_ASSERT_EQUAL(1, mdbm_unlock(mdbm));
+
+        errno = 0;
+        CPPUNIT_ASSERT_EQUAL(-1, mdbm_fetch_multi(mdbm, &keys[0], &vals[0], NULL,
+                                                  &status[0], NUM_KEYS, 1));
+        CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_fetch_multi(mdbm, &keys[0], &vals[0], NULL, &status[0], 0, 0));
+    }
+}
+
+
+/// The lookup filter must never hide a stored key, through page splits, directory
+/// growth and deletes, and should reject most lookups of missing keys.
+void
+MdbmFetchUnitTest::test_FetchM8()
+{
+    TRACE_TEST_CASE(__func__);
+    const int NUM_KEYS = 4000;
+    string fname;
+
+    {
+        MdbmHolder mdbm(EnsureTmpMdbm("fetchfilter", MDBM_O_RDWR|MDBM_O_CREAT|versionFlag,
+                                      0644, 512, 0, &fname));
+        CPPUNIT_ASSERT(NULL != (MDBM*)mdbm);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_enable_stat_operations(mdbm, MDBM_STATS_BASIC));
+
+        // Enable on a populated db, then keep splitting pages and growing the directory.
+        for (int i = 0; i < NUM_KEYS/4; ++i) {
+            string key = PREFIX + ToStr(i);
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key.c_str(), key.c_str(), MDBM_INSERT));
+        }
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_set_lookup_filter(mdbm, 1));
+        for (int i = NUM_KEYS/4; i < NUM_KEYS; ++i) {
+            string key = PREFIX + ToStr(i);
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key.c_str(), key.c_str(), MDBM_INSERT));
+        }
+        for (int i = 0; i < NUM_KEYS; i += 3) {
+            string key = PREFIX + ToStr(i);
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_delete_str(mdbm, key.c_str()));
+        }
+
+        mdbm_reset_stat_operations(mdbm);
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            string key = PREFIX + ToStr(i);
+            char* val = mdbm_fetch_str(mdbm, key.c_str());
+            if (i % 3) {
+                CPPUNIT_ASSERT(NULL != val);
+                CPPUNIT_ASSERT_EQUAL(key, string(val));
+            } else {
+                CPPUNIT_ASSERT(NULL == val);
+            }
+        }
+        for (int i = NUM_KEYS; i < 2*NUM_KEYS; ++i) {
+            string key = PREFIX + ToStr(i);
+            CPPUNIT_ASSERT(NULL == mdbm_fetch_str(mdbm, key.c_str()));
+        }
+
+        mdbm_stats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_get_stats(mdbm, &stats, sizeof(stats)));
+        CPPUNIT_ASSERT(stats.s_filter_rejects > (uint64_t)NUM_KEYS);
+        CPPUNIT_ASSERT(stats.s_filter_rejects + stats.s_filter_false_pos
+                       == (uint64_t)(NUM_KEYS + (NUM_KEYS+2)/3));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 3, 0));
+    }
+
+    // The filter persists, and can be turned off again.
+    MdbmHolder mdbm(mdbm_open(fname.c_str(), MDBM_O_RDWR|versionFlag, 0644, 0, 0));
+    CPPUNIT_ASSERT(NULL != (MDBM*)mdbm);
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 1; i < NUM_KEYS; i += 3) {
+            string key = PREFIX + ToStr(i);
+            char* val = mdbm_fetch_str(mdbm, key.c_str());
+            CPPUNIT_ASSERT(NULL != val);
+            CPPUNIT_ASSERT_EQUAL(key, string(val));
+        }
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_set_lookup_filter(mdbm, 0));
+    }
+}
+
+// Optimistic (lock-free) mdbm_fetch_buf while another process rewrites, deletes and splits
+void
+MdbmFetchUnitTest::test_FetchM9()
+{
+    TRACE_TEST_CASE(__func__);
+    const int NUM_KEYS = 2000;
+    const int lockFlags[] = { 0, MDBM_PARTITIONED_LOCKS, MDBM_RW_LOCKS };
+
+    for (size_t f = 0; f < sizeof(lockFlags)/sizeof(lockFlags[0]); ++f) {
+        int flags = MDBM_O_RDWR | MDBM_O_CREAT | versionFlag | lockFlags[f];
+        string fname;
+        MdbmHolder mdbm(EnsureTmpMdbm("fetchoptread" + ToStr(f), flags, 0644, 512, 0, &fname));
+        CPPUNIT_ASSERT(NULL != (MDBM*)mdbm);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_set_optimistic_reads(mdbm, 1));
+
+        // Each value is one repeated character, so a torn copy is easy to spot.
+        for (int i = 0; i < NUM_KEYS; i += 2) {
+            string key = PREFIX + ToStr(i);
+            string val(8 + i % 50, 'a' + i % 26);
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key.c_str(), val.c_str(), MDBM_INSERT));
+        }
+        datum buf;
+        buf.dptr = (char*)malloc(1);
+        buf.dsize = 1;
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            string key = PREFIX + ToStr(i);
+            datum k = { (char*)key.c_str(), (int)key.size() + 1 };
+            datum v;
+            errno = 0;
+            if (i % 2) {
+                CPPUNIT_ASSERT_EQUAL(-1, mdbm_fetch_buf(mdbm, &k, &v, &buf, 0));
+                CPPUNIT_ASSERT_EQUAL(ENOENT, errno);
+            } else {
+                CPPUNIT_ASSERT_EQUAL(0, mdbm_fetch_buf(mdbm, &k, &v, &buf, 0));
+                CPPUNIT_ASSERT_EQUAL(string(8 + i % 50, 'a' + i % 26), string(v.dptr));
+                CPPUNIT_ASSERT(v.dptr == buf.dptr);
+            }
+        }
+
+        pid_t pid = fork();
+        CPPUNIT_ASSERT(pid >= 0);
+        if (!pid) {
+            MDBM* db = mdbm_open(fname.c_str(), MDBM_O_RDWR | versionFlag | lockFlags[f], 0644, 0, 0);
+            int ret = db ? 0 : 1;
+            for (int pass = 1; db && !ret && pass < 10; ++pass) {
+                for (int i = 0; i < NUM_KEYS; ++i) {
+                    string key = PREFIX + ToStr(i);
+                    string val(8 + (i + pass) % 60, 'a' + (i + pass) % 26);
+                    if ((i + pass) % 5 == 0) {
+                        mdbm_delete_str(db, key.c_str());
+                    } else if (mdbm_store_str(db, key.c_str(), val.c_str(), MDBM_REPLACE) < 0) {
+                        ret = 2;
+                        break;
+                    }
+                }
+            }
+            if (db) {
+                mdbm_close(db);
+            }
+            _exit(ret);
+        }
+
+        int status = 0;
+        while (waitpid(pid, &status, WNOHANG) == 0) {
+            for (int i = 0; i < NUM_KEYS; ++i) {
+                string key = PREFIX + ToStr(i);
+                datum k = { (char*)key.c_str(), (int)key.size() + 1 };
+                datum v;
+                if (mdbm_fetch_buf(mdbm, &k, &v, &buf, 0) == 0) {
+                    CPPUNIT_ASSERT(v.dsize >= 9);
+                    CPPUNIT_ASSERT_EQUAL(string(v.dsize - 1, v.dptr[0]), string(v.dptr));
+                }
+            }
+        }
+        CPPUNIT_ASSERT(WIFEXITED(status));
+        CPPUNIT_ASSERT_EQUAL(0, WEXITSTATUS(status));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 3, 0));
+
+        // Read-only handles can't change the setting.
+        MdbmHolder rdb(mdbm_open(fname.c_str(), MDBM_O_RDONLY | versionFlag | lockFlags[f], 0644, 0, 0));
+        CPPUNIT_ASSERT(NULL != (MDBM*)rdb);
+        errno = 0;
+        CPPUNIT_ASSERT_EQUAL(-1, mdbm_set_optimistic_reads(rdb, 0));
+        CPPUNIT_ASSERT_EQUAL(EPERM, errno);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_set_optimistic_reads(mdbm, 0));
+        free(buf.dptr);
+    }
+}
+
+// Optimistic read counters: locked lookups leave them alone, and counts left
+// by a writer that died in a locked section are dropped on lock recovery
+void
+MdbmFetchUnitTest::test_FetchM10()
+{
+    TRACE_TEST_CASE(__func__);
+    const int lockFlags[] = { 0, MDBM_PARTITIONED_LOCKS };
+
+    for (size_t f = 0; f < sizeof(lockFlags)/sizeof(lockFlags[0]); ++f) {
+        int flags = MDBM_O_RDWR | MDBM_O_CREAT | versionFlag | lockFlags[f];
+        string fname;
+        MdbmHolder mdbm(EnsureTmpMdbm("fetchoptseq" + ToStr(f), flags, 0644, 4096, 0, &fname));
+        CPPUNIT_ASSERT(NULL != (MDBM*)mdbm);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_set_optimistic_reads(mdbm, 1));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, PREFIX, "value", MDBM_REPLACE));
+
+        mdbm_hdr_t* hdr = ((MDBM*)mdbm)->db_hdr;
+        uint32_t seq[MDBM_READ_SEQ_WORDS];
+        memcpy(seq, hdr->h_read_seq, sizeof(seq));
+        datum k = { (char*)PREFIX, (int)strlen(PREFIX) + 1 };
+        datum v;
+        datum buf;
+        buf.dptr = (char*)malloc(1);
+        buf.dsize = 1;
+        for (int i = 0; i < 10; ++i) {
+            int st = -1;
+            CPPUNIT_ASSERT_EQUAL(1, mdbm_fetch_multi(mdbm, &k, &v, &buf, &st, 1, 0));
+            CPPUNIT_ASSERT_EQUAL(0, st);
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_fetch_buf(mdbm, &k, &v, &buf, 0));
+        }
+        CPPUNIT_ASSERT(0 == memcmp(seq, hdr->h_read_seq, sizeof(seq)));
+
+        // A writer dies while holding the lock of the key's partition (or the db)
+        pid_t pid = fork();
+        CPPUNIT_ASSERT(pid >= 0);
+        if (!pid) {
+            MDBM* db = mdbm_open(fname.c_str(), MDBM_O_RDWR | versionFlag | lockFlags[f], 0644, 0, 0);
+            if (!db || mdbm_plock(db, &k, 0) != 1) {
+                _exit(1);
+            }
+            _exit(0);
+        }
+        int status = 0;
+        CPPUNIT_ASSERT_EQUAL(pid, waitpid(pid, &status, 0));
+        CPPUNIT_ASSERT(WIFEXITED(status));
+        CPPUNIT_ASSERT_EQUAL(0, WEXITSTATUS(status));
+        int busy = 0;
+        for (int i = 0; i < MDBM_READ_SEQ_WORDS; ++i) {
+            busy |= hdr->h_read_seq[i] & MDBM_READ_SEQ_BUSY;
+        }
+        CPPUNIT_ASSERT(busy);
+
+        // The locked fallback recovers the lock, and the counts with it
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_fetch_buf(mdbm, &k, &v, &buf, 0));
+        CPPUNIT_ASSERT_EQUAL(string("value"), string(v.dptr));
+        for (int i = 0; i < MDBM_READ_SEQ_WORDS; ++i) {
+            CPPUNIT_ASSERT_EQUAL(0U, hdr->h_read_seq[i] & MDBM_READ_SEQ_BUSY);
+        }
+        CPPUNIT_ASSERT_EQUAL(0U, hdr->h_read_seq_stale);
+        free(buf.dptr);
+    }
+}
+
 void
 MdbmFetchUnitTest::finalCleanup()
 {
@@ -1487,6 +1838,11 @@ class MdbmFetchUnitTestV3 : public MdbmFetchUnitTest
     CPPUNIT_TEST(test_FetchM3);   // Test M3 - V3 only
     CPPUNIT_TEST(test_FetchM4);   // Test M4 - V3 only
     CPPUNIT_TEST(test_FetchM5);   // Test M5 - V3 only
+    CPPUNIT_TEST(test_FetchM6);   // Test M6 - V3 only
+    CPPUNIT_TEST(test_FetchM7);   // Test M7 - V3 only
+    CPPUNIT_TEST(test_FetchM8);   // Test M8 - V3 only
+    CPPUNIT_TEST(test_FetchM9);   // Test M9 - V3 only
+    CPPUNIT_TEST(test_FetchM10);  // Test M10 - V3 only
     CPPUNIT_TEST(finalCleanup);
   CPPUNIT_TEST_SUITE_END();
 
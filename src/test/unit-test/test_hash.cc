@@ -25,6 +25,7 @@
 #include <cppunit/ui/text/TestRunner.h>
 
 //#include "configstoryutil.hh"
+#include "mdbm_internal.h"
 #include "TestBase.hh"
 
 
@@ -61,6 +62,7 @@ public:
         return (versionFlag == MDBM_CREATE_V3) ? MDBM_CONFIG_DEFAULT_HASH : MDBM_HASH_FNV;
     }
     void ExerciseHashFuncs();
+    void KnownHashValues();
 
 protected:
     void createDefaultDB(const string &prefix);
@@ -85,7 +87,7 @@ const char * HashTestBase::_Val = "find me";
 int HashTestBase::_ValidHashSeries[] = {
     MDBM_HASH_CRC32, MDBM_HASH_EJB, MDBM_HASH_PHONG, MDBM_HASH_OZ,
     MDBM_HASH_TOREK, MDBM_HASH_FNV, MDBM_HASH_STL, MDBM_HASH_MD5,
-    MDBM_HASH_SHA_1, MDBM_HASH_JENKINS, MDBM_HASH_HSIEH };
+    MDBM_HASH_SHA_1, MDBM_HASH_JENKINS, MDBM_HASH_HSIEH, MDBM_HASH_XXH64, MDBM_HASH_CRC32C };
 
 int HashTestBase::_setupCnt = 0;
 
@@ -480,7 +482,7 @@ void HashTestBase::ExerciseHashFuncs()
   uint32_t hash;
   datum d;
   char buf[128];
-  for (h = 0; h < MDBM_MAX_HASH; ++h) {
+  for (h = 0; h <= MDBM_MAX_HASH; ++h) {
     for (i=0; i<bucketCount; ++i) {
       bucket[i] = 0;
     }
@@ -502,6 +504,48 @@ void HashTestBase::ExerciseHashFuncs()
 
 }
 
+void HashTestBase::KnownHashValues()
+{
+  // Published check values (xxHash64 folded to 32 bits)
+  struct { int hashId; const char* key; uint32_t expect; } known[] = {
+    { MDBM_HASH_CRC32C, "123456789", 0xE3069283 },
+    { MDBM_HASH_CRC32C, "The quick brown fox jumps over the lazy dog", 0x22620404 },
+    { MDBM_HASH_XXH64,  "", 0xEF46DB37 ^ 0x51D8E999 },
+    { MDBM_HASH_XXH64,  "abc", 0x44BC2CF5 ^ 0xAD770999 },
+  };
+  int hw = (mdbm_internal_set_crc32c_hw(1) == 0);
+  uint32_t hash;
+  datum d;
+
+  for (size_t i = 0; i < sizeof(known)/sizeof(known[0]); ++i) {
+    d.dptr = (char*)known[i].key;
+    d.dsize = strlen(known[i].key);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_get_hash_value(d, known[i].hashId, &hash));
+    CPPUNIT_ASSERT_EQUAL(known[i].expect, hash);
+  }
+
+  // The SSE4.2 and table CRC-32C must agree for every length and alignment
+  if (hw) {
+    char buf[300];
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+      buf[i] = (char)(i * 7 + 3);
+    }
+    for (int off = 0; off < 8; ++off) {
+      for (int len = 0; len < 256; ++len) {
+        uint32_t hwHash, swHash;
+        d.dptr = buf + off;
+        d.dsize = len;
+        mdbm_internal_set_crc32c_hw(1);
+        mdbm_get_hash_value(d, MDBM_HASH_CRC32C, &hwHash);
+        mdbm_internal_set_crc32c_hw(0);
+        mdbm_get_hash_value(d, MDBM_HASH_CRC32C, &swHash);
+        CPPUNIT_ASSERT_EQUAL(swHash, hwHash);
+      }
+    }
+    mdbm_internal_set_crc32c_hw(1);
+  }
+}
+
 void HashTestBase::ErrorCaseSetHash()    // Test Case F-12
 {
     string tcprefix = "TC F-12: ErrorcaseSetHash: ";
@@ -528,6 +572,7 @@ class HashTestV3 : public HashTestBase
     CPPUNIT_TEST(GetKeyhashValInvalidHashFunc);
     CPPUNIT_TEST(ErrorCaseSetHash);
     CPPUNIT_TEST(ExerciseHashFuncs);
+    CPPUNIT_TEST(KnownHashValues);
     CPPUNIT_TEST_SUITE_END();
 
 public:
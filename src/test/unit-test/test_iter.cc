@@ -110,6 +110,10 @@ class MdbmUnitTestIter : public CppUnit::TestFixture, public TestBase
     void test_IterAA4();
     void test_IterAA5();
 
+    void test_IterBB1();
+    void test_IterBB2();
+    void test_IterBB3();
+
     void finalCleanup();
 
     // Helper methods
@@ -124,6 +128,7 @@ class MdbmUnitTestIter : public CppUnit::TestFixture, public TestBase
     string createEmptyMdbm(const string &prefix);
     bool checkMixedData(MDBM *mdbm, NextType nextType, DeleteWhat deleteWhat = DELETE_NONE,
                         int keyCount = KEY_COUNT_DEFAULT);
+    void checkIterateParallel(const string &prefix, int lockFlags);
 
     protected:
 
@@ -502,6 +507,30 @@ MdbmUnitTestIter::test_IterAA5()
     CPPUNIT_ASSERT_EQUAL(true, checkMixedData(mdbm, DO_NEXTKEY_R, DELETE_ALL));
 }
 
+void
+MdbmUnitTestIter::test_IterBB1()
+{
+    string prefix = string("IterBB1") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+    checkIterateParallel(prefix, 0);
+}
+
+void
+MdbmUnitTestIter::test_IterBB2()
+{
+    string prefix = string("IterBB2") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+    checkIterateParallel(prefix, MDBM_PARTITIONED_LOCKS);
+}
+
+void
+MdbmUnitTestIter::test_IterBB3()
+{
+    string prefix = string("IterBB3") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+    checkIterateParallel(prefix, MDBM_RW_LOCKS);
+}
+
 
 void
 MdbmUnitTestIter::finalCleanup()
@@ -756,6 +785,74 @@ MdbmUnitTestIter::checkMixedData(MDBM *mdbm, NextType nextType, DeleteWhat delet
 }
 
 
+struct IterParallelCounts {
+    int entries;
+    int pages;
+    long keySum;
+    int stopAfter;
+};
+
+static int
+countParallelIter(void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+{
+    IterParallelCounts *counts = static_cast<IterParallelCounts *>(user);
+
+    if (kv == NULL) {
+        __sync_fetch_and_add(&counts->pages, 1);
+        return 0;
+    }
+    int n = __sync_add_and_fetch(&counts->entries, 1);
+    __sync_fetch_and_add(&counts->keySum, atol(kv->key.dptr + strlen(KEY_PREFIX)));
+    return (counts->stopAfter && n >= counts->stopAfter) ? 1 : 0;
+}
+
+/// Iterates a db using several threads, and checks that every record is visited
+/// exactly once, that page mode visits pages, and that a callback can stop iteration.
+//
+void
+MdbmUnitTestIter::checkIterateParallel(const string &prefix, int lockFlags)
+{
+    const int keyCount = 5000;
+    MdbmHolder mdbm(EnsureTmpMdbm(prefix, getmdbmFlags() | MDBM_O_CREAT | lockFlags,
+                                  0644, DEFAULT_PAGE_SIZE, 0));
+    CPPUNIT_ASSERT((MDBM *) mdbm != NULL);
+
+    long keySum = 0;
+    for (int i = 0; i < keyCount; ++i) {
+        string key = KEY_PREFIX + ToStr(i);
+        datum ky = { const_cast<char *> (key.c_str()), (int) key.size() + 1 };
+        datum val = { const_cast<char *> (key.c_str()), (int) key.size() + 1 };
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store(mdbm, ky, val, MDBM_REPLACE));
+        keySum += i;
+    }
+
+    IterParallelCounts counts;
+    memset(&counts, 0, sizeof(counts));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_iterate_parallel(mdbm, 4, countParallelIter,
+                                                  MDBM_ITERATE_ENTRIES, &counts));
+    CPPUNIT_ASSERT_EQUAL(keyCount, counts.entries);
+    CPPUNIT_ASSERT_EQUAL(keySum, counts.keySum);
+
+    IterParallelCounts pageCounts;
+    memset(&pageCounts, 0, sizeof(pageCounts));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_iterate(mdbm, -1, countParallelIter, 0, &pageCounts));
+    memset(&counts, 0, sizeof(counts));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_iterate_parallel(mdbm, 0, countParallelIter, 0, &counts));
+    CPPUNIT_ASSERT(counts.pages > 1);
+    CPPUNIT_ASSERT_EQUAL(pageCounts.pages, counts.pages);
+
+    memset(&counts, 0, sizeof(counts));
+    counts.stopAfter = 100;
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_iterate_parallel(mdbm, 4, countParallelIter,
+                                                  MDBM_ITERATE_ENTRIES, &counts));
+    CPPUNIT_ASSERT(counts.entries < keyCount);
+
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_iterate_parallel(mdbm, 4, NULL, 0, NULL));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+}
+
+
 /// MDBM V3 class
 
 class MdbmUnitTestIterV3 : public MdbmUnitTestIter
@@ -804,6 +901,10 @@ class MdbmUnitTestIterV3 : public MdbmUnitTestIter
     CPPUNIT_TEST(test_IterAA4);
     CPPUNIT_TEST(test_IterAA5);
 
+    CPPUNIT_TEST(test_IterBB1);
+    CPPUNIT_TEST(test_IterBB2);
+    CPPUNIT_TEST(test_IterBB3);
+
     CPPUNIT_TEST(finalCleanup);
 
   CPPUNIT_TEST_SUITE_END();
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sched.h>
 
 #include <sys/types.h>
@@ -77,6 +78,14 @@ class MdbmUnitTestOther : public CppUnit::TestFixture, public TestBase
     void initialSetup();
 
     void testCompressTree();
+    void testCompactStep();
+    void testFreeChunkReuse();
+    void testMaintain();
+    void testDirtyTracking();
+    void testJournal();
+    void testChangeRing();
+    void testMerkle();
+    void testBulkBuild();
 
     void test_OtherAF1();
     void test_OtherAF2();
@@ -141,11 +150,15 @@ class MdbmUnitTestOther : public CppUnit::TestFixture, public TestBase
     void testRobustLocksPart();
     void testPLock();
     void testMLock();
+    void testLockStats();
+    void testLockStatsContended();
     void testShmem();
     void test_OneFcopy();
     void test_BlockingFcopy();  // Block during the copy, and redo the fcopy
     void test_ThreeFcopys();
     void test_CorruptPadding();
+    void test_CheckParallel();
+    void test_CheckParallelDirCache();
 
 
     void finalCleanup();
@@ -393,6 +406,655 @@ MdbmUnitTestOther::testCompressTree()
 
 }
 
+void
+MdbmUnitTestOther::testCompactStep()
+{
+    string prefix = string("testCompactStep") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+
+    int lobSize = DEFAULT_PAGE_SIZE*2, lobCount = 5;
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR | MDBM_LARGE_OBJECTS;
+    string fname;
+    MdbmHolder mdbm = EnsureTmpMdbm(prefix, flags, 0644, DEFAULT_PAGE_SIZE, 0, &fname);
+    mdbm_pre_split(mdbm, 260);
+    do_data(mdbm, true);
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, lobSize, lobCount));
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, 2000, true, lobCount));
+    CPPUNIT_ASSERT_EQUAL(0, DeleteData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, 2000, true, lobCount));
+    off_t oldSize = getFileSize(fname);
+
+    // Compact a few pages at a time; the db must stay consistent between steps
+    mdbm_compact_cursor_t cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    int ret, steps = 0;
+    while ((ret = mdbm_compact_step(mdbm, 0, 8, &cursor)) == 1) {
+        ++steps;
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 4, 1));
+        CPPUNIT_ASSERT_EQUAL(0, do_data(mdbm, false));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, ret);
+    CPPUNIT_ASSERT(steps > 1);
+    CPPUNIT_ASSERT_EQUAL((int)MDBM_COMPACT_DONE, cursor.phase);
+    CPPUNIT_ASSERT(cursor.pages_merged > 0);
+    CPPUNIT_ASSERT(getFileSize(fname) < oldSize);
+
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 4, 1));
+    CPPUNIT_ASSERT_EQUAL(0, VerifyData(mdbm, DEFAULT_KEY_SIZE, lobSize, lobCount));
+    CPPUNIT_ASSERT_EQUAL(0, do_data(mdbm, false));
+
+    // Nothing left to do
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_compact_step(mdbm, 0, 0, &cursor));
+}
+
+static int
+storeSizedLob(MDBM* db, int i)
+{
+    char key[32], val[DEFAULT_PAGE_SIZE * 8];
+    datum k, v;
+
+    snprintf(key, sizeof(key), "lob%d", i);
+    memset(val, 'a' + i % 26, sizeof(val));
+    k.dptr = key;
+    k.dsize = strlen(key);
+    v.dptr = val;
+    v.dsize = DEFAULT_PAGE_SIZE * (i % 8) + DEFAULT_PAGE_SIZE / 2;
+    return mdbm_store(db, k, v, MDBM_REPLACE);
+}
+
+static int
+checkSizedLob(MDBM* db, int i, bool present)
+{
+    char key[32];
+    datum k, v;
+
+    snprintf(key, sizeof(key), "lob%d", i);
+    k.dptr = key;
+    k.dsize = strlen(key);
+    v = mdbm_fetch(db, k);
+    if (!present) {
+        return v.dptr ? -1 : 0;
+    }
+    if (!v.dptr || v.dsize != DEFAULT_PAGE_SIZE * (i % 8) + DEFAULT_PAGE_SIZE / 2
+        || v.dptr[0] != 'a' + i % 26 || v.dptr[v.dsize - 1] != 'a' + i % 26) {
+        return -1;
+    }
+    return 0;
+}
+
+void
+MdbmUnitTestOther::testFreeChunkReuse()
+{
+    string prefix = string("testFreeChunkReuse") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+
+    const int lobCount = 64;
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR | MDBM_LARGE_OBJECTS;
+    string fname;
+    MdbmHolder mdbm = EnsureTmpMdbm(prefix, flags, 0644, DEFAULT_PAGE_SIZE, 0, &fname);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_pre_split(mdbm, 64));
+    // A second handle has its own free-list index, which must follow changes made through the first
+    MdbmHolder mdbm2(mdbm_open(fname.c_str(), getmdbmFlags() | MDBM_O_RDWR, 0644, 0, 0));
+    CPPUNIT_ASSERT(NULL != (MDBM*)mdbm2);
+
+    int i;
+    for (i = 0; i < lobCount; ++i) {
+        CPPUNIT_ASSERT_EQUAL(0, storeSizedLob(i % 2 ? mdbm2 : mdbm, i));
+    }
+    for (i = 0; i < lobCount; i += 2) {
+        char key[32];
+        snprintf(key, sizeof(key), "lob%d", i);
+        datum k = { key, (int)strlen(key) };
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_delete(mdbm2, k));
+    }
+    // Check under the lock, so the handle picks up the other one's remap
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_lock(mdbm));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 4, 1));
+    mdbm_unlock(mdbm);
+    off_t oldSize = getFileSize(fname);
+
+    // Freed chunks are reused, in any size, through either handle
+    for (i = 0; i < lobCount; i += 2) {
+        CPPUNIT_ASSERT_EQUAL(0, storeSizedLob(i % 4 ? mdbm2 : mdbm, i));
+    }
+    CPPUNIT_ASSERT_EQUAL(oldSize, getFileSize(fname));
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_lock(mdbm2));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm2, 4, 1));
+    mdbm_unlock(mdbm2);
+    for (i = 0; i < lobCount; ++i) {
+        CPPUNIT_ASSERT_EQUAL(0, checkSizedLob(i % 2 ? mdbm : mdbm2, i, true));
+    }
+
+    // Free everything, then reuse it for differently sized objects
+    for (i = 0; i < lobCount; ++i) {
+        char key[32];
+        snprintf(key, sizeof(key), "lob%d", i);
+        datum k = { key, (int)strlen(key) };
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_delete(i % 3 ? mdbm : mdbm2, k));
+    }
+    for (i = lobCount; i < 2 * lobCount; ++i) {
+        CPPUNIT_ASSERT_EQUAL(0, storeSizedLob(i % 3 ? mdbm2 : mdbm, i));
+    }
+    CPPUNIT_ASSERT_EQUAL(oldSize, getFileSize(fname));
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_lock(mdbm));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 4, 1));
+    mdbm_unlock(mdbm);
+    for (i = 0; i < 2 * lobCount; ++i) {
+        CPPUNIT_ASSERT_EQUAL(0, checkSizedLob(mdbm2, i, i >= lobCount));
+    }
+}
+
+void
+MdbmUnitTestOther::testMaintain()
+{
+    string prefix = string("testMaintain") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+
+    const int pageSize = 4096, count = 20000;
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR;
+    MdbmHolder mdbm = EnsureTmpMdbm(prefix, flags, 0644, pageSize, 0);
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count));
+
+    uint32_t next = 0;
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_maintain(mdbm, 0, 0, &next));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_maintain(mdbm, 50, 0, NULL));
+
+    // A budgeted pass picks up where the last one stopped
+    CPPUNIT_ASSERT(mdbm_maintain(mdbm, 50, 8, &next) >= 0);
+    CPPUNIT_ASSERT_EQUAL(8U, next);
+
+    // Split until no page is short of free space
+    int ret, split = 0;
+    while ((ret = mdbm_maintain(mdbm, 50, 0, &next)) > 0) {
+        split += ret;
+    }
+    CPPUNIT_ASSERT_EQUAL(0, ret);
+    CPPUNIT_ASSERT(split > 0);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 4, 1));
+    CPPUNIT_ASSERT_EQUAL(0, VerifyData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count));
+
+    // Some more stores fit without splitting pages
+    mdbm_ubig_t pages = mdbm_count_pages(mdbm);
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count / 20, true, count));
+    CPPUNIT_ASSERT_EQUAL(pages, mdbm_count_pages(mdbm));
+    CPPUNIT_ASSERT_EQUAL(0, VerifyData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count + count / 20));
+}
+
+void
+MdbmUnitTestOther::testDirtyTracking()
+{
+    string prefix = string("testDirtyTracking") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+
+    const int pageSize = 4096, count = 20000;
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR;
+    string fname;
+    MdbmHolder mdbm = EnsureTmpMdbm(prefix, flags, 0644, pageSize, 0, &fname);
+    uint64_t synced = 0;
+
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_sync_dirty(mdbm, 0, 0, &synced));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_start_flusher(mdbm, 10, 0));
+
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_dirty_tracking(mdbm, 1));
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_sync_dirty(mdbm, 0, 0, &synced));
+    CPPUNIT_ASSERT(synced > 0);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_sync_dirty(mdbm, 0, MDBM_SYNC_DIRTY_WAIT, &synced));
+    CPPUNIT_ASSERT_EQUAL(0ULL, (unsigned long long)synced);
+
+    // Rewriting one record dirties only its page
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, 1, true, 0));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_sync_dirty(mdbm, 0, 0, &synced));
+    CPPUNIT_ASSERT_EQUAL((unsigned long long)pageSize, (unsigned long long)synced);
+
+    // A budgeted sync leaves the rest for later
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count, true, 0));
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_sync_dirty(mdbm, pageSize, 0, &synced));
+    CPPUNIT_ASSERT(synced >= (uint64_t)pageSize);
+
+    // The flusher writes back the rest
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_start_flusher(mdbm, 10, 0));
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_start_flusher(mdbm, 10, 0));
+    CPPUNIT_ASSERT_EQUAL(EBUSY, errno);
+    usleep(200000);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_stop_flusher(mdbm));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_sync_dirty(mdbm, 0, 0, &synced));
+    CPPUNIT_ASSERT_EQUAL(0ULL, (unsigned long long)synced);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_fsync(mdbm));
+
+    // Reopened handles track their changes too
+    MdbmHolder mdbm2 = mdbm_open(fname.c_str(), flags, 0644, 0, 0);
+    CPPUNIT_ASSERT(NULL != (MDBM*)mdbm2);
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm2, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, 1, true, 0));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_sync_dirty(mdbm, 0, 0, &synced));
+    CPPUNIT_ASSERT_EQUAL((unsigned long long)pageSize, (unsigned long long)synced);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 4, 1));
+
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_dirty_tracking(mdbm, 0));
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_sync_dirty(mdbm, 0, 0, &synced));
+}
+
+void
+MdbmUnitTestOther::testJournal()
+{
+    string prefix = string("testJournal") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+
+    const int count = 1000;
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR;
+    string fname;
+    MdbmHolder mdbm = EnsureTmpMdbm(prefix, flags, 0644, 4096, 0, &fname);
+    string jname = fname + ".journal";
+    string snapName = GetTmpName(prefix + "snap");
+    string jsnapName = snapName + ".journal";
+    struct stat st;
+    char key[32], val[32];
+    int i;
+
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_journal_sync(mdbm));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_journal(mdbm, 1));
+    // Pre-split so that the stores below don't split pages, which checkpoints
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_pre_split(mdbm, 256));
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_journal_checkpoint(mdbm));
+    CPPUNIT_ASSERT_EQUAL(0, stat(jname.c_str(), &st));
+    CPPUNIT_ASSERT_EQUAL(4096LL, (long long)st.st_size);
+    CPPUNIT_ASSERT_EQUAL(0, system(("cp " + fname + " " + snapName).c_str()));
+
+    // Changes after the snapshot are only in the journal
+    for (i = 0; i < count; ++i) {
+        snprintf(key, sizeof(key), "jkey%d", i);
+        snprintf(val, sizeof(val), "jval%d", i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key, val, MDBM_REPLACE));
+    }
+    for (i = 0; i < count; i += 2) {
+        snprintf(key, sizeof(key), "jkey%d", i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_delete_str(mdbm, key));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_journal_sync(mdbm));
+    CPPUNIT_ASSERT_EQUAL(0, stat(jname.c_str(), &st));
+    CPPUNIT_ASSERT(st.st_size > 4096);
+    CPPUNIT_ASSERT_EQUAL(0, system(("cp " + jname + " " + jsnapName).c_str()));
+
+    // The last close checkpoints
+    mdbm.Close();
+    CPPUNIT_ASSERT_EQUAL(0, stat(jname.c_str(), &st));
+    CPPUNIT_ASSERT_EQUAL(4096LL, (long long)st.st_size);
+
+    // "Crash": put back the old db with the journal, and reopen to replay it
+    CPPUNIT_ASSERT_EQUAL(0, system(("cp " + snapName + " " + fname).c_str()));
+    CPPUNIT_ASSERT_EQUAL(0, system(("cp " + jsnapName + " " + jname).c_str()));
+    MdbmHolder mdbm2 = mdbm_open(fname.c_str(), flags, 0644, 0, 0);
+    CPPUNIT_ASSERT(NULL != (MDBM*)mdbm2);
+    CPPUNIT_ASSERT_EQUAL(0, stat(jname.c_str(), &st));
+    CPPUNIT_ASSERT_EQUAL(4096LL, (long long)st.st_size);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)(count + count/2), mdbm_count_records(mdbm2));
+    CPPUNIT_ASSERT_EQUAL(0, VerifyData(mdbm2, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count));
+    for (i = 0; i < count; ++i) {
+        datum k, v;
+        snprintf(key, sizeof(key), "jkey%d", i);
+        snprintf(val, sizeof(val), "jval%d", i);
+        k.dptr = key;
+        k.dsize = strlen(key) + 1;
+        v = mdbm_fetch(mdbm2, k);
+        if (i % 2) {
+            CPPUNIT_ASSERT(v.dptr != NULL && !strcmp(v.dptr, val));
+        } else {
+            CPPUNIT_ASSERT(v.dptr == NULL);
+        }
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm2, 4, 1));
+
+    // A restore is replayed too, not just the purge that starts it
+    string saveName = GetTmpName(prefix + "save");
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_save(mdbm2, saveName.c_str(), MDBM_O_CREAT, 0644, 0));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm2, "extra", "extra", MDBM_REPLACE));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_journal_checkpoint(mdbm2));
+    CPPUNIT_ASSERT_EQUAL(0, system(("cp " + fname + " " + snapName).c_str()));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_restore(mdbm2, saveName.c_str()));
+    CPPUNIT_ASSERT_EQUAL(0, system(("cp " + jname + " " + jsnapName).c_str()));
+    mdbm2.Close();
+    CPPUNIT_ASSERT_EQUAL(0, system(("cp " + snapName + " " + fname).c_str()));
+    CPPUNIT_ASSERT_EQUAL(0, system(("cp " + jsnapName + " " + jname).c_str()));
+    MdbmHolder mdbm3 = mdbm_open(fname.c_str(), flags, 0644, 0, 0);
+    CPPUNIT_ASSERT(NULL != (MDBM*)mdbm3);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)(count + count/2), mdbm_count_records(mdbm3));
+    CPPUNIT_ASSERT_EQUAL(0, VerifyData(mdbm3, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, count));
+    CPPUNIT_ASSERT(mdbm_fetch_str(mdbm3, "extra") == NULL);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm3, 4, 1));
+    unlink(saveName.c_str());
+
+    // A store that splits a page checkpoints before it returns
+    char big[1024];
+    mdbm_ubig_t npages = mdbm_count_pages(mdbm3);
+    memset(big, 'b', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    for (i = 0; mdbm_count_pages(mdbm3) == npages; ++i) {
+        CPPUNIT_ASSERT(i < 100000);
+        CPPUNIT_ASSERT_EQUAL(0, stat(jname.c_str(), &st));
+        CPPUNIT_ASSERT(i == 0 || st.st_size > 4096);
+        snprintf(key, sizeof(key), "skey%d", i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm3, key, big, MDBM_REPLACE));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, stat(jname.c_str(), &st));
+    CPPUNIT_ASSERT_EQUAL(4096LL, (long long)st.st_size);
+
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_journal(mdbm3, 0));
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_journal_sync(mdbm3));
+    unlink(snapName.c_str());
+    unlink(jsnapName.c_str());
+}
+
+void
+MdbmUnitTestOther::testChangeRing()
+{
+    string prefix = string("testChangeRing") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+
+    const int count = 100;
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR;
+    string fname;
+    MdbmHolder mdbm = EnsureTmpMdbm(prefix, flags, 0644, 4096, 0, &fname);
+    mdbm_change_ring_t* ring;
+    mdbm_change_t change;
+    uint64_t epoch, seq, epoch2, seq2;
+    char key[32], val[32];
+    int i;
+
+    errno = 0;
+    CPPUNIT_ASSERT(NULL == mdbm_change_ring_open(fname.c_str()));
+    CPPUNIT_ASSERT_EQUAL(ENOENT, errno);
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_set_change_ring(mdbm, 4096));
+
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_change_ring(mdbm, 1024*1024));
+    CPPUNIT_ASSERT((ring = mdbm_change_ring_open(fname.c_str())) != NULL);
+    mdbm_change_ring_position(ring, &epoch, &seq);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_change_ring_next(ring, &change));
+
+    for (i = 0; i < count; ++i) {
+        snprintf(key, sizeof(key), "ckey%d", i);
+        snprintf(val, sizeof(val), "cval%d", i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key, val, MDBM_REPLACE));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_delete_str(mdbm, "ckey0"));
+    mdbm_purge(mdbm);
+
+    for (i = 0; i < count; ++i) {
+        snprintf(key, sizeof(key), "ckey%d", i);
+        snprintf(val, sizeof(val), "cval%d", i);
+        CPPUNIT_ASSERT_EQUAL(1, mdbm_change_ring_next(ring, &change));
+        CPPUNIT_ASSERT_EQUAL(seq + i, change.seq);
+        CPPUNIT_ASSERT_EQUAL(MDBM_CHANGE_STORE, change.op);
+        CPPUNIT_ASSERT_EQUAL(0, strcmp(key, change.key.dptr));
+        CPPUNIT_ASSERT_EQUAL(0, strcmp(val, change.val.dptr));
+    }
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_change_ring_next(ring, &change));
+    CPPUNIT_ASSERT_EQUAL(MDBM_CHANGE_DELETE, change.op);
+    CPPUNIT_ASSERT_EQUAL(0, strcmp("ckey0", change.key.dptr));
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_change_ring_next(ring, &change));
+    CPPUNIT_ASSERT_EQUAL(MDBM_CHANGE_PURGE, change.op);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_change_ring_next(ring, &change));
+
+    // Going back to a saved position
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_change_ring_seek(ring, epoch, seq + count));
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_change_ring_next(ring, &change));
+    CPPUNIT_ASSERT_EQUAL(MDBM_CHANGE_DELETE, change.op);
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_change_ring_seek(ring, epoch, seq + count + 10));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+
+    // A restore is recorded as its purge and every record it loads
+    string saveName = GetTmpName(prefix + "save");
+    while (mdbm_change_ring_next(ring, &change) > 0) {
+    }
+    for (i = 0; i < count; ++i) {
+        snprintf(key, sizeof(key), "rkey%d", i);
+        snprintf(val, sizeof(val), "rval%d", i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key, val, MDBM_REPLACE));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_save(mdbm, saveName.c_str(), MDBM_O_CREAT, 0644, 0));
+    while (mdbm_change_ring_next(ring, &change) > 0) {
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_restore(mdbm, saveName.c_str()));
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_change_ring_next(ring, &change));
+    CPPUNIT_ASSERT_EQUAL(MDBM_CHANGE_PURGE, change.op);
+    for (i = 0; i < count; ++i) {
+        CPPUNIT_ASSERT_EQUAL(1, mdbm_change_ring_next(ring, &change));
+        CPPUNIT_ASSERT_EQUAL(MDBM_CHANGE_INSERT_DUP, change.op);
+        CPPUNIT_ASSERT_EQUAL(0, strncmp("rkey", change.key.dptr, 4));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_change_ring_next(ring, &change));
+    unlink(saveName.c_str());
+
+    // A consumer that falls behind the whole ring must resync
+    memset(val, 'x', sizeof(val) - 1);
+    val[sizeof(val) - 1] = 0;
+    for (i = 0; i < 50000; ++i) {
+        snprintf(key, sizeof(key), "lap%d", i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key, val, MDBM_REPLACE));
+    }
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_change_ring_next(ring, &change));
+    CPPUNIT_ASSERT_EQUAL(ESTALE, errno);
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_change_ring_seek(ring, epoch, seq));
+    CPPUNIT_ASSERT_EQUAL(ESTALE, errno);
+    mdbm_change_ring_close(ring);
+
+    // Disabling it starts a new epoch
+    CPPUNIT_ASSERT((ring = mdbm_change_ring_open(fname.c_str())) != NULL);
+    mdbm_change_ring_position(ring, &epoch, &seq);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_change_ring(mdbm, 0));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, "ckey0", "cval0", MDBM_REPLACE));
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_change_ring_next(ring, &change));
+    CPPUNIT_ASSERT_EQUAL(ESTALE, errno);
+    mdbm_change_ring_close(ring);
+    CPPUNIT_ASSERT((ring = mdbm_change_ring_open(fname.c_str())) != NULL);
+    mdbm_change_ring_position(ring, &epoch2, &seq2);
+    CPPUNIT_ASSERT(epoch2 != epoch);
+    CPPUNIT_ASSERT_EQUAL(seq, seq2);
+    mdbm_change_ring_close(ring);
+    unlink((fname + ".changes").c_str());
+}
+
+static int
+countLeafRecords(void* user, const mdbm_iterate_info_t* info, const kvpair* kv)
+{
+    ++*(int*)user;
+    return 0;
+}
+
+void
+MdbmUnitTestOther::testMerkle()
+{
+    string prefix = string("testMerkle") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+
+    const int count = 2000;
+    const int levels = 10;
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR;
+    string fname, treeName;
+    MdbmHolder mdbm1 = EnsureTmpMdbm(prefix, flags, 0644, 4096, 0);
+    MdbmHolder mdbm2 = EnsureTmpMdbm(prefix, flags, 0644, 16384, 0, &fname);
+    mdbm_merkle_t *tree1, *tree2, *loaded;
+    uint32_t leaves[4];
+    char key[32], val[32];
+    int i, n;
+
+    // Same records, stored in a different order in pages of a different size
+    for (i = 0; i < count; ++i) {
+        snprintf(key, sizeof(key), "mkey%d", i);
+        snprintf(val, sizeof(val), "mval%d", i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm1, key, val, MDBM_REPLACE));
+        snprintf(key, sizeof(key), "mkey%d", count - 1 - i);
+        snprintf(val, sizeof(val), "mval%d", count - 1 - i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm2, key, val, MDBM_REPLACE));
+    }
+    CPPUNIT_ASSERT((tree1 = mdbm_merkle_build(mdbm1, levels, 0)) != NULL);
+    CPPUNIT_ASSERT((tree2 = mdbm_merkle_build(mdbm2, levels, 2)) != NULL);
+    CPPUNIT_ASSERT_EQUAL(levels, mdbm_merkle_levels(tree1));
+    CPPUNIT_ASSERT(mdbm_merkle_root(tree1) == mdbm_merkle_root(tree2));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_merkle_diff(tree1, tree2, NULL, 0));
+    CPPUNIT_ASSERT(mdbm_merkle_level(tree1, levels) != NULL);
+    CPPUNIT_ASSERT(mdbm_merkle_level(tree1, levels + 1) == NULL);
+
+    // Every record is in exactly one leaf
+    n = 0;
+    for (i = 0; i < (1 << levels); ++i) {
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_merkle_iterate_leaf(mdbm2, levels, i, countLeafRecords, 0, &n));
+    }
+    CPPUNIT_ASSERT_EQUAL(count, n);
+
+    // A changed record shows up in a single leaf
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm2, "mkey7", "changed", MDBM_REPLACE));
+    mdbm_merkle_free(tree2);
+    CPPUNIT_ASSERT((tree2 = mdbm_merkle_build(mdbm2, levels, 0)) != NULL);
+    CPPUNIT_ASSERT(mdbm_merkle_root(tree1) != mdbm_merkle_root(tree2));
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_merkle_diff(tree1, tree2, leaves, 4));
+    n = 0;
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_merkle_iterate_leaf(mdbm2, levels, leaves[0], countLeafRecords, 0, &n));
+    CPPUNIT_ASSERT(n >= 1);
+
+    // Saved trees compare like the original
+    treeName = fname + ".merkle";
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_merkle_save(tree2, treeName.c_str()));
+    CPPUNIT_ASSERT((loaded = mdbm_merkle_load(treeName.c_str())) != NULL);
+    CPPUNIT_ASSERT(mdbm_merkle_root(tree2) == mdbm_merkle_root(loaded));
+    CPPUNIT_ASSERT_EQUAL(1, mdbm_merkle_diff(tree1, loaded, NULL, 0));
+    mdbm_merkle_free(loaded);
+    unlink(treeName.c_str());
+
+    mdbm_merkle_free(tree2);
+    CPPUNIT_ASSERT((tree2 = mdbm_merkle_build(mdbm2, levels - 1, 0)) != NULL);
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_merkle_diff(tree1, tree2, NULL, 0));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+    mdbm_merkle_free(tree1);
+    mdbm_merkle_free(tree2);
+}
+
+void
+MdbmUnitTestOther::testBulkBuild()
+{
+    string prefix = string("testBulkBuild") + versionString + ":";
+    TRACE_TEST_CASE(__func__)
+
+    const int count = 5000;
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR;
+    MdbmHolder mdbm1 = EnsureTmpMdbm(prefix, flags, 0644, 4096, 0);
+    MdbmHolder mdbm2 = EnsureTmpMdbm(prefix, flags, 0644, 4096, 0);
+    mdbm_bulk_t *bulk;
+    char key[32], val[32];
+    datum k, v;
+    int i;
+
+    // A small memory limit, so records spill to temporary files
+    CPPUNIT_ASSERT((bulk = mdbm_bulk_open(mdbm1, MDBM_REPLACE, 64*1024, NULL)) != NULL);
+    for (i = 0; i < count + count / 10; ++i) {
+        snprintf(key, sizeof(key), "bkey%d", i % count);
+        snprintf(val, sizeof(val), "%s%d", (i < count) ? "bval" : "new", i % count);
+        k.dptr = key;
+        k.dsize = strlen(key);
+        v.dptr = val;
+        v.dsize = strlen(val);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_bulk_add(bulk, k, v));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_bulk_finish(bulk));
+    CPPUNIT_ASSERT_EQUAL((uint64_t)count, mdbm_count_records(mdbm1));
+    for (i = 0; i < count; i += 7) {
+        snprintf(key, sizeof(key), "bkey%d", i);
+        snprintf(val, sizeof(val), "%s%d", (i < count / 10) ? "new" : "bval", i);
+        k.dptr = key;
+        k.dsize = strlen(key);
+        v = mdbm_fetch(mdbm1, k);
+        CPPUNIT_ASSERT(v.dptr != NULL);
+        CPPUNIT_ASSERT_EQUAL(string(val), string(v.dptr, v.dsize));
+    }
+
+    // Only empty dbs can be built
+    errno = 0;
+    CPPUNIT_ASSERT(mdbm_bulk_open(mdbm1, MDBM_REPLACE, 0, NULL) == NULL);
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+
+    // Duplicates are kept, and records too large for a page are rejected
+    CPPUNIT_ASSERT((bulk = mdbm_bulk_open(mdbm2, MDBM_INSERT_DUP, 0, NULL)) != NULL);
+    k.dptr = key;
+    k.dsize = snprintf(key, sizeof(key), "dupkey");
+    v.dptr = val;
+    v.dsize = snprintf(val, sizeof(val), "dupval");
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_bulk_add(bulk, k, v));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_bulk_add(bulk, k, v));
+    string big(8192, 'x');
+    v.dptr = (char*)big.data();
+    v.dsize = big.size();
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_bulk_add(bulk, k, v));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_bulk_finish(bulk));
+    CPPUNIT_ASSERT_EQUAL((uint64_t)2, mdbm_count_records(mdbm2));
+
+    // An aborted build leaves the db empty
+    MdbmHolder mdbm3 = EnsureTmpMdbm(prefix, flags, 0644, 4096, 0);
+    CPPUNIT_ASSERT((bulk = mdbm_bulk_open(mdbm3, MDBM_INSERT, 0, NULL)) != NULL);
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_bulk_add(bulk, k, k));
+    mdbm_bulk_abort(bulk);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)0, mdbm_count_records(mdbm3));
+
+    // A spilled build splits pages, so it is checkpointed rather than
+    // journaled; it is recorded in the change ring
+    string fname;
+    MdbmHolder mdbm4 = EnsureTmpMdbm(prefix, flags, 0644, 4096, 0, &fname);
+    string jname = fname + ".journal";
+    mdbm_change_ring_t *ring;
+    mdbm_change_t change;
+    int purges = 0, inserts = 0;
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_journal(mdbm4, 1));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_change_ring(mdbm4, 1024*1024));
+    CPPUNIT_ASSERT((ring = mdbm_change_ring_open(fname.c_str())) != NULL);
+    CPPUNIT_ASSERT((bulk = mdbm_bulk_open(mdbm4, MDBM_REPLACE, 64*1024, NULL)) != NULL);
+    for (i = 0; i < count + count / 10; ++i) {
+        snprintf(key, sizeof(key), "bkey%d", i % count);
+        snprintf(val, sizeof(val), "%s%d", (i < count) ? "bval" : "new", i % count);
+        k.dptr = key;
+        k.dsize = strlen(key);
+        v.dptr = val;
+        v.dsize = strlen(val);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_bulk_add(bulk, k, v));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_bulk_finish(bulk));
+    while (mdbm_change_ring_next(ring, &change) > 0) {
+        if (change.op == MDBM_CHANGE_PURGE) {
+            CPPUNIT_ASSERT_EQUAL(0, inserts);
+            ++purges;
+        } else if (change.op == MDBM_CHANGE_INSERT_DUP) {
+            ++inserts;
+        }
+    }
+    mdbm_change_ring_close(ring);
+    CPPUNIT_ASSERT_EQUAL(1, purges);
+    CPPUNIT_ASSERT_EQUAL(count, inserts);
+    struct stat st;
+    CPPUNIT_ASSERT_EQUAL(0, stat(jname.c_str(), &st));
+    CPPUNIT_ASSERT_EQUAL(4096LL, (long long)st.st_size);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)count, mdbm_count_records(mdbm4));
+    k.dptr = key;
+    k.dsize = snprintf(key, sizeof(key), "bkey1");
+    v = mdbm_fetch(mdbm4, k);
+    CPPUNIT_ASSERT(v.dptr != NULL);
+    CPPUNIT_ASSERT_EQUAL(string("new1"), string(v.dptr, v.dsize));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_journal(mdbm4, 0));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_change_ring(mdbm4, 0));
+    unlink((fname + ".changes").c_str());
+}
+
 
 
 
@@ -1264,6 +1926,96 @@ void MdbmUnitTestOther::testMLock() {
     CPPUNIT_ASSERT(NULL != ErrToStr(-1));
 }
 
+void MdbmUnitTestOther::testLockStats() {
+    TRACE_TEST_CASE(__func__)
+
+    // records are padded so neighbouring partitions don't share a cache line
+    CPPUNIT_ASSERT(0 == PMutex::GetRecordSize() % PMUTEX_CACHE_LINE);
+
+    string fname;
+    MdbmHolder mdbm(GetTmpPopulatedMdbm("testLockStats", getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR | MDBM_PARTITIONED_LOCKS, 0644, DEFAULT_PAGE_SIZE, 0, &fname));
+    mdbm_lock_stats_t stats;
+
+    for (int i = 0; i < 10; ++i) {
+      CPPUNIT_ASSERT(1 == mdbm_lock(mdbm));
+      CPPUNIT_ASSERT(1 == mdbm_unlock(mdbm));
+    }
+    CPPUNIT_ASSERT(0 == mdbm_get_lock_stats(mdbm, &stats, sizeof(stats)));
+    CPPUNIT_ASSERT(stats.ls_acquires >= 10);
+    CPPUNIT_ASSERT(stats.ls_contended <= stats.ls_acquires);
+    CPPUNIT_ASSERT(stats.ls_spin_acquires <= stats.ls_contended);
+    CPPUNIT_ASSERT(0 == stats.ls_owner_died);
+
+    CPPUNIT_ASSERT(0 > mdbm_get_lock_stats(mdbm, NULL, sizeof(stats)));
+    CPPUNIT_ASSERT(0 > mdbm_get_lock_stats(NULL, &stats, sizeof(stats)));
+
+    MdbmHolder nolock(mdbm_open(fname.c_str(), MDBM_O_RDONLY | MDBM_OPEN_NOLOCK, 0644, 0, 0));
+    CPPUNIT_ASSERT(NULL != (MDBM*)nolock);
+    errno = 0;
+    CPPUNIT_ASSERT(0 > mdbm_get_lock_stats(nolock, &stats, sizeof(stats)));
+    CPPUNIT_ASSERT(EINVAL == errno);
+}
+
+struct LockHolderArg {
+    MDBM* db;
+    volatile int locked;
+};
+
+// Holds the partition lock of "key" long enough for the other thread to block
+static void*
+holdPartitionLock(void* arg)
+{
+    LockHolderArg* holder = (LockHolderArg*)arg;
+    datum k;
+
+    k.dptr = (char*)"key";
+    k.dsize = 3;
+    if (mdbm_plock(holder->db, &k, 0) != 1) {
+        holder->locked = -1;
+        return NULL;
+    }
+    holder->locked = 1;
+    usleep(50000);
+    mdbm_punlock(holder->db, &k, 0);
+    return NULL;
+}
+
+void MdbmUnitTestOther::testLockStatsContended() {
+    TRACE_TEST_CASE(__func__)
+
+    MdbmHolder mdbm(GetTmpPopulatedMdbm("testLockStatsContended", getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR | MDBM_PARTITIONED_LOCKS, 0644, DEFAULT_PAGE_SIZE, 0));
+    mdbm_lock_stats_t before, after;
+    LockHolderArg holder;
+    pthread_t tid;
+    datum k;
+
+    k.dptr = (char*)"key";
+    k.dsize = 3;
+    holder.db = mdbm_dup_handle(mdbm, 0);
+    holder.locked = 0;
+    CPPUNIT_ASSERT(NULL != holder.db);
+    CPPUNIT_ASSERT(0 == mdbm_get_lock_stats(mdbm, &before, sizeof(before)));
+
+    // the counters live in the lock file, so only their increase is checked
+    CPPUNIT_ASSERT(0 == pthread_create(&tid, NULL, holdPartitionLock, &holder));
+    while (!holder.locked) {
+      usleep(1000);
+    }
+    CPPUNIT_ASSERT(1 == holder.locked);
+    CPPUNIT_ASSERT(1 == mdbm_plock(mdbm, &k, 0));
+    CPPUNIT_ASSERT(1 == mdbm_punlock(mdbm, &k, 0));
+    pthread_join(tid, NULL);
+    mdbm_close(holder.db);
+
+    CPPUNIT_ASSERT(0 == mdbm_get_lock_stats(mdbm, &after, sizeof(after)));
+    CPPUNIT_ASSERT(after.ls_acquires >= before.ls_acquires + 2);
+    CPPUNIT_ASSERT(after.ls_contended >= before.ls_contended + 1);
+    // held for 50ms, so the waiter gave up spinning and slept
+    CPPUNIT_ASSERT(after.ls_sleeps >= before.ls_sleeps + 1);
+    CPPUNIT_ASSERT(after.ls_spin_acquires - before.ls_spin_acquires
+                   <= after.ls_contended - before.ls_contended);
+}
+
 void MdbmUnitTestOther::testShmem() {
   TRACE_TEST_CASE(__func__)
 
@@ -2269,6 +3021,60 @@ MdbmUnitTestOther::test_CorruptPadding()
     mdbm_close(mdbm);  // close will complain but close
 }
 
+void
+MdbmUnitTestOther::test_CheckParallel()
+{
+    string prefix = string("test_CheckParallel");
+    TRACE_TEST_CASE(__func__)
+
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR | MDBM_LARGE_OBJECTS;
+    MdbmHolder mdbm(EnsureTmpMdbm(prefix, flags, 0644, DEFAULT_PAGE_SIZE, 0));
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, 4000));
+    CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_PAGE_SIZE*2, 20, true, 4000));
+
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 4, 0));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check_parallel(mdbm, 4, 0, 1));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check_parallel(mdbm, 4, 0, 4));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check_parallel(mdbm, 4, 0, 0));
+
+    // Scribble on some data pages: threaded checks must find the same errors
+    struct mdbm *dbm = (struct mdbm *) (MDBM *) mdbm;
+    for (unsigned p = 2; p < dbm->db_num_pages; p += 7) {
+        dbm->db_base[(size_t)p * dbm->db_pagesize + 20] ^= 0x5a;
+    }
+    int nerr = mdbm_check(mdbm, 4, 0);
+    CPPUNIT_ASSERT(nerr > 0);
+    CPPUNIT_ASSERT_EQUAL(nerr, mdbm_check_parallel(mdbm, 4, 0, 4));
+    CPPUNIT_ASSERT_EQUAL(nerr, mdbm_check_parallel(mdbm, 4, 1, 4));
+}
+
+void
+MdbmUnitTestOther::test_CheckParallelDirCache()
+{
+    string prefix = string("test_CheckParallelDirCache");
+    TRACE_TEST_CASE(__func__)
+
+    string fname;
+    int flags = getmdbmFlags() | MDBM_O_CREAT | MDBM_O_RDWR;
+    {
+        MdbmHolder mdbm(EnsureTmpMdbm(prefix, flags, 0644, DEFAULT_PAGE_SIZE, 0, &fname));
+        CPPUNIT_ASSERT_EQUAL(0, InsertData(mdbm, DEFAULT_KEY_SIZE, DEFAULT_VAL_SIZE, 20000));
+    }
+
+    // A fresh handle has no directory cache yet: the workers of a threaded
+    // check must not build it (or count misses) through the shared handle.
+    for (int pass = 0; pass < 5; ++pass) {
+        MdbmHolder mdbm(mdbm_open(fname.c_str(), getmdbmFlags() | MDBM_O_RDWR, 0644, 0, 0));
+        struct mdbm *dbm = (struct mdbm *) (MDBM *) mdbm;
+        CPPUNIT_ASSERT(dbm->db_dir_shift > 0);
+        CPPUNIT_ASSERT(NULL == dbm->db_dir_cache);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check_parallel(mdbm, 4, 0, 8));
+        CPPUNIT_ASSERT(NULL != dbm->db_dir_cache);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check_parallel(mdbm, 4, 0, 8));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 4, 0));
+    }
+}
+
 /// MDBM V3 class
 
 class MdbmUnitTestOtherV3 : public MdbmUnitTestOther
@@ -2281,6 +3087,8 @@ class MdbmUnitTestOtherV3 : public MdbmUnitTestOther
     CPPUNIT_TEST(test_BlockingFcopy);
     CPPUNIT_TEST(test_ThreeFcopys);
     CPPUNIT_TEST(test_CorruptPadding);
+    CPPUNIT_TEST(test_CheckParallel);
+    CPPUNIT_TEST(test_CheckParallelDirCache);
 
     CPPUNIT_TEST(test_OtherAF1);
     CPPUNIT_TEST(test_OtherAF2);
@@ -2347,6 +3155,8 @@ class MdbmUnitTestOtherV3 : public MdbmUnitTestOther
 #endif
     CPPUNIT_TEST(testPLock);
     CPPUNIT_TEST(testMLock);
+    CPPUNIT_TEST(testLockStats);
+    CPPUNIT_TEST(testLockStatsContended);
     CPPUNIT_TEST(testShmem);
 
     CPPUNIT_TEST(test_BenchExisting);
@@ -2432,6 +3242,14 @@ class MdbmUnitTestOtherV3PLock : public MdbmUnitTestOther
     CPPUNIT_TEST(initialSetup);
 
     CPPUNIT_TEST(testCompressTree);
+    CPPUNIT_TEST(testCompactStep);
+    CPPUNIT_TEST(testFreeChunkReuse);
+    CPPUNIT_TEST(testMaintain);
+    CPPUNIT_TEST(testDirtyTracking);
+    CPPUNIT_TEST(testJournal);
+    CPPUNIT_TEST(testChangeRing);
+    CPPUNIT_TEST(testMerkle);
+    CPPUNIT_TEST(testBulkBuild);
 
     CPPUNIT_TEST(test_OtherAF1);
     CPPUNIT_TEST(test_OtherAF2);
@@ -178,6 +178,9 @@ class MdbmUnitTestStore : public CppUnit::TestFixture, public TestBase
     void test_StoreT3();   // Test T3
     void test_StoreT4();   // Test T4
     void test_StoreDupesOverflowPage();   // Store too many duplicates
+    void test_StorePageIndex();           // Store/delete/merge with an in-page index
+    void test_StoreFullHash();            // Store/split/merge with stored full hashes
+    void test_StoreMulti();               // Batched stores with per-record results
 
     void test_StoreChurnLob();
     void test_StoreChurnOversize();
@@ -1902,6 +1905,174 @@ MdbmUnitTestStore::test_StoreDupesOverflowPage()
     CPPUNIT_ASSERT(NULL != fetched.dptr);
 }
 
+void
+MdbmUnitTestStore::test_StorePageIndex()
+{
+    const int NUM_KEYS = 20000;
+    int flags = MDBM_O_RDWR | MDBM_O_CREAT | versionFlag;
+    MdbmHolder mdbm(EnsureTmpMdbm("PageIndex", flags, 0644, 64*1024, 0));
+
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_page_index(mdbm, 4096));
+    for (int i = 0; i < NUM_KEYS; ++i) {
+        string key = "k" + ToStr(i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key.c_str(), "v", MDBM_INSERT));
+    }
+    errno = 0;
+    CPPUNIT_ASSERT_EQUAL(-1, mdbm_set_page_index(mdbm, 0));
+    CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+
+    // Deletes leave holes that are reused, shuffled and wrung out by later stores.
+    for (int i = 0; i < NUM_KEYS; i += 3) {
+        string key = "k" + ToStr(i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_delete_str(mdbm, key.c_str()));
+    }
+    for (int i = 1; i < NUM_KEYS; i += 3) {
+        string key = "k" + ToStr(i);
+        CPPUNIT_ASSERT_EQUAL(1, mdbm_store_str(mdbm, key.c_str(), "v", MDBM_INSERT));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key.c_str(), "replaced", MDBM_REPLACE));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 3, 0));
+
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            string key = "k" + ToStr(i);
+            char* val = mdbm_fetch_str(mdbm, key.c_str());
+            if (i % 3 == 0) {
+                CPPUNIT_ASSERT(NULL == val);
+            } else {
+                CPPUNIT_ASSERT(NULL != val);
+                CPPUNIT_ASSERT_EQUAL(string((i % 3 == 1) ? "replaced" : "v"), string(val));
+            }
+        }
+        // Merging pages must carry the index along.
+        mdbm_compress_tree(mdbm);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 3, 0));
+    }
+
+    // Too many entries for the index: the page falls back to scanning.
+    MdbmHolder small(EnsureTmpMdbm("PageIndexSmall", flags, 0644, 4096, 0));
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_set_page_index(small, 16));
+    for (int i = 0; i < 100; ++i) {
+        string key = "k" + ToStr(i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(small, key.c_str(), "v", MDBM_INSERT));
+    }
+    for (int i = 0; i < 100; i += 2) {
+        string key = "k" + ToStr(i);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_delete_str(small, key.c_str()));
+    }
+    for (int i = 0; i < 100; ++i) {
+        string key = "k" + ToStr(i);
+        CPPUNIT_ASSERT((i % 2) ? NULL != mdbm_fetch_str(small, key.c_str())
+                               : NULL == mdbm_fetch_str(small, key.c_str()));
+    }
+    CPPUNIT_ASSERT_EQUAL(0, mdbm_check(small, 3, 0));
+}
+
+void
+MdbmUnitTestStore::test_StoreFullHash()
+{
+    const int NUM_KEYS = 5000;
+    const int aligns[] = { MDBM_ALIGN_8_BITS, MDBM_ALIGN_64_BITS };
+    int flags = MDBM_O_RDWR | MDBM_O_CREAT | versionFlag;
+
+    for (size_t a = 0; a < sizeof(aligns)/sizeof(aligns[0]); ++a) {
+        MdbmHolder mdbm(EnsureTmpMdbm("FullHash" + ToStr(a), flags, 0644, 512, 0));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_set_hash(mdbm, MDBM_HASH_MD5));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_set_alignment(mdbm, aligns[a]));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_set_full_hash(mdbm, 1));
+
+        // Small pages split many times, then deletes and a merge.
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            string key = "key" + ToStr(i);
+            string val = string(i % 7, 'v');
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key.c_str(), val.c_str(), MDBM_INSERT));
+        }
+        errno = 0;
+        CPPUNIT_ASSERT_EQUAL(-1, mdbm_set_full_hash(mdbm, 0));
+        CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 5, 0));
+        for (int i = 0; i < NUM_KEYS; i += 2) {
+            string key = "key" + ToStr(i);
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_delete_str(mdbm, key.c_str()));
+        }
+        mdbm_compress_tree(mdbm);
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 4, 0));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 5, 0));
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            string key = "key" + ToStr(i);
+            char* val = mdbm_fetch_str(mdbm, key.c_str());
+            if (i % 2) {
+                CPPUNIT_ASSERT(NULL != val);
+                CPPUNIT_ASSERT_EQUAL(string(i % 7, 'v'), string(val));
+            } else {
+                CPPUNIT_ASSERT(NULL == val);
+            }
+        }
+    }
+}
+
+
+void
+MdbmUnitTestStore::test_StoreMulti()
+{
+    const int NUM_KEYS = 3000;
+    const int lockFlags[] = { 0, MDBM_PARTITIONED_LOCKS, MDBM_RW_LOCKS };
+
+    for (size_t f = 0; f < sizeof(lockFlags)/sizeof(lockFlags[0]); ++f) {
+        int flags = MDBM_O_RDWR | MDBM_O_CREAT | versionFlag | lockFlags[f];
+        MdbmHolder mdbm(EnsureTmpMdbm("StoreMulti" + ToStr(f), flags, 0644, 512, 0));
+
+        // Every 4th key is already there, and the last record repeats key 1
+        for (int i = 0; i < NUM_KEYS; i += 4) {
+            string key = "key" + ToStr(i);
+            CPPUNIT_ASSERT_EQUAL(0, mdbm_store_str(mdbm, key.c_str(), "old", MDBM_INSERT));
+        }
+        vector<string> keyStrs(NUM_KEYS + 1), valStrs(NUM_KEYS + 1);
+        vector<datum> keys(NUM_KEYS + 1), vals(NUM_KEYS + 1);
+        vector<int> storeFlags(NUM_KEYS + 1, MDBM_INSERT), status(NUM_KEYS + 1, -1);
+        for (int i = 0; i <= NUM_KEYS; ++i) {
+            keyStrs[i] = "key" + ToStr(i < NUM_KEYS ? i : 1);
+            valStrs[i] = string(i % 11, 'v') + ToStr(i);
+            keys[i].dptr = (char*)keyStrs[i].c_str();
+            keys[i].dsize = keyStrs[i].size() + 1;
+            vals[i].dptr = (char*)valStrs[i].c_str();
+            vals[i].dsize = valStrs[i].size() + 1;
+        }
+        storeFlags[NUM_KEYS] = MDBM_REPLACE;
+
+        CPPUNIT_ASSERT_EQUAL(NUM_KEYS - NUM_KEYS/4 + 1,
+                             mdbm_store_multi(mdbm, &keys[0], &vals[0], &storeFlags[0],
+                                              &status[0], NUM_KEYS + 1, 0));
+        for (int i = 0; i < NUM_KEYS; ++i) {
+            char* val = mdbm_fetch_str(mdbm, keyStrs[i].c_str());
+            CPPUNIT_ASSERT(NULL != val);
+            if (i % 4 == 0) {
+                CPPUNIT_ASSERT_EQUAL(EEXIST, status[i]);
+                CPPUNIT_ASSERT_EQUAL(string("old"), string(val));
+            } else if (i != 1) {
+                CPPUNIT_ASSERT_EQUAL(0, status[i]);
+                CPPUNIT_ASSERT_EQUAL(valStrs[i], string(val));
+            }
+        }
+        CPPUNIT_ASSERT_EQUAL(0, status[NUM_KEYS]);
+        CPPUNIT_ASSERT_EQUAL(valStrs[NUM_KEYS], string(mdbm_fetch_str(mdbm, "key1")));
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_check(mdbm, 3, 0));
+
+        // Same flags for every record
+        CPPUNIT_ASSERT_EQUAL(NUM_KEYS/2, mdbm_store_multi(mdbm, &keys[0], &vals[0], NULL,
+                                                          &status[0], NUM_KEYS/2, MDBM_REPLACE));
+        CPPUNIT_ASSERT_EQUAL(valStrs[0], string(mdbm_fetch_str(mdbm, "key0")));
+
+        keys[0].dsize = 0;
+        CPPUNIT_ASSERT_EQUAL(0, mdbm_store_multi(mdbm, &keys[0], &vals[0], NULL,
+                                                 &status[0], 1, MDBM_REPLACE));
+        CPPUNIT_ASSERT_EQUAL(EINVAL, status[0]);
+        errno = 0;
+        CPPUNIT_ASSERT_EQUAL(-1, mdbm_store_multi(mdbm, &keys[0], &vals[0], NULL,
+                                                  NULL, 1, MDBM_REPLACE));
+        CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+    }
+}
 
 
 class MdbmUnitTestStoreV3 : public MdbmUnitTestStore
@@ -1963,6 +2134,9 @@ class MdbmUnitTestStoreV3 : public MdbmUnitTestStore
     CPPUNIT_TEST(test_StoreT3);
     CPPUNIT_TEST(test_StoreT4);
     CPPUNIT_TEST(test_StoreDupesOverflowPage);
+    CPPUNIT_TEST(test_StorePageIndex);
+    CPPUNIT_TEST(test_StoreFullHash);
+    CPPUNIT_TEST(test_StoreMulti);
     CPPUNIT_TEST(finalCleanup);
   CPPUNIT_TEST_SUITE_END();
 
@@ -0,0 +1,177 @@
+/* Copyright 2013 Yahoo! Inc.                                         */
+/* See LICENSE in the root of the distribution for licensing details. */
+
+/* Micro-benchmark of the page entry-table scanners used by find_entry(). */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <string.h>
+
+#include "mdbm.h"
+#include "mdbm_internal.h"
+#include "mdbm_util.h"
+
+
+static double GetFloatTime() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return ((double)now.tv_sec) + ((double)now.tv_usec)/1000000.0;
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "\
+Usage: bench_entry_scan [options]\n\
+Options:\n\
+        -e <count>      Number of entries on the simulated page\n\
+                        (default: derived from each page size)\n\
+        -p <size>       Page size to simulate, may be repeated\n\
+                        (default: sweep 4k, 8k, 16k, 32k and 64k)\n\
+        -s <bytes>      Average key+value size used to derive the entry count\n\
+                        from the page size (default: 48)\n\
+        -r <count>      Number of lookups per scanner (default: 1000000)\n\
+        -m <mode>       Probe mode: hit, miss or both (default: both)\n\
+                        A miss probes for keys absent from the page, scanning\n\
+                        the whole entry table.\n\
+");
+    exit(1);
+}
+
+#define MAX_PAGE_SIZES 16
+
+static const char* scanNames[] = { "scalar", "sse2", "avx2" };
+
+static void
+bench_scan(int pagesize, int nentries, int reps, int doHits, int doMisses)
+{
+    mdbm_entry_t* ep;
+    uint32_t* hits;
+    uint32_t* misses;
+    int i, k;
+
+    /* Fill the table like a page: random match words, plus a top-of-page marker. */
+    ep = (mdbm_entry_t*)calloc(nentries+1,sizeof(mdbm_entry_t));
+    hits = (uint32_t*)malloc(nentries*sizeof(uint32_t));
+    misses = (uint32_t*)malloc(nentries*sizeof(uint32_t));
+    srandom(70194039);
+    for (i = 0; i < nentries; ++i) {
+        mdbm_entry_t probe;
+        ep[i].e_key.key.len = 1 + (random() % 64);
+        ep[i].e_key.key.hash = random();
+        ep[i].e_offset = i;
+        hits[i] = ep[i].e_key.match;
+        /* Stored keys are at most 64 bytes, so longer probes are never found. */
+        probe.e_key.key.len = 65 + (random() % 64);
+        probe.e_key.key.hash = random();
+        misses[i] = probe.e_key.match;
+    }
+    ep[nentries].e_key.match = MDBM_TOP_OF_PAGE_MARKER;
+
+    for (k = MDBM_SCAN_SCALAR; k <= MDBM_SCAN_AVX2; ++k) {
+        int m;
+        if (mdbm_internal_set_entry_scan(k) < 0) {
+            fprintf(stderr, "Scan:%s\t not supported on this cpu\n", scanNames[k]);
+            continue;
+        }
+        for (m = 0; m < 2; ++m) {
+            const uint32_t* keys = m ? misses : hits;
+            double start, end;
+            uint64_t sum = 0;
+            if ((m && !doMisses) || (!m && !doHits)) {
+                continue;
+            }
+            start = GetFloatTime();
+            for (i = 0; i < reps; ++i) {
+                sum += mdbm_internal_scan_entries(ep, 0, nentries, keys[i % nentries]);
+            }
+            end = GetFloatTime();
+            fprintf(stderr, "Scan:%s\t %-4s page %6d elapsed % 7.3f (%7.1f ns/lookup)"
+                " for %d reps of %d entries (check %llu)\n",
+                scanNames[k], m ? "miss" : "hit", pagesize, end-start,
+                (end-start)*1e9/reps, reps, nentries, (unsigned long long)sum);
+        }
+    }
+
+    free(misses);
+    free(hits);
+    free(ep);
+}
+
+int
+main (int argc, char** argv)
+{
+    int nentries = 0;
+    int reps = 1000*1000;
+    int recsize = 48;
+    int pagesizes[MAX_PAGE_SIZES];
+    int npagesizes = 0;
+    int doHits = 1, doMisses = 1;
+    int opt, i;
+    int saved = mdbm_internal_get_entry_scan();
+
+    while ((opt = getopt(argc,argv,"e:m:p:r:s:")) != -1) {
+        switch (opt) {
+        case 'e':
+            nentries = atoi(optarg);
+            if (nentries < 1) {
+                usage();
+            }
+            break;
+        case 'm':
+            if (!strcmp(optarg,"hit")) {
+                doMisses = 0;
+            } else if (!strcmp(optarg,"miss")) {
+                doHits = 0;
+            } else if (strcmp(optarg,"both")) {
+                usage();
+            }
+            break;
+        case 'p':
+            if (npagesizes == MAX_PAGE_SIZES) {
+                usage();
+            }
+            pagesizes[npagesizes++] = mdbm_util_get_size(optarg,1);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 's':
+            recsize = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (reps < 1 || recsize < 0) {
+        usage();
+    }
+    if (!npagesizes) {
+        for (i = 12; i <= 16; ++i) {
+            pagesizes[npagesizes++] = 1<<i;
+        }
+    }
+
+    for (i = 0; i < npagesizes; ++i) {
+        int n = nentries;
+        if (pagesizes[i] < MDBM_MINPAGE || pagesizes[i] > MDBM_MAXPAGE) {
+            fprintf(stderr, "Invalid page size %d\n", pagesizes[i]);
+            usage();
+        }
+        if (!n) {
+            n = (pagesizes[i] - MDBM_PAGE_T_SIZE) / (MDBM_ENTRY_T_SIZE + recsize);
+            if (n < 1) {
+                n = 1;
+            }
+        }
+        bench_scan(pagesizes[i], n, reps, doHits, doMisses);
+    }
+    mdbm_internal_set_entry_scan(saved);
+
+    return 0;
+}
@@ -973,6 +973,8 @@ Options:\n\
                           8  SHA-1\n\
                           9  Jenkins\n\
                          10  SuperFast\n\
+                         11  xxHash64\n\
+                         12  CRC-32C\n\
         -K              Sequential keys (instead of random keys)\n\
         -k <bytes>      Key size (default: 4).\n\
                         Suffix k/m/g may be used to override default of bytes.\n\
@@ -0,0 +1,380 @@
+/* Copyright 2013 Yahoo! Inc.                                         */
+/* See LICENSE in the root of the distribution for licensing details. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/param.h>
+
+#include "mdbm.h"
+
+#define PREFIX "mdbm_changes "
+
+#define STREAM_MAGIC "MDBMCHG1"
+
+/* Change stream record header, followed by the key and the value. */
+typedef struct {
+    uint32_t op;
+    uint32_t ksize;
+    uint32_t vsize;
+} stream_rec_t;
+
+static void
+usage(int exit_code)
+{
+    fprintf(stderr, "\
+Usage: mdbm_changes [options] <mdbm> <replica mdbm>\n\
+       mdbm_changes [options] -o <file> <mdbm>\n\
+       mdbm_changes [options] -i <file> <replica mdbm>\n\
+\n\
+Applies the changes recorded in the change ring of <mdbm> to <replica mdbm>,\n\
+or writes them to a change stream, or applies a change stream.\n\
+\n\
+Options are:\n\
+  -f         Follow: keep waiting for new changes\n\
+  -h         This message\n\
+  -i <file>  Apply the change stream in <file> ('-' for stdin)\n\
+  -L         Open with no locking\n\
+  -o <file>  Write a change stream to <file> ('-' for stdout)\n\
+  -p <file>  Resume from, and save, the position in the change ring\n\
+  -w <msec>  With -f, time between polls of the change ring (default 100)\n\
+\n");
+    exit(exit_code);
+}
+
+static int
+read_position(const char* path, uint64_t* epoch, uint64_t* seq)
+{
+    FILE* fp;
+    int n;
+
+    if ((fp = fopen(path,"r")) == NULL) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    n = fscanf(fp,"%" SCNu64 " %" SCNu64,epoch,seq);
+    fclose(fp);
+    if (n != 2) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 1;
+}
+
+static int
+write_position(const char* path, mdbm_change_ring_t* ring)
+{
+    char tmp[MAXPATHLEN+1];
+    uint64_t epoch, seq;
+    FILE* fp;
+
+    mdbm_change_ring_position(ring,&epoch,&seq);
+    snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    if ((fp = fopen(tmp,"w")) == NULL) {
+        return -1;
+    }
+    fprintf(fp,"%" PRIu64 " %" PRIu64 "\n",epoch,seq);
+    if (fclose(fp) != 0 || rename(tmp,path) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+apply_change(MDBM* db, int op, datum key, datum val)
+{
+    switch (op) {
+    case MDBM_CHANGE_STORE:
+        return mdbm_store(db,key,val,MDBM_REPLACE);
+
+    case MDBM_CHANGE_INSERT_DUP:
+        return mdbm_store(db,key,val,MDBM_INSERT_DUP);
+
+    case MDBM_CHANGE_DELETE:
+        if (mdbm_delete(db,key) < 0 && errno != ENOENT) {
+            return -1;
+        }
+        return 0;
+
+    case MDBM_CHANGE_PURGE:
+        mdbm_purge(db);
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/* Fetches the value of a change recorded without it.  Returns 0 if the key has
+ * since been deleted (the delete follows in the ring).
+ */
+static int
+fetch_value(MDBM* src, datum key, datum* val, datum* buf)
+{
+    int ret = 0;
+
+    if (mdbm_lock_smart(src,&key,MDBM_O_RDONLY) != 1) {
+        return -1;
+    }
+    *val = mdbm_fetch(src,key);
+    if (val->dptr) {
+        if (val->dsize > buf->dsize) {
+            buf->dptr = (char*)realloc(buf->dptr,val->dsize);
+            buf->dsize = val->dsize;
+        }
+        memcpy(buf->dptr,val->dptr,val->dsize);
+        val->dptr = buf->dptr;
+        ret = 1;
+    }
+    mdbm_unlock_smart(src,&key,0);
+    return ret;
+}
+
+static int
+write_change(FILE* fp, int op, datum key, datum val)
+{
+    stream_rec_t rec;
+
+    rec.op = htonl(op);
+    rec.ksize = htonl(key.dsize);
+    rec.vsize = htonl(val.dsize);
+    if (fwrite(&rec,sizeof(rec),1,fp) != 1
+        || (key.dsize && fwrite(key.dptr,key.dsize,1,fp) != 1)
+        || (val.dsize && fwrite(val.dptr,val.dsize,1,fp) != 1))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+import_stream(FILE* fp, MDBM* db)
+{
+    char magic[sizeof(STREAM_MAGIC)-1];
+    stream_rec_t rec;
+    datum key, val;
+    char* buf = NULL;
+    uint32_t bufsize = 0;
+    uint64_t n = 0;
+
+    if (fread(magic,sizeof(magic),1,fp) != 1 || memcmp(magic,STREAM_MAGIC,sizeof(magic))) {
+        fprintf(stderr, PREFIX "not a change stream\n");
+        return -1;
+    }
+    while (fread(&rec,sizeof(rec),1,fp) == 1) {
+        key.dsize = ntohl(rec.ksize);
+        val.dsize = ntohl(rec.vsize);
+        if ((uint32_t)key.dsize > MDBM_KEYLEN_MAX || (uint32_t)val.dsize > MDBM_VALLEN_MAX) {
+            fprintf(stderr, PREFIX "invalid change stream record %" PRIu64 "\n", n);
+            free(buf);
+            return -1;
+        }
+        if ((uint32_t)(key.dsize + val.dsize) > bufsize) {
+            bufsize = key.dsize + val.dsize;
+            buf = (char*)realloc(buf,bufsize);
+        }
+        key.dptr = buf;
+        val.dptr = buf + key.dsize;
+        if (key.dsize + val.dsize && fread(buf,key.dsize + val.dsize,1,fp) != 1) {
+            fprintf(stderr, PREFIX "truncated change stream\n");
+            free(buf);
+            return -1;
+        }
+        if (apply_change(db,ntohl(rec.op),key,val) < 0) {
+            fprintf(stderr, PREFIX "unable to apply change %" PRIu64 ": %s\n",
+                    n, strerror(errno));
+            free(buf);
+            return -1;
+        }
+        n++;
+    }
+    free(buf);
+    if (ferror(fp)) {
+        fprintf(stderr, PREFIX "read error: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* infile = NULL;
+    const char* outfile = NULL;
+    const char* posfile = NULL;
+    const char* srcname = NULL;
+    MDBM* src = NULL;
+    MDBM* replica = NULL;
+    FILE* fp = NULL;
+    mdbm_change_ring_t* ring;
+    mdbm_change_t change;
+    datum buf = { NULL, 0 };
+    uint64_t epoch, seq;
+    int follow = 0;
+    int wait_msec = 100;
+    int opt;
+    int oflags = 0;
+    int ret;
+
+    while ((opt = getopt(argc,argv,"fhi:Lo:p:w:")) != -1) {
+        switch (opt) {
+        case 'f':
+            follow = 1;
+            break;
+
+        case 'h':
+            usage(0);
+
+        case 'i':
+            infile = optarg;
+            break;
+
+        case 'L':
+            oflags |= MDBM_OPEN_NOLOCK;
+            break;
+
+        case 'o':
+            outfile = optarg;
+            break;
+
+        case 'p':
+            posfile = optarg;
+            break;
+
+        case 'w':
+            wait_msec = atoi(optarg);
+            break;
+
+        default:
+            usage(1);
+        }
+    }
+
+    if ((infile && outfile) || (argc - optind) != ((infile || outfile) ? 1 : 2)) {
+        usage(1);
+    }
+
+    if (!(oflags&MDBM_OPEN_NOLOCK)) {
+      oflags |= MDBM_ANY_LOCKS;
+    }
+
+    if (!outfile) {
+        const char* name = argv[argc-1];
+
+        if ((replica = mdbm_open(name, MDBM_O_RDWR|oflags, 0, 0, 0)) == NULL) {
+            fprintf(stderr, PREFIX "mdbm_open(%s): %s\n", name, strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (infile) {
+        if (!strcmp(infile,"-")) {
+            fp = stdin;
+        } else if ((fp = fopen(infile,"r")) == NULL) {
+            fprintf(stderr, PREFIX "fopen(%s): %s\n", infile, strerror(errno));
+            exit(1);
+        }
+        ret = import_stream(fp,replica);
+        mdbm_close(replica);
+        return ret < 0 ? 1 : 0;
+    }
+
+    srcname = argv[optind];
+    if ((ring = mdbm_change_ring_open(srcname)) == NULL) {
+        fprintf(stderr, PREFIX "mdbm_change_ring_open(%s): %s\n", srcname, strerror(errno));
+        exit(1);
+    }
+    if (posfile) {
+        if ((ret = read_position(posfile,&epoch,&seq)) < 0) {
+            fprintf(stderr, PREFIX "%s: %s\n", posfile, strerror(errno));
+            exit(1);
+        }
+        if (ret && mdbm_change_ring_seek(ring,epoch,seq) < 0) {
+            if (errno == ESTALE) {
+                fprintf(stderr, PREFIX "%s: changes since the saved position are no longer"
+                        " available, resync the replica with mdbm_copy\n", srcname);
+                exit(2);
+            }
+            fprintf(stderr, PREFIX "mdbm_change_ring_seek(%s): %s\n", srcname, strerror(errno));
+            exit(1);
+        }
+    }
+    if (outfile) {
+        if (!strcmp(outfile,"-")) {
+            fp = stdout;
+        } else if ((fp = fopen(outfile,"w")) == NULL) {
+            fprintf(stderr, PREFIX "fopen(%s): %s\n", outfile, strerror(errno));
+            exit(1);
+        }
+        if (fwrite(STREAM_MAGIC,sizeof(STREAM_MAGIC)-1,1,fp) != 1) {
+            fprintf(stderr, PREFIX "write error: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    for (;;) {
+        datum val;
+
+        if ((ret = mdbm_change_ring_next(ring,&change)) < 0) {
+            if (errno == ESTALE) {
+                fprintf(stderr, PREFIX "%s: fell behind the change ring,"
+                        " resync the replica with mdbm_copy\n", srcname);
+                exit(2);
+            }
+            fprintf(stderr, PREFIX "mdbm_change_ring_next(%s): %s\n", srcname, strerror(errno));
+            exit(1);
+        }
+        if (!ret) {
+            if ((fp && fflush(fp) != 0) || (posfile && write_position(posfile,ring) < 0)) {
+                fprintf(stderr, PREFIX "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+            if (!follow) {
+                break;
+            }
+            usleep(wait_msec*1000);
+            continue;
+        }
+        val = change.val;
+        if (change.flags & MDBM_CHANGE_NOVAL) {
+            if (!src && (src = mdbm_open(srcname, MDBM_O_RDONLY|oflags, 0, 0, 0)) == NULL) {
+                fprintf(stderr, PREFIX "mdbm_open(%s): %s\n", srcname, strerror(errno));
+                exit(1);
+            }
+            if ((ret = fetch_value(src,change.key,&val,&buf)) < 0) {
+                fprintf(stderr, PREFIX "mdbm_fetch(%s): %s\n", srcname, strerror(errno));
+                exit(1);
+            }
+            if (!ret) {
+                change.op = MDBM_CHANGE_DELETE;
+            }
+        }
+        if (fp) {
+            ret = write_change(fp,change.op,change.key,val);
+        } else {
+            ret = apply_change(replica,change.op,change.key,val);
+        }
+        if (ret < 0) {
+            fprintf(stderr, PREFIX "unable to apply change %" PRIu64 ": %s\n",
+                    change.seq, strerror(errno));
+            exit(1);
+        }
+    }
+
+    mdbm_change_ring_close(ring);
+    if (src) {
+        mdbm_close(src);
+    }
+    if (replica) {
+        mdbm_close(replica);
+    }
+    if (fp && fp != stdout && fclose(fp) != 0) {
+        fprintf(stderr, PREFIX "write error: %s\n", strerror(errno));
+        exit(1);
+    }
+    free(buf.dptr);
+    return 0;
+}
@@ -30,6 +30,8 @@ usage(int exit_code)
 "        -l mode         Lock mode \n"
 lockstr_to_flags_usage("                          ")
 "        -p <n>          Check specified page\n"
+"        -t <n>          Number of threads for data page and large object checks\n"
+"                        (default: 1, 0 for one per CPU)\n"
 "        -V              Display mdbm file version.\n"
 "                        This option may only be used with the -v option.\n"
 "                        Use `-v 0' to return just the unadorned version number.\n"
@@ -63,9 +65,10 @@ main(int argc, char* argv[])
     int verbose = 1;
     int dbcheck = 3;
     int lock = 1;
+    int nthreads = 1;
     uint64_t winsize = 0;
 
-    while ((opt = getopt(argc,argv,"d:hLl:p:Vv:w:X:")) != -1) {
+    while ((opt = getopt(argc,argv,"d:hLl:p:t:Vv:w:X:")) != -1) {
         switch (opt) {
         case '2':
             break;
@@ -109,6 +112,16 @@ main(int argc, char* argv[])
             pno = atoi(optarg);
             break;
 
+        case 't':
+            opt_nonversion = 1;
+            checkVersionUsage(opt_version);
+            nthreads = atoi(optarg);
+            if (nthreads < 0) {
+                printf("Number of threads must not be negative, threads=%d\n\n", nthreads);
+                usage(1);
+            }
+            break;
+
         case 'V':
             opt_version = 1;
             checkVersionUsage(opt_nonversion);
@@ -188,7 +201,7 @@ main(int argc, char* argv[])
                     mdbm_logerror(LOG_ERR,0,"%s: mdbm_lock failure",fn);
                 }
             }
-            ret = mdbm_check(db,dbcheck,verbose);
+            ret = mdbm_check_parallel(db,dbcheck,verbose,nthreads);
             if (lock) {
                 if (mdbm_unlock(db) != 1) {
                     mdbm_logerror(LOG_ERR,0,"%s: mdbm_unlock failure",fn);
@@ -77,37 +77,123 @@ static void dump_kv(datum key, datum val) {
     }
 }
 
+/* Dumps the record if it is missing from, or differs in, db.
+ * Returns 1 if the record was dumped. */
+static int dump_if_different(MDBM* db, datum key, datum val, int missing_only, int no_missing) {
+    datum d = mdbm_fetch(db, key);
+
+    if (NULL == d.dptr || 0 == d.dsize) {
+      if (!no_missing) {
+        dump_kv(key, val);
+        return 1;
+      }
+    } else if ((val.dsize != d.dsize) || memcmp(val.dptr, d.dptr, val.dsize)) {
+      if (!missing_only) {
+        dump_kv(key, val);
+        return 1;
+      }
+    }
+    return 0;
+}
+
 static uint64_t dump_different(MDBM* db1, MDBM* db2, int missing_only, int no_missing) {
     uint64_t retval = 0;
     kvpair kv;
-    datum d;
     MDBM_ITER iter;
 
     MDBM_ITER_INIT(&iter);
     kv = mdbm_first_r(db1, &iter);
     while (kv.key.dptr != NULL) {
-        d = mdbm_fetch(db2, kv.key);
-
-        if (NULL == d.dptr || 0 == d.dsize) {
-          if (!no_missing) {
-            dump_kv(kv.key, kv.val);
-            ++retval;
-          }
-        } else if ((kv.val.dsize != d.dsize) || memcmp(kv.val.dptr, d.dptr, kv.val.dsize)) {
-          if (!missing_only) {
-            dump_kv(kv.key, kv.val);
-            ++retval;
-          }
-        }
+        retval += dump_if_different(db2, kv.key, kv.val, missing_only, no_missing);
         kv = mdbm_next_r(db1, &iter);
     }
     return retval;
 }
 
+struct leaf_compare {
+    MDBM* other;        /* NULL to dump every record */
+    int missing_only;
+    int no_missing;
+    uint64_t count;
+};
+
+static int dump_leaf_record(void* user, const mdbm_iterate_info_t* info, const kvpair* kv) {
+    struct leaf_compare* cmp = (struct leaf_compare*)user;
+
+    if (!cmp->other) {
+        dump_kv(kv->key, kv->val);
+        cmp->count++;
+    } else {
+        cmp->count += dump_if_different(cmp->other, kv->key, kv->val,
+                                        cmp->missing_only, cmp->no_missing);
+    }
+    return 0;
+}
+
+/* Compares db1 against a Merkle tree (of db2, or loaded from a file when db2 is
+ * NULL), dumping the records in the leaves that differ. */
+static int dump_different_leaves(MDBM* db1, MDBM* db2, mdbm_merkle_t* tree2,
+                                 int nthreads, int missing_only, int no_missing,
+                                 uint64_t* diffcount) {
+    int levels = mdbm_merkle_levels(tree2);
+    mdbm_merkle_t* tree1;
+    uint32_t* leaves;
+    int nleaves, i;
+    struct leaf_compare cmp;
+
+    if ((tree1 = mdbm_merkle_build(db1, levels, nthreads)) == NULL) {
+        perror("mdbm_merkle_build");
+        return -1;
+    }
+    if (mdbm_merkle_root(tree1) == mdbm_merkle_root(tree2)) {
+        mdbm_merkle_free(tree1);
+        return 0;
+    }
+    if ((leaves = (uint32_t*)malloc(sizeof(uint32_t) << levels)) == NULL) {
+        perror("malloc");
+        mdbm_merkle_free(tree1);
+        return -1;
+    }
+    if ((nleaves = mdbm_merkle_diff(tree1, tree2, leaves, 1 << levels)) < 0) {
+        perror("mdbm_merkle_diff");
+        free(leaves);
+        mdbm_merkle_free(tree1);
+        return -1;
+    }
+    for (i = 0; i < nleaves; ++i) {
+        if (!db2) {
+            cmp.other = NULL;
+            cmp.count = 0;
+            mdbm_merkle_iterate_leaf(db1, levels, leaves[i], dump_leaf_record, 0, &cmp);
+            *diffcount += cmp.count;
+            continue;
+        }
+        /* Things that are different or in db1 only */
+        cmp.other = db2;
+        cmp.missing_only = missing_only;
+        cmp.no_missing = no_missing;
+        cmp.count = 0;
+        if (!missing_only && !no_missing) {
+            mdbm_merkle_iterate_leaf(db1, levels, leaves[i], dump_leaf_record, 0, &cmp);
+            /* Things that are in db2 only */
+            cmp.other = db1;
+            cmp.missing_only = 1;
+            mdbm_merkle_iterate_leaf(db2, levels, leaves[i], dump_leaf_record, 0, &cmp);
+        } else {
+            mdbm_merkle_iterate_leaf(db1, levels, leaves[i], dump_leaf_record, 0, &cmp);
+        }
+        *diffcount += cmp.count;
+    }
+    free(leaves);
+    mdbm_merkle_free(tree1);
+    return 0;
+}
+
 
 static void usage (void) {
     printf("\
 Usage: mdbm_compare [options] <db_filename1> <db_filename2>\n\
+       mdbm_compare [options] -T <tree_file> <db_filename1>\n\
 Compares two MDBMs, dumping out differing entries.\n\
 Options:\n\
         -k          Print key data\n\
@@ -118,6 +204,11 @@ Options:\n\
         -m          Missing. Only show entries not in the second DB.\n\
         -M          Not missing. Only show entries that exist (but differ) in both DBs.\n\
                     NOTE: -m and -M are mutually exclusive.\n\
+        -n <count>  With -t or -T, number of threads building Merkle trees\n\
+        -t <levels> Compare Merkle trees with 2^<levels> leaves first, and only\n\
+                    compare the entries of the leaves that differ\n\
+        -T <file>   Compare db_filename1 against a Merkle tree saved by mdbm_digest,\n\
+                    dumping all entries of the leaves that differ\n\
         -w <size>   Use windowed mode with specified window size\n\
 ");
 }
@@ -133,12 +224,16 @@ int main(int argc, char** argv) {
     int missing = 0;
     int common = 0;
     const char* outname = NULL;
+    const char* treename = NULL;
+    int levels = -1;
+    int nthreads = 0;
+    mdbm_merkle_t* tree2 = NULL;
 
     /* initialize to be unit-test friendly */
     flags = 0;
     outfile = stdout;
 
-    while ((opt = getopt(argc,argv,"hf:F:kLmMvw:")) != -1) {
+    while ((opt = getopt(argc,argv,"hf:F:kLmMn:t:T:vw:")) != -1) {
         switch (opt) {
         case 'f':
             outname=optarg;
@@ -172,6 +267,20 @@ int main(int argc, char** argv) {
         case 'M':
             common = 1;
             break;
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 't':
+            levels = atoi(optarg);
+            if (levels < 0 || levels > MDBM_MERKLE_MAX_LEVELS) {
+              fprintf(stderr, "ERROR: Merkle tree levels must be 0..%d !\n", MDBM_MERKLE_MAX_LEVELS);
+              usage();
+              return -1;
+            }
+            break;
+        case 'T':
+            treename = optarg;
+            break;
         case 'v':
             flags |= MDBM_DUMP_VALUES;
             break;
@@ -187,7 +296,18 @@ int main(int argc, char** argv) {
       usage();
       return -1;
     }
-    if (optind+2 != argc) { 
+    if (treename) {
+      if (levels >= 0) {
+        fprintf(stderr, "ERROR: only specify one of -t or -T !\n");
+        usage();
+        return -1;
+      }
+      if (optind+1 != argc) {
+        fprintf(stderr, "ERROR: must provide one mdbm file to compare against the tree !\n");
+        usage();
+        return 1;
+      }
+    } else if (optind+2 != argc) { 
       fprintf(stderr, "ERROR: must provide two mdbm files to compare !\n");
       usage(); 
       return 1; 
@@ -207,14 +327,31 @@ int main(int argc, char** argv) {
         mdbm_set_window_size(db1,winsize);
     }
 
-    db2 = mdbm_open(argv[optind+1],MDBM_O_RDONLY|oflags,0,0,0);
-    if (!db2) {
-        perror(argv[optind+1]);
-        retval = -1;
-        goto cleanup;
-    }
-    if (winsize) {
-        mdbm_set_window_size(db2,winsize);
+    if (treename) {
+        tree2 = mdbm_merkle_load(treename);
+        if (!tree2) {
+            perror(treename);
+            retval = -1;
+            goto cleanup;
+        }
+    } else {
+        db2 = mdbm_open(argv[optind+1],MDBM_O_RDONLY|oflags,0,0,0);
+        if (!db2) {
+            perror(argv[optind+1]);
+            retval = -1;
+            goto cleanup;
+        }
+        if (winsize) {
+            mdbm_set_window_size(db2,winsize);
+        }
+        if (levels >= 0) {
+            tree2 = mdbm_merkle_build(db2,levels,nthreads);
+            if (!tree2) {
+                perror("mdbm_merkle_build");
+                retval = -1;
+                goto cleanup;
+            }
+        }
     }
     
     if (outname) {
@@ -225,7 +362,12 @@ int main(int argc, char** argv) {
       }
     }
 
-    if (missing) {
+    if (tree2) {
+      if (dump_different_leaves(db1, db2, tree2, nthreads, missing, common, &diffcount) < 0) {
+        retval = -1;
+        goto cleanup;
+      }
+    } else if (missing) {
       diffcount = dump_different(db1, db2, 1, 0);
     } else if (common) {
       diffcount = dump_different(db1, db2, 0, 1);
@@ -246,6 +388,10 @@ int main(int argc, char** argv) {
     retval = (diffcount!=0) ? 1:0;
 
 cleanup:
+    if (tree2) {
+      mdbm_merkle_free(tree2);
+      tree2=NULL;
+    }
     if (db1) { 
       mdbm_close(db1); 
       db1=NULL; 
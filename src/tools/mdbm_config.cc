@@ -58,7 +58,8 @@ static double OverboundToCapacityRatio = 10.0;
 
 static int HashFuncs[] = { MDBM_HASH_CRC32, MDBM_HASH_EJB, MDBM_HASH_PHONG, MDBM_HASH_OZ,
                            MDBM_HASH_TOREK, MDBM_HASH_FNV, MDBM_HASH_STL, MDBM_HASH_MD5,
-                           MDBM_HASH_SHA_1, MDBM_HASH_JENKINS, MDBM_HASH_HSIEH };
+                           MDBM_HASH_SHA_1, MDBM_HASH_JENKINS, MDBM_HASH_HSIEH,
+                           MDBM_HASH_XXH64, MDBM_HASH_CRC32C };
 static uint HashNum = sizeof(HashFuncs) / sizeof(int);
 
 static bool PrintVerbose = false;
@@ -171,6 +172,7 @@ usage: " PROG " [options] outfile.mdbm\n\
   -r value        Set the ratio of the overbound-penalty to capacity-penalty coefficients\n\
   -s hash         Create DB with <hash> hash function\n\
          hash: CRC | EJB | PHONG | OZ | TOREK | FNV | STL | MD5 | SHA1 | JENKINS | HSIEH\n\
+               | XXH64 | CRC32C\n\
   -t targetcap    Target MDBM capacity utilization rate (default: 50%%, range: 1%% - 75%%)\n\
   -v              Verbose\n\
   -w <n.n%%>      Specifies floating-poing percentage of accesses that are writes\n\
@@ -1174,6 +1176,10 @@ main(int argc, char** argv)
                 optHashfnid = MDBM_HASH_JENKINS;
             } else if (strcasecmp(optarg, "HSIEH") == 0) {
                 optHashfnid = MDBM_HASH_HSIEH;
+            } else if (strcasecmp(optarg, "XXH64") == 0) {
+                optHashfnid = MDBM_HASH_XXH64;
+            } else if (strcasecmp(optarg, "CRC32C") == 0) {
+                optHashfnid = MDBM_HASH_CRC32C;
             }
             hashSet = true;
             break;
@@ -38,6 +38,8 @@ usage (void)
 "                   8  SHA-1\n"
 "                   9  Jenkins\n"
 "                  10  Hsieh SuperFast\n"
+"                  11  xxHash64\n"
+"                  12  CRC-32C\n"
 "    -K mode     locking mode \n"
 lockstr_to_flags_usage("                  ")
 "    -L          Enable large-object mode\n"
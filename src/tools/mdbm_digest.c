@@ -2,6 +2,7 @@
 /* See LICENSE in the root of the distribution for licensing details. */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 #include <stdio.h>
@@ -24,7 +25,10 @@ Usage: mdbm_digest [options] DBFILE\n\
 Options:\n\
         -h            This help message\n\
         -m            Generate md5\n\
+        -n <threads>  With -t, number of threads building the Merkle tree\n\
+        -o <file>     With -t, save the Merkle tree to <file>\n\
         -s            Generate sha-1\n\
+        -t <levels>   Generate a Merkle tree with 2^<levels> leaves\n\
         -v            Show verbose stats\n\
         -w <size>     Open database in windowed mode with specified window size.\n\
                       Suffix k/m/g may be used to override the default of bytes.\n\
@@ -41,10 +45,13 @@ main (int argc, char** argv)
     int md5 = 0;
     int sha1 = 0;
     int verbose = 0;
+    int levels = -1;
+    int nthreads = 0;
+    const char* treefile = NULL;
     uint64_t winsize = 0;
     int oflags = MDBM_ANY_LOCKS;
 
-    while ((opt = getopt(argc,argv,"hmsvw:")) != -1) {
+    while ((opt = getopt(argc,argv,"hmn:o:st:vw:")) != -1) {
         switch (opt) {
         case 'h':
             usage(0);
@@ -54,10 +61,27 @@ main (int argc, char** argv)
             md5 = 1;
             break;
 
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+
+        case 'o':
+            treefile = optarg;
+            break;
+
         case 's':
             sha1 = 1;
             break;
 
+        case 't':
+            levels = atoi(optarg);
+            if (levels < 0 || levels > MDBM_MERKLE_MAX_LEVELS) {
+                fprintf(stderr, PROG ": Merkle tree levels must be 0..%d\n",
+                        MDBM_MERKLE_MAX_LEVELS);
+                usage(1);
+            }
+            break;
+
         case 'v':
             verbose++;
             break;
@@ -81,7 +105,12 @@ main (int argc, char** argv)
         usage(1);
     }
 
-    if (!md5 && !sha1) {
+    if (treefile && levels < 0) {
+        fputs(PROG ": -o requires -t\n",stderr);
+        usage(1);
+    }
+
+    if (!md5 && !sha1 && levels < 0) {
         sha1 = 1;
     }
 
@@ -102,7 +131,27 @@ main (int argc, char** argv)
         }
     }
 
-    if (mdbm_lock(db) != 1) {
+    if (levels >= 0) {
+        mdbm_merkle_t* tree;
+
+        if ((tree = mdbm_merkle_build(db,levels,nthreads)) == NULL) {
+            perror("mdbm_merkle_build");
+            mdbm_close(db);
+            exit(1);
+        }
+        printf("MERKLE(%s)= %016" PRIx64 "\n",argv[optind],mdbm_merkle_root(tree));
+        if (treefile && mdbm_merkle_save(tree,treefile) < 0) {
+            perror(treefile);
+            mdbm_merkle_free(tree);
+            mdbm_close(db);
+            exit(1);
+        }
+        mdbm_merkle_free(tree);
+    }
+
+    if (!md5 && !sha1) {
+        /* Merkle tree only */
+    } else if (mdbm_lock(db) != 1) {
         perror("mdbm_lock");
     } else {
         kvpair kv;
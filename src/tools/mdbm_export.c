@@ -21,7 +21,10 @@ static void usage()
           "  -f           Fast mode (don't lock db while reading)\n"
           "  -L mode      Specify lock-mode, one of: \n"
           lockstr_to_flags_usage("                 ")
+          "  -b           Export binary bindump format (default db_dump format)\n"
           "  -c           Export cdbdump format (default db_dump format)\n"
+          "  -C level     With -b, compress blocks (1 fastest .. 9 smallest)\n"
+          "  -n threads   With -b, number of threads reading the db (default: one per CPU)\n"
           "  -o outfile   Write to <outfile> instead of stdout\n"
           "  -r           Only write record metadata information.\n"
           "               Output format: keySize,valueSize,pageNumber\n"
@@ -62,34 +65,6 @@ static void do_cdbdump(MDBM *db, FILE *fp)
   fputc('\n', fp);
 }
 
-static inline void dump_str(datum d, FILE *fp)
-{
-  int i;
-
-  for (i = 0; i < d.dsize; i++)
-    {
-      switch(d.dptr[i])
-        {
-        case '\\':
-          fwrite("\\\\", 2, 1, fp);
-          break;
-        case '\0':
-          fwrite("\\00", 3, 1, fp);
-          break;
-        case '\012':
-          fwrite("\\0a", 3, 1, fp);
-          break;
-        case '\015':
-          fwrite("\\0d", 3, 1, fp);
-          break;
-        default:
-          fputc(d.dptr[i], fp);
-        }
-    }
-
-  fputc('\n', fp);
-}
-
 /**
  * Berkley DB's db_dump format
  * http://www.sleepycat.com/docs/utility/db_dump.html
@@ -108,8 +83,7 @@ static void do_dbdump(MDBM *db, FILE *fp)
 
   for (kv = mdbm_first(db); kv.key.dptr != NULL; kv = mdbm_next(db))
     {
-      dump_str(kv.key, fp);
-      dump_str(kv.val, fp);
+      mdbm_dbdump_to_file(kv, fp);
     }
 }
 
@@ -122,8 +96,11 @@ int main(int argc, char** argv)
   MDBM *db;
   int   lock_flags = MDBM_ANY_LOCKS;
   int   opt_recordInfo = 0;
+  int   opt_bindump = 0;
+  int   opt_level = 0;
+  int   opt_threads = 0;
 
-  while ((c = getopt(argc, argv, "hfL:o:cr")) != EOF) {
+  while ((c = getopt(argc, argv, "bhfL:o:cC:n:r")) != EOF) {
     switch (c) {
     case 'h':
       opt_help = 1;
@@ -132,9 +109,18 @@ int main(int argc, char** argv)
       fprintf(stderr, "Option \"-f\" is deprecated, use \"-L none\" \n");
       opt_fast = 1;
       break;
+    case 'b':
+      opt_bindump = 1;
+      break;
     case 'c':
       opt_cdbdump = 1;
       break;
+    case 'C':
+      opt_level = atoi(optarg);
+      break;
+    case 'n':
+      opt_threads = atoi(optarg);
+      break;
     case 'o':
       opt_outfile = optarg;
       break;
@@ -172,6 +158,10 @@ int main(int argc, char** argv)
     fprintf(stderr, "Options \"-c\" and \"-r\" are not compatible.\n");
     return(1);
   }
+  if (opt_bindump && (opt_recordInfo || opt_cdbdump)) {
+    fprintf(stderr, "Option \"-b\" is not compatible with \"-c\" or \"-r\".\n");
+    return(1);
+  }
 
   if ((db = mdbm_open(argv[optind], MDBM_O_RDONLY|lock_flags, 0, 0, 0)) == NULL) {
     fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
@@ -188,6 +178,20 @@ int main(int argc, char** argv)
   /* Buffer output a little more */
   setvbuf(fp, NULL, _IOFBF, BUFSIZ * 16);
 
+  if (opt_bindump) {
+    /* Threads lock one page at a time, so the db isn't locked as a whole. */
+    int ret = mdbm_bindump_export(db, fp, opt_level, opt_threads);
+    if (ret < 0) {
+      fprintf(stderr, "%s: %s\n", opt_outfile ? opt_outfile : "stdout", strerror(errno));
+    }
+    if (fclose(fp) != 0 && !ret) {
+      perror(opt_outfile ? opt_outfile : "stdout");
+      ret = -1;
+    }
+    mdbm_close(db);
+    return (ret < 0) ? 1 : 0;
+  }
+
   if (!opt_fast) {
     mdbm_lock(db);
   }
@@ -19,11 +19,24 @@
  *                           in the input directory.
  * -c : This specifies that the source input files are in cdb format. 
  *      Default format is db_dump.
+ * -B : This specifies that the source input files are in bindump format.
+ *      Records are hashed straight from their length-prefixed keys, and the
+ *      bucket files are written in bindump format too.
+ * -m : This specifies that the sources are MDBMs, whose records are split
+ *      without exporting them first.  The bucket files are in db_dump format,
+ *      or in cdb or bindump format with -c or -B.
+ * -n <threads> : Split cdb and db_dump source files on a pipeline: this thread
+ *      reads batches of records, and <threads> workers hash them. With -m,
+ *      the number of threads iterating the pages of each MDBM.
+ *      0 means one per CPU.
  * --hash-function <hash code> : This number identifies the hash function to use.
  *                  REQUIRED.
 */
 
 #include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -33,6 +46,7 @@
 #include <ctype.h>
 
 #include <algorithm>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -44,8 +58,11 @@
 using namespace std;
 
 bool   CdbFlag  = false;
+bool   BinFlag  = false;
+bool   MdbmFlag = false;
 int    HashCode = -1;  // REQUIRED
 int    BuckCnt  = 50;
+int    Threads  = -1;  // -1: split source files on this thread only
 string InputDir;
 string SrcFilePrefix;
 string OutputDir = ".";
@@ -57,7 +74,7 @@ getNumForHashCode(const char *optarg)
 {
     string str(optarg);
     int smallestHashCode = 0;
-    int biggestHashCode  = 10;
+    int biggestHashCode  = MDBM_MAX_HASH;
     string nums("0123456789");
     size_t foundNum = str.find_first_of(nums);
     if (foundNum != string::npos) // have a number
@@ -67,7 +84,7 @@ getNumForHashCode(const char *optarg)
         {
             int hcode = atoi(optarg);
             // catch invalid strings like "1crc32", "010" 
-            if (hcode != biggestHashCode && str.size() > 1)
+            if (str.size() > 1 && (hcode < 10 || str.size() > 2))
             {
                 hcode = -1;
 	    }
@@ -85,13 +102,23 @@ getNumForHashCode(const char *optarg)
     // Lets translate the name to a number, index equals hash code value
     // so order is important!
     // 0=CRC32 1=EJB 2=PHONG 3=OZ 4=TOREK 5=FNV 6=STL 7=MD5 8=SHA1 9=Jenkins 10=Hsieh
+    // 11=XXH64 12=CRC32C
     string nameList[] = { string("CRC"),      string("EJB"),   string("PHONG"), 
                           string("OZ"),       string("TOREK"), string("FNV"), 
                           string("STL"),      string("MD5"),   string("SHA1"), 
-                          string("JENKINS"),  string("HSIEH"), string() };
+                          string("JENKINS"),  string("HSIEH"), string("XXH64"),
+                          string("CRC32C"),   string() };
 
     char (*pfunc)(char) = reinterpret_cast<char(*)(char)>(static_cast<int(*)(int)>(toupper));
     transform(str.begin(), str.end(), str.begin(), pfunc);
+    // "CRC32C" also contains "CRC", so look for an exact name first
+    for (int hcode = smallestHashCode; nameList[hcode].empty() == false; ++hcode)
+    {
+        if (str == nameList[hcode])
+        {
+            return hcode;
+        }
+    }
     for (int hcode = smallestHashCode; nameList[hcode].empty() == false; ++hcode)
     {
         if (str.find(nameList[hcode]) != string::npos)
@@ -110,11 +137,16 @@ usage()
 {
     cerr << "Usage: mdbm_export_splitter [options] [source files]..." << endl;
     cerr << "Splits the source files into buckets of key/values by hash of the key." << endl;
-    cerr << "All source files will be expected to be in the same format, either CDB or db_dump." << endl;
+    cerr << "All source files will be expected to be in the same format, either CDB, db_dump or bindump." << endl;
     cerr << "The bucket files will be in the same format as the source files." << endl;
     cerr << "Options:" << endl;
+    cerr << "  -B                 The source input files will be in bindump format." << endl;
     cerr << "  -c                 The source input files will be in CDB format." << endl;
     cerr << "  -b <bucket count>  Number of buckets to create." << endl;
+    cerr << "  -m                 The sources are MDBMs: split their records without exporting them." << endl;
+    cerr << "                     Buckets are in db_dump format, or CDB or bindump format with -c or -B." << endl;
+    cerr << "  -n <threads>       Split CDB and db_dump source files with <threads> worker threads," << endl;
+    cerr << "                     or iterate MDBMs (-m) with <threads> threads. 0 means one per CPU." << endl;
     cerr << "  --hash-function <hash code> MDBM specific code representing a hash method." << endl;
     cerr << "      User may provide the number or name as shown below:" << endl;
     cerr << "      0  or  CRC32" << endl
@@ -127,7 +159,9 @@ usage()
          << "      7  or  MD5" << endl
          << "      8  or  SHA1" << endl
          << "      9  or  Jenkins" << endl
-         << "     10  or  Hsieh" << endl;
+         << "     10  or  Hsieh" << endl
+         << "     11  or  XXH64" << endl
+         << "     12  or  CRC32C" << endl;
     cerr << "  -h                       Show usage and exit." << endl;
     cerr << "  -i <input directory>     Directory that contains the source files in CDB or db_dump format" << endl;
     cerr << "  -o <output directory>    Directory inwhich to write the bucket files" << endl;
@@ -138,7 +172,7 @@ int
 processOptions(int argc, char ** argv)
 {
     // get options
-    const char *shortOpts = "cb:h:i:o:p:";
+    const char *shortOpts = "Bcb:h:i:mn:o:p:";
     static option longOpts[] = {
         {"hash-function", 1, 0, 0},
         {0, 0, 0, 0}
@@ -156,6 +190,9 @@ processOptions(int argc, char ** argv)
         case 'b': 
             BuckCnt  = atoi(optarg);
             break;
+        case 'B': 
+            BinFlag = true;
+            break;
         case 'c': 
             CdbFlag = true;
             break;
@@ -166,6 +203,14 @@ processOptions(int argc, char ** argv)
         case 'i': 
             InputDir = optarg;
             break;
+        case 'm': 
+            MdbmFlag = true;
+            break;
+        case 'n': 
+            Threads = atoi(optarg);
+            if (Threads < 0)
+                err_flag = true;
+            break;
         case 'o': 
             OutputDir = optarg;
             break;
@@ -179,6 +224,11 @@ processOptions(int argc, char ** argv)
 
     int extraArgs = argc - optind;
     err_flag = InputDir.empty() && extraArgs == 0 ? true : err_flag;
+    if (CdbFlag && BinFlag)
+    {
+        cerr << "ERROR: Only specify one of -B or -c" << endl;
+        err_flag = true;
+    }
     if (err_flag) 
     {
         return -1;
@@ -191,8 +241,9 @@ class BucketFile
 public:
     BucketFile(const string &fqname) : _fd(-1), _fqname(fqname) {}
     int write(string &line);
+    int write(const char *data, size_t len); // whole lines, with their '\n'
 
-    void close(); // close file
+    void close(); // flush and close file
 
     void operator() (BucketFile *bfile) { if (bfile) bfile->close(); }
 
@@ -200,11 +251,16 @@ public:
     string fileName() { return _fqname; }
 private:
     int open(); // open or create file
+    int flush(); // write out the buffered lines
 
     int    _fd;
     string _fqname; // fully qualified file name path
+    string _buf;    // lines not yet written
 };
 
+// Lines are buffered per bucket, and written once this much is pending
+static const size_t BucketBufferSize = 64 * 1024;
+
 class BucketFiles
 {
 public:
@@ -217,6 +273,7 @@ public:
 
     int count() { return _bucketCnt; }
     int sendToBucket(int buckIndex, string &keyLine, string &valueLine, int valLen);
+    int sendLines(int buckIndex, const char *lines, size_t len);
 
 protected:
     BucketFiles() {}
@@ -250,6 +307,20 @@ void CdbBucketFiles::CdbFinalizeFile::operator() (BucketFile *bfile)
     bfile->close();
 }
 
+// Bucket files in bindump format, written a record at a time.
+class BinBucketFiles : public BucketFiles
+{
+public:
+    BinBucketFiles(int bucketCnt, const string &outputDir, const string &outFilePrefix);
+    ~BinBucketFiles();
+
+    int sendRecord(int buckIndex, const kvpair &kv);
+
+private:
+    vector<FILE*>                  _fps;
+    vector<mdbm_bindump_writer_t*> _writers;
+};
+
 class SplitFile
 {
 public:
@@ -265,7 +336,12 @@ public:
     SplitFile& operator= (SplitFile &src);
 
     virtual void split(string &srcfile) = 0;
-    void hashAndSend(const string &key, string &keyLine, string &valueLine, int lineCnt, const string &fname);
+    void hashAndSend(const string &key, string &keyLine, string &valueLine, bool hasValue,
+                     int lineCnt, const string &fname);
+
+protected:
+    int bucketIndex(const datum &key);
+    BucketFiles* buckets() { return _buckFiles; }
 
 private:
     uint32_t     _hashCode;
@@ -292,14 +368,24 @@ SplitFile& SplitFile::operator= (SplitFile &src)
     _buckFiles = src._buckFiles;
     return *this;
 }
-void SplitFile::hashAndSend(const string &key, string &keyLine, string &valueLine, int lineCnt, const string &fname)
+// Returns the bucket of a key, or -1 if it can't be hashed.
+int SplitFile::bucketIndex(const datum &key)
+{
+    uint32_t hashValue = 0;
+    if (mdbm_get_hash_value(key, _hashCode, &hashValue) == -1)
+    {
+        return -1;
+    }
+    return hashValue % _buckFiles->count();
+}
+void SplitFile::hashAndSend(const string &key, string &keyLine, string &valueLine, bool hasValue,
+                            int lineCnt, const string &fname)
 {
     datum dkey;
     dkey.dptr  = const_cast<char*>(key.c_str());
     dkey.dsize = key.size();
-    uint32_t hashValue = 0;
-    int ret = mdbm_get_hash_value(dkey, _hashCode, &hashValue);
-    if (ret == -1)
+    int buckIndex = bucketIndex(dkey);
+    if (buckIndex == -1)
     {
         cerr << "SplitFile: ERROR: Cannot get mdbm_get_hash_value"
              << ", key-size=" << key.size()
@@ -309,8 +395,7 @@ void SplitFile::hashAndSend(const string &key, string &keyLine, string &valueLin
     }
     else
     {
-        int buckIndex = hashValue % _buckFiles->count();
-        int valLen = valueLine.empty() ? -1 : int(valueLine.size());
+        int valLen = hasValue ? int(valueLine.size()) : -1;
         _buckFiles->sendToBucket(buckIndex, keyLine, valueLine, valLen);
     }
 }
@@ -333,12 +418,120 @@ public:
     {}
     void split(string &srcfile);
 
+    static bool isHeaderLine(const string &line);
+
 private:
     static string DbDumpHeaderFields;
 };
 
+class BinSplitFile : public SplitFile
+{
+public:
+    BinSplitFile(uint32_t hashCode, BinBucketFiles *buckFiles) :
+        SplitFile(hashCode, buckFiles), _binBuckFiles(buckFiles)
+    {}
+    void split(string &srcfile);
+
+private:
+    static int splitRecord(void *user, const kvpair *kv);
+
+    BinBucketFiles *_binBuckFiles;
+};
+
+// A batch of whole records read from a source file, for a pipeline worker.
+struct SplitBatch
+{
+    uint64_t       seq;       // batches are appended to the buckets in this order
+    string         fname;
+    int            firstLine; // line number before the first record
+    string         data;      // records, each line ending with '\n'
+    vector<string> out;       // lines for each bucket
+};
+
+// Splits cdb or db_dump source files on a pipeline.  This thread reads batches
+// of whole records, and worker threads hash them into per-bucket lines, which
+// are appended to the bucket files in batch order, so each bucket gets its
+// records in the same order as when splitting on one thread.
+class PipelineSplitFile : public SplitFile
+{
+public:
+    PipelineSplitFile(uint32_t hashCode, BucketFiles *buckFiles, bool cdb, int nthreads);
+    ~PipelineSplitFile();
+    void split(string &srcfile);
+
+private:
+    static void* worker(void *arg);
+    void   splitBatch(SplitBatch *batch);
+    void   submit(SplitBatch *batch);
+    size_t recordsEnd(const char *data, size_t len, int *lines);
+    bool   skipHeader(FILE *fp, string &carry, int *lines);
+
+    bool               _cdb;
+    int                _nthreads;
+    vector<pthread_t>  _threads;
+    pthread_mutex_t    _mutex;
+    pthread_cond_t     _cond;      // signalled when any of the below changes
+    deque<SplitBatch*> _queue;
+    size_t             _inflight;  // batches read but not yet appended
+    uint64_t           _nextSeq;
+    uint64_t           _committed; // batches appended to the buckets so far
+    bool               _done;
+};
+
+// One thread's lines (or bindump records) for each bucket.
+struct SplitBuffers
+{
+    vector<char*>    bufs;
+    vector<uint32_t> sizes;
+    vector<uint32_t> lens;
+};
+
+// Splits the records of MDBMs, without an export file in between.  Pages are
+// iterated on several threads (see mdbm_iterate_parallel), and each thread
+// formats records into its own per-bucket buffers.  A full buffer is appended
+// to its bucket under the bucket's lock, so records of the same key, which are
+// on the same page, keep their order.
+class MdbmSplitFile : public SplitFile
+{
+public:
+    MdbmSplitFile(uint32_t hashCode, BucketFiles *buckFiles, BinBucketFiles *binBuckFiles,
+                  bool cdb, int nthreads);
+    ~MdbmSplitFile();
+    void split(string &srcfile);
+
+private:
+    static int splitRecord(void *user, const mdbm_iterate_info_t *info, const kvpair *kv);
+    int  addRecord(SplitBuffers *sb, const kvpair &kv);
+    int  flush(SplitBuffers *sb, int buckIndex);
+
+    BinBucketFiles         *_binBuckFiles; // NULL unless the buckets are bindump
+    bool                    _cdb;
+    int                     _nthreads;
+    pthread_key_t           _key;
+    pthread_mutex_t         _mutex;        // guards _buffers and _failed
+    vector<SplitBuffers*>   _buffers;
+    vector<pthread_mutex_t> _bucketLocks;
+    bool                    _failed;
+};
+
 string DbDumpSplitFile::DbDumpHeaderFields = "format type mdbm_pagesize mdbm_pagecount HEADER";
 
+// Returns true if the line holds one of the db_dump header fields.
+bool DbDumpSplitFile::isHeaderLine(const string &line)
+{
+    stringstream hdrs(DbDumpHeaderFields);
+    while (hdrs)
+    {
+        string field;
+        hdrs >> field;
+        if (field.empty() == false && line.find(field) != string::npos)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 // split given file
 void DbDumpSplitFile::split(string &srcfile)
 {
@@ -364,21 +557,7 @@ void DbDumpSplitFile::split(string &srcfile)
         if (noMoreHeader == false)
         {
             // check for header fields and throw away
-            bool checkMoreHeader = false;
-
-            stringstream hdrs(DbDumpHeaderFields);
-            while (hdrs)
-            {
-                string field;
-                hdrs >> field;
-                if (field.empty() == false && line.find(field) != string::npos)
-                {
-                    // found a header so jump past it
-                    checkMoreHeader = true;
-                    break;
-                }
-            }
-            if (checkMoreHeader)
+            if (isHeaderLine(line))
             {
                 continue; // devoured a header field, continue to check for more
             }
@@ -404,7 +583,7 @@ void DbDumpSplitFile::split(string &srcfile)
             }
         }
 
-        hashAndSend(key, keyline, valline, cnt, srcfile);
+        hashAndSend(key, keyline, valline, true, cnt, srcfile);
     }
 }
 void CdbSplitFile::split(string &srcfile)
@@ -440,8 +619,595 @@ void CdbSplitFile::split(string &srcfile)
             continue;
         }
 
-        hashAndSend(key, keyLine, valLine, cnt, srcfile);
+        hashAndSend(key, keyLine, valLine, false, cnt, srcfile);
+    }
+}
+
+// Records are copied to their bucket as they are, without any text to parse.
+int BinSplitFile::splitRecord(void *user, const kvpair *kv)
+{
+    BinSplitFile *self = static_cast<BinSplitFile*>(user);
+    int buckIndex = self->bucketIndex(kv->key);
+    if (buckIndex == -1)
+    {
+        cerr << "BinSplitFile: ERROR: Cannot get mdbm_get_hash_value"
+             << ", key-size=" << kv->key.dsize
+             << endl;
+        return 0;
+    }
+    return self->_binBuckFiles->sendRecord(buckIndex, *kv) == -1 ? 1 : 0;
+}
+void BinSplitFile::split(string &srcfile)
+{
+    FILE *fp = fopen(srcfile.c_str(), "r");
+    if (fp == NULL)
+    {
+        cerr << "BinSplitFile: ERROR: Cannot open source file"
+             << ", file=" << srcfile
+             << ", errno=" << errno
+             << endl;
+        return;
+    }
+    if (mdbm_bindump_import_header(fp, NULL, NULL, NULL, NULL) == -1)
+    {
+        cerr << "BinSplitFile: ERROR: Not a bindump file"
+             << ", file=" << srcfile
+             << endl;
+    }
+    // the bucket writers aren't thread-safe, so records are taken one at a time
+    else if (mdbm_bindump_read(fp, srcfile.c_str(), 1, splitRecord, this) != 0)
+    {
+        cerr << "BinSplitFile: ERROR: Failed to split source file"
+             << ", file=" << srcfile
+             << endl;
+    }
+    fclose(fp);
+}
+
+// Bytes of source file read per pipeline batch
+static const size_t SplitBatchSize = 1024 * 1024;
+
+// Flush a thread's buffer for a bucket when it holds this much (see MdbmSplitFile)
+static const uint32_t SplitFlushSize = 64 * 1024;
+
+static int
+threadCount(int nthreads)
+{
+    if (nthreads <= 0)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? int(ncpu) : 1;
+    }
+    return nthreads;
+}
+
+PipelineSplitFile::PipelineSplitFile(uint32_t hashCode, BucketFiles *buckFiles, bool cdb, int nthreads) :
+    SplitFile(hashCode, buckFiles), _cdb(cdb), _nthreads(threadCount(nthreads)),
+    _inflight(0), _nextSeq(0), _committed(0), _done(false)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+PipelineSplitFile::~PipelineSplitFile()
+{
+    pthread_mutex_lock(&_mutex);
+    _done = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    for (size_t i = 0; i < _threads.size(); ++i)
+    {
+        pthread_join(_threads[i], NULL);
+    }
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+// Returns the length of the whole records at the start of data, and the number
+// of lines they span in *lines.  Empty lines between records are skipped.
+size_t PipelineSplitFile::recordsEnd(const char *data, size_t len, int *lines)
+{
+    const char *end    = data + len;
+    const char *recEnd = data;
+    const char *nl;
+    bool        atKey  = true;
+    int         cnt    = 0;
+
+    *lines = 0;
+    for (const char *p = data; (nl = (const char*)memchr(p, '\n', end - p)) != NULL; p = nl + 1)
+    {
+        ++cnt;
+        if (atKey && nl == p)
+        {
+            recEnd = nl + 1;
+            *lines = cnt;
+        }
+        else if (_cdb || !atKey)
+        {
+            recEnd = nl + 1;
+            *lines = cnt;
+            atKey  = true;
+        }
+        else
+        {
+            atKey = false; // db_dump value line follows
+        }
+    }
+    return recEnd - data;
+}
+
+// Throw away the db_dump header lines, leaving the first record line in carry.
+// Returns false at the end of the file.
+bool PipelineSplitFile::skipHeader(FILE *fp, string &carry, int *lines)
+{
+    char   *buf  = NULL;
+    size_t  size = 0;
+    ssize_t got;
+    while ((got = getline(&buf, &size, fp)) != -1)
+    {
+        ++*lines;
+        string line(buf, got);
+        if (line[got - 1] == '\n')
+        {
+            line.resize(got - 1);
+        }
+        if (line.empty() || DbDumpSplitFile::isHeaderLine(line))
+        {
+            continue;
+        }
+        carry.assign(buf, got);
+        --*lines; // counted again with the record
+        break;
+    }
+    free(buf);
+    return got != -1;
+}
+
+void PipelineSplitFile::split(string &srcfile)
+{
+    FILE *fp = fopen(srcfile.c_str(), "r");
+    if (fp == NULL)
+    {
+        cerr << "PipelineSplitFile: ERROR: Cannot open source file"
+             << ", file=" << srcfile
+             << ", errno=" << errno
+             << endl;
+        return;
+    }
+    while (int(_threads.size()) < _nthreads)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, this) != 0)
+        {
+            break;
+        }
+        _threads.push_back(tid);
+    }
+    if (_threads.empty())
+    {
+        // no workers: split this thread's batches below on this thread
+        _nthreads = 0;
+    }
+
+    int    lineCnt = 0;
+    string carry;
+    bool   eof = (_cdb == false && skipHeader(fp, carry, &lineCnt) == false);
+    while (!eof)
+    {
+        SplitBatch *batch = new SplitBatch;
+        batch->fname     = srcfile;
+        batch->firstLine = lineCnt;
+        batch->data.swap(carry);
+
+        size_t have = batch->data.size();
+        batch->data.resize(have + SplitBatchSize);
+        size_t got = fread(&batch->data[have], 1, SplitBatchSize, fp);
+        batch->data.resize(have + got);
+        eof = (got < SplitBatchSize);
+
+        int lines = 0;
+        if (eof)
+        {
+            // the last line may not end with a newline
+            if (!batch->data.empty() && batch->data[batch->data.size() - 1] != '\n')
+            {
+                batch->data += '\n';
+            }
+        }
+        else
+        {
+            size_t end = recordsEnd(batch->data.data(), batch->data.size(), &lines);
+            carry.assign(batch->data, end, string::npos);
+            batch->data.resize(end);
+        }
+        lineCnt += lines;
+
+        if (batch->data.empty())
+        {
+            delete batch; // no whole record yet, read more
+        }
+        else if (_nthreads == 0)
+        {
+            splitBatch(batch);
+            for (int index = 0; index < buckets()->count(); ++index)
+            {
+                buckets()->sendLines(index, batch->out[index].data(), batch->out[index].size());
+            }
+            delete batch;
+        }
+        else
+        {
+            submit(batch);
+        }
+    }
+    if (ferror(fp))
+    {
+        cerr << "PipelineSplitFile: ERROR: Failed to read source file"
+             << ", file=" << srcfile
+             << endl;
+    }
+    fclose(fp);
+}
+
+void PipelineSplitFile::submit(SplitBatch *batch)
+{
+    pthread_mutex_lock(&_mutex);
+    // bound the memory held by batches waiting for (or in) the workers
+    while (_inflight >= size_t(2 * _nthreads))
+    {
+        pthread_cond_wait(&_cond, &_mutex);
+    }
+    batch->seq = _nextSeq++;
+    ++_inflight;
+    _queue.push_back(batch);
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void* PipelineSplitFile::worker(void *arg)
+{
+    PipelineSplitFile *self = static_cast<PipelineSplitFile*>(arg);
+
+    pthread_mutex_lock(&self->_mutex);
+    for (;;)
+    {
+        while (self->_queue.empty() && !self->_done)
+        {
+            pthread_cond_wait(&self->_cond, &self->_mutex);
+        }
+        if (self->_queue.empty())
+        {
+            break;
+        }
+        SplitBatch *batch = self->_queue.front();
+        self->_queue.pop_front();
+        pthread_mutex_unlock(&self->_mutex);
+
+        self->splitBatch(batch);
+
+        // wait for the batches before this one to be appended
+        pthread_mutex_lock(&self->_mutex);
+        while (self->_committed != batch->seq)
+        {
+            pthread_cond_wait(&self->_cond, &self->_mutex);
+        }
+        pthread_mutex_unlock(&self->_mutex);
+        for (int index = 0; index < self->buckets()->count(); ++index)
+        {
+            if (!batch->out[index].empty())
+            {
+                self->buckets()->sendLines(index, batch->out[index].data(), batch->out[index].size());
+            }
+        }
+        delete batch;
+
+        pthread_mutex_lock(&self->_mutex);
+        ++self->_committed;
+        --self->_inflight;
+        pthread_cond_broadcast(&self->_cond);
+    }
+    pthread_mutex_unlock(&self->_mutex);
+    return NULL;
+}
+
+// Hash each record of the batch, and add its lines to the output of its bucket.
+void PipelineSplitFile::splitBatch(SplitBatch *batch)
+{
+    const char *data = batch->data.data();
+    const char *end  = data + batch->data.size();
+    int         cnt  = batch->firstLine;
+
+    batch->out.resize(buckets()->count());
+    for (const char *p = data; p < end;)
+    {
+        const char *nl = (const char*)memchr(p, '\n', end - p); // every line ends with one
+        ++cnt;
+        if (nl == p)
+        {
+            p = nl + 1;
+            continue;
+        }
+
+        datum       key;
+        const char *recEnd = nl + 1;
+        if (_cdb)
+        {
+            // ex cdb format: +8,8:HHHHHHH7->HHHHHHH7
+            const char *pos  = (const char*)memchr(p, ':', nl - p);
+            const char *pos2 = (const char*)memmem(p, nl - p, "->", 2);
+            if (pos == NULL || pos2 == NULL)
+            {
+                ostringstream msg;
+                msg << "PipelineSplitFile: ERROR: Mal-formed cdb syntax"
+                    << ", file=" << batch->fname
+                    << ", line-number=" << cnt
+                    << ", line-size=" << (nl - p)
+                    << endl;
+                cerr << msg.str();
+                p = recEnd;
+                continue;
+            }
+            // as CdbSplitFile does, a key without "->" after it runs to the end of the line
+            key.dptr  = const_cast<char*>(pos + 1);
+            key.dsize = (pos2 > pos ? pos2 : nl) - (pos + 1);
+        }
+        else
+        {
+            // db_dump format: a key line, then a value line
+            if (recEnd == end)
+            {
+                ostringstream msg;
+                msg << "PipelineSplitFile: ERROR: Mal-formed db_dump syntax"
+                    << ", file=" << batch->fname
+                    << ", line-number=" << cnt
+                    << ", line-size=" << (nl - p)
+                    << endl;
+                cerr << msg.str();
+                break;
+            }
+            key.dptr  = const_cast<char*>(p);
+            key.dsize = nl - p;
+            recEnd    = (const char*)memchr(recEnd, '\n', end - recEnd) + 1;
+            ++cnt;
+        }
+
+        int buckIndex = bucketIndex(key);
+        if (buckIndex == -1)
+        {
+            ostringstream msg;
+            msg << "PipelineSplitFile: ERROR: Cannot get mdbm_get_hash_value"
+                << ", key-size=" << key.dsize
+                << ", file=" << batch->fname
+                << ", line-number=" << cnt
+                << endl;
+            cerr << msg.str();
+        }
+        else
+        {
+            batch->out[buckIndex].append(p, recEnd - p);
+        }
+        p = recEnd;
+    }
+}
+
+
+MdbmSplitFile::MdbmSplitFile(uint32_t hashCode, BucketFiles *buckFiles, BinBucketFiles *binBuckFiles,
+                             bool cdb, int nthreads) :
+    SplitFile(hashCode, buckFiles), _binBuckFiles(binBuckFiles), _cdb(cdb),
+    _nthreads(nthreads), _bucketLocks(buckFiles->count()), _failed(false)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    for (size_t index = 0; index < _bucketLocks.size(); ++index)
+    {
+        pthread_mutex_init(&_bucketLocks[index], NULL);
+    }
+}
+MdbmSplitFile::~MdbmSplitFile()
+{
+    for (size_t index = 0; index < _bucketLocks.size(); ++index)
+    {
+        pthread_mutex_destroy(&_bucketLocks[index]);
     }
+    pthread_mutex_destroy(&_mutex);
+}
+
+// Append a thread's buffer for a bucket to the bucket file.
+int MdbmSplitFile::flush(SplitBuffers *sb, int buckIndex)
+{
+    const char *buf = sb->bufs[buckIndex];
+    uint32_t    len = sb->lens[buckIndex];
+    int         ret = 0;
+
+    pthread_mutex_lock(&_bucketLocks[buckIndex]);
+    if (_binBuckFiles == NULL)
+    {
+        ret = buckets()->sendLines(buckIndex, buf, len);
+    }
+    else
+    {
+        // records are the key and value lengths, then the key and the value
+        for (uint32_t off = 0; off < len && ret != -1;)
+        {
+            kvpair kv;
+            memcpy(&kv.key.dsize, buf + off, sizeof(kv.key.dsize));
+            memcpy(&kv.val.dsize, buf + off + sizeof(kv.key.dsize), sizeof(kv.val.dsize));
+            off += sizeof(kv.key.dsize) + sizeof(kv.val.dsize);
+            kv.key.dptr = const_cast<char*>(buf + off);
+            kv.val.dptr = kv.key.dptr + kv.key.dsize;
+            off += kv.key.dsize + kv.val.dsize;
+            ret = _binBuckFiles->sendRecord(buckIndex, kv);
+        }
+    }
+    pthread_mutex_unlock(&_bucketLocks[buckIndex]);
+    sb->lens[buckIndex] = 0;
+    return ret == -1 ? -1 : 0;
+}
+
+int MdbmSplitFile::addRecord(SplitBuffers *sb, const kvpair &kv)
+{
+    int buckIndex;
+    if (_binBuckFiles != NULL || _cdb)
+    {
+        if ((buckIndex = bucketIndex(kv.key)) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        // db_dump source files are split by the hash of their (escaped) key
+        // lines: escape the record first, and hash its first line
+        uint32_t    len = 0;
+        int         scratch = buckets()->count();
+        if (mdbm_dbdump_add_record(kv, &len, &sb->bufs[scratch], &sb->sizes[scratch], 0) == -1)
+        {
+            return -1;
+        }
+        datum line;
+        line.dptr  = sb->bufs[scratch];
+        line.dsize = (const char*)memchr(line.dptr, '\n', len) - line.dptr;
+        if ((buckIndex = bucketIndex(line)) == -1)
+        {
+            return -1;
+        }
+        uint32_t off = sb->lens[buckIndex];
+        if (off + len > sb->sizes[buckIndex])
+        {
+            uint32_t size = off + len + SplitFlushSize;
+            char    *buf  = (char*)realloc(sb->bufs[buckIndex], size);
+            if (buf == NULL)
+            {
+                return -1;
+            }
+            sb->bufs[buckIndex]  = buf;
+            sb->sizes[buckIndex] = size;
+        }
+        memcpy(sb->bufs[buckIndex] + off, line.dptr, len);
+        sb->lens[buckIndex] += len;
+    }
+
+    if (_cdb)
+    {
+        if (mdbm_cdbdump_add_record(kv, &sb->lens[buckIndex], &sb->bufs[buckIndex],
+                                    &sb->sizes[buckIndex], sb->lens[buckIndex]) == -1)
+        {
+            return -1;
+        }
+    }
+    else if (_binBuckFiles != NULL)
+    {
+        uint32_t off = sb->lens[buckIndex];
+        uint32_t len = sizeof(kv.key.dsize) + sizeof(kv.val.dsize) + kv.key.dsize + kv.val.dsize;
+        if (off + len > sb->sizes[buckIndex])
+        {
+            uint32_t size = off + len + SplitFlushSize;
+            char    *buf  = (char*)realloc(sb->bufs[buckIndex], size);
+            if (buf == NULL)
+            {
+                return -1;
+            }
+            sb->bufs[buckIndex]  = buf;
+            sb->sizes[buckIndex] = size;
+        }
+        char *p = sb->bufs[buckIndex] + off;
+        memcpy(p, &kv.key.dsize, sizeof(kv.key.dsize));
+        p += sizeof(kv.key.dsize);
+        memcpy(p, &kv.val.dsize, sizeof(kv.val.dsize));
+        p += sizeof(kv.val.dsize);
+        memcpy(p, kv.key.dptr, kv.key.dsize);
+        memcpy(p + kv.key.dsize, kv.val.dptr, kv.val.dsize);
+        sb->lens[buckIndex] += len;
+    }
+
+    if (sb->lens[buckIndex] >= SplitFlushSize)
+    {
+        return flush(sb, buckIndex);
+    }
+    return 0;
+}
+
+int MdbmSplitFile::splitRecord(void *user, const mdbm_iterate_info_t *info, const kvpair *kv)
+{
+    MdbmSplitFile *self = static_cast<MdbmSplitFile*>(user);
+    SplitBuffers  *sb;
+
+    if (info->i_entry.entry_flags & MDBM_ENTRY_DELETED)
+    {
+        return 0;
+    }
+    if ((sb = static_cast<SplitBuffers*>(pthread_getspecific(self->_key))) == NULL)
+    {
+        // one buffer per bucket, and one more to escape db_dump records in
+        int cnt = self->buckets()->count() + 1;
+        sb = new SplitBuffers;
+        sb->bufs.resize(cnt, static_cast<char*>(NULL));
+        sb->sizes.resize(cnt, 0);
+        sb->lens.resize(cnt, 0);
+        pthread_mutex_lock(&self->_mutex);
+        self->_buffers.push_back(sb);
+        pthread_mutex_unlock(&self->_mutex);
+        pthread_setspecific(self->_key, sb);
+    }
+    if (self->addRecord(sb, *kv) == -1)
+    {
+        cerr << "MdbmSplitFile: ERROR: Failed to split record"
+             << ", key-size=" << kv->key.dsize
+             << ", errno=" << errno
+             << endl;
+        pthread_mutex_lock(&self->_mutex);
+        self->_failed = true;
+        pthread_mutex_unlock(&self->_mutex);
+        return 1;
+    }
+    return 0;
+}
+
+void MdbmSplitFile::split(string &srcfile)
+{
+    MDBM *db = mdbm_open(srcfile.c_str(), MDBM_O_RDONLY | MDBM_ANY_LOCKS, 0, 0, 0);
+    if (db == NULL)
+    {
+        cerr << "MdbmSplitFile: ERROR: Cannot open source MDBM"
+             << ", file=" << srcfile
+             << ", errno=" << errno
+             << endl;
+        return;
+    }
+    if (pthread_key_create(&_key, NULL) != 0)
+    {
+        cerr << "MdbmSplitFile: ERROR: Cannot create thread key" << endl;
+        mdbm_close(db);
+        return;
+    }
+
+    int ret = mdbm_iterate_parallel(db, _nthreads, splitRecord, MDBM_ITERATE_ENTRIES, this);
+
+    // The workers are gone: write out what they left behind.
+    for (size_t index = 0; index < _buffers.size(); ++index)
+    {
+        SplitBuffers *sb = _buffers[index];
+        for (int buckIndex = 0; buckIndex < buckets()->count(); ++buckIndex)
+        {
+            if (sb->lens[buckIndex] && !_failed && flush(sb, buckIndex) == -1)
+            {
+                _failed = true;
+            }
+        }
+        for (size_t buf = 0; buf < sb->bufs.size(); ++buf)
+        {
+            free(sb->bufs[buf]);
+        }
+        delete sb;
+    }
+    _buffers.clear();
+    pthread_key_delete(_key);
+
+    if (ret != 0 || _failed)
+    {
+        cerr << "MdbmSplitFile: ERROR: Failed to split source MDBM"
+             << ", file=" << srcfile
+             << endl;
+    }
+    mdbm_close(db);
 }
 
 
@@ -460,6 +1226,67 @@ BucketFiles::BucketFiles(int bucketCnt, const string &outputDir, const string &o
         _buckFiles[index] = new BucketFile(ssname.str());
     }
 }
+BinBucketFiles::BinBucketFiles(int bucketCnt, const string &outputDir, const string &outFilePrefix) :
+    BucketFiles(bucketCnt, outputDir, outFilePrefix),
+    _fps(bucketCnt, static_cast<FILE*>(NULL)),
+    _writers(bucketCnt, static_cast<mdbm_bindump_writer_t*>(NULL))
+{}
+BinBucketFiles::~BinBucketFiles()
+{
+    for (int index = 0; index < _bucketCnt; ++index)
+    {
+        if (_writers[index] && mdbm_bindump_writer_close(_writers[index]) == -1)
+        {
+            cerr << "BinBucketFiles: ERROR: Failed to finish bucket file"
+                 << ", file-name=" << _buckFiles[index]->fileName()
+                 << ", errno=" << errno
+                 << endl;
+        }
+        if (_fps[index])
+        {
+            fclose(_fps[index]);
+        }
+    }
+}
+/**
+  Given the bucketIndex, add the record to the appropriate bindump bucket file,
+  creating it on first use.
+**/
+int
+BinBucketFiles::sendRecord(int buckIndex, const kvpair &kv)
+{
+    if (buckIndex < 0 || buckIndex >= _bucketCnt)
+    {
+        cerr << "BinBucketFiles: ERROR: sendRecord: Failed to write record"
+             << " due to bad index."
+             << ", bucket-index=" << buckIndex
+             << ", maximum-number-buckets=" << _bucketCnt
+             << endl;
+        return -1;
+    }
+    if (_writers[buckIndex] == NULL)
+    {
+        string fname = _buckFiles[buckIndex]->fileName();
+        if ((_fps[buckIndex] = fopen(fname.c_str(), "w")) == NULL
+            || (_writers[buckIndex] = mdbm_bindump_writer_open(_fps[buckIndex], 0, 0, 0, -1, 0)) == NULL)
+        {
+            cerr << "BinBucketFiles: ERROR: Failed to open bucket file"
+                 << ", file-name=" << fname
+                 << ", errno=" << errno
+                 << endl;
+            return -1;
+        }
+    }
+    if (mdbm_bindump_writer_add(_writers[buckIndex], kv) == -1)
+    {
+        cerr << "BinBucketFiles: ERROR: Failed to write record to bucket"
+             << ", bucket-file=" << _buckFiles[buckIndex]->fileName()
+             << ", errno=" << errno
+             << endl;
+        return -1;
+    }
+    return 0;
+}
 CdbBucketFiles::~CdbBucketFiles()
 {
     CdbFinalizeFile cdbff;
@@ -509,10 +1336,33 @@ BucketFiles::sendToBucket(int buckIndex, string &keyLine, string &valueLine, int
     }
     return ret;
 }
+/**
+  Append whole lines (each ending with '\n') to the bucket file, as they are.
+**/
+int
+BucketFiles::sendLines(int buckIndex, const char *lines, size_t len)
+{
+    if (buckIndex < 0 || buckIndex >= _bucketCnt || !_buckFiles[buckIndex])
+    {
+        cerr << "BucketFiles: ERROR: sendLines: Failed to write lines"
+             << " due to bad index."
+             << ", bucket-index=" << buckIndex
+             << ", maximum-number-buckets=" << _bucketCnt
+             << endl;
+        return -1;
+    }
+    return _buckFiles[buckIndex]->write(lines, len);
+}
 
 
 int
 BucketFile::write(string &line)
+{
+    line += "\n";
+    return write(line.c_str(), line.size());
+}
+int
+BucketFile::write(const char *data, size_t len)
 {
     if (open() == -1) // open the bucket file if not yet created or opened
     {
@@ -522,12 +1372,26 @@ BucketFile::write(string &line)
         return -1;
     }
 
-    line += "\n";
-
-    int ret      = -1;
-    int maxTries = 3;
-    for (int cnt = 0; cnt < maxTries && (ret = ::write(_fd, line.c_str(), line.size())) == -1; ++cnt)
+    _buf.append(data, len);
+    if (_buf.size() < BucketBufferSize)
     {
+        return len;
+    }
+    return flush() == -1 ? -1 : int(len);
+}
+int
+BucketFile::flush()
+{
+    size_t done     = 0;
+    int    maxTries = 3;
+    for (int cnt = 0; done < _buf.size() && cnt < maxTries;)
+    {
+        ssize_t ret = ::write(_fd, _buf.data() + done, _buf.size() - done);
+        if (ret != -1)
+        {
+            done += ret;
+            continue;
+        }
         int errnum = errno;
         if (errnum == EAGAIN)
         {
@@ -535,6 +1399,7 @@ BucketFile::write(string &line)
                  << ", bucket-file=" << _fqname
                  << ", try-count=" << cnt
                  << endl;
+            ++cnt;
         }
         else
         {
@@ -543,17 +1408,21 @@ BucketFile::write(string &line)
                  << ", errno=" << errnum
                  << ", fd=" << _fd
                  << endl;
-            return ret;
+            _buf.clear();
+            return -1;
         }
     }
-    if (ret == -1)
+    if (done < _buf.size())
     {
         cerr << "BucketFile: ERROR: Failed to write line to bucket"
              << ", bucket-file=" << _fqname
              << ", fd=" << _fd
              << endl;
+        _buf.clear();
+        return -1;
     }
-    return ret;
+    _buf.clear();
+    return 0;
 }
 int
 BucketFile::open()
@@ -582,6 +1451,7 @@ BucketFile::close() // close file
 {
     if (_fd != -1)
     {
+        flush();
         ::close(_fd);
     }
     _fd = -1;
@@ -660,7 +1530,37 @@ main(int argc, char **argv)
     }
 
     SplitFile *fileSplitter;
-    if (CdbFlag)
+    if (MdbmFlag)
+    {
+        BinBucketFiles *binBuckFiles = NULL;
+        BucketFiles    *buckFiles;
+        if (BinFlag)
+        {
+            buckFiles = binBuckFiles = new BinBucketFiles(BuckCnt, OutputDir, SrcFilePrefix);
+        }
+        else if (CdbFlag)
+        {
+            buckFiles = new CdbBucketFiles(BuckCnt, OutputDir, SrcFilePrefix);
+        }
+        else
+        {
+            buckFiles = new BucketFiles(BuckCnt, OutputDir, SrcFilePrefix);
+        }
+        fileSplitter = new MdbmSplitFile(HashCode, buckFiles, binBuckFiles, CdbFlag,
+                                         Threads < 0 ? 0 : Threads);
+    }
+    else if (BinFlag)
+    {
+        BinBucketFiles *buckFiles = new BinBucketFiles(BuckCnt, OutputDir, SrcFilePrefix);
+        fileSplitter = new BinSplitFile(HashCode, buckFiles);
+    }
+    else if (Threads >= 0)
+    {
+        BucketFiles *buckFiles = CdbFlag ? new CdbBucketFiles(BuckCnt, OutputDir, SrcFilePrefix)
+                                         : new BucketFiles(BuckCnt, OutputDir, SrcFilePrefix);
+        fileSplitter = new PipelineSplitFile(HashCode, buckFiles, CdbFlag, Threads);
+    }
+    else if (CdbFlag)
     {
         BucketFiles *buckFiles = new CdbBucketFiles(BuckCnt, OutputDir, SrcFilePrefix);
         fileSplitter = new CdbSplitFile(HashCode, buckFiles);
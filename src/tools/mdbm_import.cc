@@ -25,6 +25,9 @@ usage()
     fprintf(stderr, 
 "usage: mdbm_import [options] outfile.mdbm\n"
 "  -3           Create V3 DB\n"
+"  -b           Input is in binary bindump format (default db_dump)\n"
+"  -B           Bulk build: sort the records by page and write each page once.\n"
+"               The DB must be new or truncated (-Z).\n"
 "  -c           Input is in cdbdump format (default db_dump)\n"
 "  -D           Delete keys with zero-length values.\n"
 "  -d dbsize    Create DB with initial <dbsize> DB size.\n"
@@ -35,6 +38,10 @@ usage()
 "  -l           Create DB with Large Object support\n"
 "  -L locking   Specify the type of locking to use:\n"
 lockstr_to_flags_usage("                 ")
+"  -M memsize   With -B, memory for buffering records before they spill to $TMPDIR.\n"
+"               Suffix k/m/g may be used to override default of m (default 256m).\n"
+"  -n threads   With -b, number of threads decoding and storing (default: one per CPU).\n"
+"               Records are stored in no particular order with more than one thread.\n"
 "  -p pgsize    Create DB with page size.\n"
 "               Suffix k/m/g may be used to override default of bytes.\n"
 "  -s hash      Create DB with <hash> hash function\n"
@@ -62,6 +69,7 @@ static char inputFile[PATH_MAX + 1];
 static char *mdbmFile;
 static int opt_delete_zero = 0;
 static int lineno = 1;
+static mdbm_bulk_t *bulk = NULL;
 
 static void
 err_readformat(char badchar, int linenum)
@@ -104,61 +112,20 @@ dbload_header(FILE *fp, int *pgsize, int *pgcount, int *large)
     return 0;
 }
 
-inline char
-x2c(int c1, int c2)
-{
-    int digit =
-        (((c1 >= 'A') ? ((c1 & 0xdf) - 'A') + 10 : (c1 - '0')) << 4)
-        | ((c2 >= 'A' ? ((c2 & 0xdf) - 'A') + 10 : (c2 - '0')));
-    return (char)digit;
-}
-
-inline int
-read_str(FILE *fp, std::string &str)
-{
-    int ch, ch2, ch3;
-
-    str.erase();
-
-    for (;;) {
-        ch = getc(fp);
-        switch(ch) {
-        case '\n':
-            return 0;
-        case EOF:
-            return EOF;
-        case '\\':
-            ch2 = getc(fp);
-            if (ch2 == '\\') {
-                str.append((size_t)1, '\\');
-            }
-            else {
-                if (ch2 != '\n') {
-                    // expect two hex characters
-                    ch3 = getc(fp);
-                    if (isxdigit(ch2) && isxdigit(ch3)) {
-                        str.append((size_t)1, x2c(ch2, ch3));
-                    }
-                    else {
-                        fprintf(stderr, "Bad input escape format, mdbm=%s, inputFile=%s, line=%d\n",
-                                mdbmFile, inputFile, lineno);
-                        return -2;
-                    }
-                }
-            }
-            break;
-        default:
-            str.append((size_t)1, ch);
-        }
-    }
-    /*NOTREACHED*/
-}
-
 static int
 store(MDBM *db, datum key, datum val, int store_flag)
 {
     int rc = 0, lock_ret = 1;
 
+    if (bulk) {
+        if (mdbm_bulk_add(bulk, key, val) != 0) {
+            fprintf(stderr, "Cannot add record, mdbm=%s, inputFile=%s, line=%d, errno=%s\n",
+                    mdbmFile, inputFile, lineno, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
     if ((lock_ret = mdbm_lock_smart(db, &key, MDBM_O_RDWR)) == -1) {
         fprintf(stderr, "Cannot acquire smart lock, mdbm=%s, inputFile=%s, line=%d, errno=%s\n",
                 mdbmFile, inputFile, lineno, strerror(errno));
@@ -196,46 +163,28 @@ store(MDBM *db, datum key, datum val, int store_flag)
     return rc;
 }
 
+struct dbload {
+    MDBM *db;
+    int store_flag;
+};
+
 static int
-do_dbload(MDBM *db, FILE *fp, int store_flag)
+dbload_record(void *user, const kvpair *kv)
 {
-    std::string keybuf(""), valbuf("");
-    datum key, val;
-    int status;
-
-    for (;; lineno++) {
-        if ((status = read_str(fp, keybuf)) != 0) {
-            if (status == EOF)
-                break;
-            else
-                return -2;
-        }
-
-        if (keybuf.size() == 0) {
-            fprintf(stderr, "Bad (zero) key length, mdbm=%s, inputFile=%s, line=%d\n",
-                    mdbmFile, inputFile, lineno);
-            return -2;
-        }
+    struct dbload *ld = (struct dbload *) user;
+    int rc = store(ld->db, kv->key, kv->val, ld->store_flag);
 
-        if ((status = read_str(fp, valbuf)) != 0) {
-            if (status == EOF)
-                fprintf(stderr, "Unexpected EOF, mdbm=%s, inputFile=%s, line=%d\n",
-                        mdbmFile, inputFile, lineno);
-            return -2;
-        }
-
-        key.dptr = (char*) keybuf.data();
-        key.dsize = keybuf.size();
-
-        val.dptr = (char*) valbuf.data();
-        val.dsize = valbuf.size();
+    lineno++;
+    return (rc == -1) ? -3 : 0;
+}
 
-        if (store(db, key, val, store_flag) == -1) {
-            return -3;
-        }
-    }
+static int
+do_dbload(MDBM *db, FILE *fp, int store_flag)
+{
+    struct dbload ld = { db, store_flag };
+    uint32_t line = lineno;
 
-    return 0;
+    return mdbm_dbdump_read(fp, inputFile, &line, dbload_record, &ld);
 }
 
 static int
@@ -368,6 +317,17 @@ do_cdbmake(MDBM *db, FILE *fp, int store_flag)
     return 0;
 }
 
+static int
+bulk_add_record(void *user, const kvpair *kv)
+{
+    if (mdbm_bulk_add((mdbm_bulk_t*)user, kv->key, kv->val) != 0) {
+        fprintf(stderr, "Cannot add record, mdbm=%s, inputFile=%s, errno=%s\n",
+                mdbmFile, inputFile, strerror(errno));
+        return -3;
+    }
+    return 0;
+}
+
 int
 main(int argc, char** argv)
 {
@@ -376,6 +336,11 @@ main(int argc, char** argv)
     int opt_help = 0;
     int opt_fast = 0;
     int opt_cdbdump = 0;
+    int opt_bindump = 0;
+    int opt_bulk = 0;
+    uint64_t opt_bulk_mem = 0;
+    int opt_threads = 0;
+    int bindump_hash = -1;
     char *opt_infile = NULL;
     int flags = MDBM_O_RDWR|MDBM_O_CREAT;
     int opt_header = 1;
@@ -388,9 +353,10 @@ main(int argc, char** argv)
     int opt_version = 0;
     int opt_trunc = 0;
     opt_delete_zero = 0; // reset here to be unit-test friendly
+    bulk = NULL;
     bool locking_requested = false;
 
-    while ((c = getopt(argc, argv, "3hi:lL:p:d:DfcTs:S:y:z:Z")) != EOF) {
+    while ((c = getopt(argc, argv, "3bBhi:lL:M:n:p:d:DfcTs:S:y:z:Z")) != EOF) {
         switch (c) {
         case '3':
             opt_version = MDBM_CREATE_V3;
@@ -403,9 +369,21 @@ main(int argc, char** argv)
             flags |= MDBM_OPEN_NOLOCK;
             opt_fast = 1;
             break;
+        case 'b':
+            opt_bindump = 1;
+            break;
+        case 'B':
+            opt_bulk = 1;
+            break;
         case 'c':
             opt_cdbdump = 1;
             break;
+        case 'M':
+            opt_bulk_mem = mdbm_util_get_size(optarg, 1024*1024);
+            break;
+        case 'n':
+            opt_threads = atoi(optarg);
+            break;
         case 'T':
             opt_header = 0;
             break;
@@ -469,6 +447,16 @@ main(int argc, char** argv)
         return 1;
     }
 
+    if (opt_bindump && (opt_cdbdump || !opt_header || opt_delete_zero)) {
+        fprintf(stderr, "Option -b is not compatible with -c, -D or -T\n");
+        return 1;
+    }
+
+    if (opt_bulk && (opt_delete_zero || opt_store_flag == MDBM_MODIFY)) {
+        fprintf(stderr, "Option -B is not compatible with -D or -S 3\n");
+        return 1;
+    }
+
     if (flags & MDBM_OPEN_NOLOCK) {
       locking_requested = true;
       opt_fast = 0;
@@ -500,12 +488,31 @@ main(int argc, char** argv)
         strncpy(inputFile, "stdin", sizeof(inputFile) - 1);
     }
 
+    /* Buffer input a little more */
+    setvbuf(fp, NULL, _IOFBF, BUFSIZ * 16);
+
 
     mdbmFile = argv[optind];
 
     int pagesize = 0;
     uint64_t dbsize = 0;
-    if (!opt_cdbdump && opt_header) {
+    if (opt_bindump) {
+        int pgsize = 0, pgcount = 0, large = 0;
+
+        if (mdbm_bindump_import_header(fp, &pgsize, &pgcount, &large, &bindump_hash) != 0) {
+            fprintf(stderr, "Bad bindump header, mdbm=%s, inputFile=%s\n", mdbmFile, inputFile);
+            fclose(fp);
+            return(1);
+        }
+
+        if (pgcount > 0 && pgsize > 0) {
+            pagesize = pgsize;
+            dbsize = (uint64_t)pgcount * pgsize;
+        }
+
+        if (large)
+            flags |= MDBM_LARGE_OBJECTS;
+    } else if (!opt_cdbdump && opt_header) {
         int pgsize = -1, pgcount = -1, large = 0;
 
         if (dbload_header(fp, &pgsize, &pgcount, &large) != 0) {
@@ -584,11 +591,31 @@ main(int argc, char** argv)
             fprintf(stderr, "Unknown hash function, hashId=%d, mdbm=%s\n", opt_hashfnid, mdbmFile);
             return(1);
         }
+    } else if (bindump_hash >= 0 && bindump_hash != mdbm_get_hash(db)
+               && mdbm_count_records(db) == 0) {
+        // a new DB gets the hash function of the exported one
+        mdbm_sethash(db, bindump_hash);
     }
 
     int errcode = 0;
 
-    if (opt_cdbdump) {
+    if (opt_bulk && (bulk = mdbm_bulk_open(db, opt_store_flag, opt_bulk_mem, NULL)) == NULL) {
+        fprintf(stderr, "Cannot start bulk build (the DB must be empty), mdbm=%s, errno=%s\n",
+                mdbmFile, strerror(errno));
+        mdbm_close(db);
+        fclose(fp);
+        return(1);
+    }
+
+    if (opt_bindump && bulk) {
+        if (mdbm_bindump_read(fp, inputFile, 1, bulk_add_record, bulk) != 0) {
+            errcode = 1;
+        }
+    } else if (opt_bindump) {
+        if (mdbm_bindump_import(db, fp, inputFile, opt_store_flag, opt_threads) != 0) {
+            errcode = 1;
+        }
+    } else if (opt_cdbdump) {
         if (do_cdbmake(db, fp, opt_store_flag) != 0) {
             errcode = 1;
         }
@@ -598,6 +625,16 @@ main(int argc, char** argv)
         }
     }
 
+    if (bulk) {
+        if (errcode) {
+            mdbm_bulk_abort(bulk);
+        } else if (mdbm_bulk_finish(bulk) != 0) {
+            fprintf(stderr, "Bulk build failed, mdbm=%s, errno=%s\n", mdbmFile, strerror(errno));
+            errcode = 1;
+        }
+        bulk = NULL;
+    }
+
     mdbm_sync(db);
     mdbm_close(db);
     fclose(fp);
@@ -35,7 +35,7 @@ main (int argc, char** argv)
     int opt;
     int oflags = 0;
 
-    while ((opt = getopt(argc,argv,"h")) != -1) {
+    while ((opt = getopt(argc,argv,"hL")) != -1) {
         switch (opt) {
         case 'h':
             usage(0);